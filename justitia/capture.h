@@ -0,0 +1,187 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+//// Opt-in capture of what an application posts, for replay (rdma_pacer/replay.h, pacersim -r).
+//// With CAPTURE_ENV set to a path prefix, every WR posted to a send queue is recorded: the tsc of
+//// its post call, the qp, the opcode, the bytes and the class the qp is paced as. Each thread that
+//// posts records into a ring of its own, no lock, no syscall; the ring is written to
+//// <prefix>.<pid>.<tid> whenever it fills, when the thread exits and when the process does.
+//// Posts racing the exit of the process may be lost. Off, a post costs the test of a global.
+//// Included by the qp.c of each driver, and by rdma_pacer to read the files; kept free of verbs.
+//// Shared by libmlx4 and libmlx5.
+
+#define CAPTURE_ENV			"JUSTITIA_CAPTURE"
+#define CAPTURE_MAGIC			0x5041434aU	/* "JCAP" */
+#define CAPTURE_VERSION			1
+#define CAPTURE_RING_RECS		8192		/* per thread: 192KB between two writes */
+
+//// the file starts with it; records follow until the end
+struct capture_header {
+	uint32_t	magic;
+	uint32_t	version;
+	double		cpu_mhz;	/* tsc cycles per us */
+	uint64_t	tsc0;		/* tsc the thread started capturing at */
+	int32_t		pid, tid;
+};
+
+struct capture_rec {
+	uint64_t	tsc;		/* of the post call: the WRs of a chain share it */
+	uint32_t	qpn;
+	uint32_t	bytes;		/* of the scatter/gather list */
+	uint32_t	send_flags;
+	uint8_t		opcode;		/* enum ibv_wr_opcode */
+	int8_t		cls;		/* FLOW_CLASS_* it is paced as, -1 unpaced */
+	uint16_t	num_sge;
+};
+
+struct capture_ring {
+	struct capture_ring	*next;		/* in capture_rings */
+	int			fd;
+	uint32_t		n;
+	struct capture_rec	rec[CAPTURE_RING_RECS];
+};
+
+static int capture_state = -1;			//// -1 until a post looked at CAPTURE_ENV, then 1 if on
+static const char *capture_prefix;
+static double capture_mhz;			//// set by the driver once capture is on
+static pthread_key_t capture_key;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct capture_ring *capture_rings;	//// of the threads that did not exit, for the exit
+static __thread struct capture_ring *capture_self;
+static __thread int capture_failed;		//// its file could not be opened: the thread records nothing
+
+//// nonzero while capture is on or not known to be off yet
+static inline int capture_enabled(void)
+{
+	return __atomic_load_n(&capture_state, __ATOMIC_RELAXED);
+}
+
+//// writes out what the ring holds; called under capture_lock
+static inline void capture_flush(struct capture_ring *r)
+{
+	const char *p = (const char *)r->rec;
+	size_t left = r->n * sizeof(r->rec[0]);
+	ssize_t n;
+
+	while (left && (n = write(r->fd, p, left)) > 0) {
+		p += n;
+		left -= n;
+	}
+	r->n = 0;
+}
+
+static inline void capture_exit(void)
+{
+	struct capture_ring *r;
+
+	pthread_mutex_lock(&capture_lock);
+	for (r = capture_rings; r; r = r->next)
+		capture_flush(r);
+	pthread_mutex_unlock(&capture_lock);
+}
+
+static inline void capture_thread_exit(void *arg)
+{
+	struct capture_ring *r = arg, **p;
+
+	pthread_mutex_lock(&capture_lock);
+	for (p = &capture_rings; *p && *p != r; p = &(*p)->next)
+		;
+	if (*p)
+		*p = r->next;
+	capture_flush(r);
+	pthread_mutex_unlock(&capture_lock);
+	close(r->fd);
+	free(r);
+}
+
+//// The first post of the process looks at CAPTURE_ENV; 1 if capture is on, 0 if not
+static inline int capture_setup(void)
+{
+	const char *env;
+	int on = 0;
+
+	pthread_mutex_lock(&capture_lock);
+	if (capture_state < 0) {
+		env = getenv(CAPTURE_ENV);
+		if (env && *env && !pthread_key_create(&capture_key, capture_thread_exit)) {
+			capture_prefix = env;
+			atexit(capture_exit);
+			on = 1;
+		}
+		__atomic_store_n(&capture_state, on, __ATOMIC_RELAXED);
+	}
+	on = capture_state;
+	pthread_mutex_unlock(&capture_lock);
+	return on;
+}
+
+//// the ring of a thread posting for the first time, and its file
+static inline struct capture_ring *capture_thread_start(uint64_t tsc)
+{
+	struct capture_header h;
+	struct capture_ring *r;
+	char path[PATH_MAX];
+
+	if (capture_failed || !(r = calloc(1, sizeof(*r))))
+		return NULL;
+	memset(&h, 0, sizeof(h));
+	h.magic = CAPTURE_MAGIC;
+	h.version = CAPTURE_VERSION;
+	h.cpu_mhz = capture_mhz;
+	h.tsc0 = tsc;
+	h.pid = getpid();
+	h.tid = syscall(SYS_gettid);
+	snprintf(path, sizeof(path), "%s.%d.%d", capture_prefix, h.pid, h.tid);
+	r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (r->fd < 0 || write(r->fd, &h, sizeof(h)) != sizeof(h)) {
+		fprintf(stderr, "capture: cannot write %s\n", path);
+		if (r->fd >= 0)
+			close(r->fd);
+		free(r);
+		capture_failed = 1;
+		return NULL;
+	}
+	pthread_mutex_lock(&capture_lock);
+	r->next = capture_rings;
+	capture_rings = r;
+	pthread_mutex_unlock(&capture_lock);
+	pthread_setspecific(capture_key, r);
+	return capture_self = r;
+}
+
+//// records one WR of a post call made at tsc
+static inline void capture_post(uint64_t tsc, uint32_t qpn, int opcode, uint64_t bytes, int cls,
+				int num_sge, uint32_t send_flags)
+{
+	struct capture_ring *r = capture_self;
+	struct capture_rec *c;
+
+	if (!r && !(r = capture_thread_start(tsc)))
+		return;
+	c = &r->rec[r->n];
+	c->tsc = tsc;
+	c->qpn = qpn;
+	c->bytes = bytes > UINT32_MAX ? UINT32_MAX : bytes;
+	c->send_flags = send_flags;
+	c->opcode = opcode;
+	c->cls = cls;
+	c->num_sge = num_sge;
+	if (++r->n == CAPTURE_RING_RECS) {
+		pthread_mutex_lock(&capture_lock);
+		capture_flush(r);
+		pthread_mutex_unlock(&capture_lock);
+	}
+}
+
+#endif
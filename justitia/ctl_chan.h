@@ -0,0 +1,88 @@
+#ifndef CTL_CHAN_H
+#define CTL_CHAN_H
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//// Control channel to the pacer. A process keeps one connection for all its qps instead of a
+//// connect per message: it starts with the CTL_HELLO line, then every message is a line. Only a
+//// join ("j:pid:tid:qpn[:MBps]") is answered, with a "slot[:granted]" line; app_*, exit_app_*
+//// and leaves ("l:pid:tid:qpn") are not, so they cost the sender one send.
+//// Shared by libmlx4 and libmlx5.
+
+#define CTL_HELLO		"ctl\n"
+#define CTL_LINE_LEN		64
+
+//// a stream connection to the pacer at path, or -1
+static inline int ctl_dial(const char *path)
+{
+	struct sockaddr_un remote;
+	int s;
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	memset(&remote, 0, sizeof(remote));
+	remote.sun_family = AF_UNIX;
+	strncpy(remote.sun_path, path, sizeof(remote.sun_path) - 1);
+	if (connect(s, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+//// all of len bytes, or -1; a pacer gone away fails it, it does not raise SIGPIPE
+static inline int ctl_send(int s, const char *msg, int len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(s, msg, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		msg += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//// a control channel to the pacer at path, or -1
+static inline int ctl_open(const char *path)
+{
+	int s = ctl_dial(path);
+
+	if (s >= 0 && ctl_send(s, CTL_HELLO, sizeof(CTL_HELLO) - 1)) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+//// The answer to the request just sent, without its newline; its length, or -1. Nothing but
+//// answers comes back on the channel and one request is out at a time, so the line is all there is.
+static inline int ctl_recv_line(int s, char *line, int size)
+{
+	int len = 0;
+	ssize_t n;
+
+	while (len < size - 1) {
+		n = recv(s, line + len, size - 1 - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len += n;
+		if (line[len - 1] == '\n') {
+			line[--len] = '\0';
+			return len;
+		}
+	}
+	return -1;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef FLOW_CLASS_H
+#define FLOW_CLASS_H
+
+#include <stdint.h>
+
+//// Online class of a flow created without a class hint, from what it posts. Every post call
+//// feeds its WR count, bytes and the cycles since the previous call. Every FLOW_CLASS_WINDOW WRs
+//// the window votes: big WRs are bandwidth; small ones are latency-bound when the flow leaves
+//// about an RTT between them and throughput-bound when it streams them. The flow only moves to
+//// another class after FLOW_CLASS_DWELL votes in a row for it, and sizes and gaps have separate
+//// thresholds to enter and to leave a class, so a flow near a boundary does not flap. The first
+//// vote decides at once: until then the flow is only provisionally bandwidth.
+//// Shared by libmlx4 and libmlx5.
+
+#define FLOW_CLASS_BW			0
+#define FLOW_CLASS_LAT			1
+#define FLOW_CLASS_TPUT			2
+#define FLOW_CLASS_HINT_BW		3	/* qp_context hint pinning a qp to the bandwidth class */
+
+#define FLOW_CLASS_WINDOW		64	/* WRs per vote */
+#define FLOW_CLASS_DWELL		4	/* votes in a row to change class */
+#define FLOW_CLASS_SMALL_BYTES		1024	/* mean WR size at or below which a big flow becomes small */
+#define FLOW_CLASS_BIG_BYTES		4096	/* mean WR size above which a small flow becomes big */
+#define FLOW_CLASS_LAT_GAP_NS		1000	/* mean ns between WRs at or above which a flow is latency-bound */
+#define FLOW_CLASS_TPUT_GAP_NS		400	/* mean ns between WRs below which a flow is throughput-bound */
+#define FLOW_CLASS_MAX_GAP_NS		100000	/* a longer pause counts as this much: idle is not a class */
+
+struct flow_class {
+	uint64_t	last_post;	/* cycles at the previous post call; 0 before the first */
+	uint64_t	bytes;		/* posted in the current window */
+	uint64_t	gap_ns;		/* between the post calls of the current window */
+	uint32_t	wrs;		/* posted in the current window */
+	int		cls;		/* current class */
+	int		decided;	/* a vote has been taken */
+	int		vote;		/* class of the last votes */
+	int		votes;		/* votes in a row for it */
+};
+
+static inline void flow_class_init(struct flow_class *fc, int cls)
+{
+	fc->last_post = 0;
+	fc->bytes = 0;
+	fc->gap_ns = 0;
+	fc->wrs = 0;
+	fc->cls = cls;
+	fc->decided = 0;
+	fc->vote = cls;
+	fc->votes = 0;
+}
+
+//// class a full window points at, given the class the flow is in now
+static inline int flow_class_vote(const struct flow_class *fc)
+{
+	uint64_t size = fc->bytes / fc->wrs;
+	uint64_t gap = fc->gap_ns / fc->wrs;
+	int small;
+
+	if (fc->cls == FLOW_CLASS_BW)
+		small = size <= FLOW_CLASS_SMALL_BYTES;
+	else
+		small = size <= FLOW_CLASS_BIG_BYTES;
+	if (!small)
+		return FLOW_CLASS_BW;
+
+	if (gap >= FLOW_CLASS_LAT_GAP_NS)
+		return FLOW_CLASS_LAT;
+	if (gap < FLOW_CLASS_TPUT_GAP_NS)
+		return FLOW_CLASS_TPUT;
+	//// in between: a small flow stays what it is; a big one that just became small goes by the nearer side
+	if (fc->cls != FLOW_CLASS_BW)
+		return fc->cls;
+	return gap >= (FLOW_CLASS_LAT_GAP_NS + FLOW_CLASS_TPUT_GAP_NS) / 2 ? FLOW_CLASS_LAT : FLOW_CLASS_TPUT;
+}
+
+//// one post call of wrs WRs and bytes bytes at cycles now; ns = cycles * ns_mult >> 16.
+//// Returns the class the flow is in after it.
+static inline int flow_class_post(struct flow_class *fc, uint64_t now, uint32_t wrs, uint64_t bytes,
+				  uint32_t ns_mult)
+{
+	uint64_t gap;
+	int vote;
+
+	if (fc->last_post) {
+		gap = now - fc->last_post;
+		//// past 2^40 cycles (minutes) the product could overflow; it is idle anyway
+		if (now < fc->last_post || gap >> 40)
+			gap = FLOW_CLASS_MAX_GAP_NS;
+		else
+			gap = (gap * ns_mult) >> 16;
+		fc->gap_ns += gap < FLOW_CLASS_MAX_GAP_NS ? gap : FLOW_CLASS_MAX_GAP_NS;
+	}
+	fc->last_post = now;
+	fc->bytes += bytes;
+	fc->wrs += wrs;
+	if (fc->wrs < FLOW_CLASS_WINDOW)
+		return fc->cls;
+
+	vote = flow_class_vote(fc);
+	fc->bytes = 0;
+	fc->gap_ns = 0;
+	fc->wrs = 0;
+
+	if (!fc->decided) {
+		fc->decided = 1;
+		fc->cls = vote;
+		fc->vote = vote;
+		fc->votes = 0;
+		return fc->cls;
+	}
+	if (vote == fc->cls) {
+		fc->votes = 0;
+		return fc->cls;
+	}
+	if (vote != fc->vote) {
+		fc->vote = vote;
+		fc->votes = 0;
+	}
+	if (++fc->votes >= FLOW_CLASS_DWELL) {
+		fc->cls = vote;
+		fc->votes = 0;
+	}
+	return fc->cls;
+}
+
+#endif
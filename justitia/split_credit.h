@@ -0,0 +1,42 @@
+#ifndef SPLIT_CREDIT_H
+#define SPLIT_CREDIT_H
+
+#include <stdint.h>
+
+//// Credit flow of the two-sided split chunks. The receiver preposts slots receive slots on
+//// split_qp[0] and grants the sender one credit per slot; a chunk in flight holds one. The
+//// receiver hands credits back over split_qp2 as it posts consumed slots again, batch of them
+//// at a time (and whatever it still owes once a message is complete), so a message of any
+//// number of chunks streams through the slots. The sender never waits for more than one
+//// credit: with batch <= slots, a sender holding none has at least batch slots owed to it
+//// (or in flight), so the credits it waits for are on their way.
+//// Shared by libmlx4 and libmlx5; kept free of verbs.
+
+//// Sender: take up to want of the credits, none if there are none. Only the sender takes
+//// credits while the credit returns of the peer add to them from any thread.
+static inline uint32_t split_credit_take(int *credits, uint32_t want)
+{
+	int have = __atomic_load_n(credits, __ATOMIC_RELAXED);
+	uint32_t take;
+
+	if (have <= 0)
+		return 0;
+	take = (uint32_t)have < want ? (uint32_t)have : want;
+	__atomic_sub_fetch(credits, take, __ATOMIC_RELAXED);
+	return take;
+}
+
+//// Receiver: a consumed slot was posted again; returns the credits to hand back now, 0 to
+//// keep owing them. last is set for the final chunk of a message.
+static inline uint32_t split_credit_reposted(uint32_t *owed, uint32_t batch, int last)
+{
+	uint32_t n;
+
+	if (++*owed < batch && !last)
+		return 0;
+	n = *owed;
+	*owed = 0;
+	return n;
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef SPLIT_EXCHANGE_H
+#define SPLIT_EXCHANGE_H
+
+#include <stdint.h>
+
+//// The EXCHANGE that connects the split qps of a user's RC qp to those of its peer. It is the
+//// first message each end sends on the user's qp: the qp goes to RTS with sq_psn - 1, and the
+//// EXCHANGE goes out ahead of the application's first post or in answer to the peer's, so the
+//// application's messages start at the psns it gave. An end that takes EXCHANGEs goes to RTR
+//// with rq_psn - 1 and posts a RR for it ahead of the application's; one that does not (its
+//// qp is on an SRQ) keeps rq_psn and drops the peer's as a duplicate. Nothing is reset once
+//// the application's psns are reached, so nothing has to wait for the peer to get there.
+//// The EXCHANGE carries its sender's psns, and a split qp pair is only used once the peer
+//// has granted credits over it, so the two ends cannot disagree on whether they split.
+//// A pair that is up may carry the chunks of several user's qps between the same two ends,
+//// so each end offers those it has and both pick the same one (split_exchange_choose).
+//// The psns are only shifted with SPLIT_EXCHANGE_ENV set to 1, at both ends: a peer on a stock
+//// driver would take the EXCHANGE for the application's first message.
+//// Shared by libmlx4 and libmlx5, which talk to each other; kept free of verbs.
+
+#define SPLIT_PSN_MASK		0xffffffu
+#define SPLIT_EXCHANGE_SEAL	0x53504c54u	/* "SPLT" */
+#define SPLIT_EXCHANGE_ENV	"JUSTITIA_SPLIT_EXCHANGE"	/* "1": RC qps split, with a peer that set it too */
+
+//// Split qps of the sender that are up with the peer already, offered for the user's qp instead
+//// of the fresh ones in qp_num/qp2_num
+#define SPLIT_EXCHANGE_LINKS	4
+
+struct split_exchange_link {
+	uint32_t qp_num;	// the sender's split_qp[0]
+	uint32_t qp2_num;	// and split_qp2
+	uint32_t peer_qp_num;	// the split_qp[0] of the receiver it is connected to
+	uint32_t peer_qp2_num;	// and its split_qp2
+};
+
+struct split_exchange {
+	uint32_t qp_num;	// fresh split_qp[0]; 0 if the sender takes no EXCHANGEs and never splits
+	uint32_t sq_psn;	// of both fresh split qps
+	uint32_t qp2_num;	// fresh split_qp2
+	uint32_t recv_slots;	// two-sided chunks the sender may have in flight (0: no reassembly)
+	uint32_t slot_size;	// largest two-sided chunk
+	uint32_t split_min;	// shortest piece of a split message on the user's qp
+	uint32_t user_psn;	// psn of the sender's first message on the user's qp after this one
+	uint32_t links;		// entries of link[] in use
+	struct split_exchange_link link[SPLIT_EXCHANGE_LINKS];
+	uint32_t seal;		// SPLIT_EXCHANGE_SEAL: the last word, so the HCA writes it last
+};
+
+//// psn the user's qp sends (receives) the EXCHANGE with, one ahead of the application's
+static inline uint32_t split_psn_prev(uint32_t psn)
+{
+	return (psn - 1) & SPLIT_PSN_MASK;
+}
+
+//// Whether the EXCHANGE has landed in x, a RR buffer zeroed before it was posted. Nothing
+//// of the cq is looked at, so the application's completions are left where they are.
+static inline int split_exchange_arrived(const struct split_exchange *x)
+{
+	return __atomic_load_n(&x->seal, __ATOMIC_ACQUIRE) == SPLIT_EXCHANGE_SEAL;
+}
+
+//// Whether the links a and b, offered by the two ends, are connected to each other
+static inline int split_exchange_mates(const struct split_exchange_link *a, const struct split_exchange_link *b)
+{
+	return a->peer_qp_num && a->peer_qp_num == b->qp_num && a->peer_qp2_num == b->qp2_num &&
+	       b->peer_qp_num == a->qp_num && b->peer_qp2_num == a->qp2_num;
+}
+
+//// Which of the links offered in ours both ends split the user's qp over, or -1 if neither
+//// end has one connected to one of the other's and the fresh split qps are connected. Of the
+//// pairs offered by both ends, the one with the lowest qp numbers is taken, those of the end
+//// with the lower fresh split_qp[0] first, so it is the same pair seen from either end; a tie
+//// takes none. Both ends hold both EXCHANGEs, so they come to the same answer.
+static inline int split_exchange_choose(const struct split_exchange *ours, const struct split_exchange *theirs)
+{
+	uint32_t n = ours->links < SPLIT_EXCHANGE_LINKS ? ours->links : SPLIT_EXCHANGE_LINKS;
+	uint32_t m = theirs->links < SPLIT_EXCHANGE_LINKS ? theirs->links : SPLIT_EXCHANGE_LINKS;
+	uint64_t key, best_key = 0;
+	int best = -1, tie = 0;
+	uint32_t i, j, a, b;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < m; j++) {
+			if (!split_exchange_mates(&ours->link[i], &theirs->link[j]))
+				continue;
+			a = ours->link[i].qp_num;
+			b = theirs->link[j].qp_num;
+			if (ours->qp_num > theirs->qp_num || (ours->qp_num == theirs->qp_num && a > b))
+				key = (uint64_t)b << 32 | a;
+			else
+				key = (uint64_t)a << 32 | b;
+			if (best < 0 || key < best_key) {
+				best = i;
+				best_key = key;
+				tie = 0;
+			} else if (key == best_key) {
+				tie = 1;
+			}
+		}
+	}
+	return tie ? -1 : best;
+}
+
+#endif /* SPLIT_EXCHANGE_H */
@@ -0,0 +1,106 @@
+#ifndef SPLIT_SGE_H
+#define SPLIT_SGE_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+//// Helpers to cut a work request's scatter/gather list into split chunks at
+//// arbitrary byte offsets. A chunk may span several user SGEs and a user SGE
+//// may be shared by several chunks. Used by libmlx4 and libmlx5.
+
+struct split_sge_cursor {
+	int		idx;	/* current entry of the user's sg_list */
+	uint32_t	off;	/* bytes of sg_list[idx] already consumed */
+};
+
+static inline uint64_t split_sge_total(const struct ibv_sge *sg_list, int num_sge)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < num_sge; i++)
+		total += sg_list[i].length;
+	return total;
+}
+
+//// Length of the piece of a two-sided split message (SEND or WRITE_WITH_IMM) that goes over
+//// the user's qp. The receiver only looks for split chunks behind a receive of at least
+//// split_min bytes, so the piece is never shorter than that unless the whole message is.
+static inline uint64_t split_user_piece_length(uint64_t total, uint32_t chunk, uint32_t split_min)
+{
+	uint64_t piece = chunk > split_min ? chunk : split_min;
+
+	return total < piece ? total : piece;
+}
+
+//// The piece on the user's qp carries an imm marking it as that of a split message: the number
+//// of completions the receiver takes from the split qp for the message, and whether the user's
+//// own imm comes with the last of them. Receives without the mark are never taken for split
+//// pieces, so an imm with the mark's top bits is reserved on qps whose peer splits.
+#define SPLIT_IMM_MARK		0xa4000000u
+#define SPLIT_IMM_MARK_MASK	0xfe000000u
+#define SPLIT_IMM_USER		0x01000000u	/* the user's imm comes with the last chunk */
+#define SPLIT_IMM_CHUNKS	0x00ffffffu
+
+static inline uint32_t split_imm_mark(uint32_t chunks, int user_imm)
+{
+	return SPLIT_IMM_MARK | (user_imm ? SPLIT_IMM_USER : 0) | (chunks & SPLIT_IMM_CHUNKS);
+}
+
+//// chunks of the split message whose piece carries imm (host order), 0 if it is not marked
+static inline uint32_t split_imm_chunks(uint32_t imm)
+{
+	return (imm & SPLIT_IMM_MARK_MASK) == SPLIT_IMM_MARK ? imm & SPLIT_IMM_CHUNKS : 0;
+}
+
+//// position the cursor at byte offset of the message described by sg_list
+static inline void split_sge_seek(struct split_sge_cursor *cur, const struct ibv_sge *sg_list,
+				  int num_sge, uint64_t offset)
+{
+	cur->idx = 0;
+	cur->off = 0;
+	while (cur->idx < num_sge) {
+		if (offset < sg_list[cur->idx].length) {
+			cur->off = offset;
+			return;
+		}
+		offset -= sg_list[cur->idx].length;
+		cur->idx++;
+	}
+}
+
+//// Emit the SGEs covering the next length bytes and advance the cursor.
+//// Returns the number of SGEs written to out, or -1 if the list is shorter
+//// than length or more than max_out SGEs would be needed.
+static inline int split_sge_fill(struct split_sge_cursor *cur, const struct ibv_sge *sg_list,
+				 int num_sge, uint64_t length, struct ibv_sge *out, int max_out)
+{
+	int n = 0;
+
+	while (length) {
+		uint32_t avail, take;
+
+		if (cur->idx >= num_sge || n >= max_out)
+			return -1;
+		avail = sg_list[cur->idx].length - cur->off;
+		if (!avail) {
+			cur->idx++;
+			cur->off = 0;
+			continue;
+		}
+		take = length < avail ? length : avail;
+		out[n].addr = sg_list[cur->idx].addr + cur->off;
+		out[n].length = take;
+		out[n].lkey = sg_list[cur->idx].lkey;
+		n++;
+		cur->off += take;
+		length -= take;
+		if (cur->off == sg_list[cur->idx].length) {
+			cur->idx++;
+			cur->off = 0;
+		}
+	}
+	return n;
+}
+
+#endif /* SPLIT_SGE_H */
@@ -0,0 +1,81 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+#include <time.h>
+
+//// Fail-open watchdog of the pacer. The pacer bumps a heartbeat in the shared block every
+//// HEARTBEAT_US and publishes a new epoch every time it starts. A thread waiting for a token looks
+//// at the heartbeat every WATCHDOG_SPINS spins; once it stood still for WATCHDOG_STALE_NS of the
+//// thread's own time the pacer is found dead, and no one waits for its tokens any more: sends go
+//// unpaced until it beats again, or until a new pacer publishes another epoch, which every qp
+//// then joins again.
+//// Shared by libmlx4 and libmlx5.
+
+#define WATCHDOG_SPINS			1024		/* spins between looks at the heartbeat */
+#define WATCHDOG_STALE_NS		50000000	/* a heartbeat standing still this long: the pacer is dead */
+
+struct watchdog {
+	uint64_t	beat;		/* heartbeat last seen */
+	uint64_t	since_ns;	/* when it was first seen standing still; 0 while it moves */
+	uint32_t	spins;
+};
+
+//// the pacer found dead: that of epoch, which beat last at beat
+struct watchdog_dead {
+	uint32_t	epoch;
+	uint64_t	beat;
+};
+
+static inline uint64_t watchdog_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//// a wait for the pacer starts
+static inline void watchdog_start(struct watchdog *w, const uint64_t *heartbeat)
+{
+	w->beat = __atomic_load_n(heartbeat, __ATOMIC_RELAXED);
+	w->since_ns = 0;
+	w->spins = 0;
+}
+
+//// called on every spin of the wait; 1 once the heartbeat stood still for WATCHDOG_STALE_NS
+static inline int watchdog_stale(struct watchdog *w, const uint64_t *heartbeat)
+{
+	uint64_t beat, now;
+
+	if (++w->spins % WATCHDOG_SPINS)
+		return 0;
+	beat = __atomic_load_n(heartbeat, __ATOMIC_RELAXED);
+	if (beat != w->beat) {
+		w->beat = beat;
+		w->since_ns = 0;
+		return 0;
+	}
+	now = watchdog_now_ns();
+	if (!w->since_ns) {
+		w->since_ns = now;
+		return 0;
+	}
+	return now - w->since_ns >= WATCHDOG_STALE_NS;
+}
+
+//// records the pacer of epoch as dead, with the heartbeat w last saw
+static inline void watchdog_bury(struct watchdog_dead *d, const struct watchdog *w, uint32_t epoch)
+{
+	__atomic_store_n(&d->beat, w->beat, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->epoch, epoch, __ATOMIC_RELAXED);
+}
+
+//// whether the pacer publishing epoch and heartbeat is the one found dead, not beating since
+static inline int watchdog_dead(const struct watchdog_dead *d, uint32_t epoch, uint64_t heartbeat)
+{
+	return __atomic_load_n(&d->epoch, __ATOMIC_RELAXED) == epoch &&
+	       __atomic_load_n(&d->beat, __ATOMIC_RELAXED) == heartbeat;
+}
+
+#endif
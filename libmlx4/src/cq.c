@@ -41,6 +41,7 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <errno.h>
 
 #include <infiniband/opcode.h>
 
@@ -62,6 +63,8 @@ static inline cycles_t get_cycles()
 ////
 /* isolation */
 #include "pacer.h"
+#include "split_sge.h"
+#include "split_credit.h"
 #include "math.h"
 /* end */
 
@@ -74,11 +77,7 @@ enum {
 enum {
 	CQ_OK					=  0,
 	CQ_EMPTY				= -1,
-	CQ_POLL_ERR				= -2,
-	////
-	CQ_SPLIT				= 1,
-	CQ_SPLIT_WIMM			= 2
-	////
+	CQ_POLL_ERR				= -2
 };
 
 #define MLX4_CQ_DB_REQ_NOT_SOL			(1 << 24)
@@ -241,12 +240,18 @@ static void mlx4_handle_error_cqe(struct mlx4_err_cqe *cqe, struct ibv_wc *wc)
 		wc->status = IBV_WC_GENERAL_ERR;
 		break;
 	}
-	printf("FIND cqe syndrome: cqe->syndrome = %d\n", cqe->syndrome);
-	printf("FIND ERROR STATUS: wc->status = %d\n", wc->status);
-
 	wc->vendor_err = cqe->vendor_err;
 }
 
+//// Whether a completion of the user's qp is that of the split qp EXCHANGE (split_exchange.h),
+//// the first on its side of the qp, which the application never sees
+static inline int split_exchange_cqe(struct mlx4_qp *qp, int is_send)
+{
+	uint8_t bit = is_send ? SPLIT_EXCHANGE_SEND_CQE : SPLIT_EXCHANGE_RECV_CQE;
+
+	return !!(__atomic_fetch_and(&qp->split_exchange_cqes, (uint8_t)~bit, __ATOMIC_RELAXED) & bit);
+}
+
 static int __mlx4_poll_one(struct mlx4_cq *cq,
 			 struct mlx4_qp **cur_qp,
 			 struct ibv_exp_wc *wc,
@@ -270,12 +275,11 @@ static int __mlx4_poll_one(struct mlx4_cq *cq,
 			      IBV_EXP_CQ_TIMESTAMP);
 	uint64_t exp_wc_flags = 0;
 	uint64_t wc_flags = 0;
+repoll:
 	cqe = next_cqe_sw(cq);
-	//printf("DEBUG __mlx4_poll_one: ckpt0\n");
 	if (!cqe)
 		return CQ_EMPTY;
 
-	//printf("DEBUG __mlx4_poll_one: ckpt1\n");
 	if (cq->cqe_size == 64)
 		++cqe;
 
@@ -297,9 +301,6 @@ static int __mlx4_poll_one(struct mlx4_cq *cq,
 	/* include checksum as work around for calc opcode */
 	is_error = (cqe->owner_sr_opcode & MLX4_CQE_OPCODE_MASK) ==
 		MLX4_CQE_OPCODE_ERROR && (cqe->checksum & 0xff);
-	////
-	//printf("222 is_error = %d; cqe->owner_sr_opcode = %d\n", is_error, cqe->owner_sr_opcode);
-	////
 
 	if ((qpn & MLX4_XRC_QPN_BIT) && !is_send) {
 		/*
@@ -335,6 +336,11 @@ static int __mlx4_poll_one(struct mlx4_cq *cq,
 		wqe_index = ntohs(cqe->wqe_index);
 		wq->tail += (uint16_t) (wqe_index - (uint16_t) wq->tail);
 		wc->wr_id = wq->wrid[wq->tail & (wq->wqe_cnt - 1)];
+		/* isolation */
+		if ((*cur_qp)->pace.lat && !is_error)
+			lat_hist_record((*cur_qp)->pace.lat,
+					get_cycles() - (*cur_qp)->pace.post_cycles[wq->tail & (wq->wqe_cnt - 1)]);
+		/* end */
 		++wq->tail;
 	} else if (srq) {
 		wqe_index = htons(cqe->wqe_index);
@@ -351,8 +357,13 @@ static int __mlx4_poll_one(struct mlx4_cq *cq,
 		++wq->tail;
 	}
 
+	if (unlikely(*cur_qp && (*cur_qp)->split_exchange_cqes) &&
+	    split_exchange_cqe(*cur_qp, is_send)) {
+		exp_wc_flags = 0;
+		goto repoll;
+	}
+
 	if (unlikely(is_error)) {
-		//printf("IS ERROR2222??????????????\n");
 		mlx4_handle_error_cqe((struct mlx4_err_cqe *)cqe,
 				      (struct ibv_wc *)wc);
 		return CQ_OK;
@@ -527,488 +538,374 @@ static int __mlx4_poll_one(struct mlx4_cq *cq,
 		wc->exp_wc_flags = exp_wc_flags | (uint64_t)wc_flags;
 
 	((struct ibv_wc *)wc)->wc_flags = wc_flags;
-
 	return CQ_OK;
 }
 
 
-static int mlx4_poll_one(struct mlx4_cq *cq,
-			 struct mlx4_qp **cur_qp,
-			 struct ibv_exp_wc *wc,
-			 uint32_t wc_size, int is_exp, struct mlx4_wqe_data_seg **scat)
+static void mlx4_stall_poll_cq()
 {
-	//printf("DEBUG mlx4_poll_one: enter\n");
-	////
-	int split_flag = 0;
-	int wimm_flag = 0;
-	////
-	struct mlx4_wq *wq;
-	struct mlx4_cqe *cqe;
-	struct mlx4_srq *srq;
-	uint32_t qpn;
-	uint32_t g_mlpath_rqpn;
-	uint16_t wqe_index;
-	int is_error;
-	int is_send;
-	int size;
-	int left;
-	int list_len;
 	int i;
-	struct mlx4_inlr_rbuff *rbuffs;
-	uint8_t *sbuff;
-	int timestamp_en = !!(cq->creation_flags &
-			      IBV_EXP_CQ_TIMESTAMP);
-	uint64_t exp_wc_flags = 0;
-	uint64_t wc_flags = 0;
-	cqe = next_cqe_sw(cq);
-	////
-	/*
-	if (cq->num_chunks_to_recv == 0) {
-		free(cq->current_cqe);
-		cq->current_cqe = NULL;
-		cqe = next_cqe_sw(cq);
-	} else {
-		cqe = cq->current_cqe;
-	}
-	*/
-	////
-	//printf("DEBUG mlx4_poll_one: ckpt0\n");
-	if (!cqe)
-		return CQ_EMPTY;
 
-	//printf("DEBUG mlx4_poll_one: ckpt1\n");
-	if (cq->cqe_size == 64)
-		++cqe;
-
-	++cq->cons_index;
+	for (i = 0; i < mlx4_stall_num_loop; i++)
+		(void)get_cycles();
+}
 
-	VALGRIND_MAKE_MEM_DEFINED(cqe, sizeof *cqe);
+//// Copy len bytes to byte offset of the message described by the data segments of a RR
+static int split_copy_to_rr(const struct mlx4_wqe_data_seg *segs, int num_segs, uint64_t offset,
+			    const char *src, uint32_t len)
+{
+	int i;
 
-	/*
-	 * Make sure we read CQ entry contents after we've checked the
-	 * ownership bit.
-	 */
-	rmb();
+	for (i = 0; i < num_segs && len; i++) {
+		uint32_t seg_len = ntohl(segs[i].byte_count);
+		uint32_t take;
 
-	qpn = ntohl(cqe->vlan_my_qpn) & MLX4_CQE_QPN_MASK;
-	////
-	/*
-	if (cq->num_chunks_to_recv > 0) {
-		qpn = cq->current_qpn;
+		if (segs[i].lkey == htonl(MLX4_INVALID_LKEY))
+			break;
+		if (offset >= seg_len) {
+			offset -= seg_len;
+			continue;
+		}
+		take = min(len, seg_len - offset);
+		memcpy((void *)(uintptr_t)(ntohll(segs[i].addr) + offset), src, take);
+		src += take;
+		len -= take;
+		offset = 0;
 	}
-	*/
-	////
-	wc->qp_num = qpn;
+	return len ? -1 : 0;
+}
 
-	is_send  = cqe->owner_sr_opcode & MLX4_CQE_IS_SEND_MASK;
-	//printf("DEBUG mlx4_poll_one: ckpt2; qpn:%u; is_send:%d\n", qpn, is_send);
+//// Whether wc, a completion of the user's qp, is the piece of a split message: a receive the
+//// peer marked in its imm (split_sge.h) on a qp whose peer streams chunks into our slots
+static inline int split_recv_first_piece(struct mlx4_qp *qp, struct ibv_exp_wc *wc)
+{
+	return qp->split_recv.buf && qp->split_qp_exchange_done >= 1 &&
+	       !qp->verbs_qp.qp.srq && wc->status == IBV_WC_SUCCESS &&
+	       (wc->exp_opcode == IBV_EXP_WC_RECV ||
+		wc->exp_opcode == IBV_EXP_WC_RECV_RDMA_WITH_IMM) &&
+	       (((struct ibv_wc *)wc)->wc_flags & IBV_WC_WITH_IMM) &&
+	       split_imm_chunks(ntohl(wc->imm_data));
+}
 
-	/* include checksum as work around for calc opcode */
-	//// Temporarily remove error checking for custmo opcode
-	//is_error = 0;
-	//printf("DEBUG POLL_CQ: setting is_error\n");
-	////
-	is_error = (cqe->owner_sr_opcode & MLX4_CQE_OPCODE_MASK) ==
-		MLX4_CQE_OPCODE_ERROR && (cqe->checksum & 0xff);
+//// the part of a completion of wc_size the split path keeps
+static inline uint32_t split_wc_size(uint32_t wc_size)
+{
+	return min(wc_size, sizeof(struct ibv_exp_wc));
+}
 
-	if ((qpn & MLX4_XRC_QPN_BIT) && !is_send) {
-		/*
-		 * We do not have to take the XSRQ table lock here,
-		 * because CQs will be locked while SRQs are removed
-		 * from the table.
-		 */
-		//printf("Really?\n");
-		*cur_qp = NULL;
-		srq = mlx4_find_xsrq(&to_mctx(cq->ibv_cq.context)->xsrq_table,
-				     ntohl(cqe->g_mlpath_rqpn) & MLX4_CQE_QPN_MASK);
-		if (!srq)
-			return CQ_POLL_ERR;
-	} else {
-		if (unlikely(!*cur_qp || (qpn != (*cur_qp)->verbs_qp.qp.qp_num))) {
-			/*
-			 * We do not have to take the QP table lock here,
-			 * because CQs will be locked while QPs are removed
-			 * from the table.
-			 */
-			*cur_qp = mlx4_find_qp(to_mctx(cq->ibv_cq.context), qpn);
-			if (unlikely(!*cur_qp)) {
-				//printf("why here?\n");
-				return CQ_POLL_ERR;
-			}
-		}
-		if (is_exp) {
-			wc->qp = &((*cur_qp)->verbs_qp.qp);
-			exp_wc_flags |= IBV_EXP_WC_QP;
-		}
-		srq = ((*cur_qp)->verbs_qp.qp.srq) ? to_msrq((*cur_qp)->verbs_qp.qp.srq) : NULL;
+//// Make room for one more entry of size in a ring of *cap entries, num of them used from *head
+//// on; a full ring doubles and starts at 0 again. Returns 0 or -1.
+static int split_ring_reserve(void **ring, uint32_t *head, uint32_t num, uint32_t *cap, size_t size)
+{
+	uint32_t ncap = *cap ? *cap * 2 : 8;
+	uint32_t first = *cap - *head;
+	char *grown;
+
+	if (num < *cap)
+		return 0;
+	grown = malloc((size_t)ncap * size);
+	if (!grown)
+		return -1;
+	if (num) {
+		memcpy(grown, (char *)*ring + (size_t)*head * size, (size_t)first * size);
+		memcpy(grown + (size_t)first * size, *ring, (size_t)(num - first) * size);
 	}
+	free(*ring);
+	*ring = grown;
+	*head = 0;
+	*cap = ncap;
+	return 0;
+}
 
-	//printf("DEBUG mlx4_poll_one: ckpt3; is error=%d\n", is_error);
-	//printf("DEBUG mlx4_poll_one: ckpt3; cqe->owner_sr_opcode = %#08x\n", cqe->owner_sr_opcode);
-	if (is_send) {
-		wq = &(*cur_qp)->sq;
-		wqe_index = ntohs(cqe->wqe_index);
-		wq->tail += (uint16_t) (wqe_index - (uint16_t) wq->tail);
-		wc->wr_id = wq->wrid[wq->tail & (wq->wqe_cnt - 1)];
-		++wq->tail;
-	} else if (srq) {
-		wqe_index = htons(cqe->wqe_index);
-		wc->wr_id = srq->wrid[wqe_index];
-		mlx4_free_srq_wqe(srq, wqe_index);
-		if (is_exp) {
-			wc->srq = &(srq->verbs_srq.srq);
-			exp_wc_flags |= IBV_EXP_WC_SRQ;
-		}
-	} else {
-		wq = &(*cur_qp)->rq;
-		wqe_index = wq->tail & (wq->wqe_cnt - 1);
-		wc->wr_id = wq->wrid[wqe_index];
-		++wq->tail;
-	}
+//// queue a completion for the user behind those already ready
+static int split_out_push(struct mlx4_cq *cq, const struct ibv_exp_wc *wc)
+{
+	if (split_ring_reserve((void **)&cq->split_out, &cq->split_out_head, cq->split_out_num,
+			       &cq->split_out_cap, sizeof(*wc)))
+		return -1;
+	cq->split_out[(cq->split_out_head + cq->split_out_num++) % cq->split_out_cap] = *wc;
+	return 0;
+}
 
-	if (unlikely(is_error)) {
-		//printf("IS ERROR??????????????\n");
-		mlx4_handle_error_cqe((struct mlx4_err_cqe *)cqe,
-				      (struct ibv_wc *)wc);
-		return CQ_OK;
+#if SPLIT_RECV_CREDIT_BATCH < 1 || SPLIT_RECV_CREDIT_BATCH > SPLIT_RECV_SLOTS
+#error "a sender without credits waits for a credit return of SPLIT_RECV_CREDIT_BATCH slots"
+#endif
+
+//// Take one chunk of qp's split message: copy it into the user's RR behind what has arrived so
+//// far, post its slot again and hand credits back every SPLIT_RECV_CREDIT_BATCH slots and with
+//// the last chunk (split_credit.h). A split WRITE_WITH_IMM has its data in place already: its
+//// first chunk is the WIMM in front of the user's piece, whose imm is the number of bytes it
+//// covers. The user's imm, if any, comes with the last chunk.
+//// Returns 1 when the message is complete (pool->wc is its completion), 0 when chunks are
+//// still missing, -1 on error.
+static int split_recv_chunk(struct mlx4_qp *qp, uint32_t slot, uint32_t byte_len, uint32_t imm_data)
+{
+	struct split_recv_pool *pool = &qp->split_recv;
+	uint32_t credits;
+
+	if (pool->num_rr_segs) {
+		if (byte_len &&
+		    split_copy_to_rr(pool->rr_segs, pool->num_rr_segs, pool->offset,
+				     (char *)pool->buf + (uint64_t)slot * pool->slot_size, byte_len))
+			pool->overflow = 1;
+		pool->offset += byte_len;
+	} else if (!pool->done) {
+		pool->offset += ntohl(imm_data);
 	}
+	if (pool->left == 1 && pool->user_imm)
+		pool->wc.imm_data = imm_data;
+	if (mlx4_post_split_recv_slot(qp, slot))
+		return -1;
+	++pool->done;
+	credits = split_credit_reposted(&pool->owed, SPLIT_RECV_CREDIT_BATCH, pool->left == 1);
+	if (credits &&
+	    (mlx4_post_split_credit(qp->split_qp2, credits) ||
+	     mlx4_split_reap_credits(qp->split_pool) < 0))
+		return -1;
+	if (--pool->left)
+		return 0;
 
-	wc->status = IBV_WC_SUCCESS;
+#ifdef JUSTITIA_DEBUG
+	printf("RECEIVER: split message of %" PRIu64 " bytes in %u chunks\n", pool->offset, pool->done);
+	fflush(stdout);
+#endif
+	pool->wc.byte_len = pool->offset;
+	if (pool->overflow)
+		pool->wc.status = IBV_WC_LOC_LEN_ERR;
+	return 1;
+}
 
-	if (timestamp_en && offsetof(struct ibv_exp_wc, timestamp) < wc_size)  {
-		/* currently, only CQ_CREATE_WITH_TIMESTAMPING_RAW is
-		 * supported. CQ_CREATE_WITH_TIMESTAMPING_SYS isn't
-		 * supported */
-		if (cq->creation_flags &
-		    IBV_EXP_CQ_TIMESTAMP_TO_SYS_TIME)
-			wc->timestamp = 0;
-		else {
-			wc->timestamp =
-				(uint64_t)(ntohl(cqe->timestamp_16_47) +
-					   !cqe->timestamp_0_15) << 16
-				| (uint64_t)ntohs(cqe->timestamp_0_15);
-			exp_wc_flags |= IBV_EXP_WC_WITH_TIMESTAMP;
-		}
+//// Start reassembling the split message whose piece on qp is wc; rr_segs are the data segments
+//// of the RR the piece consumed (NULL for a WRITE_WITH_IMM). The chunks that came in ahead of
+//// the piece are taken right away. Returns like split_recv_chunk.
+static int split_recv_begin(struct mlx4_qp *qp, const struct ibv_exp_wc *wc, uint32_t wc_size,
+			    const struct mlx4_wqe_data_seg *rr_segs)
+{
+	struct split_recv_pool *pool = &qp->split_recv;
+	uint32_t imm = ntohl(wc->imm_data);
+	int ret;
+
+	pool->num_rr_segs = rr_segs ? qp->rq.max_gs : 0;
+	if (rr_segs)
+		memcpy(pool->rr_segs, rr_segs, pool->num_rr_segs * sizeof(*pool->rr_segs));
+	memset(&pool->wc, 0, sizeof(pool->wc));
+	memcpy(&pool->wc, wc, split_wc_size(wc_size));
+	//// the imm of the piece was ours
+	pool->user_imm = !!(imm & SPLIT_IMM_USER);
+	if (!pool->user_imm) {
+		((struct ibv_wc *)&pool->wc)->wc_flags &= ~IBV_WC_WITH_IMM;
+		if (wc_size >= sizeof(struct ibv_exp_wc))
+			pool->wc.exp_wc_flags &= ~IBV_EXP_WC_WITH_IMM;
+		pool->wc.imm_data = 0;
+	}
+	pool->offset = wc->byte_len;
+	pool->left = split_imm_chunks(imm);
+	pool->done = 0;
+	pool->overflow = 0;
+
+	while (pool->num_early) {
+		struct split_chunk *c = &pool->early[pool->early_head];
+
+		pool->early_head = (pool->early_head + 1) % SPLIT_RECV_SLOTS;
+		pool->num_early--;
+		ret = split_recv_chunk(qp, c->slot, c->byte_len, c->imm_data);
+		if (ret)
+			return ret;
 	}
+	if (pool->dropped) {
+		uint32_t n = min(pool->dropped, pool->left);
+
+		pool->dropped -= n;
+		pool->left -= n;
+		pool->done += n;
+		pool->wc.status = IBV_WC_REM_INV_REQ_ERR;
+		if (pool->left)
+			return 0;
+		if (pool->owed &&
+		    (mlx4_post_split_credit(qp->split_qp2, pool->owed) ||
+		     mlx4_split_reap_credits(qp->split_pool) < 0))
+			return -1;
+		pool->owed = 0;
+		pool->wc.byte_len = pool->offset;
+		return 1;
+	}
+	return 0;
+}
 
-	if (is_send) {
-		//printf("DEBUG POLL CQ: entering is_send logic if check\n");
-		//printf("DEBUG POLL CQ: , and cqe->owner_sr_opcode = %u\n", cqe->owner_sr_opcode);
-		//printf("DEBUG POLL CQ: , and cqe->owner_sr_opcode & make = %u\n", cqe->owner_sr_opcode & MLX4_CQE_OPCODE_MASK);
-		switch (cqe->owner_sr_opcode & MLX4_CQE_OPCODE_MASK) {
-		case MLX4_OPCODE_CALC_RDMA_WRITE_IMM:
-		case MLX4_OPCODE_RDMA_WRITE_IMM:
-			wc_flags |= IBV_WC_WITH_IMM;
-		////
-		//case MLX4_OPCODE_RDMA_WRITE_IMM_SPLIT:
-		//	wc_flags |= IBV_WC_WITH_IMM;
-		//	printf("DEBUG POLL CQ: setting wc_flags here (SPLIT)\n");
-		////
-		case MLX4_OPCODE_RDMA_WRITE:
-			wc->exp_opcode    = IBV_EXP_WC_RDMA_WRITE;
-			break;
-		case MLX4_OPCODE_SEND_IMM:
-			wc_flags |= IBV_WC_WITH_IMM;
-		case MLX4_OPCODE_SEND:
-			wc->exp_opcode    = IBV_EXP_WC_SEND;
-			break;
-		case MLX4_OPCODE_RDMA_READ:
-			wc->exp_opcode    = IBV_EXP_WC_RDMA_READ;
-			wc->byte_len  = ntohl(cqe->byte_cnt);
-			break;
-		case MLX4_OPCODE_ATOMIC_CS:
-			wc->exp_opcode    = IBV_EXP_WC_COMP_SWAP;
-			wc->byte_len  = 8;
-			break;
-		case MLX4_OPCODE_ATOMIC_FA:
-			wc->exp_opcode    = IBV_EXP_WC_FETCH_ADD;
-			wc->byte_len  = 8;
-			break;
-		case MLX4_OPCODE_ATOMIC_MASK_CS:
-			wc->exp_opcode    = IBV_EXP_WC_MASKED_COMP_SWAP;
-			break;
-		case MLX4_OPCODE_ATOMIC_MASK_FA:
-			wc->exp_opcode    = IBV_EXP_WC_MASKED_FETCH_ADD;
-			break;
-		case MLX4_OPCODE_LOCAL_INVAL:
-			((struct ibv_wc *)wc)->opcode    = IBV_WC_LOCAL_INV;
-			break;
-		case MLX4_OPCODE_BIND_MW:
-			wc->exp_opcode    = IBV_EXP_WC_BIND_MW;
-			break;
-		case MLX4_OPCODE_SEND_INVAL:
-			((struct ibv_wc *)wc)->opcode    = IBV_WC_SEND;
-			break;
-		default:
-			/* assume it's a send completion */
-			//printf("DEBUG POLL CQ: default, setting SEND\n");
-			wc->exp_opcode    = IBV_EXP_WC_SEND;
-			break;
-		}
-	} else {
-		wc->byte_len = ntohl(cqe->byte_cnt);
-		//printf("DEBUG: mlx4_poll_one: wc->byte_len: %u\n", wc->byte_len);
-		//// Instead of checking the chunk size, always assume it is going to be split, and get the message from Split QP unless the msg is too small
-		//if (wc->byte_len > cq->split_chunk_size) {
-		if (wc->byte_len >= MIN_SPLIT_CHUNK_SIZE) {
-			//// get receive request corresponding to this wc
-			if (scat != NULL) {
-				*scat = (struct mlx4_wqe_data_seg *)mlx4_get_recv_wqe(*cur_qp, wqe_index);
-				//printf("DEBUG: get RR: scat->addr: %" PRIu64 "\n", ntohll((*scat)->addr));
-				//printf("DEBUG: get RR: scat->lkey: %" PRIu32 "\n", ntohl((*scat)->lkey));
-			}
-			split_flag = 1;
-		}
-		////
-		if ((*cur_qp) && (*cur_qp)->max_inlr_sg &&
-		    (cqe->owner_sr_opcode & MLX4_CQE_INL_SCATTER_MASK)) {
-			//printf("DEBUG: POLL CQ: inline?\n");
-			rbuffs = (*cur_qp)->inlr_buff.buff[wqe_index].sg_list;
-			list_len = (*cur_qp)->inlr_buff.buff[wqe_index].list_len;
-			sbuff = mlx4_get_recv_wqe((*cur_qp), wqe_index);
-			left = wc->byte_len;
-			for (i = 0; (i < list_len) && left; i++) {
-				size = min(rbuffs->rlen, left);
-				memcpy(rbuffs->rbuff, sbuff, size);
-				left -= size;
-				rbuffs++;
-				sbuff += size;
-			}
-			if (left) {
-				wc->status = IBV_WC_LOC_LEN_ERR;
-				return CQ_OK;
-			}
-		}
+//// qp's split message is complete: it is ready for the user, and so are the receives held back
+//// behind it, up to the piece of the next split message, which starts coming in.
+static int split_recv_finish(struct mlx4_cq *cq, struct mlx4_qp *qp, uint32_t wc_size)
+{
+	struct split_recv_pool *pool = &qp->split_recv;
+	int ret;
 
-		//printf("DEBUG POLL CQ: cqe->owner_sr_opcode & mask = %u\n", cqe->owner_sr_opcode & MLX4_CQE_OPCODE_MASK);
-		//printf("DEBUG POLL CQ: cqe->owner_sr_opcode = %u\n", cqe->owner_sr_opcode);
-		switch (cqe->owner_sr_opcode & MLX4_CQE_OPCODE_MASK) {
-		case MLX4_RECV_OPCODE_RDMA_WRITE_IMM:
-			//printf("DEBUG POLL CQ: (WIMM)IBV_WC_WITH_IMM set to wc_flags\n");
-			//if (ntohl(cqe->byte_cnt) == SPLIT_CHUNK_SIZE + sizeof(struct two_sided_header)) {}	
-			wc->exp_opcode   = IBV_EXP_WC_RECV_RDMA_WITH_IMM;
-			wc_flags = IBV_WC_WITH_IMM;
-			wc->imm_data = cqe->immed_rss_invalid;
-			//printf("DEBUG POLL CQ: ntohl(cqe->immed_rss_invalid): %d\n", ntohl(cqe->immed_rss_invalid));
-			//// WIMM hack
-			if (split_flag) {
-				wimm_flag = 1;
-			}
-			////
-			break;
-		case MLX4_RECV_OPCODE_SEND_INVAL:
-			((struct ibv_wc *)wc)->opcode   = IBV_WC_RECV;
-			((struct ibv_wc *)wc)->wc_flags |= IBV_WC_WITH_INV;
-			wc->imm_data = ntohl(cqe->immed_rss_invalid);
-			break;
-		case MLX4_RECV_OPCODE_SEND:
-			wc->exp_opcode   = IBV_EXP_WC_RECV;
-			wc_flags = 0;
-			//printf("DEBUG POLL CQ: ntohl(cqe->immed_rss_invalid): %d\n", ntohl(cqe->immed_rss_invalid));
-			////
-			/*
-			printf("DEBUG POLL CQ: RECV SEND\n");
-			if (cqe == NULL) {
-				printf("DDDD cqe is NULL\n");
-			}
-			if (cq->num_chunks_to_recv == 0) {
-				if (wc->byte_len == SPLIT_CHUNK_SIZE + sizeof(struct two_sided_header)) {
-
-					//struct mlx4_wq *rq = &(*cur_qp)->rq;
-					//unsigned int ind = rq->head & (rq->wqe_cnt - 1);
-					//struct two_sided_header *recv_header;
-					//recv_header = (struct two_sided_header *)malloc(sizeof(struct two_sided_header));
-					//recv_header.num_split_chunks = 0;
-					//if (wq->buf + SPLIT_CHUNK_SIZE + 1 != NULL) { printf("DEBUG SEGFAULT is not NULL\n"); }
-					//printf("DEBUG: SEGFAULT: wr->buf: %" PRIu64 "\n", (uint64_t)wq->buf);
-					//int *num_split_chunks = (int *) wq->buf + SPLIT_CHUNK_SIZE;
-					struct mlx4_wqe_data_seg *scat = (struct mlx4_wqe_data_seg *)mlx4_get_recv_wqe(*cur_qp, wqe_index);
-					//struct mlx4_wqe_data_seg *scat = (struct mlx4_wqe_data_seg *) (rq->buf + (ind << rq->wqe_shift));
-					//char *ptr = (char *)(scat->addr + SPLIT_CHUNK_SIZE);
-					//int *num_split_chunks = (int *)ptr;
-					//int *num_split_chunks = (uintptr_t)(scat->addr + SPLIT_CHUNK_SIZE);
-					printf("DEBUG: SEGFAULT: scat->addr: %" PRIu64 "\n", ntohll(scat->addr));
-					printf("DEBUG: SEGFAULT: scat->addr+SPLIT_CHUNK_SIZE: %" PRIu64 "\n", ntohll(scat->addr) + SPLIT_CHUNK_SIZE);
-					int *num_split_chunks = (int *)(ntohll(scat->addr) + SPLIT_CHUNK_SIZE);
-					//uint64_t ptr = (uint64_t) (ntohll(scat->addr) + SPLIT_CHUNK_SIZE);
-					//memcpy(recv_header, ntohll(scat->addr) + SPLIT_CHUNK_SIZE, sizeof(struct two_sided_header));
-					//int *num_split_chunks = (int *) wq->buf + SPLIT_CHUNK_SIZE;
-					printf("DEBUG SEGFAULT: num_split_chunks:%d\n", *num_split_chunks);
-					//cq->num_chunks_to_recv = recv_header->num_split_chunks;
-					cq->num_chunks_to_recv = *num_split_chunks;
-					--cq->num_chunks_to_recv;
-					cq->current_cqe = (struct mlx4_cqe *)malloc(sizeof(struct mlx4_cqe));
-					memcpy(cq->current_cqe, cqe, sizeof(struct mlx4_cqe));
-					cq->current_qpn = qpn;
-					return CQ_EMPTY;
-				}
-			} else {
-				--cq->num_chunks_to_recv;
-				if (cq->num_chunks_to_recv > 0) {
-					return CQ_EMPTY;
-				}
-				printf("DDD RETURN OK\n");
-				return CQ_OK;
+	do {
+		if (split_out_push(cq, &pool->wc))
+			return -1;
+		ret = 0;
+		while (!pool->left && pool->num_held) {
+			struct split_held *h = &pool->held[pool->held_head];
+
+			pool->held_head = (pool->held_head + 1) % pool->held_cap;
+			pool->num_held--;
+			if (split_recv_first_piece(qp, &h->wc)) {
+				ret = split_recv_begin(qp, &h->wc, wc_size, h->rr_segs);
+				free(h->rr_segs);
+				if (ret)
+					break;
+			} else if (split_out_push(cq, &h->wc)) {
+				return -1;
 			}
-			*/
-			////
-			break;
-		case MLX4_RECV_OPCODE_SEND_IMM:
-			//printf("DEBUG POLL CQ: (SIMM)IBV_WC_WITH_IMM set to wc_flags\n");
-			wc->exp_opcode   = IBV_EXP_WC_RECV;
-			wc_flags = IBV_WC_WITH_IMM;
-			wc->imm_data = cqe->immed_rss_invalid;
-			break;
-		////
-		//case MLX4_RECV_OPCODE_RDMA_WRITE_IMM_SPLIT:
-		//	printf("DETECT SPLIT\n");
-		//	break;
-		////
 		}
+	} while (ret > 0);
+	return ret;
+}
 
-		if (!timestamp_en) {
-			exp_wc_flags |= IBV_EXP_WC_WITH_SLID;
-			wc->slid = ntohs(cqe->rlid);
-		}
-		g_mlpath_rqpn	   = ntohl(cqe->g_mlpath_rqpn);
-		wc->src_qp	   = g_mlpath_rqpn & 0xffffff;
-		wc->dlid_path_bits = (g_mlpath_rqpn >> 24) & 0x7f;
-		wc_flags	  |= g_mlpath_rqpn & 0x80000000 ? IBV_WC_GRH : 0;
-		wc->pkey_index     = ntohl(cqe->immed_rss_invalid) & 0x7f;
-		/* When working with xrc srqs, don't have qp to check link layer.
-		  * Using IB SL, should consider Roce. (TBD)
-		*/
-		/* sl is invalid when timestamp is used */
-		if (!timestamp_en) {
-			if ((*cur_qp) && (*cur_qp)->link_layer ==
-			    IBV_LINK_LAYER_ETHERNET)
-				wc->sl = ntohs(cqe->sl_vid) >> 13;
-			else
-				wc->sl = ntohs(cqe->sl_vid) >> 12;
-			exp_wc_flags |= IBV_EXP_WC_WITH_SL;
-		}
-		if (is_exp && *cur_qp) {
-			if ((*cur_qp)->qp_cap_cache & MLX4_RX_CSUM_MODE_IP_OK_IP_NON_TCP_UDP)
-			/* Only ConnectX-3 Pro reports checksum for now) */
-				exp_wc_flags |=
-				MLX4_TRANSPOSE(cqe->badfcs_enc,
-					MLX4_CQE_STATUS_L4_CSUM,
-					(uint64_t)IBV_EXP_WC_RX_TCP_UDP_CSUM_OK) |
-				mlx4_transpose_uint16_t(cqe->status,
-					htons(MLX4_CQE_STATUS_IPOK),
-					(uint64_t)IBV_EXP_WC_RX_IP_CSUM_OK) |
-				mlx4_transpose_uint16_t(cqe->status,
-					htons(MLX4_CQE_STATUS_IPV4),
-					(uint64_t)IBV_EXP_WC_RX_IPV4_PACKET) |
-				mlx4_transpose_uint16_t(cqe->status,
-					htons(MLX4_CQE_STATUS_IPV6),
-					(uint64_t)IBV_EXP_WC_RX_IPV6_PACKET);
-			if ((*cur_qp)->qp_cap_cache & MLX4_RX_VXLAN) {
-				exp_wc_flags |=
-				mlx4_transpose_uint32_t(cqe->vlan_my_qpn,
-				htonl(MLX4_CQE_L2_TUNNEL),
-				(uint64_t)IBV_EXP_WC_RX_TUNNEL_PACKET) |
-				mlx4_transpose_uint32_t(cqe->vlan_my_qpn,
-					htonl(MLX4_CQE_L2_TUNNEL_IPOK),
-					(uint64_t)IBV_EXP_WC_RX_OUTER_IP_CSUM_OK) |
-				mlx4_transpose_uint32_t(cqe->vlan_my_qpn,
-					htonl(MLX4_CQE_L2_TUNNEL_L4_CSUM),
-					(uint64_t)IBV_EXP_WC_RX_OUTER_TCP_UDP_CSUM_OK) |
-				mlx4_transpose_uint32_t(cqe->vlan_my_qpn,
-					htonl(MLX4_CQE_L2_TUNNEL_IPV4),
-					(uint64_t)IBV_EXP_WC_RX_OUTER_IPV4_PACKET);
-				exp_wc_flags |=
-				MLX4_TRANSPOSE(~exp_wc_flags,
-						IBV_EXP_WC_RX_OUTER_IPV4_PACKET,
-						IBV_EXP_WC_RX_OUTER_IPV6_PACKET);
-			}
-		}
+//// hold back a receive of qp that completed while its split message is still coming in
+static int split_recv_hold(struct mlx4_qp *qp, const struct ibv_exp_wc *wc, uint32_t wc_size)
+{
+	struct split_recv_pool *pool = &qp->split_recv;
+	struct split_held *h;
+
+	if (split_ring_reserve((void **)&pool->held, &pool->held_head, pool->num_held,
+			       &pool->held_cap, sizeof(*pool->held)))
+		return -1;
+	h = &pool->held[(pool->held_head + pool->num_held) % pool->held_cap];
+	memset(&h->wc, 0, sizeof(h->wc));
+	memcpy(&h->wc, wc, split_wc_size(wc_size));
+	h->rr_segs = NULL;
+	//// the RR's WQE may be reused once the user posts again
+	if (wc->exp_opcode == IBV_EXP_WC_RECV && split_recv_first_piece(qp, &h->wc)) {
+		h->rr_segs = malloc(qp->rq.max_gs * sizeof(*h->rr_segs));
+		if (!h->rr_segs)
+			return -1;
+		memcpy(h->rr_segs, mlx4_get_recv_wqe(qp, (qp->rq.tail - 1) & (qp->rq.wqe_cnt - 1)),
+		       qp->rq.max_gs * sizeof(*h->rr_segs));
 	}
+	pool->num_held++;
+	return 0;
+}
 
-	if (is_exp)
-		wc->exp_wc_flags = exp_wc_flags | (uint64_t)wc_flags;
+//// Post slot of qp again without taking its chunk, which came in ahead of its piece with no room
+//// left in early[]; the message it belongs to completes with an error once its piece is in.
+static int split_recv_drop(struct mlx4_qp *qp, uint32_t slot)
+{
+	struct split_recv_pool *pool = &qp->split_recv;
+	uint32_t credits;
 
-	((struct ibv_wc *)wc)->wc_flags = wc_flags;
-	//printf("DEBUG POLL ONE: actually hit end\n");
+	if (mlx4_post_split_recv_slot(qp, slot))
+		return -1;
+	pool->dropped++;
+	credits = split_credit_reposted(&pool->owed, SPLIT_RECV_CREDIT_BATCH, 0);
+	if (credits &&
+	    (mlx4_post_split_credit(qp->split_qp2, credits) ||
+	     mlx4_split_reap_credits(qp->split_pool) < 0))
+		return -1;
+	return 0;
+}
 
-	//// WIMM hack
-	if (wimm_flag) {
-		return CQ_SPLIT_WIMM;
-	}
-	////
-#ifdef DRIVER_MEASURE_LAT
-	//// TIMESTAMP
-	if (cq->wr_timestamps != NULL) {
-		cycles_t cycles_elapsed = get_cycles() - queue_pop(cq->wr_timestamps);
-		//printf("cycles = %llu\n", cycles_elapsed);
-		int lat = round(cycles_elapsed / cq->cpu_mhz * 1000);	// latency in nanosec
-		printf("lat = %.2f\n", (double)lat/1000);
-#ifdef DRIVER_USE_CMH
-		if (CMH_Update(cq->cmh, lat)) {
-			fprintf(stderr, "CHM_update failed\n");	
-			return CQ_OK;
-		}
-#endif
+//// A chunk completed on split_qp[0] of qp. One of a message that failed to come in completes
+//// the message with its error; that of a split qp no message is coming in on (flushed when the
+//// split qps are set up again) is dropped.
+static int split_recv_chunk_wc(struct mlx4_cq *cq, struct mlx4_qp *qp, const struct ibv_exp_wc *wc,
+			       uint32_t wc_size)
+{
+	struct split_recv_pool *pool = &qp->split_recv;
+	struct split_chunk *c;
+	int ret;
+
+	if (wc->status != IBV_WC_SUCCESS) {
+		if (!pool->left)
+			return 0;
+		pool->wc.status = wc->status;
+		pool->left = 0;
+		return split_recv_finish(cq, qp, wc_size);
 	}
-	////
-#endif
-	if (split_flag) {
-		//printf("returning CQ_SPLIT\n");
-		// generate a CQ_SPLIT return val	
-		return CQ_SPLIT;
+	if (!pool->left) {
+		//// more than the peer had credits for: its message fails, not the cq
+		if (pool->num_early == SPLIT_RECV_SLOTS)
+			return split_recv_drop(qp, wc->wr_id);
+		c = &pool->early[(pool->early_head + pool->num_early++) % SPLIT_RECV_SLOTS];
+		c->slot = wc->wr_id;
+		c->byte_len = wc->byte_len;
+		c->imm_data = wc->imm_data;
+		return 0;
 	}
-	return CQ_OK;
+	ret = split_recv_chunk(qp, wc->wr_id, wc->byte_len, wc->imm_data);
+	return ret > 0 ? split_recv_finish(cq, qp, wc_size) : ret;
 }
 
-static void mlx4_stall_poll_cq()
+//// Look at wc, just polled from a cq split messages can arrive on for qp. Returns 1 when it
+//// goes to the user as it is, 0 when the split path took it, -1 on error.
+static int split_recv_wc(struct mlx4_cq *cq, struct mlx4_qp *qp, struct ibv_exp_wc *wc,
+			 uint32_t wc_size)
 {
-	int i;
+	int ret;
 
-	for (i = 0; i < mlx4_stall_num_loop; i++)
-		(void)get_cycles();
+	if (!qp)
+		return 1;
+	if (qp->split_owner)
+		return split_recv_chunk_wc(cq, qp->split_owner, wc, wc_size) < 0 ? -1 : 0;
+	if (!qp->split_recv.buf)
+		return 1;
+	//// the receives of a qp go out in order; its sends and errors need not wait
+	if (qp->split_recv.left && wc->status == IBV_WC_SUCCESS &&
+	    (wc->exp_opcode == IBV_EXP_WC_RECV || wc->exp_opcode == IBV_EXP_WC_RECV_RDMA_WITH_IMM))
+		return split_recv_hold(qp, wc, wc_size) ? -1 : 0;
+	if (!split_recv_first_piece(qp, wc))
+		return 1;
+
+	ret = split_recv_begin(qp, wc, wc_size,
+			       wc->exp_opcode == IBV_EXP_WC_RECV ?
+			       mlx4_get_recv_wqe(qp, (qp->rq.tail - 1) & (qp->rq.wqe_cnt - 1)) : NULL);
+	if (ret > 0)
+		ret = split_recv_finish(cq, qp, wc_size);
+	return ret < 0 ? -1 : 0;
 }
 
-int __mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
-		 uint32_t wc_size, int is_exp)
+//// Poll a locked cq that split messages can arrive on. The chunks of the peers complete here
+//// too, so an armed cq wakes its user for them and nothing needs to wait for them: the split
+//// path takes them, and hands out one completion per split message once its last chunk is in.
+//// Receives of a qp behind a split message still coming in are held back until it is out, so
+//// each qp's completions keep their order; those of other qps go out meanwhile.
+static int split_poll_cq(struct mlx4_cq *cq, int ne, struct ibv_exp_wc *wc,
+			 uint32_t wc_size, int is_exp, int *err)
 {
-	struct mlx4_cq *cq = to_mcq(ibcq);
 	struct mlx4_qp *qp = NULL;
-	int npolled;
-	int err = CQ_OK;
+	struct ibv_exp_wc *cur;
+	int npolled = 0;
+	int ret;
 
-	if (unlikely(cq->stall_next_poll)) {
-		cq->stall_next_poll = 0;
-		mlx4_stall_poll_cq();
-	}
-	mlx4_lock(&cq->lock);
-	
-	for (npolled = 0; npolled < ne; ++npolled) {
-		err = __mlx4_poll_one(cq, &qp, ((void *)wc) + npolled * wc_size,
-				    wc_size, is_exp);
-		if (unlikely(err != CQ_OK)) {
-			//if (err != -1) {
-			//	printf("SUSPICIOUS err = %d\n", err);
-			//}
+	for (;;) {
+		//// what is ready goes out first, in the order it became ready
+		while (npolled < ne && cq->split_out_num) {
+			cur = ((void *)wc) + npolled++ * wc_size;
+			memcpy(cur, &cq->split_out[cq->split_out_head], split_wc_size(wc_size));
+			cq->split_out_head = (cq->split_out_head + 1) % cq->split_out_cap;
+			cq->split_out_num--;
+		}
+		if (npolled == ne)
+			break;
+		cur = ((void *)wc) + npolled * wc_size;
+		*err = __mlx4_poll_one(cq, &qp, cur, wc_size, is_exp);
+		if (unlikely(*err != CQ_OK))
+			break;
+		ret = split_recv_wc(cq, qp, cur, wc_size);
+		if (ret < 0) {
+			*err = CQ_POLL_ERR;
 			break;
 		}
+		npolled += ret;
 	}
-
-	if (likely(npolled || err == CQ_POLL_ERR))
-		mlx4_update_cons_index(cq);
-
-	mlx4_unlock(&cq->lock);
-
-	if (unlikely(cq->stall_enable && err == CQ_EMPTY))
-		cq->stall_next_poll = 1;
-	
-	return err == CQ_POLL_ERR ? err : npolled;
+	return npolled;
 }
 
-int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
+int __mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 		 uint32_t wc_size, int is_exp)
 {
 	struct mlx4_cq *cq = to_mcq(ibcq);
 	struct mlx4_qp *qp = NULL;
+	uint32_t cons_index;
 	int npolled;
 	int err = CQ_OK;
 
@@ -1017,315 +914,50 @@ int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
 		mlx4_stall_poll_cq();
 	}
 	mlx4_lock(&cq->lock);
-	struct mlx4_wqe_data_seg *scat = NULL;
-	for (npolled = 0; npolled < ne; ++npolled) {
-		err = mlx4_poll_one(cq, &qp, ((void *)wc) + npolled * wc_size,
-				    wc_size, is_exp, &scat);
-		//if (unlikely(err != CQ_OK && err != CQ_SPLIT))
-		//if (err == CQ_SPLIT) {
-		//	printf("DEBUG mlx4_poll_cq: wc->qp_num: %#06x\n", wc->qp_num);
-		//}
-		if (unlikely(err != CQ_OK)) {
-			break;
+	cons_index = cq->cons_index;
+
+	//// a cq no split message can arrive on is polled exactly as stock
+	if (likely(!__atomic_load_n(&cq->split_recv_qps, __ATOMIC_RELAXED))) {
+		for (npolled = 0; npolled < ne; ++npolled) {
+			err = __mlx4_poll_one(cq, &qp, ((void *)wc) + npolled * wc_size,
+					    wc_size, is_exp);
+			if (unlikely(err != CQ_OK))
+				break;
 		}
+	} else {
+		npolled = split_poll_cq(cq, ne, wc, wc_size, is_exp, &err);
 	}
-	//printf("DEBUG mlx4_poll_cq: err:%d\n", err);
-	//printf("DEBUG mlx4_poll_cq: npolled:%d\n", npolled);
 
-	//if (scat != NULL) {printf("DDD SEG1: scat is not NULL.\n");}
-	if (likely(npolled || err == CQ_POLL_ERR || err == CQ_SPLIT || err == CQ_SPLIT_WIMM))
+	//// the EXCHANGE completions are consumed without being polled
+	if (likely(cq->cons_index != cons_index))
 		mlx4_update_cons_index(cq);
-	
-	//if (scat != NULL) {printf("DDD SEG2: scat is not NULL.\n");}
-	long total_bytes_recvd = 0;
-	if (err == CQ_SPLIT) {
-		// <1> poll from split_qp to get sender's INFO message
-		////
-		/*
-		struct ibv_qp_attr attr0;
-		struct ibv_qp_init_attr init_attr0;
-		if (ibv_query_qp(qp->split_qp, &attr0, IBV_QP_STATE, &init_attr0)) {
-			fprintf(stderr, "Failed to query QP state\n");
-			return -1;
-		}
-		printf("DEBUG poll_cq dest qpn CHECK: split_qp's dest_qp_num: %#06x\n", attr0.dest_qp_num);
-		printf("SPLIT QP local QPN: %#06x\n", qp->split_qp->qp_num);
-		*/
-		////
-
-		printf("RECEIVER <1> poll from split_qp to get sender's INFO message\n");
-		fflush(stdout);
-
-		//struct mlx4_qp *split_qp = NULL;
-		struct ibv_exp_wc split_wc;
-		uint32_t num_chunks_to_recv;
-		uint32_t split_chunk_size;
-
-		int ne2;
-		struct ibv_cq *ev_cq;
-		void *ev_ctx;
-		if (SPLIT_USE_EVENT) {
-			if (ibv_get_cq_event(qp->split_comp_recv_channel, &ev_cq, &ev_ctx)) {
-				fprintf(stderr, "Failed to get CQ event.\n");
-				return CQ_POLL_ERR;
-			}
-
-			ibv_ack_cq_events(ev_cq, 1);
 
-			if (ibv_req_notify_cq(ev_cq, 0)) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				return CQ_POLL_ERR;
-			}
-		}
-		do {
-			ne2 = __mlx4_poll_cq(qp->split_recv_cq, 1, &split_wc, wc_size, is_exp);
-		} while (ne2 == 0);
-
-		// <2> cache num_chunks_split from the received message
-		printf("RECEIVER <2> cache updated chunks_size & num_chunks_split from the received message\n");
-		fflush(stdout);
-		if (qp->split_fc_msg[0].type == INFO) {
-			printf("DEBUG: mlx4_poll_cq: Received INFO msg\n");
-			fflush(stdout);
-		} else {
-			printf("NOT INFO!\n");
-			fflush(stdout);
-			return -1;
-		}
-
-		num_chunks_to_recv = qp->split_fc_msg[0].msg.split_chunk_info.num_split_chunks;
-		split_chunk_size = qp->split_fc_msg[0].msg.split_chunk_info.current_chunk_size;
-		//cq->split_chunk_size = split_chunk_size;	
-
-		printf("DEBUG: mlx4_poll_cq: updated chunk size = %" PRIu32 "\n", split_chunk_size);
-		printf("DEBUG: mlx4_poll_cq: num_chunks_to_recv = %" PRIu32 "\n", num_chunks_to_recv);
-		fflush(stdout);
-
-		//printf("DEBUG: mlx4_poll_cq: split_FC_msg.msg.num_split_chunks = %d\n", qp->split_fc_msg[0].msg.num_split_chunks);
-		//printf("DEBUG: mlx4_poll_cq: num_chunks_to_recv = %d\n", num_chunks_to_recv);
-
-		// <3> post corresponding number of RRs to split_qp
-		printf("RECEIVER <3> post corresponding number of RRs to split_qp\n");
-		fflush(stdout);
-		
-		struct ibv_sge rsge;
-		struct ibv_recv_wr rwr;
-		struct ibv_recv_wr *bad_rwr;
-
-		memset(&rsge, 0, sizeof(rsge));
-		rsge.addr = (uintptr_t)ntohll(scat->addr);		// base addr
-		rsge.length = split_chunk_size;
-		rsge.lkey = ntohl(scat->lkey); 
-		
-		//printf("DEBUG: print scat: rsge.addr: %" PRIu64 "\n", rsge.addr);
-		//printf("DEBUG: print scat: rsge.lkey: %" PRIu32 "\n", rsge.lkey);
-
-		memset(&rwr, 0, sizeof(rwr));
-		rwr.wr_id = 0;
-		rwr.next = NULL;
-		rwr.sg_list = &rsge;
-		rwr.num_sge = 1;
-
-		int i;
-		int ret;
-		//printf("DEBUG mlx4_poll_cq: num_chunks_to_recv = %d\n", num_chunks_to_recv);
-
-		// NOTE: num_chunks_to_recv can be 0. In such case, no RR is posted.
-		for (i = 0; i < num_chunks_to_recv; i++) {
-			rsge.addr += split_chunk_size;		// relevant for SEND, DC for WIMM
-
-			ret = mlx4_post_recv(qp->split_qp[0], &rwr, &bad_rwr);
-			if (ret != 0) {
-				errno = ret;
-				fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-			}
-			
-		}
-		//printf("Posted %d recv requests\n", num_chunks_to_recv);
-
-		// <4> post another RR for future splitting
-		printf("RECEIVER <4> post another RR for future splitting\n");
-		fflush(stdout);
-		memset(&rsge, 0, sizeof(rsge));
-		rsge.addr = (uintptr_t)&qp->split_fc_msg[0];
-		rsge.length = sizeof(struct Split_FC_message);
-		rsge.lkey = qp->split_fc_mr->lkey;
-
-		memset(&rwr, 0, sizeof(rwr));
-		rwr.wr_id = 0;
-		rwr.next = NULL;
-		rwr.sg_list = &rsge;
-		rwr.num_sge = 1;
-
-		ret = mlx4_post_recv(qp->split_qp[0], &rwr, &bad_rwr);
-		if (ret != 0) {
-			errno = ret;
-			fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-		}
-
-		// <5> send ACK back to sender using split_qp, and poll its wc
-		printf("RECEIVER <5> send ACK back to sender using split_qp, and poll its wc\n");
-		fflush(stdout);
-		if (num_chunks_to_recv > 0) {
-
-			//printf("DEBUG5: mlx4_poll_cq: split_fc_msg.msg.num_split_chunks = %d\n", qp->split_fc_msg[0].msg.num_split_chunks);
-			qp->split_fc_msg[3].type = ACK;
-			struct ibv_sge ssge;
-			struct ibv_send_wr swr;
-			struct ibv_send_wr *bad_swr;
-
-			memset(&ssge, 0, sizeof(ssge));
-			ssge.addr	  = (uintptr_t)&qp->split_fc_msg[3];
-			ssge.length = sizeof(struct Split_FC_message);
-			ssge.lkey	  = qp->split_fc_mr->lkey;
-
-			//printf("DDDDD: ssge.addr = %" PRIu64 "\n", ssge.addr);
-			//printf("DDDDD: ssge.length = %d \n", ssge.length);
-			//printf("DDDDD: ssge.lkey = %" PRIu32 "\n", ssge.lkey);
-				
-			memset(&swr, 0, sizeof(swr));
-			swr.wr_id      = 0;
-			swr.sg_list    = &ssge;
-			swr.num_sge    = 1;
-			swr.opcode     = IBV_WR_SEND;
-			swr.send_flags = IBV_SEND_SIGNALED;
-
-			//__mlx4_post_send(qp->split_qp, &swr, &bad_swr);
-			ret = __mlx4_post_send(qp->split_qp2, &swr, &bad_swr);
-			if (ret != 0) {
-				errno = ret;
-				fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-			}
-			printf("ACK msg posted\n");
-			fflush(stdout);
-
-			if (SPLIT_USE_EVENT) {
-				if (ibv_get_cq_event(qp->split_comp_channel2, &ev_cq, &ev_ctx)) {
-					fprintf(stderr, "Failed to get CQ event.\n");
-					return CQ_POLL_ERR;
-				}
-
-				ibv_ack_cq_events(ev_cq, 1);
-
-				if (ibv_req_notify_cq(ev_cq, 0)) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					return CQ_POLL_ERR;
-				}
-			}
-			do {
-				ne2 = __mlx4_poll_cq(qp->split_cq2, 1, &split_wc, wc_size, is_exp);
-			} while (ne2 == 0);
-		}
-
-		// <6> poll from split_qp, and keep counting successful wc until all chunks are polled
-		printf("RECEIVER <6> poll from split_qp, and keep counting successful wc until all chunks are polled\n");
-		fflush(stdout);
-		//total_bytes_recvd = split_chunk_size + 1;
-		total_bytes_recvd += wc->byte_len;
-
-		////
-		if (num_chunks_to_recv > 0) {	// check if there is a need to poll
-			int ret_ne = 0;
-			ne2 = 0;
-			if (SPLIT_USE_EVENT) {
-				if (ibv_get_cq_event(qp->split_comp_recv_channel, &ev_cq, &ev_ctx)) {
-					fprintf(stderr, "Failed to get CQ event.\n");
-					return CQ_POLL_ERR;
-				}
-
-				ibv_ack_cq_events(ev_cq, 1);
-
-				
-				if (ibv_req_notify_cq(ev_cq, 0)) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					return CQ_POLL_ERR;
-				}
-			}
-			while (ne2 < num_chunks_to_recv) {
-				do {
-					ret_ne = __mlx4_poll_cq(qp->split_recv_cq, 1, &split_wc, wc_size, is_exp);
-				} while (ret_ne == 0);
-				++ne2;	
-				total_bytes_recvd += split_wc.byte_len;
-				//printf("ne2 = %d, byte_len: %d\n", ne2, split_wc.byte_len);
-			}
-			////
-		}
-
-		//// increment npolled;
-		++npolled;
-	} else if (err == CQ_SPLIT_WIMM) {
-		//printf("INDEED WIMM, USER received %d bytes\n", wc->byte_len);
-
-		struct ibv_sge rsge;
-		struct ibv_recv_wr rwr;
-		struct ibv_recv_wr *bad_rwr;
-		memset(&rsge, 0, sizeof(rsge));
-		rsge.addr = (uintptr_t)&qp->split_fc_msg[0];
-		rsge.length = sizeof(struct Split_FC_message);
-		rsge.lkey = qp->split_fc_mr->lkey;
-
-		memset(&rwr, 0, sizeof(rwr));
-		rwr.wr_id = 0;
-		rwr.next = NULL;
-		rwr.sg_list = &rsge;
-		rwr.num_sge = 1;
-
-		int ret = mlx4_post_recv(qp->split_qp[0], &rwr, &bad_rwr);
-		if (ret != 0) {
-			errno = ret;
-			fprintf(stderr, "mlx4_post_recv REALLY BAD!!, errno = %d\n", errno);
-		}
-
-		//// poll split_qp for the (N-1)th chunk sent via WIMM
-		int ne2;
-		struct ibv_cq *ev_cq;
-		void *ev_ctx;
-		struct ibv_exp_wc split_wc;
-		if (SPLIT_USE_EVENT) {
-			if (ibv_get_cq_event(qp->split_comp_recv_channel, &ev_cq, &ev_ctx)) {
-				fprintf(stderr, "Failed to get CQ event.\n");
-				return CQ_POLL_ERR;
-			}
+	mlx4_unlock(&cq->lock);
 
-			ibv_ack_cq_events(ev_cq, 1);
+	if (unlikely(cq->stall_enable && err == CQ_EMPTY))
+		cq->stall_next_poll = 1;
 
-			if (ibv_req_notify_cq(ev_cq, 0)) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				return CQ_POLL_ERR;
-			}
-		}
-		do {
-			ne2 = __mlx4_poll_cq(qp->split_recv_cq, 1, &split_wc, wc_size, is_exp);
-		} while (ne2 == 0);
+	return err == CQ_POLL_ERR ? err : npolled;
+}
 
-		//printf("GET WIMM chunk from split cq; recv byte = %d\n", split_wc.byte_len);
-		fflush(stdout);
+//// Drop the completions of qpn that are ready for the user; called when it is cleaned out of cq
+static void split_out_forget(struct mlx4_cq *cq, uint32_t qpn)
+{
+	uint32_t i, kept = 0;
 
-		//// increment npolled;
-		++npolled;
-	}
+	for (i = 0; i < cq->split_out_num; i++) {
+		struct ibv_exp_wc *e = &cq->split_out[(cq->split_out_head + i) % cq->split_out_cap];
 
-	//// make byte_len look real
-	if (err == CQ_SPLIT) {
-		err = CQ_OK;
-	    wc->byte_len = total_bytes_recvd;
-	} else if (err == CQ_SPLIT_WIMM) {
-		err = CQ_OK;
-		//TODO: fix length later
+		if (e->qp_num != qpn)
+			cq->split_out[(cq->split_out_head + kept++) % cq->split_out_cap] = *e;
 	}
-	////
-
-	mlx4_unlock(&cq->lock);
-	//printf("PUPU2\n");
-
-	if (unlikely(cq->stall_enable && err == CQ_EMPTY)) {
-		cq->stall_next_poll = 1;
-		//printf("CQ STALL?\n");
+	cq->split_out_num = kept;
+}
 
-	}
-	
-	return err == CQ_POLL_ERR ? err : npolled;
+int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
+		 uint32_t wc_size, int is_exp)
+{
+	return __mlx4_poll_cq(ibcq, ne, wc, wc_size, is_exp);
 }
 
 int mlx4_exp_poll_cq(struct ibv_cq *ibcq, int num_entries,
@@ -1382,6 +1014,8 @@ void __mlx4_cq_clean(struct mlx4_cq *cq, uint32_t qpn, struct mlx4_srq *srq)
 
 	if (cq->last_qp && cq->last_qp->verbs_qp.qp.qp_num == qpn)
 		cq->last_qp = NULL;
+	if (cq->split_out_num)
+		split_out_forget(cq, qpn);
 	/*
 	 * First we need to find the current producer index, so we
 	 * know where to start cleaning from.  It doesn't matter if HW
@@ -461,6 +461,13 @@ void read_init_vars(struct mlx4_context *ctx)
 		} else {
 			ctx->prefer_bf = 1;
 		}
+		//// Chunks of split messages are copied from the receive slots into the user's RR,
+		//// which costs a core about as much as a line-rate stream: off unless asked for.
+		ctx->split_recv = !ibv_exp_cmd_getenv(&ctx->ibv_ctx, "MLX4_SPLIT_RECV", env_value,
+						      sizeof(env_value)) && !strcmp(env_value, "1");
+		//// the EXCHANGE shifts the psns of the user's qps (split_exchange.h): off unless asked for
+		ctx->split_exchange = !ibv_exp_cmd_getenv(&ctx->ibv_ctx, SPLIT_EXCHANGE_ENV, env_value,
+							  sizeof(env_value)) && !strcmp(env_value, "1");
 
 		ctx->env_initialized = 1;
 		//printf("DEBUG BF: ctx->prefer_bf: %d\n", ctx->prefer_bf);
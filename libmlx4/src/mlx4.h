@@ -53,35 +53,30 @@
 #include <inttypes.h>
 #include "queue.h"
 #include "countmin.h"
+#include "flow_class.h"
+#include "split_exchange.h"
 #define SPLIT_CHUNK_SIZE		1000000			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
 //#define SPLIT_CHUNK_SIZE		1048576			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
 //#define SPLIT_CHUNK_SIZE		10000			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
 ////#define MIN_SPLIT_CHUNK_SIZE    2048			//// A minimun chunk size that everybody knows and assumes.
 #define MIN_SPLIT_CHUNK_SIZE    1000000			//// temporary hack to make 2-sided not split at 1MB chunk
 //#define MIN_SPLIT_CHUNK_SIZE    1048576			//// temporary hack to make 2-sided not split at 1MB chunk
-#define MANUAL_SPLIT_QPN_DIFF 	1				//// manually set (guess) split qpn/psn or general approcah
-#define SPLIT_QP_NUM_DIFF		1				//// DC if MANUAL_SPLIT is off
+#define SPLIT_EXCHANGE_TIMEOUT_MS	5000		//// give up splitting if the peer's grant does not arrive in time after the EXCHANGE
+#define SPLIT_EXCHANGE_POLL_US		1000		//// how often the exchange thread looks at the qps waiting for their peer
+#define SPLIT_EXCHANGE_RECV_CQE		1			//// split_exchange_cqes: the first receive completion of the user's qp is the peer's EXCHANGE
+#define SPLIT_EXCHANGE_SEND_CQE		2			//// and the first send completion is our own
 #define SPLIT_USE_EVENT			1				//// event-triggered polling for splitting
+#define SPLIT_RECV_SLOTS		4				//// receive slots preposted for two-sided split chunks = credits granted to the peer
+#define SPLIT_RECV_SLOT_SIZE	SPLIT_CHUNK_SIZE	//// largest two-sided chunk the peer may send us
+#define SPLIT_RECV_CREDIT_BATCH	2				//// slots posted again per credit return; at most SPLIT_RECV_SLOTS (split_credit.h)
+#define SPLIT_CREDIT_REAP_BATCH	16				//// completions reaped from a shared split cq per poll
 //#define SPLIT_USE_LINKED_LIST	0				//// post using a linked list or not (for one-sided verbs) (for testing purposes)
 //#define SPLIT_USE_NO_BATCH		0				//// 1 -> post 1 poll 1 at one-sided verbs; DC if SPLIT_USE_LINKED_LIST is 1; 0 -> use batch 
-#define SPLIT_USE_NO_BATCH_2SIDED		1		//// 1 -> post 1 poll 1 at two-sided verbs; 
 #define SPLIT_ONE_SIDED_BATCH_SIZE		1		//// batch rate in one-sided verbs. 1 means no batch. Becomes DC if SPLIT_ONE_SIDED_BATCH_SIZE > 1
-#define SPLIT_USE_SELECTIVE_SIGNALING	1		//// use selective signaling (only last chunk signaled) when sending split chunks 
 //#define SPLIT_QP_NUM_ONE_SIDED			2		//// Default number of split_QPs used to send split chunks in one-sided verbs
 #define MAX_SPLIT_QP_NUM_ONE_SIDED		1	    //// Maximum number of split_QPs used to send split chunks in one-sided verbs
 #define SPLIT_MAX_SEND_WR 		8000
-#define SPLIT_MAX_RECV_WR 		8000
-#define SPLIT_MAX_CQE			10000
-#define RR_BUFFER_INIT_CAP		1000
-#define TIMESTAMP_QUEUE_CAP		16
-// For count-min sketch
-//#define DRIVER_MEASURE_LAT
-//#define DRIVER_USE_CMH
-#define CMH_WIDTH 32768
-#define CMH_DEPTH 16
-#define CMH_U 24
-#define CMH_GRAN 4
-#define CMH_WINDOW_SIZE 10000
+#define SPLIT_QP2_WR			64				//// WRs of each queue of split_qp2: the grant, the credit returns and the RRs for the peer's
 //#define CPU_FRIENDLY                            //// Don't not use busy-wait checking for "pending" in shared memory. Use UDS with token enforcement.
 #define SPLIT_BIG_CHUNK_SIZE    1000000	        //// The big chunk size used in CPU_FRIENDLY version. Should be consistent with the value used in Pacer.
 //#define SPLIT_BIG_CHUNK_SIZE    1048576	        //// The big chunk size used in CPU_FRIENDLY version. Should be consistent with the value used in Pacer.
@@ -312,26 +307,97 @@ struct Split_FC_message {
 			uint32_t num_split_chunks;
 			uint32_t current_chunk_size;
 		} split_chunk_info;
-		struct {
-			uint32_t qp_num;
-			uint32_t sq_psn;
-		} split_qp_exchange;
+		struct split_exchange split_qp_exchange;
 	} msg;
 };
 ////
 
-//// Buffer holding Receive Requests posted at the user's qp at INIT state
-struct rr_buffer {
-	struct ibv_recv_wr **slot;	// head of the buffer
-	unsigned int size;			// number of wr_head pointers
-	unsigned int capacity;
+//// Remote end of the split qps, kept while they stay connected to it. A reconnect whose
+//// EXCHANGEs show both ends still connected to each other keeps them as they are.
+struct split_peer {
+	int				valid;
+	uint32_t		qp_num;			// the peer's split_qp[0]
+	uint32_t		qp2_num;		// the peer's split_qp2
+	uint32_t		recv_slots;		// credits the peer grants for two-sided chunks
+	uint32_t		slot_size;
+	uint32_t		split_min;
 };
 
-int rr_buffer_init(struct rr_buffer *rr_buf, unsigned int cap);
+//// Justitia pacing state of a user's qp. Class, pacer slot and token credit belong to the qp,
+//// so a thread driving both a latency qp and a bandwidth qp paces each of them on its own.
+struct justitia_flow {
+	struct flow_info	*flow;			// slot in the pacer's shm; NULL while unpaced
+	struct justitia_pacer	*pacer;			// of the port the qp is on; NULL if it has none
+	struct shared_block	*sb;			// that pacer's shm
+	struct mlx4_qp		*next;			// process-wide list of qps holding a slot
+	unsigned int		slot;
+	pid_t			tid;			// thread that joined; pid:tid:qpn is the slot key
+	int			started;		// the pacer has been told the class of the qp
+	int64_t			byte_credit;		// bw: bytes still covered by the last token
+	int32_t			debit;			// tput: WRs still covered by the last token
+	unsigned int		flow_socket;		// CPU_FRIENDLY: the pacer signals tokens here
+	uint64_t		*post_cycles;		// lat: tsc at which each SQ WQE was posted
+	struct lat_hist		*lat;			// lat: completion latencies in the pacer's shm; NULL when not recorded
+	uint64_t		msg_left;		// bw: bytes of the message being posted not yet charged to tokens
+	int			auto_class;		// no class hint: the class is taken from what the qp posts
+	struct flow_class	fc;
+	uint32_t		reserved;		// tput: MBps the pacer guarantees the qp; paced by bytes like bw then
+	int			registered;		// posted to while attached to a pacer: joins every new one
+	uint32_t		epoch;			// of the pacer the qp joined last, or tried to
+};
 
-int rr_buffer_enqueue(struct rr_buffer *rr_buf, struct ibv_recv_wr* wr);
+//// A chunk of the peer that completed before the piece of its message was polled
+struct split_chunk {
+	uint32_t		slot;
+	uint32_t		byte_len;
+	uint32_t		imm_data;
+};
 
-int rr_buffer_post_and_clear(struct rr_buffer *rr_buf, struct ibv_qp *qp);
+//// A receive of the user's qp that completed while a split message was still coming in; it is
+//// handed out behind that message
+struct split_held {
+	struct ibv_exp_wc	wc;
+	struct mlx4_wqe_data_seg *rr_segs;		// copy of its RR when it is the piece of a split message
+};
+
+//// Receive slots preposted on split_qp[0] for the two-sided chunks of the peer. The peer holds
+//// one credit per free slot and streams chunks as long as it has credits; every chunk is
+//// copied into the user's RR as it completes and its slot is posted again. The credits of the
+//// slots posted again go back over split_qp2 SPLIT_RECV_CREDIT_BATCH at a time, and those
+//// still owed when the last chunk of a message is in with it (split_credit.h).
+//// Chunks complete on the user's recv cq, so an armed cq wakes its user for them; polls of the
+//// cq take them and hand out a single completion per message once its last chunk is in (see
+//// split_poll_cq in cq.c). The message being reassembled lives here.
+struct split_recv_pool {
+	void			*buf;
+	struct ibv_mr	*mr;
+	uint32_t		num_slots;
+	uint32_t		slot_size;
+	struct mlx4_wqe_data_seg *rr_segs;		// copy of the user's RR, rq.max_gs entries
+	int			num_rr_segs;		// 0 for a split WRITE_WITH_IMM
+	uint32_t		left;			// chunks still expected; 0 when no message is coming in
+	uint32_t		done;
+	uint32_t		owed;			// slots posted again whose credits have not gone back yet
+	uint64_t		offset;			// bytes of the message in place so far
+	int			overflow;
+	int			user_imm;		// the user's imm comes with the last chunk
+	struct ibv_exp_wc	wc;			// the user's completion, handed out when left drops to 0
+	struct split_chunk	early[SPLIT_RECV_SLOTS];	// ring of chunks ahead of their piece
+	uint32_t		early_head, num_early;
+	uint32_t		dropped;		// chunks ahead of their piece that early[] had no room for
+	struct split_held	*held;			// ring of held_cap receives behind the message
+	uint32_t		held_head, num_held, held_cap;
+};
+
+//// Per-QP chunk descriptors used to build split chains without touching the user's wr.
+//// Sized from SPLIT_MAX_SEND_WR so one window of chunks always fits in the split SQ;
+//// each chunk owns max_sge SGEs so it can span several entries of the user's sg_list.
+struct split_arena {
+	struct ibv_send_wr *wr;
+	struct ibv_sge *sge;
+	unsigned int capacity;
+	unsigned int max_sge;
+};
 
 ////
 
@@ -525,6 +591,8 @@ struct mlx4_context {
 	pthread_mutex_t			db_list_mutex;
 	int				cqe_size;
 	int				prefer_bf;
+	int				split_recv;	/* MLX4_SPLIT_RECV: take split messages from peers */
+	int				split_exchange;	/* SPLIT_EXCHANGE_ENV: RC qps split */
 	struct mlx4_spinlock			hugetlb_lock;
 	struct list_head			hugetlb_list;
 	int				stall_enable;
@@ -545,11 +613,31 @@ struct mlx4_buf {
 	int				base;
 };
 
+//// The split cqs of a PD, shared by the split qps of all its user qps. Each grows by the
+//// entries the split qps it serves may hold and shrinks back as they go, so it never
+//// overruns. The completions carry the user qp they are for in their wr_id.
+struct mlx4_split_pool {
+	struct mlx4_lock	send_lock;	// reaps send_cq
+	struct mlx4_lock	cq2_lock;	// reaps cq2
+	int			refcnt;		// user qps attached; guarded by the pool mutex in verbs.c
+	pthread_mutex_t		wait_mutex;	// guards the reapers below
+	pthread_cond_t		wait_cond;	// broadcast after every reap that handed out completions
+	int			send_reaper;	// a waiter reaps send_cq
+	int			cq2_reaper;	// a waiter reaps cq2
+	struct ibv_comp_channel	*send_channel;
+	struct ibv_comp_channel	*channel2;
+	struct ibv_cq		*send_cq;	// sends of split_qp[0] of the user qps
+	struct ibv_cq		*cq2;		// split_qp2 of the user qps
+	int			send_cqe;	// entries of each cq reserved by the split qps
+	int			cq2_cqe;
+};
+
 struct mlx4_pd {
 	struct ibv_pd			ibv_pd;
 	uint32_t			pdn;
 	//// added for splitting cleanup
 	struct ibv_mr		*split_fc_mr;
+	struct mlx4_split_pool	*split_pool;
 	////
 };
 
@@ -581,16 +669,10 @@ struct mlx4_cq {
 	int				creation_flags;
 	struct mlx4_qp			*last_qp;
 	uint32_t			model_flags; /* use mlx4_cq_model_flags */
-	//uint32_t 		split_chunk_size;
-#ifdef DRIVER_MEASURE_LAT
-	//// TIMESTAMP
-	Queue 			*wr_timestamps;		/* Ideally, we don't even need a queue if assume user post-1-poll-1 for theri "small" QP */
-	double 			cpu_mhz;
-#ifdef DRIVER_USE_CMH
-	CMH_type		*cmh;
 	////
-#endif
-#endif
+	int				split_recv_qps;		/* qps of this cq whose peer may split what it sends */
+	struct ibv_exp_wc		*split_out;		/* ring of completions ready for the user, ahead of the cq */
+	uint32_t			split_out_head, split_out_num, split_out_cap;
 };
 
 struct mlx4_srq {
@@ -711,26 +793,35 @@ struct mlx4_qp {
 	//// added for spliting
 	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED];
 	struct ibv_qp 		*split_qp2;
-	//struct ibv_cq		*split_cq;
-	struct ibv_cq		*split_send_cq;
-	struct ibv_cq		*split_recv_cq;
-	struct ibv_cq		*split_cq2;
-	//struct ibv_comp_channel *split_comp_channel;
-	struct ibv_comp_channel *split_comp_send_channel;
-	struct ibv_comp_channel *split_comp_recv_channel;
-	struct ibv_comp_channel *split_comp_channel2;
+	struct mlx4_split_pool	*split_pool;			// the split cqs of the PD; our chunks come in on the user's recv cq
+	int					split_send_cqe;			// entries of the pool's cqs our split qps reserved
+	int					split_cq2_cqe;
+	uint32_t			split_sends_posted;		// signaled chunks of split_qp[0] posted,
+	uint32_t			split_sends_done;		// and reaped off the pool's send cq
+	int					split_sends_failed;
 	uint32_t			split_dest_qpn;
 	struct Split_FC_message split_fc_msg[4];
 	struct ibv_mr		*split_fc_mr;
-	struct ibv_qp_attr	*user_qp_attr_init;
+	struct ibv_qp_attr	user_qp_attr_init;	// the split qps are brought up like the user's qp
 	int 				user_qp_mask_init;
-	struct ibv_qp_attr	*user_qp_attr_rtr;
+	struct ibv_qp_attr	user_qp_attr_rtr;
 	int 				user_qp_mask_rtr;
-	struct rr_buffer	rr_buf;
-	int 				split_qp_exchange_done;
+	struct mlx4_lock	split_lock;				// held by a split from its first post to its last completion
+	struct split_arena	split_arena;
+	int 				split_qp_exchange_done;	// 0: EXCHANGE pending, 2: split qps connected, waiting for the peer's grant, 1: splitting, -1: no splitting
+	int					split_exchange_tx;		// our EXCHANGE: 0 not due yet, 1 owed ahead of the next post, 2 sent
+	uint8_t				split_exchange_cqes;	// SPLIT_EXCHANGE_*_CQE: completions of the EXCHANGE kept from the application
+	uint32_t			split_rq_psn;			// the application's rq_psn, named by the peer's EXCHANGE
+	uint64_t			split_exchange_deadline;	// ms; for the peer's grant
+	struct mlx4_qp		*split_exchange_next;	// on the list of the exchange thread
+	struct split_peer	split_peer;
+	struct split_recv_pool	split_recv;			// allocated when the user's qp first goes to INIT
+	struct mlx4_qp		*split_owner;			// of split_qp[0]: the user's qp whose chunks it receives
+	int					split_credits;			// free slots of the peer for our two-sided chunks
 	//uint32_t			prev_chunk_size;		// used in 2-sided chunk size varying
-	int					isSmall;
-	struct mlx4_cq		*orig_send_cq;
+	int					isSmall;				// 0: bw, 1: lat, 2: tput; hinted in qp_context or classified online
+	struct mlx4_lock	pace_lock;				// guards pace and isSmall; tokens are waited for under it, never under an SQ lock
+	struct justitia_flow	pace;
 	////
 };
 
@@ -884,6 +975,8 @@ int mlx4_alloc_cq_buf(struct mlx4_context *mctx, struct mlx4_buf *buf, int nent,
 int mlx4_resize_cq(struct ibv_cq *cq, int cqe);
 int mlx4_destroy_cq(struct ibv_cq *cq);
 int mlx4_poll_ibv_cq(struct ibv_cq *cq, int ne, struct ibv_wc *wc);
+int __mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_exp_wc *wc,
+		   uint32_t wc_size, int is_exp);
 int mlx4_exp_poll_cq(struct ibv_cq *ibcq, int num_entries,
 		     struct ibv_exp_wc *wc, uint32_t wc_size) __MLX4_ALGN_FUNC__;
 int mlx4_arm_cq(struct ibv_cq *cq, int solicited);
@@ -937,18 +1030,24 @@ int mlx4_destroy_qp(struct ibv_qp *qp);
 void *mlx4_get_recv_wqe(struct mlx4_qp *qp, int n);
 void mlx4_init_qp_indices(struct mlx4_qp *qp);
 void mlx4_qp_init_sq_ownership(struct mlx4_qp *qp);
+int __mlx4_post_send_until(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+		   struct ibv_send_wr *stop, struct ibv_send_wr **bad_wr,
+		   struct mlx4_qp *owner) __MLX4_ALGN_FUNC__;
 int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-		   struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
+		   struct ibv_send_wr **bad_wr, struct mlx4_qp *owner) __MLX4_ALGN_FUNC__;
 #ifdef CPU_FRIENDLY
 int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-		   struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
+		   struct ibv_send_wr *stop, struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
 #endif
 int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		   struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
-int orig_mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-		   struct ibv_send_wr **bad_wr) __MLX4_ALGN_FUNC__;
 int mlx4_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 		   struct ibv_recv_wr **bad_wr) __MLX4_ALGN_FUNC__;
+int mlx4_post_split_exchange(struct mlx4_qp *qp);
+int mlx4_split_reap_grant(struct mlx4_qp *qp);
+int mlx4_post_split_credit(struct ibv_qp *split_qp2, uint32_t credits);
+int mlx4_split_reap_credits(struct mlx4_split_pool *pool);
+int mlx4_post_split_recv_slot(struct mlx4_qp *qp, uint32_t slot);
 void mlx4_calc_sq_wqe_size(struct ibv_qp_cap *cap, enum ibv_qp_type type,
 			   struct mlx4_qp *qp);
 int num_inline_segs(int data, enum ibv_qp_type type);
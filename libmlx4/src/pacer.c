@@ -1,6 +1,7 @@
 #include "pacer.h"
 
 #include <sys/syscall.h>
+#include "get_clock.h"
 
 
 char *get_sock_path() {
@@ -34,182 +35,513 @@ char *get_sock_path() {
     return SOCK_PATH;
 }
 
-// join=0 -> exit; join=1 -> first join and ask pacer for slot; join=2 -> tell pacer about the type of the app (0:bw, 1:lat, 2:tput); join=3 -> deregister slot mapping
-//void contact_pacer(int join, uint64_t vaddr) {
-void contact_pacer(int join) {
-    /* prepare unix domain socket */
-    char *sock_path = get_sock_path();
-    unsigned int s, len;
-    struct sockaddr_un remote;
-    char str[MSG_LEN];
-    long long unsigned int vaddr = 0;     // hack for now
-    int vaddr_idx;
+//// the pacer's socket path: the hostname it is derived from is read once per process
+static pthread_once_t sock_path_once = PTHREAD_ONCE_INIT;
+static char *sock_path;
 
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        exit(1);
-    }
+static void justitia_sock_path_init(void) {
+    sock_path = get_sock_path();
+}
+
+static const char *justitia_sock_path(void) {
+    pthread_once(&sock_path_once, justitia_sock_path_init);
+    return sock_path;
+}
 
-    printf("Contacting pacer...\n");
+//// the pacers of the ports the process has qps on (struct justitia_pacer)
+static struct justitia_pacer *pacers = NULL;
+static pthread_mutex_t pacers_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    remote.sun_family = AF_UNIX;
-    strcpy(remote.sun_path, sock_path);
-    free(sock_path);
-    printf("SUN_PATH = %s\n", remote.sun_path);
-    printf("SOCK_PATH = %s\n", SOCK_PATH);
-    len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-    if (connect(s, (struct sockaddr *)&remote, len) == -1) {
-        perror("connect");
-        exit(1);
+//// The pacer of port of dev: the one the port runs, else the one that named no port; NULL if
+//// neither runs. Its shared block is mapped once per process.
+struct justitia_pacer *justitia_pacer_attach(const char *dev, int port) {
+    struct justitia_pacer *p;
+    char name[PORT_DEV_LEN + 32];
+    int fd;
+
+    snprintf(name, sizeof(name), PORT_BLOCK_FMT, SHARED_MEM_NAME, dev, port);
+    if ((fd = shm_open(name, O_RDWR, 0600)) < 0) {
+        dev = "";
+        port = 0;
+        if ((fd = shm_open(SHARED_MEM_NAME, O_RDWR, 0600)) < 0)
+            return NULL;
+    }
+    pthread_mutex_lock(&pacers_lock);
+    for (p = pacers; p; p = p->next)
+        if (p->port == port && !strcmp(p->dev, dev))
+            goto out;
+    if (!(p = calloc(1, sizeof(*p))))
+        goto out;
+    p->sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    if (p->sb == MAP_FAILED) {
+        free(p);
+        p = NULL;
+        goto out;
     }
+    snprintf(p->dev, sizeof(p->dev), "%s", dev);
+    p->port = port;
+    if (port)
+        snprintf(p->sock_path, sizeof(p->sock_path), PORT_SOCK_FMT, justitia_sock_path(), dev, port);
+    else
+        snprintf(p->sock_path, sizeof(p->sock_path), "%s", justitia_sock_path());
+    p->ctl_sock = -1;
+    pthread_mutex_init(&p->ctl_lock, NULL);
+    p->next = pacers;
+    pacers = p;
+out:
+    pthread_mutex_unlock(&pacers_lock);
+    close(fd);
+    return p;
+}
 
-    if (join == 0) {
-        memset(str, 0, MSG_LEN);
-        if (isSmall == 0) {
-            strcpy(str, "exit_app_bw");
-        } else if (isSmall == 1) {
-            strcpy(str, "exit_app_lat");
-        } else if (isSmall == 2) {
-            strcpy(str, "exit_app_tput");
-        } else {
-            strcpy(str, "exit_app_bw");
-        }
-        if (send(s, str, strlen(str), 0) == -1) {
-            perror("send: exit");
-            exit(1);
-        }
-        close(s);
-    } else if (join == 1) {
-        /* send join message */
-        printf("Sending join message...\n");
-        //strcpy(str, "join:");
-        sprintf(str, "join:%016Lx", vaddr);
-        if (send(s, str, strlen(str), 0) == -1) {
-            perror("send: join");
-            exit(1);
-        }
+//// Sends the line msg to pacer p and, with reply, reads the answer back into it (CTL_LINE_LEN).
+//// A channel the pacer dropped, as a restarted one does, is opened once more. Unanswered lines
+//// never wait for the channel: while another thread holds it, or the thread an exit handler
+//// interrupted does, they go on a connection of their own. Returns 0, or -1.
+static int justitia_ctl(struct justitia_pacer *p, char *msg, int len, int reply) {
+    int s, tries, ret = -1;
 
-        /* recv sender/receiver prompt (instead of string "pid") */
-        if ((len = recv(s, str, MSG_LEN, 0)) > 0) {
-            str[len] = '\0';
-            if (strncmp(str, "sender:xxx", 6) == 0) {
-                sscanf(str, "sender:%x", &vaddr_idx);
-                printf("I'm a sender; vaddr_idx = %d\n", vaddr_idx);
-
-            } else if (strcmp(str, "recver") == 0) {
-                printf("I'm a receiver.\n");
-            } else {
-                printf("unrecognized string. must be \"sender\" or \"recver\"\n");
-                exit(1);
-            }
+    if (reply) {
+        pthread_mutex_lock(&p->ctl_lock);
+    } else if (pthread_mutex_trylock(&p->ctl_lock)) {
+        if ((s = ctl_open(p->sock_path)) < 0)
+            return -1;
+        ret = ctl_send(s, msg, len);
+        close(s);
+        return ret;
+    }
+    for (tries = 0; tries < 2 && ret; tries++) {
+        if (p->ctl_sock < 0 && (p->ctl_sock = ctl_open(p->sock_path)) < 0)
+            break;
+        if (!ctl_send(p->ctl_sock, msg, len) && (!reply || ctl_recv_line(p->ctl_sock, msg, CTL_LINE_LEN) >= 0)) {
+            ret = 0;
         } else {
-            if (len < 0) perror("recv");
-            else printf("Server closed connection\n");
-            exit(1);
-        }
-        memset(str, 0, MSG_LEN);
-
-        /* send pid:tid so pacer can schedule per-thread */
-        pid_t my_pid = getpid();
-        pid_t my_tid = (pid_t)syscall(SYS_gettid);
-        printf("My PID is %d, TID is %d\n", my_pid, my_tid);
-        len = snprintf(str, MSG_LEN, "%d:%d", my_pid, my_tid);
-        //printf("length of pid message is %d\n", len);
-        if (send(s, str, len, 0) == -1) {
-            perror("error in sending pid: ");
-            exit(1);
+            close(p->ctl_sock);
+            p->ctl_sock = -1;
         }
+    }
+    pthread_mutex_unlock(&p->ctl_lock);
+    if (ret)
+        fprintf(stderr, "justitia: no pacer at %s\n", p->sock_path);
+    return ret;
+}
 
-        /* receive the slot number */
-        if ((len = recv(s, str, MSG_LEN, 0)) > 0) {
-            str[len] = '\0';
-        } else {
-            if (len < 0) perror("recv");
-            else printf("Server closed connection\n");
-            exit(1);
-        }
-        slot = strtol(str, NULL, 10);
-        printf("Received slot number: %d\n", slot);
+#ifdef CPU_FRIENDLY
+//// token reads on the flow socket give up every WATCHDOG_STALE_NS, for the reader to look at the heartbeat
+static void justitia_token_timeout(int s) {
+    struct timeval tv = { WATCHDOG_STALE_NS / 1000000000, WATCHDOG_STALE_NS % 1000000000 / 1000 };
+
+    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+        perror("setsockopt: SO_RCVTIMEO");
+}
+
+//// Tokens come over the socket a qp joined on: it joins on a connection of its own, with the
+//// one-shot exchange (join:vaddr, then pid:tid:qpn[:MBps]), and keeps it. The slot is left in line.
+static int justitia_join_socket(struct mlx4_qp *qp, char *line) {
+    struct justitia_flow *jf = &qp->pace;
+    long long unsigned int vaddr = 0;     // hack for now
+    int s, len;
 
+    if ((s = ctl_dial(jf->pacer->sock_path)) < 0) {
+        perror("connect");
+        return -1;
+    }
+    len = snprintf(line, CTL_LINE_LEN, "join:%016Lx", vaddr);
+    if (ctl_send(s, line, len)) {
+        perror("send: join");
+        goto fail;
+    }
+    if ((len = recv(s, line, CTL_LINE_LEN - 1, 0)) <= 0) {
+        printf("Server closed connection\n");
+        goto fail;
+    }
+    line[len] = '\0';
+    if (strncmp(line, "sender:", 7) && strcmp(line, "recver")) {
+        printf("unrecognized string. must be \"sender\" or \"recver\"\n");
+        goto fail;
+    }
+    if (jf->reserved)
+        len = snprintf(line, CTL_LINE_LEN, "%d:%d:%x:%u", getpid(), jf->tid, qp->verbs_qp.qp.qp_num, jf->reserved);
+    else
+        len = snprintf(line, CTL_LINE_LEN, "%d:%d:%x", getpid(), jf->tid, qp->verbs_qp.qp.qp_num);
+    if (ctl_send(s, line, len)) {
+        perror("send: pid:tid:qpn");
+        goto fail;
+    }
+    if ((len = recv(s, line, CTL_LINE_LEN - 1, 0)) <= 0) {
+        printf("Server closed connection\n");
+        goto fail;
+    }
+    line[len] = '\0';
+    jf->flow_socket = s;
+    justitia_token_timeout(s);
+    return 0;
+
+fail:
+    close(s);
+    return -1;
+}
+#endif
+
+//// the class a qp tells the pacer it starts or stops sending as: app_* for join=2, exit_app_* for join=0
+static const char *justitia_app_type(struct mlx4_qp *qp) {
+    if (qp->isSmall == 0 && qp->pace.flow && __atomic_load_n(&qp->pace.flow->read, __ATOMIC_RELAXED))
+        return "read";
+    if (qp->isSmall == 1)
+        return "lat";
+    if (qp->isSmall == 2)
+        return "tput";
+    return "bw";
+}
+
+// join=0 -> exit_app_*; join=1 -> join + get slot; join=2 -> app_* (app_read for a READ elephant); join=3 -> deregister slot mapping
+// Slots are per qp: they are keyed by pid:tid:qpn, the tid being that of the thread that joined.
+// All go on the control channel of the process (ctl_chan.h); only a join waits for an answer.
+// Returns 0, or -1 if the pacer could not be reached: the qp is then left unpaced, never the process killed.
+int contact_pacer(struct mlx4_qp *qp, int join) {
+    struct justitia_flow *jf = &qp->pace;
+    char line[CTL_LINE_LEN], *end;
+    uint32_t granted;
+    long slot;
+    int len;
+
+    if (join == 0 || join == 2) {
+        len = snprintf(line, CTL_LINE_LEN, "%sapp_%s\n", join ? "" : "exit_", justitia_app_type(qp));
+        return justitia_ctl(jf->pacer, line, len, 0);
+    }
+
+    if (join == 3) {
+        len = snprintf(line, CTL_LINE_LEN, "l:%d:%d:%x\n", getpid(), jf->tid, qp->verbs_qp.qp.qp_num);
+        return justitia_ctl(jf->pacer, line, len, 0);
+    }
+
+    if (join != 1)
+        return 0;
+    jf->tid = (pid_t)syscall(SYS_gettid);
 #ifdef CPU_FRIENDLY
-        flow_socket = s;
-        // don't close (s) in case of join
-        // this connection is the one we use to recv tokens in token_enforcement impl
+    if (justitia_join_socket(qp, line))
+        return -1;
 #else
-    close(s);
+    if (jf->reserved)   /* a tput qp asking for a minimum rate: j:pid:tid:qpn:MBps */
+        len = snprintf(line, CTL_LINE_LEN, "j:%d:%d:%x:%u\n", getpid(), jf->tid, qp->verbs_qp.qp.qp_num, jf->reserved);
+    else
+        len = snprintf(line, CTL_LINE_LEN, "j:%d:%d:%x\n", getpid(), jf->tid, qp->verbs_qp.qp.qp_num);
+    if (justitia_ctl(jf->pacer, line, len, 1))
+        return -1;
 #endif
-    } else if (join == 2) {
-        /* tell daemon about my app type */
-        memset(str, 0, MSG_LEN);
-        if (isSmall == 0) {
-            strcpy(str, "app_bw");
-        } else if (isSmall == 1) {
-            strcpy(str, "app_lat");
-        } else if (isSmall == 2){
-            strcpy(str, "app_tput");
-        } else {
-            printf("unrecognized app type. Exit\n");
-            exit(1);
-        }
-        if (send(s, str, strlen(str), 0) == -1) {
-            perror("send: app type");
-            exit(1);
-        }
-        close(s);
-    } else if (join == 3) {
-        pid_t my_pid = getpid();
-        pid_t my_tid = (pid_t)syscall(SYS_gettid);
-        len = snprintf(str, MSG_LEN, "l:%d:%d", my_pid, my_tid);
-        if (send(s, str, len, 0) == -1) {
-            perror("send: leave");
-            exit(1);
+    slot = strtol(line, &end, 10);
+    /* -1: the pacer has no slot left for the qp, which goes unpaced */
+    if (slot < 0) {
+#ifdef CPU_FRIENDLY
+        close(jf->flow_socket);
+        jf->flow_socket = 0;
+#endif
+        fprintf(stderr, "justitia: qp %06x: no pacer slot left, unpaced\n", qp->verbs_qp.qp.qp_num);
+        return -1;
+    }
+    jf->slot = slot;
+    /* the pacer answers a reservation with slot:MBps granted, 0 if it did not admit it */
+    if (jf->reserved) {
+        granted = *end == ':' ? strtoul(end + 1, NULL, 10) : 0;
+        if (!granted)
+            fprintf(stderr, "justitia: qp %06x: reservation of %u MBps rejected, running best effort\n",
+                    qp->verbs_qp.qp.qp_num, jf->reserved);
+        jf->reserved = granted;
+    }
+    return 0;
+}
+
+//// qps holding a pacer slot, so the exit handlers can hand all of them back
+static struct mlx4_qp *paced_qps = NULL;
+static pthread_mutex_t paced_qps_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t lat_ns_mult = 0;
+
+//// cycles to ns, for the latency histograms and the online classifier, and cpu_mhz: as the pacer
+//// published them in its shared block sb, or timed here against a pacer that has not; -1 without
+//// a cpu clock rate
+int justitia_clock_init(const struct shared_block *sb) {
+    uint32_t khz;
+    double mhz;
+
+    if (!__atomic_load_n(&lat_ns_mult, __ATOMIC_RELAXED)) {
+        if (sb && (khz = __atomic_load_n(&sb->tsc.khz, __ATOMIC_ACQUIRE))) {
+            cpu_mhz = khz / 1000.0;
+            __atomic_store_n(&lat_ns_mult, sb->tsc.ns_mult, __ATOMIC_RELAXED);
+            return 0;
         }
-        close(s);
+        mhz = cpu_mhz > 0 ? cpu_mhz : get_cpu_mhz(1);
+        if (mhz <= 0)
+            return -1;
+        cpu_mhz = mhz;
+        __atomic_store_n(&lat_ns_mult, (uint32_t)((1 << TSC_NS_SHIFT) * 1000 / mhz + 0.5), __ATOMIC_RELAXED);
     }
+    return 0;
 }
 
-void set_inactive_on_exit() {
-    /* make exit handler idempotent per-thread */
-    if (justitia_exit_done)
+//// tsc rate a capture (capture.h) is stamped with: that of the pacer the qp joined, or the cpu's.
+//// An unpaced qp leaves the clock alone, for a pacer that comes up later to publish its own.
+double justitia_capture_mhz(const struct shared_block *sb) {
+    if (sb && !justitia_clock_init(sb))
+        return cpu_mhz;
+    return cpu_mhz > 0 ? cpu_mhz : get_cpu_mhz(1);
+}
+
+//// A latency-sensitive qp stamps every WQE it posts and counts each of its send completions into
+//// the histogram of its slot, for the pacer to control on; without a cpu clock rate it records nothing.
+//// The stamps stay allocated until the qp is destroyed, even if it leaves the class.
+static void justitia_lat_start(struct mlx4_qp *qp) {
+    struct justitia_flow *jf = &qp->pace;
+
+    if (justitia_clock_init(jf->sb))
+        return;
+    if (!jf->post_cycles)
+        jf->post_cycles = calloc(qp->sq.wqe_cnt, sizeof(*jf->post_cycles));
+    if (jf->post_cycles)
+        jf->lat = &jf->sb->lat_hist[jf->slot];
+}
+
+//// MBps a tput qp asks the pacer to guarantee it when it joins, from the environment; 0 for none
+static uint32_t justitia_min_rate(void) {
+    const char *env = getenv(MIN_RATE_ENV);
+
+    return env ? strtoul(env, NULL, 10) : 0;
+}
+
+//// Joins the pacer running now; a qp it does not answer stays unpaced until the next one.
+//// The epoch is read after the join: a pacer takes joins just before it publishes it, and
+//// a qp that reads the old one joins once more, keeping its slot.
+static void justitia_flow_join(struct mlx4_qp *qp) {
+    struct justitia_flow *jf = &qp->pace;
+    int ret;
+
+    jf->flow = NULL;
+    jf->lat = NULL;
+    jf->started = 0;
+    jf->reserved = qp->isSmall == 2 && !jf->auto_class ? justitia_min_rate() : 0;
+    ret = contact_pacer(qp, 1);
+    jf->epoch = __atomic_load_n(&jf->sb->epoch, __ATOMIC_RELAXED);
+    if (ret) {
+        jf->reserved = 0;
         return;
+    }
+    jf->flow = &jf->sb->flows[jf->slot];
+    jf->byte_credit = 0;
+    jf->debit = 0;
+    jf->msg_left = 0;
+    if (qp->isSmall == 1)
+        justitia_lat_start(qp);
+}
+
+//// the qp is to be paced by pacer p, the one of the port it is on, from its first post on
+void justitia_flow_attach(struct mlx4_qp *qp, struct justitia_pacer *p) {
+    qp->pace.pacer = p;
+    qp->pace.sb = p->sb;
+}
+
+//// The first post of a qp attached to a pacer takes a slot of it, under the pace lock. A qp
+//// the pacer has no slot for stays unpaced, as one it did not answer does, until the next one.
+void justitia_flow_register(struct mlx4_qp *qp) {
+    struct justitia_flow *jf = &qp->pace;
+
+
+    jf->registered = 1;
+    justitia_flow_join(qp);
+    if (jf->auto_class && justitia_clock_init(jf->sb))
+        jf->auto_class = 0;         /* no clock to time the posts with: stays bw */
+
+    pthread_mutex_lock(&paced_qps_lock);
+    jf->next = paced_qps;
+    paced_qps = qp;
+    pthread_mutex_unlock(&paced_qps_lock);
+}
+
+// first post of a registered qp: tell the pacer (and through it the receiver) its class
+void justitia_flow_start(struct mlx4_qp *qp, int is_read) {
+    struct justitia_flow *jf = &qp->pace;
 
-    if (flow) {
-        if (isSmall == 1) {
-            if (num_active_small_flows)
-                __atomic_fetch_sub(&sb->num_active_small_flows, num_active_small_flows, __ATOMIC_RELAXED);
-            contact_pacer(0);
-            printf("DEBUG decrement SMALL counter by %d\n", num_active_small_flows);
-        } else if (__atomic_load_n(&flow->read, __ATOMIC_RELAXED)) {
-            //TODO: fix READ exit later
-            __atomic_store_n(&flow->read, 0, __ATOMIC_RELAXED);
-            contact_pacer(0);
+    jf->started = 1;
+    switch (qp->isSmall) {
+    case 0:
+        if (is_read) {
+            //// READ elephants are paced by the pacer's read tokens, at the rate the responder grants
+            __atomic_store_n(&jf->flow->read, 1, __ATOMIC_RELAXED);
+            contact_pacer(qp, 2);
         } else {
-            if (num_active_big_flows)
-                __atomic_fetch_sub(&sb->num_active_big_flows, num_active_big_flows, __ATOMIC_RELAXED);
-            printf("DEBUG decrement BIG counter by %d\n", num_active_big_flows);
-            contact_pacer(0);
+            contact_pacer(qp, 2);
+            printf("DEBUG POST SEND: INDEED increment BIG flow counter\n");
+            __atomic_fetch_add(&jf->sb->num_active_big_flows, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&jf->sb->num_active_bw_flows, 1, __ATOMIC_RELAXED);
         }
-        __atomic_store_n(&flow->pending, 0, __ATOMIC_RELAXED);
-        __atomic_store_n(&flow->active, 0, __ATOMIC_RELAXED);
+        break;
+    case 1:
+        contact_pacer(qp, 2);
+        printf("DEBUG POST SEND: INDEED increment SMALL flow counter\n");
+        __atomic_fetch_add(&jf->sb->num_active_small_flows, 1, __ATOMIC_RELAXED);
+        break;
+    case 2:
+        contact_pacer(qp, 2);
+        printf("DEBUG POST SEND: TPUT SENSITIVE\n");
+        __atomic_fetch_add(&jf->sb->num_active_big_flows, 1, __ATOMIC_RELAXED);
+        break;
+    default:
+        break;
+    }
+}
+
+// the pacer (and through it the receiver) stops counting the qp in its class; the slot stays
+static void justitia_flow_stop(struct mlx4_qp *qp) {
+    struct justitia_flow *jf = &qp->pace;
+
+    if (!jf->started)
+        return;
+    if (qp->isSmall == 1) {
+        __atomic_fetch_sub(&jf->sb->num_active_small_flows, 1, __ATOMIC_RELAXED);
+        contact_pacer(qp, 0);
+        printf("DEBUG decrement SMALL counter\n");
+    } else if (__atomic_load_n(&jf->flow->read, __ATOMIC_RELAXED)) {
+        contact_pacer(qp, 0);
+        __atomic_store_n(&jf->flow->read, 0, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&jf->sb->num_active_big_flows, 1, __ATOMIC_RELAXED);
+        if (qp->isSmall == 0)
+            __atomic_fetch_sub(&jf->sb->num_active_bw_flows, 1, __ATOMIC_RELAXED);
+        printf("DEBUG decrement BIG counter\n");
+        contact_pacer(qp, 0);
+    }
+    jf->started = 0;
+}
+
+//// An online classified qp moved to class cls: it leaves the old class and joins the new one,
+//// keeping its slot. Called under the pace lock, like the first post that started it.
+void justitia_flow_reclassify(struct mlx4_qp *qp, int cls) {
+    struct justitia_flow *jf = &qp->pace;
+
+#ifdef JUSTITIA_DEBUG
+    printf("DEBUG qp %06x reclassified %d -> %d\n", qp->verbs_qp.qp.qp_num, qp->isSmall, cls);
+#endif
+    justitia_flow_stop(qp);
+    if (qp->isSmall == 1)
+        jf->lat = NULL;
+    qp->isSmall = cls;
+    if (cls == 1)
+        justitia_lat_start(qp);
+    justitia_flow_start(qp, 0);
+}
+
+//// A new pacer published another epoch (watchdog.h): the slot and class of the qp went with the
+//// old one, which the new one does not count. The qp joins again and tells its class on its next
+//// post. Called under the pace lock, like the first post that started it.
+void justitia_flow_reattach(struct mlx4_qp *qp) {
+    struct justitia_flow *jf = &qp->pace;
 
 #ifdef CPU_FRIENDLY
-        if (flow_socket) {
-            close(flow_socket);
-            flow_socket = 0;
-        }
+    if (jf->flow_socket) {
+        close(jf->flow_socket);
+        jf->flow_socket = 0;
+    }
 #endif
+    justitia_flow_join(qp);
+    fprintf(stderr, "justitia: qp %06x %s pacer epoch %u\n", qp->verbs_qp.qp.qp_num,
+            jf->flow ? "joined" : "could not join", jf->epoch);
+}
+
+//// a waiter found pacer p dead (watchdog.h): the process stops waiting for its tokens
+void justitia_pacer_bury(struct justitia_pacer *p, const struct watchdog *w) {
+    uint32_t epoch = __atomic_load_n(&p->sb->epoch, __ATOMIC_RELAXED);
+
+    if (watchdog_dead(&p->dead, epoch, w->beat))
+        return;
+    watchdog_bury(&p->dead, w, epoch);
+    fprintf(stderr, "justitia: pacer epoch %u at %s stopped beating; sending unpaced until it is back\n", epoch,
+            p->sock_path);
+}
+
+static void justitia_flow_leave(struct mlx4_qp *qp) {
+    struct justitia_flow *jf = &qp->pace;
+
+    if (!jf->flow)
+        return;
+    justitia_flow_stop(qp);
+    __atomic_store_n(&jf->flow->pending, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&jf->flow->active, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&jf->sb->msg_left[jf->slot], 0, __ATOMIC_RELAXED);
+
+#ifdef CPU_FRIENDLY
+    if (jf->flow_socket) {
+        close(jf->flow_socket);
+        jf->flow_socket = 0;
+    }
+#endif
+
+    /* Return this qp's slot to pacer */
+    contact_pacer(qp, 3);
+
+    jf->flow = NULL;
+    jf->lat = NULL;
+}
+
+// hand the slot of a qp back to the pacer; called when the qp is destroyed
+void justitia_flow_release(struct mlx4_qp *qp) {
+    struct mlx4_qp **pos;
 
-    /* Return this thread's slot to pacer (scheme A: per-thread slots) */
-    contact_pacer(3);
+    /* a qp the pacer did not answer is on the list too, to join the next one */
+    if (qp->pace.registered) {
+        pthread_mutex_lock(&paced_qps_lock);
+        for (pos = &paced_qps; *pos; pos = &(*pos)->pace.next) {
+            if (*pos == qp) {
+                *pos = qp->pace.next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&paced_qps_lock);
+
+        justitia_flow_leave(qp);
+        qp->pace.registered = 0;
+    }
+
+    /* a qp that already left at exit keeps its stamps until it is destroyed */
+    free(qp->pace.post_cycles);
+    qp->pace.post_cycles = NULL;
+}
+
+//// The qp was brought to INIT on port. It was attached to the pacer of port 1 when it was created;
+//// on another port it leaves that pacer for the one of its port, or goes unpaced if the port has
+//// none. Usually called before the qp posts anything, and so before it took a slot.
+void justitia_flow_port(struct mlx4_qp *qp, int port) {
+    struct justitia_flow *jf = &qp->pace;
+    struct justitia_pacer *p;
+
+    if (!jf->pacer || jf->pacer->port == port)
+        return;
+    p = justitia_pacer_attach(ibv_get_device_name(qp->verbs_qp.qp.context->device), port);
+    if (p == jf->pacer)
+        return;
+    if (!p) {
+        justitia_flow_release(qp);
+        fprintf(stderr, "justitia: qp %06x on port %d, which has no pacer: unpaced\n", qp->verbs_qp.qp.qp_num, port);
+        jf->pacer = NULL;
+        jf->sb = NULL;
+        return;
+    }
+    if (jf->registered)
+        justitia_flow_leave(qp);
+    jf->pacer = p;
+    jf->sb = p->sb;
+    if (jf->registered)
+        justitia_flow_join(qp);
+}
+
+void set_inactive_on_exit() {
+    struct mlx4_qp *qp;
 
-        flow = NULL;
-        slot = 0;
-        start_flag = 1;
-        num_active_small_flows = 0;
-        num_active_big_flows = 0;
-        printf("libmlx4 thread exit\n");
-        justitia_exit_done = 1;
+    /* make exit handler idempotent: every qp leaves the list before it leaves the pacer */
+    pthread_mutex_lock(&paced_qps_lock);
+    while ((qp = paced_qps)) {
+        paced_qps = qp->pace.next;
+        justitia_flow_leave(qp);
     }
+    pthread_mutex_unlock(&paced_qps_lock);
+    printf("libmlx4 exit\n");
 }
 
 void termination_handler(int sig) {
@@ -47,13 +47,13 @@
 #include "wqe.h"
 
 /* isolation */
-//#include "qp_pacer.h"
 #include "pacer.h"
+#include "split_sge.h"
+#include "split_credit.h"
+#include "capture.h"
 #include <inttypes.h>
 #include <sys/time.h>
-__thread int isSmall = -1; /* per-thread: 0=bw, 1=lat, 2=tput; -1 unset */
 int isRead = 0;
-__thread int32_t debit = 0;
 double cpu_factor_table[] = {0,0.5,0.5,0.7,0.9};    //value for first level is a don't-care (for 1MB chunks)
 /* end */
 
@@ -1111,21 +1111,228 @@ void mlx4_update_post_send_one(struct mlx4_qp *qp)
 	}
 }
 
-//// ceil helper
-int ceil_helper(float num_chunks)
+////
+
+#ifndef CPU_FRIENDLY
+//// Asks the pacer for a token and spins until it grants one. Fails open (watchdog.h): nothing
+//// is asked of a pacer found dead, and one that stops beating during the wait is found dead.
+//// Returns 0 with a token, -1 without.
+static inline int justitia_wait_token(struct justitia_flow *jf)
 {
-	int inum_chunks = (int)num_chunks;
-	if (num_chunks == (float)inum_chunks)
+	struct watchdog w;
+	cycles_t start;
+
+	if (unlikely(justitia_pacer_dead(jf->pacer)))
+		return -1;
+	start = get_cycles();
+	__atomic_store_n(&jf->flow->pending, 1, __ATOMIC_RELAXED);
+	watchdog_start(&w, &jf->sb->heartbeat);
+	while (__atomic_load_n(&jf->flow->pending, __ATOMIC_RELAXED))
 	{
-		return inum_chunks;
+		cpu_relax();
+		if (unlikely(watchdog_stale(&w, &jf->sb->heartbeat)))
+		{
+			justitia_pacer_bury(jf->pacer, &w);
+			__atomic_store_n(&jf->flow->pending, 0, __ATOMIC_RELAXED);
+			return -1;
+		}
 	}
-	return inum_chunks + 1;
+	justitia_stat_add(&jf->sb->stats[jf->slot].wait_cycles, get_cycles() - start);
+	return 0;
+}
+#else
+//// The same over the flow socket: its reads time out every WATCHDOG_STALE_NS, and a pacer
+//// whose heartbeat has not moved since the last one, or which closed the socket, is dead.
+static inline int justitia_wait_token(struct justitia_flow *jf)
+{
+	struct watchdog w;
+	cycles_t start;
+	ssize_t n;
+	char str;
+
+	if (unlikely(justitia_pacer_dead(jf->pacer)))
+		return -1;
+	start = get_cycles();
+	__atomic_store_n(&jf->flow->pending, 1, __ATOMIC_RELAXED);
+	watchdog_start(&w, &jf->sb->heartbeat);
+	while ((n = recv(jf->flow_socket, &str, 1, 0)) <= 0)
+	{
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+		    __atomic_load_n(&jf->sb->heartbeat, __ATOMIC_RELAXED) != w.beat)
+		{
+			watchdog_start(&w, &jf->sb->heartbeat);
+			continue;
+		}
+		justitia_pacer_bury(jf->pacer, &w);
+		__atomic_store_n(&jf->flow->pending, 0, __ATOMIC_RELAXED);
+		return -1;
+	}
+	justitia_stat_add(&jf->sb->stats[jf->slot].wait_cycles, get_cycles() - start);
+	return 0;
+}
+#endif
+
+//// A bw flow tells the pacer how much is left of the message it is posting before it asks for
+//// a token, so the pacer can grant the shortest remaining message first (SRPT_GRANTS).
+//// A WR posted outside a split message is a message of its own.
+static inline void justitia_msg_publish(struct justitia_flow *jf, uint64_t len)
+{
+	if (jf->msg_left < len)
+		jf->msg_left = len;
+	__atomic_store_n(&jf->sb->msg_left[jf->slot], jf->msg_left, __ATOMIC_RELAXED);
+}
+
+//// len bytes of the message were charged
+static inline void justitia_msg_charged(struct justitia_flow *jf, uint64_t len)
+{
+	jf->msg_left = jf->msg_left > len ? jf->msg_left - len : 0;
+}
+
+#ifndef CPU_FRIENDLY
+//// Bandwidth flows are charged by bytes: a token is worth one chunk of the WR's kind and the
+//// credit carries over between WRs of a chain (and between calls), so a post-list of small
+//// WRs shares tokens while a full split chunk still costs exactly one.
+static inline void justitia_charge_bytes(struct justitia_flow *jf, struct ibv_send_wr *wr)
+{
+	uint64_t len = split_sge_total(wr->sg_list, wr->num_sge);
+
+	if (jf->byte_credit <= 0)
+		justitia_msg_publish(jf, len);
+	while (jf->byte_credit <= 0)
+	{
+		if (justitia_wait_token(jf))
+		{
+			jf->byte_credit = len;		//// no pacer: the WR goes unpaced
+			break;
+		}
+		jf->byte_credit += (wr->opcode == IBV_WR_RDMA_READ) ? __atomic_load_n(&jf->sb->active_chunk_size_read, __ATOMIC_RELAXED)
+								    : __atomic_load_n(&jf->sb->active_chunk_size, __ATOMIC_RELAXED);
+	}
+	jf->byte_credit -= len;
+	justitia_msg_charged(jf, len);
+}
+#endif
+
+//// a qp takes its pacer slot on its first post, not when it is created (justitia_flow_register)
+static inline void justitia_flow_first_post(struct mlx4_qp *qp)
+{
+	if (likely(qp->pace.registered || !qp->pace.pacer))
+		return;
+	mlx4_lock(&qp->pace_lock);
+	if (!qp->pace.registered && qp->pace.pacer)
+		justitia_flow_register(qp);
+	mlx4_unlock(&qp->pace_lock);
+}
+
+//// class a post is paced as: that of the user's qp it is charged to, -1 if unpaced
+static inline int justitia_class(struct mlx4_qp *owner)
+{
+	if (!owner || !owner->pace.flow)
+		return -1;
+	//// a reservation is metered in bytes: its tput qp takes one token per chunk, like bw
+	return owner->pace.reserved ? 0 : owner->isSmall;
+}
+
+//// Takes the tokens the WRs from wr up to (not including) stop cost owner before they are
+//// posted, so no thread waits for the pacer while it holds an SQ lock. Bandwidth flows are
+//// charged WR by WR, throughput flows are debited the whole chain. The pace lock keeps the
+//// threads posting to owner from spending the same token credit.
+static inline void justitia_pace_chain(struct mlx4_qp *owner, struct ibv_send_wr *wr,
+				       struct ibv_send_wr *stop)
+{
+	struct justitia_flow *jf = &owner->pace;
+	int nreq = 0;
+	int cls;
+
+	cls = justitia_class(owner);
+	if (cls != 0 && cls != 2)
+		return;
+	mlx4_lock(&owner->pace_lock);
+	//// the class may have moved before the lock was taken
+	cls = justitia_class(owner);
+	if (cls == 0)
+	{
+		for (; wr != stop; wr = wr->next)
+#ifndef CPU_FRIENDLY
+			justitia_charge_bytes(jf, wr);
+#else
+			justitia_wait_token(jf);
+#endif
+	}
+	else if (cls == 2)
+	{
+		for (; wr != stop; wr = wr->next)
+			nreq++;
+		while (jf->debit <= 0)
+		{
+			if (justitia_wait_token(jf))
+			{
+				jf->debit = nreq;	//// no pacer: the chain goes unpaced
+				break;
+			}
+			jf->debit += __atomic_load_n(&jf->sb->active_batch_ops, __ATOMIC_RELAXED);
+		}
+		jf->debit -= nreq;
+	}
+	mlx4_unlock(&owner->pace_lock);
+}
+
+//// Feeds one post call of a qp created without a class hint to its online classifier, and moves
+//// the qp to the class the classifier settles on. READ elephants keep their bw slot. The window
+//// counters are not locked: threads posting to the same qp at once only blur its statistics.
+static inline void justitia_flow_observe(struct mlx4_qp *qp, struct ibv_send_wr *wr)
+{
+	struct justitia_flow *jf = &qp->pace;
+	uint64_t bytes = 0;
+	uint32_t wrs = 0;
+	int cls;
+
+	if (__atomic_load_n(&jf->flow->read, __ATOMIC_RELAXED))
+		return;
+	for (; wr; wr = wr->next, wrs++)
+		bytes += split_sge_total(wr->sg_list, wr->num_sge);
+	cls = flow_class_post(&jf->fc, get_cycles(), wrs, bytes, lat_ns_mult);
+	if (likely(cls == qp->isSmall))
+		return;
+	mlx4_lock(&qp->pace_lock);
+	if (jf->flow && cls != qp->isSmall)
+		justitia_flow_reclassify(qp, cls);
+	mlx4_unlock(&qp->pace_lock);
+}
+
+//// Records each WR of a post call into the thread's capture ring (capture.h), stamped with the
+//// time of the call and the class the qp is paced as; the first post of the process looks at
+//// CAPTURE_ENV.
+static void justitia_capture(struct mlx4_qp *qp, uint32_t qpn, struct ibv_send_wr *wr)
+{
+	uint64_t now;
+	int cls;
+
+	if (capture_enabled() < 0 && !capture_setup())
+		return;
+	if (!capture_mhz)
+		capture_mhz = justitia_capture_mhz(qp->pace.sb);
+	now = get_cycles();
+	cls = justitia_class(qp);
+	for (; wr; wr = wr->next)
+		capture_post(now, qpn, wr->opcode, split_sge_total(wr->sg_list, wr->num_sge), cls,
+			     wr->num_sge, wr->send_flags);
 }
-////
 
-//// original mlx4_post_send without lock
 int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-					 struct ibv_send_wr **bad_wr)
+					 struct ibv_send_wr **bad_wr, struct mlx4_qp *owner)
+{
+	return __mlx4_post_send_until(ibqp, wr, NULL, bad_wr, owner);
+}
+
+//// original mlx4_post_send without lock; posts the chain from wr up to (not including) stop.
+//// Its tokens were taken by justitia_pace_chain; the posted bytes count for owner, the user's qp
+//// (a split chunk counts for the qp it came from). Control messages pass NULL.
+int __mlx4_post_send_until(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+					 struct ibv_send_wr *stop, struct ibv_send_wr **bad_wr,
+					 struct mlx4_qp *owner)
 {
 	//printf("DEBUG __mlx4_post_send: enter\n");
 	//printf("DEBUG __mlx4_post_send: raddr:%" PRIu64 "\n", wr->wr.rdma.remote_addr);
@@ -1137,6 +1344,10 @@ int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	int inl = 0;
 	int ret = 0;
 	int size = 0;
+	//// latency-sensitive qps stamp their WQEs for the completion latency histogram
+	cycles_t posted = qp->pace.post_cycles ? get_cycles() : 0;
+	int cls = justitia_class(owner);
+	uint64_t paced_bytes = 0;
     //uint8_t expected_pending = 0;
 
 	////mlx4_lock(&qp->sq.lock);
@@ -1145,21 +1356,8 @@ int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 
 	ind = qp->sq.head;
 
-	for (nreq = 0; wr; ++nreq, wr = wr->next)
+	for (nreq = 0; wr != stop; ++nreq, wr = wr->next)
 	{
-		/* isolation */
-#ifndef CPU_FRIENDLY
-		if (isSmall == 0 && flow)
-		{
-            //expected_pending = 0;
-			//printf("DEBUG ENTER HERE\n");
-			__atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-			//while (!__atomic_compare_exchange_n(&flow->pending, &expected_pending, 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))   // multi-thread safer than doing load
-			while (__atomic_load_n(&flow->pending, __ATOMIC_RELAXED))
-				cpu_relax();
-		}
-#endif
-		/* end */
 		//printf("ORIG POST SEND: wr->sg_list->length = %d\n", wr->sg_list->length);
 		/* to be considered whether can throw first check, create_qp_exp with post_send */
 		if (!(qp->create_flags & IBV_EXP_QP_CREATE_IGNORE_SQ_OVERFLOW))
@@ -1190,6 +1388,8 @@ int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 
 		ctrl = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
 		qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
+		if (posted)
+			qp->pace.post_cycles[ind & (qp->sq.wqe_cnt - 1)] = posted;
 
 		ret = qp->post_send_one(wr, qp, ctrl, &size, &inl, ind);
 		if (unlikely(ret))
@@ -1199,12 +1399,14 @@ int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			*bad_wr = wr;
 			goto out;
 		}
+		if (cls >= 0)
+			paced_bytes += split_sge_total(wr->sg_list, wr->num_sge);
 		/*
 		 * We can improve latency by not stamping the last
 		 * send queue WQE until after ringing the doorbell, so
 		 * only stamp here if there are still more WQEs to post.
 		 */
-		if (likely(wr->next))
+		if (likely(wr->next != stop))
 #ifndef MLX4_WQE_FORMAT
 			stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) &
 								   (qp->sq.wqe_cnt - 1));
@@ -1217,25 +1419,9 @@ int __mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		++ind;
 	}
 	// printf("ORIG POST SEND: nreq = %d\n", nreq);
-	/* isolation */
-#ifndef CPU_FRIENDLY
-	if (isSmall == 2 && flow)
-	{
-		// printf("DEBUG enter\n");
-		while (debit <= 0)
-		{
-			// printf("DEBUG REQUEST TOKEN\n");
-			__atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-			while (__atomic_load_n(&flow->pending, __ATOMIC_RELAXED))
-				cpu_relax();
-			debit += __atomic_load_n(&sb->active_batch_ops, __ATOMIC_RELAXED);
-			// printf("DEBUG DEBIT %d\n", debit);
-		}
-		debit -= nreq;
-	}
-#endif
-	/* end */
 out:
+	if (paced_bytes)
+		justitia_stat_post(&owner->pace, owner->isSmall, paced_bytes);
 	//printf("DEBUG __mlx4_post_send: right before ring_db: size = %d\n", size);
 	ring_db(qp, ctrl, nreq, size, inl);
 
@@ -1254,15 +1440,20 @@ out:
 ////
 
 #ifdef CPU_FRIENDLY
-//// original __mlx4_post_send without lock; used by big flows with no splitting or normal small flows in CPU_FRIENDLY
+//// original __mlx4_post_send without lock; used by big flows with no splitting or normal small flows in CPU_FRIENDLY.
+//// Its tokens were taken by justitia_pace_chain.
 int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-					 struct ibv_send_wr **bad_wr)
+					 struct ibv_send_wr *stop, struct ibv_send_wr **bad_wr)
 {
 	//printf("DEBUG __mlx4_post_send: enter\n");
 	//printf("DEBUG __mlx4_post_send: raddr:%" PRIu64 "\n", wr->wr.rdma.remote_addr);
 	//printf("DEBUG __mlx4_post_send: sg_addr:%" PRIu64 "\n", wr->sg_list->addr);
 	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct justitia_flow *jf = &qp->pace;
+	int cls = justitia_class(qp);
+	uint64_t paced_bytes = 0;
 	void *uninitialized_var(ctrl);
+	cycles_t posted = jf->post_cycles ? get_cycles() : 0;
 	unsigned int ind;
 	int nreq;
 	int inl = 0;
@@ -1276,25 +1467,8 @@ int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 
 	ind = qp->sq.head;
 
-    //struct timeval tt1, tt2;
-	for (nreq = 0; wr; ++nreq, wr = wr->next)
+	for (nreq = 0; wr != stop; ++nreq, wr = wr->next)
 	{
-		/* isolation */
-		if (isSmall == 0 && flow)
-		{
-            char str;
-            __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-            //gettimeofday(&tt1,NULL);
-            if (recv(flow_socket, &str, 1, 0) > 0) {
-                //printf("received a token\n");
-            } else {
-                printf("Error in recving tokens. Exit\n");
-                exit(1);
-            }
-            //gettimeofday(&tt2,NULL);
-            //printf("__send_BIG: elaspsed time = %d us\n", (int)(tt2.tv_usec - tt1.tv_usec));
-		}
-		/* end */
 		//printf("ORIG POST SEND: wr->sg_list->length = %d\n", wr->sg_list->length);
 		/* to be considered whether can throw first check, create_qp_exp with post_send */
 		if (!(qp->create_flags & IBV_EXP_QP_CREATE_IGNORE_SQ_OVERFLOW))
@@ -1325,6 +1499,8 @@ int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 
 		ctrl = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
 		qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
+		if (posted)
+			qp->pace.post_cycles[ind & (qp->sq.wqe_cnt - 1)] = posted;
 
 		ret = qp->post_send_one(wr, qp, ctrl, &size, &inl, ind);
 		if (unlikely(ret))
@@ -1334,12 +1510,14 @@ int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			*bad_wr = wr;
 			goto out;
 		}
+		if (cls >= 0)
+			paced_bytes += split_sge_total(wr->sg_list, wr->num_sge);
 		/*
 		 * We can improve latency by not stamping the last
 		 * send queue WQE until after ringing the doorbell, so
 		 * only stamp here if there are still more WQEs to post.
 		 */
-		if (likely(wr->next))
+		if (likely(wr->next != stop))
 #ifndef MLX4_WQE_FORMAT
 			stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) &
 								   (qp->sq.wqe_cnt - 1));
@@ -1352,27 +1530,9 @@ int __mlx4_post_send_BIG(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		++ind;
 	}
 	// printf("ORIG POST SEND: nreq = %d\n", nreq);
-	/* isolation */
-	if (isSmall == 2 && flow)
-	{
-		// printf("DEBUG enter\n");
-		while (debit <= 0)
-		{
-            char str;
-            __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-            if (recv(flow_socket, &str, 1, 0) > 0) {
-                //printf("received a token\n");
-            } else {
-                printf("Error in recving tokens. Exit\n");
-                exit(1);
-            }
-			debit += __atomic_load_n(&sb->active_batch_ops, __ATOMIC_RELAXED);
-			// printf("DEBUG DEBIT %d\n", debit);
-		}
-		debit -= nreq;
-	}
-	/* end */
 out:
+	if (paced_bytes)
+		justitia_stat_post(jf, qp->isSmall, paced_bytes);
 	//printf("DEBUG __mlx4_post_send: right before ring_db: size = %d\n", size);
 	ring_db(qp, ctrl, nreq, size, inl);
 
@@ -1391,1859 +1551,739 @@ out:
 ////
 #endif
 
-//// new version with both one-sided and two-sided verbs using split qp
-int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-				   struct ibv_send_wr **bad_wr)
-{
-
-	struct mlx4_qp *qp = to_mqp(ibqp);
-
-	/* isolation */
-	if (unlikely(start_flag))
+//// Reap the PD's shared split_cq2 without blocking: a credit return of a peer is added to the
+//// user's qp named by the wr_id of the RR it consumed, and that RR is posted again; completions
+//// of our own credit returns (wr_id 0) are dropped. The first one after the EXCHANGE is the
+//// peer's grant: its split qps are connected to ours, so the user's qp starts splitting.
+//// A RR flushed by split qps gone to error fails their user's qp only.
+//// Returns the number of completions reaped or -1.
+static int split_reap_credits(struct ibv_cq *split_cq2)
+{
+	struct ibv_wc wc[SPLIT_CREDIT_REAP_BATCH];
+	struct ibv_recv_wr rwr;
+	struct ibv_recv_wr *bad_rwr;
+	int ne, i;
+
+	ne = __mlx4_poll_cq(split_cq2, SPLIT_CREDIT_REAP_BATCH, (struct ibv_exp_wc *)wc, sizeof(wc[0]), 0);
+	for (i = 0; i < ne; i++)
 	{
-		start_flag = 0;
-		if (flow)
+		struct mlx4_qp *qp = (struct mlx4_qp *)(uintptr_t)wc[i].wr_id;
+
+		if (!qp)
+			continue;
+		if (wc[i].status != IBV_WC_SUCCESS)
 		{
-			/* Scheme A: class is per-thread; first QP may initialize it */
-			if (isSmall < 0)
-				isSmall = qp->isSmall;
-			switch (isSmall)
-			{
-			case 0:
-			{
-				if (wr->opcode == IBV_WR_RDMA_READ)
-				{
-					__atomic_store_n(&flow->read, 1, __ATOMIC_RELAXED);
-					//contact_pacer_read();		//TODO: fix read later
-				}
-				else
-				{
-					num_active_big_flows++;
-					contact_pacer(2);
-					printf("DEBUG POST SEND: INDEED increment BIG flow counter\n");
-					__atomic_fetch_add(&sb->num_active_big_flows, 1, __ATOMIC_RELAXED);
-				    __atomic_fetch_add(&sb->num_active_bw_flows, 1, __ATOMIC_RELAXED);
-				}
-				break;
-			}
-			case 1:
-			{
-				contact_pacer(2);
-				num_active_small_flows++;
-				printf("DEBUG POST SEND: INDEED increment SMALL flow counter\n");
-				__atomic_fetch_add(&sb->num_active_small_flows, 1, __ATOMIC_RELAXED);
-				break;
-			}
-			case 2:
-			{
-				contact_pacer(2);
-				num_active_big_flows++;
-                __atomic_fetch_add(&sb->num_active_big_flows, 1, __ATOMIC_RELAXED);
-				// num_active_small_flows++;
-				// printf("DEBUG POST SEND: INDEED increment SMALL flow counter\n");
-				// __atomic_fetch_add(&sb->num_active_small_flows, 1, __ATOMIC_RELAXED);
-				printf("DEBUG POST SEND: TPUT SENSITIVE\n");
-				break;
-			}
-			default:
-				break;
-			}
+			__atomic_store_n(&qp->split_sends_failed, 1, __ATOMIC_RELAXED);
+			continue;
 		}
-	}
-	/* end */
 
-	int ret = 0;
-	mlx4_lock(&qp->sq.lock);
-
-	//// splitting logic
-	//// Update split chunk size
-	uint32_t split_chunk_size = sb ? (wr->opcode == IBV_WR_RDMA_READ ? __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED)
-																	 : __atomic_load_n(&sb->active_chunk_size, __ATOMIC_RELAXED))
-								   : SPLIT_CHUNK_SIZE;
-	//if (++GLOBAL_CNT % 100 == 0) {
-	//printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 "\n", split_chunk_size);
-	//	printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 " [%d]\n", split_chunk_size, GLOBAL_CNT);
-	//	fflush(stdout);
-	//}
-	//printf("DEBUG: POST SEND: split_chunk_size = %" PRIu32 "; msg size = %d [%d]\n", split_chunk_size, wr->sg_list->length, ++GLOBAL_CNT);
-	//fflush(stdout);
-
-	int is_two_sided = 0;
-	int is_wimm = 0;
-	if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
-		wr->opcode == IBV_WR_SEND ||
-		wr->opcode == IBV_WR_SEND_WITH_IMM)
-	{
-		is_two_sided = 1;
-	}
-	if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
-	{
-		is_wimm = 1;
+		memset(&rwr, 0, sizeof(rwr));
+		rwr.wr_id = wc[i].wr_id;
+		if (mlx4_post_recv(qp->split_qp2, &rwr, &bad_rwr))
+			return -1;
+		__atomic_add_fetch(&qp->split_credits, ntohl(wc[i].imm_data), __ATOMIC_RELAXED);
+		if (__atomic_load_n(&qp->split_qp_exchange_done, __ATOMIC_RELAXED) == 2)
+			__atomic_store_n(&qp->split_qp_exchange_done, 1, __ATOMIC_RELEASE);
 	}
+	return ne;
+}
 
-	//// Now in two-sided case, the receiver will alywas try to get a split INFO message after receiving the first chunk (unless message is really small)
-	//// In other words, sender alywas send an extra INFO message (again unless msg is really small -- less than MIN_SPLIT_CHUNK_SIZE)
-	//// In the info message, we specify chunk_size and num_split_chunks (0 means no splitting)
+//// Reap the PD's shared split send cq without blocking: the completion of a chunk is counted
+//// for the user's qp named by its wr_id, which a chunk completing in error fails.
+//// Returns the number of completions reaped or -1.
+static int split_reap_sends(struct ibv_cq *split_send_cq)
+{
+	struct ibv_wc wc[SPLIT_CREDIT_REAP_BATCH];
+	int ne, i;
 
-	//if (wr->sg_list->length > split_chunk_size)
-	if (wr->sg_list->length > split_chunk_size ||
-		//(!is_wimm && (is_two_sided && wr->sg_list->length >= MIN_SPLIT_CHUNK_SIZE))) {
-		(is_two_sided && wr->sg_list->length >= MIN_SPLIT_CHUNK_SIZE))
+	ne = mlx4_poll_ibv_cq(split_send_cq, SPLIT_CREDIT_REAP_BATCH, wc);
+	for (i = 0; i < ne; i++)
 	{
+		struct mlx4_qp *qp = (struct mlx4_qp *)(uintptr_t)wc[i].wr_id;
 
-		//printf("[[[NEED TO SPLIT]]] [%d]\n", ++GLOBAL_CNT);
-
-		uint32_t num_chunks_to_send = 1;
-		uint32_t orig_num_chunks_to_send = 1;
-		uint32_t current_length = 0;
-		uint64_t orig_raddr = 0;
-		uint64_t orig_sge_addr = 0;
-		uint32_t orig_sge_length = 0;
-		int orig_send_flags = 0;
-
-		current_length = wr->sg_list->length;
-		orig_raddr = wr->wr.rdma.remote_addr;
-		orig_sge_addr = wr->sg_list->addr;
-		orig_sge_length = wr->sg_list->length;
-		orig_send_flags = wr->send_flags;
-
-		// For two-sided ops, the first chunk still need to be what it is originally,
-		// because the user will poll the first one at the end
-		//////wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-		//printf("IBV_SEND_SIGNALED: %d\n", IBV_SEND_SIGNALED);
-
-		//if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
-		//	wr->opcode == IBV_WR_SEND ||
-		//	wr->opcode == IBV_WR_SEND_WITH_IMM) { 				//// two-sided op
-
-		if (is_wimm)
-		{ // WIMM hack
-			//// num_chunks_to_send is the total chunks to send for the entire data. (including the chunk via user qp)
-			num_chunks_to_send = ceil_helper((double)orig_sge_length / (double)split_chunk_size);
-			uint32_t first_chunk_length = wr->sg_list->length % split_chunk_size;
-			if (first_chunk_length == 0)
-			{
-				first_chunk_length = split_chunk_size;
-			}
-			//printf("num_chunks_to_send = %d, first_chunk_length = %d\n", num_chunks_to_send, first_chunk_length);
-			//fflush(stdout);
-
-			if (num_chunks_to_send == 0)
-			{
-				printf("WRONG num_chunks_to_send\n");
-				return -1;
-			}
-
-			struct ibv_sge sge;
-			struct ibv_send_wr swr;
-			struct ibv_send_wr *bad_swr;
-			memset(&swr, 0, sizeof(swr));
-			memset(&sge, 0, sizeof(sge));
-			swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-			//printf("ORIG remote addr = %lu\n", wr->wr.rdma.remote_addr);
-			sge.addr = wr->sg_list->addr;
-			//printf("ORIG sge addr = %lu\n", wr->sg_list->addr);
-			sge.length = first_chunk_length;
-			sge.lkey = wr->sg_list->lkey;
-
-			//// (N-2) chunks send using WRITE
-			int i = 0;
-			if (num_chunks_to_send > 2)
-			{
+		if (wc[i].status != IBV_WC_SUCCESS)
+		{
+			fprintf(stderr, "split completion of qp %06x failed: %s\n", qp->verbs_qp.qp.qp_num,
+					ibv_wc_status_str(wc[i].status));
+			__atomic_store_n(&qp->split_sends_failed, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&qp->split_sends_done, 1, __ATOMIC_RELEASE);
+	}
+	return ne;
+}
 
-				for (i = 0; i < num_chunks_to_send - 2; i++)
-				{
-					swr.wr_id = i + 1;
-					swr.opcode = IBV_WR_RDMA_WRITE;
-					swr.sg_list = &sge;
-					swr.num_sge = 1;
-					swr.send_flags = (i == num_chunks_to_send - 3) ? (orig_send_flags | IBV_SEND_SIGNALED) : (orig_send_flags & (~(IBV_SEND_SIGNALED)));
-					//// No batch for now
-					swr.send_flags = (orig_send_flags | IBV_SEND_SIGNALED);
-					if (i == 0)
-					{
-						swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-					}
-					else if (i == 1)
-					{
-						swr.wr.rdma.remote_addr += first_chunk_length;
-					}
-					else
-					{
-						swr.wr.rdma.remote_addr += split_chunk_size;
-					}
-					swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-					swr.next = NULL;
+//// Reap one of the pool's shared cqs with reap, under its reap lock; the waiters are woken if
+//// anything was handed out. Returns what reap does.
+static int split_pool_reap(struct mlx4_split_pool *pool, struct mlx4_lock *lock, struct ibv_cq *cq,
+						   int (*reap)(struct ibv_cq *))
+{
+	int ne;
 
-					sge.length = (i == 0) ? first_chunk_length : split_chunk_size;
-					if (i == 0)
-					{
-						sge.addr = wr->sg_list->addr;
-					}
-					else if (i == 1)
-					{
-						sge.addr += first_chunk_length;
-					}
-					else
-					{
-						sge.addr += split_chunk_size;
-					}
-					sge.lkey = wr->sg_list->lkey;
+	mlx4_lock(lock);
+	ne = reap(cq);
+	mlx4_unlock(lock);
+	if (ne > 0)
+	{
+		pthread_mutex_lock(&pool->wait_mutex);
+		pthread_cond_broadcast(&pool->wait_cond);
+		pthread_mutex_unlock(&pool->wait_mutex);
+	}
+	return ne;
+}
 
-					// those WRs are handled by the split qp
-					ret = __mlx4_post_send(qp->split_qp[0], &swr, &bad_swr);
-					if (ret != 0)
-					{
-						errno = ret;
-						fprintf(stderr, "error posting SRs (WRITE) to split qp, errno = %d\n", errno);
-						goto out;
-					}
+//// Wait until done(qp) tells (1 done, -1 failed) while cq, one of the pool's shared cqs, is
+//// reaped with reap under lock. One waiter at a time reaps it (*reaper is set) and, once it is
+//// armed and still found empty, sleeps on its channel; the others sleep on the pool's wait_cond,
+//// so a completion reaped for another qp wakes that qp's waiter. done must not change
+//// anything, as it is also looked at without the wait mutex. Returns 0 or EIO.
+static int split_pool_wait(struct mlx4_split_pool *pool, struct mlx4_qp *qp, int *reaper,
+						   struct mlx4_lock *lock, struct ibv_cq *cq, struct ibv_comp_channel *channel,
+						   int (*reap)(struct ibv_cq *), int (*done)(struct mlx4_qp *))
+{
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	int ret, ne;
 
-					struct ibv_wc wc;
-					struct ibv_cq *ev_cq;
-					void *ev_ctx;
-					int ne = 0;
-					if (swr.send_flags == (orig_send_flags | IBV_SEND_SIGNALED))
-					{
-						if (SPLIT_USE_EVENT)
-						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-							if (ret)
-							{
-								fprintf(stderr, "Failed to get CQ event.\n");
-								return ret;
-							}
-
-							ibv_ack_cq_events(ev_cq, 1);
-
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
-						}
-						do
-						{
-							ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-							//printf("ne = %d\n", ne);
-						} while (ne == 0);
-					}
-					//printf("Send chunks using WRITE, length = %d; sge.addr = %lu; remote_addr = %lu\n", sge.length, sge.addr, swr.wr.rdma.remote_addr);
-					//fflush(stdout);
-				}
-			}
+	pthread_mutex_lock(&pool->wait_mutex);
+	while (!(ret = done(qp)))
+	{
+		if (*reaper)
+		{
+			pthread_cond_wait(&pool->wait_cond, &pool->wait_mutex);
+			continue;
+		}
+		*reaper = 1;
+		pthread_mutex_unlock(&pool->wait_mutex);
 
-			//// (N-1)th chunk sends using WIMM
-			//// if N == 1, still sends out an empty chunk using WIMM
-			if (num_chunks_to_send >= 1)
+		ne = split_pool_reap(pool, lock, cq, reap);
+		if (ne == 0 && SPLIT_USE_EVENT)
+		{
+			//// armed before the last look, so nothing that comes in after it is slept through
+			if (ibv_req_notify_cq(cq, 0))
+				ne = -1;
+			else if (!(ne = split_pool_reap(pool, lock, cq, reap)) && !done(qp))
 			{
-				swr.wr_id = i + 1;
-				swr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-				swr.sg_list = &sge;
-				swr.num_sge = 1;
-				swr.send_flags = (orig_send_flags | IBV_SEND_SIGNALED);
-				if (i == 0)
-				{
-					swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-				}
-				else if (i == 1)
-				{
-					swr.wr.rdma.remote_addr += first_chunk_length;
-				}
-				else
-				{
-					swr.wr.rdma.remote_addr += split_chunk_size;
-				}
-				swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-				swr.next = NULL;
-
-				if (i == 0)
-				{
-					sge.addr = wr->sg_list->addr;
-				}
-				else if (i == 1)
-				{
-					sge.addr += first_chunk_length;
-				}
-				else
-				{
-					sge.addr += split_chunk_size;
-				}
-				sge.lkey = wr->sg_list->lkey;
-				if (num_chunks_to_send == 1)
-				{
-					swr.num_sge = 0;
-					swr.sg_list = NULL;
-					sge.length = 0;
-				}
+				if (ibv_get_cq_event(channel, &ev_cq, &ev_ctx))
+					ne = -1;
 				else
-				{
-					sge.length = (i == 0) ? first_chunk_length : split_chunk_size;
-
-					++i;
-				}
-
-				ret = __mlx4_post_send(qp->split_qp[0], &swr, bad_wr);
-				if (ret != 0)
-				{
-					errno = ret;
-					fprintf(stderr, "error posting SRs (WRITE) to split qp, errno = %d\n", errno);
-					goto out;
-				}
-
-				struct ibv_wc wc;
-				struct ibv_cq *ev_cq;
-				void *ev_ctx;
-				int ne = 0;
-				if (SPLIT_USE_EVENT)
-				{
-					ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-					if (ret)
-					{
-						fprintf(stderr, "Failed to get CQ event.\n");
-						return ret;
-					}
-
 					ibv_ack_cq_events(ev_cq, 1);
-
-					ret = ibv_req_notify_cq(ev_cq, 0);
-					if (ret)
-					{
-						fprintf(stderr, "Couldn't request CQ notification\n");
-						return ret;
-					}
-				}
-				do
-				{
-					ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-					//printf("ne = %d\n", ne);
-				} while (ne == 0);
-			}
-			else
-			{
-				printf("Shouldn't be the case\n");
-				fflush(stdout);
-				return -1;
-			}
-
-			//printf("Finished sending %d th chunk via split qp using WIMM; length = %d; sge.addr = %lu; remote_addr = %lu\n", num_chunks_to_send - 1, sge.length, sge.addr, swr.wr.rdma.remote_addr);
-			//fflush(stdout);
-
-			//// N th chunk sends using WIMM via USER QP
-			//current_length = wr->sg_list->length - split_chunks_size * i;
-
-			swr.wr_id = wr->wr_id;
-			swr.opcode = wr->opcode;
-			swr.sg_list = &sge;
-			swr.num_sge = 1;
-			swr.send_flags = orig_send_flags;
-			if (i == 0)
-			{
-				swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
-			}
-			else if (i == 1)
-			{
-				swr.wr.rdma.remote_addr += first_chunk_length;
-			}
-			else
-			{
-				swr.wr.rdma.remote_addr += split_chunk_size;
-			}
-			swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-			swr.next = NULL;
-
-			//sge.length = current_length;
-			sge.length = (i == 0) ? first_chunk_length : split_chunk_size;
-			if (i == 0)
-			{
-				sge.addr = wr->sg_list->addr;
-			}
-			else if (i == 1)
-			{
-				sge.addr += first_chunk_length;
-			}
-			else
-			{
-				sge.addr += split_chunk_size;
-			}
-			sge.lkey = wr->sg_list->lkey;
-
-			//ret = __mlx4_post_send(ibqp, &swr, bad_wr);
-			wr->wr.rdma.remote_addr = swr.wr.rdma.remote_addr;
-			wr->sg_list->addr = sge.addr;
-			wr->sg_list->length = sge.length;
-			ret = __mlx4_post_send(ibqp, wr, bad_wr);
-			if (ret != 0)
-			{
-				errno = ret;
-				//printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-				goto out;
 			}
-
-			//printf("USER last chunk sent; length = %d; sge.addr = %lu; remote_addr = %lu\n", sge.length, sge.addr, swr.wr.rdma.remote_addr);
-			//fflush(stdout);
-
-			wr->wr.rdma.remote_addr = orig_raddr;
-			wr->sg_list->addr = orig_sge_addr;
-			wr->sg_list->length = orig_sge_length;
-			wr->send_flags = orig_send_flags;
-
-			mlx4_unlock(&qp->sq.lock);
-			return ret;
 		}
-		else if (is_two_sided)
-		{
-
-			//printf("[[[Splitting two-sided op]]]\n");
-			//printf("ORIG QP local QPN: %#06x\n", ibqp->qp_num);
-			//printf("SPLIT QP local QPN: %#06x\n", qp->split_qp->qp_num);
-
-			//// num_chunks_to_send here is the remainning chunks left to send to the receiver (not including the first one that has already been sent)
-			num_chunks_to_send = ceil_helper((double)orig_sge_length / (double)split_chunk_size) - 1;
-			if (num_chunks_to_send < 0)
-			{
-				printf("IMPOSSIBLE that chunks_to_split is < 0 since here orig_sge_length must be > 0\n");
-				return -1;
-			}
-			orig_num_chunks_to_send = num_chunks_to_send;
-
-			// <1> send the first chunk of message using user's qp
-			//printf("SENDER <1> send the first chunk of message using user's qp\n");
-			//fflush(stdout);
-
-			//// It is possible that the message is smaller than split_chunk_size.
-			//// In such case, we send out the original message.
-			if (wr->sg_list->length > split_chunk_size)
-			{
-				wr->sg_list->length = split_chunk_size;
-			}
-			//printf("first chunk message length = %" PRIu32 "\n", wr->sg_list->length);
-			//fflush(stdout);
-
-			ret = __mlx4_post_send(ibqp, wr, bad_wr);
-			if (ret != 0)
-			{
-				errno = ret;
-				goto out;
-			}
-
-			// <2> post a SR to split_qp to send num_split_chunks as well as the current(updated)_chunk_size to the receiver and poll its wc
-			//printf("SENDER <2> post a SR to split_qp to send num_split_chunks and current(updated)_chunk_size to the receiver and poll its wc\n");
-
-			qp->split_fc_msg[1].type = INFO;
-			qp->split_fc_msg[1].msg.split_chunk_info.num_split_chunks = num_chunks_to_send;
-			qp->split_fc_msg[1].msg.split_chunk_info.current_chunk_size = split_chunk_size;
-			//printf("DEBUG POST SEND: qp->split_fc_msg.msg.split_chunk_info.num_split_chunks: %d\n", qp->split_fc_msg[1].msg.split_chunk_info.num_split_chunks);
-			//printf("DEBUG POST SEND: qp->split_fc_msg.msg.split_chunk_info.current_chunk_size: %d\n", qp->split_fc_msg[1].msg.split_chunk_info.current_chunk_size);
-			//fflush(stdout);
-
-			struct ibv_sge ssge;
-			struct ibv_send_wr swr;
-			struct ibv_send_wr *bad_swr;
-
-			memset(&ssge, 0, sizeof(ssge));
-			ssge.addr = (uintptr_t)&qp->split_fc_msg[1];
-			ssge.length = sizeof(struct Split_FC_message);
-			ssge.lkey = qp->split_fc_mr->lkey;
-
-			memset(&swr, 0, sizeof(swr));
-			swr.wr_id = 0;
-			swr.sg_list = &ssge;
-			swr.num_sge = 1;
-			swr.opcode = IBV_WR_SEND;
-			swr.send_flags = IBV_SEND_SIGNALED;
-
-			int ret2;
-			ret2 = __mlx4_post_send(qp->split_qp[0], &swr, &bad_swr);
-			if (ret2 != 0)
-			{
-				errno = ret2;
-				fprintf(stderr, "DEBUG POST SEND: REALLY BAD!!, errno = %d\n", errno);
-			}
-
-			int ne = 0;
-			struct ibv_wc wc;
-			struct ibv_cq *ev_cq;
-			void *ev_ctx;
-			if (SPLIT_USE_EVENT)
-			{
-				ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-				if (ret)
-				{
-					fprintf(stderr, "Failed to get CQ event.\n");
-					return ret;
-				}
-
-				ibv_ack_cq_events(ev_cq, 1);
-
-				ret = ibv_req_notify_cq(ev_cq, 0);
-				if (ret)
-				{
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					return ret;
-				}
-			}
-			do
-			{
-				ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-			} while (ne == 0);
-
-			// <3> poll from split_cq for receiver's ACK
-			//printf("SENDER <3> poll from split_cq for receiver's ACK\n");
-			//fflush(stdout);
-			if (num_chunks_to_send > 0) {
-				if (SPLIT_USE_EVENT) {
-					ret = ibv_get_cq_event(qp->split_comp_channel2, &ev_cq, &ev_ctx);
-					if (ret)
-					{
-						fprintf(stderr, "Failed to get CQ event.\n");
-						return ret;
-					}
-
-					ibv_ack_cq_events(ev_cq, 1);
-
-					ret = ibv_req_notify_cq(ev_cq, 0);
-					if (ret)
-					{
-						fprintf(stderr, "Couldn't request CQ notification\n");
-						return ret;
-					}
-				}
-				do
-				{
-					ne = mlx4_poll_ibv_cq(qp->split_cq2, 1, &wc);
-				} while (ne == 0);
-				// check if the message is ACK: (for debug)
-				if (qp->split_fc_msg[2].type == ACK) {
-					//printf("INDEED received ACK from receiver.\n");
-					//fflush(stdout);
-				} else if (qp->split_fc_msg[2].type == INFO) {
-					printf("NOT ACK BUT INFO!\n");
-					fflush(stdout);
-					return -1;
-				}
-				else {
-					printf("NOT ACK BUT something else!\n");
-					fflush(stdout);
-					return -1;
-				}
-			}
-
-			// <4> send using split_qp with the rest of the original message chunks
-			printf("SENDER <4> send using split_qp with the rest of the original message [%d] chunks\n", num_chunks_to_send);
-			fflush(stdout);
-			//printf("SENDER <4> send using split_qp with the rest of the original message chunks using a linked list of WRs\n");
-
-			//// Batch using a linked list of WRs
-			/* still some issue, fix later
-			struct ibv_send_wr *wr_head = NULL, *current_wr = NULL, *new_wr = NULL;
-			struct ibv_sge *sge;
-			//TODO: later deallocate the heap memory
-			int i;
-			int num_unsignaled = num_chunks_to_send - 1;
-			printf("num_unsignaled: %d\n", num_unsignaled);
-			for (i = 0; i < num_unsignaled; i++) {
-				new_wr = (struct ibv_send_wr *)malloc(sizeof(struct ibv_send_wr));
-				memset(new_wr, 0, sizeof(struct ibv_send_wr));
-				sge = (struct ibv_sge *)malloc(sizeof(struct ibv_sge));
-				new_wr->wr_id = i + 1;
-				new_wr->opcode = wr->opcode;
-				new_wr->sg_list = sge;
-				new_wr->num_sge = 1;
-				new_wr->send_flags = 0; //covered by memset though
-				new_wr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-				new_wr->wr.rdma.rkey = wr->wr.rdma.rkey;
-				sge->length = split_chunk_size;
-				sge->addr = wr->sg_list->addr + split_chunk_size * i;
-				sge->lkey = wr->sg_list->lkey;
-				printf("sge->addr:%" PRIu64 "\n", sge->addr);
-				if (wr_head == NULL) {
-					wr_head = new_wr;
-					current_wr = wr_head;
-				} else {
-					current_wr->next = new_wr;
-					current_wr = current_wr->next;
-				}
-			}
-			// Last one with flag SIGNALED
-			current_length -= split_chunk_size * num_unsignaled;
-			new_wr = (struct ibv_send_wr *)malloc(sizeof(struct ibv_send_wr));
-			memset(new_wr, 0, sizeof(struct ibv_send_wr));
-			sge = (struct ibv_sge *)malloc(sizeof(struct ibv_sge));
-			new_wr->wr_id = i + 1;
-			new_wr->opcode = wr->opcode;
-			new_wr->sg_list = sge;
-			new_wr->num_sge = 1;
-			new_wr->send_flags = IBV_SEND_SIGNALED;
-			new_wr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-			new_wr->wr.rdma.rkey = wr->wr.rdma.rkey;
-			sge->length = current_length;
-			sge->addr = wr->sg_list->addr + split_chunk_size * i;
-			sge->lkey = wr->sg_list->lkey;
-			printf("sge->addr:%" PRIu64 "\n", sge->addr);
-			if (i == 0) {
-				wr_head = new_wr;
-				fprintf(stderr, "WARNING: linked list size shouldn't be that small\n");
-			} else {
-				current_wr->next = new_wr;
-				current_wr = current_wr->next;
-				current_wr->next = NULL;
-			}
-			ret = __mlx4_post_send(qp->split_qp, wr_head, bad_wr);
-			if (ret != 0) {
-				errno = ret;
-				printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-				goto out;
-			}
-			*/
-			//// End of using linked list
-
-			//wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-			if (!SPLIT_USE_SELECTIVE_SIGNALING)
-			{
-				wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-			}
-			else
-			{
-				wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-			}
-
-			// NOTE: if num_chunks_to_send = 0 here (which is possible), we will not post any WRs in the following loop.
-			while (num_chunks_to_send > 0)
-			{
-
-				//printf("DEBUG POST SEND: posting rest SRs to split_qp. num_chunks_to_send = %d\n", num_chunks_to_send);
-				//printf("raddr:%" PRIu64 "\n", wr->wr.rdma.remote_addr);
-				//printf("sg_addr:%" PRIu64 "\n", wr->sg_list->addr);
-				//printf("rkey:%" PRIu32 "\n", wr->wr.rdma.rkey);
-
-				current_length -= split_chunk_size;
-				wr->wr.rdma.remote_addr += split_chunk_size; // DC for SEND
-				wr->sg_list->addr += split_chunk_size;
-
-				if (num_chunks_to_send == 1)
-				{
-					wr->sg_list->length = current_length;
-					// the last one has to be SIGNALED to synchronize. Otherwise we'll go to the next iteration directly.
-					wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-				}
-
-				if (SPLIT_USE_NO_BATCH_2SIDED)
-				{
-					wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-				}
-
-				//__mlx4_post_send(qp->split_qp, wr, bad_wr);
-				ret = __mlx4_post_send(qp->split_qp[0], wr, bad_wr);
-				if (ret != 0)
-				{
-					errno = ret;
-					fprintf(stderr, "DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-					goto out;
-				}
-
-				num_chunks_to_send--;
 
-				if (SPLIT_USE_NO_BATCH_2SIDED)
-				{
-					if (SPLIT_USE_EVENT)
-					{
-						ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-						if (ret)
-						{
-							fprintf(stderr, "Failed to get CQ event.\n");
-							return ret;
-						}
-
-						ibv_ack_cq_events(ev_cq, 1);
-
-						ret = ibv_req_notify_cq(ev_cq, 0);
-						if (ret)
-						{
-							fprintf(stderr, "Couldn't request CQ notification\n");
-							return ret;
-						}
-					}
-					do
-					{
-						ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-						//printf("ne = %d\n", ne);
-					} while (ne == 0);
-				}
-			}
-
-			// <5> poll from the split_cq for all chunks to ensure the completion message has done transfering.
-			//printf("SENDER <5> poll from the split_cq for all chunks to ensure the completion message has done transfering.\n");
-			//printf("SENDER <5> Alternatively, post and poll without batch for all split chunks .\n");
-			//fflush(stdout);
-			//// All signalled
-			//TODO: if necessary, study the performance difference of polling multiple WCs at a time.
-			// Drawbacks of this is that you need to provide a big array of wc structs to pass in.
-			//printf("DEBUG POST_SEND: orig_num_chunks_to_send = %d\n", orig_num_chunks_to_send);
-
-			if (!SPLIT_USE_NO_BATCH_2SIDED)
-			{
-				if (orig_num_chunks_to_send > 0)
-				{ //// only if we indeed sent out some chunks
-					if (SPLIT_USE_SELECTIVE_SIGNALING)
-					{
-						//// selective signalling to poll the wc of the last wr
-						if (SPLIT_USE_EVENT)
-						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-							if (ret)
-							{
-								fprintf(stderr, "Failed to get CQ event.\n");
-								return ret;
-							}
-
-							ibv_ack_cq_events(ev_cq, 1);
-
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
-						}
-						do
-						{
-							ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-							//printf("ne = %d\n", ne);
-						} while (ne == 0);
-					}
-					else
-					{
-						int total_npolled = 0;
-						while (total_npolled < orig_num_chunks_to_send)
-						{
-							if (SPLIT_USE_EVENT)
-							{
-								ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-								if (ret)
-								{
-									fprintf(stderr, "Failed to get CQ event.\n");
-									return ret;
-								}
-
-								ibv_ack_cq_events(ev_cq, 1);
-
-								ret = ibv_req_notify_cq(ev_cq, 0);
-								if (ret)
-								{
-									fprintf(stderr, "Couldn't request CQ notification\n");
-									return ret;
-								}
-							}
-
-							do
-							{
-								//ne += mlx4_poll_ibv_cq(qp->split_cq, num_wrs_to_split_qp, &wc);
-								ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-								//printf("ne = %d\n", ne);
-								total_npolled += ne;
-								//printf("total_npolled = %d\n", total_npolled);
-							} while (ne != 0);
-						}
-					}
-				}
-			}
-
-			// <6> post another RR to split_qp for future splitting
-			//printf("SENDER <6> post another RR to split_qp for future splitting\n");
-			//fflush(stdout);
-
-			struct ibv_sge rsge;
-			struct ibv_recv_wr rwr;
-			struct ibv_recv_wr *bad_rwr;
-			memset(&rsge, 0, sizeof(rsge));
-			rsge.addr = (uintptr_t)&qp->split_fc_msg[2];
-			rsge.length = sizeof(struct Split_FC_message);
-			rsge.lkey = qp->split_fc_mr->lkey;
-			//printf("DDDDD: rsge.addr = %" PRIu64 "\n", rsge.addr);
-			//printf("DDDDD: rsge.length = %d \n", rsge.length);
-			//printf("DDDDD: rsge.lkey = %" PRIu32 "\n", rsge.lkey);
-
-			memset(&rwr, 0, sizeof(rwr));
-			rwr.wr_id = 0;
-			rwr.next = NULL;
-			rwr.sg_list = &rsge;
-			rwr.num_sge = 1;
-
-			ret2 = mlx4_post_recv(qp->split_qp2, &rwr, &bad_rwr);
-			if (ret2 != 0)
-			{
-				errno = ret2;
-				fprintf(stderr, "Failed to call mlx4_post_recv, errno = %d\n", errno);
-			}
-
-			//// Restore original qp before return
-			wr->wr.rdma.remote_addr = orig_raddr;
-			wr->sg_list->addr = orig_sge_addr;
-			wr->sg_list->length = orig_sge_length;
-			wr->send_flags = orig_send_flags;
-			mlx4_unlock(&qp->sq.lock);
-
-			return 0;
+		pthread_mutex_lock(&pool->wait_mutex);
+		*reaper = 0;
+		pthread_cond_broadcast(&pool->wait_cond);
+		if (ne < 0)
+		{
+			ret = -1;
+			break;
 		}
-		else if (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ)
-		{ // One-sided verbs
-
-            //// Dynamically adjust the number of split QPs (for one-sided verbs)
-            ////int num_split_qp = sb ? __atomic_load_n(&sb->num_active_split_qps, __ATOMIC_RELAXED) : SPLIT_QP_NUM_ONE_SIDED;
-            int num_split_qp = 1;
-
-			//// calculate num of chunks to split (based on the current(updated) chunk size) (1 + remaining)
-			num_chunks_to_send = ceil_helper((float)orig_sge_length / (float)split_chunk_size);
+	}
+	pthread_mutex_unlock(&pool->wait_mutex);
+	return ret < 0 ? EIO : 0;
+}
 
-            int num_wrs_to_split_qp = num_chunks_to_send - 1;
-            struct ibv_send_wr swr;
-            struct ibv_sge sge;
-            int i, j, qp_idx;
-            struct ibv_wc wc;
-            int ne = 0;
-            struct ibv_cq *ev_cq;
-            void *ev_ctx;
+static int split_sends_complete(struct mlx4_qp *qp)
+{
+	if (__atomic_load_n(&qp->split_sends_failed, __ATOMIC_RELAXED))
+		return -1;
+	return (int32_t)(__atomic_load_n(&qp->split_sends_done, __ATOMIC_ACQUIRE) - qp->split_sends_posted) >= 0;
+}
 
-#ifdef CPU_FRIENDLY
-            int split_idx = 0;
-            int num_big_chunks_to_send = 0;
-            int token_enforcement = 0;
-            uint32_t virtual_link_cap = 0;
-            double cpu_factor = 0;
-            char str;
-            // assume split_chunk_size is never greater than SPLIT_BIG_CHUNK_SIZE but only less than or equal to it
-            if (split_chunk_size < SPLIT_BIG_CHUNK_SIZE) {      // if token enforcement is needed
-                token_enforcement = 1;
-                num_big_chunks_to_send = ceil_helper((float)orig_sge_length / (float)SPLIT_BIG_CHUNK_SIZE);
-                num_chunks_to_send = ceil_helper((float)SPLIT_BIG_CHUNK_SIZE / (float)split_chunk_size);
-            } else {                                            // if no token enforcement (chunk_size = BIG_chunk_size)
-                num_big_chunks_to_send = 1;     // only execute the outter loop once
-                num_chunks_to_send = ceil_helper((float)orig_sge_length / (float)split_chunk_size);
-            }
-            //printf("PUPU num_big_chunks = %d\n", num_big_chunks_to_send);
-            //printf("num_split_qp = %d; num_chunks_to_send = %d\n", num_split_qp, num_chunks_to_send);
-
-            for (split_idx = 0; split_idx < num_big_chunks_to_send; split_idx++) {
-                // very last chunk go to user's own QP
-                num_wrs_to_split_qp = (num_big_chunks_to_send == 1) ? num_chunks_to_send - 1 : num_chunks_to_send;
-                //printf("num_wrs_to_split_qp at iteration %d = %d\n", split_idx, num_wrs_to_split_qp);
-
-                if (token_enforcement) {    // has to turn on pacer
-                    __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-                    virtual_link_cap = __atomic_load_n(&sb->virtual_link_cap, __ATOMIC_RELAXED);
-                    cpu_factor = cpu_factor_table[__atomic_load_n(&sb->split_level, __ATOMIC_RELAXED)];
-                    //printf("cpu_factor = %.2f\n", cpu_factor);
-
-                    //printf("virtual link cap = %u", virtual_link_cap);
-                    if (recv(flow_socket, &str, 1, 0) > 0) {
-                        //printf("received a token\n");
-                    } else {
-                        printf("Error in recving tokens. Exit\n");
-                        exit(1);
-                    }
-                }
-#endif
+//// Wait for the completion of the signaled chunk just posted to split_qp[0] of qp
+static int split_wait_send(struct mlx4_qp *qp)
+{
+	struct mlx4_split_pool *pool = qp->split_pool;
 
-                //struct timeval tt1, tt2;
-				for (i = 0, j = 0; i < num_wrs_to_split_qp; i++, j++) {
-#ifdef CPU_FRIENDLY
-                    if (!token_enforcement) {   // has to turn on pacer
-                        __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
-                        //gettimeofday(&tt1,NULL);
-                        if (recv(flow_socket, &str, 1, 0) > 0) {
-                            //printf("received a token\n");
-                        } else {
-                            printf("Error in recving tokens. Exit\n");
-                            exit(1);
-                        }
-                        //gettimeofday(&tt2,NULL);
-                        //printf("elapsed time = %d us\n", (int)(tt2.tv_usec - tt1.tv_usec));
-                    }
-#endif
-					swr.wr_id = i + 1;
-					swr.opcode = wr->opcode;
-					swr.sg_list = &sge;
-					swr.num_sge = 1;
-					//swr.send_flags = (i == num_wrs_to_split_qp - 1 || (i + 1) % SPLIT_ONE_SIDED_BATCH_SIZE == 0) ? (orig_send_flags | IBV_SEND_SIGNALED) : (orig_send_flags & (~(IBV_SEND_SIGNALED)));
-                    //swr.send_flags = (i >= num_wrs_to_split_qp - num_split_qp) ? (orig_send_flags | IBV_SEND_SIGNALED) : (orig_send_flags & (~(IBV_SEND_SIGNALED)));
-#ifdef CPU_FRIENDLY
-                    if (!token_enforcement) {
-                        swr.send_flags = (orig_send_flags | IBV_SEND_SIGNALED);
-                    } else {
-                        // selective signaling
-                        swr.send_flags = (i >= num_wrs_to_split_qp - num_split_qp) ? (orig_send_flags | IBV_SEND_SIGNALED) : (orig_send_flags & (~(IBV_SEND_SIGNALED)));
-                    }
-#else
-                    // selective signaling
-                    swr.send_flags = (i >= num_wrs_to_split_qp - num_split_qp) ? (orig_send_flags | IBV_SEND_SIGNALED) : (orig_send_flags & (~(IBV_SEND_SIGNALED)));
+	qp->split_sends_posted++;
+	return split_pool_wait(pool, qp, &pool->send_reaper, &pool->send_lock, pool->send_cq,
+						   pool->send_channel, split_reap_sends, split_sends_complete);
+}
 
-#endif
+//// Post wr to the user's qp or one of its split qps, charged to the user's qp. Its tokens are
+//// taken first; the SQ lock of the qp it goes to is held only while the WQEs are written, so
+//// other threads posting to the user's qp get in between chunks.
+static inline int split_post_locked(struct mlx4_qp *qp, struct ibv_qp *ibqp, struct ibv_send_wr *wr)
+{
+	struct mlx4_qp *sq = to_mqp(ibqp);
+	struct ibv_send_wr *bad_swr;
+	int ret;
 
 #ifndef CPU_FRIENDLY
-					swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-#else
-					swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_idx * SPLIT_BIG_CHUNK_SIZE + split_chunk_size * i;
+	justitia_pace_chain(qp, wr, NULL);
 #endif
-					swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-					swr.next = NULL;
+	mlx4_lock(&sq->sq.lock);
+	ret = __mlx4_post_send(ibqp, wr, &bad_swr, qp);
+	mlx4_unlock(&sq->sq.lock);
+	return ret;
+}
 
-					sge.length = split_chunk_size;
+//// Number of arena chunks that may go out under a single doorbell.
+//// Bandwidth flows are charged per chunk before it is posted, so each of their
+//// chunks is rung on its own; throughput flows are debited per chain and get at most
+//// active_batch_ops chunks per token; unpaced flows release the whole window at once.
+static inline uint32_t split_token_batch(struct mlx4_qp *qp, uint32_t window)
+{
+	uint32_t batch = window;
+	int cls = justitia_class(qp);
+
+	if (cls < 0)
+		return batch;
 #ifndef CPU_FRIENDLY
-					sge.addr = wr->sg_list->addr + split_chunk_size * i;
+	if (cls == 0)
+	{
+		batch = 1;
+	}
+	else if (cls == 2)
+	{
+		uint32_t ops = __atomic_load_n(&qp->pace.sb->active_batch_ops, __ATOMIC_RELAXED);
+		if (ops && ops < batch)
+			batch = ops;
+	}
 #else
-					sge.addr = wr->sg_list->addr + split_idx * SPLIT_BIG_CHUNK_SIZE + split_chunk_size * i;
+	batch = 1;
 #endif
-					sge.lkey = wr->sg_list->lkey;
+	return batch;
+}
 
-					// those WRs are handled by the split qp
 #ifdef CPU_FRIENDLY
-                    if (token_enforcement) {
-                        cycles_t start_cycle = get_cycles();
-                        //while (get_cycles() - start_cycle < cpu_mhz * 5000 / 4400)
-                        ////while (get_cycles() - start_cycle < cpu_mhz * split_chunk_size / 4400)
-                        ////virtual_link_cap = __atomic_load_n(&sb->virtual_link_cap, __ATOMIC_RELAXED);
-                        while (get_cycles() - start_cycle < cpu_mhz * cpu_factor * split_chunk_size / virtual_link_cap)
-                            cpu_relax();
-                        //gettimeofday(&tt2,NULL);
-                        //printf("elapsed time = %d us\n", (int)(tt2.tv_usec - tt1.tv_usec));
-                    }
-#endif
-					qp_idx = j % num_split_qp;      // no longer use multiple sqps; qp_idx should always be 0 now.
-					ret = __mlx4_post_send(qp->split_qp[qp_idx], &swr, bad_wr);
-					if (ret != 0)
-					{
-						errno = ret;
-						fprintf(stderr, "error posting one-sided send requests to split qp, errno = %d\n", errno);
-						goto out;
-					}
+//// Token handshake over the flow socket before posting a split chunk.
+//// Chunks smaller than SPLIT_BIG_CHUNK_SIZE share one token and are spaced out locally.
+static inline void split_cpu_friendly_token(struct mlx4_qp *qp, uint32_t chunk_idx,
+					    uint32_t split_chunk_size)
+{
+	struct justitia_flow *jf = &qp->pace;
+	uint32_t chunks_per_token = 1;
 
-					if (swr.send_flags == (orig_send_flags | IBV_SEND_SIGNALED))
-					{
-						//printf("indeed signalled; i = %d; var = %d\n", i, num_wrs_to_split_qp - num_split_qp);
-						if (SPLIT_USE_EVENT)
-						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-							if (ret)
-							{
-								fprintf(stderr, "Failed to get CQ event.\n");
-								return ret;
-							}
-
-							ibv_ack_cq_events(ev_cq, 1);
-
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
-						}
-						//// selective signalling to poll the wc of the last wr
-						do
-						{
-							ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-							//printf("ne = %d\n", ne);
-						} while (ne == 0);
-					}
-				}
+	mlx4_lock(&qp->pace_lock);
 
-                current_length -= split_chunk_size * num_wrs_to_split_qp;
-#ifdef CPU_FRIENDLY
-			}
-#endif
+	if (split_chunk_size < SPLIT_BIG_CHUNK_SIZE)
+		chunks_per_token = (SPLIT_BIG_CHUNK_SIZE + split_chunk_size - 1) / split_chunk_size;
 
-            // Very last one with the original send flag post to user's QP so the user can possibly poll its wc
-            swr.wr_id = wr->wr_id;
-            swr.opcode = wr->opcode;
-            swr.sg_list = &sge;
-            swr.num_sge = 1;
-            swr.send_flags = orig_send_flags;
-            //swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-            swr.wr.rdma.remote_addr += split_chunk_size;
-            swr.wr.rdma.rkey = wr->wr.rdma.rkey;
-            ////swr.next = NULL;	// wrong!
-			swr.next = wr->next;    //TODO: fix this in all other verbs/cases
-
-            sge.length = current_length;
-            //sge.addr = wr->sg_list->addr + split_chunk_size * i;
-            sge.addr += split_chunk_size;
-            sge.lkey = wr->sg_list->lkey;
-            //printf("sge->addr:%" PRIu64 "; send_flag: %d\n", sge[i].addr, new_wr[i].send_flags);
-            //printf("DDDDDDD:  i = %d; current_length = %d\n", i, current_length);
+	if (chunk_idx % chunks_per_token == 0)
+	{
+		justitia_msg_publish(jf, split_chunk_size);
+		justitia_wait_token(jf);
+	}
 
-#ifdef CPU_FRIENDLY
-            if (!token_enforcement) {
-                ret = __mlx4_post_send_BIG(ibqp, &swr, bad_wr);
-            } else {
-                ret = __mlx4_post_send(ibqp, &swr, bad_wr);
-            }
-#else
-            ret = __mlx4_post_send(ibqp, &swr, bad_wr);
+	if (chunks_per_token > 1)
+	{
+		uint32_t virtual_link_cap = __atomic_load_n(&jf->sb->virtual_link_cap, __ATOMIC_RELAXED);
+		double cpu_factor = cpu_factor_table[__atomic_load_n(&jf->sb->split_level, __ATOMIC_RELAXED)];
+		cycles_t start_cycle = get_cycles();
+		cycles_t wait = virtual_link_cap ? cpu_mhz * cpu_factor * split_chunk_size / virtual_link_cap : 0;
+
+		while (get_cycles() - start_cycle < wait)
+			cpu_relax();
+	}
+	justitia_msg_charged(jf, split_chunk_size);
+	mlx4_unlock(&qp->pace_lock);
+}
 #endif
-            if (ret != 0)
-            {
-                errno = ret;
-                printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-                goto out;
-            }
-
-            mlx4_unlock(&qp->sq.lock);
-            return ret;
-            /*
-			else
-			{
-				//// Batch using a linked list of WRs
-				struct ibv_send_wr *wr_head = NULL, *current_wr = NULL, *new_wr = NULL;
-				struct ibv_sge *sge;
-				new_wr = (struct ibv_send_wr *)malloc(num_chunks_to_send * sizeof(struct ibv_send_wr));
-				memset(new_wr, 0, num_chunks_to_send * sizeof(struct ibv_send_wr));
-				sge = (struct ibv_sge *)malloc(num_chunks_to_send * sizeof(struct ibv_sge));
-				memset(sge, 0, num_chunks_to_send * sizeof(struct ibv_sge));
-
-				int i;
-				int num_wrs_to_split_qp = num_chunks_to_send - 1;
-				//printf("num_unsignaled: %d\n", num_unsignaled);
-				// use a linked list to post the unsignaled ones
-				for (i = 0; i < num_wrs_to_split_qp; i++)
-				{
-					new_wr[i].wr_id = i + 1;
-					new_wr[i].opcode = wr->opcode;
-					new_wr[i].sg_list = &sge[i];
-					new_wr[i].num_sge = 1;
-					//new_wr[i].send_flags = (i == num_wrs_to_split_qp - 1 || !SPLIT_USE_SELECTIVE_SIGNALING) ? IBV_SEND_SIGNALED : 0; // last one is signaled for synchronization
-					new_wr[i].send_flags = (i == num_wrs_to_split_qp - 1 || !SPLIT_USE_SELECTIVE_SIGNALING) ? (orig_send_flags | IBV_SEND_SIGNALED) : (orig_send_flags & (~(IBV_SEND_SIGNALED)));
-					//new_wr[i].send_flags = IBV_SEND_SIGNALED;
-					new_wr[i].wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-					new_wr[i].wr.rdma.rkey = wr->wr.rdma.rkey;
-
-					sge[i].length = split_chunk_size;
-					sge[i].addr = wr->sg_list->addr + split_chunk_size * i;
-					sge[i].lkey = wr->sg_list->lkey;
-					//printf("sge->addr:%" PRIu64 "; send_flag: %d\n", sge[i].addr, new_wr[i].send_flags);
-
-					if (wr_head == NULL)
-					{
-						wr_head = &new_wr[i];
-						current_wr = wr_head;
-					}
-					else
-					{
-						current_wr->next = &new_wr[i];
-						current_wr = current_wr->next;
-					}
-				}
-				current_wr->next = NULL;
-				// those WRs are handled by the split qp
-				ret = __mlx4_post_send(qp->split_qp[0], wr_head, bad_wr);
-				if (ret != 0)
-				{
-					errno = ret;
-					fprintf(stderr, "error posting one-sided send requests to split qp, errno = %d\n", errno);
-					goto out;
-				}
 
-				//// selective signalling to poll the wc of the last wr
-				struct ibv_wc wc;
-				int ne = 0;
-				struct ibv_cq *ev_cq;
-				void *ev_ctx;
-				if (SPLIT_USE_SELECTIVE_SIGNALING)
-				{
-					if (SPLIT_USE_EVENT)
-					{
-						ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-						if (ret)
-						{
-							fprintf(stderr, "Failed to get CQ event.\n");
-							return ret;
-						}
-
-						ibv_ack_cq_events(ev_cq, 1);
-
-						ret = ibv_req_notify_cq(ev_cq, 0);
-						if (ret)
-						{
-							fprintf(stderr, "Couldn't request CQ notification\n");
-							return ret;
-						}
-					}
-					//// selective signalling to poll the wc of the last wr
-					do
-					{
-						ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-						//printf("ne = %d\n", ne);
-					} while (ne == 0);
-				}
-				else
-				{
-					int total_npolled = 0;
-					while (total_npolled < num_wrs_to_split_qp)
-					{
-						if (SPLIT_USE_EVENT)
-						{
-							ret = ibv_get_cq_event(qp->split_comp_send_channel, &ev_cq, &ev_ctx);
-							if (ret)
-							{
-								fprintf(stderr, "Failed to get CQ event.\n");
-								return ret;
-							}
-
-							ibv_ack_cq_events(ev_cq, 1);
-
-							ret = ibv_req_notify_cq(ev_cq, 0);
-							if (ret)
-							{
-								fprintf(stderr, "Couldn't request CQ notification\n");
-								return ret;
-							}
-						}
-
-						do
-						{
-							//ne += mlx4_poll_ibv_cq(qp->split_cq, num_wrs_to_split_qp, &wc);
-							ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-							//printf("ne = %d\n", ne);
-							total_npolled += ne;
-						} while (ne != 0);
-					}
-				}
+static int split_credits_free(struct mlx4_qp *qp)
+{
+	if (__atomic_load_n(&qp->split_sends_failed, __ATOMIC_RELAXED))
+		return -1;
+	return __atomic_load_n(&qp->split_credits, __ATOMIC_RELAXED) > 0;
+}
+
+//// Wait until the peer has a receive slot free for our two-sided chunks and take up to want
+//// of the free ones (split_credit.h); *taken tells how many.
+static int split_take_credits(struct mlx4_qp *qp, uint32_t want, uint32_t *taken)
+{
+	struct mlx4_split_pool *pool = qp->split_pool;
+
+	while (!(*taken = split_credit_take(&qp->split_credits, want)))
+	{
+		if (split_pool_wait(pool, qp, &pool->cq2_reaper, &pool->cq2_lock, pool->cq2, pool->channel2,
+							split_reap_credits, split_credits_free))
+		{
+			fprintf(stderr, "split: reaping credits of qp %06x failed\n", qp->verbs_qp.qp.qp_num);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+//// Post bytes [offset, offset + length) of the user wr to the split qp as chunks of
+//// split_chunk_size built in the per-QP arena; a chunk takes as many SGEs of the user's
+//// sg_list as it spans, and the user's wr/sg_list are only read.
+//// Chunks go out in arena-sized windows whose last chunk is signaled and reaped before the
+//// arena and the split SQ are reused. Within a window, one token batch = one doorbell.
+//// Two-sided chunks (IBV_WR_SEND_WITH_IMM) land in the peer's receive slots: a window is as
+//// many chunks as there are credits free (at least one is waited for). Chunks carry the
+//// user's imm; the receiver takes it from the last one.
+static int split_post_chunks(struct mlx4_qp *qp, struct ibv_send_wr *wr,
+							 enum ibv_wr_opcode opcode, uint64_t offset,
+							 uint64_t length, uint32_t split_chunk_size, int paced)
+{
+	struct split_arena *arena = &qp->split_arena;
+	struct split_sge_cursor cursor;
+	uint64_t num_chunks = (length + split_chunk_size - 1) / split_chunk_size;
+	int credited = opcode == IBV_WR_SEND_WITH_IMM;
+	uint32_t chunk_idx = 0;
+	uint32_t window, batch, i;
+	int ret;
+
+	split_sge_seek(&cursor, wr->sg_list, wr->num_sge, offset);
 
-				// Very last one with the original send flag post to user's QP so it can possibly poll its wc
-				current_length -= split_chunk_size * num_wrs_to_split_qp;
-
-				new_wr[i].wr_id = wr->wr_id;
-				new_wr[i].opcode = wr->opcode;
-				new_wr[i].sg_list = &sge[i];
-				new_wr[i].num_sge = 1;
-				new_wr[i].send_flags = orig_send_flags;
-				new_wr[i].wr.rdma.remote_addr = wr->wr.rdma.remote_addr + split_chunk_size * i;
-				new_wr[i].wr.rdma.rkey = wr->wr.rdma.rkey;
-				new_wr[i].next = NULL;
-
-				sge[i].length = current_length;
-				sge[i].addr = wr->sg_list->addr + split_chunk_size * i;
-				sge[i].lkey = wr->sg_list->lkey;
-				//printf("sge->addr:%" PRIu64 "; send_flag: %d\n", sge[i].addr, new_wr[i].send_flags);
-				//printf("DDDDDDD:  i = %d; current_length = %d\n", i, current_length);
-
-				ret = __mlx4_post_send(ibqp, &new_wr[i], bad_wr);
-				if (ret != 0)
-				{
-					errno = ret;
-					//printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-					goto out;
-				}
+	while (num_chunks)
+	{
+		window = num_chunks < arena->capacity ? num_chunks : arena->capacity;
+		if (credited)
+		{
+			ret = split_take_credits(qp, window, &window);
+			if (ret)
+				return ret;
+		}
+		batch = split_token_batch(qp, window);
 
-				// clean up wr & sge mem on heap
-				free(new_wr);
-				free(sge);
+		for (i = 0; i < window; i++)
+		{
+			struct ibv_send_wr *swr = &arena->wr[i];
+			struct ibv_sge *sge = &arena->sge[i * arena->max_sge];
+			uint32_t len = length < split_chunk_size ? length : split_chunk_size;
+
+			swr->num_sge = split_sge_fill(&cursor, wr->sg_list, wr->num_sge, len, sge, arena->max_sge);
+			if (swr->num_sge < 0)
+				return EINVAL;
+
+			swr->wr_id = (uintptr_t)qp;
+			swr->opcode = opcode;
+			swr->sg_list = sge;
+			swr->send_flags = (i == window - 1) ? (wr->send_flags | IBV_SEND_SIGNALED) : (wr->send_flags & ~IBV_SEND_SIGNALED);
+			swr->imm_data = wr->imm_data;
+			swr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + offset;
+			swr->wr.rdma.rkey = wr->wr.rdma.rkey;
+			swr->next = ((i + 1) % batch && i + 1 < window) ? &arena->wr[i + 1] : NULL;
+
+			offset += len;
+			length -= len;
+		}
 
-				//// End of using linked list
-				mlx4_unlock(&qp->sq.lock);
+		for (i = 0; i < window; i += batch)
+		{
+#ifdef CPU_FRIENDLY
+			if (paced && qp->pace.flow)
+				split_cpu_friendly_token(qp, chunk_idx + i, split_chunk_size);
+#endif
+			ret = split_post_locked(qp, qp->split_qp[0], &arena->wr[i]);
+			if (ret)
+			{
+				fprintf(stderr, "error posting split chunks to split qp, errno = %d: %s\n", ret, strerror(ret));
 				return ret;
 			}
-            */
 		}
-	}
 
-#ifdef DRIVER_MEASURE_LAT
-	//// TIMESTAMP
-	// For latency-sensitive QP, keep the timestamp
-	if (likely(qp->isSmall == 1) && (wr->send_flags & IBV_SEND_SIGNALED))
-	{
-		queue_push(qp->orig_send_cq->wr_timestamps, get_cycles());
+		ret = split_wait_send(qp);
+		if (ret)
+			return ret;
+
+		if (qp->pace.flow)
+			justitia_stat_add(&qp->pace.sb->stats[qp->pace.slot].chunks, window);
+		chunk_idx += window;
+		num_chunks -= window;
 	}
-	////
-#endif
 
-	//// if not splitting or other atomic verbs, act like normal
-#ifdef CPU_FRIENDLY
-	ret = __mlx4_post_send_BIG(ibqp, wr, bad_wr);
-#else
-	ret = __mlx4_post_send(ibqp, wr, bad_wr);
-#endif
-out:
-	mlx4_unlock(&qp->sq.lock);
-	return ret;
+	return 0;
 }
 
-//// old version with one-sided verbs using user's own qp
-int orig_mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-						struct ibv_send_wr **bad_wr)
+//// Post bytes [offset, offset + length) of the user's wr to the user's qp as one WR built
+//// in the first arena slot, so the user's completion (if signaled) still comes from its own qp.
+//// The piece of a two-sided split message carries mark (split_imm_mark) as its imm instead of
+//// the user's; pieces of one-sided verbs pass 0.
+static int split_post_user_tail(struct mlx4_qp *qp, struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+								uint64_t offset, uint32_t length, uint32_t mark)
 {
-	struct mlx4_qp *qp = to_mqp(ibqp);
-	void *uninitialized_var(ctrl);
-	unsigned int ind;
-	int nreq;
-	int inl = 0;
-	int ret = 0;
-	int size = 0;
-	////
-	//printf("sq.max_gs: %d; qp->sq.max_post: %d\n", qp->sq.max_gs, qp->sq.max_post);
-	/*
-	struct ibv_qp_attr attr0;
-	struct ibv_qp_init_attr init_attr0;
-	if (ibv_query_qp(ibqp, &attr0, IBV_QP_STATE, &init_attr0)) {
-		fprintf(stderr, "Failed to query QP state\n");
-		return -1;
-	}
-	//printf("DEBUG POST SEND INITIAL CHECK: lid: %04x\n", attr0.ah_attr.dlid);
-	printf("DEBUG POST SEND INITIAL CHECK: qpn:%#06x\n", ibqp->qp_num);
-	//printf("DEBUG POST SEND INITIAL CHECK: psn: %#06x\n", attr0.sq_psn);
-	//printf("DEBUG POST SEND INITIAL CHECK: port: %d\n", attr0.port_num);
-	printf("DEBUG POST SEND INITIAL CHECK: dest_qp_num: %#06x\n", attr0.dest_qp_num);
-	//printf("DEBUG POST SEND INITIAL CHECK: wr rkey: %#08x\n", wr->wr.rdma.rkey);
-	struct ibv_qp_attr attr1;
-	struct ibv_qp_init_attr init_attr1;
-	if (ibv_query_qp(qp->split_qp, &attr1, IBV_QP_STATE, &init_attr1)) {
-		fprintf(stderr, "Failed to query QP state\n");
-		return -1;
+	struct split_arena *arena = &qp->split_arena;
+	struct ibv_send_wr *swr = &arena->wr[0];
+	struct split_sge_cursor cursor;
+
+	*swr = *wr;
+	swr->next = NULL;
+	swr->sg_list = arena->sge;
+	split_sge_seek(&cursor, wr->sg_list, wr->num_sge, offset);
+	swr->num_sge = split_sge_fill(&cursor, wr->sg_list, wr->num_sge, length, arena->sge, arena->max_sge);
+	if (swr->num_sge < 0)
+		return EINVAL;
+	swr->wr.rdma.remote_addr += offset;
+	if (mark)
+	{
+		if (swr->opcode == IBV_WR_SEND)
+			swr->opcode = IBV_WR_SEND_WITH_IMM;
+		swr->imm_data = htonl(mark);
 	}
-	printf("DEBUG POST SEND INITIAL CHECK: SPLIT qpn:%#06x\n", qp->split_qp->qp_num);
-	printf("DEBUG POST SEND INITIAL CHECK: SPLIT dest_qp_num: %#06x\n", attr1.dest_qp_num);
-	*/
-	////
 
-	mlx4_lock(&qp->sq.lock);
+	return split_post_locked(qp, ibqp, swr);
+}
 
-	/* XXX check that state is OK to post send */
+//// split chunk size for a WR of this opcode on qp (READs are paced with their own chunk size)
+static inline uint32_t split_chunk_size_for(struct mlx4_qp *qp, struct ibv_send_wr *wr)
+{
+	struct shared_block *sb = qp->pace.sb;
 
-	ind = qp->sq.head;
+	if (!sb)
+		return SPLIT_CHUNK_SIZE;
+	return wr->opcode == IBV_WR_RDMA_READ ? __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED)
+										  : __atomic_load_n(&sb->active_chunk_size, __ATOMIC_RELAXED);
+}
+
+//// whether a WR carrying total bytes goes through the split path
+static inline int split_wr_needed(struct mlx4_qp *qp, struct ibv_send_wr *wr, uint64_t total,
+								  uint32_t split_chunk_size)
+{
+	if (wr->send_flags & IBV_SEND_INLINE)
+		return 0;
 
-	//for (nreq = 0; wr; ++nreq, wr = wr->next) {
-	for (nreq = 0; wr; wr = wr->next)
+	switch (wr->opcode)
 	{
-		/* to be considered whether can throw first check, create_qp_exp with post_send */
-		////
-		int is_completed = 0;
-		int need_reset = 0; //// as long as it is once split, this is set to 1.
-		//int is_split = 0;
-		int num_chunks_to_send = 1;
-		//int orig_num_chunks_to_send = 1;
-		int current_length = 0;
-		uint64_t orig_raddr = 0;
-		uint64_t orig_sge_addr = 0;
-		uint32_t orig_sge_length = 0;
-		int orig_send_flags = 0;
-		unsigned cur_sq_size;
-		//struct ibv_sge two_sided_sg_list[2];
-		//struct ibv_sge *orig_sg_list = NULL;
-		//struct two_sided_header header;
-		//struct header_buffer header_buf;
-
-		cur_sq_size = (&qp->sq)->head - (&qp->sq)->tail;
-		//printf("cur_sq_size = %u\n", cur_sq_size);
-		//printf("max_post = %u\n", (&qp->sq)->max_post);
-		if (likely(cur_sq_size + 1 < (&qp->sq)->max_post))
-		{
-			//if (likely(cur_sq_size + nreq + 1 < (&qp->sq)->max_post)) {
+	//// A receiver with slots for us takes chunks behind the receives we mark (split_sge.h);
+	//// the marked piece is at least split_min bytes, so shorter messages are not split.
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return qp->split_peer.recv_slots && total >= qp->split_peer.split_min;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_READ:
+		return total > split_chunk_size;
+	default:
+		return 0;
+	}
+}
 
-			if (wr->sg_list->length > SPLIT_CHUNK_SIZE)
-			{
-				//// if there is a need to split
-				//printf("[[[NEED TO SPLIT]]] [%d]\n", ++GLOBAL_CNT);
-				//is_split = 1;
-				need_reset = 1;
-
-				current_length = wr->sg_list->length;
-				orig_raddr = wr->wr.rdma.remote_addr;
-				orig_sge_addr = wr->sg_list->addr;
-				orig_sge_length = wr->sg_list->length;
-				orig_send_flags = wr->send_flags;
-
-				num_chunks_to_send = ceil_helper((float)orig_sge_length / (float)SPLIT_CHUNK_SIZE);
-				//printf("(0) num_chunks_to_send: %d\n", num_chunks_to_send);
-				if (num_chunks_to_send > (&qp->sq)->max_post - cur_sq_size)
-				{
-					num_chunks_to_send = (&qp->sq)->max_post - cur_sq_size;
-				}
-				//orig_num_chunks_to_send = num_chunks_to_send;
-				//printf("(1) num_chunks_to_send: %d\n", num_chunks_to_send);
+//// An empty two-sided chunk on the split qp carrying imm; it takes a receive slot of the peer
+static int split_post_empty_chunk(struct mlx4_qp *qp, uint32_t imm)
+{
+	struct ibv_send_wr swr;
+	uint32_t taken;
+	int ret;
 
-				wr->sg_list->length = SPLIT_CHUNK_SIZE;
-				//orig_sg_list = wr->sg_list;
+	memset(&swr, 0, sizeof(swr));
+	swr.wr_id = (uintptr_t)qp;
+	swr.opcode = IBV_WR_SEND_WITH_IMM;
+	swr.imm_data = imm;
+	swr.send_flags = IBV_SEND_SIGNALED;
+
+	ret = split_take_credits(qp, 1, &taken);
+	if (ret == 0)
+		ret = split_post_locked(qp, qp->split_qp[0], &swr);
+	if (ret == 0)
+		ret = split_wait_send(qp);
+	return ret;
+}
 
-				// For two-sided ops, the first one still need to be what it is originally,
-				// because the user will poll the first one at the end
-				//wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-				//printf("IBV_SEND_SIGNALED: %d\n", IBV_SEND_SIGNALED);
+//// Split a single WR (its next pointer is ignored) of total bytes.
+//// Returns 0 or an errno value; the caller owns the split lock of qp, not an SQ lock.
+static int split_one_wr(struct mlx4_qp *qp, struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+						uint64_t total_length, uint32_t split_chunk_size)
+{
+	uint32_t num_chunks_to_send;
+	uint32_t taken;
+	int ret;
 
-				if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
-					wr->opcode == IBV_WR_SEND ||
-					wr->opcode == IBV_WR_SEND_WITH_IMM)
-				{ //// two-sided op
+	//// the tokens its chunks ask for are for this whole message
+	qp->pace.msg_left = total_length;
 
-					num_chunks_to_send = ceil_helper((float)orig_sge_length / (float)SPLIT_CHUNK_SIZE);
+	if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+	{ // WIMM hack
+		//// The tail goes out as WIMM on the user's qp, the chunk before it as WIMM on the split qp
+		//// (it takes one of the peer's receive slots) and everything in front as WRITEs.
+		//// If there is nothing in front of the tail, the split qp still sends out an empty WIMM.
+		//// The tail is marked for the receiver (split_sge.h): the WIMM on the split qp tells it
+		//// the bytes in front of the tail, an empty chunk behind it the user's imm.
+		uint32_t tail_length = split_user_piece_length(total_length, split_chunk_size, qp->split_peer.split_min);
+		uint32_t wimm_length = total_length - tail_length < split_chunk_size ? total_length - tail_length : split_chunk_size;
+		uint64_t wimm_offset = total_length - tail_length - wimm_length;
+
+		if (wimm_offset)
+		{
+			ret = split_post_chunks(qp, wr, IBV_WR_RDMA_WRITE, 0, wimm_offset, split_chunk_size, 0);
+			if (ret != 0)
+				return ret;
+		}
 
-					//printf("[[[Splitting two-sided op]]]\n");
-					//printf("ORIG QP local QPN: %#06x\n", ibqp->qp_num);
-					//printf("SPLIT QP local QPN: %#06x\n", qp->split_qp->qp_num);
-					//// qpn hack:
-					//qp->split_qp->qp_num = ibqp->qp_num;
-					//printf("SPLIT QP local QPN: %#06x\n", qp->split_qp->qp_num);
+		struct split_sge_cursor cursor;
+		struct ibv_sge sge[qp->split_arena.max_sge];
+		struct ibv_send_wr swr;
+		memset(&swr, 0, sizeof(swr));
+		split_sge_seek(&cursor, wr->sg_list, wr->num_sge, wimm_offset);
+		swr.num_sge = split_sge_fill(&cursor, wr->sg_list, wr->num_sge, wimm_length, sge, qp->split_arena.max_sge);
+		if (swr.num_sge < 0)
+			return EINVAL;
+		swr.sg_list = swr.num_sge ? sge : NULL;
+		swr.wr_id = (uintptr_t)qp;
+		swr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+		//// the receiver adds the bytes in front of the tail to the byte_len of the user's completion
+		swr.imm_data = htonl((uint32_t)(total_length - tail_length));
+		swr.send_flags = (wr->send_flags | IBV_SEND_SIGNALED);
+		swr.wr.rdma.remote_addr = wr->wr.rdma.remote_addr + wimm_offset;
+		swr.wr.rdma.rkey = wr->wr.rdma.rkey;
+
+		ret = split_take_credits(qp, 1, &taken);
+		if (ret == 0)
+			ret = split_post_locked(qp, qp->split_qp[0], &swr);
+		if (ret == 0)
+			ret = split_wait_send(qp);
+		if (ret == 0)
+			ret = split_post_empty_chunk(qp, wr->imm_data);
+		if (ret != 0)
+		{
+			fprintf(stderr, "error posting SRs (WIMM) to split qp, errno = %d\n", ret);
+			return ret;
+		}
 
-					////
+		//// N th chunk sends using WIMM via USER QP
+		return split_post_user_tail(qp, ibqp, wr, total_length - tail_length, tail_length,
+									split_imm_mark(2, 1));
+	}
+	else if (wr->opcode == IBV_WR_SEND || wr->opcode == IBV_WR_SEND_WITH_IMM)
+	{
+		//// The first piece goes over the user's qp into the user's RR, marked with the number of
+		//// chunks behind it; the rest streams over the split qp into the peer's preposted receive
+		//// slots as long as we hold credits for them. The receiver copies each chunk into the
+		//// same RR and hands the slot back. A SEND_WITH_IMM has its imm on the last chunk.
+		uint32_t first_length = split_user_piece_length(total_length, split_chunk_size, qp->split_peer.split_min);
+		uint32_t chunk_size = split_chunk_size < qp->split_peer.slot_size ? split_chunk_size : qp->split_peer.slot_size;
+		uint64_t rest = total_length - first_length;
+		uint64_t chunks = rest ? (rest + chunk_size - 1) / chunk_size : 1;
+
+		if (chunks > SPLIT_IMM_CHUNKS)
+			return EINVAL;
+
+		// <1> send the first chunk of message using user's qp
+#ifdef JUSTITIA_DEBUG
+		printf("SENDER <1> send the first chunk of message using user's qp\n");
+		printf("first chunk message length = %" PRIu32 "\n", first_length);
+		fflush(stdout);
+#endif
+		ret = split_post_user_tail(qp, ibqp, wr, 0, first_length,
+								   split_imm_mark(chunks, wr->opcode == IBV_WR_SEND_WITH_IMM));
+		if (ret != 0)
+			return ret;
 
-					wr->sg_list->length++;
+		// <2> stream the rest of the message as chunks over split_qp
+#ifdef JUSTITIA_DEBUG
+		printf("SENDER <2> stream the rest of the original message [%" PRIu64 "] chunks\n", chunks);
+		fflush(stdout);
+#endif
+		if (rest)
+			return split_post_chunks(qp, wr, IBV_WR_SEND_WITH_IMM, first_length, rest, chunk_size, 0);
 
-					// Two-sided spliting
-					// <1> if message to send > CHUNK_SIZE, send first chunk with extra dummy byte using user's qp
-					printf("SENDER <1> if message to send > CHUNK_SIZE, send first chunk with extra dummy byte using user's qp\n");
-					ret = __mlx4_post_send(ibqp, wr, bad_wr);
-					if (ret != 0)
-					{
-						errno = ret;
-						goto out;
-					}
-					wr->sg_list->length--;
-
-					// <2> post a SR to split_qp to send num_chunks_to_send to the receiver and poll its wc
-					// will first implement WRITE_IMM
-					printf("SENDER <2> post a SR to split_qp to send num_chunks_to_send to the receiver and poll its wc\n");
-
-					//// temp for debugging:
-					//num_chunks_to_send = 1;
-					////
-
-					qp->split_fc_msg[1].type = INFO;
-					qp->split_fc_msg[1].msg.split_chunk_info.num_split_chunks = num_chunks_to_send;
-					printf("DEBUG POST SEND: qp->split_fc_msg.msg.split_chunk_info.num_split_chunks: %d\n", qp->split_fc_msg[1].msg.split_chunk_info.num_split_chunks);
-					num_chunks_to_send--;
-
-					struct ibv_sge ssge;
-					struct ibv_send_wr swr;
-					struct ibv_send_wr *bad_swr;
-
-					memset(&ssge, 0, sizeof(ssge));
-					ssge.addr = (uintptr_t)&qp->split_fc_msg[1];
-					ssge.length = sizeof(struct Split_FC_message);
-					ssge.lkey = qp->split_fc_mr->lkey;
-
-					memset(&swr, 0, sizeof(swr));
-					swr.wr_id = 0;
-					swr.sg_list = &ssge;
-					swr.num_sge = 1;
-					swr.opcode = IBV_WR_SEND;
-					swr.send_flags = IBV_SEND_SIGNALED;
-
-					int ret2;
-					ret2 = __mlx4_post_send(qp->split_qp[0], &swr, &bad_swr);
-					if (ret2 != 0)
-					{
-						errno = ret2;
-						printf("DEBUG POST SEND: REALLY BAD!!, errno = %d\n", errno);
-					}
+		//// nothing left for the split qp: an empty chunk still ends the message
+		return split_post_empty_chunk(qp, wr->imm_data);
+	}
 
-					int ne = 0;
-					struct ibv_wc wc;
-					do
-					{
-						ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-					} while (ne == 0);
+	//// One-sided verbs: all chunks but the last one go through the split qp as arena chains
+	num_chunks_to_send = (total_length + split_chunk_size - 1) / split_chunk_size;
+	uint64_t split_length = (uint64_t)(num_chunks_to_send - 1) * split_chunk_size;
 
-					// <3> poll from split_cq for receiver's ACK
-					// TODO: do event-triggered later
-					printf("SENDER <3> poll from split_cq for receiver's ACK\n");
-					do
-					{
-						ne = mlx4_poll_ibv_cq(qp->split_recv_cq, 1, &wc);
-					} while (ne == 0);
-					// check if the message is ACK: (for debug)
-					if (qp->split_fc_msg[0].type == ACK)
-					{
-						printf("INDEED received ACK from receiver.\n");
-					}
+	ret = split_post_chunks(qp, wr, wr->opcode, 0, split_length, split_chunk_size, 1);
+	if (ret != 0)
+		return ret;
 
-					// <4> send using split_qp with the rest of the original message chunks using a linked list of WRs.
-					printf("SENDER <4> send using split_qp with the rest of the original message chunks\n");
-					//printf("SENDER <4> send using split_qp with the rest of the original message chunks using a linked list of WRs\n");
-
-					//// Batch using a linked list of WRs
-					/* still some issue, fix later
-					struct ibv_send_wr *wr_head = NULL, *current_wr = NULL, *new_wr = NULL;
-					struct ibv_sge *sge;
-					//TODO: later deallocate the heap memory
-
-					int i;
-					int num_unsignaled = num_chunks_to_send - 1;
-					printf("num_unsignaled: %d\n", num_unsignaled);
-					for (i = 0; i < num_unsignaled; i++) {
-						new_wr = (struct ibv_send_wr *)malloc(sizeof(struct ibv_send_wr));
-						memset(new_wr, 0, sizeof(struct ibv_send_wr));
-						sge = (struct ibv_sge *)malloc(sizeof(struct ibv_sge));
-
-						new_wr->wr_id = i + 1;
-						new_wr->opcode = wr->opcode;
-						new_wr->sg_list = sge;
-						new_wr->num_sge = 1;
-						new_wr->send_flags = 0; //covered by memset though
-						new_wr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + SPLIT_CHUNK_SIZE * i;
-						new_wr->wr.rdma.rkey = wr->wr.rdma.rkey;
-
-						sge->length = SPLIT_CHUNK_SIZE;
-						sge->addr = wr->sg_list->addr + SPLIT_CHUNK_SIZE * i;
-						sge->lkey = wr->sg_list->lkey;
-						printf("sge->addr:%" PRIu64 "\n", sge->addr);
-
-						if (wr_head == NULL) {
-							wr_head = new_wr;
-							current_wr = wr_head;
-						} else {
-							current_wr->next = new_wr;
-							current_wr = current_wr->next;
-						}
-					}
+	// Very last one with the original send flag post to user's QP so the user can possibly poll its wc
+#ifdef CPU_FRIENDLY
+	if (qp->pace.flow)
+		split_cpu_friendly_token(qp, num_chunks_to_send - 1, split_chunk_size);
+#endif
+	return split_post_user_tail(qp, ibqp, wr, split_length, total_length - split_length, 0);
+}
 
-					// Last one with flag SIGNALED
-					current_length -= SPLIT_CHUNK_SIZE * num_unsignaled;
-					new_wr = (struct ibv_send_wr *)malloc(sizeof(struct ibv_send_wr));
-					memset(new_wr, 0, sizeof(struct ibv_send_wr));
-					sge = (struct ibv_sge *)malloc(sizeof(struct ibv_sge));
-
-					new_wr->wr_id = i + 1;
-					new_wr->opcode = wr->opcode;
-					new_wr->sg_list = sge;
-					new_wr->num_sge = 1;
-					new_wr->send_flags = IBV_SEND_SIGNALED;
-					new_wr->wr.rdma.remote_addr = wr->wr.rdma.remote_addr + SPLIT_CHUNK_SIZE * i;
-					new_wr->wr.rdma.rkey = wr->wr.rdma.rkey;
-
-					sge->length = current_length;
-					sge->addr = wr->sg_list->addr + SPLIT_CHUNK_SIZE * i;
-					sge->lkey = wr->sg_list->lkey;
-					printf("sge->addr:%" PRIu64 "\n", sge->addr);
-
-					if (i == 0) {
-						wr_head = new_wr;
-						printf("WARNING\n");
-					} else {
-						current_wr->next = new_wr;
-						current_wr = current_wr->next;
-						current_wr->next = NULL;
-					}
+//// Send our EXCHANGE (split_exchange.h) on the user's qp, SQ lock held, if it is still owed:
+//// ahead of the application's first post, or from the exchange thread in answer to the
+//// peer's. It goes outside of the pacer and splitting, and its completion is kept from the
+//// application.
+static int split_post_exchange_locked(struct mlx4_qp *qp)
+{
+	struct ibv_sge sge;
+	struct ibv_send_wr wr;
+	struct ibv_send_wr *bad_wr;
+	int ret;
 
-					ret = __mlx4_post_send(qp->split_qp, wr_head, bad_wr);
-					if (ret != 0) {
-						errno = ret;
-						printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-						goto out;
-					}
-					*/
-					//// End of using linked list
-
-					// Originally WRs were not sent in a linked list
-					// starting from the 2nd chunk, all set to unsignaled
-					// ^^^ Actually in this case every chunk needs to be SIGNALED
-					//wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-					// ^^^ Well, not necesarily...
-					wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-
-					//int cnt = 0;
-					while (num_chunks_to_send > 0)
-					{
-						current_length -= SPLIT_CHUNK_SIZE;
-						wr->wr.rdma.remote_addr += SPLIT_CHUNK_SIZE;
-						wr->sg_list->addr += SPLIT_CHUNK_SIZE;
-						//sleep(2);
-
-						//printf("DEBUG POST SEND: posting rest SRs to split_qp. num_chunks_to_send = %d\n", num_chunks_to_send);
-						//printf("raddr:%" PRIu64 "\n", wr->wr.rdma.remote_addr);
-						//printf("sg_addr:%" PRIu64 "\n", wr->sg_list->addr);
-						//printf("rkey:%" PRIu32 "\n", wr->wr.rdma.rkey);
-						if (num_chunks_to_send == 1)
-						{
-							wr->sg_list->length = current_length;
-							// the last one has to be SIGNALED to synchronize. Otherwise we'll go to the next iteration directly.
-							wr->send_flags = IBV_SEND_SIGNALED;
-						}
-
-						//__mlx4_post_send(qp->split_qp, wr, bad_wr);
-						ret = __mlx4_post_send(qp->split_qp[0], wr, bad_wr);
-						//cnt++;
-						//printf("post_send [%d]\n", cnt);
-						if (ret != 0)
-						{
-							errno = ret;
-							printf("DEBUG POST SEND REALLY BAD!!, errno = %d\n", errno);
-							goto out;
-						}
-
-						num_chunks_to_send--;
-					}
+	if (qp->split_exchange_tx != 1)
+		return 0;
 
-					// <5> poll from the split_cq for all chunks to ensure the completion message has done transfering.
-					printf("SENDER <5> poll from the split_cq for all chunks to ensure the completion message has done transfering.\n");
-					ne = 0;
-					//// All signalled
-					/*
-					//TODO: if necessary, study the performance difference of polling multiple WCs at a time.
-					// Drawbacks of this is that you need to provide a big array of wc structs to pass in.
-					printf("DEBUG POST_SEND: orig_num_chunks_to_send = %d\n", orig_num_chunks_to_send);	
-					do {
-						ne += mlx4_poll_ibv_cq(qp->split_cq, 1, &wc);
-						//ne += mlx4_poll_ibv_cq(qp->split_cq, orig_num_chunks_to_send - 1, &wc);
-						printf("ne = %d\n", ne);
-					} while (ne < orig_num_chunks_to_send - 1);
-					printf("ne = %d, message transfer completed\n", ne);
-					*/
-					//// selective signalling to poll the wc of the last wr
-					do
-					{
-						ne = mlx4_poll_ibv_cq(qp->split_send_cq, 1, &wc);
-						//printf("ne = %d\n", ne);
-					} while (ne == 0);
-					////
-
-					/*	
-					int ret_ne = 0;
-					while (ne < orig_num_chunks_to_send - 1) {
-						do {
-							ret_ne = mlx4_poll_ibv_cq(qp->split_cq, 1, &wc);	
-						} while (ret_ne == 0);
-						++ne;	
-					}
-					printf("ne = %d, message transfer completed\n", ne);
-					*/
-
-					////
-
-					// <6> post another RR to split_qp for future splitting
-					printf("SENDER <6> post another RR to split_qp for future splitting\n");
-
-					struct ibv_sge rsge;
-					struct ibv_recv_wr rwr;
-					struct ibv_recv_wr *bad_rwr;
-					memset(&rsge, 0, sizeof(rsge));
-					rsge.addr = (uintptr_t)&qp->split_fc_msg[2];
-					rsge.length = sizeof(struct Split_FC_message);
-					rsge.lkey = qp->split_fc_mr->lkey;
-					//printf("DDDDD: rsge.addr = %" PRIu64 "\n", rsge.addr);
-					//printf("DDDDD: rsge.length = %d \n", rsge.length);
-					//printf("DDDDD: rsge.lkey = %" PRIu32 "\n", rsge.lkey);
-
-					memset(&rwr, 0, sizeof(rwr));
-					rwr.wr_id = 0;
-					rwr.next = NULL;
-					rwr.sg_list = &rsge;
-					rwr.num_sge = 1;
-
-					ret2 = mlx4_post_recv(qp->split_qp[0], &rwr, &bad_rwr);
-					if (ret2 != 0)
-					{
-						errno = ret2;
-						printf("REALLY BAD!!, errno = %d\n", errno);
-					}
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)&qp->split_fc_msg[0];
+	sge.length = sizeof(struct Split_FC_message);
+	sge.lkey = qp->split_fc_mr->lkey;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	wr.send_flags = IBV_SEND_SIGNALED;
+
+	//// a connection-time control message does not take tokens from the pacer
+	__atomic_or_fetch(&qp->split_exchange_cqes, SPLIT_EXCHANGE_SEND_CQE, __ATOMIC_RELAXED);
+	ret = __mlx4_post_send(&qp->verbs_qp.qp, &wr, &bad_wr, NULL);
+	if (ret)
+		__atomic_and_fetch(&qp->split_exchange_cqes, ~SPLIT_EXCHANGE_SEND_CQE, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&qp->split_exchange_tx, 2, __ATOMIC_RELEASE);
+	return ret;
+}
 
-					//wr->num_sge = 2;
-					//two_sided_sg_list[0].addr = wr->sg_list->addr;
-					//two_sided_sg_list[0].length = SPLIT_CHUNK_SIZE;
-					//two_sided_sg_list[0].lkey = wr->sg_list->lkey;
-					//two_sided_sg_list[1].addr = (uintptr_t) &qp->header_buf;
-					//two_sided_sg_list[1].length = sizeof(struct two_sided_header);
-					//two_sided_sg_list[1].lkey = qp->header_mr->lkey;
-
-					//wr->sg_list = two_sided_sg_list;
-
-					//// temp for debugging:
-					//wr->sg_list = orig_sg_list;
-					//num_chunks_to_send = 1;
-					////
-					/*	
-					while (num_chunks_to_send != 0) {
-						//printf("DEBUG POST_SEND: using split_qp to send chunk\n");
-						
-						//// test qp state
-						
-						struct ibv_qp_attr attr;
-						struct ibv_qp_init_attr init_attr;
-						if (ibv_query_qp(qp->split_qp, &attr, IBV_QP_STATE, &init_attr)) {
-							fprintf(stderr, "Failed to query QP state\n");
-							return -1;
-						}
-						if (attr.qp_state == IBV_QPS_RTS) {
-							printf("DEBUG POST SEND: INDEED RTS state\n");
-						}
-
-						struct ibv_qp_attr attr2;
-						struct ibv_qp_init_attr init_attr2;
-						if (ibv_query_qp(ibqp, &attr2, IBV_QP_STATE, &init_attr2)) {
-							fprintf(stderr, "Failed to query QP state\n");
-							return -1;
-						}
-						if (attr.sq_psn != attr2.sq_psn) {
-							printf("DEBUG POST SEND: sq_psn not equal!\n");
-							printf("split_qp sq_psn:%" PRIu32 "\n", attr.sq_psn);
-							printf("orig qp sq_psn:%" PRIu32 "\n", attr2.sq_psn);
-						}
-						printf("DEBUG POST SEND: psn: %#06x\n", attr.sq_psn);
-						if (attr.port_num != attr2.port_num) {
-							printf("DEBUG POST SEND: port_num not equal!\n");
-						}
-						if (attr.dest_qp_num != attr2.dest_qp_num) {
-							printf("DEBUG POST SEND: dest_qp_num not equal!\n");
-						}
-						printf("DEBUG POST SEND: dest_qp_num: %#06x\n", attr.dest_qp_num);
-
-						printf("wr rkey: %#08x\n", wr->wr.rdma.rkey);
-						
-						////
-
-						//// send using custom qp
-						ret = __mlx4_post_send(qp->split_qp, wr, bad_wr);
-						if (ret != 0) {
-							errno = ret;
-							goto out;
-						}
-
-						--num_chunks_to_send;
-						if (num_chunks_to_send == orig_num_chunks_to_send - 1) {
-							wr->sg_list = orig_sg_list;
-							wr->num_sge = 1;
-						}
-						current_length -= SPLIT_CHUNK_SIZE;
-						wr->wr.rdma.remote_addr += SPLIT_CHUNK_SIZE;
-						wr->sg_list->addr += SPLIT_CHUNK_SIZE;
-
-						if (num_chunks_to_send == 1) {
-							wr->sg_list->length = current_length;
-							if ((orig_send_flags & IBV_SEND_SIGNALED) != 0) {	//// if original request is SIGNALED, set this flag for the last chunk
-								wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-							}
-						}
-
-						//printf("DEBUG POST_SEND: num_chunks_to_send: %d\n", num_chunks_to_send);
-					}
-					*/
-
-					//// Restore original qp before return
-					wr->wr.rdma.remote_addr = orig_raddr;
-					wr->sg_list->addr = orig_sge_addr;
-					wr->sg_list->length = orig_sge_length;
-					wr->send_flags = orig_send_flags;
-					mlx4_unlock(&qp->sq.lock);
-					return 0;
-				}
-			}
-			////
-
-			/*
-			if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM || 
-				wr->opcode == IBV_WR_SEND ||
-				wr->opcode == IBV_WR_SEND_WITH_IMM) {	//// two-sided op
-
-				qp->header
-
-				
-				//// only need to split if msg length > SPLIT_CHUNK_SIZE + header size
-				if (wr->sg_list->length >= SPLIT_CHUNK_SIZE + sizeof(struct two_sided_header)) {
-					printf("Handling two-sided operation spliting\n");
-					memcpy(&header_buf, wr->sg_list->addr + SPLIT_CHUNK_SIZE, sizeof(two_sided_header));
-					two_sided_header.num_chunks_to_send = num_chunks_to_send;
-					memcpy(wr->sg_list->addr + SPLIT_CHUNK_SIZE, &two_sided_header, sizeof(two_sided_header));
-					wr->sg_list->length += sizeof(two_sided_header);
-				} 
-				
-
-
-			} else {	//// one-sided op
-				if (wr->sg_list->length > SPLIT_CHUNK_SIZE) {
-					//// if there is a need to split
-					printf("[[[NEED TO SPLIT]]]\n");
-					//is_split = 1;
-					need_reset = 1;
-
-					current_length = wr->sg_list->length;
-					orig_raddr = wr->wr.rdma.remote_addr;
-					orig_sge_addr = wr->sg_list->addr;
-					orig_sge_length = wr->sg_list->length;
-					orig_send_flags = wr->send_flags;
-
-					num_chunks_to_send = ceil_helper((float)orig_sge_length / (float)SPLIT_CHUNK_SIZE);
-					if (num_chunks_to_send > (&qp->sq)->max_post - cur_sq_size) {
-						num_chunks_to_send = (&qp->sq)->max_post - cur_sq_size;
-					}
-					//orig_num_chunks_to_send = num_chunks_to_send;
-					printf("num_chunks_to_send: %d\n", num_chunks_to_send);
+//// new version with both one-sided and two-sided verbs using split qp
+//// The user's chain is walked WR by WR: WRs that need splitting are split one at a time
+//// (scatter/gather lists included), and each run of WRs in between is posted as one chain.
+//// Tokens are taken before the SQ lock, which is only held around the WQE writes: a split WR
+//// holds the split lock of the qp for its whole length, but other threads can post to the same
+//// qp between its chunks.
+int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				   struct ibv_send_wr **bad_wr)
+{
 
-					wr->sg_list->length = SPLIT_CHUNK_SIZE;
-					wr->send_flags = wr->send_flags & (~(IBV_SEND_SIGNALED));
-					//printf("IBV_SEND_SIGNALED: %d\n", IBV_SEND_SIGNALED);
-				}
-			}
-			*/
-		}
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct ibv_send_wr *cur, *stop;
 
-		////
+	int ret = 0;
+	//// split qps are only usable once the peer granted credits over them
+	int split = __atomic_load_n(&qp->split_qp_exchange_done, __ATOMIC_ACQUIRE) == 1;
 
-		while (is_completed == 0)
+	//// our EXCHANGE goes ahead of the first message of the application
+	if (unlikely(__atomic_load_n(&qp->split_exchange_tx, __ATOMIC_RELAXED) == 1))
+	{
+		ret = mlx4_post_split_exchange(qp);
+		if (ret)
 		{
-			////
-			//printf("num_chunks_to_send: %d\n", num_chunks_to_send);
-			//printf("message_size = %d\n", wr->sg_list->length);
-			//printf("current_length = %d\n", current_length);
-			//printf("raddr:%" PRIu64 "\n", wr->wr.rdma.remote_addr);
-			//printf("sg_addr:%" PRIu64 "\n", wr->sg_list->addr);
-			//printf("send_flags: %d\n", wr->send_flags);
-
-			//if (is_split && nreq > 0) {
-			//	mlx4_lock(&qp->sq.lock2);
-			//	//printf("get lock2\n");
-			//	//sleep(1);
-			//}
-
-			if (!(qp->create_flags & IBV_EXP_QP_CREATE_IGNORE_SQ_OVERFLOW))
-				if (unlikely(wq_overflow(&qp->sq, nreq, qp)))
-				{
-					printf("HIT1\n");
-					ret = ENOMEM;
-					errno = ret;
-					*bad_wr = wr;
-					goto out;
-				}
+			*bad_wr = wr;
+			return ret;
+		}
+	}
 
-			if (unlikely(wr->num_sge > qp->sq.max_gs))
-			{
-				printf("HIT2\n");
-				ret = ENOMEM;
-				errno = ret;
-				*bad_wr = wr;
-				goto out;
-			}
+	/* isolation */
+	justitia_flow_first_post(qp);
+	//// a pacer that started since the qp joined lost its slot: the qp joins it (watchdog.h)
+	if (unlikely(qp->pace.registered &&
+		     qp->pace.epoch != __atomic_load_n(&qp->pace.sb->epoch, __ATOMIC_RELAXED)))
+	{
+		mlx4_lock(&qp->pace_lock);
+		if (qp->pace.epoch != __atomic_load_n(&qp->pace.sb->epoch, __ATOMIC_RELAXED))
+			justitia_flow_reattach(qp);
+		mlx4_unlock(&qp->pace_lock);
+	}
+	//// the first post of a paced qp tells the pacer its class (under the pace lock: once per qp)
+	if (unlikely(qp->pace.flow && !qp->pace.started))
+	{
+		mlx4_lock(&qp->pace_lock);
+		if (!qp->pace.started)
+			justitia_flow_start(qp, wr->opcode == IBV_WR_RDMA_READ);
+		mlx4_unlock(&qp->pace_lock);
+	}
+	if (qp->pace.auto_class && qp->pace.flow)
+		justitia_flow_observe(qp, wr);
+	//// the workload is recorded for replay while CAPTURE_ENV is set (capture.h)
+	if (unlikely(capture_enabled()))
+		justitia_capture(qp, ibqp->qp_num, wr);
+	/* end */
+
+	cur = wr;
+	while (cur)
+	{
+		uint64_t total_length = split_sge_total(cur->sg_list, cur->num_sge);
+		//// Update split chunk size
+		uint32_t split_chunk_size = split_chunk_size_for(qp, cur);
 
-			if (unlikely(wr->opcode >= sizeof(mlx4_ib_opcode) / sizeof(mlx4_ib_opcode[0])))
+		if (split && split_wr_needed(qp, cur, total_length, split_chunk_size))
+		{
+			mlx4_lock(&qp->split_lock);
+			ret = split_one_wr(qp, ibqp, cur, total_length, split_chunk_size);
+			mlx4_unlock(&qp->split_lock);
+			if (ret != 0)
 			{
-				//printf("DEBUG POST SEND: opcode error \n");
-				ret = EINVAL;
 				errno = ret;
-				*bad_wr = wr;
-				goto out;
+				*bad_wr = cur;
+				return ret;
 			}
+			cur = cur->next;
+			continue;
+		}
 
-			ctrl = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
-			qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
+		for (stop = cur->next; stop; stop = stop->next)
+			if (split && split_wr_needed(qp, stop, split_sge_total(stop->sg_list, stop->num_sge), split_chunk_size_for(qp, stop)))
+				break;
 
-			ret = qp->post_send_one(wr, qp, ctrl, &size, &inl, ind);
-			if (unlikely(ret))
-			{
-				inl = 0;
-				errno = ret;
-				*bad_wr = wr;
-				goto out;
-			}
-			/*
-			* We can improve latency by not stamping the last
-			* send queue WQE until after ringing the doorbell, so
-			* only stamp here if there are still more WQEs to post.
-			*/
-			if (likely(wr->next))
-#ifndef MLX4_WQE_FORMAT
-				stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) &
-									   (qp->sq.wqe_cnt - 1));
+		//// if not splitting or other atomic verbs, act like normal
+		justitia_pace_chain(qp, cur, stop);
+		mlx4_lock(&qp->sq.lock);
+#ifdef CPU_FRIENDLY
+		ret = __mlx4_post_send_BIG(ibqp, cur, stop, bad_wr);
 #else
-				/* Make sure all owners bits are set to HW ownership */
-				set_owner_wqe(qp, ind, size,
-							  ((ind & qp->sq.wqe_cnt) ? htonl(WQE_CTRL_OWN) : 0));
+		ret = __mlx4_post_send_until(ibqp, cur, stop, bad_wr, qp);
 #endif
+		mlx4_unlock(&qp->sq.lock);
+		if (ret != 0)
+			return ret;
+		cur = stop;
+	}
 
-			++ind;
+	return ret;
+}
 
-			//// increment nreq
-			++nreq;
-			//// cleaner logic
-			--num_chunks_to_send;
-			current_length -= SPLIT_CHUNK_SIZE;
-			if (num_chunks_to_send == 0)
-			{
-				is_completed = 1;
-			}
-			else
-			{
-				/*
-				if (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM || 
-					wr->opcode == IBV_WR_SEND ||
-					wr->opcode == IBV_WR_SEND_WITH_IMM) {
-						
-					if (num_chunks_to_send == orig_num_chunks_to_send - 1) {
-						wr->sg_list = orig_sg_list;
-						wr->num_sge = 1;
-					}
-					//if (num_chunks_to_send == orig_num_chunks_to_send - 1) {
-					//	memcpy(wr->sg_list->addr + SPLIT_CHUNK_SIZE, &header_buf, sizeof(two_sided_header));
-					//}
-				}
-				*/
+int mlx4_post_split_exchange(struct mlx4_qp *qp)
+{
+	int ret;
 
-				wr->wr.rdma.remote_addr += SPLIT_CHUNK_SIZE;
-				wr->sg_list->addr += SPLIT_CHUNK_SIZE;
+	mlx4_lock(&qp->sq.lock);
+	ret = split_post_exchange_locked(qp);
+	mlx4_unlock(&qp->sq.lock);
+	return ret;
+}
 
-				if (num_chunks_to_send == 1)
-				{
-					wr->sg_list->length = current_length;
-					if ((orig_send_flags & IBV_SEND_SIGNALED) != 0)
-					{ //// if original request is SIGNALED, set this flag for the last chunk
-						wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-					}
-				}
-			}
+//// Hand credits for our receive slots back to the peer: an empty SEND_WITH_IMM on split_qp2
+//// carrying their number, outside of the pacer like the EXCHANGE.
+int mlx4_post_split_credit(struct ibv_qp *split_qp2, uint32_t credits)
+{
+	struct mlx4_qp *qp = to_mqp(split_qp2);
+	struct ibv_send_wr wr;
+	struct ibv_send_wr *bad_wr;
+	int ret;
 
-			/*
-			//// update message length and raddr
-			if (is_split && current_length > SPLIT_CHUNK_SIZE) {
-				current_length -= SPLIT_CHUNK_SIZE;
-				if (likely(cur_sq_size + nreq + 1 < (&qp->sq)->max_post)) {
-					wr->wr.rdma.remote_addr += SPLIT_CHUNK_SIZE;
-					wr->sg_list->addr += SPLIT_CHUNK_SIZE;
-					if (current_length <= SPLIT_CHUNK_SIZE) {
-						wr->sg_list->length = current_length;
-						if ((orig_send_flags & IBV_SEND_SIGNALED) != 0) {
-							wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-						}
-					}
-				} else {	//// if about to reach max_send_wr
-					//printf("DDDEBUG: stop spliting due to insufficient sq empty slots.\n");
-					wr->sg_list->length = current_length;
-					if ((orig_send_flags & IBV_SEND_SIGNALED) != 0) {
-						wr->send_flags = wr->send_flags | IBV_SEND_SIGNALED;
-					}
-					is_split = 0;
-				}
-			} else {	//// not splitting due to max_send_wr or orig message < 1MB, or there is no more splitting chunk to send
-				is_completed = 1;
-			}
-			*/
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_SEND_WITH_IMM;
+	wr.imm_data = htonl(credits);
+	wr.send_flags = IBV_SEND_SIGNALED;
 
-			//if (is_split && nreq > 0) {
-			//	mlx4_unlock(&qp->sq.lock2);
-			//}
-			////
-		}
-		//// For user-level transparency
-		if (need_reset)
-		{
-			wr->wr.rdma.remote_addr = orig_raddr;
-			wr->sg_list->addr = orig_sge_addr;
-			wr->sg_list->length = orig_sge_length;
-			wr->send_flags = orig_send_flags;
-		}
-		////
-	}
+	mlx4_lock(&qp->sq.lock);
+	ret = __mlx4_post_send(split_qp2, &wr, &bad_wr, NULL);
+	mlx4_unlock(&qp->sq.lock);
+	return ret;
+}
 
-out:
-	ring_db(qp, ctrl, nreq, size, inl);
+//// Hand out what the PD's shared split_cq2 holds, the peers' grants included; for the receive
+//// path and the exchange thread. Returns the number reaped or -1.
+int mlx4_split_reap_credits(struct mlx4_split_pool *pool)
+{
+	return split_pool_reap(pool, &pool->cq2_lock, pool->cq2, split_reap_credits);
+}
 
-	if (likely(nreq))
-#ifndef MLX4_WQE_FORMAT
-		stamp_send_wqe(qp, (ind + qp->sq_spare_wqes - 1) &
-							   (qp->sq.wqe_cnt - 1));
-#else
-		set_owner_wqe(qp, ind - 1, size,
-					  ((ind - 1) & qp->sq.wqe_cnt ? htonl(WQE_CTRL_OWN) : 0));
-#endif
-	mlx4_unlock(&qp->sq.lock);
+//// Whether the peer's grant has come in; for the exchange thread. 1 if so, -1 on a failed reap.
+int mlx4_split_reap_grant(struct mlx4_qp *qp)
+{
+	if (mlx4_split_reap_credits(qp->split_pool) < 0)
+		return -1;
+	return __atomic_load_n(&qp->split_qp_exchange_done, __ATOMIC_ACQUIRE) == 1;
+}
 
-	return ret;
+//// (Re)post receive slot i of the two-sided split chunks on split_qp[0]
+int mlx4_post_split_recv_slot(struct mlx4_qp *qp, uint32_t slot)
+{
+	struct split_recv_pool *pool = &qp->split_recv;
+	struct ibv_sge sge;
+	struct ibv_recv_wr wr;
+	struct ibv_recv_wr *bad_wr;
+
+	sge.addr = (uintptr_t)pool->buf + (uint64_t)slot * pool->slot_size;
+	sge.length = pool->slot_size;
+	sge.lkey = pool->mr->lkey;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = slot;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	return mlx4_post_recv(qp->split_qp[0], &wr, &bad_wr);
 }
 
 int mlx4_exp_post_send(struct ibv_qp *ibqp, struct ibv_exp_send_wr *wr,
@@ -3270,6 +2310,17 @@ int mlx4_exp_post_send(struct ibv_qp *ibqp, struct ibv_exp_send_wr *wr,
 
 	mlx4_lock(&qp->sq.lock);
 
+	if (unlikely(qp->split_exchange_tx == 1))
+	{
+		ret = split_post_exchange_locked(qp);
+		if (ret)
+		{
+			*bad_wr = wr;
+			mlx4_unlock(&qp->sq.lock);
+			return ret;
+		}
+	}
+
 	/* XXX check that state is OK to post send */
 
 	ind = qp->sq.head;
@@ -3617,30 +2668,6 @@ out:
 	return ret;
 }
 
-////
-int rr_buffer_enqueue(struct rr_buffer *rr_buf, struct ibv_recv_wr *wr)
-{
-	unsigned int i = rr_buf->size;
-	struct ibv_recv_wr **new_slot;
-	if (i >= rr_buf->capacity)
-	{
-		rr_buf->capacity *= 2;
-		new_slot = realloc(rr_buf->slot, rr_buf->capacity * sizeof(struct ibv_recv_wr *));
-		if (!new_slot)
-		{
-			return -1;
-		}
-		rr_buf->slot = new_slot;
-	}
-	struct ibv_recv_wr *rwr = (struct ibv_recv_wr *)malloc(sizeof(struct ibv_recv_wr));
-	memcpy(rwr, wr, sizeof(struct ibv_recv_wr));
-	rr_buf->slot[i] = rwr;
-	rr_buf->size += 1;
-
-	return 0;
-}
-////
-
 int mlx4_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 				   struct ibv_recv_wr **bad_wr)
 {
@@ -3695,27 +2722,6 @@ int mlx4_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 	// 	}
 	// }
 
-	//// Buffer all recv requests if qp is at INIT state.
-	//// Split qp shall never post RRs at its own INIT state
-	if (ibqp->state == IBV_QPS_INIT)
-	{
-		//printf("i don't think so but just to double check...\n");
-		//printf("split_qp_exchange_done = %d\n", qp->split_qp_exchange_done);
-		//fflush(stdout);
-		struct mlx4_qp *qp = to_mqp(ibqp);
-		//if (!qp->split_qp_exchange_done) {
-		if (qp->split_qp_exchange_done == 0)
-		{ // 1 or -1(case where qpn is set manually) can bypass
-			if (rr_buffer_enqueue(&qp->rr_buf, wr))
-			{
-				ret = 1;
-				fprintf(stderr, "Error adding wr to RR_buffer\n");
-				goto out;
-			}
-		}
-	}
-	////
-
 	/* XXX check that state is OK to post receive */
 	ind = qp->rq.head & (qp->rq.wqe_cnt - 1);
 
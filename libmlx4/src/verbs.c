@@ -47,6 +47,7 @@
 /* Added for reg_mr mmap munmap system calls */
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sched.h>
 #include <glob.h>
 #include "mlx4.h"
@@ -60,27 +61,13 @@
 /* isolation */
 #include "pacer.h"
 #include "get_clock.h"
-__thread struct flow_info *flow = NULL;
-struct shared_block *sb = NULL;
-__thread int start_flag = 0;
-__thread int registered = 0;
-__thread unsigned int slot = 0;
 //int start_recv = 0;
-__thread int num_active_small_flows = 0;
-__thread int num_active_big_flows = 0;
-__thread int justitia_exit_done = 0;
-#ifdef CPU_FRIENDLY
-double cpu_mhz = 0;
-__thread unsigned int flow_socket = 0;
-#endif
+double cpu_mhz = 0;                 /* the pacer's, from justitia_clock_init at create_qp (CPU_FRIENDLY) or by the first latency-sensitive qp */
 /* end */
 
 static pthread_mutex_t justitia_shm_lock = PTHREAD_MUTEX_INITIALIZER;
 static int justitia_process_handlers_installed = 0;
 
-static pthread_key_t justitia_thread_key;
-static pthread_once_t justitia_thread_key_once = PTHREAD_ONCE_INIT;
-
 static int justitia_is_pacer_process(void)
 {
 	int fd = open("/proc/self/comm", O_RDONLY);
@@ -101,23 +88,6 @@ static int justitia_is_pacer_process(void)
 	return strcmp(name, "pacer") == 0;
 }
 
-static void justitia_thread_destructor(void *value)
-{
-	(void)value;
-	set_inactive_on_exit();
-}
-
-static void justitia_make_thread_key(void)
-{
-	(void)pthread_key_create(&justitia_thread_key, justitia_thread_destructor);
-}
-
-static void justitia_register_thread_cleanup(void)
-{
-	pthread_once(&justitia_thread_key_once, justitia_make_thread_key);
-	(void)pthread_setspecific(justitia_thread_key, (void *)1);
-}
-
 int __mlx4_query_device(uint64_t raw_fw_ver,
 			struct ibv_device_attr *attr)
 {
@@ -233,9 +203,6 @@ struct ibv_pd *mlx4_alloc_pd(struct ibv_context *context)
 	struct mlx4_alloc_pd_resp resp;
 	struct mlx4_pd		 *pd;
 
-#ifdef CPU_FRIENDLY
-    cpu_mhz = get_cpu_mhz(1);
-#endif
 	read_init_vars(to_mctx(context));
 	pd = malloc(sizeof *pd);
 	if (!pd)
@@ -859,12 +826,6 @@ static struct ibv_cq *create_cq(struct ibv_context *context,
 
 	cq->pattern = MLX4_CQ_PATTERN;
 
-#ifdef DRIVER_MEASURE_LAT
-	//// TIMESTAMP
-	cq->cpu_mhz = get_cpu_mhz(1);
-	////
-#endif
-
 	return &cq->ibv_cq;
 
 err_db:
@@ -980,6 +941,7 @@ int mlx4_destroy_cq(struct ibv_cq *cq)
 		return ret;
 
 	mlx4_free_db(to_mctx(cq->context), MLX4_DB_TYPE_CQ, to_mcq(cq)->set_ci_db);
+	free(to_mcq(cq)->split_out);
 	if (to_mcq(cq)->buf.hmem != NULL)
 		mlx4_free_buf_huge(to_mctx(cq->context), &to_mcq(cq)->buf);
 	else
@@ -1136,14 +1098,93 @@ struct ibv_qp *mlx4_create_qp_ex(struct ibv_context *context,
 	return mlx4_exp_create_qp(context, (struct ibv_exp_qp_init_attr *)attr);
 }
 
-////
-int rr_buffer_init(struct rr_buffer *rr_buf, unsigned int cap) {
-	rr_buf->slot = (struct ibv_recv_wr **)malloc(cap * sizeof(struct ibv_recv_wr *));
-	if (!rr_buf->slot) { return -1; }
-	rr_buf->capacity = cap;
-	rr_buf->size = 0;
+//// allocate the chunk descriptors used by the split path up front
+static int split_arena_init(struct split_arena *arena, unsigned int cap, unsigned int max_sge)
+{
+	arena->wr = calloc(cap, sizeof(*arena->wr));
+	arena->sge = calloc((size_t)cap * max_sge, sizeof(*arena->sge));
+	if (!arena->wr || !arena->sge) {
+		free(arena->wr);
+		free(arena->sge);
+		arena->wr = NULL;
+		arena->sge = NULL;
+		arena->capacity = 0;
+		return ENOMEM;
+	}
+	arena->capacity = cap;
+	arena->max_sge = max_sge;
+	return 0;
+}
 
+static void split_arena_free(struct split_arena *arena)
+{
+	free(arena->wr);
+	free(arena->sge);
+	arena->wr = NULL;
+	arena->sge = NULL;
+	arena->capacity = 0;
+}
+
+//// Receive slots for the peer's two-sided chunks, registered once per user qp, and room to
+//// keep the user's RR of a message while its chunks come in
+static int split_recv_pool_alloc(struct split_recv_pool *pool, struct ibv_pd *pd, int max_gs)
+{
+	size_t size = (size_t)SPLIT_RECV_SLOTS * SPLIT_RECV_SLOT_SIZE;
+
+	if (pool->buf)
+		return 0;
+	pool->rr_segs = calloc(max_gs ? max_gs : 1, sizeof(*pool->rr_segs));
+	if (!pool->rr_segs)
+		return -1;
+	if (posix_memalign(&pool->buf, sysconf(_SC_PAGESIZE), size)) {
+		pool->buf = NULL;
+		goto err_segs;
+	}
+	pool->mr = mlx4_reg_mr(pd, pool->buf, size, IBV_ACCESS_LOCAL_WRITE);
+	if (!pool->mr) {
+		free(pool->buf);
+		pool->buf = NULL;
+		goto err_segs;
+	}
+	pool->num_slots = SPLIT_RECV_SLOTS;
+	pool->slot_size = SPLIT_RECV_SLOT_SIZE;
 	return 0;
+
+err_segs:
+	free(pool->rr_segs);
+	pool->rr_segs = NULL;
+	return -1;
+}
+
+//// Forget the message coming in, the chunks ahead of their piece and the receives held back;
+//// the slots are all posted again when the split qps are set up
+static void split_recv_pool_reset(struct split_recv_pool *pool)
+{
+	while (pool->num_held) {
+		free(pool->held[pool->held_head].rr_segs);
+		pool->held_head = (pool->held_head + 1) % pool->held_cap;
+		pool->num_held--;
+	}
+	pool->left = 0;
+	pool->owed = 0;
+	pool->num_early = 0;
+	pool->dropped = 0;
+}
+
+static void split_recv_pool_free(struct split_recv_pool *pool)
+{
+	split_recv_pool_reset(pool);
+	free(pool->held);
+	pool->held = NULL;
+	pool->held_cap = 0;
+	if (pool->mr)
+		mlx4_dereg_mr(pool->mr);
+	free(pool->buf);
+	free(pool->rr_segs);
+	pool->mr = NULL;
+	pool->buf = NULL;
+	pool->rr_segs = NULL;
+	pool->num_slots = 0;
 }
 ////
 
@@ -1170,115 +1211,262 @@ struct ibv_qp *__mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr
 }
 ////
 
-struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+//// The split cqs are shared per PD (struct mlx4_split_pool). The pool comes up with the
+//// PD's first user qp and goes away with its last one; split_pool_mutex guards
+//// pd->split_pool, refcnt and what the split qps reserved of its cqs. The split qps stay
+//// per user qp: the peer's chunks land in the receive slots of the user qp they are for.
+static pthread_mutex_t split_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//// Reserve n more entries of a shared cq, growing it first if they may not fit
+static int split_cq_reserve(struct ibv_cq *cq, int *reserved, int n)
+{
+	int want = *reserved + n;
+
+	if (want > cq->cqe && mlx4_resize_cq(cq, want > 2 * cq->cqe ? want : 2 * cq->cqe) &&
+	    mlx4_resize_cq(cq, want))
+		return -1;
+	*reserved = want;
+	return 0;
+}
+
+static void split_pool_destroy(struct mlx4_split_pool *pool)
+{
+	if (pool->send_cq)
+		mlx4_destroy_cq(pool->send_cq);
+	if (pool->cq2)
+		mlx4_destroy_cq(pool->cq2);
+	if (pool->send_channel)
+		ibv_destroy_comp_channel(pool->send_channel);
+	if (pool->channel2)
+		ibv_destroy_comp_channel(pool->channel2);
+	pthread_cond_destroy(&pool->wait_cond);
+	pthread_mutex_destroy(&pool->wait_mutex);
+	free(pool);
+}
+
+//// take a reference on the PD's pool, creating it on first use; its cqs grow with the split qps
+static struct mlx4_split_pool *split_pool_get(struct ibv_pd *pd)
+{
+	struct mlx4_pd *mpd = to_mpd(pd);
+	struct mlx4_split_pool *pool;
+
+	pthread_mutex_lock(&split_pool_mutex);
+	pool = mpd->split_pool;
+	if (pool) {
+		pool->refcnt++;
+		pthread_mutex_unlock(&split_pool_mutex);
+		return pool;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		goto err;
+	pthread_mutex_init(&pool->wait_mutex, NULL);
+	pthread_cond_init(&pool->wait_cond, NULL);
+	if (mlx4_lock_init(&pool->send_lock, 1, mlx4_get_locktype()) ||
+	    mlx4_lock_init(&pool->cq2_lock, 1, mlx4_get_locktype()))
+		goto err;
+	//// create custom cq used for rdma message splitting
+	pool->send_channel = ibv_create_comp_channel(pd->context);
+	pool->channel2 = ibv_create_comp_channel(pd->context);
+	if (!pool->send_channel || !pool->channel2)
+		goto err;
+	pool->send_cq = mlx4_create_cq(pd->context, 1, pool->send_channel, 0);
+	pool->cq2 = mlx4_create_cq(pd->context, 1, pool->channel2, 0);
+	if (!pool->send_cq || !pool->cq2)
+		goto err;
+
+	pool->refcnt = 1;
+	mpd->split_pool = pool;
+	pthread_mutex_unlock(&split_pool_mutex);
+	return pool;
+
+err:
+	fprintf(stderr, "Error creating split resources: %s\n", strerror(errno));
+	if (pool)
+		split_pool_destroy(pool);
+	pthread_mutex_unlock(&split_pool_mutex);
+	return NULL;
+}
+
+static void split_pool_put(struct ibv_pd *pd, struct mlx4_split_pool *pool)
+{
+	pthread_mutex_lock(&split_pool_mutex);
+	if (--pool->refcnt == 0) {
+		to_mpd(pd)->split_pool = NULL;
+		split_pool_destroy(pool);
+	}
+	pthread_mutex_unlock(&split_pool_mutex);
+}
+
+//// Destroy the split qps of mqp and give back what they reserved of the PD's split cqs. The
+//// reap lock of each cq keeps mqp from being taken off it as a wr_id while they go; it is not
+//// held over split_qp[0], whose receives complete on the user's recv cq, as the receive path
+//// reaps cq2 under that cq's lock.
+static void split_qps_destroy(struct mlx4_qp *mqp)
+{
+	struct mlx4_split_pool *pool = mqp->split_pool;
+	struct ibv_pd *pd = mqp->verbs_qp.qp.pd;
+	int i;
+
+	if (!pool)
+		return;
+	mlx4_lock(&pool->send_lock);
+	for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+		if (mqp->split_qp[i])
+			mlx4_destroy_qp(mqp->split_qp[i]);
+		mqp->split_qp[i] = NULL;
+	}
+	mlx4_unlock(&pool->send_lock);
+	mlx4_lock(&pool->cq2_lock);
+	if (mqp->split_qp2)
+		mlx4_destroy_qp(mqp->split_qp2);
+	mqp->split_qp2 = NULL;
+	mlx4_unlock(&pool->cq2_lock);
+
+	pthread_mutex_lock(&split_pool_mutex);
+	pool->send_cqe -= mqp->split_send_cqe;
+	pool->cq2_cqe -= mqp->split_cq2_cqe;
+	pthread_mutex_unlock(&split_pool_mutex);
+	mqp->split_send_cqe = 0;
+	mqp->split_cq2_cqe = 0;
+	mqp->split_pool = NULL;
+	split_pool_put(pd, pool);
+}
+
+//// Create the split qps of the user's RC qp mqp on the PD's shared split cqs, which grow by
+//// what the split qps may hold: the chunks of a window on the send cq, and the queues of
+//// split_qp2 on cq2. The receive slots of split_qp[0] complete on the user's recv cq, which
+//// split_exchange_init grows for them. Returns 0, or -1 with none of them left behind.
+static int split_qps_create(struct ibv_pd *pd, struct mlx4_qp *mqp, struct ibv_qp_init_attr *attr)
 {
-	//// create custom cq used for two-sided rdma message splitting
-	//struct ibv_comp_channel *channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *send_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *recv_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *channel2 = ibv_create_comp_channel(pd->context);
-	struct ibv_cq *split_send_cq = mlx4_create_cq(pd->context, SPLIT_MAX_CQE, send_channel, 0);
-	struct ibv_cq *split_recv_cq = mlx4_create_cq(pd->context, SPLIT_MAX_CQE, recv_channel, 0);
-	struct ibv_cq *split_cq2 = mlx4_create_cq(pd->context, SPLIT_MAX_CQE, channel2, 0);
-	//// arm split_cq for completion events
-	//mlx4_arm_cq(split_cq, 0);
-
-	//// create a custom qp for our own use 
 	struct ibv_qp_init_attr split_init_attr, split_init_attr2;
+	struct mlx4_split_pool *pool;
+	int i, ret;
+
+	pool = split_pool_get(pd);
+	if (!pool)
+		return -1;
+	mqp->split_pool = pool;
+
 	memset(&split_init_attr, 0, sizeof(struct ibv_qp_init_attr));
-	split_init_attr.send_cq = split_send_cq;
-	split_init_attr.recv_cq = split_recv_cq;
+	split_init_attr.send_cq = pool->send_cq;
+	//// chunks of the peer complete on the user's recv cq, so its user is woken for them
+	split_init_attr.recv_cq = attr->recv_cq;
 	split_init_attr.cap.max_send_wr  = SPLIT_MAX_SEND_WR;
-	split_init_attr.cap.max_recv_wr  = SPLIT_MAX_RECV_WR;
-	split_init_attr.cap.max_send_sge = 1;
+	split_init_attr.cap.max_recv_wr  = SPLIT_RECV_SLOTS;
+	//// a split chunk may span as many SGEs as the user's WR carries
+	split_init_attr.cap.max_send_sge = attr->cap.max_send_sge ? attr->cap.max_send_sge : 1;
 	split_init_attr.cap.max_recv_sge = 1;
 	split_init_attr.cap.max_inline_data = 100;	// probably not going to use inline there
 	split_init_attr.qp_type = IBV_QPT_RC;
 	split_init_attr.qp_context = (void *)1;
 	memcpy(&split_init_attr2, &split_init_attr, sizeof(struct ibv_qp_init_attr));
-	split_init_attr2.send_cq = split_cq2;
-	split_init_attr2.recv_cq = split_cq2;
-
-	struct ibv_qp 		*qp;
-	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED];
-	struct ibv_qp 		*split_qp2;			// temporarily used in 2-sided
-	split_qp2 = __mlx4_create_qp(pd, &split_init_attr2);
-	if (split_qp2 == NULL) {
-		printf("Create split qp2 failed. %s\n", strerror(errno));
+	//// split_qp2 sends the grant and credit returns and takes the peer's
+	split_init_attr2.send_cq = pool->cq2;
+	split_init_attr2.recv_cq = pool->cq2;
+	split_init_attr2.cap.max_send_wr = SPLIT_QP2_WR;
+	split_init_attr2.cap.max_recv_wr = SPLIT_QP2_WR;
+	split_init_attr2.cap.max_send_sge = 1;
+
+	mqp->split_qp2 = __mlx4_create_qp(pd, &split_init_attr2);
+	if (!mqp->split_qp2)
+		goto err;
+	for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+		mqp->split_qp[i] = __mlx4_create_qp(pd, &split_init_attr);
+		if (!mqp->split_qp[i])
+			goto err;
 	}
-	printf("DEBUG mlx4_create_qp: split_qp->qpn = %06x\n", split_qp2->qp_num);
-
-	int i;
-	//for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-	for (i = MAX_SPLIT_QP_NUM_ONE_SIDED - 1; i >= 0 ; i--) {
-		split_qp[i] = __mlx4_create_qp(pd, &split_init_attr);
-		if (split_qp[i]) {
-			printf("DEBUG mlx4_create_qp: split_qp[%d]->qpn = %06x\n", i, split_qp[i]->qp_num);
-		} else {
-			fprintf(stderr, "Error creating Split QP #%d\n", i + 1);
-			return NULL;
-		}
+	to_mqp(mqp->split_qp[0])->split_owner = mqp;
+
+	pthread_mutex_lock(&split_pool_mutex);
+	ret = split_cq_reserve(pool->cq2, &pool->cq2_cqe, split_init_attr2.cap.max_send_wr +
+						      split_init_attr2.cap.max_recv_wr);
+	if (!ret) {
+		mqp->split_cq2_cqe = split_init_attr2.cap.max_send_wr + split_init_attr2.cap.max_recv_wr;
+		ret = split_cq_reserve(pool->send_cq, &pool->send_cqe,
+				       MAX_SPLIT_QP_NUM_ONE_SIDED * split_init_attr.cap.max_send_wr);
 	}
+	if (!ret)
+		mqp->split_send_cqe = MAX_SPLIT_QP_NUM_ONE_SIDED * split_init_attr.cap.max_send_wr;
+	pthread_mutex_unlock(&split_pool_mutex);
+	if (ret)
+		goto err;
+#ifdef JUSTITIA_DEBUG
+	printf("DEBUG mlx4_create_qp: split_qp[0]->qpn = %06x, split_qp2->qpn = %06x\n",
+	       mqp->split_qp[0]->qp_num, mqp->split_qp2->qp_num);
+#endif
+	return 0;
+
+err:
+	fprintf(stderr, "Error creating split qps: %s\n", strerror(errno));
+	split_qps_destroy(mqp);
+	return -1;
+}
 
-	//// Now create the user's qp
+struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+{
+	struct mlx4_context	*ctx = to_mctx(pd->context);
+	struct ibv_qp 		*qp;
+	int			split, exchange_rr;
+
+	//// only RC qps of a process that opted in to the EXCHANGE split; it and the RR it lands in
+	//// take a WQE of their own on top of those asked for
+	read_init_vars(ctx);
+	split = attr->qp_type == IBV_QPT_RC && ctx->split_exchange;
+	exchange_rr = split && !attr->srq;
+	attr->cap.max_send_wr += split;
+	attr->cap.max_recv_wr += exchange_rr;
 	qp = __mlx4_create_qp(pd, attr);
-	printf("DEBUG mlx4_create_qp: orig_qp->qpn = %06x\n", qp->qp_num);
-	//// store split_qp & split_cq inside the user's qp
-	if (qp) {
-		struct mlx4_qp *mqp = to_mqp(qp);
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			mqp->split_qp[i] = split_qp[i];
-		}
-		mqp->split_qp2 = split_qp2;
-		mqp->split_cq2 = split_cq2;
-		mqp->split_send_cq = split_send_cq;
-		mqp->split_recv_cq = split_recv_cq;
-		mqp->split_comp_send_channel = send_channel;
-		mqp->split_comp_recv_channel = recv_channel;
-		mqp->split_comp_channel2 = channel2;
+	attr->cap.max_send_wr -= split;
+	attr->cap.max_recv_wr -= exchange_rr;
+	if (!qp)
+		return NULL;
+	struct mlx4_qp *mqp = to_mqp(qp);
+	if (mlx4_lock_init(&mqp->split_lock, 1, mlx4_get_locktype()) ||
+	    mlx4_lock_init(&mqp->pace_lock, 1, mlx4_get_locktype())) {
+		fprintf(stderr, "Error initializing split locks\n");
+		mlx4_destroy_qp(qp);
+		return NULL;
+	}
+	//// split qps are connected by the EXCHANGE once the user's RC qp is up
+	mqp->split_qp_exchange_done = -1;
+	//// store split_qp & split_cq inside the user's RC qp; one that has none is never split
+	if (split && !split_qps_create(pd, mqp, attr)) {
 		//// register mr for two-sided splitting header message
 		//// register size * 2 since in split qpn exchange we need mr for send & recv at the same time
 		mqp->split_fc_mr = mlx4_reg_mr(pd, &mqp->split_fc_msg, 4 * sizeof(struct Split_FC_message), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
 		//// add in pd for later deletion
 		to_mpd(pd)->split_fc_mr = mqp->split_fc_mr;
-		//// initalize recv request buffer
-		rr_buffer_init(&mqp->rr_buf, RR_BUFFER_INIT_CAP);
-		if (MANUAL_SPLIT_QPN_DIFF) {
-			mqp->split_qp_exchange_done = -1;
-		} else {
-			mqp->split_qp_exchange_done = 0;
+		if (!mqp->split_fc_mr ||
+		    split_arena_init(&mqp->split_arena, SPLIT_MAX_SEND_WR,
+				     attr->cap.max_send_sge ? attr->cap.max_send_sge : 1)) {
+			fprintf(stderr, "Error allocating split chunk arena; qp %06x is not split\n", qp->qp_num);
+			split_qps_destroy(mqp);
 		}
-		//// set whether user has set the qp to send mice flows
+	}
+	//// class hint in qp_context: lat, tput and FLOW_CLASS_HINT_BW pin the class; anything
+	//// else (NULL, or a real context pointer) starts as bw and is classified from the posts
+	switch ((long)attr->qp_context) {
+	case FLOW_CLASS_LAT:
+	case FLOW_CLASS_TPUT:
 		mqp->isSmall = (long)attr->qp_context;
-		if (mqp->isSmall < 0 || mqp->isSmall > 2)
-			mqp->isSmall = 0;
-		/* Scheme A: per-thread class is decided once; later QPs in same thread inherit */
-		if (isSmall < 0)
-			isSmall = mqp->isSmall;
-#ifdef DRIVER_MEASURE_LAT
-		//// TIMESTAMP
-		// Initialize timestamp queue inside its send_cq if user creates a "small" QP
-		if (mqp->isSmall == 1) {			// 1 means lat-sensitive; 2 means tput-sensitive
-			mqp->orig_send_cq = to_mcq(attr->send_cq);
-			mqp->orig_send_cq->wr_timestamps = queue_init(TIMESTAMP_QUEUE_CAP);
-#ifdef DRIVER_USE_CMH
-			mqp->orig_send_cq->cmh = CMH_Init(CMH_WIDTH, CMH_DEPTH, CMH_U, CMH_GRAN, CMH_WINDOW_SIZE);
-#endif
-		} else {
-			mqp->orig_send_cq = NULL;
-		}
-		////
-#endif
-
-	} else {
-		fprintf(stderr, "Error creating Split QP\n");
-		return qp;
+		break;
+	case FLOW_CLASS_HINT_BW:
+		mqp->isSmall = FLOW_CLASS_BW;
+		break;
+	default:
+		mqp->isSmall = FLOW_CLASS_BW;
+		mqp->pace.auto_class = 1;
+		flow_class_init(&mqp->pace.fc, FLOW_CLASS_BW);
+		break;
 	}
 	////
 
 	/* isolation */
-	int fd_shm;
-	if ((fd_shm = shm_open(SHARED_MEM_NAME, O_RDWR, 0600)) == -1){
+	//// the pacer of port 1 of the device; a qp brought to INIT on another port moves to its pacer
+	struct justitia_pacer *pacer;
+	if (!(pacer = justitia_pacer_attach(ibv_get_device_name(pd->context->device), 1))) {
 		printf("@@@Pacer's shared memory is not found. Pacer won't be used.\n");
 	} else {
 		if (justitia_is_pacer_process()) {
@@ -1286,10 +1474,9 @@ struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
 			return qp;
 		}
 		pthread_mutex_lock(&justitia_shm_lock);
-		if (!sb) {
-			sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ,
-				MAP_SHARED, fd_shm, 0);
-		}
+#ifdef CPU_FRIENDLY
+		justitia_clock_init(pacer->sb);		/* split chunks are spaced in cycles */
+#endif
 		if (!justitia_process_handlers_installed) {
 			justitia_process_handlers_installed = 1;
 			/* set up signal handler */
@@ -1314,15 +1501,8 @@ struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
 		}
 		pthread_mutex_unlock(&justitia_shm_lock);
 
-		/* Per-thread registration: each thread gets its own flow slot */
-		if (!registered) {
-			registered = 1;
-			justitia_register_thread_cleanup();
-			contact_pacer(1);
-			flow = sb ? &sb->flows[slot] : NULL;
-			start_flag = 1;
-			printf("@@@Thread registered at slot %d.\n", slot);
-		}
+		/* Per-qp registration: each qp takes a flow slot of its own on its first post */
+		justitia_flow_attach(to_mqp(qp), pacer);
 	}
 	/* end */
 
@@ -1367,6 +1547,12 @@ int mlx4_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
 		return ret;
 
 	init_attr->cap.max_send_wr     = qp->sq.max_post;
+	//// less the WQEs of the EXCHANGE, as at create
+	if (qp->split_qp2) {
+		init_attr->cap.max_send_wr--;
+		if (!ibqp->srq)
+			init_attr->cap.max_recv_wr--;
+	}
 	init_attr->cap.max_send_sge    = qp->sq.max_gs;
 	init_attr->cap.max_inline_data = qp->max_inline_data;
 
@@ -1413,535 +1599,404 @@ int __mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 	return ret;
 }
 
-//// repost recv requests in the rr_buffer and free the memory
-int rr_buffer_post_and_clear(struct rr_buffer *rr_buf, struct ibv_qp *qp) {
-	int i;
-	struct ibv_recv_wr *rwr, *bad_rwr;
-	printf("DEBUG: entring rr_buffer_post_and_clear\n");
-	for (i = 0; i < rr_buf->size; i++) {
-		rwr = rr_buf->slot[i];
-		if (mlx4_post_recv(qp, rwr, &bad_rwr)) {
-			fprintf(stderr, "Failed to repost recv requests to user qp.\n");
-			return 1;
-		}
-		free(rwr);
-	}
-	return 0;
-}
-////
+//// Split qps are brought up with the EXCHANGE below, which names one one-sided split qp
+#if MAX_SPLIT_QP_NUM_ONE_SIDED != 1
+#error "the split qp EXCHANGE carries a single one-sided split qp"
+#endif
 
-//// Modify to change the qp state of the custom qp
-// A more general design: AT INIT to RTR transition, we move user's QP to RTR and then to RTS using our own psn to exchange split qp's qpn.
-// Then we reset user's QP, and move it all the way to RTR using cached user's info.
-// This design is to handle cases where <1> the user neven transitions QP on the receiver side to RTS. <2> random qpns at qp creation
-// (1) Cache user's parameters when modify qp state so that we can later reproduce it from RESET to RTR
-// TOOD: (2) We also cache all recv qps user post to the recv queue at INIT state. (It is allowed to post rr at INIT state, and reset clean everything.)
-// (3) At INIT -> RTR transition, always transition to RTR and then to RTS using our own special rq_psn and sq_psn
-// (4) after split qp qpn exchange, reset user's qp and move again to RTR
-int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
-		    int attr_mask)
+#define SPLIT_RTS_MASK	(IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | \
+			 IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC)
+
+static inline uint64_t split_now_ms(void)
 {
-	int i;
-	start_flag = 0;
-	//start_recv = 0;
+	struct timespec ts;
 
-	struct ibv_modify_qp cmd;
-	int ret;
-	//// do the same state transition for custom qp.
-	struct mlx4_qp *mqp = to_mqp(qp);
-	////
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	if (attr_mask & IBV_QP_PORT) {
-		////printf("DEBUG MLX4_MODIFY_QP: actually enter here\n");
-		ret = update_port_data(qp, attr->port_num);
-		if (ret)
-			return ret;
-		//// do same for custom_qp
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			update_port_data(mqp->split_qp[i], attr->port_num);
-		}
-		update_port_data(mqp->split_qp2, attr->port_num);
-		////
-	}
+static int split_reset_qp(struct ibv_qp *qp)
+{
+	struct ibv_qp_attr attr;
 
-	if (qp->state == IBV_QPS_RESET &&
-	    attr_mask & IBV_QP_STATE   &&
-	    attr->qp_state == IBV_QPS_INIT) {
-		mlx4_qp_init_sq_ownership(to_mqp(qp));
-		//// do same for custom_qp
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			mlx4_qp_init_sq_ownership(to_mqp(mqp->split_qp[i]));
-		}
-		mlx4_qp_init_sq_ownership(to_mqp(mqp->split_qp2));
-		////
-	}
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RESET;
+	return __mlx4_modify_qp(qp, &attr, IBV_QP_STATE);
+}
 
-	//// Ignore QPs that are not RC for now
-	if (qp->qp_type != IBV_QPT_RC) {
-		ret = ibv_cmd_modify_qp(qp, attr, attr_mask, &cmd, sizeof cmd);
-		goto check;
-	}
-
-	if (MANUAL_SPLIT_QPN_DIFF) {
-
-		//// modify original user's qp state
-		ret = ibv_cmd_modify_qp(qp, attr, attr_mask, &cmd, sizeof cmd);
-
-		//// if manually set the qpn difference for split qp
-		// Essentially we are looking at the user QP's INIT -> RTR transition when hacking dest_qp_num
-		// We also directly modify split qp to RTS instead of wait users modify their qp to RTS
-		// because some users might never do so.
-		if (qp->state == IBV_QPS_INIT) {
-			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-				if (__mlx4_modify_qp(mqp->split_qp[i], attr, attr_mask)) {
-					fprintf(stderr, "Failed to modify SPLIT QP to INIT State\n");
-					ret = 1;
-					goto err;
-				}
-			}
-			if (__mlx4_modify_qp(mqp->split_qp2, attr, attr_mask)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to INIT State\n");
-				ret = 1;
-				goto err;
-			}
-			printf("<<<<MODIFY SPLIT QP to INIT>>>>\n");
-			fflush(stdout);
-		} else if (qp->state == IBV_QPS_RTR && mqp->split_qp[0]->state == IBV_QPS_INIT) {
-			//attr->dest_qp_num -= 1;	// for old benchmark
-			//attr->dest_qp_num -= 2; // for new benchmark
-			struct ibv_qp_attr split_attr, split_attr2;
-			memcpy(&split_attr, attr, sizeof(struct ibv_qp_attr));
-			memcpy(&split_attr2, attr, sizeof(struct ibv_qp_attr));
-			int split_mask = attr_mask;
-			uint32_t split_dest_qp_num = attr->dest_qp_num;
-			uint32_t split_rq_psn = 10083;
-			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-				split_dest_qp_num -= SPLIT_QP_NUM_DIFF;
-				split_rq_psn++;
-				split_attr.dest_qp_num = split_dest_qp_num;
-				split_attr.rq_psn = split_rq_psn;
-				//printf("DEBUG MODIFY QP: now attr->dest_qp_num is %06x\n", attr->dest_qp_num);
-
-				if (__mlx4_modify_qp(mqp->split_qp[i], &split_attr, split_mask)) {
-					fprintf(stderr, "Failed to modify SPLIT QP to RTR State\n");
-					ret = 1;
-					goto err;
-				}
-			}
+static int split_qp_to_rts(struct ibv_qp *qp, uint32_t sq_psn)
+{
+	struct ibv_qp_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state		= IBV_QPS_RTS;
+	attr.sq_psn		= sq_psn;
+	attr.timeout		= 14;
+	attr.retry_cnt		= 7;
+	attr.rnr_retry		= 7;
+	attr.max_rd_atomic	= 1;
+	return __mlx4_modify_qp(qp, &attr, SPLIT_RTS_MASK);
+}
 
-			split_dest_qp_num -= SPLIT_QP_NUM_DIFF;
-			////split_attr2.dest_qp_num -= split_dest_qp_num; // wrong!
-			split_attr2.dest_qp_num = split_dest_qp_num;
-			split_attr2.rq_psn = 10083;
-			if (__mlx4_modify_qp(mqp->split_qp2, &split_attr2, split_mask)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to RTR State\n");
-				ret = 1;
-				goto err;
-			}
-			printf("<<<<MODIFY SPLIT QP to RTR>>>>\n");
-			fflush(stdout);
-			//// pre-post a RR for later use
-			//printf("DEBUG MODIFY QP: post a RR to split_qp\n");
-			struct ibv_sge sge;
-			struct ibv_recv_wr wr;
-			struct ibv_recv_wr *bad_wr;
-			memset(&sge, 0, sizeof(sge));
-			sge.addr = (uintptr_t)&mqp->split_fc_msg[0];
-			sge.length = sizeof(struct Split_FC_message);
-			sge.lkey = mqp->split_fc_mr->lkey;
-
-			memset(&wr, 0, sizeof(wr));
-			wr.wr_id = 0;
-			wr.next = NULL;
-			wr.sg_list = &sge;
-			wr.num_sge = 1;
-
-			if (mlx4_post_recv(mqp->split_qp[0], &wr, &bad_wr)) {
-				fprintf(stderr, "Failed to post the initial RR to split qp.\n");
-				ret = 1;
-				goto err;
-			}
+static int split_post_fc_recv(struct mlx4_qp *mqp, struct ibv_qp *qp, struct Split_FC_message *msg)
+{
+	struct ibv_sge sge;
+	struct ibv_recv_wr wr;
+	struct ibv_recv_wr *bad_wr;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)msg;
+	sge.length = sizeof(struct Split_FC_message);
+	sge.lkey = mqp->split_fc_mr->lkey;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	return mlx4_post_recv(qp, &wr, &bad_wr);
+}
 
-			sge.addr = (uintptr_t)&mqp->split_fc_msg[2];
-			if (mlx4_post_recv(mqp->split_qp2, &wr, &bad_wr)) {
-				fprintf(stderr, "Failed to post the initial RR to split qp.\n");
-				ret = 1;
-				goto err;
-			}
+//// Receive slots for the peer's chunks go on split_qp[0]; split_qp2 gets one empty RR per
+//// credit the peer may hand back and one for its grant, each naming our user qp in its wr_id
+static int split_post_split_recvs(struct mlx4_qp *mqp, int i, uint32_t peer_slots)
+{
+	struct ibv_recv_wr wr;
+	struct ibv_recv_wr *bad_wr;
+	uint32_t n;
+
+	if (i == 0) {
+		for (n = 0; n < mqp->split_recv.num_slots; n++)
+			if (mlx4_post_split_recv_slot(mqp, n))
+				return -1;
+		return 0;
+	}
 
-			// Modify split qp to RTS
-			split_attr.qp_state	    = IBV_QPS_RTS;
-			//split_attr.sq_psn	    = 10083;
-			split_attr.timeout	    = 14;
-			split_attr.retry_cnt	= 7;
-			split_attr.rnr_retry	= 7;
-			split_attr.max_rd_atomic  = 1;
-			int rts_mask = 	IBV_QP_STATE              |
-							IBV_QP_TIMEOUT            |
-							IBV_QP_RETRY_CNT          |
-							IBV_QP_RNR_RETRY          |
-							IBV_QP_SQ_PSN             |
-							IBV_QP_MAX_QP_RD_ATOMIC;
-
-			uint32_t split_sq_psn = 10083;
-			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-				split_sq_psn++;
-				split_attr.sq_psn = split_sq_psn;
-
-				if (__mlx4_modify_qp(mqp->split_qp[i], &split_attr, rts_mask)) {
-					fprintf(stderr, "Failed to modify SPLIT QP to RTS State\n");
-					ret = 1;
-					goto err;
-				}
-			}
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = (uintptr_t)mqp;
+	for (n = 0; n < peer_slots + 1; n++)
+		if (mlx4_post_recv(mqp->split_qp2, &wr, &bad_wr))
+			return -1;
+	return 0;
+}
 
-			split_attr2.qp_state	    = IBV_QPS_RTS;
-			split_attr2.sq_psn	    = 10083;
-			split_attr2.timeout	    = 14;
-			split_attr2.retry_cnt	= 7;
-			split_attr2.rnr_retry	= 7;
-			split_attr2.max_rd_atomic  = 1;
-			if (__mlx4_modify_qp(mqp->split_qp2, &split_attr2, rts_mask)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to RTS State\n");
-				ret = 1;
-				goto err;
-			}
-			printf("<<<<MODIFY SPLIT QP to RTS>>>>\n");
-
-			printf("<<<<Request SPLIT CQ evnt notification\n");
-			fflush(stdout);
-			if (SPLIT_USE_EVENT) {
-				ret = ibv_req_notify_cq(mqp->split_send_cq, 0); 
-				if (ret) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					goto err;
-				}
-				ret = ibv_req_notify_cq(mqp->split_recv_cq, 0); 
-				if (ret) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					goto err;
-				}
-				ret = ibv_req_notify_cq(mqp->split_cq2, 0); 
-				if (ret) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					goto err;
-				}
-			}
+//// Connect split_qp[0] and split_qp2 to the peer's on the path of the user's qp, and pre-post
+//// the RRs of two-sided splitting. Our credits come with the peer's grant.
+static int split_qps_connect(struct mlx4_qp *mqp, struct split_exchange *ours,
+			     struct split_exchange *theirs)
+{
+	struct ibv_qp *split[2] = { mqp->split_qp[0], mqp->split_qp2 };
+	uint32_t dest[2] = { theirs->qp_num, theirs->qp2_num };
+	struct ibv_qp_attr split_attr;
+	int i;
 
+	//// no message is coming in and no credit is owed to the peer: the slots are all posted again
+	split_recv_pool_reset(&mqp->split_recv);
+	for (i = 0; i < 2; i++) {
+		memcpy(&split_attr, &mqp->user_qp_attr_rtr, sizeof(split_attr));
+		split_attr.dest_qp_num = dest[i];
+		split_attr.rq_psn = theirs->sq_psn;
+		if (split_reset_qp(split[i]) ||
+		    __mlx4_modify_qp(split[i], &mqp->user_qp_attr_init, mqp->user_qp_mask_init) ||
+		    __mlx4_modify_qp(split[i], &split_attr, mqp->user_qp_mask_rtr) ||
+		    split_post_split_recvs(mqp, i, theirs->recv_slots) ||
+		    split_qp_to_rts(split[i], ours->sq_psn)) {
+			fprintf(stderr, "Failed to bring split qp %06x to RTS\n", split[i]->qp_num);
+			return -1;
 		}
-	} else {	// a general solution for split qp qpn exchange
-		if (qp->state == IBV_QPS_RESET && attr->qp_state == IBV_QPS_INIT) {
-			//// USER QP RESET->INIT transition.
-			printf("<<<<USER QP: RESET -> INIT.>>>>\n");
-			fflush(stdout);
-			//// Caching user qp's qp_attr.
-			mqp->user_qp_attr_init = (struct ibv_qp_attr *)malloc(sizeof(struct ibv_qp_attr));
-			memcpy(mqp->user_qp_attr_init, attr, sizeof(struct ibv_qp_attr));
-			mqp->user_qp_mask_init = attr_mask;
-			ret = ibv_cmd_modify_qp(qp, attr, attr_mask, &cmd, sizeof cmd);
-			if (ret) {
-				fprintf(stderr, "Failed to manually modify USER QP to INIT State. %s\n", strerror(errno));
-				goto err;
-			}
-		} else if (qp->state == IBV_QPS_INIT && attr->qp_state == IBV_QPS_RTR) {
-			//// USER QP INIT -> RTR transition.
-			printf("<<<<USER QP: INIT -> RTR.>>>>\n");
-			fflush(stdout);
-			//// Caching user qp's qp_attr.
-			mqp->user_qp_attr_rtr = (struct ibv_qp_attr *)malloc(sizeof(struct ibv_qp_attr));
-			memcpy(mqp->user_qp_attr_rtr, attr, sizeof(struct ibv_qp_attr));
-			mqp->user_qp_mask_rtr = attr_mask;
-
-			//// Move user qp to RTR
-			uint32_t orig_rq_psn = attr->rq_psn;
-			mqp->user_qp_attr_rtr->rq_psn = 18300;
-			ret = ibv_cmd_modify_qp(qp, mqp->user_qp_attr_rtr, attr_mask, &cmd, sizeof cmd);
-			if (ret) {
-				fprintf(stderr, "Failed to manually modify USER QP to RTR State. %s\n", strerror(errno));
-				goto err;
-			}
-			mqp->user_qp_attr_rtr->rq_psn = orig_rq_psn;
-
-			//// Turn off the flag for caching RRs
-			mqp->split_qp_exchange_done = 1;
-
-			//// Move user qp to RTS
-			struct ibv_qp_attr temp_rts_attr;	
-			memset(&temp_rts_attr, 0, sizeof(struct ibv_qp_attr));
-			temp_rts_attr.qp_state	    = IBV_QPS_RTS;
-			temp_rts_attr.sq_psn	    = 18300;
-			temp_rts_attr.timeout	    = 14;
-			temp_rts_attr.retry_cnt		= 7;
-			temp_rts_attr.rnr_retry		= 7;
-			temp_rts_attr.max_rd_atomic  = 1;
-			int rts_mask = 	IBV_QP_STATE              |
-							IBV_QP_TIMEOUT            |
-							IBV_QP_RETRY_CNT          |
-							IBV_QP_RNR_RETRY          |
-							IBV_QP_SQ_PSN             |
-							IBV_QP_MAX_QP_RD_ATOMIC;
-
-			ret = ibv_cmd_modify_qp(qp, &temp_rts_attr, rts_mask, &cmd, sizeof cmd);
-			if (ret) {
-				fprintf(stderr, "Failed to manually modify USER QP to RTS State\n");
-				goto err;
-			}
-
-			//// Exchange split qp qpn using USER QP
-			// post RR for ex message
-			struct ibv_sge rsge;
-			struct ibv_recv_wr rwr;
-			struct ibv_recv_wr *bad_rwr;
-			memset(&rsge, 0, sizeof(rsge));
-			rsge.addr = (uintptr_t)&mqp->split_fc_msg[1];
-			rsge.length = sizeof(struct Split_FC_message);
-			rsge.lkey = mqp->split_fc_mr->lkey;
-
-			memset(&rwr, 0, sizeof(rwr));
-			rwr.wr_id = 0;
-			rwr.next = NULL;
-			rwr.sg_list = &rsge;
-			rwr.num_sge = 1;
-
-			ret = mlx4_post_recv(qp, &rwr, &bad_rwr);
-			if (ret) {
-				fprintf(stderr, "Failed to post exchange RR to user qp.\n");
-				goto err;
-			}
+	}
+	__atomic_store_n(&mqp->split_credits, 0, __ATOMIC_RELAXED);
+	//// nothing of the split qps before their reset is left on the shared cqs
+	mqp->split_sends_posted = 0;
+	__atomic_store_n(&mqp->split_sends_done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&mqp->split_sends_failed, 0, __ATOMIC_RELAXED);
+#ifdef JUSTITIA_DEBUG
+	printf("<<<<SPLIT QPs %06x/%06x connected to %06x/%06x>>>>\n",
+	       split[0]->qp_num, split[1]->qp_num, dest[0], dest[1]);
+	fflush(stdout);
+#endif
+	return 0;
+}
 
-			// Set split qp's sq_psn for exchange
-			uint32_t split_qp_sq_psn = lrand48() & 0xffffff;
-			mqp->split_fc_msg[0].type = EXCHANGE;
-			mqp->split_fc_msg[0].msg.split_qp_exchange.qp_num = mqp->split_qp[0]->qp_num;
-			mqp->split_fc_msg[0].msg.split_qp_exchange.sq_psn = split_qp_sq_psn;
-			printf("<<<<Local qpn: %06x\n", mqp->split_qp[0]->qp_num);
-			printf("<<<<Local sq_psn: %06x\n", split_qp_sq_psn);
-
-			sleep(1);
-			// Post SR for ex message
-			struct ibv_sge ssge;
-			struct ibv_send_wr swr;
-			struct ibv_send_wr *bad_swr;
-				
-			memset(&ssge, 0, sizeof(ssge));
-			ssge.addr	  = (uintptr_t)&mqp->split_fc_msg[0];
-			ssge.length = sizeof(struct Split_FC_message);
-			ssge.lkey	  = mqp->split_fc_mr->lkey;
-				
-			memset(&swr, 0, sizeof(swr));
-			swr.wr_id      = 0;
-			swr.sg_list    = &ssge;
-			swr.num_sge    = 1;
-			swr.opcode     = IBV_WR_SEND;
-			swr.send_flags = IBV_SEND_SIGNALED;
-
-			//printf("@@@before mlx4_post_send, start_flag = %d.\n", start_flag);
-			ret = mlx4_post_send(qp, &swr, &bad_swr);
-			if (ret != 0) {
-				fprintf(stderr, "Failed to post exchange SR to user qp.\n");
-				goto err;
-			}
+//// User's qps waiting for the peer's EXCHANGE or grant. A helper thread looks at them, since
+//// a passive end (the target of one-sided verbs) may never post or poll anything itself.
+static pthread_mutex_t split_exchange_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mlx4_qp *split_exchange_head;
+static int split_exchange_running;
 
-			// Recv exchange message
-			uint32_t remote_split_qpn = mqp->split_fc_msg[1].msg.split_qp_exchange.qp_num;
-			uint32_t remote_split_sq_psn = mqp->split_fc_msg[1].msg.split_qp_exchange.sq_psn; 
-			int ne = 0;
-			struct ibv_wc wc;
-			if (qp->recv_cq == qp->send_cq) {
-				int count_twice = 0;
-				while (count_twice < 2) {
-					do {
-						ne = mlx4_poll_ibv_cq(qp->recv_cq, 1, &wc);
-					} while (ne == 0);
-					count_twice++;
-					if (wc.opcode == IBV_WC_SEND) {
-						printf("<<<<exchange message sent.>>>>\n");
-					} else if (wc.opcode == IBV_WC_RECV) {
-						if (mqp->split_fc_msg[1].type != EXCHANGE) {
-							ret = 1;
-							fprintf(stderr, "Wrong message when exchange split qp info\n");
-							goto err;
-						}
-						remote_split_qpn = mqp->split_fc_msg[1].msg.split_qp_exchange.qp_num;
-						remote_split_sq_psn = mqp->split_fc_msg[1].msg.split_qp_exchange.sq_psn; 
-						printf("<<<<Received remote qpn: %06x\n", remote_split_qpn);
-						printf("<<<<Received remote sq_psn: %06x\n", remote_split_sq_psn);
-						fflush(stdout);
-					} else {
-						ret = 1;
-						fprintf(stderr, "Impossible opcode when polling intial exchange messages\n");
-					}
-				}
-			} else {
-				do {
-					ne = mlx4_poll_ibv_cq(qp->send_cq, 1, &wc);
-				} while (ne == 0);
-				if (wc.opcode != IBV_WC_SEND) {
-					fprintf(stderr, "Wrong opcode when polling exchange sr\n");
-				}
-				printf("<<<<exchange message sent.>>>>\n");
+static int split_exchange_step(struct mlx4_qp *mqp);
 
-				do {
-					ne = mlx4_poll_ibv_cq(qp->recv_cq, 1, &wc);
-				} while (ne == 0);
-				if (wc.opcode != IBV_WC_RECV) {
-					fprintf(stderr, "Wrong opcode when polling exchange rr\n");
-				}
-				if (mqp->split_fc_msg[1].type != EXCHANGE) {
-					ret = 1;
-					fprintf(stderr, "Wrong message when exchange split qp info\n");
-					goto err;
-				}
-				remote_split_qpn = mqp->split_fc_msg[1].msg.split_qp_exchange.qp_num;
-				remote_split_sq_psn = mqp->split_fc_msg[1].msg.split_qp_exchange.sq_psn; 
-				printf("<<<<Received remote qpn: %06x\n", remote_split_qpn);
-				printf("<<<<Received remote sq_psn: %06x\n", remote_split_sq_psn);
-			}
-			// Reset user QP and move to RTR
-			int reset_mask = IBV_QP_STATE;
-			struct ibv_qp_attr temp_reset_attr;
-			memset(&temp_reset_attr, 0, sizeof(struct ibv_qp_attr));
-			temp_reset_attr.qp_state = IBV_QPS_RESET;
-			ret = __mlx4_modify_qp(qp, &temp_reset_attr, reset_mask);
-			if (ret) {
-				fprintf(stderr, "Failed to modify USER QP to RESET State.\n");
-				goto err;
-			}
+static void *split_exchange_thread(void *arg)
+{
+	struct mlx4_qp **p;
+
+	pthread_mutex_lock(&split_exchange_mutex);
+	while (split_exchange_head) {
+		for (p = &split_exchange_head; *p; ) {
+			if (split_exchange_step(*p))
+				*p = (*p)->split_exchange_next;
+			else
+				p = &(*p)->split_exchange_next;
+		}
+		pthread_mutex_unlock(&split_exchange_mutex);
+		usleep(SPLIT_EXCHANGE_POLL_US);
+		pthread_mutex_lock(&split_exchange_mutex);
+	}
+	split_exchange_running = 0;
+	pthread_mutex_unlock(&split_exchange_mutex);
+	return NULL;
+}
 
-			ret = __mlx4_modify_qp(qp, mqp->user_qp_attr_init, mqp->user_qp_mask_init);
-			if (ret) {
-				fprintf(stderr, "Failed to modify USER QP to INIT State.\n");
-				goto err;
-			}
+static void split_exchange_watch(struct mlx4_qp *mqp)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_mutex_lock(&split_exchange_mutex);
+	mqp->split_exchange_next = split_exchange_head;
+	split_exchange_head = mqp;
+	if (!split_exchange_running) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		split_exchange_running = !pthread_create(&thread, &attr, split_exchange_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (!split_exchange_running)
+			fprintf(stderr, "Couldn't start the split qp exchange thread\n");
+	}
+	pthread_mutex_unlock(&split_exchange_mutex);
+}
 
-			ret = __mlx4_modify_qp(qp, mqp->user_qp_attr_rtr, mqp->user_qp_mask_rtr);
-			if (ret) {
-				fprintf(stderr, "Failed to modify USER QP to RTR State.\n");
-				goto err;
-			}
-			printf("<<<<USER QP back to RTR now.\n");
+//// Once this returns, the exchange thread no longer touches mqp
+static void split_exchange_unwatch(struct mlx4_qp *mqp)
+{
+	struct mlx4_qp **p;
 
-			////repost cached RRs to UESR QP
-			printf("RR buffer size = %u", mqp->rr_buf.size);
-			if (rr_buffer_post_and_clear(&mqp->rr_buf, qp)) {
-				ret = 1;
-				goto err;
-			}
+	pthread_mutex_lock(&split_exchange_mutex);
+	for (p = &split_exchange_head; *p; p = &(*p)->split_exchange_next) {
+		if (*p == mqp) {
+			*p = mqp->split_exchange_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&split_exchange_mutex);
+}
 
-			// Move split_qp qp state to INIT
-			if (__mlx4_modify_qp(mqp->split_qp[0], mqp->user_qp_attr_init, mqp->user_qp_mask_init)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to INIT State\n");
-				goto err;
-			}
-			printf("<<<<MODIFY SPLIT QP to INIT>>>>\n");	
-
-			// Move split_qp qp state to RTR
-			mqp->user_qp_attr_rtr->dest_qp_num = remote_split_qpn;
-			mqp->user_qp_attr_rtr->rq_psn = remote_split_sq_psn;
-			if (__mlx4_modify_qp(mqp->split_qp[0], mqp->user_qp_attr_rtr, mqp->user_qp_mask_rtr)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to INIT State\n");
-				goto err;
-			}
-			printf("<<<<MODIFY SPLIT QP to RTR>>>>\n");	
-
-			// pre-post a RR for later use
-			struct ibv_sge sge;
-			struct ibv_recv_wr wr;
-			struct ibv_recv_wr *bad_wr;
-			memset(&sge, 0, sizeof(sge));
-			sge.addr = (uintptr_t)&mqp->split_fc_msg[0];
-			sge.length = sizeof(struct Split_FC_message);
-			sge.lkey = mqp->split_fc_mr->lkey;
-
-			memset(&wr, 0, sizeof(wr));
-			wr.wr_id = 0;
-			wr.next = NULL;
-			wr.sg_list = &sge;
-			wr.num_sge = 1;
-
-			if (mlx4_post_recv(mqp->split_qp[0], &wr, &bad_wr)) {
-				fprintf(stderr, "Failed to post the initial RR to split qp.\n");
-				goto err;
-			}
+//// One look at a user's qp waiting for its peer, under split_exchange_mutex. Once the peer's
+//// EXCHANGE is in and ours went out, the split qps are kept if both ends are still connected to
+//// each other; if not, they are connected and the grant is sent, and the qp splits when the
+//// peer's grant comes in. A qp that never gets the grant stays
+//// connected for the peer's split messages but does not split its own. Returns 1 once the
+//// exchange thread is done with the qp.
+static int split_exchange_step(struct mlx4_qp *mqp)
+{
+	struct split_exchange *ours = &mqp->split_fc_msg[0].msg.split_qp_exchange;
+	struct split_exchange *theirs = &mqp->split_fc_msg[1].msg.split_qp_exchange;
+	int keep;
+	int ret;
 
-			// Move split_qp qp state to RTS
-			temp_rts_attr.sq_psn = split_qp_sq_psn;
-			if (__mlx4_modify_qp(mqp->split_qp[0], &temp_rts_attr, rts_mask)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to RTS State\n");
-				goto err;
-			}
-			printf("<<<<MODIFY SPLIT QP to RTS>>>>\n");
+	if (mqp->split_qp_exchange_done == 2) {
+		ret = mlx4_split_reap_grant(mqp);
+		if (ret < 0)
+			goto fail;
+		return ret || split_now_ms() >= mqp->split_exchange_deadline;
+	}
+	if (!split_exchange_arrived(theirs) ||
+	    !__atomic_load_n(&mqp->split_exchange_tx, __ATOMIC_ACQUIRE))
+		return 0;
+	//// the peer connects its split qps once it has ours
+	if (mlx4_post_split_exchange(mqp))
+		goto fail;
+	if (!theirs->qp_num) {
+		//// the peer takes no EXCHANGEs, so it never splits with us
+		__atomic_store_n(&mqp->split_qp_exchange_done, -1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	if (theirs->user_psn != mqp->split_rq_psn)
+		goto fail;
+
+	//// only our own split qps are offered (split_exchange_rts), as the peer's chunks are reassembled
+	//// for this qp alone
+	keep = split_exchange_choose(ours, theirs) == 0;
+	mqp->split_peer.recv_slots = theirs->recv_slots;
+	mqp->split_peer.slot_size = theirs->slot_size;
+	mqp->split_peer.split_min = theirs->split_min;
+	if (keep) {
+		//// up at both ends already, credits included
+		__atomic_store_n(&mqp->split_qp_exchange_done, 1, __ATOMIC_RELEASE);
+		return 1;
+	}
+	mqp->split_peer.valid = 0;
+	if (split_qps_connect(mqp, ours, theirs))
+		goto fail;
+	mqp->split_peer.qp_num = theirs->qp_num;
+	mqp->split_peer.qp2_num = theirs->qp2_num;
+	mqp->split_peer.valid = 1;
+
+	//// the grant: our split qps are connected to the peer's, with all of our slots free
+	if (mlx4_post_split_credit(mqp->split_qp2, ours->recv_slots))
+		goto fail;
+	mqp->split_exchange_deadline = split_now_ms() + SPLIT_EXCHANGE_TIMEOUT_MS;
+	__atomic_store_n(&mqp->split_qp_exchange_done, 2, __ATOMIC_RELEASE);
+	return 0;
 
-			free(mqp->user_qp_attr_init);
-			free(mqp->user_qp_attr_rtr);
+fail:
+	fprintf(stderr, "split qp EXCHANGE of qp %06x failed; posting it without splitting\n",
+		mqp->verbs_qp.qp.qp_num);
+	__atomic_store_n(&mqp->split_qp_exchange_done, -1, __ATOMIC_RELAXED);
+	return 1;
+}
 
-			printf("<<<<Request SPLIT CQ evnt notification\n");
-			if (SPLIT_USE_EVENT) {
-				ret = ibv_req_notify_cq(mqp->split_send_cq, 0); 
-				if (ret) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					goto err;
-				}
-				ret = ibv_req_notify_cq(mqp->split_recv_cq, 0); 
-				if (ret) {
-					fprintf(stderr, "Couldn't request CQ notification\n");
-					goto err;
-				}
-			}
+//// RESET -> INIT: a user's qp that is not on an SRQ takes the peer's EXCHANGE in a RR posted
+//// ahead of any of the application's
+static void split_exchange_init(struct mlx4_qp *mqp)
+{
+	struct ibv_qp *qp = &mqp->verbs_qp.qp;
+
+	mqp->split_qp_exchange_done = -1;
+	if (qp->srq)
+		return;
+	//// without receive slots the peer does not split what it sends us; with them, polls of
+	//// the recv cq look for split messages (see mlx4_poll_cq). The chunks of the peer
+	//// complete on that cq too, which grows by a slot's worth for them.
+	//// Slots are only offered with MLX4_SPLIT_RECV=1 (read_init_vars).
+	if (to_mctx(qp->context)->split_recv && !mqp->split_recv.buf) {
+		if (split_recv_pool_alloc(&mqp->split_recv, qp->pd, mqp->rq.max_gs) ||
+		    mlx4_resize_cq(qp->recv_cq, qp->recv_cq->cqe + SPLIT_RECV_SLOTS)) {
+			fprintf(stderr, "split: no receive slots for qp %06x\n", qp->qp_num);
+			split_recv_pool_free(&mqp->split_recv);
 		} else {
-			//// modify original user's qp state. In this case, the user can move her qp to RTS
-			ret = ibv_cmd_modify_qp(qp, attr, attr_mask, &cmd, sizeof cmd);
+			__atomic_fetch_add(&to_mcq(qp->recv_cq)->split_recv_qps, 1, __ATOMIC_RELAXED);
 		}
 	}
+	memset(&mqp->split_fc_msg[1], 0, sizeof(mqp->split_fc_msg[1]));
+	mqp->split_exchange_cqes = SPLIT_EXCHANGE_RECV_CQE;
+	if (split_post_fc_recv(mqp, qp, &mqp->split_fc_msg[1])) {
+		mqp->split_exchange_cqes = 0;
+		return;
+	}
+	mqp->split_qp_exchange_done = 0;
+}
 
+//// INIT -> RTR of a qp that takes EXCHANGEs: one psn early, for the peer's
+static int split_exchange_rtr(struct mlx4_qp *mqp, struct ibv_qp_attr *attr, int attr_mask)
+{
+	struct ibv_qp_attr rtr_attr;
+	int ret;
 
+	memcpy(&rtr_attr, attr, sizeof(rtr_attr));
+	rtr_attr.rq_psn = split_psn_prev(attr->rq_psn);
+	ret = __mlx4_modify_qp(&mqp->verbs_qp.qp, &rtr_attr, attr_mask);
+	if (ret)
+		return ret;
+	//// the split qps are brought up on the same path
+	memcpy(&mqp->user_qp_attr_rtr, attr, sizeof(*attr));
+	mqp->user_qp_mask_rtr = attr_mask;
+	mqp->split_rq_psn = attr->rq_psn;
+	split_exchange_watch(mqp);
+	return 0;
+}
 
-check:
-	if (!ret		       &&
-	    (attr_mask & IBV_QP_STATE) &&
-	    attr->qp_state == IBV_QPS_RESET) {
-		////printf("DEBUG MLX4_MODIFY_QP: also enter here\n");
-		if (qp->recv_cq)
-			mlx4_cq_clean(to_mcq(qp->recv_cq), qp->qp_num,
-				      qp->srq ? to_msrq(qp->srq) : NULL);
-		if (qp->send_cq && qp->send_cq != qp->recv_cq)
-			mlx4_cq_clean(to_mcq(qp->send_cq), qp->qp_num, NULL);
+//// RTR -> RTS: one psn early, for our EXCHANGE. Every user's qp that splits sends one, so its
+//// peer finds the application's messages at the psns it was given whether it takes EXCHANGEs
+//// or not.
+static int split_exchange_rts(struct mlx4_qp *mqp, struct ibv_qp_attr *attr, int attr_mask)
+{
+	struct ibv_qp *qp = &mqp->verbs_qp.qp;
+	struct split_exchange *ours = &mqp->split_fc_msg[0].msg.split_qp_exchange;
+	struct ibv_qp_attr rts_attr;
+	int splits = mqp->split_qp_exchange_done == 0;
+	int keep = splits && mqp->split_peer.valid &&
+		   mqp->split_qp[0]->state == IBV_QPS_RTS &&
+		   mqp->split_qp2->state == IBV_QPS_RTS;
+	int ret;
 
-		mlx4_init_qp_indices(to_mqp(qp));
-		if (to_mqp(qp)->rq.wqe_cnt)
-			*to_mqp(qp)->db = 0;
+	memcpy(&rts_attr, attr, sizeof(rts_attr));
+	rts_attr.sq_psn = split_psn_prev(attr->sq_psn);
+	ret = __mlx4_modify_qp(qp, &rts_attr, attr_mask);
+	if (ret)
+		return ret;
 
-		if (qp->qp_type == IBV_QPT_RC) {
-			//// do same for custom_qp
-			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-				qp = mqp->split_qp[i];
-				if (qp->recv_cq)
-					mlx4_cq_clean(to_mcq(qp->recv_cq), qp->qp_num,
-							qp->srq ? to_msrq(qp->srq) : NULL);
-				if (qp->send_cq && qp->send_cq != qp->recv_cq)
-					mlx4_cq_clean(to_mcq(qp->send_cq), qp->qp_num, NULL);
-
-				mlx4_init_qp_indices(to_mqp(qp));
-				if (to_mqp(qp)->rq.wqe_cnt)
-					*to_mqp(qp)->db = 0;
-			}
+	memset(&mqp->split_fc_msg[0], 0, sizeof(mqp->split_fc_msg[0]));
+	mqp->split_fc_msg[0].type = EXCHANGE;
+	if (splits) {
+		ours->qp_num = mqp->split_qp[0]->qp_num;
+		ours->qp2_num = mqp->split_qp2->qp_num;
+		ours->recv_slots = mqp->split_recv.num_slots;
+		ours->slot_size = mqp->split_recv.slot_size;
+	}
+	ours->sq_psn = (getpid() ^ qp->qp_num ^ (uint32_t)get_cycles()) & SPLIT_PSN_MASK;
+	ours->split_min = MIN_SPLIT_CHUNK_SIZE;
+	ours->user_psn = attr->sq_psn;
+	//// the split qps stay as they are if the peer's are still connected to them
+	if (keep) {
+		ours->links = 1;
+		ours->link[0].qp_num = ours->qp_num;
+		ours->link[0].qp2_num = ours->qp2_num;
+		ours->link[0].peer_qp_num = mqp->split_peer.qp_num;
+		ours->link[0].peer_qp2_num = mqp->split_peer.qp2_num;
+	}
+	ours->seal = SPLIT_EXCHANGE_SEAL;
+	__atomic_store_n(&mqp->split_exchange_tx, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+//// Modify to change the qp state of the user's qp and bring up its split qps.
+//// Each end sends the EXCHANGE (split_exchange.h) as the first message on the user's qp, one
+//// psn ahead of the application's, so nothing waits for the peer here; the split qps are
+//// connected by the exchange thread once both EXCHANGEs are through.
+int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		   int attr_mask)
+{
+	struct mlx4_qp *mqp = to_mqp(qp);
+	enum ibv_qp_state cur_state = qp->state;
+	int ret;
 
-			qp = mqp->split_qp2;
-			if (qp->recv_cq)
-				mlx4_cq_clean(to_mcq(qp->recv_cq), qp->qp_num,
-						qp->srq ? to_msrq(qp->srq) : NULL);
-			if (qp->send_cq && qp->send_cq != qp->recv_cq)
-				mlx4_cq_clean(to_mcq(qp->send_cq), qp->qp_num, NULL);
-
-			mlx4_init_qp_indices(to_mqp(qp));
-			if (to_mqp(qp)->rq.wqe_cnt)
-				*to_mqp(qp)->db = 0;
-			////
+	//// Ignore QPs that are not RC for now
+	if (qp->qp_type != IBV_QPT_RC || !mqp->split_qp2 || !(attr_mask & IBV_QP_STATE)) {
+		ret = __mlx4_modify_qp(qp, attr, attr_mask);
+		goto out;
+	}
+
+	switch (attr->qp_state) {
+	case IBV_QPS_INIT:
+		ret = __mlx4_modify_qp(qp, attr, attr_mask);
+		if (!ret && cur_state == IBV_QPS_RESET) {
+			//// cached to bring the split qps up like the user's qp
+			memcpy(&mqp->user_qp_attr_init, attr, sizeof(*attr));
+			mqp->user_qp_mask_init = attr_mask;
+			split_exchange_init(mqp);
+		}
+		break;
+	case IBV_QPS_RTR:
+		if (cur_state == IBV_QPS_INIT && mqp->split_qp_exchange_done == 0)
+			ret = split_exchange_rtr(mqp, attr, attr_mask);
+		else
+			ret = __mlx4_modify_qp(qp, attr, attr_mask);
+		break;
+	case IBV_QPS_RTS:
+		if (cur_state == IBV_QPS_RTR)
+			ret = split_exchange_rts(mqp, attr, attr_mask);
+		else
+			ret = __mlx4_modify_qp(qp, attr, attr_mask);
+		break;
+	case IBV_QPS_RESET:
+		split_exchange_unwatch(mqp);
+		ret = __mlx4_modify_qp(qp, attr, attr_mask);
+		if (!ret) {
+			//// the split qps stay connected for a reconnect to the same peer
+			mqp->split_qp_exchange_done = -1;
+			mqp->split_exchange_tx = 0;
+			mqp->split_exchange_cqes = 0;
 		}
+		break;
+	default:
+		ret = __mlx4_modify_qp(qp, attr, attr_mask);
+		break;
 	}
-	start_flag = 1;
-	//start_recv = 1;
-err:
+
+out:
+	//// paced by the pacer of the port it is on
+	if (!ret && (attr_mask & IBV_QP_STATE) && attr->qp_state == IBV_QPS_INIT &&
+	    (attr_mask & IBV_QP_PORT))
+		justitia_flow_port(mqp, attr->port_num);
 	return ret;
 }
 
@@ -1988,39 +2043,37 @@ static void mlx4_unlock_cqs(struct ibv_qp *qp)
 	}
 }
 
-//// also do cleanup for split_qp
-//TODO: cleanup multi qps later; in fact there's something hasn't been fixed for cleanup for a long time
+//// also destroys the split qps of a user's qp
 int mlx4_destroy_qp(struct ibv_qp *ibqp)
 {
 	struct mlx4_qp *qp = to_mqp(ibqp);
 	int ret;
 
+	if (qp->split_qp2)
+		split_exchange_unwatch(qp);
+	split_qps_destroy(qp);
+
 	pthread_mutex_lock(&to_mctx(ibqp->context)->qp_table_mutex);
 	ret = ibv_cmd_destroy_qp(ibqp);
 	if (ret) {
 		pthread_mutex_unlock(&to_mctx(ibqp->context)->qp_table_mutex);
 		return ret;
 	}
+	justitia_flow_release(qp);
 
 	mlx4_lock_cqs(ibqp);
-	if (qp->split_qp[0]->recv_cq) {
-		__mlx4_cq_clean(to_mcq(qp->split_qp[0]->recv_cq), qp->split_qp[0]->qp_num, NULL);
-	}
-	if (qp->split_qp[0]->send_cq && qp->split_qp[0]->send_cq != qp->split_qp[0]->recv_cq) {
-		__mlx4_cq_clean(to_mcq(qp->split_qp[0]->send_cq), qp->split_qp[0]->qp_num, NULL);
-	}
 	if (ibqp->recv_cq) {
 		__mlx4_cq_clean(to_mcq(ibqp->recv_cq), ibqp->qp_num,
 				ibqp->srq ? to_msrq(ibqp->srq) : NULL);
+		if (qp->split_recv.buf && !ibqp->srq)
+			__atomic_fetch_sub(&to_mcq(ibqp->recv_cq)->split_recv_qps, 1, __ATOMIC_RELAXED);
 	}
 	if (ibqp->send_cq && ibqp->send_cq != ibqp->recv_cq) {
 		__mlx4_cq_clean(to_mcq(ibqp->send_cq), ibqp->qp_num, NULL);
 	}
 
-	if (qp->sq.wqe_cnt || qp->rq.wqe_cnt) {
-		mlx4_clear_qp(to_mctx(qp->split_qp[0]->context), qp->split_qp[0]->qp_num);
+	if (qp->sq.wqe_cnt || qp->rq.wqe_cnt)
 		mlx4_clear_qp(to_mctx(ibqp->context), ibqp->qp_num);
-	}
 
 	mlx4_unlock_cqs(ibqp);
 	pthread_mutex_unlock(&to_mctx(ibqp->context)->qp_table_mutex);
@@ -2042,15 +2095,13 @@ int mlx4_destroy_qp(struct ibv_qp *ibqp)
 		}
 	}
 
-	if (qp->rq.wqe_cnt) {
-		mlx4_free_db(to_mctx(qp->split_qp[0]->context), MLX4_DB_TYPE_RQ, to_mqp(qp->split_qp[0])->db);
+	if (qp->rq.wqe_cnt)
 		mlx4_free_db(to_mctx(ibqp->context), MLX4_DB_TYPE_RQ, qp->db);
-	}
 
-	mlx4_dealloc_qp_buf(qp->split_qp[0]->context, to_mqp(qp->split_qp[0]));
 	mlx4_dealloc_qp_buf(ibqp->context, qp);
 
-	free(to_mqp(qp->split_qp[0]));
+	split_arena_free(&qp->split_arena);
+	split_recv_pool_free(&qp->split_recv);
 	free(qp);
 
 	return 0;
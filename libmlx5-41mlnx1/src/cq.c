@@ -48,6 +48,9 @@
 #include "mlx5.h"
 #include "wqe.h"
 #include "doorbell.h"
+/* isolation */
+#include "pacer.h"
+/* end */
 
 enum {
 	CQ_OK					=  0,
@@ -906,6 +909,15 @@ static inline int is_odp_pfault_err(struct mlx5_err_cqe *ecqe)
 	       ecqe->vendor_err_synd == MLX5_CQE_VENDOR_SYNDROME_ODP_PFAULT;
 }
 
+//// Whether a completion of the user's qp is that of the split qp EXCHANGE (split_exchange.h),
+//// the first on its side of the qp, which the application never sees
+static inline int split_exchange_cqe(struct mlx5_qp *mqp, int responder)
+{
+	uint8_t bit = responder ? SPLIT_EXCHANGE_RECV_CQE : SPLIT_EXCHANGE_SEND_CQE;
+
+	return !!(__atomic_fetch_and(&mqp->split_exchange_cqes, (uint8_t)~bit, __ATOMIC_RELAXED) & bit);
+}
+
 static inline int mlx5_poll_one(struct mlx5_cq *cq,
 				struct mlx5_resource **cur_rsc,
 				struct mlx5_srq **cur_srq, struct ibv_exp_wc *wc,
@@ -1103,6 +1115,14 @@ repoll:
 		wc->wr_id = wq->wrid[idx];
 		wq->tail = mqp->gen_data.wqe_head[idx] + 1;
 		wc->status = err;
+		/* isolation */
+		if (mqp->pace.lat) {
+			uint64_t now = 0;
+
+			mlx5_get_cycles(&now);
+			lat_hist_record(mqp->pace.lat, now - mqp->pace.post_cycles[idx]);
+		}
+		/* end */
 		break;
 	case MLX5_CQE_RESP_WR_IMM:
 	case MLX5_CQE_RESP_SEND:
@@ -1209,6 +1229,14 @@ repoll:
 		wmb();
 	}
 
+	if (unlikely(mqp && mqp->split_exchange_cqes) && split_exchange_cqe(mqp, responder)) {
+		mqp = NULL;
+		rwq = NULL;
+		is_srq = 0;
+		exp_wc_flags = 0;
+		goto repoll;
+	}
+
 	return CQ_OK;
 }
 
@@ -532,6 +532,17 @@ static int get_cqe_comp(struct ibv_context *context)
 	return strcmp(env, "0") ? 1 : 0;
 }
 
+//// The EXCHANGE shifts the psns of the user's qps (split_exchange.h): off unless asked for
+static int get_split_exchange(struct ibv_context *context)
+{
+	char env[VERBS_MAX_ENV_VAL];
+
+	if (ibv_exp_cmd_getenv(context, SPLIT_EXCHANGE_ENV, env, sizeof(env)))
+		return 0;
+
+	return strcmp(env, "1") ? 0 : 1;
+}
+
 static int get_use_mutex(struct ibv_context *context)
 {
 	char env[VERBS_MAX_ENV_VAL];
@@ -1062,6 +1073,7 @@ static int mlx5_alloc_context(struct verbs_device *vdev,
 	context->prefer_bf = get_always_bf(&context->ibv_ctx);
 	context->shut_up_bf = get_shut_up_bf(&context->ibv_ctx);
 	context->enable_cqe_comp = get_cqe_comp(&context->ibv_ctx);
+	context->split_exchange = get_split_exchange(&context->ibv_ctx);
 	mlx5_use_mutex = get_use_mutex(&context->ibv_ctx);
 
 	offset = 0;
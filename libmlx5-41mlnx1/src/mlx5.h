@@ -48,6 +48,8 @@
 #include "bitmap.h"
 #include "implicit_lkey.h"
 #include "wqe.h"
+#include "flow_class.h"
+#include "split_exchange.h"
 
 ////
 #include <inttypes.h>
@@ -55,20 +57,20 @@
 //#define SPLIT_CHUNK_SIZE		10000			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
 #define MIN_SPLIT_CHUNK_SIZE    2048			//// A minimun chunk size that everybody knows and assumes.
 //#define SPLIT_CHUNK_SIZE		10485760			//// Default Split Chunk Size; Need to be equal or less than the initial chunk size that pacer sets.
-#define MANUAL_SPLIT_QPN_DIFF 	1				//// manually set (guess) split qpn/psn or general approcah
-#define SPLIT_QP_NUM_DIFF		1				//// DC if MANUAL_SPLIT is off
+#define SPLIT_EXCHANGE_TIMEOUT_MS	5000		//// give up splitting if the peer's grant does not arrive in time after the EXCHANGE
+#define SPLIT_EXCHANGE_POLL_US		1000		//// how often the exchange thread looks at the qps waiting for their peer
+#define SPLIT_EXCHANGE_RECV_CQE		1			//// split_exchange_cqes: the first receive completion of the user's qp is the peer's EXCHANGE
+#define SPLIT_EXCHANGE_SEND_CQE		2			//// and the first send completion is our own
 #define SPLIT_USE_EVENT			1				//// event-triggered polling for splitting
+#define SPLIT_CREDIT_REAP_BATCH	16				//// credit returns reaped from split_cq2 per poll
 //#define SPLIT_USE_LINKED_LIST	0				//// post using a linked list or not (for one-sided verbs) (for testing purposes)
 //#define SPLIT_USE_NO_BATCH		0				//// 1 -> post 1 poll 1 at one-sided verbs; DC if SPLIT_USE_LINKED_LIST is 1; 0 -> use batch 
-#define SPLIT_USE_NO_BATCH_2SIDED		1		//// 1 -> post 1 poll 1 at two-sided verbs; 
 #define SPLIT_ONE_SIDED_BATCH_SIZE		1		//// batch rate in one-sided verbs. 1 means no batch
-#define SPLIT_USE_SELECTIVE_SIGNALING	1		//// use selective signaling (only last chunk signaled) or not when sending split chunks 
 //#define SPLIT_QP_NUM_ONE_SIDED			2		//// Default number of split_QPs used to send split chunks in one-sided verbs
 #define MAX_SPLIT_QP_NUM_ONE_SIDED		1	    //// Maximum number of split_QPs used to send split chunks in one-sided verbs
 #define SPLIT_MAX_SEND_WR 		6000
-#define SPLIT_MAX_RECV_WR 		6000
-#define SPLIT_MAX_CQE			10000
-#define RR_BUFFER_INIT_CAP		1000
+#define SPLIT_QP2_WR			64		//// split_qp2 only carries the grant and the peer's credit returns
+#define SPLIT_IDLE_LINKS		4		//// links of a pd no user QP splits over that are kept, of each state
 //#define CPU_FRIENDLY                            //// Don't not use busy-wait checking for "pending" in shared memory. Use UDS with token enforcement.
 #define SPLIT_BIG_CHUNK_SIZE    1000000	        //// The big chunk size used in CPU_FRIENDLY version. Should be consistent with the value used in Pacer.
 //#define SPLIT_BIG_CHUNK_SIZE    10485760	        //// The big chunk size used in CPU_FRIENDLY version. Should be consistent with the value used in Pacer.
@@ -361,27 +363,51 @@ struct Split_FC_message {
 			uint32_t num_split_chunks;
 			uint32_t current_chunk_size;
 		} split_chunk_info;
-		struct {
-			uint32_t qp_num;
-			uint32_t sq_psn;
-		} split_qp_exchange;
+		struct split_exchange split_qp_exchange;
 	} msg;
 };
 ////
 
-//// Buffer holding Receive Requests posted at the user's qp at INIT state
-struct rr_buffer {
-	struct ibv_recv_wr **slot;	// head of the buffer
-	unsigned int size;			// number of wr_head pointers
+//// What the peer of a user's qp said in its EXCHANGE about splitting towards it
+struct split_peer {
+	uint32_t		recv_slots;		// credits the peer grants for two-sided chunks
+	uint32_t		slot_size;
+	uint32_t		split_min;
+};
+
+//// Justitia pacing state of a user's qp. Class, pacer slot and token credit belong to the qp,
+//// so a thread driving both a latency qp and a bandwidth qp paces each of them on its own.
+struct justitia_flow {
+	struct flow_info	*flow;			// slot in the pacer's shm; NULL while unpaced
+	struct justitia_pacer	*pacer;			// of the port the qp is on; NULL if it has none
+	struct shared_block	*sb;			// that pacer's shm
+	struct mlx5_qp		*next;			// process-wide list of qps holding a slot
+	unsigned int		slot;
+	pid_t			tid;			// thread that joined; pid:tid:qpn is the slot key
+	int			started;		// the pacer has been told the class of the qp
+	int64_t			byte_credit;		// bw: bytes still covered by the last token
+	int32_t			debit;			// tput: WRs still covered by the last token
+	unsigned int		flow_socket;		// CPU_FRIENDLY: the pacer signals tokens here
+	uint64_t		*post_cycles;		// lat: tsc at which each SQ WQE was posted
+	struct lat_hist		*lat;			// lat: completion latencies in the pacer's shm; NULL when not recorded
+	uint64_t		msg_left;		// bw: bytes of the message being posted not yet charged to tokens
+	int			auto_class;		// no class hint: the class is taken from what the qp posts
+	struct flow_class	fc;
+	uint32_t		reserved;		// tput: MBps the pacer guarantees the qp; paced by bytes like bw then
+	int			registered;		// posted to while attached to a pacer: joins every new one
+	uint32_t		epoch;			// of the pacer the qp joined last, or tried to
+};
+
+//// Chunk descriptors used to build split chains without touching the user's wr.
+//// Sized from SPLIT_MAX_SEND_WR so one window of chunks always fits in the split SQ;
+//// each chunk owns max_sge SGEs so it can span several entries of the user's sg_list.
+struct split_arena {
+	struct ibv_send_wr *wr;
+	struct ibv_sge *sge;
 	unsigned int capacity;
+	unsigned int max_sge;
 };
 
-int rr_buffer_init(struct rr_buffer *rr_buf, unsigned int cap);
-
-int rr_buffer_enqueue(struct rr_buffer *rr_buf, struct ibv_recv_wr* wr);
-
-int rr_buffer_post_and_clear(struct rr_buffer *rr_buf, struct ibv_qp *qp);
-
 ////
 
 struct mlx5_resource {
@@ -441,6 +467,7 @@ struct mlx5_context {
 	int				prefer_bf;
 	int				shut_up_bf;
 	int				enable_cqe_comp;
+	int				split_exchange;		//// SPLIT_EXCHANGE_ENV: RC qps split
 	struct {
 		struct mlx5_resource  **table;
 		int			refcnt;
@@ -561,14 +588,84 @@ struct mlx5_buf {
 	int				numa_alloc;
 };
 
+//// Registered home of the split control messages (4 per user QP), so creating a
+//// user QP takes a slot instead of registering its own MR.
+#define SPLIT_FC_SLAB_QPS		64
+
+struct split_fc_slab {
+	struct split_fc_slab	*next;
+	struct ibv_mr		*mr;
+	uint64_t		free_mask;	/* bit i set: msg[i] is free */
+	struct Split_FC_message	msg[SPLIT_FC_SLAB_QPS][4];
+};
+
+//// Split QPs of a PD connected to those of one peer (split_exchange.h): split_qp[0] carries
+//// the chunks, split_qp2 the credits. A link is made when an EXCHANGE needs one rather than
+//// with the user QP, and user QPs of the PD brought up alike to the same peer split over
+//// the same link, one split at a time. Links no user QP splits over stay in the pool for the
+//// next EXCHANGE, up to SPLIT_IDLE_LINKS.
+enum {
+	SPLIT_LINK_IDLE,	/* connected to nothing */
+	SPLIT_LINK_GRANT,	/* connected, waiting for the peer's grant */
+	SPLIT_LINK_UP,		/* the peer's grant came in */
+};
+
+struct mlx5_split_link {
+	struct mlx5_split_link	*next;		/* on the pool's list */
+	struct ibv_qp		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED];
+	struct ibv_qp		*split_qp2;
+	int			users;		/* user QPs splitting over it or offering it; guarded by the pool mutex */
+	int			state;		/* SPLIT_LINK_* */
+	uint32_t		peer_qp_num;	/* the peer's split_qp[0] and split_qp2 */
+	uint32_t		peer_qp2_num;
+	uint32_t		peer_recv_slots;	/* the peer reassembles our chunks: one user QP at a time */
+	struct ibv_qp_attr	attr_init;	/* what it was brought up with */
+	struct ibv_qp_attr	attr_rtr;
+	int			send_cqe;	/* entries reserved in the pool's cqs */
+	int			cq2_cqe;
+	int			credits;	/* free slots of the peer for our two-sided chunks */
+	struct mlx5_lock	lock;		/* held by a split from its first post to its last completion */
+	struct split_arena	arena;		/* allocated by the first split */
+	uint32_t		sends_posted;	/* signaled chunks posted to split_qp[0] */
+	uint32_t		sends_done;	/* and their completions, handed over from the shared send cq */
+	int			sends_failed;	/* a chunk completed in error */
+};
+
+//// Split resources shared by every user QP of a PD: the split CQs and their
+//// completion channels, the links and the control-message slabs. A completion reaped
+//// from a shared CQ is handed to the link named by its wr_id, so splits over different
+//// links go on at the same time: a CQ's reap lock is only held while it is reaped, and
+//// one waiter at a time sleeps on each channel while the others wait on wait_cond.
+//// Every link reserves the entries of the shared CQs its QPs may fill, flushes of a QP
+//// in error included, and a CQ grows before it could be overrun.
+struct mlx5_split_pool {
+	struct mlx5_lock	send_lock;	/* reaps send_cq */
+	struct mlx5_lock	cq2_lock;	/* reaps cq2 */
+	int			refcnt;		/* user QPs attached; guarded by the pool mutex in verbs.c */
+	pthread_mutex_t		wait_mutex;	/* guards the reapers below */
+	pthread_cond_t		wait_cond;	/* broadcast after every reap that handed out completions */
+	int			send_reaper;	/* a waiter reaps send_cq */
+	int			cq2_reaper;	/* a waiter reaps cq2 */
+	struct ibv_comp_channel	*send_channel;
+	struct ibv_comp_channel	*channel2;
+	struct ibv_cq		*send_cq;	/* split_qp[0] of the links */
+	struct ibv_cq		*cq2;		/* split_qp2 of the links */
+	int			send_cqe;	/* entries of each cq reserved by the links */
+	int			cq2_cqe;
+	struct mlx5_split_link	*links;		/* guarded by the pool mutex */
+	struct split_fc_slab	*slabs;
+};
+
+int mlx5_split_reserve_arena(struct split_arena *arena, unsigned int max_sge);
+
 struct mlx5_pd {
 	struct ibv_pd			ibv_pd;
 	uint32_t			pdn;
 	struct mlx5_implicit_lkey       r_ilkey;
 	struct mlx5_implicit_lkey       w_ilkey;
 	struct mlx5_implicit_lkey      *remote_ilkey;
-	//// added for splitting cleanup
-	struct ibv_mr		*split_fc_mr;
+	//// added for splitting
+	struct mlx5_split_pool	*split_pool;
 	////
 };
 
@@ -905,27 +1002,28 @@ struct mlx5_qp {
 	uint32_t				max_tso_header;
 	uint32_t                                flags; /* Use enum mlx5_qp_flags */
 	//// added for spliting
-	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED];
-	struct ibv_qp 		*split_qp2;
-	//struct ibv_cq		*split_cq;
-	struct ibv_cq		*split_send_cq;
-	struct ibv_cq		*split_recv_cq;
-	struct ibv_cq		*split_cq2;
-	//struct ibv_comp_channel *split_comp_channel;
-	struct ibv_comp_channel *split_comp_send_channel;
-	struct ibv_comp_channel *split_comp_recv_channel;
-	struct ibv_comp_channel *split_comp_channel2;
-	uint32_t			split_dest_qpn;
-	struct Split_FC_message split_fc_msg[4];
+	struct Split_FC_message *split_fc_msg;	/* 4 messages in a slab of split_pool */
 	struct ibv_mr		*split_fc_mr;
-	struct ibv_qp_attr	*user_qp_attr_init;
+	struct split_fc_slab	*split_fc_slab;
+	struct mlx5_split_pool	*split_pool;
+	struct ibv_qp_attr	user_qp_attr_init;	// the split qps are brought up like the user's qp
 	int 				user_qp_mask_init;
-	struct ibv_qp_attr	*user_qp_attr_rtr;
+	struct ibv_qp_attr	user_qp_attr_rtr;
 	int 				user_qp_mask_rtr;
-	struct rr_buffer	rr_buf;
-	int 				split_qp_exchange_done;
+	int 				split_qp_exchange_done;	// 0: EXCHANGE pending, 2: split qps connected, waiting for the peer's grant, 1: splitting, -1: no splitting
+	int					split_exchange_tx;		// our EXCHANGE: 0 not due yet, 1 owed ahead of the next post, 2 sent
+	uint8_t				split_exchange_cqes;	// SPLIT_EXCHANGE_*_CQE: completions of the EXCHANGE kept from the application
+	uint32_t			split_rq_psn;			// the application's rq_psn, named by the peer's EXCHANGE
+	uint64_t			split_exchange_deadline;	// ms; for the peer's grant
+	struct mlx5_qp		*split_exchange_next;	// on the list of the exchange thread
+	struct split_peer	split_peer;
+	struct mlx5_split_link	*split_link;			// split over once the EXCHANGE is through
+	struct mlx5_split_link	*split_fresh;			// ours, offered in the EXCHANGE to be connected
+	struct mlx5_split_link	*split_offer[SPLIT_EXCHANGE_LINKS];	// up already, offered in the EXCHANGE
 	//uint32_t			prev_chunk_size;		// used in 2-sided chunk size varying
-	int					isSmall;
+	int					isSmall;				// 0: bw, 1: lat, 2: tput; hinted in qp_context or classified online
+	struct mlx5_lock	pace_lock;				// guards pace and isSmall; tokens are waited for under it, never under an SQ lock
+	struct justitia_flow	pace;
 	////
 };
 
@@ -1296,6 +1394,9 @@ struct ibv_exp_rwq_ind_table *mlx5_exp_create_rwq_ind_table(struct ibv_context *
 int mlx5_exp_destroy_rwq_ind_table(struct ibv_exp_rwq_ind_table *rwq_ind_table);
 int mlx5_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 			  struct ibv_recv_wr **bad_wr) __MLX5_ALGN_F__;
+int mlx5_post_split_exchange(struct mlx5_qp *qp);
+int mlx5_post_split_credit(struct ibv_qp *split_qp2, uint32_t credits);
+int mlx5_split_reap_grant(struct mlx5_split_pool *pool);
 void mlx5_calc_sq_wqe_size(struct ibv_qp_cap *cap, enum ibv_qp_type type,
 			   struct mlx5_qp *qp);
 void mlx5_set_sq_sizes(struct mlx5_qp *qp, struct ibv_qp_cap *cap,
@@ -18,12 +18,18 @@
 #include <pthread.h>
 #include <signal.h>
 #include "mlx5.h"
+#include "watchdog.h"
+#include "ctl_chan.h"
 
 #define SHARED_MEM_NAME "/rdma-fairness"
+#define PORT_BLOCK_FMT "%s-%s-%d"      /* the shared block of a port's own pacer: SHARED_MEM_NAME-dev-port */
+#define PORT_SOCK_FMT "%s-%s-%d"       /* and its socket: that of get_sock_path, -dev-port */
+#define PORT_DEV_LEN 64
 #define SOCK_PATH "/gpfs/gpfs0/groups/chowdhury/yiwenzhg/rdma_socket"
-#define MSG_LEN 24
+#define MSG_LEN 32
 #define MAX_FLOWS 512
 #define HOSTNAME_PATH "/proc/sys/kernel/hostname"
+#define MIN_RATE_ENV "JUSTITIA_MIN_RATE"      /* MBps the tput qps of a process ask the pacer to reserve */
 
 struct flow_info {
     uint8_t pending;
@@ -31,6 +37,51 @@ struct flow_info {
     uint8_t read;
 };
 
+//// Completion latency histograms of latency-sensitive qps, read by the pacer's monitor.
+//// Same layout and buckets as rdma_pacer/lat_hist.h: 128ns wide below 1us, then 4 per power of two.
+#define LAT_HIST_BUCKETS        64
+#define LAT_HIST_LINEAR_SHIFT   7
+#define LAT_HIST_LINEAR_NS      1024
+#define LAT_HIST_LINEAR         (LAT_HIST_LINEAR_NS >> LAT_HIST_LINEAR_SHIFT)
+#define LAT_HIST_SUB_BITS       2
+
+struct lat_hist {
+    uint32_t total;                         /* completions recorded; bumped after the bucket */
+    uint32_t count[LAT_HIST_BUCKETS];       /* completions per bucket; both wrap */
+};
+
+//// The TSC's rate, calibrated once by the pacer and published for the drivers and tools, so that
+//// all of them convert cycles alike and none has to time the TSC itself.
+#define TSC_NS_SHIFT 16
+struct tsc_clock {
+    uint32_t khz;                           /* tsc cycles per ms; 0 until published, stored last */
+    uint32_t ns_mult;                       /* ns = cycles * ns_mult >> TSC_NS_SHIFT */
+    uint32_t invariant;                     /* ticks at khz whatever the core's clock does */
+    uint32_t pad;
+};
+
+//// the device port a shared block belongs to, published by its pacer
+struct pacer_port {
+    char dev[PORT_DEV_LEN];                 /* empty for a pacer that did not name one */
+    uint32_t num;
+    uint32_t line_rate;                     /* MBps paced to */
+};
+
+//// Per-slot telemetry, read live by pacerstat. The counters only grow, and a slot handed to
+//// another qp keeps counting where the last one left off. tokens has a single writer, the pacer's
+//// token thread; the rest are added to by the threads posting to the qp, under its pace lock or the
+//// SQ lock of the qp a WR goes to, so they are added to atomically.
+struct flow_stats {
+    uint64_t tokens;                        /* granted by the pacer */
+    uint64_t bytes;                         /* posted by the qp while paced */
+    uint64_t wait_cycles;                   /* the qp spent waiting on pending */
+    uint64_t chunks;                        /* split chunks the qp posted */
+    uint64_t last_beat;                     /* heartbeat at the qp's last paced post */
+    int32_t pid, tid;                       /* owner the pacer handed the slot to; pid 0 if free */
+    uint32_t qpn;
+    uint32_t cls;                           /* class the qp last posted as + 1 (bw, lat, tput); 0 before */
+};
+
 struct shared_block {
     struct flow_info flows[MAX_FLOWS];
     uint32_t active_chunk_size;
@@ -42,27 +93,99 @@ struct shared_block {
     uint16_t num_active_small_flows;       /* incremented when a mouse first sends a message */
     uint16_t num_active_bw_flows;         /* incremented when an elephant first sends a message */
     uint16_t split_level;
+    struct lat_hist lat_hist[MAX_FLOWS];   /* slot -> completion latencies of a latency-sensitive qp */
+    uint64_t msg_left[MAX_FLOWS];          /* slot -> bytes a bw flow has left of the message it is posting; 0 if unknown */
+    uint64_t heartbeat;                    /* bumped by the pacer every HEARTBEAT_US; the drivers fail open when it stops */
+    uint32_t epoch;                        /* new every time a pacer starts taking joins; 0 before the first */
+    uint32_t tail_ref_ns;                  /* reference flow's tail the monitor measured last */
+    uint32_t tail_app_ns;                  /* latency apps' own tail it took last; 0 without one */
+    struct flow_stats stats[MAX_FLOWS];    /* slot -> telemetry for pacerstat */
+    struct tsc_clock tsc;                  /* published before the epoch */
+    struct pacer_port port;                /* the device port paced, published before the epoch */
+};
+
+//// The pacer of a device port, as the process' qps on the port see it: every port runs a pacer of
+//// its own, with a shared block and a control channel of its own. Attached by the first qp
+//// created on the port and kept for the life of the process; a port without a pacer of its own
+//// goes to the one that named no port (port 0 here), if there is one.
+struct justitia_pacer {
+    struct justitia_pacer   *next;
+    char                    dev[PORT_DEV_LEN];
+    int                     port;           /* 0: the pacer that named no port, pacing any */
+    struct shared_block     *sb;
+    char                    sock_path[104];
+    int                     ctl_sock;       /* control channel (ctl_chan.h); -1 before the first message and once the pacer dropped it */
+    pthread_mutex_t         ctl_lock;
+    struct watchdog_dead    dead;           /* the pacer found dead, if any */
 };
 
-extern __thread struct flow_info *flow;     /* per-thread flow slot; initialization in verbs.c */
-extern struct shared_block *sb;            /* process-wide shared memory mapping; initialization in verbs.c */
-extern __thread int start_flag;            /* per-thread: whether this thread has reported its app type */
-extern __thread unsigned int slot;         /* per-thread slot id */
 extern int start_recv;             /* initialized in qp.c */
-extern __thread int isSmall;                /* per-thread class: 0=bw,1=lat,2=tput; initialized in qp.c */
-extern __thread int num_active_small_flows; /* per-thread counters for cleanup */
-extern __thread int num_active_big_flows;   /* per-thread counters for cleanup */
-extern __thread int justitia_exit_done;     /* per-thread: ensure exit handler runs once */
 //// UDS_IMPL
-#ifdef CPU_FRIENDLY
-extern __thread unsigned int flow_socket;
 extern double cpu_mhz;              /* declaration; initialization in verbs.c */
-#endif
 ////
+extern uint32_t lat_ns_mult;        /* ns = cycles * lat_ns_mult >> TSC_NS_SHIFT; initialization in pacer.c */
 
 char *get_sock_path();
-void contact_pacer(int join);
+int contact_pacer(struct mlx5_qp *qp, int join);
+int justitia_clock_init(const struct shared_block *sb);
+double justitia_capture_mhz(const struct shared_block *sb);
+struct justitia_pacer *justitia_pacer_attach(const char *dev, int port);
+void justitia_flow_attach(struct mlx5_qp *qp, struct justitia_pacer *p);
+void justitia_flow_register(struct mlx5_qp *qp);
+void justitia_flow_port(struct mlx5_qp *qp, int port);
+void justitia_flow_start(struct mlx5_qp *qp, int is_read);
+void justitia_flow_reclassify(struct mlx5_qp *qp, int cls);
+void justitia_flow_release(struct mlx5_qp *qp);
+void justitia_flow_reattach(struct mlx5_qp *qp);
+void justitia_pacer_bury(struct justitia_pacer *p, const struct watchdog *w);
 void set_inactive_on_exit();
 void termination_handler(int sig);
 
+//// whether the pacer in the shared block now is the one found dead (watchdog.h): nothing is
+//// waited for until it beats again or another one starts
+static inline int justitia_pacer_dead(struct justitia_pacer *p)
+{
+    return watchdog_dead(&p->dead, __atomic_load_n(&p->sb->epoch, __ATOMIC_RELAXED),
+                         __atomic_load_n(&p->sb->heartbeat, __ATOMIC_RELAXED));
+}
+
+static inline unsigned lat_hist_bucket(uint64_t ns)
+{
+    unsigned e, b;
+
+    if (ns < LAT_HIST_LINEAR_NS)
+        return ns >> LAT_HIST_LINEAR_SHIFT;
+    e = 63 - __builtin_clzll(ns);
+    b = LAT_HIST_LINEAR + ((e - 10) << LAT_HIST_SUB_BITS) +
+        ((ns >> (e - LAT_HIST_SUB_BITS)) & ((1 << LAT_HIST_SUB_BITS) - 1));
+    return b < LAT_HIST_BUCKETS ? b : LAT_HIST_BUCKETS - 1;
+}
+
+//// one send completion, cycles after its WQE was posted; a slot has a single writer (its qp's
+//// send cq is polled under the cq lock), so plain relaxed stores are enough
+static inline void lat_hist_record(struct lat_hist *h, uint64_t cycles)
+{
+    uint32_t *c = &h->count[lat_hist_bucket((cycles * lat_ns_mult) >> TSC_NS_SHIFT)];
+
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, __atomic_load_n(&h->total, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+//// telemetry for pacerstat (struct flow_stats) from a thread posting to the qp
+static inline void justitia_stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+//// a paced post of bytes by the qp of jf, posting as class cls
+static inline void justitia_stat_post(struct justitia_flow *jf, int cls, uint64_t bytes)
+{
+    struct flow_stats *st = &jf->sb->stats[jf->slot];
+
+    justitia_stat_add(&st->bytes, bytes);
+    __atomic_store_n(&st->last_beat, __atomic_load_n(&jf->sb->heartbeat, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    if (__atomic_load_n(&st->cls, __ATOMIC_RELAXED) != (uint32_t)cls + 1)
+        __atomic_store_n(&st->cls, cls + 1, __ATOMIC_RELAXED);
+}
+
 #endif
@@ -46,6 +46,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <time.h>
 
 #include "mlx5.h"
 #include "mlx5-abi.h"
@@ -55,27 +56,13 @@
 //#include "verbs_pacer.h"
 #include "pacer.h"
 #include "get_clock.h"
-__thread struct flow_info *flow = NULL;
-struct shared_block *sb = NULL;
-__thread int registered = 0;
-__thread int start_flag = 0;
-__thread unsigned int slot = 0;
 //int start_recv = 0;
-__thread int num_active_small_flows = 0;
-__thread int num_active_big_flows = 0;
-__thread int justitia_exit_done = 0;
-#ifdef CPU_FRIENDLY
-double cpu_mhz = 0;
-__thread unsigned int flow_socket = 0;
-#endif
+double cpu_mhz = 0;                 /* the pacer's, from justitia_clock_init at create_qp (CPU_FRIENDLY) or by the first latency-sensitive qp */
 /* end */
 
 static pthread_mutex_t justitia_shm_lock = PTHREAD_MUTEX_INITIALIZER;
 static int justitia_process_handlers_installed = 0;
 
-static pthread_key_t justitia_thread_key;
-static pthread_once_t justitia_thread_key_once = PTHREAD_ONCE_INIT;
-
 static int justitia_is_pacer_process(void)
 {
 	int fd = open("/proc/self/comm", O_RDONLY);
@@ -96,23 +83,6 @@ static int justitia_is_pacer_process(void)
 	return strcmp(name, "pacer") == 0;
 }
 
-static void justitia_thread_destructor(void *value)
-{
-	(void)value;
-	set_inactive_on_exit();
-}
-
-static void justitia_make_thread_key(void)
-{
-	(void)pthread_key_create(&justitia_thread_key, justitia_thread_destructor);
-}
-
-static void justitia_register_thread_cleanup(void)
-{
-	pthread_once(&justitia_thread_key_once, justitia_make_thread_key);
-	(void)pthread_setspecific(justitia_thread_key, (void *)1);
-}
-
 int mlx5_single_threaded = 0;
 int mlx5_use_mutex;
 
@@ -310,9 +280,6 @@ struct ibv_pd *mlx5_alloc_pd(struct ibv_context *context)
 	struct mlx5_alloc_pd_resp resp;
 	struct mlx5_pd		 *pd;
 
-#ifdef CPU_FRIENDLY
-    cpu_mhz = get_cpu_mhz(1);
-#endif
 	read_init_vars(to_mctx(context));
 	pd = calloc(1, sizeof *pd);
 	if (!pd)
@@ -2418,97 +2385,437 @@ struct ibv_qp *__mlx5_create_qp(struct ibv_pd *pd,
 	return qp;
 }
 
-struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
-			      struct ibv_qp_init_attr *attr)
+//// Split resources are shared per PD (struct mlx5_split_pool). The pool comes up with
+//// the PD's first user QP and goes away with its last one; split_pool_mutex guards
+//// pd->split_pool, refcnt, the links and the control-message slabs.
+static pthread_mutex_t split_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//// Reserve n more entries of a shared cq, growing it first if they may not fit
+static int split_cq_reserve(struct ibv_cq *cq, int *reserved, int n)
+{
+	int want = *reserved + n;
+
+	if (want > cq->cqe && mlx5_resize_cq(cq, want > 2 * cq->cqe ? want : 2 * cq->cqe) &&
+	    mlx5_resize_cq(cq, want))
+		return -1;
+	*reserved = want;
+	return 0;
+}
+
+//// Destroy a link no user QP holds, with the pool mutex held. The reap locks keep its wr_id
+//// from being taken off a shared cq while it goes.
+static void split_link_destroy(struct mlx5_split_pool *pool, struct mlx5_split_link *link)
 {
-	//// create custom cq used for two-sided rdma message splitting
-	struct ibv_comp_channel *send_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *recv_channel = ibv_create_comp_channel(pd->context);
-	struct ibv_comp_channel *channel2 = ibv_create_comp_channel(pd->context);
-	struct ibv_cq *split_send_cq = mlx5_create_cq(pd->context, SPLIT_MAX_CQE, send_channel, 0);
-	struct ibv_cq *split_recv_cq = mlx5_create_cq(pd->context, SPLIT_MAX_CQE, recv_channel, 0);
-	struct ibv_cq *split_cq2 = mlx5_create_cq(pd->context, SPLIT_MAX_CQE, channel2, 0);
+	struct mlx5_split_link **p;
+	int i;
+
+	for (p = &pool->links; *p; p = &(*p)->next) {
+		if (*p == link) {
+			*p = link->next;
+			break;
+		}
+	}
+	mlx5_lock(&pool->send_lock);
+	mlx5_lock(&pool->cq2_lock);
+	for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++)
+		if (link->split_qp[i])
+			mlx5_destroy_qp(link->split_qp[i]);
+	if (link->split_qp2)
+		mlx5_destroy_qp(link->split_qp2);
+	mlx5_unlock(&pool->cq2_lock);
+	mlx5_unlock(&pool->send_lock);
+	pool->send_cqe -= link->send_cqe;
+	pool->cq2_cqe -= link->cq2_cqe;
+	free(link->arena.wr);
+	free(link->arena.sge);
+	free(link);
+}
 
-	/// create a custom qp for our own use 
+//// A new link of the pool whose split qps take chunks of up to max_sge SGEs, with the pool
+//// mutex held. Its split qps are left in RESET until the EXCHANGE connects them.
+static struct mlx5_split_link *split_link_create(struct ibv_pd *pd, struct mlx5_split_pool *pool,
+						 int max_sge)
+{
 	struct ibv_qp_init_attr split_init_attr, split_init_attr2;
+	struct mlx5_split_link *link;
+	int i;
+
+	link = calloc(1, sizeof(*link));
+	if (!link)
+		return NULL;
+	if (mlx5_lock_init(&link->lock, 1, mlx5_get_locktype())) {
+		free(link);
+		return NULL;
+	}
+	link->next = pool->links;
+	pool->links = link;
+
 	memset(&split_init_attr, 0, sizeof(struct ibv_qp_init_attr));
-	split_init_attr.send_cq = split_send_cq;
-	split_init_attr.recv_cq = split_recv_cq;
+	//// the peer sends us no two-sided chunks (recv_slots is 0), so split_qp[0] takes no receives
+	split_init_attr.send_cq = pool->send_cq;
+	split_init_attr.recv_cq = pool->send_cq;
 	split_init_attr.cap.max_send_wr  = SPLIT_MAX_SEND_WR;
-	split_init_attr.cap.max_recv_wr  = SPLIT_MAX_RECV_WR;
-	split_init_attr.cap.max_send_sge = 1;
+	split_init_attr.cap.max_recv_wr  = 0;
+	//// a split chunk may span as many SGEs as the user's WR carries
+	split_init_attr.cap.max_send_sge = max_sge ? max_sge : 1;
 	split_init_attr.cap.max_recv_sge = 1;
 	split_init_attr.cap.max_inline_data = 100;	// probably not going to use inline there
 	split_init_attr.qp_type = IBV_QPT_RC;
 	split_init_attr.qp_context = (void *)1;
 	memcpy(&split_init_attr2, &split_init_attr, sizeof(struct ibv_qp_init_attr));
-	split_init_attr2.send_cq = split_cq2;
-	split_init_attr2.recv_cq = split_cq2;
-
-	struct ibv_qp 		*qp;
-	struct ibv_qp 		*split_qp[MAX_SPLIT_QP_NUM_ONE_SIDED];
-	struct ibv_qp 		*split_qp2;			// temporarily used in 2-sided
-	split_qp2 = __mlx5_create_qp(pd, &split_init_attr2);
-	if (split_qp2 == NULL) {
-		printf("Create split qp2 failed. %s\n", strerror(errno));
+	//// split_qp2 sends the grant and takes the peer's grant and credit returns
+	split_init_attr2.send_cq = pool->cq2;
+	split_init_attr2.recv_cq = pool->cq2;
+	split_init_attr2.cap.max_send_wr = SPLIT_QP2_WR;
+	split_init_attr2.cap.max_recv_wr = SPLIT_QP2_WR;
+	split_init_attr2.cap.max_send_sge = 1;
+
+	link->split_qp2 = __mlx5_create_qp(pd, &split_init_attr2);
+	if (!link->split_qp2)
+		goto err;
+	if (split_cq_reserve(pool->cq2, &pool->cq2_cqe, split_init_attr2.cap.max_send_wr +
+						      split_init_attr2.cap.max_recv_wr))
+		goto err;
+	link->cq2_cqe = split_init_attr2.cap.max_send_wr + split_init_attr2.cap.max_recv_wr;
+	for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
+		link->split_qp[i] = __mlx5_create_qp(pd, &split_init_attr);
+		if (!link->split_qp[i])
+			goto err;
+		if (split_cq_reserve(pool->send_cq, &pool->send_cqe, split_init_attr.cap.max_send_wr))
+			goto err;
+		link->send_cqe += split_init_attr.cap.max_send_wr;
 	}
 	#ifdef JUSTITIA_DEBUG
-	printf("DEBUG mlx5_create_qp: split_qp->qpn = %06x\n", split_qp2->qp_num);
+	printf("DEBUG split_link_create: split_qp[0]->qpn = %06x, split_qp2->qpn = %06x\n",
+	       link->split_qp[0]->qp_num, link->split_qp2->qp_num);
 	#endif
+	return link;
+
+err:
+	fprintf(stderr, "Error creating split qps: %s\n", strerror(errno));
+	split_link_destroy(pool, link);
+	return NULL;
+}
+
+static void split_pool_destroy(struct mlx5_split_pool *pool)
+{
+	struct split_fc_slab *slab;
+
+	while (pool->links)
+		split_link_destroy(pool, pool->links);
+	while ((slab = pool->slabs)) {
+		pool->slabs = slab->next;
+		if (slab->mr)
+			mlx5_dereg_mr(slab->mr);
+		free(slab);
+	}
+	if (pool->send_cq)
+		mlx5_destroy_cq(pool->send_cq);
+	if (pool->cq2)
+		mlx5_destroy_cq(pool->cq2);
+	if (pool->send_channel)
+		ibv_destroy_comp_channel(pool->send_channel);
+	if (pool->channel2)
+		ibv_destroy_comp_channel(pool->channel2);
+	pthread_cond_destroy(&pool->wait_cond);
+	pthread_mutex_destroy(&pool->wait_mutex);
+	free(pool);
+}
+
+//// take a reference on the PD's pool, creating it on first use; its cqs grow with its links
+static struct mlx5_split_pool *split_pool_get(struct ibv_pd *pd)
+{
+	struct mlx5_pd *mpd = to_mpd(pd);
+	struct mlx5_split_pool *pool;
+
+	pthread_mutex_lock(&split_pool_mutex);
+	pool = mpd->split_pool;
+	if (pool) {
+		pool->refcnt++;
+		pthread_mutex_unlock(&split_pool_mutex);
+		return pool;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		goto err;
+	pthread_mutex_init(&pool->wait_mutex, NULL);
+	pthread_cond_init(&pool->wait_cond, NULL);
+	if (mlx5_lock_init(&pool->send_lock, 1, mlx5_get_locktype()) ||
+	    mlx5_lock_init(&pool->cq2_lock, 1, mlx5_get_locktype()))
+		goto err;
+	//// create custom cq used for rdma message splitting
+	pool->send_channel = ibv_create_comp_channel(pd->context);
+	pool->channel2 = ibv_create_comp_channel(pd->context);
+	if (!pool->send_channel || !pool->channel2)
+		goto err;
+	pool->send_cq = mlx5_create_cq(pd->context, 1, pool->send_channel, 0);
+	pool->cq2 = mlx5_create_cq(pd->context, 1, pool->channel2, 0);
+	if (!pool->send_cq || !pool->cq2)
+		goto err;
+
+	pool->refcnt = 1;
+	mpd->split_pool = pool;
+	pthread_mutex_unlock(&split_pool_mutex);
+	return pool;
+
+err:
+	fprintf(stderr, "Error creating split resources: %s\n", strerror(errno));
+	if (pool)
+		split_pool_destroy(pool);
+	pthread_mutex_unlock(&split_pool_mutex);
+	return NULL;
+}
 
+static void split_pool_put(struct ibv_pd *pd, struct mlx5_split_pool *pool)
+{
+	pthread_mutex_lock(&split_pool_mutex);
+	if (--pool->refcnt == 0) {
+		to_mpd(pd)->split_pool = NULL;
+		split_pool_destroy(pool);
+	}
+	pthread_mutex_unlock(&split_pool_mutex);
+}
+
+//// hand a user QP its 4 control messages from a registered slab
+static int split_fc_slot_get(struct ibv_pd *pd, struct mlx5_split_pool *pool, struct mlx5_qp *mqp)
+{
+	struct split_fc_slab *slab;
 	int i;
-	//for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-	for (i = MAX_SPLIT_QP_NUM_ONE_SIDED - 1; i >= 0 ; i--) {
-		split_qp[i] = __mlx5_create_qp(pd, &split_init_attr);
-		if (split_qp[i]) {
-			#ifdef JUSTITIA_DEBUG
-			printf("DEBUG mlx4_create_qp: split_qp[%d]->qpn = %06x\n", i, split_qp[i]->qp_num);
-			#endif
-		} else {
-			fprintf(stderr, "Error creating Split QP #%d\n", i + 1);
-			return NULL;
+
+	pthread_mutex_lock(&split_pool_mutex);
+	for (slab = pool->slabs; slab; slab = slab->next)
+		if (slab->free_mask)
+			break;
+	if (!slab) {
+		slab = calloc(1, sizeof(*slab));
+		if (!slab)
+			goto err;
+		slab->mr = mlx5_reg_mr(pd, slab->msg, sizeof(slab->msg), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+		if (!slab->mr) {
+			free(slab);
+			goto err;
 		}
+		slab->free_mask = SPLIT_FC_SLAB_QPS == 64 ? ~0ULL : (1ULL << SPLIT_FC_SLAB_QPS) - 1;
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+	}
+	i = __builtin_ctzll(slab->free_mask);
+	slab->free_mask &= ~(1ULL << i);
+	memset(slab->msg[i], 0, sizeof(slab->msg[i]));
+	mqp->split_fc_slab = slab;
+	mqp->split_fc_msg = slab->msg[i];
+	mqp->split_fc_mr = slab->mr;
+	pthread_mutex_unlock(&split_pool_mutex);
+	return 0;
+
+err:
+	pthread_mutex_unlock(&split_pool_mutex);
+	return ENOMEM;
+}
+
+static void split_fc_slot_put(struct mlx5_qp *mqp)
+{
+	struct split_fc_slab *slab = mqp->split_fc_slab;
+
+	if (!slab)
+		return;
+	pthread_mutex_lock(&split_pool_mutex);
+	slab->free_mask |= 1ULL << (mqp->split_fc_msg - &slab->msg[0][0]) / 4;
+	pthread_mutex_unlock(&split_pool_mutex);
+	mqp->split_fc_slab = NULL;
+	mqp->split_fc_msg = NULL;
+	mqp->split_fc_mr = NULL;
+}
+
+//// Make sure the chunk arena of a link can describe chunks of up to max_sge SGEs.
+//// Allocated by the first split rather than with the link; called with its lock held.
+int mlx5_split_reserve_arena(struct split_arena *arena, unsigned int max_sge)
+{
+	struct ibv_sge *sge;
+
+	if (max_sge == 0)
+		max_sge = 1;
+	if (arena->wr && arena->max_sge >= max_sge)
+		return 0;
+
+	if (!arena->wr) {
+		arena->wr = calloc(SPLIT_MAX_SEND_WR, sizeof(*arena->wr));
+		if (!arena->wr)
+			return ENOMEM;
+	}
+	sge = calloc((size_t)SPLIT_MAX_SEND_WR * max_sge, sizeof(*sge));
+	if (!sge)
+		return ENOMEM;
+	free(arena->sge);
+	arena->sge = sge;
+	arena->capacity = SPLIT_MAX_SEND_WR;
+	arena->max_sge = max_sge;
+	return 0;
+}
+
+//// Whether user QP mqp may split over link: brought up like it on the same path, with as many SGEs
+static int split_link_matches(struct mlx5_split_link *link, struct mlx5_qp *mqp)
+{
+	struct ibv_qp_attr *li = &link->attr_init, *lr = &link->attr_rtr;
+	struct ibv_qp_attr *ui = &mqp->user_qp_attr_init, *ur = &mqp->user_qp_attr_rtr;
+
+	if (to_mqp(link->split_qp[0])->sq.max_gs < mqp->sq.max_gs ||
+	    li->port_num != ui->port_num || li->pkey_index != ui->pkey_index ||
+	    li->qp_access_flags != ui->qp_access_flags ||
+	    lr->path_mtu != ur->path_mtu || lr->max_dest_rd_atomic != ur->max_dest_rd_atomic ||
+	    lr->min_rnr_timer != ur->min_rnr_timer)
+		return 0;
+	if (lr->ah_attr.dlid != ur->ah_attr.dlid || lr->ah_attr.sl != ur->ah_attr.sl ||
+	    lr->ah_attr.src_path_bits != ur->ah_attr.src_path_bits ||
+	    lr->ah_attr.port_num != ur->ah_attr.port_num || lr->ah_attr.is_global != ur->ah_attr.is_global)
+		return 0;
+	return !lr->ah_attr.is_global ||
+	       (!memcmp(&lr->ah_attr.grh.dgid, &ur->ah_attr.grh.dgid, sizeof(lr->ah_attr.grh.dgid)) &&
+		lr->ah_attr.grh.sgid_index == ur->ah_attr.grh.sgid_index &&
+		lr->ah_attr.grh.traffic_class == ur->ah_attr.grh.traffic_class);
+}
+
+//// Let go of a link held by a user QP, with the pool mutex held. One no user QP holds any more
+//// goes if SPLIT_IDLE_LINKS of its kind are idle already, or if it failed.
+static void split_link_put(struct mlx5_split_pool *pool, struct mlx5_split_link *link)
+{
+	struct mlx5_split_link *l;
+	int state = SPLIT_LINK_GRANT;
+	int idle = 0;
+
+	if (!link || --link->users)
+		return;
+	//// a grant that is still due finds it idle and leaves it that way
+	__atomic_compare_exchange_n(&link->state, &state, SPLIT_LINK_IDLE, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	state = __atomic_load_n(&link->state, __ATOMIC_RELAXED);
+	for (l = pool->links; l; l = l->next)
+		if (l != link && !l->users && __atomic_load_n(&l->state, __ATOMIC_RELAXED) == state)
+			idle++;
+	if (idle >= SPLIT_IDLE_LINKS || __atomic_load_n(&link->sends_failed, __ATOMIC_RELAXED))
+		split_link_destroy(pool, link);
+}
+
+//// Let go of every link mqp holds, with the pool mutex held
+static void split_links_put(struct mlx5_qp *mqp)
+{
+	int i;
+
+	split_link_put(mqp->split_pool, mqp->split_link);
+	split_link_put(mqp->split_pool, mqp->split_fresh);
+	for (i = 0; i < SPLIT_EXCHANGE_LINKS; i++)
+		split_link_put(mqp->split_pool, mqp->split_offer[i]);
+	mqp->split_link = NULL;
+	mqp->split_fresh = NULL;
+	memset(mqp->split_offer, 0, sizeof(mqp->split_offer));
+}
+
+//// Hold the links of mqp's EXCHANGE and name them in ours, with the pool mutex held: the links up
+//// to its peer, which it may split over instead, and a fresh one that is connected otherwise.
+//// A link whose chunks the peer reassembles is only offered while no other user QP holds it.
+//// Returns 0, or -1 without a fresh link.
+static int split_links_offer(struct ibv_pd *pd, struct mlx5_qp *mqp, struct split_exchange *ours)
+{
+	struct mlx5_split_pool *pool = mqp->split_pool;
+	struct mlx5_split_link *link, *fresh = NULL;
+	uint32_t n = 0;
+
+	for (link = pool->links; link; link = link->next) {
+		switch (__atomic_load_n(&link->state, __ATOMIC_ACQUIRE)) {
+		case SPLIT_LINK_IDLE:
+			if (!fresh && !link->users && to_mqp(link->split_qp[0])->sq.max_gs >= mqp->sq.max_gs)
+				fresh = link;
+			break;
+		case SPLIT_LINK_UP:
+			if (n == SPLIT_EXCHANGE_LINKS || __atomic_load_n(&link->sends_failed, __ATOMIC_RELAXED) ||
+			    (link->peer_recv_slots && link->users) || !split_link_matches(link, mqp))
+				break;
+			link->users++;
+			mqp->split_offer[n] = link;
+			ours->link[n].qp_num = link->split_qp[0]->qp_num;
+			ours->link[n].qp2_num = link->split_qp2->qp_num;
+			ours->link[n].peer_qp_num = link->peer_qp_num;
+			ours->link[n].peer_qp2_num = link->peer_qp2_num;
+			n++;
+			break;
+		}
+	}
+	if (!fresh)
+		fresh = split_link_create(pd, pool, mqp->sq.max_gs);
+	if (!fresh) {
+		split_links_put(mqp);
+		return -1;
 	}
+	fresh->users++;
+	mqp->split_fresh = fresh;
+	ours->qp_num = fresh->split_qp[0]->qp_num;
+	ours->qp2_num = fresh->split_qp2->qp_num;
+	ours->links = n;
+	return 0;
+}
+
+struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
+			      struct ibv_qp_init_attr *attr)
+{
+	//// split cqs and channels are shared by all user qps of the pd, and so are the split qps,
+	//// which are made when the qp is connected (split_links_offer). Only RC qps of a process
+	//// that opted in to the EXCHANGE split.
+	struct mlx5_split_pool *pool = NULL;
+	int split = attr->qp_type == IBV_QPT_RC && to_mctx(pd->context)->split_exchange;
+	if (split && !(pool = split_pool_get(pd)))
+		return NULL;
 
-	//// Now create the user's qp
+	//// the EXCHANGE and the RR it lands in take a WQE of their own on top of those asked for
+	struct ibv_qp 		*qp;
+	int exchange_rr = split && !attr->srq;
+	attr->cap.max_send_wr += split;
+	attr->cap.max_recv_wr += exchange_rr;
 	qp = __mlx5_create_qp(pd, attr);
+	attr->cap.max_send_wr -= split;
+	attr->cap.max_recv_wr -= exchange_rr;
 	if (qp == NULL) {
 		printf("Create user qp failed. %s\n", strerror(errno));
+		if (pool)
+			split_pool_put(pd, pool);
+		return NULL;
 	}
 	#ifdef JUSTITIA_DEBUG
 	printf("DEBUG mlx5_create_qp: orig_qp->qpn = %06x\n", qp->qp_num);
 	#endif
-	//// store split_qp & split_cq inside the user's qp
 	if (qp) {
 		struct mlx5_qp *mqp = to_mqp(qp);
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			mqp->split_qp[i] = split_qp[i];
-		}
 
-		mqp->split_qp2 = split_qp2;
-		mqp->split_cq2 = split_cq2;
-		mqp->split_send_cq = split_send_cq;
-		mqp->split_recv_cq = split_recv_cq;
-		mqp->split_comp_send_channel = send_channel;
-		mqp->split_comp_recv_channel = recv_channel;
-		mqp->split_comp_channel2 = channel2;
-		//// register mr for two-sided splitting header message
-		//// register size * 2 since in split qpn exchange we need mr for send & recv at the same time
-		mqp->split_fc_mr = mlx5_reg_mr(pd, &mqp->split_fc_msg, 4 * sizeof(struct Split_FC_message), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
-		//// add in pd for later deletion
-		to_mpd(pd)->split_fc_mr = mqp->split_fc_mr;
-		if (MANUAL_SPLIT_QPN_DIFF) {
-			mqp->split_qp_exchange_done = -1;
-		} else {
-			mqp->split_qp_exchange_done = 0;
+		mqp->split_pool = pool;
+		if (mlx5_lock_init(&mqp->pace_lock, 1, mlx5_get_locktype())) {
+			fprintf(stderr, "Error initializing the pace lock\n");
+			mlx5_destroy_qp(qp);
+			return NULL;
+		}
+		//// two-sided splitting header messages live in a registered slab of the pool
+		//// 4 messages since in split qpn exchange we need mr for send & recv at the same time
+		if (pool && split_fc_slot_get(pd, pool, mqp)) {
+			fprintf(stderr, "Error allocating split control messages\n");
+			mlx5_destroy_qp(qp);
+			return NULL;
+		}
+		//// split qps are connected by the EXCHANGE once the user's RC qp is up
+		mqp->split_qp_exchange_done = -1;
+		//// class hint in qp_context: lat, tput and FLOW_CLASS_HINT_BW pin the class; anything
+		//// else (NULL, or a real context pointer) starts as bw and is classified from the posts
+		switch ((long)attr->qp_context) {
+		case FLOW_CLASS_LAT:
+		case FLOW_CLASS_TPUT:
+			mqp->isSmall = (long)attr->qp_context;
+			break;
+		case FLOW_CLASS_HINT_BW:
+			mqp->isSmall = FLOW_CLASS_BW;
+			break;
+		default:
+			mqp->isSmall = FLOW_CLASS_BW;
+			mqp->pace.auto_class = 1;
+			flow_class_init(&mqp->pace.fc, FLOW_CLASS_BW);
+			break;
 		}
-		//// set whether user has set the qp to send mice flows
-		mqp->isSmall = (long)attr->qp_context;
-		if (mqp->isSmall < 0 || mqp->isSmall > 2)
-			mqp->isSmall = 0;
-		/* Scheme A: per-thread class is decided once; later QPs in same thread inherit */
-		if (isSmall < 0)
-			isSmall = mqp->isSmall;
 		#ifdef JUSTITIA_DEBUG
 		printf("mqp->isSmall is %d\n", mqp->isSmall);
 		#endif
@@ -2519,8 +2826,9 @@ struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
 	////
 
 	/* isolation */
-	int fd_shm;
-	if ((fd_shm = shm_open(SHARED_MEM_NAME, O_RDWR, 0600)) == -1){
+	//// the pacer of port 1 of the device; a qp brought to INIT on another port moves to its pacer
+	struct justitia_pacer *pacer;
+	if (!(pacer = justitia_pacer_attach(ibv_get_device_name(pd->context->device), 1))) {
 		printf("@@@Pacer's shared memory is not found. Pacer won't be used.\n");
 	} else {
 		if (justitia_is_pacer_process()) {
@@ -2528,10 +2836,9 @@ struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
 			return qp;
 		}
 		pthread_mutex_lock(&justitia_shm_lock);
-		if (!sb) {
-			sb = mmap(NULL, sizeof(struct shared_block), PROT_WRITE | PROT_READ,
-				MAP_SHARED, fd_shm, 0);
-		}
+#ifdef CPU_FRIENDLY
+		justitia_clock_init(pacer->sb);		/* split chunks are spaced in cycles */
+#endif
 		if (!justitia_process_handlers_installed) {
 			justitia_process_handlers_installed = 1;
 			/* set up signal handler */
@@ -2556,15 +2863,8 @@ struct ibv_qp *mlx5_create_qp(struct ibv_pd *pd,
 		}
 		pthread_mutex_unlock(&justitia_shm_lock);
 
-		/* Per-thread registration: each thread gets its own flow slot */
-		if (!registered) {
-			registered = 1;
-			justitia_register_thread_cleanup();
-			contact_pacer(1);
-			flow = sb ? &sb->flows[slot] : NULL;
-			start_flag = 1;
-			printf("@@@Thread registered at slot %d.\n", slot);
-		}
+		/* Per-qp registration: each qp takes a flow slot of its own on its first post */
+		justitia_flow_attach(to_mqp(qp), pacer);
 	}
 	/* end */	
 
@@ -3025,12 +3325,17 @@ static void mlx5_unlock_cqs(struct ibv_qp *qp)
 	}
 }
 
+static void split_exchange_unwatch(struct mlx5_qp *mqp);
+
 int mlx5_destroy_qp(struct ibv_qp *ibqp)
 {
 	struct mlx5_qp *qp = to_mqp(ibqp);
 	struct mlx5_context *ctx = to_mctx(ibqp->context);
 	int ret;
 
+	if (qp->split_pool)
+		split_exchange_unwatch(qp);
+
 	if (qp->rx_qp) {
 		ret = ibv_cmd_destroy_qp(ibqp);
 		if (ret)
@@ -3073,6 +3378,14 @@ int mlx5_destroy_qp(struct ibv_qp *ibqp)
 	mlx5_free_qp_buf(qp);
 
 free:
+	justitia_flow_release(qp);
+	if (qp->split_pool) {
+		pthread_mutex_lock(&split_pool_mutex);
+		split_links_put(qp);
+		pthread_mutex_unlock(&split_pool_mutex);
+		split_fc_slot_put(qp);
+		split_pool_put(ibqp->pd, qp->split_pool);
+	}
 	free(qp);
 
 	return 0;
@@ -3093,6 +3406,12 @@ int mlx5_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
 		return ret;
 
 	init_attr->cap.max_send_wr     = qp->sq.max_post;
+	//// less the WQEs of the EXCHANGE, as at create
+	if (qp->split_pool) {
+		init_attr->cap.max_send_wr--;
+		if (!ibqp->srq)
+			init_attr->cap.max_recv_wr--;
+	}
 	init_attr->cap.max_send_sge    = qp->sq.max_gs;
 	init_attr->cap.max_inline_data = qp->data_seg.max_inline_data;
 
@@ -3182,271 +3501,399 @@ int __mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 	return ret;
 }
 
-//// Modify to change the qp state of the custom qp
-//// Only include Manual method (guess) for exchange split qpn
-int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
-		   int attr_mask)
+//// Split qps are brought up with the EXCHANGE below, which names one one-sided split qp
+#if MAX_SPLIT_QP_NUM_ONE_SIDED != 1
+#error "the split qp EXCHANGE carries a single one-sided split qp"
+#endif
+
+#define SPLIT_RTS_MASK	(IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | \
+			 IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC)
+
+static inline uint64_t split_now_ms(void)
 {
-	int i;
-	start_flag = 0;
+	struct timespec ts;
 
-	struct mlx5_qp *mqp = to_mqp(qp);
-	struct mlx5_context *ctx = to_mctx(qp->context);
-	struct ibv_modify_qp cmd;
-	volatile uint32_t *db;
-	int ret;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	if (mqp->flags & MLX5_QP_FLAGS_USE_UNDERLAY) {
-		if (attr_mask & ~(IBV_QP_STATE | IBV_QP_CUR_STATE))
-			return EINVAL;
+static int split_reset_qp(struct ibv_qp *qp)
+{
+	struct ibv_qp_attr attr;
 
-		/* Underlay QP is UD over infiniband */
-		if (ctx->exp_device_cap_flags & IBV_EXP_DEVICE_RX_CSUM_IP_PKT)
-			mqp->gen_data.model_flags |= MLX5_QP_MODEL_RX_CSUM_IP_OK_IP_NON_TCP_UDP;
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RESET;
+	return __mlx5_modify_qp(qp, &attr, IBV_QP_STATE);
+}
+
+static int split_qp_to_rts(struct ibv_qp *qp, uint32_t sq_psn)
+{
+	struct ibv_qp_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state		= IBV_QPS_RTS;
+	attr.sq_psn		= sq_psn;
+	attr.timeout		= 14;
+	attr.retry_cnt		= 7;
+	attr.rnr_retry		= 7;
+	attr.max_rd_atomic	= 1;
+	return __mlx5_modify_qp(qp, &attr, SPLIT_RTS_MASK);
+}
+
+static int split_post_fc_recv(struct mlx5_qp *mqp, struct ibv_qp *qp, struct Split_FC_message *msg)
+{
+	struct ibv_sge sge;
+	struct ibv_recv_wr wr;
+	struct ibv_recv_wr *bad_wr;
+
+	memset(&sge, 0, sizeof(sge));
+	sge.addr = (uintptr_t)msg;
+	sge.length = sizeof(struct Split_FC_message);
+	sge.lkey = mqp->split_fc_mr->lkey;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	return mlx5_post_recv(qp, &wr, &bad_wr);
+}
+
+//// split_qp2 gets one empty RR per credit the peer may hand back, each naming the link in its
+//// wr_id since split_cq2 is shared by the PD
+static int split_post_credit_recvs(struct mlx5_split_link *link, uint32_t peer_slots)
+{
+	struct ibv_recv_wr wr;
+	struct ibv_recv_wr *bad_wr;
+	uint32_t n;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = (uintptr_t)link;
+	for (n = 0; n < peer_slots; n++)
+		if (mlx5_post_recv(link->split_qp2, &wr, &bad_wr))
+			return -1;
+	return 0;
+}
+
+//// Connect the split qps of link, a fresh one of mqp, to the peer's on the path of the user's
+//// qp, and pre-post the RRs for the peer's grant and credit returns. Our credits come with the
+//// peer's grant, which brings the link up.
+static int split_qps_connect(struct mlx5_qp *mqp, struct mlx5_split_link *link,
+			     struct split_exchange *ours, struct split_exchange *theirs)
+{
+	struct ibv_qp *split[2] = { link->split_qp[0], link->split_qp2 };
+	uint32_t dest[2] = { theirs->qp_num, theirs->qp2_num };
+	struct ibv_qp_attr split_attr;
+	int i;
+
+	if (theirs->recv_slots >= SPLIT_QP2_WR) {
+		fprintf(stderr, "split qp %06x takes %u credits at most\n", split[1]->qp_num, SPLIT_QP2_WR - 1);
+		return -1;
 	}
+	for (i = 0; i < 2; i++) {
+		memcpy(&split_attr, &mqp->user_qp_attr_rtr, sizeof(split_attr));
+		split_attr.dest_qp_num = dest[i];
+		split_attr.rq_psn = theirs->sq_psn;
+		if (split_reset_qp(split[i]) ||
+		    __mlx5_modify_qp(split[i], &mqp->user_qp_attr_init, mqp->user_qp_mask_init) ||
+		    __mlx5_modify_qp(split[i], &split_attr, mqp->user_qp_mask_rtr) ||
+		    (i == 1 && split_post_credit_recvs(link, theirs->recv_slots + 1)) ||
+		    split_qp_to_rts(split[i], ours->sq_psn)) {
+			fprintf(stderr, "Failed to bring split qp %06x to RTS\n", split[i]->qp_num);
+			return -1;
+		}
+	}
+	memcpy(&link->attr_init, &mqp->user_qp_attr_init, sizeof(link->attr_init));
+	memcpy(&link->attr_rtr, &mqp->user_qp_attr_rtr, sizeof(link->attr_rtr));
+	link->peer_qp_num = theirs->qp_num;
+	link->peer_qp2_num = theirs->qp2_num;
+	link->peer_recv_slots = theirs->recv_slots;
+	link->sends_failed = 0;
+	__atomic_store_n(&link->credits, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&link->state, SPLIT_LINK_GRANT, __ATOMIC_RELEASE);
+#ifdef JUSTITIA_DEBUG
+	printf("<<<<SPLIT QPs %06x/%06x connected to %06x/%06x>>>>\n",
+	       split[0]->qp_num, split[1]->qp_num, dest[0], dest[1]);
+	fflush(stdout);
+#endif
 
-	if (attr_mask & IBV_QP_PORT) {
-		ret = update_port_data(qp, attr->port_num);
-		if (ret)
-			return ret;
-		//// do same for custom_qp
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			update_port_data(mqp->split_qp[i], attr->port_num);
+	if (SPLIT_USE_EVENT) {
+		if (ibv_req_notify_cq(mqp->split_pool->send_cq, 0) ||
+		    ibv_req_notify_cq(mqp->split_pool->cq2, 0)) {
+			fprintf(stderr, "Couldn't request CQ notification\n");
+			return -1;
 		}
-		update_port_data(mqp->split_qp2, attr->port_num);
-		////
 	}
+	return 0;
+}
 
-	if (to_mqp(qp)->rx_qp)
-		return -ENOSYS;
+//// User's qps waiting for the peer's EXCHANGE or grant. A helper thread looks at them, since
+//// a passive end (the target of one-sided verbs) may never post or poll anything itself.
+static pthread_mutex_t split_exchange_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mlx5_qp *split_exchange_head;
+static int split_exchange_running;
 
-	//// Ignore QPs that are not RC for now
-	if (qp->qp_type != IBV_QPT_RC) {
-		ret = ibv_cmd_modify_qp(qp, attr, attr_mask, &cmd, sizeof cmd);
-		goto check;
-	}
+static int split_exchange_step(struct mlx5_qp *mqp);
 
-	//// modify original user's qp state
-	ret = ibv_cmd_modify_qp(qp, attr, attr_mask, &cmd, sizeof(cmd));
+static void *split_exchange_thread(void *arg)
+{
+	struct mlx5_qp **p;
 
-	//// if manually set the qpn difference for split qp
-	// Essentially we are looking at the user QP's INIT -> RTR transition when hacking dest_qp_num
-	// We also directly modify split qp to RTS instead of wait users modify their qp to RTS
-	// because some users might never do so.
-	if (qp->state == IBV_QPS_INIT) {
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			if (__mlx5_modify_qp(mqp->split_qp[i], attr, attr_mask)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to INIT State\n");
-				ret = 1;
-				goto err;
-			}
-		}
-		if (__mlx5_modify_qp(mqp->split_qp2, attr, attr_mask)) {
-			fprintf(stderr, "Failed to modify SPLIT QP to INIT State\n");
-			ret = 1;
-			goto err;
-		}
-	#ifdef JUSTITIA_DEBUG
-		printf("<<<<MODIFY SPLIT QP to INIT>>>>\n");
-		fflush(stdout);
-	#endif
-	} else if (qp->state == IBV_QPS_RTR && mqp->split_qp[0]->state == IBV_QPS_INIT) {
-		//attr->dest_qp_num -= 1;	// for old benchmark
-		//attr->dest_qp_num -= 2; // for new benchmark
-		struct ibv_qp_attr split_attr, split_attr2;
-		memcpy(&split_attr, attr, sizeof(struct ibv_qp_attr));
-		memcpy(&split_attr2, attr, sizeof(struct ibv_qp_attr));
-		int split_mask = attr_mask;
-		uint32_t split_dest_qp_num = attr->dest_qp_num;
-		uint32_t split_rq_psn = 10083;
-		for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-			split_dest_qp_num -= SPLIT_QP_NUM_DIFF;
-			split_rq_psn++;
-			split_attr.dest_qp_num = split_dest_qp_num;
-			split_attr.rq_psn = split_rq_psn;
-			//printf("DEBUG MODIFY QP: now attr->dest_qp_num is %06x\n", attr->dest_qp_num);
-
-			if (__mlx5_modify_qp(mqp->split_qp[i], &split_attr, split_mask)) {
-				fprintf(stderr, "Failed to modify SPLIT QP to RTR State\n");
-				ret = 1;
-				goto err;
-			}
+	pthread_mutex_lock(&split_exchange_mutex);
+	while (split_exchange_head) {
+		for (p = &split_exchange_head; *p; ) {
+			if (split_exchange_step(*p))
+				*p = (*p)->split_exchange_next;
+			else
+				p = &(*p)->split_exchange_next;
 		}
+		pthread_mutex_unlock(&split_exchange_mutex);
+		usleep(SPLIT_EXCHANGE_POLL_US);
+		pthread_mutex_lock(&split_exchange_mutex);
+	}
+	split_exchange_running = 0;
+	pthread_mutex_unlock(&split_exchange_mutex);
+	return NULL;
+}
 
-		split_dest_qp_num -= SPLIT_QP_NUM_DIFF;
-		split_attr2.dest_qp_num = split_dest_qp_num;
-		split_attr2.rq_psn = 10083;
-		if (__mlx5_modify_qp(mqp->split_qp2, &split_attr2, split_mask)) {
-			fprintf(stderr, "Failed to modify SPLIT QP to RTR State\n");
-			ret = 1;
-			goto err;
-		}
-	#ifdef JUSTITIA_DEBUG
-		printf("<<<<MODIFY SPLIT QP to RTR>>>>\n");
-		fflush(stdout);
-	#endif
-		//// pre-post a RR for later use
-		//printf("DEBUG MODIFY QP: post a RR to split_qp\n");
-		struct ibv_sge sge;
-		struct ibv_recv_wr wr;
-		struct ibv_recv_wr *bad_wr;
-		memset(&sge, 0, sizeof(sge));
-		sge.addr = (uintptr_t)&mqp->split_fc_msg[0];
-		sge.length = sizeof(struct Split_FC_message);
-		sge.lkey = mqp->split_fc_mr->lkey;
-
-		memset(&wr, 0, sizeof(wr));
-		wr.wr_id = 0;
-		wr.next = NULL;
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-
-		if (mlx5_post_recv(mqp->split_qp[0], &wr, &bad_wr)) {
-			fprintf(stderr, "Failed to post the initial RR to split qp.\n");
-			ret = 1;
-			goto err;
+static void split_exchange_watch(struct mlx5_qp *mqp)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_mutex_lock(&split_exchange_mutex);
+	mqp->split_exchange_next = split_exchange_head;
+	split_exchange_head = mqp;
+	if (!split_exchange_running) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		split_exchange_running = !pthread_create(&thread, &attr, split_exchange_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (!split_exchange_running)
+			fprintf(stderr, "Couldn't start the split qp exchange thread\n");
+	}
+	pthread_mutex_unlock(&split_exchange_mutex);
+}
+
+//// Once this returns, the exchange thread no longer touches mqp
+static void split_exchange_unwatch(struct mlx5_qp *mqp)
+{
+	struct mlx5_qp **p;
+
+	pthread_mutex_lock(&split_exchange_mutex);
+	for (p = &split_exchange_head; *p; p = &(*p)->split_exchange_next) {
+		if (*p == mqp) {
+			*p = mqp->split_exchange_next;
+			break;
 		}
+	}
+	pthread_mutex_unlock(&split_exchange_mutex);
+}
 
-		sge.addr = (uintptr_t)&mqp->split_fc_msg[2];
-		if (mlx5_post_recv(mqp->split_qp2, &wr, &bad_wr)) {
-			fprintf(stderr, "Failed to post the initial RR to split qp.\n");
-			ret = 1;
-			goto err;
+//// One look at a user's qp waiting for its peer, under split_exchange_mutex. Once the peer's
+//// EXCHANGE is in and ours went out, the qp splits over a link both ends offered if there is
+//// one; if not, the fresh links are connected and the grant is sent, and the qp splits when the
+//// peer's grant comes in. A qp that never gets the grant stays connected for the peer's split
+//// messages but does not split its own. Returns 1 once the exchange thread is done with the qp.
+static int split_exchange_step(struct mlx5_qp *mqp)
+{
+	struct split_exchange *ours = &mqp->split_fc_msg[0].msg.split_qp_exchange;
+	struct split_exchange *theirs = &mqp->split_fc_msg[1].msg.split_qp_exchange;
+	struct mlx5_split_link *link;
+	int choice;
+
+	if (mqp->split_qp_exchange_done == 2) {
+		if (mlx5_split_reap_grant(mqp->split_pool) < 0)
+			goto fail;
+		if (__atomic_load_n(&mqp->split_link->state, __ATOMIC_ACQUIRE) == SPLIT_LINK_UP) {
+			__atomic_store_n(&mqp->split_qp_exchange_done, 1, __ATOMIC_RELEASE);
+			return 1;
 		}
+		return split_now_ms() >= mqp->split_exchange_deadline;
+	}
+	if (!split_exchange_arrived(theirs) ||
+	    !__atomic_load_n(&mqp->split_exchange_tx, __ATOMIC_ACQUIRE))
+		return 0;
+	//// the peer connects its split qps once it has ours
+	if (mlx5_post_split_exchange(mqp))
+		goto fail;
+	if (!theirs->qp_num || !ours->qp_num) {
+		//// one end takes no EXCHANGEs or has no split qps, so neither splits
+		__atomic_store_n(&mqp->split_qp_exchange_done, -1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	if (theirs->user_psn != mqp->split_rq_psn)
+		goto fail;
+
+	choice = split_exchange_choose(ours, theirs);
+	pthread_mutex_lock(&split_pool_mutex);
+	link = choice < 0 ? mqp->split_fresh : mqp->split_offer[choice];
+	link->users++;
+	split_links_put(mqp);
+	mqp->split_link = link;
+	pthread_mutex_unlock(&split_pool_mutex);
+
+	mqp->split_peer.recv_slots = theirs->recv_slots;
+	mqp->split_peer.slot_size = theirs->slot_size;
+	mqp->split_peer.split_min = theirs->split_min;
+	if (choice >= 0) {
+		//// up at both ends already, credits included
+		__atomic_store_n(&mqp->split_qp_exchange_done, 1, __ATOMIC_RELEASE);
+		return 1;
+	}
 
-		// Modify split qp to RTS
-		split_attr.qp_state	    = IBV_QPS_RTS;
-		//split_attr.sq_psn	    = 10083;
-		split_attr.timeout	    = 14;
-		split_attr.retry_cnt	= 7;
-		split_attr.rnr_retry	= 7;
-		split_attr.max_rd_atomic  = 1;
-		int rts_mask = 	IBV_QP_STATE              |
-						IBV_QP_TIMEOUT            |
-						IBV_QP_RETRY_CNT          |
-						IBV_QP_RNR_RETRY          |
-						IBV_QP_SQ_PSN             |
-						IBV_QP_MAX_QP_RD_ATOMIC;
-
-		uint32_t split_sq_psn = 10083;
-			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-				split_sq_psn++;
-				split_attr.sq_psn = split_sq_psn;
-
-				if (__mlx5_modify_qp(mqp->split_qp[i], &split_attr, rts_mask)) {
-					fprintf(stderr, "Failed to modify SPLIT QP to RTS State\n");
-					ret = 1;
-					goto err;
-				}
-			}
+	//// the grant: our split qps are connected to the peer's, with all of our slots free
+	if (split_qps_connect(mqp, link, ours, theirs) ||
+	    mlx5_post_split_credit(link->split_qp2, ours->recv_slots))
+		goto fail;
+	mqp->split_exchange_deadline = split_now_ms() + SPLIT_EXCHANGE_TIMEOUT_MS;
+	__atomic_store_n(&mqp->split_qp_exchange_done, 2, __ATOMIC_RELEASE);
+	return 0;
 
-		split_attr2.qp_state	    = IBV_QPS_RTS;
-		split_attr2.sq_psn	    = 10083;
-		split_attr2.timeout	    = 14;
-		split_attr2.retry_cnt	= 7;
-		split_attr2.rnr_retry	= 7;
-		split_attr2.max_rd_atomic  = 1;
-		if (__mlx5_modify_qp(mqp->split_qp2, &split_attr2, rts_mask)) {
-			fprintf(stderr, "Failed to modify SPLIT QP to RTS State\n");
-			ret = 1;
-			goto err;
-		}
-	#ifdef JUSTITIA_DEBUG
-		printf("<<<<MODIFY SPLIT QP to RTS>>>>\n");
-		printf("<<<<Request SPLIT CQ evnt notification\n");
-		fflush(stdout);
-	#endif
-		if (SPLIT_USE_EVENT) {
-			ret = ibv_req_notify_cq(mqp->split_send_cq, 0); 
-			if (ret) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				goto err;
-			}
-			ret = ibv_req_notify_cq(mqp->split_recv_cq, 0); 
-			if (ret) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				goto err;
-			}
-			ret = ibv_req_notify_cq(mqp->split_cq2, 0); 
-			if (ret) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				goto err;
-			}
-		}
+fail:
+	fprintf(stderr, "split qp EXCHANGE of qp %06x failed; posting it without splitting\n",
+		mqp->verbs_qp.qp.qp_num);
+	__atomic_store_n(&mqp->split_qp_exchange_done, -1, __ATOMIC_RELAXED);
+out:
+	pthread_mutex_lock(&split_pool_mutex);
+	split_links_put(mqp);
+	pthread_mutex_unlock(&split_pool_mutex);
+	return 1;
+}
 
+//// RESET -> INIT: a user's qp that is not on an SRQ takes the peer's EXCHANGE in a RR posted
+//// ahead of any of the application's
+static void split_exchange_init(struct mlx5_qp *mqp)
+{
+	mqp->split_qp_exchange_done = -1;
+	if (mqp->verbs_qp.qp.srq)
+		return;
+	memset(&mqp->split_fc_msg[1], 0, sizeof(mqp->split_fc_msg[1]));
+	mqp->split_exchange_cqes = SPLIT_EXCHANGE_RECV_CQE;
+	if (split_post_fc_recv(mqp, &mqp->verbs_qp.qp, &mqp->split_fc_msg[1])) {
+		mqp->split_exchange_cqes = 0;
+		return;
 	}
-	//// Set start_flag to 1
-	start_flag = 1;
+	mqp->split_qp_exchange_done = 0;
+}
 
-check:
-	if (!ret		       &&
-	    (attr_mask & IBV_QP_STATE) &&
-	    attr->qp_state == IBV_QPS_RESET) {
-		if (qp->recv_cq) {
-			mlx5_cq_clean(to_mcq(qp->recv_cq), mqp->rsc.rsn,
-				      qp->srq ? to_msrq(qp->srq) : NULL);
-		}
-		if (qp->send_cq != qp->recv_cq && qp->send_cq)
-			mlx5_cq_clean(to_mcq(qp->send_cq), mqp->rsc.rsn, NULL);
+//// INIT -> RTR of a qp that takes EXCHANGEs: one psn early, for the peer's
+static int split_exchange_rtr(struct mlx5_qp *mqp, struct ibv_qp_attr *attr, int attr_mask)
+{
+	struct ibv_qp_attr rtr_attr;
+	int ret;
 
-		mlx5_init_qp_indices(mqp);
-		db = mqp->gen_data.db;
-		db[MLX5_RCV_DBR] = 0;
-		db[MLX5_SND_DBR] = 0;
+	memcpy(&rtr_attr, attr, sizeof(rtr_attr));
+	rtr_attr.rq_psn = split_psn_prev(attr->rq_psn);
+	ret = __mlx5_modify_qp(&mqp->verbs_qp.qp, &rtr_attr, attr_mask);
+	if (ret)
+		return ret;
+	//// the split qps are brought up on the same path
+	memcpy(&mqp->user_qp_attr_rtr, attr, sizeof(*attr));
+	mqp->user_qp_mask_rtr = attr_mask;
+	mqp->split_rq_psn = attr->rq_psn;
+	split_exchange_watch(mqp);
+	return 0;
+}
 
-		struct ibv_qp *orig_qp = qp;
-		if (qp->qp_type == IBV_QPT_RC) {
-			//// do same for custom_qp
-			for (i = 0; i < MAX_SPLIT_QP_NUM_ONE_SIDED; i++) {
-				qp = mqp->split_qp[i];
-				if (qp->recv_cq) {
-					mlx5_cq_clean(to_mcq(qp->recv_cq), mqp->rsc.rsn,
-							qp->srq ? to_msrq(qp->srq) : NULL);
-				}
-				if (qp->send_cq != qp->recv_cq && qp->send_cq)
-					mlx5_cq_clean(to_mcq(qp->send_cq), to_mqp(qp)->rsc.rsn, NULL);
+//// RTR -> RTS: one psn early, for our EXCHANGE. Every user's qp that splits sends one, so its
+//// peer finds the application's messages at the psns it was given whether it takes EXCHANGEs
+//// or not.
+static int split_exchange_rts(struct mlx5_qp *mqp, struct ibv_qp_attr *attr, int attr_mask)
+{
+	struct ibv_qp *qp = &mqp->verbs_qp.qp;
+	struct split_exchange *ours = &mqp->split_fc_msg[0].msg.split_qp_exchange;
+	struct ibv_qp_attr rts_attr;
+	int ret;
 
-				mlx5_init_qp_indices(to_mqp(qp));
-				db = to_mqp(qp)->gen_data.db;
-				db[MLX5_RCV_DBR] = 0;
-				db[MLX5_SND_DBR] = 0;
-			}
+	memcpy(&rts_attr, attr, sizeof(rts_attr));
+	rts_attr.sq_psn = split_psn_prev(attr->sq_psn);
+	ret = __mlx5_modify_qp(qp, &rts_attr, attr_mask);
+	if (ret)
+		return ret;
 
-			qp = mqp->split_qp2;
-			if (qp->recv_cq) {
-				mlx5_cq_clean(to_mcq(qp->recv_cq), mqp->rsc.rsn,
-						qp->srq ? to_msrq(qp->srq) : NULL);
-			}
-			if (qp->send_cq != qp->recv_cq && qp->send_cq)
-				mlx5_cq_clean(to_mcq(qp->send_cq), to_mqp(qp)->rsc.rsn, NULL);
+	memset(&mqp->split_fc_msg[0], 0, sizeof(mqp->split_fc_msg[0]));
+	mqp->split_fc_msg[0].type = EXCHANGE;
+	//// the links up to the peer already are offered along with a fresh one
+	if (mqp->split_qp_exchange_done == 0) {
+		pthread_mutex_lock(&split_pool_mutex);
+		split_links_offer(qp->pd, mqp, ours);
+		pthread_mutex_unlock(&split_pool_mutex);
+	}
+	ours->sq_psn = (getpid() ^ qp->qp_num ^ (uint32_t)get_cycles()) & SPLIT_PSN_MASK;
+	//// this driver does not reassemble split messages, so the peer must not split what it sends us
+	ours->recv_slots = 0;
+	ours->slot_size = 0;
+	ours->split_min = MIN_SPLIT_CHUNK_SIZE;
+	ours->user_psn = attr->sq_psn;
+	ours->seal = SPLIT_EXCHANGE_SEAL;
+	__atomic_store_n(&mqp->split_exchange_tx, 1, __ATOMIC_RELEASE);
+	return 0;
+}
 
-			mlx5_init_qp_indices(to_mqp(qp));
-			db = to_mqp(qp)->gen_data.db;
-			db[MLX5_RCV_DBR] = 0;
-			db[MLX5_SND_DBR] = 0;
-			////
+//// Modify to change the qp state of the user's qp and bring up its split qps.
+//// Each end sends the EXCHANGE (split_exchange.h) as the first message on the user's qp, one
+//// psn ahead of the application's, so nothing waits for the peer here; the split qps are
+//// connected by the exchange thread once both EXCHANGEs are through.
+int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		   int attr_mask)
+{
+	struct mlx5_qp *mqp = to_mqp(qp);
+	enum ibv_qp_state cur_state = qp->state;
+	int ret;
 
-			qp = orig_qp;
-		}
+	//// Ignore QPs that are not RC for now
+	if (qp->qp_type != IBV_QPT_RC || !mqp->split_pool || !(attr_mask & IBV_QP_STATE)) {
+		ret = __mlx5_modify_qp(qp, attr, attr_mask);
+		goto out;
 	}
-	if (!ret && (attr_mask & IBV_QP_STATE))
-		mlx5_update_post_send_one(mqp, qp->state, qp->qp_type);
 
-	if (!ret &&
-	    (attr_mask & IBV_QP_STATE) &&
-	    attr->qp_state == IBV_QPS_RTR &&
-	    (qp->qp_type == IBV_QPT_RAW_ETH || mqp->flags & MLX5_QP_FLAGS_USE_UNDERLAY)) {
-		mlx5_lock(&mqp->rq.lock);
-		mqp->gen_data.db[MLX5_RCV_DBR] = htonl(mqp->rq.head & 0xffff);
-		mlx5_unlock(&mqp->rq.lock);
+	switch (attr->qp_state) {
+	case IBV_QPS_INIT:
+		ret = __mlx5_modify_qp(qp, attr, attr_mask);
+		if (!ret && cur_state == IBV_QPS_RESET) {
+			//// cached to bring the split qps up like the user's qp
+			memcpy(&mqp->user_qp_attr_init, attr, sizeof(*attr));
+			mqp->user_qp_mask_init = attr_mask;
+			split_exchange_init(mqp);
+		}
+		break;
+	case IBV_QPS_RTR:
+		if (cur_state == IBV_QPS_INIT && mqp->split_qp_exchange_done == 0)
+			ret = split_exchange_rtr(mqp, attr, attr_mask);
+		else
+			ret = __mlx5_modify_qp(qp, attr, attr_mask);
+		break;
+	case IBV_QPS_RTS:
+		if (cur_state == IBV_QPS_RTR)
+			ret = split_exchange_rts(mqp, attr, attr_mask);
+		else
+			ret = __mlx5_modify_qp(qp, attr, attr_mask);
+		break;
+	case IBV_QPS_RESET:
+		split_exchange_unwatch(mqp);
+		ret = __mlx5_modify_qp(qp, attr, attr_mask);
+		if (!ret) {
+			//// its links stay up in the pool for a reconnect to the same peer
+			pthread_mutex_lock(&split_pool_mutex);
+			split_links_put(mqp);
+			pthread_mutex_unlock(&split_pool_mutex);
+			mqp->split_qp_exchange_done = -1;
+			mqp->split_exchange_tx = 0;
+			mqp->split_exchange_cqes = 0;
+		}
+		break;
+	default:
+		ret = __mlx5_modify_qp(qp, attr, attr_mask);
+		break;
 	}
 
-	start_flag = 1;
-err:
+out:
+	//// paced by the pacer of the port it is on
+	if (!ret && (attr_mask & IBV_QP_STATE) && attr->qp_state == IBV_QPS_INIT &&
+	    (attr_mask & IBV_QP_PORT))
+		justitia_flow_port(mqp, attr->port_num);
 	return ret;
 }
 
-
 static inline int ipv6_addr_v4mapped(const struct in6_addr *a)
 {
 	return ((a->s6_addr32[0] | a->s6_addr32[1]) |
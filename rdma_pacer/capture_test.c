@@ -0,0 +1,220 @@
+/*
+ * Test for the capture of the drivers (justitia/capture.h) and its replay loader (replay.h).
+ *
+ * Without JUSTITIA_CAPTURE a post finds capture off. With it, threads post chains of WRs as the
+ * drivers record them, more than a ring holds, and exit; the main thread's ring is written out as
+ * the exit of the process does it. Every WR must come back from the files: those of a thread in
+ * the order it posted them with what was posted, the WRs of a chain at one time, all of them
+ * merged in time order over about the time the posts took. Loaded at a scale of 0.5, every WR
+ * must come at half its time.
+ *
+ * usage: capture_test
+ */
+
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "get_clock.h"
+#include "../justitia/capture.h"
+#include "replay.h"
+
+#define THREADS     4
+#define CALLS       6000        /* per thread, of CHAIN WRs at most: past a ring */
+#define CHAIN       3
+
+static int failures;
+static char prefix[64];
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+/* what WR i of the calls of thread t posts: bytes count the WRs, the chains are 1 to CHAIN long */
+static uint32_t wr_qpn(int t)
+{
+    return 0x100 + t;
+}
+
+static int wr_chain(int call)
+{
+    return call % CHAIN + 1;
+}
+
+static void post_calls(int t)
+{
+    uint64_t seq = 0;
+    int call, j;
+
+    for (call = 0; call < CALLS; call++) {
+        uint64_t now = get_cycles();
+
+        for (j = 0; j < wr_chain(call); j++, seq++)
+            capture_post(now, wr_qpn(t), seq % 5, seq, t % 4 - 1, j + 1, call);
+    }
+}
+
+static void *poster(void *arg)
+{
+    post_calls((long)arg);
+    return NULL;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void remove_files(void)
+{
+    char pattern[80];
+    glob_t g;
+    size_t i;
+
+    snprintf(pattern, sizeof(pattern), "%s.*", prefix);
+    if (glob(pattern, 0, NULL, &g))
+        return;
+    for (i = 0; i < g.gl_pathc; i++)
+        unlink(g.gl_pathv[i]);
+    globfree(&g);
+}
+
+static int check_off(void)
+{
+    unsetenv(CAPTURE_ENV);
+    CHECK(capture_enabled() < 0, "capture known to be on or off before a post");
+    CHECK(!capture_setup() && !capture_enabled(), "capture on without %s", CAPTURE_ENV);
+    /* as a new process finds it */
+    capture_state = -1;
+    return 0;
+}
+
+/* the WRs of thread t, in the order loaded, are those it posted */
+static int check_thread(const struct replay *r, int t, int tid)
+{
+    uint64_t seq = 0, ns = 0;
+    int call = 0, j = 0;
+    size_t i;
+
+    for (i = 0; i < r->n; i++) {
+        const struct replay_post *p = &r->post[i];
+
+        if (p->tid != tid)
+            continue;
+        CHECK(p->qpn == wr_qpn(t) && p->bytes == seq && p->opcode == seq % 5 && p->cls == t % 4 - 1
+              && p->num_sge == j + 1 && p->send_flags == (uint32_t)call,
+              "thread %d: WR %lu came back as qp 0x%x, %u bytes, opcode %d, class %d, %d sges, call %u", t,
+              (unsigned long)seq, p->qpn, p->bytes, p->opcode, p->cls, p->num_sge, p->send_flags);
+        CHECK(j == 0 ? p->ns >= ns : p->ns == ns, "thread %d: WR %lu at %lu ns, after %lu", t,
+              (unsigned long)seq, (unsigned long)p->ns, (unsigned long)ns);
+        ns = p->ns;
+        seq++;
+        if (++j == wr_chain(call)) {
+            j = 0;
+            call++;
+        }
+    }
+    CHECK(call == CALLS && !j, "thread %d: %d of %d calls came back", t, call, CALLS);
+    return 0;
+}
+
+static int check_capture(uint32_t tsc_khz)
+{
+    pthread_t th[THREADS - 1];
+    struct replay r, half;
+    int tids[THREADS], ntids = 0, t;
+    uint64_t wrs = 0;
+    double took;
+    size_t i;
+
+    setenv(CAPTURE_ENV, prefix, 1);
+    CHECK(capture_setup() == 1 && capture_enabled() == 1, "capture off with %s set", CAPTURE_ENV);
+    capture_mhz = tsc_khz / 1000.0;
+
+    took = now_ns();
+    for (t = 1; t < THREADS; t++)
+        pthread_create(&th[t - 1], NULL, poster, (void *)(long)t);
+    post_calls(0);
+    for (t = 1; t < THREADS; t++)
+        pthread_join(th[t - 1], NULL);
+    took = now_ns() - took;
+    capture_exit();
+    for (t = 0; t < CALLS; t++)
+        wrs += wr_chain(t);
+    wrs *= THREADS;
+
+    CHECK(replay_load(&r, prefix, 1) == 0, "replay_load %s", prefix);
+    CHECK(r.files == THREADS && r.n == wrs, "%d files of %lu WRs, not %d of %lu", r.files, (unsigned long)r.n,
+          THREADS, (unsigned long)wrs);
+    CHECK(r.post[0].ns == 0 && r.span_ns == r.post[r.n - 1].ns, "span %lu ns from %lu",
+          (unsigned long)r.span_ns, (unsigned long)r.post[0].ns);
+    CHECK(r.span_ns <= took * 2 && r.span_ns >= took / 20, "%.0f us of posts span %.0f us",
+          took / 1e3, r.span_ns / 1e3);
+    for (i = 0; i < r.n; i++) {
+        CHECK(!i || r.post[i].ns >= r.post[i - 1].ns, "WR %lu at %lu ns, after %lu", (unsigned long)i,
+              (unsigned long)r.post[i].ns, (unsigned long)r.post[i - 1].ns);
+        for (t = 0; t < ntids && tids[t] != r.post[i].tid; t++)
+            ;
+        if (t == ntids) {
+            CHECK(ntids < THREADS, "WRs of more than %d threads", THREADS);
+            tids[ntids++] = r.post[i].tid;
+        }
+    }
+    for (t = 0; t < THREADS; t++) {
+        /* the thread that posted qp 0x100 + t */
+        for (i = 0; r.post[i].qpn != wr_qpn(t); i++)
+            ;
+        if (check_thread(&r, t, r.post[i].tid))
+            return -1;
+    }
+
+    CHECK(replay_load(&half, prefix, 0.5) == 0, "replay_load %s at 0.5", prefix);
+    CHECK(half.n == r.n, "%lu WRs at 0.5, %lu at 1", (unsigned long)half.n, (unsigned long)r.n);
+    for (i = 0; i < r.n; i++)
+        CHECK(half.post[i].qpn == r.post[i].qpn && half.post[i].bytes == r.post[i].bytes
+              && (half.post[i].ns == r.post[i].ns / 2 || half.post[i].ns == (r.post[i].ns + 1) / 2),
+              "WR %lu at %lu ns at 0.5, %lu at 1", (unsigned long)i, (unsigned long)half.post[i].ns,
+              (unsigned long)r.post[i].ns);
+    printf("capture_test: %lu WRs of %d threads in %.0f us, %.2f MB of capture\n", (unsigned long)r.n, THREADS,
+           took / 1e3, (r.n * sizeof(struct capture_rec) + THREADS * sizeof(struct capture_header)) / 1e6);
+    replay_free(&r);
+    replay_free(&half);
+    return 0;
+}
+
+int main(void)
+{
+    const char *source = "";
+    uint32_t tsc_khz;
+    int invariant;
+
+    if (!(tsc_khz = get_tsc_khz(&invariant, &source))) {
+        fprintf(stderr, "no tsc rate\n");
+        return 1;
+    }
+    snprintf(prefix, sizeof(prefix), "/tmp/capture_test-%d", (int)getpid());
+
+    check_off();
+    check_capture(tsc_khz);
+    remove_files();
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("capture_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include "ctl_server.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CTL_EVENTS 64
+
+/* listen at path; 0, or -1 with errno set */
+int ctl_server_open(struct ctl_server *srv, const char *path, ctl_handler handle, void *arg)
+{
+    struct sockaddr_un local;
+    struct epoll_event ev;
+
+    srv->handle = handle;
+    srv->arg = arg;
+    srv->epfd = -1;
+    if ((srv->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strncpy(local.sun_path, path, sizeof(local.sun_path) - 1);
+    unlink(local.sun_path);
+    if (bind(srv->fd, (struct sockaddr *)&local, sizeof(local)))
+        goto fail;
+    /* every thread of an app may connect at once */
+    if (listen(srv->fd, SOMAXCONN))
+        goto fail;
+
+    if ((srv->epfd = epoll_create1(0)) == -1)
+        goto fail;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         /* the listening socket */
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->fd, &ev))
+        goto fail;
+    return 0;
+
+fail:
+    if (srv->epfd >= 0)
+        close(srv->epfd);
+    close(srv->fd);
+    return -1;
+}
+
+static void ctl_accept(struct ctl_server *srv)
+{
+    struct epoll_event ev;
+    struct ctl_conn *c;
+    int fd;
+
+    if ((fd = accept(srv->fd, NULL, NULL)) == -1) {
+        if (errno != EINTR && errno != EAGAIN)
+            perror("accept");
+        return;
+    }
+    if (!(c = calloc(1, sizeof(*c)))) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        perror("epoll_ctl");
+        close(fd);
+        free(c);
+    }
+}
+
+static void ctl_drop(struct ctl_server *srv, struct ctl_conn *c, int detach)
+{
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (!detach)
+        close(c->fd);
+    free(c);
+}
+
+/* reads what came and hands the messages in it to the handler; returns what becomes of c */
+static int ctl_read(struct ctl_server *srv, struct ctl_conn *c)
+{
+    char *start, *nl;
+    ssize_t n;
+    int ret;
+
+    n = recv(c->fd, c->buf + c->len, CTL_BUF_LEN - 1 - c->len, 0);
+    if (n < 0 && errno == EINTR)
+        return CTL_KEEP;
+    if (n <= 0)
+        return CTL_CLOSE;
+    c->len += n;
+    c->buf[c->len] = '\0';
+
+    if (!c->lines) {
+        if (c->msgs || strncmp(c->buf, CTL_HELLO, sizeof(CTL_HELLO) - 1)) {
+            /* a one-shot client: what one recv gets is one message */
+            c->msgs++;
+            c->len = 0;
+            return srv->handle(c, c->buf, srv->arg);
+        }
+        c->lines = 1;
+        c->len -= sizeof(CTL_HELLO) - 1;
+        memmove(c->buf, c->buf + sizeof(CTL_HELLO) - 1, c->len + 1);
+    }
+
+    for (start = c->buf; (nl = strchr(start, '\n')); start = nl + 1) {
+        *nl = '\0';
+        c->msgs++;
+        ret = srv->handle(c, start, srv->arg);
+        if (ret != CTL_KEEP)
+            return ret;
+    }
+    c->len -= start - c->buf;
+    memmove(c->buf, start, c->len + 1);
+    /* a line longer than any message: not a client of ours */
+    return c->len < CTL_BUF_LEN - 1 ? CTL_KEEP : CTL_CLOSE;
+}
+
+/* serves the clients ready within timeout_ms (-1: waits for one); 0, or -1 if epoll fails */
+int ctl_server_poll(struct ctl_server *srv, int timeout_ms)
+{
+    struct epoll_event ev[CTL_EVENTS];
+    struct ctl_conn *c;
+    int i, n, ret;
+
+    n = epoll_wait(srv->epfd, ev, CTL_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (!(c = ev[i].data.ptr)) {
+            ctl_accept(srv);
+            continue;
+        }
+        ret = ctl_read(srv, c);
+        if (ret != CTL_KEEP)
+            ctl_drop(srv, c, ret == CTL_DETACH);
+    }
+    return 0;
+}
+
+/* serves the clients; returns only if epoll fails */
+void ctl_server_run(struct ctl_server *srv)
+{
+    while (!ctl_server_poll(srv, -1))
+        ;
+}
+
+/* all of len bytes to the client, or -1; a client gone away fails it, it does not raise SIGPIPE */
+int ctl_reply(struct ctl_conn *c, const char *msg, int len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(c->fd, msg, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        msg += n;
+        len -= n;
+    }
+    return 0;
+}
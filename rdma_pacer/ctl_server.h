@@ -0,0 +1,46 @@
+#ifndef CTL_SERVER_H
+#define CTL_SERVER_H
+
+/* The pacer's side of the control channel: one epoll loop serving every client connection at
+ * once instead of one accept and blocking recv at a time. A connection is one-shot, as the
+ * per-message clients use it: every recv is a message. One that starts with the CTL_HELLO line is
+ * a process' persistent channel (ctl_chan.h in the drivers): every line is a message then.
+ * Messages go to the handler, which answers with ctl_reply and says what becomes of the
+ * connection. Kept free of verbs so it can be benchmarked offline.
+ */
+
+#define CTL_HELLO           "ctl\n"
+#define CTL_BUF_LEN         256     /* bytes of a connection not yet handled; a line is far shorter */
+
+enum {
+    CTL_KEEP,       /* more messages come */
+    CTL_CLOSE,      /* the exchange is over */
+    CTL_DETACH,     /* the handler keeps the socket (tokens go over it under CPU_FRIENDLY) */
+};
+
+struct ctl_conn {
+    int fd;
+    int lines;                      /* persistent: a message per line */
+    int state;                      /* the handler's; 0 at accept */
+    unsigned msgs;                  /* handled so far */
+    int len;
+    char buf[CTL_BUF_LEN];
+};
+
+/* msg is nul-terminated, without its newline */
+typedef int (*ctl_handler)(struct ctl_conn *c, char *msg, void *arg);
+
+struct ctl_server {
+    int fd;                         /* listening */
+    int epfd;
+    ctl_handler handle;
+    void *arg;
+};
+
+int ctl_server_open(struct ctl_server *srv, const char *path, ctl_handler handle, void *arg);
+void ctl_server_run(struct ctl_server *srv);
+/* one turn of ctl_server_run, for a loop of another that watches epfd (pacer -s) */
+int ctl_server_poll(struct ctl_server *srv, int timeout_ms);
+int ctl_reply(struct ctl_conn *c, const char *msg, int len);
+
+#endif
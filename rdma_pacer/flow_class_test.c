@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+
+/*
+ * Trace-driven test for the drivers' online flow classifier (flow_class.h), which puts the qps
+ * created without a class hint into bw, lat or tput from what they post.
+ *
+ * Every trace is a random sequence of phases, each a stationary workload with a known class:
+ * lat is one small WR per post call an RTT after the previous one, tput posts batches of small
+ * WRs back to back, bw posts big WRs. All of them carry noise: the odd long pause (a
+ * descheduled thread) and the odd big WR in a small flow. After a lat, tput or bw phase the
+ * trace may hold in a hysteresis band (gaps between the lat and tput thresholds, sizes between
+ * the small and big ones), where the flow must keep whatever class it has.
+ *
+ * Checks: every phase is detected, 99% of them within a bound of WRs, the class never changes
+ * again inside a phase once detected (nor at all inside a band), and the WR-weighted accuracy
+ * over all phases, detection delays included, is at least 90%. Reports the confusion matrix,
+ * the time to detect and the cost of one classified post call.
+ *
+ * usage: flow_class_test [traces] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../justitia/flow_class.h"
+
+#define PHASES          12
+#define PHASE_WRS_MIN   5000
+#define PHASE_WRS_MAX   20000
+#define PAUSE_PERMILLE  2                   /* post calls followed by a pause */
+#define OUTLIER_PERMILLE 5                  /* WRs of a small flow that are big */
+#define NS_MULT         65536               /* the traces are in ns: one cycle per ns */
+#define TIMED           10000000
+
+/* longest it should take to detect a phase, in WRs: DWELL votes in a row after a window straddling
+ * the phase change and one the noise spoiled. A window closes on the call that fills it, so it
+ * holds up to wrs_hi - 1 WRs more than FLOW_CLASS_WINDOW.
+ */
+#define DETECT_BOUND(wrs_hi)    ((FLOW_CLASS_DWELL + 2) * (FLOW_CLASS_WINDOW - 1 + (wrs_hi)))
+
+enum { LAT, TPUT, BW, GAP_BAND, SIZE_BAND, KINDS };
+
+struct kind {
+    const char *name;
+    int truth;                  /* class the flow must be in; -1: the one it had on entry */
+    uint32_t wrs_lo, wrs_hi;    /* WRs per post call */
+    uint32_t size_lo, size_hi;  /* bytes per WR */
+    uint32_t gap_lo, gap_hi;    /* ns since the previous post call, per WR of the call */
+};
+
+static const struct kind kinds[KINDS] = {
+    [LAT]       = { "lat",       FLOW_CLASS_LAT,  1,  1,  16,    512,     2000, 10000 },
+    [TPUT]      = { "tput",      FLOW_CLASS_TPUT, 8,  64, 16,    1024,    50,   250 },
+    [BW]        = { "bw",        FLOW_CLASS_BW,   1,  4,  65536, 1048576, 100,  20000 },
+    [GAP_BAND]  = { "gap band",  -1,              4,  16, 16,    512,     450,  950 },
+    [SIZE_BAND] = { "size band", -1,              1,  4,  1200,  3800,    100,  5000 },
+};
+
+static int failures;
+static uint64_t confusion[3][3];        /* WRs posted [in truth class][classified as] */
+static uint32_t *detect_wrs[KINDS], detected[KINDS];  /* WRs each phase took to detect */
+static uint64_t detect_ns[KINDS];
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t uniform(uint32_t lo, uint32_t hi)
+{
+    return lo + (uint32_t)((uint64_t)rand() * (hi - lo + 1) / ((uint64_t)RAND_MAX + 1));
+}
+
+/* one post call of kind k: sets its WRs and bytes, returns the ns since the previous one */
+static uint64_t gen_call(const struct kind *k, int truth, uint32_t *wrs, uint64_t *bytes)
+{
+    uint64_t gap = 0;
+    uint32_t i;
+
+    *wrs = uniform(k->wrs_lo, k->wrs_hi);
+    *bytes = 0;
+    for (i = 0; i < *wrs; i++) {
+        gap += uniform(k->gap_lo, k->gap_hi);
+        if (truth != FLOW_CLASS_BW && k->size_hi <= FLOW_CLASS_SMALL_BYTES &&
+            uniform(0, 999) < OUTLIER_PERMILLE)
+            *bytes += 16384;
+        else
+            *bytes += uniform(k->size_lo, k->size_hi);
+    }
+    if (uniform(0, 999) < PAUSE_PERMILLE)
+        gap += uniform(10000, 1000000);
+    return gap;
+}
+
+/* one phase of kind k from trace time *t; returns the class the flow is in at its end */
+static int run_phase(struct flow_class *fc, int k, uint64_t *t, int trace, int phase)
+{
+    const struct kind *kd = &kinds[k];
+    uint32_t target = uniform(PHASE_WRS_MIN, PHASE_WRS_MAX), posted = 0, wrs;
+    uint64_t start = *t, bytes;
+    int entry = fc->cls, truth = kd->truth >= 0 ? kd->truth : entry, cls = entry, found = 0, changes = 0;
+
+    while (posted < target) {
+        *t += gen_call(kd, truth, &wrs, &bytes);
+        int was = cls;
+        cls = flow_class_post(fc, *t, wrs, bytes, NS_MULT);
+        posted += wrs;
+        if (fc->decided && found && cls != was)
+            changes++;
+        if (!found && fc->decided && cls == truth) {
+            found = 1;
+            if (kd->truth >= 0) {
+                detect_wrs[k][detected[k]++] = posted;
+                detect_ns[k] += *t - start;
+            }
+        }
+        /* the WRs before detection count as misclassified */
+        if (kd->truth >= 0)
+            confusion[truth][cls] += wrs;
+    }
+
+    if (kd->truth < 0) {
+        CHECK(cls == entry && !changes, "trace %d phase %d (%s): class %d -> %d, %d changes", trace, phase,
+              kd->name, entry, cls, changes);
+        return cls;
+    }
+    CHECK(found, "trace %d phase %d (%s): never detected in %u WRs, classified %d", trace, phase, kd->name,
+          posted, cls);
+    CHECK(changes == 0, "trace %d phase %d (%s): class changed %d times after detection", trace, phase,
+          kd->name, changes);
+    return cls;
+}
+
+static int run_trace(int trace)
+{
+    struct flow_class fc;
+    uint64_t t = 1;
+    int phase, k, prev = -1;
+
+    flow_class_init(&fc, FLOW_CLASS_BW);
+    for (phase = 0; phase < PHASES; phase++) {
+        /* a band only holds a class the flow has for real, and never follows another band */
+        if (prev >= 0 && prev < GAP_BAND && uniform(0, 2) == 0)
+            k = prev == BW ? SIZE_BAND : GAP_BAND;
+        else
+            do k = uniform(LAT, BW); while (k == prev);
+        if (run_phase(&fc, k, &t, trace, phase) < 0)
+            return -1;
+        prev = k;
+    }
+    return 0;
+}
+
+/* ns per classified post call, as the driver does it on every post */
+static double post_cost(void)
+{
+    static volatile int cls __attribute__((unused));
+    struct flow_class fc;
+    uint64_t t0, t = 0;
+    double ns;
+    int i;
+
+    flow_class_init(&fc, FLOW_CLASS_BW);
+    t0 = now_ns();
+    for (i = 0; i < TIMED; i++) {
+        t += 300 + (i & 1023);
+        cls = flow_class_post(&fc, t, 1 + (i & 7), 64 + (i & 511), NS_MULT);
+    }
+    ns = (double)(now_ns() - t0) / TIMED;
+    return ns;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* sorts the detection times of kind k and checks their p99 against the bound */
+static int check_detect(int k, uint32_t *p99)
+{
+    qsort(detect_wrs[k], detected[k], sizeof(uint32_t), cmp_u32);
+    *p99 = detected[k] ? detect_wrs[k][detected[k] - 1 - detected[k] / 100] : 0;
+    CHECK(*p99 <= DETECT_BOUND(kinds[k].wrs_hi), "%s: p99 detection after %u WRs, bound %d", kinds[k].name,
+          *p99, DETECT_BOUND(kinds[k].wrs_hi));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *names[3] = { "bw", "lat", "tput" };
+    int traces = argc > 1 ? atoi(argv[1]) : 200;
+    unsigned seed = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+    uint64_t right = 0, all = 0, sum;
+    uint32_t p99[KINDS];
+    int i, j;
+
+    if (traces <= 0)
+        return 2;
+    for (i = LAT; i <= BW; i++)
+        if (!(detect_wrs[i] = malloc((size_t)traces * PHASES * sizeof(uint32_t))))
+            return 2;
+    srand(seed);
+
+    for (i = 0; i < traces; i++)
+        run_trace(i);
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++) {
+            all += confusion[i][j];
+            right += i == j ? confusion[i][j] : 0;
+        }
+    for (i = LAT; i <= BW; i++)
+        check_detect(i, &p99[i]);
+    if ((double)right < 0.9 * all) {
+        fprintf(stderr, "FAIL: accuracy %.3f below 0.9\n", (double)right / all);
+        failures++;
+    }
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("flow_class_test: %d traces of %d phases passed (seed %u)\n", traces, PHASES, seed);
+    printf("accuracy %.4f of %llu WRs; rows: truth, columns: classified as\n", (double)right / all,
+           (unsigned long long)all);
+    printf("%8s %10s %10s %10s\n", "", names[0], names[1], names[2]);
+    for (i = 0; i < 3; i++) {
+        uint64_t row = confusion[i][0] + confusion[i][1] + confusion[i][2];
+        printf("%8s", names[i]);
+        for (j = 0; j < 3; j++)
+            printf(" %9.4f%%", row ? 100.0 * confusion[i][j] / row : 0.0);
+        printf("\n");
+    }
+    for (i = LAT; i <= BW; i++) {
+        if (!detected[i])
+            continue;
+        for (sum = 0, j = 0; j < (int)detected[i]; j++)
+            sum += detect_wrs[i][j];
+        printf("detect %-4s: mean %.0f WRs / %.1f us, p99 %u, max %u WRs (bound %d)\n", kinds[i].name,
+               (double)sum / detected[i], (double)detect_ns[i] / detected[i] / 1000, p99[i],
+               detect_wrs[i][detected[i] - 1], DETECT_BOUND(kinds[i].wrs_hi));
+        free(detect_wrs[i]);
+    }
+    printf("post: %.1f ns/call\n", post_cost());
+    return 0;
+}
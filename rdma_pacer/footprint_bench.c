@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+
+/*
+ * CPU the pacer itself burns, threaded as it runs by default against on a single core (-s,
+ * runtime.h), without a NIC.
+ *
+ * The threaded pacer is modelled by its threads: generate_fetch_tokens spinning in rr_pick and
+ * between tokens, generate_tokens_read spinning on num_big_read_flows, rate_limit_read scanning
+ * the slots for READs, the monitor sleeping MONITOR_PERIOD_US and spinning on its probe, and the
+ * heartbeat. The single-core one runs the same work as the tasks of pacer -s on one thread: token
+ * and heartbeat timers, grants polled while flows wait and backed off when none has, the probe
+ * round on a timer, and the control socket as an fd a join writes to. A probe comes back
+ * PROBE_US after it went out. Flows join, then wait for a token over and over as the drivers do,
+ * but looking at pending every CLIENT_POLL_US so that they leave the cpus to the pacer.
+ * Runs go over idle (no flow joined), 1 flow and 64 flows. Per run: the cpu time of the pacer's
+ * threads over the run's wall time (cores busy; a spinning thread keeps one busy, as many as
+ * there are cpus at most), and grants per second. With vcap_MBps tokens of SMALL_CHUNK_SIZE are
+ * paced at that rate.
+ *
+ * usage: footprint_bench [ms_per_run] [vcap_MBps]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pacer.h"
+#include "get_clock.h"
+#include "runtime.h"
+
+#define MAX_FLOWS_BENCH     64
+#define PROBE_US            5           /* a probe's round trip */
+#define CLIENT_POLL_US      20
+#define COOP_IDLE_US        1000        /* as pacer -s */
+#define COOP_BACKOFF_US     10
+#define COOP_BACKOFF_MAX_US 100
+
+enum { THREADED, SINGLE_CORE, DESIGNS };
+static const char *design_name[DESIGNS] = { "threaded", "single core" };
+
+static struct shared_block *sb;
+static int stop;
+static int num_slots;
+static int joined;
+static uint16_t num_big_read_flows;
+static uint64_t tokens;
+static uint64_t heartbeat;
+static uint32_t vcap, tsc_khz;
+static int ctl[2];                      /* the control socket: a byte per join, leave or quit */
+
+static inline void cpu_relax(void)
+{
+    asm volatile("pause\n": : :"memory");
+}
+
+static double thread_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* what a pacer thread exits with: the cpu it took, in us */
+static void *done(void)
+{
+    return (void *)(uintptr_t)(thread_ms() * 1000);
+}
+
+static inline int stopped(void)
+{
+    return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+static inline void grant(int i)
+{
+    __atomic_store_n(&sb->flows[i].pending, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sb->stats[i].tokens, sb->stats[i].tokens + 1, __ATOMIC_RELAXED);
+}
+
+/* ---- threaded: the pacer's threads as they are ---- */
+
+/* generate_fetch_tokens: the next waiting slot round-robin, a token if there is one, the next
+ * token after the time a chunk takes at vcap */
+static void *th_tokens(void *arg)
+{
+    uint64_t start = get_cycles(), interval = vcap ? token_cycles(tsc_khz, SMALL_CHUNK_SIZE, vcap) : 0;
+    int i, next_idx = 0;
+
+    tokens = 1;
+    while (!stopped()) {
+        while ((i = rr_pick(&sb->flows[0].pending, &sb->flows[0].read, sizeof(struct flow_info),
+                            __atomic_load_n(&num_slots, __ATOMIC_RELAXED), next_idx)) < 0) {
+            if (stopped())
+                return done();
+            cpu_relax();
+        }
+        if (tokens) {
+            tokens--;
+            grant(i);
+            next_idx = (i + 1) % MAX_FLOWS;
+        } else {
+            next_idx = i;
+        }
+        if (tokens < MAX_TOKEN) {
+            while (get_cycles() - start < interval)
+                cpu_relax();
+            start = get_cycles();
+            tokens++;
+        }
+    }
+    return done();
+}
+
+/* generate_tokens_read with no big READ: it looks at num_big_read_flows and nothing else */
+static void *th_read_tokens(void *arg)
+{
+    while (!stopped())
+        if (__atomic_load_n(&num_big_read_flows, __ATOMIC_RELAXED))
+            break;
+    return done();
+}
+
+/* rate_limit_read: READs waiting, none of which there is here */
+static void *th_read(void *arg)
+{
+    int i;
+
+    while (!stopped())
+        for (i = 0; i < MAX_FLOWS; i++)
+            if (__atomic_load_n(&sb->flows[i].read, __ATOMIC_RELAXED) &&
+                __atomic_load_n(&sb->flows[i].pending, __ATOMIC_RELAXED))
+                grant(i);
+    return done();
+}
+
+/* monitor_latency: a round every MONITOR_PERIOD_US, spinning for the probe */
+static void *th_monitor(void *arg)
+{
+    uint64_t t0, rtt = (uint64_t)tsc_khz * PROBE_US / 1000;
+
+    while (!stopped()) {
+        usleep(MONITOR_PERIOD_US);
+        t0 = get_cycles();
+        while (get_cycles() - t0 < rtt)
+            cpu_relax();
+    }
+    return done();
+}
+
+static void *th_heartbeat(void *arg)
+{
+    while (!stopped()) {
+        __atomic_fetch_add(&heartbeat, 1, __ATOMIC_RELAXED);
+        usleep(HEARTBEAT_US);
+    }
+    return done();
+}
+
+/* the flow handler, asleep in epoll until a client writes */
+static void *th_ctl(void *arg)
+{
+    char c;
+
+    while (read(ctl[0], &c, 1) == 1 && c != 'q')
+        __atomic_fetch_add(&joined, c == 'j' ? 1 : -1, __ATOMIC_RELAXED);
+    return done();
+}
+
+/* ---- single core: the tasks of pacer -s ---- */
+
+static struct {
+    struct runtime rt;
+    struct rt_task tokens, grants, beat, probe, ctl;
+    uint64_t last, interval, idle_since, backoff, probe_at;
+    int next_idx;
+} co;
+
+static void co_grants_on(uint64_t now)
+{
+    if (co.grants.polled)
+        return;
+    rt_cancel(&co.rt, &co.grants);
+    rt_poll(&co.rt, &co.grants, 1);
+    co.idle_since = now;
+    co.backoff = 0;
+}
+
+static void co_kick(uint64_t now)
+{
+    if (!joined)
+        return;
+    if (!co.tokens.armed) {
+        co.last = now;
+        rt_at(&co.rt, &co.tokens, now);
+    }
+    if (!co.beat.armed)
+        rt_at(&co.rt, &co.beat, now);
+    if (!co.probe.armed && !co.probe.polled)
+        rt_at(&co.rt, &co.probe, now);
+    co_grants_on(now);
+}
+
+static void co_tokens(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    uint64_t n;
+
+    if (!joined)
+        return;
+    n = (now - co.last) / co.interval;
+    co.last += n * co.interval;
+    if (tokens + n >= MAX_TOKEN) {
+        tokens = MAX_TOKEN;
+        co.last = now;
+        co_grants_on(now);
+        return;
+    }
+    if (n) {
+        tokens += n;
+        co_grants_on(now);
+    }
+    rt_at(rt, t, co.last + co.interval);
+}
+
+static void co_grants(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    int i;
+
+    if (!joined) {
+        rt_poll(rt, t, 0);
+        return;
+    }
+    i = rr_pick(&sb->flows[0].pending, &sb->flows[0].read, sizeof(struct flow_info), num_slots, co.next_idx);
+    if (i >= 0) {
+        if (tokens) {
+            tokens--;
+            grant(i);
+            co.next_idx = (i + 1) % MAX_FLOWS;
+            if (!co.tokens.armed)
+                rt_at(rt, &co.tokens, now + co.interval);
+        } else {
+            co.next_idx = i;
+        }
+        if (tokens)
+            co_grants_on(now);
+        else
+            rt_poll(rt, t, 0);
+        co.idle_since = now;
+        co.backoff = 0;
+        return;
+    }
+    if (t->polled && now - co.idle_since < rt_cycles(rt, COOP_IDLE_US * 1000))
+        return;
+    rt_poll(rt, t, 0);
+    co.backoff = co.backoff ? co.backoff * 2 : rt_cycles(rt, COOP_BACKOFF_US * 1000);
+    if (co.backoff > rt_cycles(rt, COOP_BACKOFF_MAX_US * 1000))
+        co.backoff = rt_cycles(rt, COOP_BACKOFF_MAX_US * 1000);
+    rt_at(rt, t, now + co.backoff);
+}
+
+static void co_beat(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    __atomic_fetch_add(&heartbeat, 1, __ATOMIC_RELAXED);
+    if (joined)
+        rt_at(rt, t, now + rt_cycles(rt, HEARTBEAT_US * 1000));
+}
+
+static void co_probe(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    if (!t->polled) {
+        co.probe_at = now + rt_cycles(rt, PROBE_US * 1000);
+        rt_poll(rt, t, 1);
+    }
+    if (now < co.probe_at)
+        return;
+    rt_poll(rt, t, 0);
+    if (joined)
+        rt_at(rt, t, now + rt_cycles(rt, MONITOR_PERIOD_US * 1000));
+}
+
+static void co_ctl(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    char c;
+
+    while (read(ctl[0], &c, 1) == 1) {
+        if (c == 'q') {
+            rt->stop = 1;
+            return;
+        }
+        __atomic_fetch_add(&joined, c == 'j' ? 1 : -1, __ATOMIC_RELAXED);
+        if (c == 'j')
+            break;
+    }
+    co_kick(now);
+}
+
+static void *single_core(void *arg)
+{
+    if (rt_init(&co.rt, tsc_khz)) {
+        perror("rt_init");
+        exit(1);
+    }
+    co.tokens = (struct rt_task){ .run = co_tokens };
+    co.grants = (struct rt_task){ .run = co_grants };
+    co.beat = (struct rt_task){ .run = co_beat };
+    co.probe = (struct rt_task){ .run = co_probe };
+    co.ctl = (struct rt_task){ .run = co_ctl };
+    co.interval = vcap ? token_cycles(tsc_khz, SMALL_CHUNK_SIZE, vcap) : 1;
+    if (!co.interval)
+        co.interval = 1;
+    co.next_idx = 0;
+    tokens = 1;
+    if (rt_watch(&co.rt, &co.ctl, ctl[0])) {
+        perror("rt_watch");
+        exit(1);
+    }
+    rt_run(&co.rt);
+    rt_close(&co.rt);
+    return done();
+}
+
+/* ---- flows ---- */
+
+struct client {
+    pthread_t th;
+    int slot;
+    uint64_t grants;
+};
+
+/* joins, then waits for a token over and over, looking every CLIENT_POLL_US */
+static void *client(void *arg)
+{
+    struct client *c = arg;
+    struct flow_info *flow = &sb->flows[c->slot];
+
+    if (write(ctl[1], "j", 1) != 1)
+        perror("write");
+    while (!stopped()) {
+        __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&flow->pending, __ATOMIC_RELAXED)) {
+            if (stopped())
+                goto leave;
+            usleep(CLIENT_POLL_US);
+        }
+        c->grants++;
+    }
+leave:
+    __atomic_store_n(&flow->pending, 0, __ATOMIC_RELAXED);
+    if (write(ctl[1], "l", 1) != 1)
+        perror("write");
+    return NULL;
+}
+
+static void run(int design, int n, int ms)
+{
+    static void *(*const threads[])(void *) = { th_tokens, th_read_tokens, th_read, th_monitor, th_heartbeat,
+                                                th_ctl };
+    struct client c[MAX_FLOWS_BENCH];
+    pthread_t th[8];
+    int nth = design == THREADED ? (int)(sizeof(threads) / sizeof(threads[0])) : 1, i;
+    uint64_t grants = 0, t0, beats;
+    double cpu_us = 0, secs;
+    void *ret;
+
+    memset(sb->flows, 0, sizeof(sb->flows));
+    if (pipe(ctl)) {
+        perror("pipe");
+        exit(1);
+    }
+    stop = 0;
+    joined = 0;
+    num_slots = n;
+    beats = heartbeat;
+
+    t0 = get_cycles();
+    for (i = 0; i < nth; i++)
+        pthread_create(&th[i], NULL, design == THREADED ? threads[i] : single_core, NULL);
+    for (i = 0; i < n; i++) {
+        c[i].slot = i;
+        c[i].grants = 0;
+        pthread_create(&c[i].th, NULL, client, &c[i]);
+    }
+    usleep(ms * 1000);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < n; i++) {
+        pthread_join(c[i].th, NULL);
+        grants += c[i].grants;
+    }
+    if (write(ctl[1], "q", 1) != 1)
+        perror("write");
+    for (i = 0; i < nth; i++) {
+        pthread_join(th[i], &ret);
+        cpu_us += (uintptr_t)ret;
+    }
+    secs = (get_cycles() - t0) * 1.0 / tsc_khz / 1000;
+    close(ctl[0]);
+    close(ctl[1]);
+
+    printf("%-12s %3d flows  %5.2f cores busy  %9.0f grants/s  %6.0f beats/s", design_name[design], n,
+           cpu_us / 1e6 / secs, grants / secs, (heartbeat - beats) / secs);
+    if (design == SINGLE_CORE)
+        printf("  %lu sleeps", (unsigned long)co.rt.sleeps);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const int flows[] = { 0, 1, MAX_FLOWS_BENCH };
+    int ms = argc > 1 ? atoi(argv[1]) : 500;
+    const char *source = "";
+    int d, k, invariant;
+
+    vcap = argc > 2 ? atoi(argv[2]) : 10000;
+    if (ms < 1) {
+        fprintf(stderr, "usage: %s [ms_per_run] [vcap_MBps]\n", argv[0]);
+        return 1;
+    }
+    sb = mmap(NULL, sizeof(*sb), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sb == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (!(tsc_khz = get_tsc_khz(&invariant, &source))) {
+        fprintf(stderr, "no tsc rate\n");
+        return 1;
+    }
+    printf("%d cpus, tsc %u kHz (%s); tokens of %d B at %u MBps, a probe every %d us\n",
+           (int)sysconf(_SC_NPROCESSORS_ONLN), tsc_khz, source, SMALL_CHUNK_SIZE, vcap, MONITOR_PERIOD_US);
+
+    for (k = 0; k < (int)(sizeof(flows) / sizeof(flows[0])); k++)
+        for (d = 0; d < DESIGNS; d++)
+            run(d, flows[k], ms);
+    return 0;
+}
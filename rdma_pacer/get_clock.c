@@ -45,6 +45,11 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#if defined (__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #include "get_clock.h"
 
 #ifndef DEBUG
@@ -58,6 +63,10 @@
 #define USECSTEP 10
 #define USECSTART 100
 
+#define TSC_CALIB_MS 10
+#define TSC_CALIB_ROUNDS 3
+#define TSC_SYSFS_KHZ "/sys/devices/system/cpu/cpu0/tsc_freq_khz"
+
 /*
    Use linear regression to calculate cycles per microsecond.
 http://en.wikipedia.org/wiki/Linear_regression#Parameter_estimation
@@ -232,3 +241,78 @@ double get_cpu_mhz(int no_cpu_freq_warn)
 	return proc;
 #endif
 }
+
+/* the TSC against CLOCK_MONOTONIC_RAW over TSC_CALIB_MS; kHz, or 0 */
+static uint32_t sample_tsc_khz(void)
+{
+	struct timespec t0, t1;
+	cycles_t c0, c1;
+	uint64_t ns;
+
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &t0))
+		return 0;
+	c0 = get_cycles();
+	do {
+		c1 = get_cycles();
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &t1))
+			return 0;
+		ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	} while (ns < TSC_CALIB_MS * 1000000ULL);
+
+	return (c1 - c0) * 1000000ULL / ns;
+}
+
+/*
+ * The TSC's rate in kHz, once for the pacer to publish (struct tsc_clock); 0 if it cannot be had.
+ * The kernel's figure is preferred: tsc_freq_khz in sysfs where the kernel exports it, or the
+ * crystal ratio of cpuid leaf 0x15. Otherwise the TSC is timed, the median of TSC_CALIB_ROUNDS
+ * rounds. *invariant is set if cpuid says the TSC ticks at that rate in every P- and C-state;
+ * source names where the rate came from.
+ */
+uint32_t get_tsc_khz(int *invariant, const char **source)
+{
+	uint32_t khz = 0, k[TSC_CALIB_ROUNDS], t;
+	FILE *f;
+	int i, j;
+#if defined (__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+#endif
+
+	*invariant = 0;
+#if defined (__x86_64__) || defined(__i386__)
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		*invariant = !!(edx & (1 << 8));
+#endif
+
+	if ((f = fopen(TSC_SYSFS_KHZ, "r"))) {
+		if (fscanf(f, "%u", &khz) != 1)
+			khz = 0;
+		fclose(f);
+		if (khz) {
+			*source = "sysfs";
+			return khz;
+		}
+	}
+
+#if defined (__x86_64__) || defined(__i386__)
+	if (__get_cpuid_max(0, NULL) >= 0x15) {
+		__cpuid(0x15, eax, ebx, ecx, edx);
+		if (eax && ebx && ecx) {
+			*source = "cpuid";
+			return (uint64_t)ecx * ebx / eax / 1000;
+		}
+	}
+#endif
+
+	for (i = 0; i < TSC_CALIB_ROUNDS; i++) {
+		if (!(k[i] = sample_tsc_khz()))
+			return 0;
+		for (j = i; j > 0 && k[j - 1] > k[j]; j--) {
+			t = k[j];
+			k[j] = k[j - 1];
+			k[j - 1] = t;
+		}
+	}
+	*source = "timed";
+	return k[TSC_CALIB_ROUNDS / 2];
+}
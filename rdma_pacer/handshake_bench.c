@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+
+/*
+ * Cost of the pending handshake between the drivers and the pacer, without a NIC.
+ *
+ * A token generator runs the grant loop of generate_fetch_tokens (rr_pick and token_cycles of
+ * policy.h, MAX_TOKEN) over the flow slots of a struct shared_block, as the pacer lays it out;
+ * client threads, a slot each, wait for tokens as justitia_wait_token does: store pending, spin
+ * until the pacer clears it. A handshake is timed from the store to seeing the clear. Runs go
+ * over 1, 2, 4 ... clients and three placements: unpinned, the clients on the generator's socket,
+ * and on another socket (each client on a core of its own, skipped where there are too few).
+ * Per run: grants per second, handshake p50/p99/p99.9 and cache misses per grant, counted over
+ * all the threads with perf_event_open where the kernel lets it (else "-"). With vcap_MBps the
+ * generator paces tokens of SMALL_CHUNK_SIZE at that rate; 0 grants as fast as it can.
+ *
+ * usage: handshake_bench [max_clients] [ms_per_run] [vcap_MBps]
+ */
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "pacer.h"
+#include "get_clock.h"
+
+#define MAX_CLIENTS_BENCH   64
+#define SAMPLES             (1 << 18)   /* per client; later handshakes are counted, not timed */
+
+enum { PLACE_ANY, PLACE_SAME, PLACE_CROSS, PLACES };
+static const char *place_name[PLACES] = { "unpinned", "same socket", "cross socket" };
+
+static struct shared_block *sb;
+static int stop;
+static int clients;
+static uint32_t vcap;
+static uint32_t tsc_khz;
+static double cpu_mhz;
+
+struct client {
+    pthread_t th;
+    int slot, cpu;
+    uint64_t grants;
+    uint32_t *ns;                       /* handshakes timed */
+};
+
+static inline void cpu_relax(void)
+{
+    asm volatile("pause\n": : :"memory");
+}
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* the grant loop of generate_fetch_tokens: the next waiting slot round-robin, a token if there is
+ * one, else the next one after the time a chunk takes at vcap */
+static void *generator(void *arg)
+{
+    uint64_t start = get_cycles(), interval = vcap ? token_cycles(tsc_khz, SMALL_CHUNK_SIZE, vcap) : 0;
+    uint32_t tokens = 1;
+    int i, next_idx = 0;
+
+    pin((int)(intptr_t)arg);
+    while (1) {
+        while ((i = rr_pick(&sb->flows[0].pending, &sb->flows[0].read, sizeof(struct flow_info), clients,
+                            next_idx)) < 0) {
+            if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+                return NULL;
+            cpu_relax();
+        }
+        if (tokens || !vcap) {
+            tokens -= !!vcap;
+            __atomic_store_n(&sb->flows[i].pending, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&sb->stats[i].tokens, sb->stats[i].tokens + 1, __ATOMIC_RELAXED);
+            next_idx = (i + 1) % clients;
+            continue;
+        }
+        while (get_cycles() - start < interval)
+            cpu_relax();
+        start = get_cycles();
+        if (tokens < MAX_TOKEN)
+            tokens++;
+    }
+}
+
+/* justitia_wait_token, over and over */
+static void *client(void *arg)
+{
+    struct client *c = arg;
+    struct flow_info *flow = &sb->flows[c->slot];
+    uint64_t t0;
+
+    pin(c->cpu);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        t0 = get_cycles();
+        __atomic_store_n(&flow->pending, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&flow->pending, __ATOMIC_RELAXED)) {
+            if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+                return NULL;
+            cpu_relax();
+        }
+        if (c->grants < SAMPLES)
+            c->ns[c->grants] = (get_cycles() - t0) / cpu_mhz * 1000;
+        c->grants++;
+    }
+    return NULL;
+}
+
+/* hardware cache misses of this thread and those it starts from now on; -1 if not available */
+static int misses_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int by_value(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* cpus for the generator (cpus[0]) and n clients in placement p; 0, or -1 if there are too few */
+static int place(int p, int n, int *cpus)
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN), pkg0 = -1, pkg, cpu, k = 0;
+    char path[128];
+    FILE *f;
+
+    if (p == PLACE_ANY) {
+        for (k = 0; k <= n; k++)
+            cpus[k] = -1;
+        return 0;
+    }
+    for (cpu = 0; cpu < ncpu && k <= n; cpu++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        if (!(f = fopen(path, "r")))
+            continue;
+        if (fscanf(f, "%d", &pkg) != 1)
+            pkg = 0;
+        fclose(f);
+        if (pkg0 < 0) {
+            pkg0 = pkg;
+            cpus[k++] = cpu;
+        } else if ((p == PLACE_SAME) == (pkg == pkg0)) {
+            cpus[k++] = cpu;
+        }
+    }
+    return k == n + 1 ? 0 : -1;
+}
+
+static void run(int p, int n, int ms)
+{
+    uint32_t *all;
+    struct client c[MAX_CLIENTS_BENCH];
+    int cpus[MAX_CLIENTS_BENCH + 1], fd, i;
+    uint64_t grants = 0, timed = 0, t0, misses;
+    pthread_t gen;
+    double secs;
+
+    if (place(p, n, cpus)) {
+        printf("%-12s %3d clients  skipped: too few cpus\n", place_name[p], n);
+        return;
+    }
+    if (!(all = malloc((size_t)n * SAMPLES * sizeof(uint32_t)))) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(sb->flows, 0, sizeof(sb->flows));
+    clients = n;
+    stop = 0;
+    fd = misses_open();
+
+    t0 = get_cycles();
+    pthread_create(&gen, NULL, generator, (void *)(intptr_t)cpus[0]);
+    for (i = 0; i < n; i++) {
+        c[i].slot = i;
+        c[i].cpu = cpus[i + 1];
+        c[i].grants = 0;
+        c[i].ns = &all[(size_t)i * SAMPLES];
+        pthread_create(&c[i].th, NULL, client, &c[i]);
+    }
+    usleep(ms * 1000);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < n; i++)
+        pthread_join(c[i].th, NULL);
+    pthread_join(gen, NULL);
+    secs = (get_cycles() - t0) / cpu_mhz / 1e6;
+
+    /* the timed handshakes of all the clients, packed */
+    for (i = 0; i < n; i++) {
+        uint64_t k = c[i].grants < SAMPLES ? c[i].grants : SAMPLES;
+
+        memmove(&all[timed], c[i].ns, k * sizeof(uint32_t));
+        timed += k;
+        grants += c[i].grants;
+    }
+    qsort(all, timed, sizeof(uint32_t), by_value);
+
+    printf("%-12s %3d clients  %10.0f grants/s", place_name[p], n, grants / secs);
+    if (timed)
+        printf("  p50 %6u  p99 %6u  p99.9 %7u ns", all[timed / 2], all[timed * 99 / 100], all[timed * 999 / 1000]);
+    if (fd >= 0 && read(fd, &misses, sizeof(misses)) == sizeof(misses) && grants)
+        printf("  %6.2f misses/grant\n", (double)misses / grants);
+    else
+        printf("  - misses/grant\n");
+    if (fd >= 0)
+        close(fd);
+    free(all);
+}
+
+int main(int argc, char **argv)
+{
+    int max = argc > 1 ? atoi(argv[1]) : 8;
+    int ms = argc > 2 ? atoi(argv[2]) : 200;
+    const char *source = "";
+    int p, n, invariant;
+
+    vcap = argc > 3 ? atoi(argv[3]) : 0;
+    if (max < 1 || max > MAX_CLIENTS_BENCH || ms < 1) {
+        fprintf(stderr, "usage: %s [max_clients <= %d] [ms_per_run] [vcap_MBps]\n", argv[0], MAX_CLIENTS_BENCH);
+        return 1;
+    }
+    sb = mmap(NULL, sizeof(*sb), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sb == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (!(tsc_khz = get_tsc_khz(&invariant, &source))) {
+        fprintf(stderr, "no tsc rate\n");
+        return 1;
+    }
+    cpu_mhz = tsc_khz / 1000.0;
+    printf("shared block %zu B, flow slots %zu B apart; %d cpus, tsc %u kHz (%s), %s\n", sizeof(*sb),
+           sizeof(struct flow_info), (int)sysconf(_SC_NPROCESSORS_ONLN), tsc_khz, source,
+           vcap ? "paced" : "unpaced");
+    if (vcap)
+        printf("tokens of %d B at %u MBps: %.0f grants/s at most\n", SMALL_CHUNK_SIZE, vcap,
+               (double)vcap * 1e6 / SMALL_CHUNK_SIZE);
+
+    for (p = 0; p < PLACES; p++)
+        for (n = 1; n <= max; n *= 2)
+            run(p, n, ms);
+    return 0;
+}
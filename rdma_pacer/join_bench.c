@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+
+/*
+ * Registration cost of qps with the pacer, many threads at once.
+ *
+ * Every thread registers a qp the way the drivers do: it joins (and waits for its slot), tells
+ * its class as on its first post (app_bw), and leaves. Three setups are timed:
+ *
+ *   one-shot, serial   a connect per message, each after reading the hostname the socket path is
+ *                      made of, served one connection at a time with blocking recvs, as the
+ *                      pacer's flow handler did before
+ *   one-shot, epoll    the same clients against the control server of the pacer (ctl_server.c)
+ *   channel, epoll     one persistent channel per process (ctl_chan.h in the drivers), shared by
+ *                      its threads: a join is one round trip, app_* and leaves one send
+ *
+ * The fake pacer behind both servers hands out slots keyed by pid:tid:qpn like find_next_slot and
+ * counts the rest. Per setup: join and join+app latencies over the threads, and the wall time
+ * until the server had every leave. Every thread must get a slot of its own.
+ *
+ * usage: join_bench [threads]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctl_server.h"
+#include "../justitia/ctl_chan.h"
+
+#define MAX_THREADS     4096
+#define MSG_LEN         32              /* as in pacer.h */
+#define HOSTNAME_PATH   "/proc/sys/kernel/hostname"
+#define STACK_SIZE      (64 * 1024)
+
+enum { ONESHOT, CHANNEL };
+
+/* the fake pacer; only its server thread touches the slots */
+static struct {
+    pid_t pid[MAX_THREADS];
+    pid_t tid[MAX_THREADS];
+    uint32_t qpn[MAX_THREADS];
+    int used[MAX_THREADS];
+    uint64_t apps;
+    uint64_t leaves;
+} fake;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* find_next_slot: the slot of pid:tid:qpn, or the first free one */
+static int fake_join(pid_t pid, pid_t tid, uint32_t qpn)
+{
+    int i, free_slot = -1;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        if (fake.used[i] && fake.pid[i] == pid && fake.tid[i] == tid && fake.qpn[i] == qpn)
+            return i;
+        if (!fake.used[i] && free_slot < 0)
+            free_slot = i;
+    }
+    if (free_slot >= 0) {
+        fake.used[free_slot] = 1;
+        fake.pid[free_slot] = pid;
+        fake.tid[free_slot] = tid;
+        fake.qpn[free_slot] = qpn;
+    }
+    return free_slot;
+}
+
+static void fake_leave(pid_t pid, pid_t tid, uint32_t qpn)
+{
+    int i;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        if (fake.used[i] && fake.pid[i] == pid && fake.tid[i] == tid && fake.qpn[i] == qpn) {
+            fake.used[i] = 0;
+            break;
+        }
+    }
+    __atomic_fetch_add(&fake.leaves, 1, __ATOMIC_RELAXED);
+}
+
+/* handle_flow_msg of the pacer, without the verbs */
+static int fake_handle(struct ctl_conn *c, char *msg, void *arg)
+{
+    char ans[MSG_LEN + 1];
+    pid_t pid, tid;
+    uint32_t qpn = 0;
+    int len;
+
+    (void)arg;
+    if (c->state == 1) {
+        if (sscanf(msg, "%d:%d:%x", &pid, &tid, &qpn) < 2)
+            return CTL_CLOSE;
+        len = snprintf(ans, sizeof(ans), "%d", fake_join(pid, tid, qpn));
+        ctl_reply(c, ans, len);
+        return CTL_CLOSE;
+    }
+    if (c->lines && msg[0] == 'j' && msg[1] == ':') {
+        if (sscanf(msg + 2, "%d:%d:%x", &pid, &tid, &qpn) < 3)
+            return CTL_CLOSE;
+        len = snprintf(ans, sizeof(ans), "%d\n", fake_join(pid, tid, qpn));
+        return ctl_reply(c, ans, len) ? CTL_CLOSE : CTL_KEEP;
+    }
+    if (strncmp(msg, "join:", 5) == 0) {
+        memset(ans, 0, sizeof(ans));
+        sprintf(ans, "sender:%04x", 0);
+        if (ctl_reply(c, ans, MSG_LEN))
+            return CTL_CLOSE;
+        c->state = 1;
+        return CTL_KEEP;
+    }
+    if (msg[0] == 'l' && msg[1] == ':') {
+        if (sscanf(msg + 2, "%d:%d:%x", &pid, &tid, &qpn) >= 2)
+            fake_leave(pid, tid, qpn);
+    } else if (strncmp(msg, "app_", 4) == 0 || strncmp(msg, "exit_app_", 9) == 0) {
+        __atomic_fetch_add(&fake.apps, 1, __ATOMIC_RELAXED);
+    }
+    return c->lines ? CTL_KEEP : CTL_CLOSE;
+}
+
+static void *epoll_server(void *arg)
+{
+    ctl_server_run(arg);
+    return NULL;
+}
+
+/* the flow handler before: accept, then blocking recvs on that one client until it is done */
+static void *serial_server(void *arg)
+{
+    const char *path = arg;
+    struct sockaddr_un local;
+    struct ctl_conn c;
+    int s, n;
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return NULL;
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strncpy(local.sun_path, path, sizeof(local.sun_path) - 1);
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&local, sizeof(local)) || listen(s, 10)) {
+        perror("serial server");
+        exit(2);
+    }
+    while (1) {
+        memset(&c, 0, sizeof(c));
+        if ((c.fd = accept(s, NULL, NULL)) == -1)
+            continue;
+        while ((n = recv(c.fd, c.buf, MSG_LEN, 0)) > 0) {
+            c.buf[n] = '\0';
+            if (fake_handle(&c, c.buf, NULL) != CTL_KEEP)
+                break;
+        }
+        close(c.fd);
+    }
+    return NULL;
+}
+
+/* the socket path as get_sock_path made it for every message: from the hostname */
+static void read_sock_path(char *path, const char *base)
+{
+    char hostname[100];
+    FILE *fp = fopen(HOSTNAME_PATH, "r");
+
+    if (fp) {
+        if (!fgets(hostname, sizeof(hostname), fp))
+            hostname[0] = '\0';
+        fclose(fp);
+    }
+    strcpy(path, base);
+}
+
+/* the persistent channel of the process: justitia_ctl of the drivers */
+static int ctl_sock = -1;
+static pthread_mutex_t ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int chan_msg(const char *path, char *msg, int len, int reply)
+{
+    int s, ret = -1;
+
+    if (reply) {
+        pthread_mutex_lock(&ctl_lock);
+    } else if (pthread_mutex_trylock(&ctl_lock)) {
+        if ((s = ctl_open(path)) < 0)
+            return -1;
+        ret = ctl_send(s, msg, len);
+        close(s);
+        return ret;
+    }
+    if (ctl_sock < 0)
+        ctl_sock = ctl_open(path);
+    if (ctl_sock >= 0 && !ctl_send(ctl_sock, msg, len) &&
+        (!reply || ctl_recv_line(ctl_sock, msg, CTL_LINE_LEN) >= 0))
+        ret = 0;
+    pthread_mutex_unlock(&ctl_lock);
+    return ret;
+}
+
+/* one message on a connection of its own, as contact_pacer did */
+static int oneshot_msg(const char *base, const char *msg)
+{
+    char path[108];
+    int s, ret;
+
+    read_sock_path(path, base);
+    if ((s = ctl_dial(path)) < 0)
+        return -1;
+    ret = ctl_send(s, msg, strlen(msg));
+    close(s);
+    return ret;
+}
+
+static int oneshot_join(const char *base, pid_t tid, uint32_t qpn)
+{
+    char path[108], str[MSG_LEN + 1];
+    int s, len, slot = -1;
+
+    read_sock_path(path, base);
+    if ((s = ctl_dial(path)) < 0)
+        return -1;
+    len = snprintf(str, sizeof(str), "join:%016llx", 0ULL);
+    if (ctl_send(s, str, len) || recv(s, str, MSG_LEN, 0) <= 0)
+        goto out;
+    len = snprintf(str, sizeof(str), "%d:%d:%x", getpid(), tid, qpn);
+    if (ctl_send(s, str, len) || (len = recv(s, str, MSG_LEN, 0)) <= 0)
+        goto out;
+    str[len] = '\0';
+    slot = atoi(str);
+out:
+    close(s);
+    return slot;
+}
+
+struct client {
+    pthread_t th;
+    int mode;
+    const char *path;
+    uint32_t qpn;
+    int slot;
+    uint64_t join_ns;
+    uint64_t reg_ns;                    /* join + app_* */
+};
+
+static pthread_barrier_t start_barrier;
+
+static void *client_loop(void *arg)
+{
+    struct client *cl = arg;
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    char line[CTL_LINE_LEN];
+    uint64_t t0;
+    int len;
+
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_ns();
+    if (cl->mode == CHANNEL) {
+        len = snprintf(line, sizeof(line), "j:%d:%d:%x\n", getpid(), tid, cl->qpn);
+        cl->slot = chan_msg(cl->path, line, len, 1) ? -1 : atoi(line);
+        cl->join_ns = now_ns() - t0;
+        chan_msg(cl->path, "app_bw\n", 7, 0);
+    } else {
+        cl->slot = oneshot_join(cl->path, tid, cl->qpn);
+        cl->join_ns = now_ns() - t0;
+        oneshot_msg(cl->path, "app_bw");
+    }
+    cl->reg_ns = now_ns() - t0;
+
+    /* every qp holds its slot until all registered, so none is handed out twice */
+    pthread_barrier_wait(&start_barrier);
+
+    if (cl->mode == CHANNEL) {
+        len = snprintf(line, sizeof(line), "l:%d:%d:%x\n", getpid(), tid, cl->qpn);
+        chan_msg(cl->path, line, len, 0);
+    } else {
+        snprintf(line, sizeof(line), "l:%d:%d:%x", getpid(), tid, cl->qpn);
+        oneshot_msg(cl->path, line);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *what, uint64_t *ns, int n)
+{
+    qsort(ns, n, sizeof(*ns), cmp_u64);
+    printf("  %-10s p50 %9.2f us  p99 %9.2f us  max %9.2f us\n", what,
+           ns[n / 2] / 1000.0, ns[(int)(n * 0.99)] / 1000.0, ns[n - 1] / 1000.0);
+}
+
+static struct client clients[MAX_THREADS];
+static uint64_t join_ns[MAX_THREADS], reg_ns[MAX_THREADS];
+static int seen[MAX_THREADS];
+
+static int run(const char *name, int mode, const char *path, int n)
+{
+    uint64_t t0, leaves = __atomic_load_n(&fake.leaves, __ATOMIC_RELAXED), wall;
+    pthread_attr_t attr;
+    int i, ret = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STACK_SIZE);
+    pthread_barrier_init(&start_barrier, NULL, n + 1);
+    for (i = 0; i < n; i++) {
+        clients[i].mode = mode;
+        clients[i].path = path;
+        clients[i].qpn = i;
+        if (pthread_create(&clients[i].th, &attr, client_loop, &clients[i])) {
+            perror("pthread_create");
+            exit(2);
+        }
+    }
+    t0 = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < n; i++)
+        pthread_join(clients[i].th, NULL);
+    while (__atomic_load_n(&fake.leaves, __ATOMIC_RELAXED) - leaves < (uint64_t)n)
+        sched_yield();
+    wall = now_ns() - t0;
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < n; i++) {
+        join_ns[i] = clients[i].join_ns;
+        reg_ns[i] = clients[i].reg_ns;
+        if (clients[i].slot < 0 || seen[clients[i].slot]++) {
+            fprintf(stderr, "FAIL %s: thread %d got slot %d\n", name, i, clients[i].slot);
+            ret = -1;
+        }
+    }
+    printf("%s: %d threads, all left after %.2f ms\n", name, n, wall / 1e6);
+    report("join", join_ns, n);
+    report("join+app", reg_ns, n);
+    pthread_barrier_destroy(&start_barrier);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000;
+    char serial_path[108], epoll_path[108];
+    struct ctl_server srv;
+    pthread_t th;
+    int failures = 0;
+
+    if (n < 1 || n > MAX_THREADS)
+        return 2;
+    snprintf(serial_path, sizeof(serial_path), "/tmp/join_bench.%d.serial", getpid());
+    snprintf(epoll_path, sizeof(epoll_path), "/tmp/join_bench.%d.epoll", getpid());
+    if (ctl_server_open(&srv, epoll_path, fake_handle, NULL)) {
+        perror("ctl_server_open");
+        return 2;
+    }
+    if (pthread_create(&th, NULL, epoll_server, &srv) || pthread_create(&th, NULL, serial_server, serial_path)) {
+        perror("pthread_create");
+        return 2;
+    }
+    while (access(serial_path, F_OK))
+        usleep(100);
+
+    failures += run("one-shot, serial", ONESHOT, serial_path, n) < 0;
+    failures += run("one-shot, epoll", ONESHOT, epoll_path, n) < 0;
+    failures += run("channel, epoll", CHANNEL, epoll_path, n) < 0;
+
+    unlink(serial_path);
+    unlink(epoll_path);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+#ifndef LAT_HIST_H
+#define LAT_HIST_H
+
+#include <stdint.h>
+
+/* Completion latency histograms of the latency-sensitive qps, one per flow slot in the shared
+ * block. The driver owning a slot counts every send completion of its qp (post to poll, in ns)
+ * into it; nothing is ever reset, so the pacer works on the difference between two reads and
+ * neither side takes a lock. Buckets are 128ns wide below 1us and then 4 per power of two up to
+ * 2^24 ns (~16ms); the last one also holds everything slower. Kept free of verbs so it can be
+ * tested offline. The drivers' pacer.h carry their own copy of the layout and of the recording.
+ */
+
+#define LAT_HIST_BUCKETS        64
+#define LAT_HIST_LINEAR_SHIFT   7                                       /* 128ns buckets ... */
+#define LAT_HIST_LINEAR_NS      1024                                    /* ... below 1024ns */
+#define LAT_HIST_LINEAR         (LAT_HIST_LINEAR_NS >> LAT_HIST_LINEAR_SHIFT)
+#define LAT_HIST_SUB_BITS       2                                       /* 4 buckets per power of two */
+
+struct lat_hist {
+    uint32_t total;                         /* completions recorded; bumped after the bucket */
+    uint32_t count[LAT_HIST_BUCKETS];       /* completions per bucket; both wrap */
+};
+
+static inline unsigned lat_hist_bucket(uint64_t ns)
+{
+    unsigned e, b;
+
+    if (ns < LAT_HIST_LINEAR_NS)
+        return ns >> LAT_HIST_LINEAR_SHIFT;
+    e = 63 - __builtin_clzll(ns);
+    b = LAT_HIST_LINEAR + ((e - 10) << LAT_HIST_SUB_BITS) +
+        ((ns >> (e - LAT_HIST_SUB_BITS)) & ((1 << LAT_HIST_SUB_BITS) - 1));
+    return b < LAT_HIST_BUCKETS ? b : LAT_HIST_BUCKETS - 1;
+}
+
+/* smallest latency (ns) counted in bucket b; lat_hist_floor(LAT_HIST_BUCKETS) ends the last one */
+static inline uint64_t lat_hist_floor(unsigned b)
+{
+    unsigned e, sub;
+
+    if (b < LAT_HIST_LINEAR)
+        return (uint64_t)b << LAT_HIST_LINEAR_SHIFT;
+    e = 10 + ((b - LAT_HIST_LINEAR) >> LAT_HIST_SUB_BITS);
+    sub = (b - LAT_HIST_LINEAR) & ((1 << LAT_HIST_SUB_BITS) - 1);
+    return (uint64_t)((1 << LAT_HIST_SUB_BITS) + sub) << (e - LAT_HIST_SUB_BITS);
+}
+
+/* one completion; a slot has a single writer (its qp's send cq is polled under the cq lock) */
+static inline void lat_hist_record(struct lat_hist *h, uint64_t ns)
+{
+    uint32_t *c = &h->count[lat_hist_bucket(ns)];
+
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, __atomic_load_n(&h->total, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/* add what h counted since prev to win and make prev the current counters; returns the number
+ * of completions added. A slot whose total has not moved is skipped without reading its buckets.
+ */
+static inline uint32_t lat_hist_collect(const struct lat_hist *h, struct lat_hist *prev, uint32_t *win)
+{
+    uint32_t added = 0, c;
+    int i;
+
+    if (__atomic_load_n(&h->total, __ATOMIC_RELAXED) == prev->total)
+        return 0;
+    prev->total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        c = __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+        win[i] += c - prev->count[i];
+        added += c - prev->count[i];
+        prev->count[i] = c;
+    }
+    return added;
+}
+
+/* latency (ns) below which a fraction p of the n completions in win fall, interpolated
+ * linearly inside the bucket it lands in; 0 without completions
+ */
+static inline uint64_t lat_hist_percentile(const uint32_t *win, uint32_t n, double p)
+{
+    uint64_t rank, seen = 0, lo, hi;
+    int i;
+
+    if (!n)
+        return 0;
+    rank = n - (uint64_t)((1 - p) * n);     /* all but the slowest (1 - p) of them */
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        if (seen + win[i] >= rank)
+            break;
+        seen += win[i];
+    }
+    if (i == LAT_HIST_BUCKETS)      /* win and n disagree; report the top */
+        return lat_hist_floor(LAT_HIST_BUCKETS);
+    lo = lat_hist_floor(i);
+    hi = lat_hist_floor(i + 1);
+    return lo + (hi - lo) * (rank - seen) / win[i];
+}
+
+#endif
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+/*
+ * Test for the completion latency histograms the drivers keep per latency-sensitive qp and the
+ * pacer's monitor controls on (lat_hist.h).
+ *
+ * Every latency must land in the one bucket whose [floor, next floor) holds it, buckets must
+ * tile the range without gaps, and the top bucket must take everything slower. Random latency
+ * mixes (a body around a few us plus a slow tail) are recorded and collected across counter
+ * wraparound; the percentile read back must be within its bucket's width of the exact one.
+ * Last, the cost of recording one completion (the driver's tsc read, cycles to ns, bucket and
+ * counter stores) is measured and reported.
+ *
+ * usage: lat_hist_test [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lat_hist.h"
+
+#define SAMPLES     20000
+#define TIMED       10000000
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t rdtsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+#else
+    return now_ns();
+#endif
+}
+
+static int check_buckets(void)
+{
+    uint64_t top = lat_hist_floor(LAT_HIST_BUCKETS);
+    unsigned b;
+
+    CHECK(lat_hist_floor(0) == 0, "first bucket starts at %llu", (unsigned long long)lat_hist_floor(0));
+    for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+        uint64_t lo = lat_hist_floor(b), hi = lat_hist_floor(b + 1);
+
+        CHECK(lo < hi, "bucket %u is empty: [%llu, %llu)", b, (unsigned long long)lo, (unsigned long long)hi);
+        CHECK(lat_hist_bucket(lo) == b, "%llu in bucket %u, not %u", (unsigned long long)lo, lat_hist_bucket(lo), b);
+        CHECK(lat_hist_bucket(hi - 1) == b, "%llu in bucket %u, not %u", (unsigned long long)(hi - 1),
+              lat_hist_bucket(hi - 1), b);
+        /* no bucket wider than a quarter of where it starts, past the linear ones */
+        if (b >= LAT_HIST_LINEAR)
+            CHECK((hi - lo) * 4 <= lo, "bucket %u: [%llu, %llu) too wide", b, (unsigned long long)lo,
+                  (unsigned long long)hi);
+    }
+    CHECK(lat_hist_bucket(top) == LAT_HIST_BUCKETS - 1, "%llu past the top in bucket %u",
+          (unsigned long long)top, lat_hist_bucket(top));
+    CHECK(lat_hist_bucket(UINT64_MAX) == LAT_HIST_BUCKETS - 1, "UINT64_MAX in bucket %u", lat_hist_bucket(UINT64_MAX));
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* one random mix, recorded into a slot whose counters start near wrapping */
+static int run_mix(uint64_t *lat, double p)
+{
+    static struct lat_hist slot, prev;
+    uint32_t win[LAT_HIST_BUCKETS] = { 0 }, n = 0, start = UINT32_MAX - SAMPLES / 2;
+    uint64_t body = 1000 + rand() % 4000, spread = 1 + rand() % 2000, exact, got, lo, hi;
+    int tail_pct = rand() % 5, i, b;
+
+    for (b = 0; b < LAT_HIST_BUCKETS; b++)
+        slot.count[b] = start;
+    slot.total = start;
+    prev = slot;
+
+    for (i = 0; i < SAMPLES; i++) {
+        lat[i] = body + rand() % spread;
+        if (rand() % 100 < tail_pct)
+            lat[i] = 10000 + (uint64_t)rand() % 200000;     /* slow tail */
+        lat_hist_record(&slot, lat[i]);
+        /* the monitor collects while the driver records */
+        if (rand() % 1000 == 0)
+            n += lat_hist_collect(&slot, &prev, win);
+    }
+    n += lat_hist_collect(&slot, &prev, win);
+    CHECK(n == SAMPLES, "collected %u of %d completions", n, SAMPLES);
+    CHECK(lat_hist_collect(&slot, &prev, win) == 0, "collected twice");
+
+    qsort(lat, SAMPLES, sizeof(*lat), cmp_u64);
+    exact = lat[SAMPLES - (int)((1 - p) * SAMPLES) - 1];
+    got = lat_hist_percentile(win, n, p);
+    b = lat_hist_bucket(exact);
+    lo = lat_hist_floor(b);
+    hi = lat_hist_floor(b + 1);
+    CHECK(got >= lo && got <= hi, "p%.3f: %llu outside the bucket [%llu, %llu] of the exact %llu", p,
+          (unsigned long long)got, (unsigned long long)lo, (unsigned long long)hi, (unsigned long long)exact);
+    return 0;
+}
+
+/* ns per recorded completion as the driver does it on a send completion, and ns of its tsc read */
+static double record_cost(double *tsc_ns)
+{
+    static struct lat_hist slot;
+    static uint64_t post_cycles[256];
+    uint32_t mult = 65536 * 1000 / 2500;                    /* a 2.5GHz tsc */
+    uint64_t t0, sum = 0;
+    double ns;
+    int i;
+
+    for (i = 0; i < 256; i++)
+        post_cycles[i] = rdtsc() - (uint64_t)i * 997;
+    t0 = now_ns();
+    for (i = 0; i < TIMED; i++)
+        lat_hist_record(&slot, ((rdtsc() - post_cycles[i & 255]) * mult) >> 16);
+    ns = (double)(now_ns() - t0) / TIMED;
+
+    t0 = now_ns();
+    for (i = 0; i < TIMED; i++)
+        sum += rdtsc();
+    *tsc_ns = (double)(now_ns() - t0) / TIMED;
+    post_cycles[0] = sum;
+    return ns;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 200;
+    unsigned seed = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+    static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t *lat = malloc(SAMPLES * sizeof(*lat));
+
+    if (iters < 0 || !lat)
+        return 2;
+    srand(seed);
+
+    check_buckets();
+    for (int it = 0; it < iters; it++)
+        run_mix(lat, pcts[it % (sizeof(pcts) / sizeof(pcts[0]))]);
+    free(lat);
+
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("lat_hist_test: %d random mixes passed (seed %u)\n", iters, seed);
+    double tsc_ns, ns = record_cost(&tsc_ns);
+    printf("record: %.1f ns/completion, of which %.1f ns reading the tsc\n", ns, tsc_ns);
+    return 0;
+}
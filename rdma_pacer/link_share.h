@@ -0,0 +1,45 @@
+#ifndef LINK_SHARE_H
+#define LINK_SHARE_H
+
+#include <stdint.h>
+
+/* How a sender splits its elephants' virtual link (MBps): AIMD on the whole link against the
+ * reference flow's tail latency, then an equal cut per elephant between its own WRITEs and the
+ * READs remote requesters pull through it, of what the tput flows have not reserved.
+ * Kept free of verbs so it can be tested offline.
+ */
+
+/* one AIMD step: halve on a missed latency target (not below min_cap), otherwise +1 up to line_rate */
+static inline uint32_t link_cap_aimd(uint32_t link_cap, uint32_t min_cap, uint32_t line_rate, int target_missed)
+{
+    if (target_missed) {
+        link_cap >>= 1;
+        if (link_cap < min_cap)
+            link_cap = min_cap;
+    } else if (link_cap < line_rate) {
+        link_cap++;
+    }
+    return link_cap;
+}
+
+/* lowest the AIMD may take the link to: min_cap, the elephants' share, on top of the reserved
+ * MBps the tput flows among them were admitted with, so that reservations are kept and the
+ * elephants still share min_cap besides. Never above line_rate. */
+static inline uint32_t link_cap_floor(uint32_t min_cap, uint32_t reserved, uint32_t line_rate)
+{
+    uint64_t floor = (uint64_t)min_cap + reserved;
+
+    return floor < line_rate ? (uint32_t)floor : line_rate;
+}
+
+/* rate granted to the num_peer_reads big READs of one requester, out of num_all_reads remote
+ * READs sharing link_cap with num_local_big local elephants */
+static inline uint32_t read_rate_share(uint32_t link_cap, uint32_t num_local_big,
+                                       uint32_t num_peer_reads, uint32_t num_all_reads)
+{
+    if (!num_peer_reads)
+        return 0;
+    return (uint32_t)((uint64_t)link_cap * num_peer_reads / (num_local_big + num_all_reads));
+}
+
+#endif
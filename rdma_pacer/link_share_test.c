@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+
+/*
+ * Test for how a sender shares its elephants' virtual link between local WRITEs and the big
+ * READs remote requesters pull through it (link_share.h, as used by monitor_latency).
+ *
+ * Mixes of WRITE elephants, READ elephants from one or more receivers and latency-sensitive
+ * flows are run against a fluid model of the link: the reference flow misses its tail target
+ * whenever the elephants together are allowed more than the room the latency flows leave.
+ * For every step, READs and WRITEs must get an equal cut per elephant, the cuts must add up
+ * to the AIMD'd link, and the link must stay within [min cap, line rate]. With latency flows
+ * the link must settle under the latency room instead of running at line rate.
+ *
+ * usage: link_share_test [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "link_share.h"
+
+#define LINE_RATE   22500   /* MBps, as LINE_RATE_MB */
+#define RECEIVERS   4       /* as MAX_SERVERS */
+#define STEPS       20000
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+struct mix {
+    uint32_t writes;                /* local WRITE elephants */
+    uint32_t reads[RECEIVERS];      /* big READs of each receiver */
+    uint32_t lats;                  /* latency-sensitive flows at the receiver */
+    uint32_t room;                  /* MBps the elephants may take before the tail target is missed */
+};
+
+/* one mix through STEPS monitor iterations; returns 0 or -1 */
+static int run_mix(const struct mix *m)
+{
+    uint32_t all_reads = 0, link_cap = LINE_RATE, min_cap = 0;
+    uint32_t low = LINE_RATE, high = 0;
+
+    for (int i = 0; i < RECEIVERS; i++)
+        all_reads += m->reads[i];
+    if (m->writes + all_reads == 0)
+        return 0;
+
+    /* as monitor_latency with TREAT_L_AS_ONE and a single receiver */
+    if (m->lats) {
+        min_cap = (uint32_t)((double)(m->writes + all_reads) / (m->writes + 1 + all_reads) * LINE_RATE + 0.5);
+        if (min_cap > LINE_RATE)
+            min_cap = LINE_RATE;
+    }
+
+    for (int step = 0; step < STEPS; step++) {
+        uint32_t prev = link_cap, read_sum = 0, write_cap;
+
+        if (m->lats)
+            link_cap = link_cap_aimd(link_cap, min_cap, LINE_RATE, link_cap > m->room);
+        else
+            link_cap = LINE_RATE;
+
+        CHECK(link_cap <= LINE_RATE, "link cap %u above line rate", link_cap);
+        CHECK(link_cap >= min_cap, "link cap %u below min cap %u", link_cap, min_cap);
+        if (m->lats && prev > m->room && prev / 2 >= min_cap)
+            CHECK(link_cap == prev / 2, "missed target: %u did not halve to %u", prev, link_cap);
+
+        for (int i = 0; i < RECEIVERS; i++) {
+            uint32_t rate = read_rate_share(link_cap, m->writes, m->reads[i], all_reads);
+            uint64_t exact = (uint64_t)link_cap * m->reads[i];
+            uint64_t denom = m->writes + all_reads;
+
+            /* the receiver's READs get exactly their elephants' cut, rounded down */
+            CHECK((uint64_t)rate * denom <= exact && exact < ((uint64_t)rate + 1) * denom,
+                  "receiver %d: rate %u for %u of %u READs on %u", i, rate, m->reads[i], all_reads, link_cap);
+            read_sum += rate;
+        }
+        CHECK(read_sum <= link_cap, "READs %u take more than the link %u", read_sum, link_cap);
+        write_cap = link_cap - read_sum;
+
+        /* every WRITE elephant gets at least what a READ elephant gets */
+        if (m->writes && all_reads)
+            CHECK((uint64_t)write_cap * all_reads >= (uint64_t)read_sum * m->writes,
+                  "WRITEs %u for %u elephants starved by READs %u for %u", write_cap, m->writes, read_sum, all_reads);
+        if (!m->writes)
+            CHECK(write_cap < RECEIVERS, "READ-only link leaves %u unused", write_cap);
+
+        if (step >= STEPS / 2) {
+            if (link_cap < low)
+                low = link_cap;
+            if (link_cap > high)
+                high = link_cap;
+        }
+    }
+
+    if (m->lats) {
+        uint32_t floor = m->room / 2 > min_cap ? m->room / 2 : min_cap;
+        /* settled: oscillates between the halved room and just above it */
+        CHECK(high <= (m->room >= min_cap ? m->room + 1 : min_cap), "link settles at %u above room %u", high, m->room);
+        CHECK(low >= floor, "link settles at %u below %u", low, floor);
+    } else {
+        CHECK(low == LINE_RATE && high == LINE_RATE, "no latency flows but link at %u..%u", low, high);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 200;
+    unsigned seed = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+    static const struct mix fixed[] = {
+        { .writes = 2 },                                                    /* WRITE only */
+        { .reads = { 3 } },                                                 /* READ only */
+        { .writes = 2, .reads = { 2, 1 } },                                 /* READ vs WRITE */
+        { .writes = 1, .reads = { 1 }, .lats = 1, .room = 9000 },           /* READ vs WRITE vs latency */
+        { .reads = { 4 }, .lats = 2, .room = 3000 },                        /* READ vs latency */
+        { .writes = 4, .lats = 1, .room = 15000 },                          /* WRITE vs latency */
+        { .writes = 1, .reads = { 1, 1, 1 }, .lats = 1, .room = 100 },      /* room below the min cap */
+    };
+
+    if (iters < 0)
+        return 2;
+    srand(seed);
+
+    for (unsigned i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+        run_mix(&fixed[i]);
+
+    for (int it = 0; it < iters; it++) {
+        struct mix m = { 0 };
+
+        m.writes = rand() % 9;
+        for (int i = 0; i < RECEIVERS; i++)
+            m.reads[i] = rand() % 3 == 0 ? rand() % 5 : 0;
+        m.lats = rand() % 2 ? 1 + rand() % 4 : 0;
+        m.room = 1 + rand() % LINE_RATE;
+        run_mix(&m);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("link_share_test: %d random mixes passed (seed %u)\n", iters, seed);
+    return 0;
+}
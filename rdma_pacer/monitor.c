@@ -3,17 +3,18 @@
 #include "get_clock.h"
 #include "pacer.h"
 #include "countmin.h"
+#include "link_share.h"
+#include "policy.h"
+#include "trace.h"
 #include <inttypes.h>
 #include <math.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 
-#define TAIL 2
-
 #define EVENT_POLL 0    // use event-triggered polling (or busy polling) for reference flow
 #define CS_OFFSET 4     // context switch offset
-#define EWMA 0.5
 
 #define WIDTH 32768
 #define DEPTH 16
@@ -25,49 +26,148 @@
 
 CMH_type *cmh = NULL;
 
+/* the latency apps' own tail (policy.h), from the histograms their drivers keep in sb->lat_hist */
+static struct lat_hist app_tail_prev[MAX_FLOWS];
+static struct app_tail app_tail = { .prev = app_tail_prev, .tail_age = APP_TAIL_MAX_AGE + 1 };
+
 static inline void cpu_relax() __attribute__((always_inline));
 static inline void cpu_relax() {
     asm("nop");
 }
 
-// called by sender to monitor ref flow latency and so on
-void monitor_latency(void *arg) {
-    printf(">>>starting monitor_latency...\n");
-    struct monitor_param *params = (struct monitor_param *)arg;
-    assert(params->is_client);
+/* grant the big READs of a receiver a new rate; inline and unsignaled, so that the send cq
+ * only carries ref flow completions (the next ref flow WRITE retires it)
+ */
+static void send_read_rate(struct pingpong_context *ctx, uint32_t rate) {
+    char msg[BUF_SIZE];
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sge;
+
+    memset(msg, 0, BUF_SIZE);
+    snprintf(msg, BUF_SIZE, "RATE:%" PRIu32, rate);
+    sge.addr = (uintptr_t)msg;
+    sge.length = BUF_SIZE;
+    sge.lkey = ctx->send_mr->lkey;
+
+    memset(&wr, 0, sizeof wr);
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_INLINE;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        perror("ibv_post_send: remote read rate");
+    }
+}
 
-    double latency_target = TAIL;
-    if (EVENT_POLL) {
-        latency_target += CS_OFFSET;
+/* Tells the peer about one app arrival or exit the flow handler counted (notify_* in the control
+ * block), if there is one. Sent from the loop owning the qp, which is the only one polling its
+ * send cq, and waited for here, off the apps' path: an arrival and an exit that cancel out are
+ * never sent.
+ */
+static void send_app_update(struct pingpong_context *ctx, int is_client) {
+    char msg[BUF_SIZE];
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sge;
+    struct ibv_wc wc;
+    int32_t *notify, n;
+    int num_comp;
+
+    memset(msg, 0, BUF_SIZE);
+    if (is_client && (n = __atomic_load_n(&cb.notify_big, __ATOMIC_RELAXED))) {
+        notify = &cb.notify_big;
+        strcpy(msg, n > 0 ? "big_inc" : "big_dec");
+    } else if (is_client && (n = __atomic_load_n(&cb.notify_small, __ATOMIC_RELAXED))) {
+        notify = &cb.notify_small;
+        strcpy(msg, n > 0 ? "small_inc" : "small_dec");
+    } else if (!is_client && (n = __atomic_load_n(&cb.notify_read, __ATOMIC_RELAXED))) {
+        notify = &cb.notify_read;
+        strcpy(msg, n > 0 ? "read_inc" : "read_dec");
+    } else {
+        return;
+    }
+    sge.addr = (uintptr_t)msg;
+    sge.length = BUF_SIZE;
+    sge.lkey = ctx->send_mr->lkey;
+
+    memset(&wr, 0, sizeof wr);
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        perror("ibv_post_send: app update");
+        return;
     }
+    do {    // clean up the cq for SEND message
+        num_comp = ibv_poll_cq(ctx->send_cq, 1, &wc);
+    } while (num_comp == 0);
+    __atomic_fetch_sub(notify, n > 0 ? 1 : -1, __ATOMIC_RELAXED);
+    printf("sent %s to the %s\n", msg, is_client ? "receiver" : "responder");
+}
+
+/* The monitor's state: that of monitor_latency on a sender, or server_loop on a receiver, kept
+ * between its steps so that the single-core runtime (runtime.h) can run them one at a time.
+ */
+struct monitor {
+    struct monitor_param *params;
+    /* sender */
+    double latency_target;
     double measured_tail[MAX_SERVERS];
     double prev_measured_tail[MAX_SERVERS];
-    int i;
-    for (i = 0; i < MAX_SERVERS; i++) {
-        measured_tail[i] = 0;
-        prev_measured_tail[i] = 0;
+    cycles_t start_cycle[MAX_SERVERS];
+    uint64_t seq;
+    struct ibv_send_wr wr[MAX_SERVERS];
+    struct ibv_sge sge[MAX_SERVERS];
+    uint16_t num_remote_big_reads[MAX_SERVERS];     // big READs each receiver pulls through this sender
+    uint32_t link_cap;                              // AIMD'd for local elephants and remote big READs together
+    int reaped;                                     // probes of the round completed
+    /* receiver */
+    struct ibv_send_wr send_wr[MAX_CLIENTS];
+    struct ibv_sge send_sge[MAX_CLIENTS];
+    /*
+     * NOTE:
+     *   These counters are used only as non-negative application counts
+     *   (number of big/small apps per receiver) and are later exported
+     *   to senders via the "INFO:bbbb:ssss" monitor messages.
+     *   They must never wrap around when decremented below 0.
+     *   Use 32-bit types for safety and clamp on decrement.
+     */
+    uint32_t current_num_big_apps;      // bw or tput
+    uint32_t current_num_small_apps;    // lat
+    /* both */
+    struct ibv_recv_wr recv_wr[MAX_CLIENTS];
+    struct ibv_sge recv_sge[MAX_CLIENTS];
+};
+
+static void post_update_recv(struct pingpong_context *ctx, struct ibv_recv_wr *recv_wr, struct ibv_sge *recv_sge) {
+    struct ibv_recv_wr *bad_recv_wr;
+
+    /* UPDATE RECV WR */
+    memset(recv_wr, 0, sizeof *recv_wr);
+    recv_wr->num_sge = 1;
+    recv_wr->sg_list = recv_sge;
+
+    memset(recv_sge, 0, sizeof *recv_sge);
+    memset(ctx->recv_buf, 0, BUF_SIZE);
+    recv_sge->addr = (uintptr_t)ctx->recv_buf;
+    recv_sge->length = BUF_SIZE;
+    recv_sge->lkey = ctx->recv_mr->lkey;
+    if (ibv_post_recv(ctx->qp, recv_wr, &bad_recv_wr)) {
+        perror("ibv_post_recv: recv_wr");
     }
+}
 
-    int lat; // in nanoseconds
-    cycles_t start_cycle[MAX_SERVERS], end_cycle[MAX_SERVERS];
-    //cycles_t prev_start_cycle = 0;
-    // cycles_t cmh_start, cmh_end;
-    int no_cpu_freq_warn = 1;
-    double cpu_mhz = get_cpu_mhz(no_cpu_freq_warn);
-
-    uint64_t seq = 0;
+/* sets up the channels to the receivers of a sender: the probes and the updates they send */
+static void monitor_open_sender(struct monitor *m) {
+    struct monitor_param *params = m->params;
     struct pingpong_context *ctx = NULL;        // managed by each client
-    struct ibv_send_wr wr[MAX_SERVERS], *bad_wr[MAX_SERVERS];
-    struct ibv_recv_wr recv_wr[MAX_SERVERS], *bad_recv_wr[MAX_SERVERS];
-    struct ibv_sge sge[MAX_SERVERS], recv_sge[MAX_SERVERS];
-    struct ibv_wc wc[MAX_SERVERS], recv_wc[MAX_SERVERS];
-    //struct ibv_send_wr wr, send_wr, *bad_wr = NULL;
-    //struct ibv_sge sge, send_sge, recv_sge;
-    int num_comp;
-    int num_remote_big_reads = 0;
-    uint32_t temp;
-    //uint32_t received_read_rate;
-    //uint32_t new_remote_read_rate;
+    int i;
+
+    m->latency_target = TAIL;
+    if (EVENT_POLL) {
+        m->latency_target += CS_OFFSET;
+    }
+    m->link_cap = cb.line_rate;
 
     //ctx = init_monitor_chan(servername, isclient, gid_idx);
     for (i = 0; i < params->num_servers; i++) {
@@ -79,53 +179,77 @@ void monitor_latency(void *arg) {
 
         //cb.ctx = ctx;
         cb.ctx_per_server[i] = ctx;
-        cpu_mhz = get_cpu_mhz(no_cpu_freq_warn);
 
         /* REF FLOW WRITE WR */
-        memset(&wr[i], 0, sizeof wr[i]);
-        wr[i].opcode = IBV_WR_RDMA_WRITE;
-        wr[i].sg_list = &sge[i];
-        wr[i].num_sge = 1;
-        wr[i].send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
-        wr[i].wr_id = seq;
-        wr[i].wr.rdma.rkey = ctx->rem_dest->rkey;
-        wr[i].wr.rdma.remote_addr = ctx->rem_dest->vaddr;
-
-        sge[i].addr = (uintptr_t)ctx->write_buf;
-        sge[i].length = REF_FLOW_SIZE;
-        sge[i].lkey = ctx->write_mr->lkey;
+        memset(&m->wr[i], 0, sizeof m->wr[i]);
+        m->wr[i].opcode = IBV_WR_RDMA_WRITE;
+        m->wr[i].sg_list = &m->sge[i];
+        m->wr[i].num_sge = 1;
+        m->wr[i].send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
+        m->wr[i].wr_id = m->seq;
+        m->wr[i].wr.rdma.rkey = ctx->rem_dest->rkey;
+        m->wr[i].wr.rdma.remote_addr = ctx->rem_dest->vaddr;
+
+        m->sge[i].addr = (uintptr_t)ctx->write_buf;
+        m->sge[i].length = REF_FLOW_SIZE;
+        m->sge[i].lkey = ctx->write_mr->lkey;
+
+        post_update_recv(ctx, &m->recv_wr[i], &m->recv_sge[i]);
+    }
+
+    //cb.num_receiver_big_flows = 0;        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
+    //cb.num_receiver_small_flows = 0;      // small: lat
+    for (i = 0; i < params->num_servers; i++) {
+        cb.num_receiver_big_flows[i] = 0;        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
+        cb.num_receiver_small_flows[i] = 0;      // small: lat
+        m->num_remote_big_reads[i] = 0;
+    }
+}
+
+/* sets up the channels to the senders of a receiver: the updates they send and the INFO broadcast */
+static void monitor_open_receiver(struct monitor *m) {
+    struct monitor_param *params = m->params;
+    struct pingpong_context *ctx = NULL;
+    int i;
+
+    for (i = 0; i < params->num_clients; i++) {
+        ctx = init_monitor_chan(params);        // server will get stuck in socket listen()
+        if (!ctx) {
+            fprintf(stderr, "failed to allocate pingpong context. exiting monitor_latency\n");
+            exit(1);
+        }
+        cb.ctx_per_client[i] = ctx;
 
         /* UPDATE SEND WR */
-        /*
-        memset(&send_wr, 0, sizeof send_wr);
-        send_wr.opcode = IBV_WR_SEND;
-        send_wr.sg_list = &send_sge;
-        send_wr.num_sge = 1;
-        send_wr.send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
-
-        memset(&send_sge, 0, sizeof send_sge);
+        memset(&m->send_wr[i], 0, sizeof m->send_wr[i]);
+        m->send_wr[i].opcode = IBV_WR_SEND;
+        m->send_wr[i].sg_list = &m->send_sge[i];
+        m->send_wr[i].num_sge = 1;
+        m->send_wr[i].send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
+
+        memset(&m->send_sge[i], 0, sizeof m->send_sge[i]);
         memset((char *)ctx->send_buf, 0, BUF_SIZE);
-        send_sge.addr = (uintptr_t)ctx->send_buf;
+        m->send_sge[i].addr = (uintptr_t)ctx->send_buf;
         ////send_sge.addr = (uintptr_t)((char *)ctx->send_buf + BUF_SIZE);
-        send_sge.length = BUF_SIZE;
-        send_sge.lkey = ctx->send_mr->lkey;
-        */
-
-        /* UPDATE RECV WR */
-        memset(&recv_wr[i], 0, sizeof recv_wr[i]);
-        recv_wr[i].num_sge = 1;
-        recv_wr[i].sg_list = &recv_sge[i];
-
-        memset(&recv_sge[i], 0, sizeof recv_sge[i]);
-        memset(ctx->recv_buf, 0, BUF_SIZE);
-        recv_sge[i].addr = (uintptr_t)ctx->recv_buf;
-        recv_sge[i].length = BUF_SIZE;
-        recv_sge[i].lkey = ctx->recv_mr->lkey;
-        if (ibv_post_recv(ctx->qp, &recv_wr[i], &bad_recv_wr[i])) {
-            perror("ibv_post_recv: recv_wr");
-        }
+        m->send_sge[i].length = BUF_SIZE;
+        m->send_sge[i].lkey = ctx->send_mr->lkey;
+
+        post_update_recv(ctx, &m->recv_wr[i], &m->recv_sge[i]);
     }
+}
 
+struct monitor *monitor_open(struct monitor_param *params) {
+    struct monitor *m = calloc(1, sizeof(*m));
+
+    if (!m) {
+        fprintf(stderr, "failed to allocate the monitor. exiting\n");
+        exit(1);
+    }
+    m->params = params;
+    if (params->is_client)
+        monitor_open_sender(m);
+    else
+        monitor_open_receiver(m);
 
 #ifdef USE_CMH
     cmh = CMH_Init(WIDTH, DEPTH, U, GRAN, WINDOW_SIZE);
@@ -135,461 +259,419 @@ void monitor_latency(void *arg) {
         exit(1);
     }
 #endif
+    return m;
+}
 
-    /* monitor loop */
-    uint32_t min_virtual_link_cap = 0;
+/* an update from receiver i, if one came; -1 to stop monitoring */
+static int sender_recv(struct monitor *m, int i) {
+    struct pingpong_context *ctx = cb.ctx_per_server[i];
+    struct ibv_recv_wr *bad_recv_wr;
+    struct ibv_wc recv_wc;
+    int num_comp;
+
+    num_comp = ibv_poll_cq(ctx->recv_cq, 1, &recv_wc);
+    if (num_comp <= 0)
+        return 0;
+    if (recv_wc.status != IBV_WC_SUCCESS) {
+        if (recv_wc.status == IBV_WC_WR_FLUSH_ERR) {
+            fprintf(stderr, "monitor_latency: recv WC flushed (QP is closing); stop monitoring.\n");
+            return -1;
+        }
+        fprintf(stderr, "monitor_latency: bad recv_wc status: %u.%s\n",
+                recv_wc.status, ibv_wc_status_str(recv_wc.status));
+        return -1;
+    }
+    if (strncmp(ctx->recv_buf, "INFO:xxxx:xxxx", 5) == 0) {
+        sscanf(ctx->recv_buf, "INFO:%hu:%hu", &cb.num_receiver_big_flows[i], &cb.num_receiver_small_flows[i]);
+        printf("current receiver[%d] num big apps: %" PRIu32 "\n", i, cb.num_receiver_big_flows[i]);
+        printf("current receiver[%d] num small apps: %" PRIu32 "\n", i, cb.num_receiver_small_flows[i]);
+    } else if (strcmp(ctx->recv_buf, "read_inc") == 0) {
+        m->num_remote_big_reads[i]++;
+        printf("receive new big read flow registration from receiver[%d]\n", i);
+    } else if (strcmp(ctx->recv_buf, "read_dec") == 0) {
+        if (m->num_remote_big_reads[i] > 0)
+            m->num_remote_big_reads[i]--;
+        printf("receive big read flow deregistration from receiver[%d]\n", i);
+    } else {
+        printf("Unrecognized reciever info format. Exit");
+        exit(1);
+    }
+
+    if (ibv_post_recv(ctx->qp, &m->recv_wr[i], &bad_recv_wr)) {
+        perror("ibv_post_recv: recv_wr");
+    }
+    return 0;
+}
+
+int monitor_round(struct monitor *m) {
+    struct monitor_param *params = m->params;
+    struct pingpong_context *ctx;
+    struct ibv_send_wr *bad_wr;
+    int i;
+
+    send_app_update(cb.ctx_per_server[0], 1);     // Hack for now: a single receiver hears of the apps
+
+    for (i = 0; i < params->num_servers; i++) {
+        //// check for receiver-side updates
+        ctx = cb.ctx_per_server[i];
+        if (sender_recv(m, i))
+            return -1;
+        //// end of receiving receiver-side updates
+
+        // send the ref flow to each server (receiver)
+        m->start_cycle[i] = get_cycles();
+        if (ibv_post_send(ctx->qp, &m->wr[i], &bad_wr)) {
+            perror("ibv_post_send");
+            break;
+        }
+    }
+    m->reaped = 0;
+    return 0;
+}
+
+/* one AIMD step of the virtual link on the tails of the round */
+static void monitor_adjust(struct monitor *m) {
+    struct monitor_param *params = m->params;
+    struct link_view view;
+    uint32_t reserved;                              // MBps admitted to tput flows; the AIMD never cuts below it
     uint16_t num_local_big_flows = 0;
     uint16_t num_local_bw_flows = 0;
     uint16_t num_local_small_flows = 0;
-    //cb.num_receiver_big_flows = 0;        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
-    //cb.num_receiver_small_flows = 0;      // small: lat
+    uint16_t num_all_remote_reads;
+    uint32_t read_rate, all_read_rate;
+    double app_tail_us;
+    int target_missed, i;
+
+    /* AIMD on the ref flow, the latency apps' own tail, or a blend of both (each against its target) */
+    if (APP_TAIL_WEIGHT > 0 && app_tail_update(&app_tail, cb.sb->lat_hist, MAX_FLOWS, &app_tail_us)) {
+        target_missed = tail_target_missed(m->measured_tail[0], m->latency_target, 1, app_tail_us);
+        __atomic_store_n(&cb.sb->tail_app_ns, (uint32_t)(app_tail_us * 1000), __ATOMIC_RELAXED);
+    } else {
+        target_missed = tail_target_missed(m->measured_tail[0], m->latency_target, 0, 0);      //HACK
+        __atomic_store_n(&cb.sb->tail_app_ns, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&cb.sb->tail_ref_ns, (uint32_t)(m->measured_tail[0] * 1000), __ATOMIC_RELAXED);
+
+    //num_active_big_flows = __atomic_load_n(&cb.sb->num_active_big_flows, __ATOMIC_RELAXED);
+    //num_active_small_flows = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED);
+    //num_active_bw_flows = __atomic_load_n(&cb.sb->num_active_bw_flows, __ATOMIC_RELAXED);
+
+    num_local_big_flows = __atomic_load_n(&cb.sb->num_active_big_flows, __ATOMIC_RELAXED);
+    num_local_small_flows = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED);
+    num_local_bw_flows = __atomic_load_n(&cb.sb->num_active_bw_flows, __ATOMIC_RELAXED);
+
+#ifdef HACK_APP_NUMS
+    num_local_big_flows = HACK_NUM_BW_APP;
+    num_local_small_flows = HACK_NUM_LAT_APP;
+    num_local_bw_flows = HACK_NUM_BW_APP;
+    cb.num_receiver_big_flows[0] = HACK_NUM_BW_APP;
+    cb.num_receiver_small_flows[0] = HACK_NUM_LAT_APP;
+#endif
+
+    reserved = __atomic_load_n(&cb.reserved_mb, __ATOMIC_RELAXED);
+    num_all_remote_reads = 0;
     for (i = 0; i < params->num_servers; i++) {
-        cb.num_receiver_big_flows[i] = 0;        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
-        cb.num_receiver_small_flows[i] = 0;      // small: lat
+        num_all_remote_reads += m->num_remote_big_reads[i];
     }
-    //TODO: consider a more general case (multi-sender + multi-receiver) when calculating local rate
-    // For now, assume 'multi-sender' or 'multi-receiver' case won't appear simultaneously
-    void *ev_ctx[MAX_SERVERS];
-    while (1) {
-        usleep(200);
 
+    if (num_local_big_flows + num_all_remote_reads)
+    {
+        view.local_big = num_local_big_flows;
+        view.local_small = num_local_small_flows;
+        view.local_bw = num_local_bw_flows;
+        view.remote_reads = num_all_remote_reads;
+        view.receiver_big = cb.num_receiver_big_flows[0];      // assume a single receiver
+        view.receiver_small = cb.num_receiver_small_flows[0];
+        view.reserved = reserved;
+        m->link_cap = link_cap_step(m->link_cap, &view, cb.line_rate, target_missed);
+
+        /* remote big READs get their cut of the unreserved link; local elephants keep the rest */
+        all_read_rate = 0;
         for (i = 0; i < params->num_servers; i++) {
-            //// check for receiver-side updates
-            ctx = cb.ctx_per_server[i];
-
-            num_comp = ibv_poll_cq(ctx->recv_cq, 1, &recv_wc[i]);
-            if (num_comp > 0) {
-                if (recv_wc[i].status != IBV_WC_SUCCESS) {
-                    if (recv_wc[i].status == IBV_WC_WR_FLUSH_ERR) {
-                        fprintf(stderr, "monitor_latency: recv WC flushed (QP is closing); stop monitoring.\n");
-                        return;
-                    }
-                    fprintf(stderr, "monitor_latency: bad recv_wc status: %u.%s\n",
-                            recv_wc[i].status, ibv_wc_status_str(recv_wc[i].status));
-                    return;
-                }
-                if (strncmp(ctx->recv_buf, "INFO:xxxx:xxxx", 5) == 0) {
-                    sscanf(ctx->recv_buf, "INFO:%hu:%hu", &cb.num_receiver_big_flows[i], &cb.num_receiver_small_flows[i]);
-                } else {
-                    printf("Unrecognized reciever info format. Exit");
-                    exit(1);
-                }
-                printf("current receiver[%d] num big apps: %" PRIu32 "\n", i, cb.num_receiver_big_flows[i]);
-                printf("current receiver[%d] num small apps: %" PRIu32 "\n", i, cb.num_receiver_small_flows[i]);
-
-                if (ibv_post_recv(ctx->qp, &recv_wr[i], &bad_recv_wr[i])) {
-                    perror("ibv_post_recv: recv_wr");
-                }
-            }
-            //// end of receiving receiver-side updates
-
-            // send the ref flow to each server (receiver)
-            start_cycle[i] = get_cycles();
-            if (ibv_post_send(ctx->qp, &wr[i], &bad_wr[i])) {
-                perror("ibv_post_send");
-                break;
+            read_rate = read_rate_share(m->link_cap > reserved ? m->link_cap - reserved : 0, num_local_big_flows,
+                                        m->num_remote_big_reads[i], num_all_remote_reads);
+            if (read_rate && read_rate != cb.remote_read_rate[i]) {
+                printf("new remote read rate for receiver[%d]: %" PRIu32 "\n", i, read_rate);
+                send_read_rate(cb.ctx_per_server[i], read_rate);
             }
+            cb.remote_read_rate[i] = read_rate;
+            all_read_rate += read_rate;
         }
+        if (m->link_cap - all_read_rate != __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED))
+            trace(TRACE_AIMD, target_missed, m->link_cap - all_read_rate);
+        __atomic_store_n(&cb.sb->virtual_link_cap, m->link_cap - all_read_rate, __ATOMIC_RELAXED);
+        //printf(">>>> virtual link cap: %" PRIu32 "\n", __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED));
+    }
+}
 
-        // poll wc for ref flow to measure latency
-        for (i = 0; i < params->num_servers; i++) {
-            ctx = cb.ctx_per_server[i];
-            if (EVENT_POLL) {   // not in active use; not necessary
-                if (ibv_get_cq_event(ctx->send_channel, &ctx->send_cq, &ev_ctx[i])) {
-                    fprintf(stderr, "Failed to get CQ event.\n");
-                    break;
-                }
-
-                ibv_ack_cq_events(ctx->send_cq, 1);
-
-                if (ibv_req_notify_cq(ctx->send_cq, 0)) {
-                    fprintf(stderr, "Couldn't request CQ notification\n");
-                    break;
-                }
+int monitor_reap(struct monitor *m, int wait) {
+    struct monitor_param *params = m->params;
+    struct pingpong_context *ctx;
+    struct ibv_wc wc;
+    void *ev_ctx;
+    int lat; // in nanoseconds
+    int num_comp;
+
+    // poll wc for ref flow to measure latency
+    for (; m->reaped < params->num_servers; m->reaped++) {
+        ctx = cb.ctx_per_server[m->reaped];
+        if (EVENT_POLL && wait) {   // not in active use; not necessary
+            if (ibv_get_cq_event(ctx->send_channel, &ctx->send_cq, &ev_ctx)) {
+                fprintf(stderr, "Failed to get CQ event.\n");
+                break;
             }
 
-            do {
-                num_comp = ibv_poll_cq(ctx->send_cq, 1, &wc[i]);
-            } while (num_comp == 0);
+            ibv_ack_cq_events(ctx->send_cq, 1);
 
-            if (num_comp < 0 || wc[i].status != IBV_WC_SUCCESS) {
-                if (num_comp < 0) {
-                    fprintf(stderr, "monitor_latency: ibv_poll_cq(send_cq) failed: errno=%d (%s)\n",
-                            errno, strerror(errno));
-                    return;
-                }
-                if (wc[i].status == IBV_WC_WR_FLUSH_ERR) {
-                    fprintf(stderr, "monitor_latency: send WC flushed (QP is closing); stop monitoring.\n");
-                    return;
-                }
-                fprintf(stderr, "monitor_latency: bad send wc status: %u.%s\n",
-                        wc[i].status, ibv_wc_status_str(wc[i].status));
-                return;
+            if (ibv_req_notify_cq(ctx->send_cq, 0)) {
+                fprintf(stderr, "Couldn't request CQ notification\n");
+                break;
             }
+        }
 
-            end_cycle[i] = get_cycles();
+        do {
+            num_comp = ibv_poll_cq(ctx->send_cq, 1, &wc);
+        } while (num_comp == 0 && wait);
+        if (num_comp == 0)
+            return 0;
 
+        if (num_comp < 0 || wc.status != IBV_WC_SUCCESS) {
+            if (num_comp < 0) {
+                fprintf(stderr, "monitor_latency: ibv_poll_cq(send_cq) failed: errno=%d (%s)\n",
+                        errno, strerror(errno));
+                return -1;
+            }
+            if (wc.status == IBV_WC_WR_FLUSH_ERR) {
+                fprintf(stderr, "monitor_latency: send WC flushed (QP is closing); stop monitoring.\n");
+                return -1;
+            }
+            fprintf(stderr, "monitor_latency: bad send wc status: %u.%s\n",
+                    wc.status, ibv_wc_status_str(wc.status));
+            return -1;
+        }
 
+        lat = tsc_ns(&cb.sb->tsc, get_cycles() - m->start_cycle[m->reaped]);
+        trace(TRACE_PROBE, m->reaped, lat);
 #ifdef USE_CMH
-            lat = round((end_cycle - start_cycle) / cpu_mhz * 1000);
-            if (CMH_Update(cmh, lat)) {
-                fprintf(stderr, "CMH_Update failed\n");
-                break;
-            }
+        if (CMH_Update(cmh, lat)) {
+            fprintf(stderr, "CMH_Update failed\n");
+            break;
+        }
 
-            //cmh_start = get_cycles();
-            measured_tail[i] = round(CMH_Quantile(cmh, CMH_PERCENTILE)/100.0)/10;
+        //cmh_start = get_cycles();
+        m->measured_tail[m->reaped] = round(CMH_Quantile(cmh, CMH_PERCENTILE)/100.0)/10;
 
-            ////tail_99 = (double)lat / 1000;
+        ////tail_99 = (double)lat / 1000;
 
-            //printf("measured_tail = %.1f \n", measured_tail[i]);
-            //cmh_end = get_cycles();
-            //printf("CMH_Quantile 99th takes %.2f us\n", (cmh_end - cmh_start)/cpu_mhz);
-            // if (prev_start_cycle)
-            //     printf("time between two sends %.2f us", (start_cycle - prev_start_cycle)/cpu_mhz);
-            // prev_start_cycle = start_cycle;
-            // printf("median %.1f us 99th %.1f us\n", median, tail_99);
+        //printf("measured_tail = %.1f \n", measured_tail[i]);
+        //cmh_end = get_cycles();
+        //printf("CMH_Quantile 99th takes %.2f us\n", (cmh_end - cmh_start)/cpu_mhz);
 #else
-            lat = (end_cycle[i] - start_cycle[i]) / cpu_mhz * 1000;
-            measured_tail[i] = (double)lat / 1000;
-            measured_tail[i] = EWMA * measured_tail[i] + (1 - EWMA) * prev_measured_tail[i];
-            prev_measured_tail[i] = measured_tail[i];
-            //printf("measured_tail[i] = %.1f \n", measured_tail[i]);
+        m->measured_tail[m->reaped] = ref_tail_update(m->prev_measured_tail[m->reaped], (double)lat / 1000);
+        m->prev_measured_tail[m->reaped] = m->measured_tail[m->reaped];
+        //printf("measured_tail[i] = %.1f \n", measured_tail[i]);
 #endif
-            seq++;
-            wr[i].wr_id = seq;
+        m->seq++;
+        m->wr[m->reaped].wr_id = m->seq;
+    }
 
-        }
+    monitor_adjust(m);
+    return 1;
+}
 
-        //TODO: fix READ impl later
-        /* check if any remote read is registered or if read rate is received */
-        /*
-        num_comp = ibv_poll_cq(ctx->cq_recv, 1, &recv_wc);
-        if (num_comp == 1) {
-            if (recv_wc.status != IBV_WC_SUCCESS) {
-                fprintf(stderr, "error bad recv_wc status: %u.%s\n", recv_wc.status, ibv_wc_status_str(recv_wc.status));
-                break;
-            }
-            if (strcmp(ctx->remote_read_buf, "read") == 0) {
-                printf("receive new big read flow registration\n");
-                num_remote_big_reads++;
-            } else if (strcmp(ctx->remote_read_buf, "exit") == 0) {
-                printf("receive big read flow deregistration\n");
-                num_remote_big_reads--;
-            } else {
-                received_read_rate = (uint32_t)strtol((const char *)ctx->remote_read_buf, NULL, 10);
-                printf("receive new big read rate %" PRIu32 "\n", received_read_rate);
-                __atomic_store_n(&cb.local_read_rate, received_read_rate, __ATOMIC_RELAXED);
-            }
-            if (ibv_post_recv(ctx->qp_read, &recv_wr, &bad_recv_wr))
-                perror("ibv_post_recv: recv_wr");
-        } else if (num_comp < 0) {
-            perror("ibv_poll_cq: recv_wc");
+// called by sender to monitor ref flow latency and so on
+void monitor_latency(void *arg) {
+    printf(">>>starting monitor_latency...\n");
+    trace_thread(TRACE_RING_MONITOR);
+    struct monitor_param *params = (struct monitor_param *)arg;
+    assert(params->is_client);
+    struct monitor *m = monitor_open(params);
+
+    /* monitor loop */
+    //TODO: consider a more general case (multi-sender + multi-receiver) when calculating local rate
+    // For now, assume 'multi-sender' or 'multi-receiver' case won't appear simultaneously
+    while (1) {
+        usleep(MONITOR_PERIOD_US);
+        if (monitor_round(m) || monitor_reap(m, 1) < 0)
             break;
+    }
+    printf("Out of while loop. exiting...\n");
+
+#ifdef USE_CMH
+    CMH_Destroy(cmh);
+#endif
+
+    return;
+}
+
+/* an update from sender i, if one came, broadcast to all of them; -1 to stop */
+static int receiver_recv(struct monitor *m, int i) {
+    struct monitor_param *params = m->params;
+    struct pingpong_context *ctx = cb.ctx_per_client[i];
+    struct ibv_send_wr *bad_send_wr;
+    struct ibv_recv_wr *bad_recv_wr;
+    struct ibv_wc recv_wc, send_wc;
+    int num_comp, j;
+
+    num_comp = ibv_poll_cq(ctx->recv_cq, 1, &recv_wc);
+    if (num_comp > 0) {     // found an update; actually num_comp should be either 0 or 1 given we set 'num_entires'=1 in ibv_poll_cq
+        if (recv_wc.status != IBV_WC_SUCCESS) {
+            if (recv_wc.status == IBV_WC_WR_FLUSH_ERR) {
+                fprintf(stderr, "server_loop: recv WC flushed (peer disconnected); stop server loop.\n");
+                return -1;
+            }
+            fprintf(stderr, "server_loop: bad recv_wc status: %u.%s\n",
+                    recv_wc.status, ibv_wc_status_str(recv_wc.status));
+            return -1;
         }
-        */
 
+        //remote_receiver_fan_in = (uint32_t)strtol((const char *)ctx->update_recv_buf, NULL, 10);
+        if (strncmp(ctx->recv_buf, "RATE:", 5) == 0) {
+            /* a responder granted our big READs a share of its virtual link; nothing to broadcast */
+            uint32_t read_rate = (uint32_t)strtoul((const char *)ctx->recv_buf + 5, NULL, 10);
+            printf("receive new big read rate %" PRIu32 " from client[%d]\n", read_rate, i);
+            __atomic_store_n(&cb.local_read_rate, read_rate, __ATOMIC_RELAXED);
+            if (ibv_post_recv(ctx->qp, &m->recv_wr[i], &bad_recv_wr)) {
+                perror("ibv_post_recv: recv_wr");
+            }
+            return 0;
+        } else if (strcmp(ctx->recv_buf, "big_inc") == 0) {
+            m->current_num_big_apps++;
+        } else if (strcmp(ctx->recv_buf, "small_inc") == 0) {
+            m->current_num_small_apps++;
+        } else if (strcmp(ctx->recv_buf, "big_dec") == 0) {
+            /*
+             * Guard against underflow: protocol bugs or duplicate
+             * exit notifications must not make the counter wrap to
+             * 2^N-1 and break fairness logic.
+             */
+            if (m->current_num_big_apps > 0)
+                m->current_num_big_apps--;
+        } else if (strcmp(ctx->recv_buf, "small_dec") == 0) {
+            if (m->current_num_small_apps > 0)
+                m->current_num_small_apps--;
+        } else {
+            printf("Unrecognized receiver-update msg. exit\n");
+            exit(1);
+        }
 
+        printf("current receiver num big apps: %" PRIu32 "\n", m->current_num_big_apps);
+        printf("current receiver num small apps: %" PRIu32 "\n", m->current_num_small_apps);
 
-        //num_active_big_flows = __atomic_load_n(&cb.sb->num_active_big_flows, __ATOMIC_RELAXED);
-        //num_active_small_flows = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED);
-        //num_active_bw_flows = __atomic_load_n(&cb.sb->num_active_bw_flows, __ATOMIC_RELAXED);
+        if (ibv_post_recv(ctx->qp, &m->recv_wr[i], &bad_recv_wr)) {
+            perror("ibv_post_recv: recv_wr");
+        }
 
-        num_local_big_flows = __atomic_load_n(&cb.sb->num_active_big_flows, __ATOMIC_RELAXED);
-        num_local_small_flows = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED);
-        num_local_bw_flows = __atomic_load_n(&cb.sb->num_active_bw_flows, __ATOMIC_RELAXED);
+        /* broadcast to all clients when there is an update from a client */
 
-#ifdef HACK_APP_NUMS
-        num_local_big_flows = HACK_NUM_BW_APP;
-        num_local_small_flows = HACK_NUM_LAT_APP;
-        num_local_bw_flows = HACK_NUM_BW_APP;
-        cb.num_receiver_big_flows[0] = HACK_NUM_BW_APP;
-        cb.num_receiver_small_flows[0] = HACK_NUM_LAT_APP;
-#endif
+        printf("Broadcasting receiver-side info...\n");
+        for (j = 0; j < params->num_clients; j++) {
+            ctx = cb.ctx_per_client[j];
 
-        // TODO: remove this hardcode for bw write vs lat read
-        //// READ HACK
-        /*
-        __atomic_store_n(&cb.sb->virtual_link_cap, 3000, __ATOMIC_RELAXED);
-        __atomic_store_n(&cb.sb->split_level, 2, __ATOMIC_RELAXED);
-        continue;
-        */
-        ////
-        if (num_local_big_flows + num_remote_big_reads)        // TODO: simplfiy the logic here later (can just check num_active_bw_flows + num_remote_big_reads)
-        {
-            ////if (num_active_small_flows && (num_active_bw_flows || num_remote_big_reads))    // READ HACK
-            ////if (num_active_small_flows && num_active_bw_flows) {            // before receiver-side update
-            if ((num_local_small_flows || cb.num_receiver_small_flows[0]) && num_local_bw_flows) {                // after receiver-side update
-/*
-#ifndef TREAT_L_AS_ONE
-                min_virtual_link_cap = round((double)(num_active_big_flows + num_remote_big_reads) 
-                    / (num_active_big_flows + num_active_small_flows + num_remote_big_reads) * LINE_RATE_MB);
-#else
-                min_virtual_link_cap = round((double)(num_active_big_flows + num_remote_big_reads) 
-                    / (num_active_big_flows + 1 + num_remote_big_reads) * LINE_RATE_MB);
-#endif
-*/
-#ifndef TREAT_L_AS_ONE
-                min_virtual_link_cap = round((double)(num_local_big_flows + num_remote_big_reads) 
-                    / (cb.num_receiver_big_flows[0] + cb.num_receiver_small_flows[0] + num_remote_big_reads) * LINE_RATE_MB);   // assume a single receiver
-#else
-                min_virtual_link_cap = round((double)(num_local_big_flows + num_remote_big_reads) 
-                    / (cb.num_receiver_big_flows[0] + 1 + num_remote_big_reads) * LINE_RATE_MB);      // assume a single receiver
-#endif
-                if (min_virtual_link_cap > LINE_RATE_MB) {      // could happen if haven't received info from the receiver
-                    min_virtual_link_cap = LINE_RATE_MB;
-                }
-                temp = __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED);
-
-                if (measured_tail[0] > latency_target)      //HACK
-                {
-                    /* Multiplicative Decrease */
-                    temp >>= 1;
-                    if (ELEPHANT_HAS_LOWER_BOUND && temp < min_virtual_link_cap) {
-                        temp = min_virtual_link_cap;
-                    }
-                }
-                else    // target met
-                {
-                    /* Additive Increase */
-                    if (__atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED) < LINE_RATE_MB) {
-                        temp++;
-                    }
-                }
-                if (num_remote_big_reads) {
-                    //TODO: fix READ impl later
-                    /*
-                    new_remote_read_rate = round((double)num_remote_big_reads
-                        / (num_remote_big_reads + num_active_big_flows) * temp);
-                    //// READ HACK
-                    //new_remote_read_rate = 3000;    // TODO: fix HARDCODE later
-                    ////
-                    if (new_remote_read_rate != cb.remote_read_rate) {
-                        cb.remote_read_rate = new_remote_read_rate;
-                        memset((char *)ctx->local_read_buf + BUF_READ_SIZE, 0, BUF_READ_SIZE);
-                        sprintf((char*)ctx->local_read_buf + BUF_READ_SIZE, "%" PRIu32, cb.remote_read_rate);
-                        printf("new remote read rate %s\n", (char*)ctx->local_read_buf + BUF_READ_SIZE);
-                        if (ibv_post_send(ctx->qp_read, &send_wr, &bad_wr))
-                        {
-                            perror("ibv_post_send: remote read rate");
-                        }
-                        do {
-                            num_comp = ibv_poll_cq(ctx->cq_send, 1, &send_wc);      //TODO: event-triggered polling
-                        } while(num_comp == 0);
-                        if (num_comp < 0) {
-                            perror("ibv_poll_cq: send_wr");
-                            break;
-                        }
-                        if (wc.status != IBV_WC_SUCCESS) {
-                            fprintf(stderr, "bad wc status: %s\n", ibv_wc_status_str(wc.status));
-                        }
-                    }
-                    temp -= new_remote_read_rate;
-                    */
-                }
-                __atomic_store_n(&cb.sb->virtual_link_cap, temp, __ATOMIC_RELAXED);
-            }
-            else {  // if no small flows
-                if (__atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED) != LINE_RATE_MB) {   
-                    temp = LINE_RATE_MB;
-                }
-
-                //TODO: figure out what's going on with the big read logic here. Why handle big reads only if there is no small flows?
-                if (num_remote_big_reads) {
-                    //TODO: fix READ impl later
-                    /*
-                    new_remote_read_rate = round((double)num_remote_big_reads
-                        / (num_remote_big_reads + num_active_big_flows) * temp);
-                    if (new_remote_read_rate != cb.remote_read_rate) {
-                        cb.remote_read_rate = new_remote_read_rate;
-                        memset((char *)ctx->local_read_buf + BUF_READ_SIZE, 0, BUF_READ_SIZE);
-                        sprintf((char*)ctx->local_read_buf + BUF_READ_SIZE, "%" PRIu32, cb.remote_read_rate);
-                        printf("new remote read rate %s\n", (char*)ctx->local_read_buf + BUF_READ_SIZE);
-                        if (ibv_post_send(ctx->qp_read, &send_wr, &bad_wr))
-                        {
-                            perror("ibv_post_send: remote read rate");
-                        }
-                        do {
-                            num_comp = ibv_poll_cq(ctx->cq_send, 1, &send_wc);      //TODO: event-triggered polling
-                        } while(num_comp == 0);
-                        if (num_comp < 0) {
-                            perror("ibv_poll_cq: send_wr");
-                            break;
-                        }
-                        if (wc.status != IBV_WC_SUCCESS) {
-                            fprintf(stderr, "bad wc status: %s\n", ibv_wc_status_str(wc.status));
-                        }
-                    }
-                    temp -= new_remote_read_rate;
-                    */
-                }
-                __atomic_store_n(&cb.sb->virtual_link_cap, temp, __ATOMIC_RELAXED);
+            /*
+             * Downcast to 16-bit fields in INFO message for
+             * wire-compatibility, but clamp to 0xffff to avoid
+             * unexpected wrap on the sender side.
+             */
+            uint16_t big_apps  = (m->current_num_big_apps  > UINT16_MAX) ? UINT16_MAX : (uint16_t)m->current_num_big_apps;
+            uint16_t small_apps = (m->current_num_small_apps > UINT16_MAX) ? UINT16_MAX : (uint16_t)m->current_num_small_apps;
 
+            sprintf(ctx->send_buf, "INFO:%04hu:%04hu", big_apps, small_apps);
+            if (ibv_post_send(ctx->qp, &m->send_wr[j], &bad_send_wr)) {
+                perror("ibv_post_send: broadcast info to all senders");
             }
-            //printf(">>>> virtual link cap: %" PRIu32 "\n", __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED));
+            do {    // clean up the cq for SEND message
+                num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc);
+            } while (num_comp == 0);
         }
 
+    } else if (num_comp < 0) {
+        fprintf(stderr, "server_loop: ibv_poll_cq(recv_cq) failed: errno=%d (%s)\n",
+                errno, strerror(errno));
+        return -1;
     }
-    printf("Out of while loop. exiting...\n");
+    return 0;
+}
 
-#ifdef USE_CMH
-    CMH_Destroy(cmh);
-#endif
+int monitor_serve(struct monitor *m) {
+    int i;
 
-    return;
+    //TODO: poll via channel
+    send_app_update(cb.ctx_per_client[0], 0);     // Hack for now: a single responder
+    /* check for receiver-side updates */
+    for (i = 0; i < m->params->num_clients; i++)
+        if (receiver_recv(m, i))
+            return -1;
+    return 0;
 }
 
-
 // handle receiver-side updates and coordinate with all senders
 void server_loop(void *arg) {
     printf(">>>starting server loop...\n");
+    trace_thread(TRACE_RING_MONITOR);
     struct monitor_param *params = (struct monitor_param *)arg;
     assert(!params->is_client);
+    struct monitor *m = monitor_open(params);
 
-    struct pingpong_context *ctx = NULL;
-    struct ibv_send_wr send_wr[MAX_CLIENTS], *bad_send_wr[MAX_CLIENTS];
-    struct ibv_recv_wr recv_wr[MAX_CLIENTS], *bad_recv_wr[MAX_CLIENTS];
-    struct ibv_sge send_sge[MAX_CLIENTS], recv_sge[MAX_CLIENTS];
-    struct ibv_wc send_wc[MAX_CLIENTS], recv_wc[MAX_CLIENTS];
-    int num_comp;
-    //uint32_t current_receiver_fan_in = 0;
-    /*
-     * NOTE:
-     *   These counters are used only as non-negative application counts
-     *   (number of big/small apps per receiver) and are later exported
-     *   to senders via the "INFO:bbbb:ssss" monitor messages.
-     *   They must never wrap around when decremented below 0.
-     *   Use 32-bit types for safety and clamp on decrement.
-     */
-    uint32_t current_num_big_apps = 0;       // bw or tput
-    uint32_t current_num_small_apps = 0;     // lat
-
-    int i = 0;
-    for (i = 0; i < params->num_clients; i++) {
-        ctx = init_monitor_chan(params);        // server will get stuck in socket listen()
-        if (!ctx) {
-            fprintf(stderr, "failed to allocate pingpong context. exiting monitor_latency\n");
-            exit(1);
-        }
-        cb.ctx_per_client[i] = ctx;
-
-        /* UPDATE SEND WR */
-        memset(&send_wr[i], 0, sizeof send_wr[i]);
-        send_wr[i].opcode = IBV_WR_SEND;
-        send_wr[i].sg_list = &send_sge[i];
-        send_wr[i].num_sge = 1;
-        send_wr[i].send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
-
-        memset(&send_sge[i], 0, sizeof send_sge[i]);
-        memset((char *)ctx->send_buf, 0, BUF_SIZE);
-        send_sge[i].addr = (uintptr_t)ctx->send_buf;
-        ////send_sge.addr = (uintptr_t)((char *)ctx->send_buf + BUF_SIZE);
-        send_sge[i].length = BUF_SIZE;
-        send_sge[i].lkey = ctx->send_mr->lkey;
-
-        /* UPDATE RECV WR */
-        memset(&recv_wr[i], 0, sizeof recv_wr[i]);
-        recv_wr[i].num_sge = 1;
-        recv_wr[i].sg_list = &recv_sge[i];
-
-        memset(&recv_sge[i], 0, sizeof recv_sge[i]);
-        memset(ctx->recv_buf, 0, BUF_SIZE);
-        recv_sge[i].addr = (uintptr_t)ctx->recv_buf;
-        recv_sge[i].length = BUF_SIZE;
-        recv_sge[i].lkey = ctx->recv_mr->lkey;
-        ibv_post_recv(ctx->qp, &recv_wr[i], &bad_recv_wr[i]);
+    while (1) {
+        if (monitor_serve(m))
+            return;
     }
+}
 
+/* the peers' contexts of the monitor: the receivers of a sender or the senders of a receiver */
+static struct pingpong_context **monitor_peers(struct monitor *m, int *n) {
+    *n = m->params->is_client ? m->params->num_servers : m->params->num_clients;
+    return m->params->is_client ? cb.ctx_per_server : cb.ctx_per_client;
+}
 
+int monitor_fds(struct monitor *m, int *fds, int max) {
+    struct pingpong_context **peers;
+    int i, n;
 
-#ifdef USE_CMH
-    cmh = CMH_Init(WIDTH, DEPTH, U, GRAN, WINDOW_SIZE);
-    if (!cmh)
-    {
-        fprintf(stderr, "CMH_Init failed\n");
-        exit(1);
+    peers = monitor_peers(m, &n);
+    for (i = 0; i < n && i < max; i++) {
+        fds[i] = peers[i]->recv_channel->fd;
+        if (fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK) ||
+            ibv_req_notify_cq(peers[i]->recv_cq, 0))
+            return -1;
     }
-#endif
+    return i;
+}
 
-    while (1) {
-        //TODO: poll via channel
-        /* check for receiver-side updates */
-        int i, j;
-        for (i = 0; i < params->num_clients; i++) {
-            ctx = cb.ctx_per_client[i];
-
-            num_comp = ibv_poll_cq(ctx->recv_cq, 1, &recv_wc[i]);
-            if (num_comp > 0) {     // found an update; actually num_comp should be either 0 or 1 given we set 'num_entires'=1 in ibv_poll_cq
-                if (recv_wc[i].status != IBV_WC_SUCCESS) {
-                    if (recv_wc[i].status == IBV_WC_WR_FLUSH_ERR) {
-                        fprintf(stderr, "server_loop: recv WC flushed (peer disconnected); stop server loop.\n");
-                        return;
-                    }
-                    fprintf(stderr, "server_loop: bad recv_wc status: %u.%s\n",
-                            recv_wc[i].status, ibv_wc_status_str(recv_wc[i].status));
-                    return;
-                }
-
-                //remote_receiver_fan_in = (uint32_t)strtol((const char *)ctx->update_recv_buf, NULL, 10);
-                if (strcmp(ctx->recv_buf, "big_inc") == 0) {
-                    current_num_big_apps++;
-                } else if (strcmp(ctx->recv_buf, "small_inc") == 0) {
-                    current_num_small_apps++;
-                } else if (strcmp(ctx->recv_buf, "big_dec") == 0) {
-                    /*
-                     * Guard against underflow: protocol bugs or duplicate
-                     * exit notifications must not make the counter wrap to
-                     * 2^N-1 and break fairness logic.
-                     */
-                    if (current_num_big_apps > 0)
-                        current_num_big_apps--;
-                } else if (strcmp(ctx->recv_buf, "small_dec") == 0) {
-                    if (current_num_small_apps > 0)
-                        current_num_small_apps--;
-                } else {
-                    printf("Unrecognized receiver-update msg. exit\n");
-                    exit(1);
-                }
-
-                printf("current receiver num big apps: %" PRIu32 "\n", current_num_big_apps);
-                printf("current receiver num small apps: %" PRIu32 "\n", current_num_small_apps);
-
-                if (ibv_post_recv(ctx->qp, &recv_wr[i], &bad_recv_wr[i])) {
-                    perror("ibv_post_recv: recv_wr");
-                }
-
-                /* broadcast to all clients when there is an update from a client */
-
-                printf("Broadcasting receiver-side info...\n");
-                for (j = 0; j < params->num_clients; j++) {
-                    ctx = cb.ctx_per_client[j];
-
-                    /*
-                     * Downcast to 16-bit fields in INFO message for
-                     * wire-compatibility, but clamp to 0xffff to avoid
-                     * unexpected wrap on the sender side.
-                     */
-                    uint16_t big_apps  = (current_num_big_apps  > UINT16_MAX) ? UINT16_MAX : (uint16_t)current_num_big_apps;
-                    uint16_t small_apps = (current_num_small_apps > UINT16_MAX) ? UINT16_MAX : (uint16_t)current_num_small_apps;
-
-                    sprintf(ctx->send_buf, "INFO:%04hu:%04hu", big_apps, small_apps);
-                    if (ibv_post_send(ctx->qp, &send_wr[j], &bad_send_wr[j])) {
-                        perror("ibv_post_send: broadcast info to all senders");
-                    }
-                    do {    // clean up the cq for SEND message
-                        num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc[j]);
-                    } while (num_comp == 0);
-                }
-
-            } else if (num_comp < 0) {
-                fprintf(stderr, "server_loop: ibv_poll_cq(recv_cq) failed: errno=%d (%s)\n",
-                        errno, strerror(errno));
-                return;
+int monitor_updates(struct monitor *m) {
+    struct pingpong_context **peers;
+    struct ibv_cq *cq;
+    void *ev_ctx;
+    int i, n;
+
+    /* every event acked and the cq armed again before it is polled: an update coming in between
+     * raises a new one */
+    peers = monitor_peers(m, &n);
+    for (i = 0; i < n; i++) {
+        while (!ibv_get_cq_event(peers[i]->recv_channel, &cq, &ev_ctx)) {
+            ibv_ack_cq_events(cq, 1);
+            if (ibv_req_notify_cq(cq, 0)) {
+                fprintf(stderr, "Couldn't request CQ notification\n");
+                return -1;
             }
-
         }
+    }
+    if (!m->params->is_client)
+        return monitor_serve(m);
+    for (i = 0; i < n; i++)
+        if (sender_recv(m, i))
+            return -1;
+    return 0;
+}
 
+int monitor_busy(struct monitor *m) {
+    int i;
 
-
-    }
+    if (!m->params->is_client)
+        return __atomic_load_n(&cb.notify_read, __ATOMIC_RELAXED) != 0;
+    for (i = 0; i < m->params->num_servers; i++)
+        if (m->num_remote_big_reads[i])
+            return 1;
+    return __atomic_load_n(&cb.notify_big, __ATOMIC_RELAXED) || __atomic_load_n(&cb.notify_small, __ATOMIC_RELAXED);
 }
@@ -12,4 +12,26 @@ struct monitor_param {
 void monitor_latency(void *);
 void server_loop(void *);
 
+/* The steps of monitor_latency and server_loop, for the single-core runtime to run one at a time
+ * (pacer -s). A sender starts a round of probes with monitor_round and reaps it with monitor_reap,
+ * which steps the AIMD once all of them are back; a receiver serves its senders with monitor_serve.
+ * Either hears of its peers through monitor_updates when an fd of monitor_fds is readable.
+ */
+struct monitor;
+
+struct monitor *monitor_open(struct monitor_param *);
+/* 0, or -1 to stop monitoring */
+int monitor_round(struct monitor *);
+/* 1 once the round is reaped and the AIMD stepped, 0 while probes are out (wait: spin for them),
+ * -1 to stop monitoring */
+int monitor_reap(struct monitor *, int wait);
+/* 0, or -1 to stop */
+int monitor_serve(struct monitor *);
+/* the completion channels of the updates from the peers, made nonblocking and armed; how many, or -1 */
+int monitor_fds(struct monitor *, int *fds, int max);
+/* takes the updates in after an fd of monitor_fds woke; 0, or -1 to stop */
+int monitor_updates(struct monitor *);
+/* app arrivals or exits to tell the peer of, or remote big READs to share the link with */
+int monitor_busy(struct monitor *);
+
 #endif
\ No newline at end of file
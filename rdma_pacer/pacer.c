@@ -1,37 +1,24 @@
+#define _GNU_SOURCE
 #include "pacer.h"
 #include "monitor.h"
 #include "get_clock.h"
 //#include <immintrin.h> /* For _mm_pause */
 #include "countmin.h"
+#include "srpt.h"
+#include "reserve.h"
+#include "ctl_server.h"
+#include "trace.h"
+#include "placement.h"
+#include "runtime.h"
 #include "assert.h"
 
-// DEFAULT_CHUNK_SIZE is the initial chunk size when num_split_qps = 1
-// NOTE: from Crail exp: use 1048576 & 5120 since 1048576 is Crail's default slice size
-//#define DEFAULT_CHUNK_SIZE 10000000
-#define DEFAULT_CHUNK_SIZE 1000000
-//#define DEFAULT_CHUNK_SIZE 1048576
-#define SMALL_CHUNK_SIZE 5000
-//#define SMALL_CHUNK_SIZE 5120
-//#define EVEN_SMALLER_CHUNK_SIZE 1000
-//#define EVEN_SMALLER_CHUNK_SIZE 1024
-//#define EVEN_SMALLER_CHUNK_SIZE 5120
-#define EVEN_SMALLER_CHUNK_SIZE 5000
-#define BIG_CHUNK_SIZE 1000000
-//#define BIG_CHUNK_SIZE 1048576
-//#define DEFAULT_BATCH_OPS 5000    // xl170 (when using 10Gbps link)
-//#define DEFAULT_BATCH_OPS 1000     // Conflux
-//#define DEFAULT_BATCH_OPS 1500    // c6220
-//#define DEFAULT_BATCH_OPS 1667    // r320
-#define DEFAULT_BATCH_OPS 1800    // r320
-//#define DEFAULT_BATCH_OPS 2500    // Shin's RoCEv2
-//#define MAX_TOKEN 5
-#define MAX_TOKEN 5
 #define HOSTNAME_PATH "/proc/sys/kernel/hostname"
 //#define SPLIT_QP_NUM_ONE_SIDED 2
 //#define TIMEFRAME 2         // In microseconds
 
 extern CMH_type *cmh;
 struct control_block cb;
+static char shm_name[PORT_DEV_LEN + 32] = SHARED_MEM_NAME;   /* of the port paced (port.h) */
 //uint32_t chunk_size_table[] = {4096, 8192, 16384, 32768, 65536, 1048576, 1048576};
 //uint32_t chunk_size_table[] = {8192, 8192, 100000, 100000, 500000, 1000000, 1000000};
 ////uint32_t chunk_size_table[] = {1000000, 1000000, 1000000, 1000000, 1000000, 1000000, 1000000};	// Use 1048576 in Conflux
@@ -43,6 +30,10 @@ uint32_t chunk_size_table[] = {1000000, 5000};	// adjusted based on split_level
 unsigned int flow_sockets[MAX_FLOWS];
 #endif
 ////
+#ifdef SRPT_GRANTS
+static uint64_t srpt_since[MAX_FLOWS];     /* srpt.h: grant count when a slot last got a token or was not waiting */
+static uint64_t srpt_grants;
+#endif
 /* utility fuctions */
 static void error(char *msg)
 {
@@ -50,10 +41,20 @@ static void error(char *msg)
     exit(1);
 }
 
+/* attributes of a thread that may be pinned, the n-th of its role (placement.h) */
+static pthread_attr_t *placed(pthread_attr_t *attr, const char *what, const char *env, int n)
+{
+    pthread_attr_init(attr);
+    if (placement_attr(attr, what, env, n, cb.nic_node))
+        exit(1);
+    return attr;
+}
+
 static void usage()
 {
     //printf("Usage: program is_client server_addr num_clients [gid_idx]\n");
-    printf("Usage: program is_client server_addr num_clients_or_receiver [gid_idx]\n");
+    printf("Usage: program [-d ib_dev] [-i ib_port] [-r line_rate_MBps] [-s] is_client server_addr num_clients_or_receiver [gid_idx]\n");
+    printf("  -s: run on a single core (runtime.h), idle while no flow is joined\n");
 }
 
 static inline void cpu_relax() __attribute__((always_inline));
@@ -72,14 +73,15 @@ static inline void cpu_relax()
 static void termination_handler(int sig)
 {
     printf("signal handler called\n");
-    remove("/dev/shm/rdma-fairness");
+    trace_flush();
+    shm_unlink(shm_name);
     CMH_Destroy(cmh);
     _exit(0);
 }
 
 static void rm_shmem_on_exit()
 {
-    remove("/dev/shm/rdma-fairness");
+    shm_unlink(shm_name);
 }
 
 char *get_sock_path() {
@@ -111,127 +113,103 @@ char *get_sock_path() {
 }
 /* end */
 
-/* circular buffer for future logging */
-struct circular_buffer {
-    void *buffer;     // data buffer
-    void *buffer_end; // end of data buffer
-    size_t capacity;  // maximum number of items in the buffer
-    size_t count;     // number of items in the buffer
-    size_t sz;        // size of each item in the buffer
-    void *head;       // pointer to head
-    void *tail;       // pointer to tail
-};
-
-//struct circular_buffer token_cbuf;
-
-int cbuf_init(struct circular_buffer *buf, size_t capacity, size_t sz)
+/* admits or rejects the minimum rate a tput flow asks for at join (reserve.h); the token
+ * generator picks admitted ones up from reserved_rate. Returns the MBps granted, 0 if rejected.
+ */
+static uint32_t reserve_slot(int slot, uint32_t rate)
 {
-    buf->buffer = malloc(capacity * sz);
-    if (buf->buffer == NULL)
-        return -1;
-    buf->buffer_end = (char *)buf->buffer + capacity * sz;
-    buf->capacity = capacity;
-    buf->count = 0;
-    buf->sz = sz;
-    buf->head = buf->buffer;
-    buf->tail = buf->buffer;
-    return 0;
-}
+    uint32_t total = cb.reserved_mb, granted = 0;
 
-void cbuf_free(struct circular_buffer *buf)
-{
-    free(buf->buffer);
+#ifndef CPU_FRIENDLY    /* tokens go over the flow sockets there and reservations are not metered */
+    granted = reserve_admit(&total, MAX_RESERVED_MB, rate);
+#endif
+    printf("reservation of %" PRIu32 " MBps for slot %d %s; %" PRIu32 " of %d MBps reserved\n", rate, slot,
+           granted ? "admitted" : "rejected", total, MAX_RESERVED_MB);
+    if (granted) {
+        __atomic_store_n(&cb.reserved_rate[slot], granted, __ATOMIC_RELAXED);
+        __atomic_store_n(&cb.reserved_mb, total, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cb.reserve_gen, 1, __ATOMIC_RELEASE);
+    }
+    return granted;
 }
 
-int cbuf_push_back(struct circular_buffer *buf, const void *item)
+/* gives back the reservation of a slot, if it holds one */
+static void unreserve_slot(int slot)
 {
-    if (buf->count == buf->capacity)
-        return -1;
-    memcpy(buf->head, item, buf->sz);
-    buf->head = (char*)buf->head + buf->sz;
-    if (buf->head == buf->buffer_end)
-        buf->head = buf->buffer;
-    buf->count++;
-    return 0;
+    uint32_t rate = cb.reserved_rate[slot];
+
+    if (!rate)
+        return;
+    __atomic_store_n(&cb.reserved_rate[slot], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.reserved_mb, cb.reserved_mb - rate, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cb.reserve_gen, 1, __ATOMIC_RELEASE);
 }
 
-int cbuf_pop_front(struct circular_buffer *buf, void *item)
+/* frees slot i for reuse */
+static void slot_free(int i)
 {
-    if (buf->count == 0)
-        return -1;
-    memcpy(item, buf->tail, buf->sz);
-    buf->tail = (char*)buf->tail + buf->sz;
-    if (buf->tail == buf->buffer_end)
-        buf->tail = buf->buffer;
-    buf->count--;
-    return 0;
+    pid_t pid = cb.pid_list[i];
+
+    cb.pid_list[i] = -1;
+    cb.tid_list[i] = -1;
+    cb.qpn_list[i] = 0;
+    cb.num_joined--;
+    unreserve_slot(i);
+    cb.sb->flows[i].active = 0;
+    cb.sb->flows[i].pending = 0;
+    cb.sb->flows[i].read = 0;
+    __atomic_store_n(&cb.sb->stats[i].pid, 0, __ATOMIC_RELAXED);
+    trace(TRACE_LEAVE, i, pid);
 }
 
-void logging_tokens()
+/* frees the slots of processes that exited without leaving, as a killed one does; returns how many */
+static int reap_slots()
 {
-    //cbuf_init(&token_cbuf, 1000000, sizeof(uint64_t));
-    //cbuf_push_back(&token_cbuf, &cb.tokens)
-    FILE *f = fopen("token_log.txt", "w");
-    fprintf(f, "Time(us)\tnum_tokens\n");
-    cycles_t start_cycle, curr_cycle;
-    start_cycle = get_cycles();
-    double cpu_mhz = get_cpu_mhz(1);
-    while (1) {
-        // NOTE: shouldn't be DEAFULT_CHUNK_SIZE; it can change
-        while (get_cycles() - curr_cycle < cpu_mhz * DEFAULT_CHUNK_SIZE / LINE_RATE_MB)
-            cpu_relax();
-        curr_cycle = get_cycles();
-        fprintf(f, "%.2f\t\t%lld\n", ((double) (curr_cycle - start_cycle) / cpu_mhz), cb.tokens);
-        //fprintf(f, "%.2f\t\t%" PRIu64 "\n", (double) ((curr_cycle - start_cycle) / cpu_mhz), __atomic_load_n(&cb.tokens, __ATOMIC_RELAXED));
-    }
+    int i, n = 0;
 
+    for (i = 0; i < MAX_FLOWS; i++) {
+        if (cb.pid_list[i] == -1 || kill(cb.pid_list[i], 0) == 0 || errno != ESRCH)
+            continue;
+        printf("slot %d: pid %d is gone, reaping its slot\n", i, cb.pid_list[i]);
+        slot_free(i);
+        n++;
+    }
+    return n;
 }
-/* end */
 
-static int find_next_slot(pid_t pid, pid_t tid)
+/* the slot of pid:tid:qpn, a free one if it holds none; -1 if none is left, for the qp to go unpaced */
+static int find_next_slot(pid_t pid, pid_t tid, uint32_t qpn)
 {
-    int i, ret_slot = -1, match = 0;
-    if (pid == -1) {
-        printf("Invalid pid. Exiting.\n");
-        exit(1);
-    }
+    int i, reaped = 0;
 
-    if (tid == -1) {
-        printf("Invalid tid. Exiting.\n");
-        exit(1);
+    if (pid == -1 || tid == -1) {
+        printf("Invalid pid %d tid %d\n", pid, tid);
+        return -1;
     }
 
     for (i = 0; i < MAX_FLOWS; i++) {
-        if (cb.pid_list[i] == pid && cb.tid_list[i] == tid) {
-            printf("PID(%d) TID(%d) match at slot %d\n", pid, tid, i);
-            cb.pid_list[i] = pid;
-            cb.tid_list[i] = tid;
-            ret_slot = i;
-            match = 1;
-            break;
+        if (cb.pid_list[i] == pid && cb.tid_list[i] == tid && cb.qpn_list[i] == qpn) {
+            printf("PID(%d) TID(%d) QPN(%06x) match at slot %d\n", pid, tid, qpn, i);
+            return i;
         }
-    } 
+    }
 
     /* if the pid appears for the first time */
-    if (match == 0) {
+    for (;;) {
         for (i = 0; i < MAX_FLOWS; i++) {
             if (cb.pid_list[i] == -1) {
-                //printf("No pid match. Next empty slot is %d\n", i);
-                ret_slot = i;
-                break;
+                cb.num_joined++;
+                cb.pid_list[i] = pid;
+                cb.tid_list[i] = tid;
+                cb.qpn_list[i] = qpn;
+                return i;
             }
-        } 
-    }
-
-    if (ret_slot == -1) {
-        printf("Error finding next slot. Exiting.\n");
-        exit(1);
-    } else {
-        cb.pid_list[ret_slot] = pid;
-        cb.tid_list[ret_slot] = tid;
+        }
+        if (reaped || !(reaped = reap_slots()))
+            break;
     }
-
-    return ret_slot;
+    printf("No slot left for PID(%d) TID(%d) QPN(%06x); it goes unpaced\n", pid, tid, qpn);
+    return -1;
 }
 
 // Assume only clients keep track of per src/dsr info
@@ -247,252 +225,258 @@ int find_vaddr_idx(int num_servers, uint64_t vaddr)
     return -1;
 }
 
-/* handle incoming flows one by one; assign a slot to an incoming flow */
-static void flow_handler(void *arg)
+/* a token granted to slot i, for pacerstat; a slot's tokens come from one thread (read or not) */
+static inline void stat_token(int i)
 {
-    /* prepare unix domain socket communication */
-    printf("starting flow_handler...\n");
-    unsigned int s, s2, len;
-    struct sockaddr_un local, remote;
-    char buf[MSG_LEN];
-    char buf_pid[MSG_LEN];
-    char *sock_path = get_sock_path();
-    pid_t pid;
-    pid_t tid;
-    int num_comp;
-
-    struct ibv_send_wr send_wr, *bad_wr = NULL;
-    struct ibv_sge send_sge;
-    struct ibv_wc send_wc;
-
-    memset(&send_wr, 0, sizeof send_wr);
-    send_wr.opcode = IBV_WR_SEND;
-    send_wr.sg_list = &send_sge;
-    send_wr.num_sge = 1;
-    send_wr.send_flags = (IBV_SEND_SIGNALED | IBV_SEND_INLINE);
-
-    memset(&send_sge, 0, sizeof send_sge);
-
-    /* get a socket descriptor */
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
-        error("socket");
-
-    /* bind to an address */
-    local.sun_family = AF_UNIX;
-    strcpy(local.sun_path, sock_path);
-    unlink(local.sun_path);
-    len = strlen(local.sun_path) + sizeof(local.sun_family);
-    if (bind(s, (struct sockaddr *)&local, len))
-        error("bind");
-
-    /* listen for clients */
-    if (listen(s, 10))
-        error("listen");
+    uint64_t *tokens = &cb.sb->stats[i].tokens;
 
+    __atomic_store_n(tokens, __atomic_load_n(tokens, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
 
-    int is_client = ((struct monitor_param *)arg)->is_client;
-    int num_servers = ((struct monitor_param *)arg)->num_servers;
-    uint64_t vaddr;
-    int vaddr_idx;
+/* hands slot i the token it waits for; how is TRACE_GRANT_* */
+static inline void grant(int i, int how)
+{
+    __atomic_store_n(&cb.sb->flows[i].pending, 0, __ATOMIC_RELAXED);
+    stat_token(i);
+    trace(TRACE_GRANT, i, how);
+    //// UDS_IMPL
+#ifdef CPU_FRIENDLY
+    if (send(flow_sockets[i], "0", 1, 0) == -1) {
+        perror("error sending token: ");
+        exit(1);
+    }
+#endif
+}
 
-    /* handling loop */
+/* tell the drivers the pacer is alive: a heartbeat that stands still makes them send unpaced */
+static void heartbeat()
+{
     while (1) {
-        len = sizeof(struct sockaddr_un);
-        if ((s2 = accept(s, (struct sockaddr *)&remote, &len)) == -1)
-            error("accept");
-
-        /* check join */
-        len = recv(s2, (void *)buf, (size_t)MSG_LEN, 0);
-        printf("receive message of length %d.\n", len);
-        buf[len] = '\0';
-        printf("message is %s.\n", buf);
-        //if (strcmp(buf, "join") == 0) {
-        if (strncmp(buf, "join:xxxx", 4) == 0) {      // join message now also send dst
-            // assume pacers have established connection between each other before
-            // RDMA applications start to send data (which is reasonable) 
-            // assume only clients need to keep track of per src/pair info
-            sscanf(buf, "join:%Lx", &vaddr);
-            vaddr_idx = find_vaddr_idx(num_servers, vaddr);
-            if (vaddr_idx < 0) {
-                printf("Error finding vaddr idx. Exit\n");
-                exit(1);
-            }
-            printf("Found vaddr idx: %d\n", vaddr_idx);
-
-            /* send if the node is a sender or receiver (instead of sending "pid" to prompt for pid) */
-            // for sender, also send the vaddr_idx
-            if (is_client) {
-                sprintf(buf, "sender:%04x", vaddr_idx);
-                if (send(s2, buf, sizeof(buf), 0) == -1) {
-                    perror("error sending sender info: ");
-                    exit(1);
-                }
-            } else {
-                if (send(s2, "recver", 6, 0) == -1) {
-                    perror("error sending receiver info: ");
-                    exit(1);
-                }
-            }
-
-            /* receive pid/tid from process */
-            len = recv(s2, (void *)buf_pid, (size_t)MSG_LEN, 0);
-            //printf("receive pid message of length %d.\n", len);
-            //printf("message is %s.\n", buf_pid);
-            buf_pid[len] = '\0';
-            tid = -1;
-            if (strchr(buf_pid, ':')) {
-                if (sscanf(buf_pid, "%d:%d", &pid, &tid) != 2) {
-                    printf("Invalid pid:tid format: %s. Exit\n", buf_pid);
-                    exit(1);
-                }
-            } else {
-                /* Backward compatibility: old clients send only pid */
-                pid = strtol(buf_pid, NULL, 10);
-                tid = pid;
-            }
-            printf("received pid=%d tid=%d\n", pid, tid);
-
-            /* find the slot number based on the pid received */
-            cb.next_slot = find_next_slot(pid, tid);
+        __atomic_fetch_add(&cb.sb->heartbeat, 1, __ATOMIC_RELAXED);
+        usleep(HEARTBEAT_US);
+    }
+}
 
-            //// UDS_IMPL
-#ifdef CPU_FRIENDLY
-            /* store the uds for later use (to inform token is ready) */
-            flow_sockets[cb.next_slot] = s2;
-#endif
-            ////
-            
-            /* send back slot number */
-            printf("sending back slot number %d ...\n", cb.next_slot);
-            len = snprintf(buf, MSG_LEN, "%d", cb.next_slot);
-            cb.sb->flows[cb.next_slot].active = 1;
-            send(s2, &buf, len, 0);     // yiwen:why &buf not buf?
-
-            /* find next empty slot */
-            // No longer needed since we switch to the pid based slot
-            /* 
-            cb.next_slot = (cb.next_slot + 1) % MAX_FLOWS;
-            while (__atomic_load_n(&cb.sb->flows[cb.next_slot].active, __ATOMIC_RELAXED))
-            {
-                cb.next_slot = (cb.next_slot + 1) % MAX_FLOWS;
-            }
-            */
+/* assigns pid:tid:qpn its slot and admits the minimum rate it asks for, if any; the answer for
+ * the client, slot or slot:granted, or -1 if no slot is left, goes in ans (MSG_LEN)
+ */
+static int flow_join(pid_t pid, pid_t tid, uint32_t qpn, uint32_t rate, char *ans, int *slot)
+{
+    uint32_t granted;
+    int cpu, node;
+
+    /* find the slot number based on the pid/tid/qpn received */
+    if ((*slot = find_next_slot(pid, tid, qpn)) < 0)
+        return snprintf(ans, MSG_LEN, "-1");
+    cb.next_slot = *slot;
+    if (cb.next_slot >= cb.num_slots)
+        __atomic_store_n(&cb.num_slots, cb.next_slot + 1, __ATOMIC_RELAXED);
+    unreserve_slot(cb.next_slot);       // a rejoining qp asks afresh
+    granted = rate ? reserve_slot(cb.next_slot, rate) : 0;
+    cb.sb->flows[cb.next_slot].active = 1;
+    trace(TRACE_JOIN, cb.next_slot, pid);
+    __atomic_store_n(&cb.sb->stats[cb.next_slot].cls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.sb->stats[cb.next_slot].qpn, qpn, __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.sb->stats[cb.next_slot].tid, tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.sb->stats[cb.next_slot].pid, pid, __ATOMIC_RELAXED);
+
+    /* a thread spinning on pending from the other socket pays for it on every token */
+    if (cb.nic_node >= 0 && (cpu = thread_cpu(pid, tid)) >= 0 && (node = cpu_node(cpu)) >= 0 &&
+        node != cb.nic_node)
+        printf("warning: slot %d: pid %d tid %d joins from cpu %d on node %d, the NIC and the pacer are on node %d\n",
+               cb.next_slot, pid, tid, cpu, node, cb.nic_node);
+
+    if (rate)
+        return snprintf(ans, MSG_LEN, "%d:%" PRIu32, cb.next_slot, granted);
+    return snprintf(ans, MSG_LEN, "%d", cb.next_slot);
+}
 
+/* Thread/qp deregistration: free slot mapping so it can be reused */
+static void flow_leave(pid_t pid, pid_t tid, uint32_t qpn)
+{
+    int i;
 
+    for (i = 0; i < MAX_FLOWS; i++) {
+        if (cb.pid_list[i] == pid && cb.tid_list[i] == tid && cb.qpn_list[i] == qpn) {
+            slot_free(i);
+            break;
         }
-        else if (strcmp(buf, "read") == 0)
-        {
-            // TODO: fix READ impl later
-            /*
-            send_sge.addr = (uintptr_t)cb.ctx->local_read_buf;
-            send_sge.length = BUF_READ_SIZE;
-            send_sge.lkey = cb.ctx->local_read_mr->lkey;
-
-            strcpy(cb.ctx->local_read_buf, buf);
-            ibv_post_send(cb.ctx->qp_read, &send_wr, &bad_wr);
+    }
+}
+
+/* An app starts (app_*) or stops (exit_app_*) sending in a class. The peer is told by the monitor
+ * thread that owns the qp to it (notify_* in the control block), so the client is not held up by
+ * an RDMA SEND. Returns -1 for a class it does not know.
+ */
+static int flow_app(const char *msg, int is_client)
+{
+    int inc = (msg[0] == 'a');
+    const char *type = msg + (inc ? 4 : 9);
+    int32_t *notify = NULL;
+
+    if (strcmp(type, "read") == 0) {
+        /* A big READ pulls its data through the responder's link: it is paced here with read
+         * tokens at local_read_rate, which the responder (a sender running the virtual link)
+         * grants once told about the READ. A READ issued from a sender has no remote virtual
+         * link to ask and keeps the rate it has. */
+        if (inc) {
             __atomic_fetch_add(&cb.num_big_read_flows, 1, __ATOMIC_RELAXED);
-            */
+        } else if (__atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED) > 0) {
+            __atomic_fetch_sub(&cb.num_big_read_flows, 1, __ATOMIC_RELAXED);
         }
-        else if (strncmp(buf, "exit_app_xxx", 8) == 0) {
-            /* As a sender, tell the receriver that # of the sending apps has decreased by 1 */
-            int i;
-            for (i = 0; i < num_servers; i++) {
-                //TODO: 
-            }
-            if (is_client) {
-                struct pingpong_context *ctx = cb.ctx_per_server[0]; // Hack for now
-                if (strcmp(buf, "exit_app_bw") == 0) {
-                    strcpy(ctx->send_buf, "big_dec");
-                } else if (strcmp(buf, "exit_app_lat") == 0) {
-                    strcpy(ctx->send_buf, "small_dec");
-                } else if (strcmp(buf, "exit_app_tput") == 0) {
-                    strcpy(ctx->send_buf, "big_dec");
-                } else {
-                    printf("Error unrecognized app type. Exit\n");
-                    exit(1);
-                }
-
-                send_sge.addr = (uintptr_t)ctx->send_buf;
-                send_sge.length = BUF_SIZE;
-                send_sge.lkey = ctx->send_mr->lkey;
-
+        if (!is_client)
+            notify = &cb.notify_read;
+    } else if (strcmp(type, "bw") == 0 || strcmp(type, "tput") == 0) {
+        /* As a sender, tell the receiver (since WRITE operates passively) that I contribute to one of the fan-in */
+        if (is_client)
+            notify = &cb.notify_big;
+    } else if (strcmp(type, "lat") == 0) {
+        if (is_client)
+            notify = &cb.notify_small;
+    } else {
+        return -1;
+    }
+    if (notify)
+        __atomic_fetch_add(notify, inc ? 1 : -1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-                if (ibv_post_send(ctx->qp, &send_wr, &bad_wr)) {
-                    perror("ibv_post_send: decrement num_sender for remote receiver");
-                }
-                
-                do {    // clean up the cq for SEND message
-                    num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc);
-                } while (num_comp == 0);
-                printf("sent a msg to remote receiver on WRITE EXIT\n");
+enum {
+    FLOW_NEW,           /* no message yet */
+    FLOW_JOINING,       /* a one-shot join told sender/recver; pid:tid:qpn comes next */
+};
 
+/* one message from a client of the control channel (ctl_server.h). The drivers send everything
+ * on their persistent channel: j:pid:tid:qpn[:MBps] (answered slot[:granted] or -1), app_*,
+ * exit_app_* and l:pid:tid:qpn. One-shot clients join with join:vaddr, then pid:tid:qpn[:MBps].
+ */
+static int handle_flow_msg(struct ctl_conn *c, char *msg, void *arg)
+{
+    int is_client = ((struct monitor_param *)arg)->is_client;
+    int num_servers = ((struct monitor_param *)arg)->num_servers;
+    char ans[MSG_LEN + 1];
+    uint64_t vaddr;
+    int vaddr_idx;
+    pid_t pid;
+    pid_t tid;
+    uint32_t qpn;
+    uint32_t rate;
+    int len, slot;
+
+    if (c->state == FLOW_JOINING) {
+        tid = -1;
+        qpn = 0;
+        rate = 0;
+        if (strchr(msg, ':')) {
+            /* drivers register each qp as pid:tid:qpn, and a tput qp asking for a minimum rate
+             * as pid:tid:qpn:MBps; per-thread clients send pid:tid */
+            if (sscanf(msg, "%d:%d:%x:%" SCNu32, &pid, &tid, &qpn, &rate) < 2) {
+                printf("Invalid pid:tid format: %s\n", msg);
+                return CTL_CLOSE;
             }
+        } else {
+            /* Backward compatibility: old clients send only pid */
+            pid = strtol(msg, NULL, 10);
+            tid = pid;
+        }
+        len = flow_join(pid, tid, qpn, rate, ans, &slot);
+        ctl_reply(c, ans, len);
+#ifdef CPU_FRIENDLY
+        if (slot < 0)
+            return CTL_CLOSE;
+        /* store the uds for later use (to inform token is ready) */
+        flow_sockets[slot] = c->fd;
+        return CTL_DETACH;
+#else
+        return CTL_CLOSE;
+#endif
+    }
 
-            // TODO: hanlde read exit later
-            /*
-            send_sge.addr = (uintptr_t)cb.ctx->local_read_buf;
-            send_sge.length = BUF_READ_SIZE;
-            send_sge.lkey = cb.ctx->local_read_mr->lkey;
-
-            strcpy(cb.ctx->local_read_buf, buf);
-            ibv_post_send(cb.ctx->qp_read, &send_wr, &bad_wr);
-            __atomic_fetch_sub(&cb.num_big_read_flows, 1, __ATOMIC_RELAXED);
-            */
-
-        } else if (strncmp(buf, "app_xxx", 4) == 0) {
-            /* As a sender, tell the receiver (since WRITE operates passively) that I contribute to one of the fan-in (# of sending apps increase by 1) */
-            if (is_client) {
-                struct pingpong_context *ctx = cb.ctx_per_server[0]; // Hack for now
-                if (strcmp(buf, "app_bw") == 0) {
-                    strcpy(ctx->send_buf, "big_inc");
-                } else if (strcmp(buf, "app_lat") == 0) {
-                    strcpy(ctx->send_buf, "small_inc");
-                } else if (strcmp(buf, "app_tput") == 0) {
-                    strcpy(ctx->send_buf, "big_inc");
-                } else {
-                    printf("Error unrecognized app type. Exit\n");
-                    exit(1);
-                }
-                send_sge.addr = (uintptr_t)ctx->send_buf;
-                send_sge.length = BUF_SIZE;
-                send_sge.lkey = ctx->send_mr->lkey;
+    if (c->lines && msg[0] == 'j' && msg[1] == ':') {
+        qpn = 0;
+        rate = 0;
+        if (sscanf(msg + 2, "%d:%d:%x:%" SCNu32, &pid, &tid, &qpn, &rate) < 3) {
+            printf("Invalid join format: %s\n", msg);
+            return CTL_CLOSE;
+        }
+        len = flow_join(pid, tid, qpn, rate, ans, &slot);
+        ans[len++] = '\n';
+        return ctl_reply(c, ans, len) ? CTL_CLOSE : CTL_KEEP;
+    }
 
-                if (ibv_post_send(ctx->qp, &send_wr, &bad_wr)) {
-                    perror("ibv_post_send: increment num_sender for remote receiver");
-                }
-                do {    // clean up the cq for SEND message
-                    num_comp = ibv_poll_cq(ctx->send_cq, 1, &send_wc);
-                } while (num_comp == 0);
-                printf("sent a msg to remote receiver on WRITE ARRIVAL; %s\n", buf);
-            }
-        } else if (buf[0] == 'l' && buf[1] == ':') {
-            /* Thread/process deregistration: free slot mapping so it can be reused */
-            if (sscanf(buf + 2, "%d:%d", &pid, &tid) != 2) {
-                printf("Invalid leave format: %s. Exit\n", buf);
-                exit(1);
-            }
+    if (strncmp(msg, "join:", 5) == 0) {      // join message now also send dst
+        // assume pacers have established connection between each other before
+        // RDMA applications start to send data (which is reasonable) 
+        // assume only clients need to keep track of per src/pair info
+        sscanf(msg, "join:%" SCNx64, &vaddr);
+        vaddr_idx = find_vaddr_idx(num_servers, vaddr);
+        if (vaddr_idx < 0) {
+            printf("Error finding vaddr idx: %s\n", msg);
+            return CTL_CLOSE;
+        }
 
-            int i;
-            for (i = 0; i < MAX_FLOWS; i++) {
-                if (cb.pid_list[i] == pid && cb.tid_list[i] == tid) {
-                    cb.pid_list[i] = -1;
-                    cb.tid_list[i] = -1;
-                    cb.sb->flows[i].active = 0;
-                    cb.sb->flows[i].pending = 0;
-                    cb.sb->flows[i].read = 0;
-                    break;
-                }
-            }
+        /* send if the node is a sender or receiver (instead of sending "pid" to prompt for pid) */
+        // for sender, also send the vaddr_idx
+        if (is_client) {
+            memset(ans, 0, sizeof(ans));
+            sprintf(ans, "sender:%04x", vaddr_idx);
+            len = MSG_LEN;
+        } else {
+            strcpy(ans, "recver");
+            len = 6;
         }
+        if (ctl_reply(c, ans, len))
+            return CTL_CLOSE;
+        c->state = FLOW_JOINING;
+        return CTL_KEEP;
+    }
 
-#ifndef CPU_FRIENDLY
-        close(s2);
-#else
-        /* In CPU_FRIENDLY mode, keep join sockets open for token delivery */
-        if (strncmp(buf, "join:xxxx", 4) != 0)
-            close(s2);
-#endif
+    if (msg[0] == 'l' && msg[1] == ':') {
+        qpn = 0;
+        if (sscanf(msg + 2, "%d:%d:%x", &pid, &tid, &qpn) < 2)
+            printf("Invalid leave format: %s\n", msg);
+        else
+            flow_leave(pid, tid, qpn);
+    } else if (strncmp(msg, "app_", 4) == 0 || strncmp(msg, "exit_app_", 9) == 0) {
+        if (flow_app(msg, is_client))
+            printf("Error unrecognized app type: %s\n", msg);
+    } else {
+        printf("Unrecognized message: %s\n", msg);
     }
+    return c->lines ? CTL_KEEP : CTL_CLOSE;
+}
+
+/* listens on the control socket of the port paced, and publishes a new epoch once joins are taken */
+static void ctl_open(struct ctl_server *srv, void *arg)
+{
+    char *base = get_sock_path(), sock_path[108];
+
+    /* the socket of the port paced (port.h); that of old for a pacer without one */
+    if (cb.sb->port.dev[0])
+        port_sock_path(sock_path, sizeof(sock_path), base, cb.sb->port.dev, cb.sb->port.num);
+    else
+        snprintf(sock_path, sizeof(sock_path), "%s", base);
+    printf("starting flow_handler on %s...\n", sock_path);
+    if (ctl_server_open(srv, sock_path, handle_flow_msg, arg))
+        error("listen");
+
+    /* a new epoch once joins are taken: qps of an earlier pacer join this one on their next post */
+    uint32_t epoch = __atomic_load_n(&cb.sb->epoch, __ATOMIC_RELAXED) + 1;
+    if (!epoch)
+        epoch = 1;
+    __atomic_store_n(&cb.sb->epoch, epoch, __ATOMIC_RELAXED);
+    printf("pacer epoch %u\n", epoch);
+}
+
+/* serve the control channel of every client from one epoll loop; assign a slot to an incoming flow */
+static void flow_handler(void *arg)
+{
+    struct ctl_server srv;
+
+    trace_thread(TRACE_RING_CTL);
+    ctl_open(&srv, arg);
+    ctl_server_run(&srv);
+    exit(1);
 }
 
 /* fetch one token; block if no token is available 
@@ -518,12 +502,55 @@ static inline int try_fetch_a_token()
     return got_token;
 }
 
-static inline void fetch_token_read() __attribute__((always_inline));
-static inline void fetch_token_read()
+/* takes a read token once there is one; 0 if the big READs left meanwhile and none will come */
+static inline int fetch_token_read() __attribute__((always_inline));
+static inline int fetch_token_read()
 {
-    while (!__atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED))
+    while (!__atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED)) {
+        if (!__atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED))
+            return 0;
         cpu_relax();
+    }
     __atomic_fetch_sub(&cb.tokens_read, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+#ifndef CPU_FRIENDLY
+/* grants every waiting tput flow the tokens its reservation has filled (reserve.h);
+ * returns how many, for the shared tokens to pay back
+ */
+static inline uint32_t serve_reservations(struct reserve_set *rs, double cpu_mhz, uint32_t chunk_size)
+{
+    uint32_t gen = __atomic_load_n(&cb.reserve_gen, __ATOMIC_ACQUIRE), granted = 0;
+    int i;
+
+    if (gen != rs->gen)
+        reserve_sync(rs, cb.reserved_rate, MAX_FLOWS, gen, get_cycles());
+    if (!rs->n)
+        return 0;
+    while ((i = reserve_next(rs, get_cycles(), cpu_mhz, chunk_size, &cb.sb->flows[0].pending,
+                             sizeof(struct flow_info))) >= 0) {
+        grant(i, TRACE_GRANT_RESERVED);
+        granted++;
+    }
+    return granted;
+}
+#endif
+
+/* Calibrates the TSC once and publishes its rate, khz last: drivers reading 0 time it themselves.
+ * Tokens are spaced in TSC cycles, so a TSC that is not invariant paces at the core's clock. */
+static void tsc_publish(struct tsc_clock *c)
+{
+    const char *source = "";
+    int invariant;
+    uint32_t khz = get_tsc_khz(&invariant, &source);
+
+    if (!khz)
+        error("get_tsc_khz");
+    printf("tsc %u kHz (%s)%s\n", khz, source, invariant ? "" : ", not invariant");
+    c->ns_mult = (((uint64_t)1000000 << TSC_NS_SHIFT) + khz / 2) / khz;
+    c->invariant = invariant;
+    __atomic_store_n(&c->khz, khz, __ATOMIC_RELEASE);
 }
 
 /* generate tokens at some rate; now also fetch tokens
@@ -531,19 +558,26 @@ static inline void fetch_token_read()
 static void generate_fetch_tokens()
 {
     cycles_t start_cycle = 0;
-    int cpu_mhz = get_cpu_mhz(1);
+    uint32_t tsc_khz = cb.sb->tsc.khz;
     int start_flag = 1;
     int i;
     int next_idx = 0;
+#ifndef CPU_FRIENDLY
+    double cpu_mhz = tsc_khz / 1000.0;
+    static struct reserve_set reserved;     /* buckets of the reservations admitted */
+    uint32_t reserve_debt = 0;              /* tokens granted from reservations the shared ones still owe */
+#endif
     // struct timespec wait_time;
 
     /* infinite loop: generate tokens at a rate calculated 
      * from virtual_link_cap and active chunk size 
      */
-    uint32_t temp, chunk_size = DEFAULT_CHUNK_SIZE;
+    uint32_t temp, chunk_size = DEFAULT_CHUNK_SIZE, traced_chunk_size = chunk_size;
     //uint16_t num_big;
-    uint16_t num_small;
+    //uint16_t num_small;
+    trace_thread(TRACE_RING_TOKENS);
     __atomic_store_n(&cb.sb->active_chunk_size, chunk_size, __ATOMIC_RELAXED);
+    trace(TRACE_CHUNK, 0, chunk_size);
     //__atomic_store_n(&cb.sb->active_batch_ops, chunk_size/DEFAULT_CHUNK_SIZE*DEFAULT_BATCH_OPS, __ATOMIC_RELAXED);
     __atomic_store_n(&cb.sb->active_batch_ops, DEFAULT_BATCH_OPS, __ATOMIC_RELAXED);
     __atomic_store_n(&cb.tokens, 1, __ATOMIC_RELAXED);      // in fact, in current logic, # of tokens should always be 1 or 0
@@ -569,39 +603,23 @@ static void generate_fetch_tokens()
             cb.num_receiver_small_flows[0] = HACK_NUM_LAT_APP;
 #endif
             ////if ((num_small = __atomic_load_n(&cb.sb->num_active_small_flows, __ATOMIC_RELAXED))) {
-            if (cb.num_receiver_small_flows[0]) {   // hack
-                //chunk_size = chunk_size_table[temp / num_big / (LINE_RATE_MB/6)];
-                //chunk_size = DEFAULT_CHUNK_SIZE;
-
-                ////chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->num_active_split_qps, __ATOMIC_RELAXED) - 1];
-                /* adjust chunk size based on split_level */
-                /*
-                chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) - 1];
-                if (__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) > 1) {
-                    chunk_size = chunk_size_table[1];
-                } else {
-                    chunk_size = chunk_size_table[0];
-                }
-                */
-                chunk_size = SMALL_CHUNK_SIZE;
-                if (temp > (double) LINE_RATE_MB / 3) {
-                    chunk_size = SMALL_CHUNK_SIZE;
-                } else {
-                    chunk_size = EVEN_SMALLER_CHUNK_SIZE;
-                }
-            }
-            else
-            {
-                chunk_size = DEFAULT_CHUNK_SIZE;
-                //chunk_size = SMALL_CHUNK_SIZE;      // READ hack
-            }
+            chunk_size = token_chunk_size(temp, cb.line_rate, cb.num_receiver_small_flows[0]);     // hack: the receiver's latency flows
             //printf("num big flows = %d; split_level = %d; chunk_size = %d\n", num_big, __atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED), chunk_size);
             __atomic_store_n(&cb.sb->active_chunk_size, chunk_size, __ATOMIC_RELAXED);
+            if (chunk_size != traced_chunk_size) {
+                trace(TRACE_CHUNK, 0, chunk_size);
+                traced_chunk_size = chunk_size;
+            }
             //__atomic_store_n(&cb.sb->active_batch_ops, DEFAULT_BATCH_OPS * chunk_size/DEFAULT_CHUNK_SIZE, __ATOMIC_RELAXED);  // not used
             __atomic_store_n(&cb.sb->active_batch_ops, DEFAULT_BATCH_OPS, __ATOMIC_RELAXED);
             //__atomic_fetch_add(&cb.tokens, 10, __ATOMIC_RELAXED);
             //wait_time.tv_nsec = 10 * chunk_size / temp * 1000;
 
+            /* reserved tput flows are served first, from their own buckets */
+#ifndef CPU_FRIENDLY
+            reserve_debt += serve_reservations(&reserved, cpu_mhz, chunk_size);
+#endif
+
             // try to fetch tokens for flows until we are out of tokens
             i = next_idx;
 
@@ -609,20 +627,27 @@ static void generate_fetch_tokens()
             //struct timeval tt1, tt2;
 #endif
             while (1) {
+#ifdef SRPT_GRANTS
+                /* the waiting flow with the least left of its message, aged so elephants still get tokens */
+                while ((i = srpt_pick(&cb.sb->flows[0].pending, &cb.sb->flows[0].read, sizeof(struct flow_info),
+                                      cb.sb->msg_left, srpt_since, srpt_grants, __atomic_load_n(&cb.num_slots, __ATOMIC_RELAXED),
+                                      next_idx)) < 0)
+                    cpu_relax();
+#else
+                /* the next waiting flow round-robin */
+                while ((i = rr_pick(&cb.sb->flows[0].pending, &cb.sb->flows[0].read, sizeof(struct flow_info),
+                                    __atomic_load_n(&cb.num_slots, __ATOMIC_RELAXED), next_idx)) < 0)
+                    cpu_relax();
+#endif
                 if (!__atomic_load_n(&cb.sb->flows[i].read, __ATOMIC_RELAXED) && __atomic_load_n(&cb.sb->flows[i].pending, __ATOMIC_RELAXED)) {
                     if (try_fetch_a_token()) {
-                        __atomic_store_n(&cb.sb->flows[i].pending, 0, __ATOMIC_RELAXED);
-                        //// UDS_IMPL
-#ifdef CPU_FRIENDLY
-                        //gettimeofday(&tt1,NULL);
-                        if (send(flow_sockets[i], "0", 1, 0) == -1) {
-                            perror("error sending token: ");
-                            exit(1);
-                        }
+#ifdef SRPT_GRANTS
+                        srpt_since[i] = ++srpt_grants;
 #endif
+                        //gettimeofday(&tt1,NULL);
+                        grant(i, TRACE_GRANT_SHARED);
                         //gettimeofday(&tt2,NULL);
                         //printf("elaspsed time = %d us\n", tt2.tv_usec - tt1.tv_usec);
-                        ////
                         //printf("fetched for flow %d\n", i);
                         next_idx = (i + 1) % MAX_FLOWS;
                         break;
@@ -649,15 +674,29 @@ static void generate_fetch_tokens()
                     //while (get_cycles() - start_cycle < (cpu_mhz * chunk_size / temp) / SPLIT_QP_NUM_ONE_SIDED)
 #ifndef USE_TIMEFRAME
 #ifdef CPU_FRIENDLY
-                    while (get_cycles() - start_cycle < cpu_mhz * BIG_CHUNK_SIZE / temp)      // number of cycles needed to send 1 1MB-chunk at current virtual link rate
+                    while (get_cycles() - start_cycle < token_cycles(tsc_khz, BIG_CHUNK_SIZE, temp))      // number of cycles needed to send 1 1MB-chunk at current virtual link rate
 #else
-                    while (get_cycles() - start_cycle < cpu_mhz * chunk_size / temp)      // number of cycles needed to send 1 split chunk at current virtual link rate
+                    while (get_cycles() - start_cycle < token_cycles(tsc_khz, chunk_size, temp))      // number of cycles needed to send 1 split chunk at current virtual link rate
 #endif
 #else
                     while (get_cycles() - start_cycle < cpu_mhz * TIMEFRAME)      // number of cycles needed to send 1 split chunk at current virtual link rate
+#endif
+                    {
+#ifndef CPU_FRIENDLY
+                        reserve_debt += serve_reservations(&reserved, cpu_mhz, chunk_size);
 #endif
                         cpu_relax();
+                    }
                     start_cycle = get_cycles();
+#ifndef CPU_FRIENDLY
+                    /* a token the reservations took already: the virtual link stays at its rate */
+                    if (reserve_debt) {
+                        if (reserve_debt > RESERVE_MAX * RESERVE_BURST)
+                            reserve_debt = RESERVE_MAX * RESERVE_BURST;
+                        reserve_debt--;
+                        continue;
+                    }
+#endif
                     __atomic_fetch_add(&cb.tokens, 1, __ATOMIC_RELAXED);
                 }
             }
@@ -666,75 +705,454 @@ static void generate_fetch_tokens()
     }
 }
 
+/* The READ threads while there is no big READ to pace, or none waits: they sleep instead of
+ * spinning on a core for flows that may never come, READ_BACKOFF_US at first and twice as long
+ * each time up to READ_BACKOFF_MAX_US. rate_limit_read polls pending for READ_IDLE_US after a
+ * READ last waited, as the grants of the single-core pacer do. */
+#define READ_IDLE_US        1000
+#define READ_BACKOFF_US     10
+#define READ_BACKOFF_MAX_US 100
+
+static void read_backoff(useconds_t *us)
+{
+    *us = *us ? *us * 2 : READ_BACKOFF_US;
+    if (*us > READ_BACKOFF_MAX_US)
+        *us = READ_BACKOFF_MAX_US;
+    usleep(*us);
+}
+
 static void generate_tokens_read()
 {
     cycles_t start_cycle = 0;
-    int cpu_mhz = get_cpu_mhz(1);
+    uint32_t tsc_khz = cb.sb->tsc.khz;
     int start_flag = 1;
-    // struct timespec wait_time;
+    useconds_t backoff = 0;
+    uint64_t interval, us;
 
-    /* infinite loop: generate tokens at a rate calculated 
-     * from virtual_link_cap and active chunk size 
+    /* infinite loop: generate tokens at the rate the responder granted the big READs,
+     * sleeping while there are none
      */
-    uint32_t temp, chunk_size;
-    uint16_t num_read;
+    uint32_t temp, chunk_size, traced_chunk_size = 0;
+    trace_thread(TRACE_RING_READ_TOKENS);
     while (1)
     {
-        if ((num_read = __atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED)))
+        if (!__atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED))
         {
-            // temp = 4999; // for testing
-            if ((temp = __atomic_load_n(&cb.local_read_rate, __ATOMIC_RELAXED)))
-            {
-                //TODO: note the table is no longer used
-                //chunk_size = chunk_size_table[temp / num_read / 1000];
-                ////chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->num_active_split_qps, __ATOMIC_RELAXED) - 1];
-                /* adjust chunk size based on split_level */
-                chunk_size = chunk_size_table[__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) - 1];
-                if (__atomic_load_n(&cb.sb->split_level, __ATOMIC_RELAXED) > 1) {
-                    chunk_size = chunk_size_table[0];
-                } else {
-                    chunk_size = chunk_size_table[1];
-                }
-
-                __atomic_store_n(&cb.sb->active_chunk_size_read, chunk_size, __ATOMIC_RELAXED);
-                // __atomic_fetch_add(&cb.tokens, 10, __ATOMIC_RELAXED);
-                // wait_time.tv_nsec = 10 * chunk_size / temp * 1000;
-                if (__atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED) < MAX_TOKEN)
-                {
-                    if (start_flag)
-                    {
-                        start_flag = 0;
-                        start_cycle = get_cycles();
-                        __atomic_fetch_add(&cb.tokens_read, 1, __ATOMIC_RELAXED);
-                    }
-                    else
-                    {
-                        while (get_cycles() - start_cycle < cpu_mhz * chunk_size / temp)
-                            cpu_relax();
-                        start_cycle = get_cycles();
-                        __atomic_fetch_add(&cb.tokens_read, 1, __ATOMIC_RELAXED);
-                    }
-                }
-            }
+            start_flag = 1;         /* the next big READ starts from one token, not a backlog */
+            read_backoff(&backoff);
+            continue;
+        }
+        backoff = 0;
+        temp = read_rate(__atomic_load_n(&cb.local_read_rate, __ATOMIC_RELAXED), cb.line_rate);
+        chunk_size = read_chunk_size(temp, cb.line_rate);
+
+        __atomic_store_n(&cb.sb->active_chunk_size_read, chunk_size, __ATOMIC_RELAXED);
+        if (chunk_size != traced_chunk_size) {
+            trace(TRACE_CHUNK, 1, chunk_size);
+            traced_chunk_size = chunk_size;
+        }
+#ifdef CPU_FRIENDLY
+        interval = token_cycles(tsc_khz, BIG_CHUNK_SIZE, temp);      // a token covers 1 1MB-chunk of small READ chunks
+#else
+        interval = token_cycles(tsc_khz, chunk_size, temp);
+#endif
+        if (__atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED) >= MAX_TOKEN)
+        {
+            /* full until rate_limit_read takes one: sleep a token's time when it is worth a sleep */
+            us = interval * 1000 / tsc_khz;
+            if (us >= READ_BACKOFF_US)
+                usleep(us > READ_BACKOFF_MAX_US ? READ_BACKOFF_MAX_US : us);
+            else
+                cpu_relax();
+            continue;
+        }
+        if (start_flag)
+        {
+            start_flag = 0;
+            start_cycle = get_cycles();
+            __atomic_fetch_add(&cb.tokens_read, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            while (get_cycles() - start_cycle < interval)
+                cpu_relax();
+            start_cycle = get_cycles();
+            __atomic_fetch_add(&cb.tokens_read, 1, __ATOMIC_RELAXED);
         }
-        // nanosleep(&wait_time, NULL);
     }
 }
 
+/* grants the waiting big READs a read token each, round-robin over the slots handed out; with
+ * none waiting for READ_IDLE_US it looks less and less often, and not at all without big READs */
 void rate_limit_read()
 {
-    int i;
+    int i, next = 0;
+    cycles_t idle_since = get_cycles();
+    uint64_t idle = (uint64_t)cb.sb->tsc.khz * READ_IDLE_US / 1000;
+    useconds_t backoff = 0;
+
+    trace_thread(TRACE_RING_READ);
     while (1)
     {
-        for (i = 0; i < MAX_FLOWS; i++)
+        if (__atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED) &&
+            (i = rr_pick_read(&cb.sb->flows[0].pending, &cb.sb->flows[0].read, sizeof(struct flow_info),
+                              __atomic_load_n(&cb.num_slots, __ATOMIC_RELAXED), next)) >= 0)
         {
-            if (__atomic_load_n(&cb.sb->flows[i].read, __ATOMIC_RELAXED) && __atomic_load_n(&cb.sb->flows[i].pending, __ATOMIC_RELAXED))
+            if (fetch_token_read())
             {
-                fetch_token_read();
-                __atomic_store_n(&cb.sb->flows[i].pending, 0, __ATOMIC_RELAXED);
+                grant(i, TRACE_GRANT_READ);
+                next = i + 1;
             }
+            idle_since = get_cycles();
+            backoff = 0;
+        }
+        else if (get_cycles() - idle_since < idle)
+            cpu_relax();
+        else
+            read_backoff(&backoff);
+    }
+}
+
+/* The pacer on a single core (-s, runtime.h). The token threads, the monitor and the flow
+ * handler become tasks of one loop on a pinned cpu: the token buckets are timers crediting what
+ * their interval earned, grants poll pending while flows wait and back off when none has for
+ * COOP_IDLE_US, the monitor's rounds are a timer and the probes are polled until they are back,
+ * and the control socket and the peers' updates are fds the loop sleeps on. With no flow joined
+ * and nothing for the monitor to tell, nothing is armed and the loop sleeps until a join.
+ * A join is answered once the monitor has connected to its peers, as the loop starts after it.
+ */
+#define COOP_IDLE_US        1000    /* grants stop polling pending once none waited this long */
+#define COOP_BACKOFF_US     10      /* then look at pending this often, doubling up to */
+#define COOP_BACKOFF_MAX_US 100
+
+struct coop {
+    struct runtime rt;
+    struct monitor_param *params;
+    struct monitor *m;
+    struct ctl_server srv;
+    struct rt_task tokens, read_tokens, grants, beat, probe, updates, ctl;
+    uint64_t last, last_read;                   /* tsc the buckets are credited up to */
+    uint64_t interval, interval_read;           /* cycles a token takes */
+    uint64_t idle_since, backoff;
+    int next_idx, read_idx;
+    uint32_t traced_chunk_size, traced_chunk_size_read;
+#ifndef CPU_FRIENDLY
+    struct reserve_set reserved;                /* buckets of the reservations admitted */
+    uint32_t reserve_debt;                      /* tokens granted from reservations the shared ones still owe */
+#endif
+};
+
+static struct coop coop;
+
+/* grants look at pending on every pass again */
+static void coop_grants_on(uint64_t now)
+{
+    if (coop.grants.polled)
+        return;
+    rt_cancel(&coop.rt, &coop.grants);
+    rt_poll(&coop.rt, &coop.grants, 1);
+    coop.idle_since = now;
+    coop.backoff = 0;
+}
+
+/* arms what the joined flows and the monitor need; with neither, the loop sleeps */
+static void coop_kick(uint64_t now)
+{
+    struct runtime *rt = &coop.rt;
+
+    if (cb.num_joined) {
+        if (!coop.tokens.armed) {
+            coop.last = now;
+            rt_at(rt, &coop.tokens, now);
+        }
+        if (!coop.read_tokens.armed && __atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED)) {
+            coop.last_read = now;
+            rt_at(rt, &coop.read_tokens, now);
         }
+        if (!coop.beat.armed)
+            rt_at(rt, &coop.beat, now);
+        coop_grants_on(now);
+    }
+    if ((cb.num_joined || monitor_busy(coop.m)) && !coop.probe.armed && !coop.probe.polled)
+        rt_at(rt, &coop.probe, now);
+}
+
+/* generate_fetch_tokens' bucket: the tokens the interval earned since the last credit */
+static void coop_tokens(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    uint32_t temp, chunk_size, n;
+    uint64_t tokens;
+
+    trace_thread(TRACE_RING_TOKENS);
+    if (!cb.num_joined)
+        return;                     /* coop_kick starts it on the next join */
+    if (!(temp = __atomic_load_n(&cb.sb->virtual_link_cap, __ATOMIC_RELAXED))) {
+        coop.last = now;
+        rt_at(rt, t, now + rt_cycles(rt, MONITOR_PERIOD_US * 1000));
+        return;
+    }
+    chunk_size = token_chunk_size(temp, cb.line_rate, cb.num_receiver_small_flows[0]);     // hack: the receiver's latency flows
+    __atomic_store_n(&cb.sb->active_chunk_size, chunk_size, __ATOMIC_RELAXED);
+    if (chunk_size != coop.traced_chunk_size) {
+        trace(TRACE_CHUNK, 0, chunk_size);
+        coop.traced_chunk_size = chunk_size;
+    }
+#ifdef CPU_FRIENDLY
+    coop.interval = token_cycles(rt->tsc_khz, BIG_CHUNK_SIZE, temp);
+#else
+    coop.interval = token_cycles(rt->tsc_khz, chunk_size, temp);
+#endif
+    if (!coop.interval)
+        coop.interval = 1;
+    n = (now - coop.last) / coop.interval;
+    coop.last += n * coop.interval;
+#ifndef CPU_FRIENDLY
+    /* tokens the reservations took already: the virtual link stays at its rate */
+    if (coop.reserve_debt > RESERVE_MAX * RESERVE_BURST)
+        coop.reserve_debt = RESERVE_MAX * RESERVE_BURST;
+    if (n < coop.reserve_debt) {
+        coop.reserve_debt -= n;
+        n = 0;
+    } else {
+        n -= coop.reserve_debt;
+        coop.reserve_debt = 0;
+    }
+#endif
+    tokens = __atomic_load_n(&cb.tokens, __ATOMIC_RELAXED);
+    if (tokens + n >= MAX_TOKEN) {
+        /* full: it stays so until a grant takes one, which starts it again */
+        __atomic_store_n(&cb.tokens, MAX_TOKEN, __ATOMIC_RELAXED);
+        coop.last = now;
+        coop_grants_on(now);
+        return;
+    }
+    if (n) {
+        __atomic_fetch_add(&cb.tokens, n, __ATOMIC_RELAXED);
+        coop_grants_on(now);
     }
+    rt_at(rt, t, coop.last + coop.interval);
+}
+
+/* generate_tokens_read's bucket, while there are big READs */
+static void coop_read_tokens(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    uint32_t temp, chunk_size, n;
+    uint64_t tokens;
+
+    trace_thread(TRACE_RING_READ_TOKENS);
+    if (!cb.num_joined || !__atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED))
+        return;                     /* coop_kick starts it when there are */
+    temp = read_rate(__atomic_load_n(&cb.local_read_rate, __ATOMIC_RELAXED), cb.line_rate);
+    chunk_size = read_chunk_size(temp, cb.line_rate);
+    __atomic_store_n(&cb.sb->active_chunk_size_read, chunk_size, __ATOMIC_RELAXED);
+    if (chunk_size != coop.traced_chunk_size_read) {
+        trace(TRACE_CHUNK, 1, chunk_size);
+        coop.traced_chunk_size_read = chunk_size;
+    }
+#ifdef CPU_FRIENDLY
+    coop.interval_read = token_cycles(rt->tsc_khz, BIG_CHUNK_SIZE, temp);      // a token covers 1 1MB-chunk of small READ chunks
+#else
+    coop.interval_read = token_cycles(rt->tsc_khz, chunk_size, temp);
+#endif
+    if (!coop.interval_read)
+        coop.interval_read = 1;
+    n = (now - coop.last_read) / coop.interval_read;
+    coop.last_read += n * coop.interval_read;
+    tokens = __atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED);
+    if (tokens + n >= MAX_TOKEN) {
+        __atomic_store_n(&cb.tokens_read, MAX_TOKEN, __ATOMIC_RELAXED);
+        coop.last_read = now;
+        coop_grants_on(now);
+        return;
+    }
+    if (n) {
+        __atomic_fetch_add(&cb.tokens_read, n, __ATOMIC_RELAXED);
+        coop_grants_on(now);
+    }
+    rt_at(rt, t, coop.last_read + coop.interval_read);
+}
+
+/* one grant of each kind a flow waits for, as generate_fetch_tokens and rate_limit_read make them */
+static void coop_grants(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    int n = __atomic_load_n(&cb.num_slots, __ATOMIC_RELAXED), waiting = 0, more = 0, i;
+
+    if (!cb.num_joined) {
+        rt_poll(rt, t, 0);
+        return;
+    }
+    trace_thread(TRACE_RING_TOKENS);
+#ifndef CPU_FRIENDLY
+    /* reserved tput flows are served first, from their own buckets */
+    coop.reserve_debt += serve_reservations(&coop.reserved, rt->tsc_khz / 1000.0,
+                                            __atomic_load_n(&cb.sb->active_chunk_size, __ATOMIC_RELAXED));
+    more = coop.reserved.n;
+#endif
+#ifdef SRPT_GRANTS
+    /* the waiting flow with the least left of its message, aged so elephants still get tokens */
+    i = srpt_pick(&cb.sb->flows[0].pending, &cb.sb->flows[0].read, sizeof(struct flow_info), cb.sb->msg_left,
+                  srpt_since, srpt_grants, n, coop.next_idx);
+#else
+    /* the next waiting flow round-robin */
+    i = rr_pick(&cb.sb->flows[0].pending, &cb.sb->flows[0].read, sizeof(struct flow_info), n, coop.next_idx);
+#endif
+    if (i >= 0) {
+        waiting = 1;
+        if (try_fetch_a_token()) {
+#ifdef SRPT_GRANTS
+            srpt_since[i] = ++srpt_grants;
+#endif
+            grant(i, TRACE_GRANT_SHARED);
+            coop.next_idx = (i + 1) % MAX_FLOWS;
+            if (!coop.tokens.armed)
+                rt_at(rt, &coop.tokens, now + coop.interval);
+        } else {
+            coop.next_idx = i;
+        }
+    }
+    if (__atomic_load_n(&cb.num_big_read_flows, __ATOMIC_RELAXED)) {
+        trace_thread(TRACE_RING_READ);
+        i = rr_pick_read(&cb.sb->flows[0].pending, &cb.sb->flows[0].read, sizeof(struct flow_info), n, coop.read_idx);
+        if (i >= 0) {
+            waiting = 1;
+            if (__atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED)) {
+                __atomic_fetch_sub(&cb.tokens_read, 1, __ATOMIC_RELAXED);
+                grant(i, TRACE_GRANT_READ);
+                coop.read_idx = i + 1;
+                if (!coop.read_tokens.armed)
+                    rt_at(rt, &coop.read_tokens, now + coop.interval_read);
+            }
+        }
+    }
+
+    if (waiting) {
+        /* with no token to grant them, the buckets start polling again when they credit one */
+        more |= __atomic_load_n(&cb.tokens, __ATOMIC_RELAXED) || __atomic_load_n(&cb.tokens_read, __ATOMIC_RELAXED);
+        if (more)
+            coop_grants_on(now);
+        else
+            rt_poll(rt, t, 0);
+        coop.idle_since = now;
+        coop.backoff = 0;
+        return;
+    }
+    if (t->polled && now - coop.idle_since < rt_cycles(rt, COOP_IDLE_US * 1000))
+        return;
+    /* none waited for a while: look at pending less and less often */
+    rt_poll(rt, t, 0);
+    coop.backoff = coop.backoff ? coop.backoff * 2 : rt_cycles(rt, COOP_BACKOFF_US * 1000);
+    if (coop.backoff > rt_cycles(rt, COOP_BACKOFF_MAX_US * 1000))
+        coop.backoff = rt_cycles(rt, COOP_BACKOFF_MAX_US * 1000);
+    rt_at(rt, t, now + coop.backoff);
+}
+
+/* heartbeat, while a flow may wait on pending */
+static void coop_beat(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    __atomic_fetch_add(&cb.sb->heartbeat, 1, __ATOMIC_RELAXED);
+    if (cb.num_joined)
+        rt_at(rt, t, now + rt_cycles(rt, HEARTBEAT_US * 1000));
+}
+
+/* a sender's monitor_latency, a round every MONITOR_PERIOD_US with the probes polled until they
+ * are back; a receiver's server_loop, serving its senders while there is news for them */
+static void coop_probe(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    int ret;
+
+    trace_thread(TRACE_RING_MONITOR);
+    if (!coop.params->is_client) {
+        if (monitor_serve(coop.m)) {
+            rt->stop = 1;
+            return;
+        }
+        if (monitor_busy(coop.m))
+            rt_at(rt, t, now);
+        return;
+    }
+    if (!t->polled) {
+        if (monitor_round(coop.m)) {
+            rt->stop = 1;
+            return;
+        }
+        rt_poll(rt, t, 1);
+    }
+    if ((ret = monitor_reap(coop.m, 0)) < 0) {
+        rt->stop = 1;
+        return;
+    }
+    if (!ret)
+        return;
+    rt_poll(rt, t, 0);
+    if (cb.num_joined || monitor_busy(coop.m))
+        rt_at(rt, t, now + rt_cycles(rt, MONITOR_PERIOD_US * 1000));
+}
+
+/* the peers' updates */
+static void coop_updates(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    trace_thread(TRACE_RING_MONITOR);
+    if (monitor_updates(coop.m)) {
+        rt->stop = 1;
+        return;
+    }
+    coop_kick(now);
+}
+
+/* the control socket: joins, leaves and apps arriving or exiting */
+static void coop_ctl(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    trace_thread(TRACE_RING_CTL);
+    if (ctl_server_poll(&coop.srv, 0)) {
+        rt->stop = 1;
+        return;
+    }
+    coop_kick(now);
+}
+
+/* runs the pacer on the calling thread, pinned; returns when the monitor stops */
+static void coop_run(struct monitor_param *params)
+{
+    int fds[MAX_CLIENTS], n, i;
+
+    if (placement_pin("pacer", TOKEN_CPUS_ENV, 0, cb.nic_node))
+        printf("warning: cannot pin the pacer to a cpu\n");
+    if (rt_init(&coop.rt, cb.sb->tsc.khz))
+        error("rt_init");
+    coop.params = params;
+    coop.tokens = (struct rt_task){ .run = coop_tokens, .name = "tokens" };
+    coop.read_tokens = (struct rt_task){ .run = coop_read_tokens, .name = "read_tokens" };
+    coop.grants = (struct rt_task){ .run = coop_grants, .name = "grants" };
+    coop.beat = (struct rt_task){ .run = coop_beat, .name = "heartbeat" };
+    coop.probe = (struct rt_task){ .run = coop_probe, .name = params->is_client ? "monitor_latency" : "server_loop" };
+    coop.updates = (struct rt_task){ .run = coop_updates, .name = "updates" };
+    coop.ctl = (struct rt_task){ .run = coop_ctl, .name = "flow_handler" };
+
+    coop.traced_chunk_size = DEFAULT_CHUNK_SIZE;
+    __atomic_store_n(&cb.sb->active_chunk_size, DEFAULT_CHUNK_SIZE, __ATOMIC_RELAXED);
+    trace_thread(TRACE_RING_TOKENS);
+    trace(TRACE_CHUNK, 0, DEFAULT_CHUNK_SIZE);
+    __atomic_store_n(&cb.sb->active_batch_ops, DEFAULT_BATCH_OPS, __ATOMIC_RELAXED);
+    __atomic_store_n(&cb.tokens, 1, __ATOMIC_RELAXED);
+
+    /* a beat before the epoch is published */
+    __atomic_fetch_add(&cb.sb->heartbeat, 1, __ATOMIC_RELAXED);
+    trace_thread(TRACE_RING_CTL);
+    ctl_open(&coop.srv, params);
+    if (rt_watch(&coop.rt, &coop.ctl, coop.srv.epfd))
+        error("rt_watch: flow_handler");
+
+    coop.m = monitor_open(params);
+    if ((n = monitor_fds(coop.m, fds, MAX_CLIENTS)) < 0)
+        error("monitor_fds");
+    for (i = 0; i < n; i++)
+        if (rt_watch(&coop.rt, &coop.updates, fds[i]))
+            error("rt_watch: updates");
+
+    coop_kick(get_cycles());
+    rt_run(&coop.rt);
+    printf("single-core pacer stopped: %" PRIu64 " passes, %" PRIu64 " sleeps\n", coop.rt.passes, coop.rt.sleeps);
+    rt_close(&coop.rt);
 }
 
 int main(int argc, char **argv)
@@ -760,12 +1178,40 @@ int main(int argc, char **argv)
     atexit(rm_shmem_on_exit);
 
     int fd_shm, i;
-    pthread_t th1, th2, th3;
-    //pthread_t th1, th2, th3, th4, th5;
+    pthread_t th1, th2, th3, th4, th5, th6, th7;
+    pthread_attr_t attr2, attr3, attr4, attr5;
+    char dev_name[IBV_SYSFS_NAME_MAX] = "", dev_path[256];
+    struct ibv_port_attr port_attr;
+    const char *dev = NULL;
+    int port = 1, opt, single_core = 0;
+    uint32_t line_rate = 0;
     struct monitor_param params;
     params.num_clients = 0;
     char *endPtr;
 
+    /* the device port to pace (port.h); the arguments after the options are as they were */
+    while ((opt = getopt(argc, argv, "d:i:r:s")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'i':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            line_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            single_core = 1;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     /*
     FILE* fp = fopen(argv[2], "r");
     char line[256];
@@ -813,8 +1259,25 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    /* the port paced names the shared block and the control socket, and gives the line rate */
+    if (pp_select_port(dev, port, dev_name, dev_path, sizeof(dev_path), &port_attr)) {
+        if (dev) {
+            fprintf(stderr, "no port %d on %s\n", port, dev);
+            exit(1);
+        }
+        printf("no device found to pace\n");
+    } else {
+        port_block_name(shm_name, sizeof(shm_name), SHARED_MEM_NAME, dev_name, port);
+        if (!line_rate && !(line_rate = port_line_rate(port_attr.active_speed, port_attr.active_width)))
+            printf("warning: %s port %d: speed %d width %d not known\n", dev_name, port,
+                   port_attr.active_speed, port_attr.active_width);
+    }
+    cb.line_rate = line_rate ? line_rate : LINE_RATE_MB;
+    printf("pacing %s port %d at %u MBps, shared block %s\n", dev_name[0] ? dev_name : "-", port, cb.line_rate,
+           shm_name);
+
     /* allocate shared memory */
-    if ((fd_shm = shm_open(SHARED_MEM_NAME, O_RDWR | O_CREAT, 0666)) < 0)
+    if ((fd_shm = shm_open(shm_name, O_RDWR | O_CREAT, 0666)) < 0)
         error("shm_open");
 
     if (ftruncate(fd_shm, sizeof(struct shared_block)) < 0)
@@ -824,17 +1287,37 @@ int main(int argc, char **argv)
                       PROT_WRITE | PROT_READ, MAP_SHARED, fd_shm, 0)) == MAP_FAILED)
         error("mmap");
 
+    /* the NIC's NUMA node (placement.h): the pacer's threads run there, and the shared block's
+     * memory is bound there before it is first touched */
+    cb.nic_node = dev_name[0] ? nic_node(dev_path) : -1;
+    if (cb.nic_node >= 0) {
+        printf("NIC %s on node %d\n", dev_name, cb.nic_node);
+        if (place_on_node(cb.nic_node))
+            printf("warning: cannot keep the pacer's threads to node %d\n", cb.nic_node);
+        if (mem_bind_node(cb.sb, sizeof(struct shared_block), cb.nic_node))
+            perror("mbind: shared block left where it is");
+    } else {
+        printf("NIC's NUMA node unknown; threads and shared block placed by the kernel\n");
+    }
+
     /* initialize control block */
     cb.tokens = 0;
     cb.tokens_read = 0;
     cb.num_big_read_flows = 0;
     //cb.virtual_link_cap = LINE_RATE_MB;
-    cb.local_read_rate = LINE_RATE_MB;
+    cb.local_read_rate = cb.line_rate;      /* until a responder grants a share of its virtual link */
     cb.next_slot = 0;
+    cb.num_slots = 0;
+    cb.num_joined = 0;
+    cb.reserved_mb = 0;
+    cb.reserve_gen = 0;
+    cb.notify_big = 0;
+    cb.notify_small = 0;
+    cb.notify_read = 0;
     cb.sb->active_chunk_size = DEFAULT_CHUNK_SIZE;
     cb.sb->active_chunk_size_read = DEFAULT_CHUNK_SIZE;
     cb.sb->active_batch_ops = DEFAULT_BATCH_OPS;
-    cb.sb->virtual_link_cap = LINE_RATE_MB;
+    cb.sb->virtual_link_cap = cb.line_rate;
     //cb.sb->num_active_split_qps = DEFAULT_NUM_SPLIT_QPS;    /* should always be 1 for now */
 #ifdef DYNAMIC_CPU_OPT
     cb.sb->split_level = 1;        /* starts with 0 waiting interval */
@@ -844,18 +1327,57 @@ int main(int argc, char **argv)
 #endif
     cb.sb->num_active_big_flows = 0;
     cb.sb->num_active_small_flows = 0; /* cancel out pacer's monitor flow */
+    cb.sb->tail_ref_ns = 0;
+    cb.sb->tail_app_ns = 0;
     for (i = 0; i < MAX_FLOWS; i++) {
         cb.sb->flows[i].pending = 0;
         cb.sb->flows[i].active = 0;
+        memset(&cb.sb->lat_hist[i], 0, sizeof(struct lat_hist));
+        cb.sb->msg_left[i] = 0;
+        memset(&cb.sb->stats[i], 0, sizeof(struct flow_stats));
         cb.pid_list[i] = -1;
         cb.tid_list[i] = -1;
+        cb.qpn_list[i] = 0;
+        cb.reserved_rate[i] = 0;
     }
     for (i = 0; i < MAX_SERVERS; i++) {
         cb.app_vaddrs[i] = 0;
+        cb.remote_read_rate[i] = 0;
         cb.num_receiver_big_flows[i] = 0;
         cb.num_receiver_small_flows[i] = 0;
     }
 
+    /* the port paced, for the tools */
+    snprintf(cb.sb->port.dev, sizeof(cb.sb->port.dev), "%s", dev_name);
+    cb.sb->port.num = port;
+    cb.sb->port.line_rate = cb.line_rate;
+
+    /* the TSC's rate for the pacer's threads, the drivers and the tools */
+    tsc_publish(&cb.sb->tsc);
+
+    /* event trace (trace.h), opened before the threads that write it start */
+    if (getenv(TRACE_ENV)) {
+        printf("tracing to %s...\n", getenv(TRACE_ENV));
+        if (trace_open(getenv(TRACE_ENV), cb.sb->tsc.khz / 1000.0))
+            error("trace_open");
+        if (pthread_create(&th6, NULL, (void *(*)(void *)) & trace_drain, NULL))
+        {
+            error("pthread_create: trace_drain");
+        }
+    }
+
+    /* everything on one core (-s): returns when the monitor stops, as the monitor thread would */
+    if (single_core) {
+        coop_run(&params);
+        return 0;
+    }
+
+    /* the heartbeat starts before the epoch is published */
+    if (pthread_create(&th7, NULL, (void *(*)(void *)) & heartbeat, NULL))
+    {
+        error("pthread_create: heartbeat");
+    }
+
     /* start thread handling incoming flows */
     printf("starting thread for flow handling...\n");
     if (pthread_create(&th1, NULL, (void *(*)(void *)) & flow_handler, (void *)&params))
@@ -866,14 +1388,14 @@ int main(int argc, char **argv)
     if (params.is_client) {
         /* start monitoring thread */
         printf("starting thread for latency monitoring...\n");
-        if (pthread_create(&th2, NULL, (void *(*)(void *)) & monitor_latency, (void *)&params))
+        if (pthread_create(&th2, placed(&attr2, "monitor_latency", MONITOR_CPUS_ENV, 0), (void *(*)(void *)) & monitor_latency, (void *)&params))
         {
             error("pthread_create: monitor_latency");
         }
     } else {
         /* start server loop thread */
         printf("starting thread for server loop...\n");
-        if (pthread_create(&th2, NULL, (void *(*)(void *)) & server_loop, (void *)&params))
+        if (pthread_create(&th2, placed(&attr2, "server_loop", MONITOR_CPUS_ENV, 0), (void *(*)(void *)) & server_loop, (void *)&params))
         {
             error("pthread_create: server_loop");
         }
@@ -882,33 +1404,22 @@ int main(int argc, char **argv)
 
     /* start token generating thread */
     printf("starting thread for token generating...\n");
-    if (pthread_create(&th3, NULL, (void *(*)(void *)) & generate_fetch_tokens, NULL))
+    if (pthread_create(&th3, placed(&attr3, "generate_fetch_tokens", TOKEN_CPUS_ENV, 0), (void *(*)(void *)) & generate_fetch_tokens, NULL))
     {
         error("pthread_create: generate_fetch_tokens");
     }
 
-    /*
     printf("starting thread for token generating for read...\n");
-    if (pthread_create(&th4, NULL, (void *(*)(void *)) & generate_tokens_read, NULL))
+    if (pthread_create(&th4, placed(&attr4, "generate_tokens_read", TOKEN_CPUS_ENV, 1), (void *(*)(void *)) & generate_tokens_read, NULL))
     {
         error("pthread_create: generate_tokens_read");
     }
 
     printf("starting thread for rate limiting big read flows...\n");
-    if (pthread_create(&th5, NULL, (void *(*)(void *)) & rate_limit_read, NULL))
+    if (pthread_create(&th5, placed(&attr5, "rate_limit_read", TOKEN_CPUS_ENV, 2), (void *(*)(void *)) & rate_limit_read, NULL))
     {
         error("pthread_create: rate_limit_read");
     }
-    */
-
-    /* logging thread */
-    /*
-    printf("starting thread for logging...\n");
-    if (pthread_create(&th6, NULL, (void *(*)(void *)) & logging_tokens, NULL))
-    {
-        error("pthread_create: logging_tokens");
-    }
-    */
 
     void *res;
     pthread_join(th2, &res);
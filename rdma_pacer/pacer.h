@@ -17,22 +17,27 @@
 #include <pthread.h>
 #include <signal.h>
 #include "pingpong.h"
+#include "lat_hist.h"
+#include "policy.h"
+#include "port.h"
 
 #define SHARED_MEM_NAME "/rdma-fairness"
 #define MAX_FLOWS 512
 #define MAX_CLIENTS 36      // clients per server
 #define MAX_SERVERS 4       // servers (receivers) per clients
-// IMPORTANT: use the correct line rate
+// the line rate is the port's (port.h); this one is for a pacer that cannot query its port
 #define LINE_RATE_MB 22500 /* MBps */    // 200Gbps
 //#define LINE_RATE_MB 12000 /* MBps */     // 100Gbps
 //#define LINE_RATE_MB 1100 /* MBps */      // 10Gbps
 //#define LINE_RATE_MB 4400 /* MBps */      // 40Gbps
 //#define LINE_RATE_MB 6000 /* MBps */        // 56Gbps
-#define MSG_LEN 24
+#define MSG_LEN 32
 #define SOCK_PATH "/users/yiwenzhg/rdma_socket"
-#define ELEPHANT_HAS_LOWER_BOUND 1  /* whether elephant has a minimum virtual link cap set by AIMD */
+#define MAX_RESERVED_MB (cb.line_rate / 2)  /* MBps tput flows may reserve at join in all (reserve.h); the rest is left to the AIMD */
+#define HEARTBEAT_US 1000          /* the heartbeat in the shared block moves this often; the drivers fail open when it stops */
 #define TABLE_SIZE 7
 //#define FAVOR_BIG_FLOW
+//#define SRPT_GRANTS               // grant tokens to the bw flow with the least left of its message first (srpt.h), not round-robin
 //#define SMART_RMF
 //#define USE_TIMEFRAME
 //#define DYNAMIC_NUM_SPLIT_QPS
@@ -48,7 +53,6 @@
 #define INCAST_ACTIVE_CHUNK_SIZE 1000
 #define INCAST_SAFEUTIL 550
 #define INCAST_SPLIT_LEVEL 2
-#define TREAT_L_AS_ONE
 //#define HACK_APP_NUMS               // for easy debugging purposes
 #define HACK_NUM_BW_APP 8
 #define HACK_NUM_LAT_APP 1
@@ -59,6 +63,35 @@ struct flow_info {
     uint8_t read;
 };
 
+/* The TSC's rate, calibrated once by the pacer (get_tsc_khz) and published for the drivers and
+ * tools, so that all of them convert cycles alike and none has to time the TSC itself. */
+#define TSC_NS_SHIFT 16
+struct tsc_clock {
+    uint32_t khz;                           /* tsc cycles per ms; 0 until published, stored last */
+    uint32_t ns_mult;                       /* ns = cycles * ns_mult >> TSC_NS_SHIFT */
+    uint32_t invariant;                     /* ticks at khz whatever the core's clock does */
+    uint32_t pad;
+};
+
+static inline uint64_t tsc_ns(const struct tsc_clock *c, uint64_t cycles)
+{
+    return cycles * c->ns_mult >> TSC_NS_SHIFT;
+}
+
+//// Per-slot telemetry, read live by pacerstat. The counters only grow, and a slot handed to
+//// another qp keeps counting where the last one left off; every one has a single writer (the qp's
+//// poster under its SQ lock, or the pacer's token thread), so a relaxed load and store add to it.
+struct flow_stats {
+    uint64_t tokens;                        /* granted by the pacer */
+    uint64_t bytes;                         /* posted by the qp while paced */
+    uint64_t wait_cycles;                   /* the qp spent waiting on pending */
+    uint64_t chunks;                        /* split chunks the qp posted */
+    uint64_t last_beat;                     /* heartbeat at the qp's last paced post */
+    int32_t pid, tid;                       /* owner the pacer handed the slot to; pid 0 if free */
+    uint32_t qpn;
+    uint32_t cls;                           /* class the qp last posted as + 1 (bw, lat, tput); 0 before */
+};
+
 struct shared_block {
     struct flow_info flows[MAX_FLOWS];
     uint32_t active_chunk_size;
@@ -70,6 +103,15 @@ struct shared_block {
     uint16_t num_active_small_flows;       /* incremented when a mouse first sends a message */
     uint16_t num_active_bw_flows;         /* incremented when an elephant first sends a message */
     uint16_t split_level;
+    struct lat_hist lat_hist[MAX_FLOWS];   /* slot -> completion latencies of a latency-sensitive qp */
+    uint64_t msg_left[MAX_FLOWS];          /* slot -> bytes a bw flow has left of the message it is posting; 0 if unknown */
+    uint64_t heartbeat;                    /* bumped by the pacer every HEARTBEAT_US; the drivers fail open when it stops */
+    uint32_t epoch;                        /* new every time a pacer starts taking joins; 0 before the first */
+    uint32_t tail_ref_ns;                  /* reference flow's tail the monitor measured last */
+    uint32_t tail_app_ns;                  /* latency apps' own tail it took last; 0 without one */
+    struct flow_stats stats[MAX_FLOWS];    /* slot -> telemetry for pacerstat */
+    struct tsc_clock tsc;                  /* published before the epoch */
+    struct pacer_port port;                /* the device port paced, published before the epoch */
 };
 
 struct control_block {
@@ -80,16 +122,27 @@ struct control_block {
     struct pingpong_context *ctx_per_client[MAX_CLIENTS];           // used by the server
     pid_t pid_list[MAX_FLOWS];             /* slot -> pid */
     pid_t tid_list[MAX_FLOWS];             /* slot -> tid (Linux gettid); enables per-thread scheduling */
+    uint32_t qpn_list[MAX_FLOWS];          /* slot -> qp number; 0 for a per-thread registration */
     uint64_t tokens;                       /* number of available tokens */
     uint64_t tokens_read;
     uint64_t app_vaddrs[MAX_SERVERS];           // used to compare and find which flow/app sends to which direction
     //uint32_t virtual_link_cap;           /* capacity of the virtual link that elephants go through */ /* moved to sb */
-    uint32_t remote_read_rate;             /* remote read rate */
-    uint32_t local_read_rate;
+    uint32_t remote_read_rate[MAX_SERVERS];    /* read rate granted to the big READs of each receiver */
+    uint32_t local_read_rate;              /* read rate granted by the responder to local big READs */
     uint16_t next_slot;
+    uint16_t num_slots;                    /* one past the highest slot handed out */
+    uint16_t num_joined;                   /* slots held by a joined qp or thread */
     uint16_t num_big_read_flows;
     uint16_t num_receiver_big_flows[MAX_SERVERS];        // big: bw + tput; received from receiver; Note: this value also includes this sender's local big flow
     uint16_t num_receiver_small_flows[MAX_SERVERS];      // small: lat
+    uint32_t reserved_rate[MAX_FLOWS];     /* slot -> MBps admitted for a tput flow at join; 0 for none */
+    uint32_t reserved_mb;                  /* sum of reserved_rate */
+    uint32_t reserve_gen;                  /* bumped after reserved_rate changes */
+    int32_t notify_big;                    /* big apps arrived minus exited, not yet told to the receiver */
+    int32_t notify_small;                  /* the same for small (lat) apps */
+    int32_t notify_read;                   /* the same for big READs, to tell the responder */
+    int32_t nic_node;                      /* NUMA node of the NIC; -1 if unknown (placement.h) */
+    uint32_t line_rate;                    /* MBps of the port paced (port.h) */
 };
 
 extern struct control_block cb;            /* declaration */
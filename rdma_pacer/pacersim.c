@@ -0,0 +1,833 @@
+/*
+ * pacersim: the pacer's policy (policy.h, reserve.h, srpt.h) driven in virtual time.
+ *
+ * Every sender runs what its pacer would: tokens at the virtual link rate of the active chunk
+ * size, grants to the waiting flows round-robin (or SRPT with -s) after the reservations, and a
+ * monitor probing the receiver every MONITOR_PERIOD_US that moves the virtual link on the tails.
+ * All of it is the pacer's own code; only the clock, the link and the apps are modelled:
+ *  - a sender's NIC serializes what is posted to it FIFO at line rate; the chunks then queue at
+ *    the receiver's port, FIFO at line rate and shared by all the senders, and complete
+ *    SIM_ACK_NS after leaving it (acks are never queued), plus SIM_HOST_NS at the host;
+ *  - bw apps post messages of SIM_BW_MSG back to back, up to SIM_BW_DEPTH at a time, a token per
+ *    chunk; tput apps the same, optionally with a reservation;
+ *  - lat apps post a message of SIM_LAT_MSG, unpaced, SIM_LAT_GAP_NS after the last completed,
+ *    into the histograms the monitor reads as the drivers' (lat_hist.h).
+ * Scenarios:
+ *  incast      senders (-n) with one elephant each and another sender with a latency flow, all
+ *              to one receiver
+ *  weighted    one sender with two elephants and two tput flows reserving different rates:
+ *              each gets what it reserved and an equal share of what is left
+ *  replay      (-r) a sender per capture of the drivers (replay.h) replaying what its host posted,
+ *              open loop at the times captured, scaled by -x: a qp is a flow of the class it was
+ *              paced as (an unpaced one of lat or bw by its mean WR size), its WRs the messages;
+ *              a READ is replayed as a write of its bytes, and a tput qp reserves nothing. Past
+ *              SIM_SLOTS qps a sender folds the others into flows of their class. It runs until
+ *              SIM_REPLAY_DRAIN_NS after the last WR, whatever -t says, and has no bounds.
+ * Each runs paced and then unpaced (whole messages, no tokens) for comparison; the paced run has
+ * to meet the scenario's bounds on utilization, fairness (Jain's index of the elephants), the
+ * latency flow's p99 and the reservations, or pacersim exits 1, so it can gate policy changes as
+ * a regression check.
+ *
+ * usage: pacersim [-s] [-t ms] [-n senders] [-r capture_prefix [-r ...]] [-x scale]
+ *                 [incast] [weighted] [replay]
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "policy.h"
+#include "reserve.h"
+#include "srpt.h"
+#include "pacerstat.h"
+#include "replay.h"
+
+#define SIM_LINE_RATE   22500       /* MBps, as LINE_RATE_MB */
+#define SIM_RESERVE_MAX (SIM_LINE_RATE / 2)     /* as MAX_RESERVED_MB */
+#define SIM_SENDERS     16
+#define SIM_SLOTS       16          /* per sender */
+#define SIM_ACK_NS      300         /* from leaving the receiver's port to the completion */
+#define SIM_HOST_NS     600         /* from the completion to the app seeing it */
+#define SIM_PROBE_MSG   64          /* the reference flow's message */
+#define SIM_BW_MSG      1000000
+#define SIM_BW_DEPTH    2
+#define SIM_LAT_MSG     64
+#define SIM_LAT_GAP_NS  1000
+#define SIM_WARMUP      0.2         /* of the run, not measured */
+#define SIM_REPLAY_SMALL    1024    /* mean WR bytes an unpaced qp replays as lat at, as FLOW_CLASS_SMALL_BYTES */
+#define SIM_REPLAY_DRAIN_NS 1000000 /* a replay runs on this long after its last WR */
+
+enum { EV_TOKEN, EV_POLL, EV_PROBE, EV_LAT, EV_ARRIVE, EV_COMPLETE, EV_POST };
+enum { APP_BW, APP_TPUT, APP_LAT, APP_PROBE };
+static const char *kind_name[] = { "bw", "tput", "lat", "probe" };
+
+struct event {
+    uint64_t t;                     /* ns */
+    uint64_t seq;                   /* ties go in the order scheduled */
+    uint64_t posted;                /* ns, of the message a chunk ends */
+    uint32_t bytes;
+    uint16_t type;
+    uint16_t last;                  /* the chunk ends its message */
+    int who;                        /* sender or flow */
+};
+
+struct flow {
+    int kind, sender, slot;
+    uint32_t reserve;               /* MBps asked for */
+    uint64_t left;                  /* of the message being posted */
+    int inflight;                   /* messages posted and not completed */
+    int waiting;                    /* for a token */
+    uint64_t bytes;                 /* completed since the warmup */
+    uint64_t posted;                /* ns the message being posted was posted at */
+    uint64_t msgs, done_ns;         /* messages completed since the warmup, and their time to complete */
+    /* replayed */
+    int replay;
+    uint32_t qpn;                   /* the first of the qps it replays */
+    uint64_t posts;                 /* WRs of its qps replayed */
+    long q_head, q_tail;            /* WRs posted and not started, linked in qnext; -1 if none */
+};
+
+struct sim_slot {                   /* as struct flow_info, what the grants look at */
+    uint8_t pending;
+    uint8_t read;
+    int flow;
+};
+
+struct sender {
+    uint64_t nic_busy;              /* ns the NIC is done with what was posted */
+    struct sim_slot slot[SIM_SLOTS];
+    int nslots;
+    uint32_t local_big, local_small, local_bw;
+    /* the pacer */
+    uint32_t tokens, chunk, vcap, link_cap, reserve_debt, reserved, reserve_gen;
+    uint32_t reserved_rate[SIM_SLOTS];
+    struct reserve_set rs;
+    uint64_t poll_at;
+    uint64_t msg_left[SIM_SLOTS], since[SIM_SLOTS], grants;
+    int next_idx, granting;
+    /* the monitor */
+    double tail;
+    struct lat_hist hist[SIM_SLOTS], prev[SIM_SLOTS];
+    struct app_tail at;
+    int probe;                      /* its reference flow */
+    /* the capture it replays */
+    const struct replay *rp;
+    const uint8_t *rp_slot;         /* slot of each WR */
+    size_t rp_next;
+    long *qnext;
+};
+
+static struct {
+    int paced, srpt;
+    uint64_t now, end, warmup, seq, events;
+    struct event *heap;
+    size_t n, cap;
+    uint64_t port_busy;             /* ns the receiver's port is done */
+    struct sender s[SIM_SENDERS];
+    int nsenders;
+    struct flow f[SIM_SENDERS * SIM_SLOTS];
+    int nflows;
+    uint32_t receiver_big, receiver_small;
+    uint32_t lat_win[LAT_HIST_BUCKETS], lat_n;
+} sim;
+
+static int failures;
+
+/* a capture to replay (-r), on a sender of its own */
+static struct host {
+    const char *prefix;
+    struct replay rp;
+    uint8_t *slot;                  /* of each WR */
+    int nflows, nqps, folded;
+    int kind[SIM_SLOTS];
+    uint32_t qpn[SIM_SLOTS];
+} hosts[SIM_SENDERS];
+static int nhosts;
+
+static int earlier(const struct event *a, const struct event *b)
+{
+    return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+static void schedule(uint64_t t, int type, int who, uint32_t bytes, int last, uint64_t posted)
+{
+    struct event e = { .t = t, .seq = sim.seq++, .posted = posted, .bytes = bytes, .type = type,
+                       .last = last, .who = who }, tmp;
+    size_t i, p;
+
+    if (sim.n == sim.cap) {
+        sim.cap = sim.cap ? sim.cap * 2 : 1024;
+        if (!(sim.heap = realloc(sim.heap, sim.cap * sizeof(*sim.heap)))) {
+            perror("realloc");
+            exit(2);
+        }
+    }
+    sim.heap[i = sim.n++] = e;
+    for (; i && earlier(&sim.heap[i], &sim.heap[p = (i - 1) / 2]); i = p) {
+        tmp = sim.heap[p];
+        sim.heap[p] = sim.heap[i];
+        sim.heap[i] = tmp;
+    }
+}
+
+static struct event next_event(void)
+{
+    struct event top = sim.heap[0], tmp;
+    size_t i = 0, c;
+
+    sim.heap[0] = sim.heap[--sim.n];
+    while ((c = 2 * i + 1) < sim.n) {
+        if (c + 1 < sim.n && earlier(&sim.heap[c + 1], &sim.heap[c]))
+            c++;
+        if (!earlier(&sim.heap[c], &sim.heap[i]))
+            break;
+        tmp = sim.heap[c];
+        sim.heap[c] = sim.heap[i];
+        sim.heap[i] = tmp;
+        i = c;
+    }
+    return top;
+}
+
+/* rounded down as token_cycles is, so a link paced at line rate does not queue on rounding */
+static uint64_t wire_ns(uint32_t bytes)
+{
+    return (uint64_t)bytes * 1000 / SIM_LINE_RATE;
+}
+
+/* onto the sender's NIC; what it serializes reaches the receiver's port next */
+static void nic_post(struct flow *f, uint32_t bytes, int last, uint64_t posted)
+{
+    struct sender *s = &sim.s[f->sender];
+
+    s->nic_busy = (s->nic_busy > sim.now ? s->nic_busy : sim.now) + wire_ns(bytes);
+    schedule(s->nic_busy, EV_ARRIVE, f - sim.f, bytes, last, posted);
+}
+
+static void pacer_grant(struct sender *s);
+
+/* a bw or tput app: the next chunk (paced) or message (unpaced), as long as it may have one out */
+static void app_next(struct flow *f)
+{
+    struct sender *s = &sim.s[f->sender];
+    uint64_t msg;
+
+    if (f->waiting)
+        return;
+    if (!f->left) {
+        if (f->replay) {
+            if (f->q_head < 0)
+                return;
+            /* a WR of no bytes still goes out */
+            f->left = s->rp->post[f->q_head].bytes ? s->rp->post[f->q_head].bytes : 1;
+            f->posted = s->rp->post[f->q_head].ns;
+            if ((f->q_head = s->qnext[f->q_head]) < 0)
+                f->q_tail = -1;
+        } else {
+            if (f->inflight >= SIM_BW_DEPTH)
+                return;
+            f->left = SIM_BW_MSG;
+            f->posted = sim.now;
+        }
+        f->inflight++;
+    }
+    if (!sim.paced) {
+        msg = f->left;
+        f->left = 0;
+        nic_post(f, msg, 1, f->posted);
+        app_next(f);
+        return;
+    }
+    f->waiting = 1;
+    s->msg_left[f->slot] = f->left;
+    s->slot[f->slot].pending = 1;
+    if (!s->granting)
+        pacer_grant(s);
+}
+
+/* a token for slot i, as the driver takes it: one chunk of the active size */
+static void grant(struct sender *s, int i)
+{
+    struct flow *f = &sim.f[s->slot[i].flow];
+    uint32_t bytes = f->left < s->chunk ? f->left : s->chunk;
+
+    s->slot[i].pending = 0;
+    f->waiting = 0;
+    f->left -= bytes;
+    s->msg_left[i] = f->left;
+    nic_post(f, bytes, !f->left, f->posted);
+    app_next(f);
+}
+
+/* As generate_fetch_tokens between two tokens: reservations first, from their buckets, then the
+ * tokens there are to the waiting flows. A reservation whose flow waits for its bucket to fill
+ * is looked at again when it will have. */
+static void pacer_grant(struct sender *s)
+{
+    const size_t stride = sizeof(struct sim_slot);
+    struct reserve_bucket *b;
+    uint64_t at;
+    int i;
+
+    s->granting = 1;
+    if (s->reserve_gen != s->rs.gen)
+        reserve_sync(&s->rs, s->reserved_rate, s->nslots, s->reserve_gen, sim.now);
+    while ((i = reserve_next(&s->rs, sim.now, 1000.0, s->chunk, &s->slot[0].pending, stride)) >= 0) {
+        s->reserve_debt++;
+        grant(s, i);
+    }
+    for (i = 0; i < s->rs.n; i++) {
+        b = &s->rs.b[i];
+        if (!s->slot[b->slot].pending)
+            continue;
+        at = sim.now + (uint64_t)((s->chunk - b->bytes) * 1000 / b->rate) + 1;
+        if (s->poll_at <= sim.now || at < s->poll_at) {
+            s->poll_at = at;
+            schedule(at, EV_POLL, s - sim.s, 0, 0, 0);
+        }
+    }
+
+    while (s->tokens) {
+        if (sim.srpt)
+            i = srpt_pick(&s->slot[0].pending, &s->slot[0].read, stride, s->msg_left, s->since, s->grants,
+                          s->nslots, s->next_idx);
+        else
+            i = rr_pick(&s->slot[0].pending, &s->slot[0].read, stride, s->nslots, s->next_idx);
+        if (i < 0)
+            break;
+        s->tokens--;
+        s->since[i] = ++s->grants;
+        s->next_idx = (i + 1) % s->nslots;
+        grant(s, i);
+    }
+    s->granting = 0;
+}
+
+/* As generate_fetch_tokens makes a token: the chunk size for the virtual link, a token unless the
+ * reservations took one already, and the next after the time a chunk takes at the link's rate. */
+static void pacer_token(struct sender *s)
+{
+    s->chunk = token_chunk_size(s->vcap, SIM_LINE_RATE, sim.receiver_small);
+    if (s->tokens < MAX_TOKEN) {
+        if (s->reserve_debt) {
+            if (s->reserve_debt > RESERVE_MAX * RESERVE_BURST)
+                s->reserve_debt = RESERVE_MAX * RESERVE_BURST;
+            s->reserve_debt--;
+        } else {
+            s->tokens++;
+        }
+    }
+    pacer_grant(s);
+    schedule(sim.now + token_cycles(1000000, s->chunk, s->vcap), EV_TOKEN, s - sim.s, 0, 0, 0);
+}
+
+/* As monitor_latency after its probe came back in lat ns */
+static void monitor_round(struct sender *s, uint64_t lat)
+{
+    struct link_view v;
+    double app_tail_us;
+    int valid, missed;
+
+    s->tail = ref_tail_update(s->tail, lat / 1000.0);
+    valid = app_tail_update(&s->at, s->hist, s->nslots, &app_tail_us);
+    missed = tail_target_missed(s->tail, TAIL, valid, app_tail_us);
+    if (s->local_big) {
+        v.local_big = s->local_big;
+        v.local_small = s->local_small;
+        v.local_bw = s->local_bw;
+        v.remote_reads = 0;
+        v.receiver_big = sim.receiver_big;
+        v.receiver_small = sim.receiver_small;
+        v.reserved = s->reserved;
+        s->vcap = s->link_cap = link_cap_step(s->link_cap, &v, SIM_LINE_RATE, missed);
+    }
+    schedule(sim.now + MONITOR_PERIOD_US * 1000, EV_PROBE, s - sim.s, 0, 0, 0);
+}
+
+static void complete(struct flow *f, const struct event *e)
+{
+    struct sender *s = &sim.s[f->sender];
+    uint64_t lat = sim.now + SIM_HOST_NS - e->posted;
+
+    if (sim.now >= sim.warmup) {
+        f->bytes += e->bytes;
+        if (e->last) {
+            f->msgs++;
+            f->done_ns += lat;
+        }
+    }
+    switch (f->kind) {
+    case APP_PROBE:
+        monitor_round(s, lat);
+        break;
+    case APP_LAT:
+        lat_hist_record(&s->hist[f->slot], lat);
+        if (sim.now >= sim.warmup) {
+            sim.lat_win[lat_hist_bucket(lat)]++;
+            sim.lat_n++;
+        }
+        if (!f->replay)
+            schedule(sim.now + SIM_HOST_NS + SIM_LAT_GAP_NS, EV_LAT, f - sim.f, 0, 0, 0);
+        break;
+    default:
+        if (e->last) {
+            f->inflight--;
+            app_next(f);
+        }
+    }
+}
+
+/* The next WR of the capture a sender replays: a lat qp's goes out at once, unpaced, as the
+ * driver posts it; the others queue behind what their flow has not started yet. */
+static void replay_post(struct sender *s)
+{
+    const struct replay_post *p = &s->rp->post[s->rp_next];
+    struct flow *f = &sim.f[s->slot[s->rp_slot[s->rp_next]].flow];
+    long i = s->rp_next++;
+
+    f->posts++;
+    if (f->kind == APP_LAT) {
+        nic_post(f, p->bytes, 1, sim.now);
+    } else {
+        s->qnext[i] = -1;
+        if (f->q_tail >= 0)
+            s->qnext[f->q_tail] = i;
+        else
+            f->q_head = i;
+        f->q_tail = i;
+        app_next(f);
+    }
+    if (s->rp_next < s->rp->n)
+        schedule(s->rp->post[s->rp_next].ns, EV_POST, s - sim.s, 0, 0, 0);
+}
+
+static void dispatch(const struct event *e)
+{
+    struct flow *f = &sim.f[e->who];
+
+    switch (e->type) {
+    case EV_TOKEN:
+        pacer_token(&sim.s[e->who]);
+        break;
+    case EV_POLL:
+        if (sim.s[e->who].poll_at == sim.now)
+            pacer_grant(&sim.s[e->who]);
+        break;
+    case EV_PROBE:
+        nic_post(&sim.f[sim.s[e->who].probe], SIM_PROBE_MSG, 1, sim.now);
+        break;
+    case EV_LAT:
+        nic_post(f, SIM_LAT_MSG, 1, sim.now);
+        break;
+    case EV_ARRIVE:
+        sim.port_busy = (sim.port_busy > sim.now ? sim.port_busy : sim.now) + wire_ns(e->bytes);
+        schedule(sim.port_busy + SIM_ACK_NS, EV_COMPLETE, e->who, e->bytes, e->last, e->posted);
+        break;
+    case EV_COMPLETE:
+        complete(f, e);
+        break;
+    case EV_POST:
+        replay_post(&sim.s[e->who]);
+        break;
+    }
+}
+
+static void reset(int paced, int nsenders, uint64_t ms)
+{
+    int srpt = sim.srpt, i;
+
+    free(sim.heap);
+    for (i = 0; i < SIM_SENDERS; i++)
+        free(sim.s[i].qnext);
+    memset(&sim, 0, sizeof(sim));
+    sim.srpt = srpt;
+    sim.paced = paced;
+    sim.nsenders = nsenders;
+    sim.end = ms * 1000000;
+    sim.warmup = sim.end * SIM_WARMUP;
+}
+
+/* an app of kind on sender s joining, as flow_join and the admission of its reservation */
+static struct flow *join(int s, int kind, uint32_t reserve)
+{
+    struct sender *snd = &sim.s[s];
+    struct flow *f = &sim.f[sim.nflows];
+
+    f->kind = kind;
+    f->sender = s;
+    f->slot = snd->nslots++;
+    snd->slot[f->slot].flow = sim.nflows++;
+    if (kind == APP_LAT) {
+        snd->local_small++;
+        sim.receiver_small++;
+    } else if (kind != APP_PROBE) {
+        snd->local_big++;
+        sim.receiver_big++;
+        if (kind == APP_BW)
+            snd->local_bw++;
+        if ((f->reserve = reserve_admit(&snd->reserved, SIM_RESERVE_MAX, reserve))) {
+            snd->reserved_rate[f->slot] = f->reserve;
+            snd->reserve_gen++;
+        }
+    }
+    return f;
+}
+
+/* the apps start and the pacers come up; events until the end of the run */
+static void run(void)
+{
+    struct event e;
+    struct sender *s;
+    int i;
+
+    for (i = 0; i < sim.nsenders; i++) {
+        s = &sim.s[i];
+        s->probe = join(i, APP_PROBE, 0) - sim.f;
+        s->vcap = s->link_cap = SIM_LINE_RATE;
+        s->chunk = DEFAULT_CHUNK_SIZE;
+        s->tokens = 1;
+        s->at.prev = s->prev;
+        s->at.tail_age = APP_TAIL_MAX_AGE + 1;
+        if (sim.paced) {
+            schedule(0, EV_TOKEN, i, 0, 0, 0);
+            schedule(0, EV_PROBE, i, 0, 0, 0);
+        }
+        if (s->rp)
+            schedule(s->rp->post[0].ns, EV_POST, i, 0, 0, 0);
+    }
+    for (i = 0; i < sim.nflows; i++) {
+        if (sim.f[i].kind == APP_LAT && !sim.f[i].replay)
+            schedule(0, EV_LAT, i, 0, 0, 0);
+        else if (sim.f[i].kind != APP_PROBE)
+            app_next(&sim.f[i]);
+    }
+
+    while (sim.n) {
+        e = next_event();
+        if (e.t > sim.end)
+            break;
+        sim.now = e.t;
+        sim.events++;
+        dispatch(&e);
+    }
+}
+
+struct result {
+    double util, jain, p50, p99;    /* p50, p99 in us */
+};
+
+/* what the run measured; Jain's index over the bw flows */
+static struct result report(const char *name)
+{
+    struct result r;
+    double secs = (sim.end - sim.warmup) / 1e9, bw[SIM_SENDERS * SIM_SLOTS], total = 0, mbps;
+    int i, nbw = 0;
+
+    for (i = 0; i < sim.nflows; i++) {
+        struct flow *f = &sim.f[i];
+
+        if (f->kind == APP_PROBE || f->kind == APP_LAT)
+            continue;
+        mbps = f->bytes / secs / 1e6;
+        total += mbps;
+        if (f->kind == APP_BW)
+            bw[nbw++] = mbps;
+    }
+    r.util = total / SIM_LINE_RATE;
+    r.jain = jain_index(bw, nbw);
+    r.p50 = lat_hist_percentile(sim.lat_win, sim.lat_n, 0.5) / 1000.0;
+    r.p99 = lat_hist_percentile(sim.lat_win, sim.lat_n, 0.99) / 1000.0;
+    printf("%-8s %-7s util %.3f  jain %.3f", name, sim.paced ? "paced" : "unpaced", r.util, r.jain);
+    if (sim.lat_n)
+        printf("  lat p50 %.2f us  p99 %.2f us", r.p50, r.p99);
+    printf("  (%" PRIu64 " events)\n", sim.events);
+    for (i = 0; i < sim.nflows; i++) {
+        struct flow *f = &sim.f[i];
+
+        if (f->replay)
+            printf("  qp 0x%x %-4s %" PRIu64 " of %" PRIu64 " WRs done, %.2f us each, %.0f MBps\n", f->qpn,
+                   kind_name[f->kind], f->msgs, f->posts, f->msgs ? f->done_ns / 1e3 / f->msgs : 0,
+                   f->bytes / secs / 1e6);
+        else if (f->kind == APP_TPUT)
+            printf("  tput flow %d: %.0f MBps, %u reserved\n", i, f->bytes / secs / 1e6, f->reserve);
+    }
+    return r;
+}
+
+#define BOUND(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s: ", name);                     \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+    }                                                           \
+} while (0)
+
+static void incast(const char *name, int senders, uint64_t ms)
+{
+    struct result r[2];
+    int paced, i;
+
+    for (paced = 1; paced >= 0; paced--) {
+        reset(paced, senders + 1, ms);
+        for (i = 0; i < senders; i++)
+            join(i, APP_BW, 0);
+        join(senders, APP_LAT, 0);
+        run();
+        r[paced] = report(name);
+    }
+    BOUND(r[1].util > 0.6, "utilization %.3f", r[1].util);
+    BOUND(r[1].jain > 0.95, "Jain's index %.3f", r[1].jain);
+    BOUND(r[1].p99 < 2 * TAIL, "lat p99 %.2f us over %d", r[1].p99, 2 * TAIL);
+    BOUND(r[1].p99 < r[0].p99, "lat p99 %.2f us paced, %.2f unpaced", r[1].p99, r[0].p99);
+}
+
+static void weighted(const char *name, uint64_t ms)
+{
+    const uint32_t reserve[2] = { 7000, 3000 };
+    struct result r;
+    struct flow *t[2];
+    double secs = ms * (1 - SIM_WARMUP) / 1e3;
+    int paced, i;
+
+    for (paced = 1; paced >= 0; paced--) {
+        reset(paced, 1, ms);
+        join(0, APP_BW, 0);
+        join(0, APP_BW, 0);
+        for (i = 0; i < 2; i++)
+            t[i] = join(0, APP_TPUT, reserve[i]);
+        run();
+        r = report(name);
+        if (!paced)
+            break;
+        BOUND(r.util > 0.95, "utilization %.3f", r.util);
+        BOUND(r.jain > 0.95, "Jain's index %.3f", r.jain);
+        for (i = 0; i < 2; i++)
+            BOUND(t[i]->bytes / secs / 1e6 > 0.95 * reserve[i], "tput flow %d: %.0f MBps of %u reserved",
+                  (int)(t[i] - sim.f), t[i]->bytes / secs / 1e6, reserve[i]);
+    }
+}
+
+/* what a qp of a capture posted */
+struct qp_use {
+    uint32_t qpn;
+    size_t first;                   /* its first WR */
+    uint64_t bytes, wrs;
+    int cls;                        /* as its last WR was paced */
+    int slot;
+};
+
+static const struct replay_post *sort_posts;
+static const struct qp_use *sort_uses;
+
+static int by_qpn(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+    if (sort_posts[x].qpn != sort_posts[y].qpn)
+        return sort_posts[x].qpn < sort_posts[y].qpn ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static int by_first(const void *a, const void *b)
+{
+    size_t x = sort_uses[*(const int *)a].first, y = sort_uses[*(const int *)b].first;
+
+    return x < y ? -1 : x > y;
+}
+
+/* the app kind a qp replays as: FLOW_CLASS_BW, _LAT and _TPUT as such, an unpaced one by its WRs */
+static int replay_kind(const struct qp_use *u)
+{
+    switch (u->cls) {
+    case 0:
+        return APP_BW;
+    case 1:
+        return APP_LAT;
+    case 2:
+        return APP_TPUT;
+    }
+    return u->bytes <= (uint64_t)SIM_REPLAY_SMALL * u->wrs ? APP_LAT : APP_BW;
+}
+
+/* Loads the capture of a host and lays its qps out on the slots of its sender, in the order they
+ * first posted; the probe takes the last slot. */
+static int host_load(struct host *h, double scale)
+{
+    const struct replay_post *p;
+    struct qp_use *use = NULL;
+    size_t *idx = NULL, i;
+    int *order = NULL, n = 0, k, f, same, pick, ret = -1;
+
+    if (replay_load(&h->rp, h->prefix, scale))
+        return -1;
+    p = h->rp.post;
+    if (!(idx = malloc(h->rp.n * sizeof(*idx))) || !(use = calloc(h->rp.n, sizeof(*use)))
+        || !(h->slot = malloc(h->rp.n))) {
+        perror("malloc");
+        goto out;
+    }
+    for (i = 0; i < h->rp.n; i++)
+        idx[i] = i;
+    sort_posts = p;
+    qsort(idx, h->rp.n, sizeof(*idx), by_qpn);
+    for (i = 0; i < h->rp.n; i++) {
+        if (!i || p[idx[i]].qpn != p[idx[i - 1]].qpn) {
+            use[n].qpn = p[idx[i]].qpn;
+            use[n++].first = idx[i];
+        }
+        use[n - 1].bytes += p[idx[i]].bytes;
+        use[n - 1].wrs++;
+        use[n - 1].cls = p[idx[i]].cls;
+    }
+
+    if (!(order = malloc(n * sizeof(*order)))) {
+        perror("malloc");
+        goto out;
+    }
+    for (k = 0; k < n; k++)
+        order[k] = k;
+    sort_uses = use;
+    qsort(order, n, sizeof(*order), by_first);
+    h->nqps = n;
+    for (k = 0; k < n; k++) {
+        struct qp_use *u = &use[order[k]];
+        int kind = replay_kind(u);
+
+        if (h->nflows < SIM_SLOTS - 1) {
+            h->kind[h->nflows] = kind;
+            h->qpn[h->nflows] = u->qpn;
+            u->slot = h->nflows++;
+            continue;
+        }
+        /* folded into the flows of its kind in turn, or into any if there is none */
+        for (same = 0, f = 0; f < h->nflows; f++)
+            same += h->kind[f] == kind;
+        pick = h->folded++ % (same ? same : h->nflows);
+        for (f = 0; (same && h->kind[f] != kind) || pick--; f++)
+            ;
+        u->slot = f;
+    }
+    for (i = 0, k = -1; i < h->rp.n; i++) {
+        if (!i || p[idx[i]].qpn != p[idx[i - 1]].qpn)
+            k++;
+        h->slot[idx[i]] = use[k].slot;
+    }
+    printf("replay %s: %zu WRs of %d thread(s) over %.3f ms, %d qp(s) on %d flow(s)\n", h->prefix, h->rp.n,
+           h->rp.files, h->rp.span_ns / 1e6, h->nqps, h->nflows);
+    ret = 0;
+
+out:
+    free(idx);
+    free(use);
+    free(order);
+    return ret;
+}
+
+/* the captures of the hosts replayed together, each host on a sender of its own */
+static void replay(const char *name)
+{
+    struct flow *f;
+    struct sender *s;
+    int paced, i, j;
+
+    for (paced = 1; paced >= 0; paced--) {
+        reset(paced, nhosts, 0);
+        for (i = 0; i < nhosts; i++) {
+            s = &sim.s[i];
+            for (j = 0; j < hosts[i].nflows; j++) {
+                f = join(i, hosts[i].kind[j], 0);
+                f->replay = 1;
+                f->qpn = hosts[i].qpn[j];
+                f->q_head = f->q_tail = -1;
+            }
+            s->rp = &hosts[i].rp;
+            s->rp_slot = hosts[i].slot;
+            if (!(s->qnext = malloc(s->rp->n * sizeof(*s->qnext)))) {
+                perror("malloc");
+                exit(2);
+            }
+            if (s->rp->span_ns + SIM_REPLAY_DRAIN_NS > sim.end)
+                sim.end = s->rp->span_ns + SIM_REPLAY_DRAIN_NS;
+        }
+        run();
+        report(name);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, senders = 8, timed = 0;
+    uint64_t ms = 100;
+    double scale = 1;
+    struct timespec t0, t1;
+
+    while ((opt = getopt(argc, argv, "st:n:r:x:")) != -1) {
+        switch (opt) {
+        case 's':
+            sim.srpt = 1;
+            break;
+        case 't':
+            ms = atoi(optarg);
+            break;
+        case 'n':
+            senders = atoi(optarg);
+            break;
+        case 'r':
+            if (nhosts == SIM_SENDERS)
+                goto usage;
+            hosts[nhosts++].prefix = optarg;
+            break;
+        case 'x':
+            scale = atof(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (!ms || senders < 1 || senders >= SIM_SENDERS || scale <= 0)
+        goto usage;
+    for (i = 0; i < nhosts; i++)
+        if (host_load(&hosts[i], scale))
+            return 2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = optind; i < argc || i == optind; i++) {
+        /* with captures to replay and no scenario named, only them */
+        const char *name = i < argc ? argv[i] : nhosts ? "replay" : NULL;
+
+        if (!name || !strcmp(name, "incast")) {
+            incast("incast", senders, ms);
+            timed = 1;
+        }
+        if (!name || !strcmp(name, "weighted")) {
+            weighted("weighted", ms);
+            timed = 1;
+        }
+        if (name && !strcmp(name, "replay")) {
+            if (!nhosts)
+                goto usage;
+            replay("replay");
+        }
+        if (name && strcmp(name, "incast") && strcmp(name, "weighted") && strcmp(name, "replay"))
+            goto usage;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (timed)
+        printf("%" PRIu64 " ms simulated per run", ms);
+    printf("%sin %.2f s\n", timed ? " " : "simulated ", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    if (failures) {
+        fprintf(stderr, "%d bound(s) missed\n", failures);
+        return 1;
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-s] [-t ms] [-n senders] [-r capture_prefix [-r ...]] [-x scale]\n"
+            "                [incast] [weighted] [replay]\n", argv[0]);
+    return 2;
+}
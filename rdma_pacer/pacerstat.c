@@ -0,0 +1,175 @@
+/*
+ * pacerstat: the pacer's counters, live, the way vmstat shows the kernel's.
+ *
+ * Maps the shared block read-only and samples it every delay ms: a line of the global gauges
+ * (heartbeats per second, virtual link capacity, the tails the monitor controls on, chunk size,
+ * batch, active counts, split level) with Jain's fairness index of the bw and tput flows that
+ * moved, then a line per slot with an owner or with counters that moved: tokens and MB per
+ * second, the share of the interval its qp spent waiting for a token, split chunks per second,
+ * and how long ago it last posted. Nothing is written to the block, so it may run next to a pacer
+ * at any time, and keeps showing a dead one (hb/s 0) until a new one starts.
+ *
+ * usage: pacerstat [-g] [-d ib_dev [-i ib_port]] [delay_ms [count]]
+ *   -g     gauges only, no per-slot lines
+ *   -d -i  the pacer of that device port (port.h); without, the one that named no port
+ */
+
+#include "pacer.h"
+#include "get_clock.h"
+#include "pacerstat.h"
+
+#define DELAY_MS        1000
+#define HEADER_EVERY    20          /* gauge lines between headers, like vmstat */
+
+static const char *cls_name[] = { "-", "bw", "lat", "tput" };
+
+struct sample {
+    uint64_t heartbeat;
+    struct timespec at;
+    struct flow_stats stats[MAX_FLOWS];
+};
+
+static void take(const struct shared_block *sb, struct sample *s)
+{
+    clock_gettime(CLOCK_MONOTONIC, &s->at);
+    s->heartbeat = __atomic_load_n(&sb->heartbeat, __ATOMIC_RELAXED);
+    memcpy(s->stats, (const void *)sb->stats, sizeof(s->stats));
+}
+
+static const struct shared_block *attach(const char *name)
+{
+    const struct shared_block *sb;
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+        fprintf(stderr, "shm_open %s: %s (is a pacer running%s?)\n", name, strerror(errno),
+                strcmp(name, SHARED_MEM_NAME) ? " on that port" : "; give its port with -d");
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct shared_block)) {
+        fprintf(stderr, "%s is not a shared block of this pacer\n", name);
+        close(fd);
+        return NULL;
+    }
+    sb = mmap(NULL, sizeof(struct shared_block), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (sb == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return sb;
+}
+
+static void print(const struct shared_block *sb, const struct sample *then, const struct sample *now,
+                  double cpu_mhz, int flows, int header)
+{
+    double secs = (now->at.tv_sec - then->at.tv_sec) + (now->at.tv_nsec - then->at.tv_nsec) / 1e9;
+    double rate[MAX_FLOWS];
+    int i, n = 0;
+
+    for (i = 0; i < MAX_FLOWS; i++) {
+        const struct flow_stats *a = &then->stats[i], *b = &now->stats[i];
+        uint32_t cls = b->cls;
+
+        if ((cls == 1 || cls == 3) && (b->bytes != a->bytes || b->wait_cycles != a->wait_cycles))
+            rate[n++] = stat_delta(b->bytes, a->bytes) / secs / 1e6;
+    }
+
+    if (header)
+        printf("%6s %6s %9s %9s %6s %6s %5s %4s %4s %4s %3s %5s %6s\n", "hb/s", "vcap", "tail_ref",
+               "tail_app", "chunk", "rchunk", "batch", "big", "lat", "bw", "lvl", "flows", "jain");
+    printf("%6.0f %6u %9.1f %9.1f %6u %6u %5u %4u %4u %4u %3u %5d %6.3f\n",
+           stat_delta(now->heartbeat, then->heartbeat) / secs,
+           __atomic_load_n(&sb->virtual_link_cap, __ATOMIC_RELAXED),
+           __atomic_load_n(&sb->tail_ref_ns, __ATOMIC_RELAXED) / 1000.0,
+           __atomic_load_n(&sb->tail_app_ns, __ATOMIC_RELAXED) / 1000.0,
+           __atomic_load_n(&sb->active_chunk_size, __ATOMIC_RELAXED),
+           __atomic_load_n(&sb->active_chunk_size_read, __ATOMIC_RELAXED),
+           __atomic_load_n(&sb->active_batch_ops, __ATOMIC_RELAXED),
+           __atomic_load_n(&sb->num_active_big_flows, __ATOMIC_RELAXED),
+           __atomic_load_n(&sb->num_active_small_flows, __ATOMIC_RELAXED),
+           __atomic_load_n(&sb->num_active_bw_flows, __ATOMIC_RELAXED),
+           __atomic_load_n(&sb->split_level, __ATOMIC_RELAXED),
+           n, jain_index(rate, n));
+    if (!flows)
+        return;
+
+    for (i = 0; i < MAX_FLOWS; i++) {
+        const struct flow_stats *a = &then->stats[i], *b = &now->stats[i];
+        uint64_t tokens = stat_delta(b->tokens, a->tokens), bytes = stat_delta(b->bytes, a->bytes);
+        uint64_t wait = stat_delta(b->wait_cycles, a->wait_cycles);
+
+        if (!b->pid && !tokens && !bytes && !wait)
+            continue;
+        printf("  slot %3d pid %6d tid %6d qpn %6u %4s %9.0f tok/s %9.1f MB/s %5.1f%% wait %8.0f chunk/s",
+               i, b->pid, b->tid, b->qpn, cls_name[b->cls < 4 ? b->cls : 0], tokens / secs, bytes / secs / 1e6,
+               cpu_mhz > 0 ? 100.0 * wait / (cpu_mhz * 1e6 * secs) : 0.0,
+               stat_delta(b->chunks, a->chunks) / secs);
+        if (b->last_beat)
+            printf(" idle %6.0f ms\n", (double)stat_delta(now->heartbeat, b->last_beat) * HEARTBEAT_US / 1000);
+        else
+            printf(" idle      - ms\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const struct shared_block *sb;
+    struct sample *s[2];
+    int delay = DELAY_MS, count = -1, flows = 1, port = 1, opt, k;
+    char name[PORT_DEV_LEN + 32] = SHARED_MEM_NAME;
+    const char *dev = NULL;
+    double cpu_mhz;
+
+    while ((opt = getopt(argc, argv, "gd:i:")) != -1) {
+        switch (opt) {
+        case 'g':
+            flows = 0;
+            break;
+        case 'd':
+            dev = optarg;
+            break;
+        case 'i':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-g] [-d ib_dev [-i ib_port]] [delay_ms [count]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        delay = atoi(argv[optind++]);
+    if (optind < argc)
+        count = atoi(argv[optind++]);
+    if (delay <= 0) {
+        fprintf(stderr, "delay must be positive\n");
+        return 1;
+    }
+
+    if (dev)
+        port_block_name(name, sizeof(name), SHARED_MEM_NAME, dev, port);
+    if (!(sb = attach(name)))
+        return 1;
+    if (sb->port.dev[0])
+        printf("%s port %u, line rate %u MBps\n", sb->port.dev, sb->port.num, sb->port.line_rate);
+    s[0] = malloc(sizeof(struct sample));
+    s[1] = malloc(sizeof(struct sample));
+    if (!s[0] || !s[1]) {
+        perror("malloc");
+        return 1;
+    }
+    /* the drivers count waits in tsc cycles; the pacer published their rate */
+    cpu_mhz = __atomic_load_n(&sb->tsc.khz, __ATOMIC_ACQUIRE) / 1000.0;
+    if (!cpu_mhz)
+        cpu_mhz = get_cpu_mhz(0);
+
+    take(sb, s[0]);
+    for (k = 0; count < 0 || k < count; k++) {
+        usleep(delay * 1000);
+        take(sb, s[(k + 1) & 1]);
+        print(sb, s[k & 1], s[(k + 1) & 1], cpu_mhz, flows, flows || k % HEADER_EVERY == 0);
+        fflush(stdout);
+    }
+    return 0;
+}
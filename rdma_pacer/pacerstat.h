@@ -0,0 +1,32 @@
+#ifndef PACERSTAT_H
+#define PACERSTAT_H
+
+#include <stdint.h>
+
+/* What pacerstat makes of two samples of the per-slot telemetry in the shared block (struct
+ * flow_stats in pacer.h). The counters only grow and nobody resets them while they are read, so
+ * everything is a difference between two samples. Kept free of verbs so it can be tested offline.
+ */
+
+/* how far a counter moved between two samples; one that went back was zeroed by a pacer that
+ * started in between, and all it holds now is new */
+static inline uint64_t stat_delta(uint64_t now, uint64_t then)
+{
+    return now >= then ? now - then : now;
+}
+
+/* Jain's fairness index of n rates, (sum x)^2 / (n * sum x^2): 1 when they are all equal, 1/n
+ * when one flow has it all. No flow, or none moving, is fair. */
+static inline double jain_index(const double *x, int n)
+{
+    double sum = 0, sq = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum += x[i];
+        sq += x[i] * x[i];
+    }
+    return sq > 0 ? sum * sum / (n * sq) : 1;
+}
+
+#endif
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+
+/*
+ * Test for what pacerstat makes of two samples of the per-slot telemetry (pacerstat.h).
+ *
+ * Counter differences must survive a pacer restart that zeroed the block between samples, and
+ * Jain's index must be 1 for equal rates, 1/n when one flow has it all, scale-free, and match the
+ * closed form on random rates. Last, the cost the telemetry adds on the drivers' side is measured
+ * and reported: per paced post (summing the WR's sges, adding its bytes, stamping the heartbeat
+ * and class) and per token wait (the two tsc reads around it and the add).
+ *
+ * usage: pacerstat_test [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pacerstat.h"
+
+#define MAX_N       64
+#define TIMED       10000000
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t rdtsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+#else
+    return now_ns();
+#endif
+}
+
+static inline int close_to(double a, double b)
+{
+    return a - b < 1e-9 && b - a < 1e-9;
+}
+
+static int check_delta(void)
+{
+    CHECK(stat_delta(10, 10) == 0, "still counter moved");
+    CHECK(stat_delta(15, 10) == 5, "delta %llu", (unsigned long long)stat_delta(15, 10));
+    CHECK(stat_delta(3, 1000) == 3, "a counter zeroed in between counts from 0, got %llu",
+          (unsigned long long)stat_delta(3, 1000));
+    CHECK(stat_delta(UINT64_MAX, 0) == UINT64_MAX, "large delta");
+    return 0;
+}
+
+static int check_jain_fixed(void)
+{
+    double x[MAX_N];
+    int n, i;
+
+    CHECK(jain_index(x, 0) == 1, "no flow is fair");
+    for (n = 1; n <= MAX_N; n++) {
+        for (i = 0; i < n; i++)
+            x[i] = 0;
+        CHECK(jain_index(x, n) == 1, "%d still flows are fair", n);
+        for (i = 0; i < n; i++)
+            x[i] = 1234.5;
+        CHECK(close_to(jain_index(x, n), 1), "%d equal flows: %f", n, jain_index(x, n));
+        for (i = 1; i < n; i++)
+            x[i] = 0;
+        CHECK(close_to(jain_index(x, n), 1.0 / n), "one of %d has it all: %f", n, jain_index(x, n));
+    }
+    x[0] = 1;
+    x[1] = 2;
+    CHECK(close_to(jain_index(x, 2), 0.9), "1:2 gives %f, not 0.9", jain_index(x, 2));
+    return 0;
+}
+
+/* n random rates: the index is in [1/n, 1], the closed form, and the same for the rates scaled */
+static int check_jain_random(void)
+{
+    double x[MAX_N], y[MAX_N], sum = 0, sq = 0, j;
+    int n = 1 + rand() % MAX_N, i;
+
+    for (i = 0; i < n; i++) {
+        x[i] = (rand() % 1000) * (rand() % 2 ? 1 : 100.0);
+        y[i] = x[i] * 7.25;
+        sum += x[i];
+        sq += x[i] * x[i];
+    }
+    j = jain_index(x, n);
+    CHECK(j >= 1.0 / n - 1e-9 && j <= 1 + 1e-9, "%d flows: index %f out of range", n, j);
+    if (sq > 0)
+        CHECK(close_to(j, sum * sum / (n * sq)), "%d flows: %f, closed form %f", n, j, sum * sum / (n * sq));
+    CHECK(close_to(j, jain_index(y, n)), "%d flows: %f, scaled %f", n, j, jain_index(y, n));
+    return 0;
+}
+
+/* as the drivers lay a slot out (struct flow_stats) and add to it (justitia_stat_*) */
+struct slot {
+    uint64_t tokens, bytes, wait_cycles, chunks, last_beat;
+    int32_t pid, tid;
+    uint32_t qpn, cls;
+};
+
+struct sge {
+    uint64_t addr;
+    uint32_t length, lkey;
+};
+
+static inline void stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static double post_cost(double *wait_ns)
+{
+    static struct slot slots[8];
+    static uint64_t heartbeat;
+    struct sge sg = { 0x1000, 65536, 1 };
+    uint64_t t0, start;
+    double post_ns;
+    int i;
+
+    t0 = now_ns();
+    for (i = 0; i < TIMED; i++) {
+        struct slot *st = &slots[i & 7];
+
+        asm volatile ("" : : "r" (&sg) : "memory");    /* the WR is new every post */
+        stat_add(&st->bytes, sg.length);
+        __atomic_store_n(&st->last_beat, __atomic_load_n(&heartbeat, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        if (__atomic_load_n(&st->cls, __ATOMIC_RELAXED) != 1)
+            __atomic_store_n(&st->cls, 1, __ATOMIC_RELAXED);
+    }
+    post_ns = (double)(now_ns() - t0) / TIMED;
+
+    t0 = now_ns();
+    for (i = 0; i < TIMED; i++) {
+        start = rdtsc();
+        stat_add(&slots[i & 7].wait_cycles, rdtsc() - start);
+    }
+    *wait_ns = (double)(now_ns() - t0) / TIMED;
+    return post_ns;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 10000;
+    unsigned seed = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+
+    if (iters < 0)
+        return 2;
+    srand(seed);
+
+    check_delta();
+    check_jain_fixed();
+    for (int it = 0; it < iters; it++)
+        check_jain_random();
+
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("pacerstat_test: %d random rate sets passed (seed %u)\n", iters, seed);
+    double wait_ns, post_ns = post_cost(&wait_ns);
+    printf("telemetry: %.1f ns/paced post, %.1f ns/token wait\n", post_ns, wait_ns);
+    return 0;
+}
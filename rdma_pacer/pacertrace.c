@@ -0,0 +1,191 @@
+/*
+ * pacertrace: decodes a pacer event trace (trace.h) into a timeline.
+ *
+ * Events of all rings are merged in tsc order and printed one per line, microseconds since the
+ * trace started, with the ring that wrote them: token grants, AIMD steps of the virtual link,
+ * chunk size changes, joins and leaves, probe latencies, and the events a ring dropped. -s keeps
+ * one slot's grants, joins and leaves (and everything that is not per slot), -e keeps event types,
+ * and -f/-u cut a window around an incident. -c prints CSV for plotting, and -S a summary per
+ * event type and the grants per slot instead of the timeline.
+ *
+ * usage: pacertrace [-c | -S] [-s slot] [-e grant,aimd,chunk,join,leave,probe,drop]
+ *                   [-f from_us] [-u until_us] trace_file
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAX_SLOTS   65536
+
+static const char *ring_name[TRACE_RINGS] = { "tokens", "readtok", "read", "monitor", "ctl" };
+static const char *type_name[TRACE_TYPES] = { "?", "grant", "aimd", "chunk", "join", "leave", "probe", "drop" };
+static const char *grant_name[] = { "shared", "reserved", "read" };
+
+static int by_tsc(const void *a, const void *b)
+{
+    const struct trace_event *x = a, *y = b;
+
+    if (x->tsc != y->tsc)
+        return x->tsc < y->tsc ? -1 : 1;
+    return x->ring - y->ring;
+}
+
+static int per_slot(int type)
+{
+    return type == TRACE_GRANT || type == TRACE_JOIN || type == TRACE_LEAVE;
+}
+
+static void print_event(const struct trace_event *e, double us)
+{
+    printf("%14.3f %-8s %-6s ", us, e->ring < TRACE_RINGS ? ring_name[e->ring] : "?", type_name[e->type]);
+    switch (e->type) {
+    case TRACE_GRANT:
+        printf("slot %u %s\n", e->arg, e->val < 3 ? grant_name[e->val] : "?");
+        break;
+    case TRACE_AIMD:
+        printf("cap %u MBps%s\n", e->val, e->arg ? " (tail missed)" : "");
+        break;
+    case TRACE_CHUNK:
+        printf("%s%u B\n", e->arg ? "read " : "", e->val);
+        break;
+    case TRACE_JOIN:
+    case TRACE_LEAVE:
+        printf("slot %u pid %u\n", e->arg, e->val);
+        break;
+    case TRACE_PROBE:
+        printf("server %u %.3f us\n", e->arg, e->val / 1000.0);
+        break;
+    case TRACE_DROP:
+        printf("%u events\n", e->val);
+        break;
+    default:
+        printf("arg %u val %u\n", e->arg, e->val);
+    }
+}
+
+static int parse_types(char *list)
+{
+    char *t;
+    int mask = 0, i;
+
+    for (t = strtok(list, ","); t; t = strtok(NULL, ",")) {
+        for (i = 1; i < TRACE_TYPES && strcmp(t, type_name[i]); i++)
+            ;
+        if (i == TRACE_TYPES) {
+            fprintf(stderr, "unknown event type %s\n", t);
+            return -1;
+        }
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+int main(int argc, char **argv)
+{
+    struct trace_header h;
+    struct trace_event *ev = NULL;
+    size_t n = 0, cap = 0, i;
+    int opt, csv = 0, summary = 0, slot = -1, types = ~0;
+    double from = 0, until = -1, us;
+    uint64_t count[TRACE_TYPES] = { 0 };
+    static uint64_t grants[MAX_SLOTS];
+    FILE *f;
+
+    while ((opt = getopt(argc, argv, "cSs:e:f:u:")) != -1) {
+        switch (opt) {
+        case 'c':
+            csv = 1;
+            break;
+        case 'S':
+            summary = 1;
+            break;
+        case 's':
+            slot = atoi(optarg);
+            break;
+        case 'e':
+            if ((types = parse_types(optarg)) < 0)
+                return 1;
+            break;
+        case 'f':
+            from = atof(optarg);
+            break;
+        case 'u':
+            until = atof(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1)
+        goto usage;
+
+    if (!(f = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a pacer trace of version %d\n", argv[optind], TRACE_VERSION);
+        return 1;
+    }
+    while (1) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1 << 16;
+            if (!(ev = realloc(ev, cap * sizeof(*ev)))) {
+                perror("realloc");
+                return 1;
+            }
+        }
+        if (fread(&ev[n], sizeof(*ev), 1, f) != 1)
+            break;
+        n++;
+    }
+    fclose(f);
+    /* each ring is in order already; the drain wrote them one after another */
+    qsort(ev, n, sizeof(*ev), by_tsc);
+
+    if (csv)
+        printf("time_us,ring,event,arg,val\n");
+    for (i = 0; i < n; i++) {
+        struct trace_event *e = &ev[i];
+
+        if (e->type >= TRACE_TYPES || !(types & (1 << e->type)))
+            continue;
+        if (slot >= 0 && per_slot(e->type) && e->arg != slot)
+            continue;
+        us = e->tsc >= h.tsc0 ? (e->tsc - h.tsc0) / h.cpu_mhz : 0;
+        if (us < from || (until >= 0 && us > until))
+            continue;
+        if (summary) {
+            count[e->type]++;
+            if (e->type == TRACE_GRANT)
+                grants[e->arg]++;
+        } else if (csv) {
+            printf("%.3f,%s,%s,%u,%u\n", us, e->ring < TRACE_RINGS ? ring_name[e->ring] : "?",
+                   type_name[e->type], e->arg, e->val);
+        } else {
+            print_event(e, us);
+        }
+    }
+
+    if (summary) {
+        printf("%zu events, %.3f s at %.0f MHz\n", n,
+               n ? (ev[n - 1].tsc - h.tsc0) / h.cpu_mhz / 1e6 : 0.0, h.cpu_mhz);
+        for (i = 1; i < TRACE_TYPES; i++)
+            printf("%-6s %12" PRIu64 "\n", type_name[i], count[i]);
+        for (i = 0; i < MAX_SLOTS; i++)
+            if (grants[i])
+                printf("slot %4zu %12" PRIu64 " grants\n", i, grants[i]);
+    }
+    free(ev);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-c | -S] [-s slot] [-e grant,aimd,chunk,join,leave,probe,drop]\n"
+                    "       %*s [-f from_us] [-u until_us] trace_file\n", argv[0], (int)strlen(argv[0]), "");
+    return 1;
+}
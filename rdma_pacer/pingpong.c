@@ -2,9 +2,10 @@
 
 static const int port = 18515;
 /* Verbs port numbers are 1-based (0 is invalid). */
-static const int ib_port = 1;
+static int ib_port = 1;
 static const int mtu = IBV_MTU_2048;
-static const int ib_dev_idx = 1;
+static const int ib_dev_idx = 1;        /* the device paced when none is named */
+static char ib_dev_name[IBV_SYSFS_NAME_MAX];    /* the one named, by pp_select_port */
 //static const int ib_dev_idx = 1;
 //static const int ib_dev_idx = 2;  // used in xl170
 
@@ -61,6 +62,43 @@ struct pingpong_context *init_monitor_chan(struct monitor_param *params){
     return ctx;
 }
 
+/* the device called name, or the ib_dev_idx-th if name is NULL; NULL if there is none */
+static struct ibv_device *pp_find_device(struct ibv_device **dev_list, const char *name)
+{
+    int i;
+
+    for (i = 0; dev_list[i]; i++)
+        if (name ? !strcmp(ibv_get_device_name(dev_list[i]), name) : i == ib_dev_idx)
+            return dev_list[i];
+    return NULL;
+}
+
+/* The device and port the pacer paces, where the monitor's qp goes too: dev by name, or the
+ * ib_dev_idx-th device if dev is NULL. Its name goes in name (IBV_SYSFS_NAME_MAX), its sysfs path
+ * in path, and the port's attributes in attr. 0, or -1 if there is no such device or port.
+ */
+int pp_select_port(const char *dev, int port, char *name, char *path, size_t len, struct ibv_port_attr *attr)
+{
+    struct ibv_device **dev_list, *ib_dev;
+    struct ibv_context *context;
+    int ret = -1;
+
+    if (!(dev_list = ibv_get_device_list(NULL)))
+        return -1;
+    if ((ib_dev = pp_find_device(dev_list, dev)) && (context = ibv_open_device(ib_dev))) {
+        if (!ibv_query_port(context, port, attr)) {
+            snprintf(ib_dev_name, sizeof(ib_dev_name), "%s", ibv_get_device_name(ib_dev));
+            ib_port = port;
+            snprintf(name, IBV_SYSFS_NAME_MAX, "%s", ib_dev_name);
+            snprintf(path, len, "%s", ib_dev->ibdev_path);
+            ret = 0;
+        }
+        ibv_close_device(context);
+    }
+    ibv_free_device_list(dev_list);
+    return ret;
+}
+
 static struct pingpong_context *alloc_monitor_qp() {
     struct ibv_device **dev_list;
     struct ibv_device *ib_dev;
@@ -73,7 +111,7 @@ static struct pingpong_context *alloc_monitor_qp() {
     }
 
     //ib_dev = *dev_list; // pick the first device
-    ib_dev = dev_list[ib_dev_idx];
+    ib_dev = pp_find_device(dev_list, ib_dev_name[0] ? ib_dev_name : NULL);
     if (ib_dev) {
         printf("IB DEV NAME: %s\n", ibv_get_device_name(ib_dev));
     }
@@ -188,7 +226,7 @@ static struct pingpong_context *alloc_monitor_qp() {
 	    memset(&init_attr, 0, sizeof(struct ibv_qp_init_attr));
 	    init_attr.send_cq = ctx->send_cq;
 	    init_attr.recv_cq = ctx->recv_cq;
-	    init_attr.cap.max_send_wr  = 2;
+	    init_attr.cap.max_send_wr  = 4;		// ref flow, app updates and an unsignaled read rate
 	    init_attr.cap.max_recv_wr  = 2;
 	    init_attr.cap.max_send_sge = 1;
 	    init_attr.cap.max_recv_sge = 1;
@@ -53,5 +53,6 @@ struct pingpong_dest {
 };
 
 struct pingpong_context * init_monitor_chan(struct monitor_param *);
+int pp_select_port(const char *dev, int port, char *name, char *path, size_t len, struct ibv_port_attr *attr);
 
 #endif
\ No newline at end of file
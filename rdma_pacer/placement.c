@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "placement.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define SYSFS_CPU       "/sys/devices/system/cpu"
+#define SYSFS_NODE      "/sys/devices/system/node"
+#define MAX_NODES       1024
+
+/* the first line of a sysfs file into buf, without its newline; -1 if it cannot be read */
+static int read_line(const char *path, char *buf, int len)
+{
+    FILE *f = fopen(path, "r");
+    int ok;
+
+    if (!f)
+        return -1;
+    ok = fgets(buf, len, f) != NULL;
+    fclose(f);
+    if (!ok)
+        return -1;
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+int cpulist_parse(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+    char *end;
+    long a, b;
+
+    CPU_ZERO(set);
+    while (isspace((unsigned char)*p))
+        p++;
+    while (*p) {
+        a = strtol(p, &end, 10);
+        if (end == p || a < 0)
+            return -1;
+        b = a;
+        p = end;
+        if (*p == '-') {
+            b = strtol(++p, &end, 10);
+            if (end == p || b < a)
+                return -1;
+            p = end;
+        }
+        if (b >= CPU_SETSIZE)
+            return -1;
+        for (; a <= b; a++)
+            CPU_SET(a, set);
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+    return 0;
+}
+
+int cpuset_nth(const cpu_set_t *set, int n)
+{
+    int count = CPU_COUNT(set), cpu;
+
+    if (!count)
+        return -1;
+    n %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, set) && n-- == 0)
+            return cpu;
+    return -1;
+}
+
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    int node = -1;
+
+    /* the cpu's directory links the node it is on, as node<N> */
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+    if (!(dir = opendir(path)))
+        return -1;
+    while ((d = readdir(dir)))
+        if (strncmp(d->d_name, "node", 4) == 0 && isdigit((unsigned char)d->d_name[4])) {
+            node = atoi(d->d_name + 4);
+            break;
+        }
+    closedir(dir);
+    return node;
+}
+
+int node_cpus(int node, cpu_set_t *set)
+{
+    char path[64], list[1024];
+
+    snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+    if (node < 0 || read_line(path, list, sizeof(list)) || cpulist_parse(list, set) || !CPU_COUNT(set))
+        return -1;
+    return 0;
+}
+
+int nic_node(const char *ibdev_path)
+{
+    char path[512], val[16];
+
+    snprintf(path, sizeof(path), "%s/device/numa_node", ibdev_path);
+    if (read_line(path, val, sizeof(val)))
+        return -1;
+    return atoi(val);       /* -1 already where the platform does not tell */
+}
+
+int cpu_isolated(int cpu)
+{
+    char list[1024];
+    cpu_set_t set;
+
+    if (read_line(SYSFS_CPU "/isolated", list, sizeof(list)) || cpulist_parse(list, &set))
+        return 0;
+    return cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set);
+}
+
+int mem_bind_node(void *addr, size_t len, int node)
+{
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+
+    if (node < 0 || node >= MAX_NODES)
+        return -1;
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << node % (8 * sizeof(unsigned long));
+    /* the kernel reads one bit less than maxnode */
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, mask, MAX_NODES + 1, MPOL_MF_MOVE) ? -1 : 0;
+}
+
+int thread_cpu(pid_t pid, pid_t tid)
+{
+    char path[64], stat[1024], *p;
+    int field, cpu = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+    if (read_line(path, stat, sizeof(stat)) || !(p = strrchr(stat, ')')))
+        return -1;
+    /* processor is the 39th field; the comm before the ')' may hold spaces, the rest do not */
+    for (field = 2, p = strtok(p + 1, " "); p; p = strtok(NULL, " "))
+        if (++field == 39) {
+            cpu = atoi(p);
+            break;
+        }
+    return cpu;
+}
+
+int place_on_node(int node)
+{
+    cpu_set_t set;
+
+    if (node_cpus(node, &set) || pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        return -1;
+    return 0;
+}
+
+/* the n-th cpu of the list in env: 1 with it in cpu, 0 if env is not set, -1 if it does not parse */
+static int env_cpu(const char *env, int n, int *cpu)
+{
+    const char *list = getenv(env);
+    cpu_set_t set;
+
+    if (!list || !*list)
+        return 0;
+    if (cpulist_parse(list, &set) || (*cpu = cpuset_nth(&set, n)) < 0) {
+        fprintf(stderr, "%s=%s is not a cpu list\n", env, list);
+        return -1;
+    }
+    return 1;
+}
+
+static void pinned(const char *what, int cpu, int node)
+{
+    int on = cpu_node(cpu);
+
+    printf("%s pinned to cpu %d%s\n", what, cpu, cpu_isolated(cpu) ? " (isolated)" : ", not isolated");
+    if (node >= 0 && on >= 0 && on != node)
+        printf("warning: cpu %d is on node %d, the NIC on node %d: %s crosses sockets to the shared block\n",
+               cpu, on, node, what);
+}
+
+int placement_attr(pthread_attr_t *attr, const char *what, const char *env, int n, int node)
+{
+    cpu_set_t set;
+    int cpu, ret;
+
+    if ((ret = env_cpu(env, n, &cpu)) <= 0)
+        return ret;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_attr_setaffinity_np(attr, sizeof(set), &set))
+        return -1;
+    pinned(what, cpu, node);
+    return 0;
+}
+
+int placement_pin(const char *what, const char *env, int n, int node)
+{
+    cpu_set_t set;
+    int cpu, ret;
+
+    if ((ret = env_cpu(env, n, &cpu)) < 0)
+        return -1;
+    if (!ret && (node_cpus(node, &set) || (cpu = cpuset_nth(&set, 0)) < 0) && (cpu = sched_getcpu()) < 0)
+        return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        return -1;
+    pinned(what, cpu, node);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sched.h>          /* cpu_set_t: the includer defines _GNU_SOURCE */
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Where the pacer's threads and the shared block live relative to the NIC. The token threads and
+ * the apps spinning on pending share the block's cache lines, and a handshake across sockets costs
+ * about twice one within (handshake_bench), so by default everything goes on the NIC's NUMA node:
+ * the threads may run on any of its cpus and the block's pages are bound to its memory. The token
+ * and monitor threads can be pinned to cores of their own (isolated ones, preferably) with the
+ * cpu lists below, written as in /sys/devices/system/cpu/isolated: "2,3" or "2-4". The token
+ * threads take the cpus of TOKEN_CPUS_ENV in turn: generate_fetch_tokens the first,
+ * generate_tokens_read the next, rate_limit_read the one after.
+ * Kept free of verbs so it can be tested offline; the NIC is named by its ibdev_path.
+ */
+
+#define TOKEN_CPUS_ENV      "JUSTITIA_TOKEN_CPUS"
+#define MONITOR_CPUS_ENV    "JUSTITIA_MONITOR_CPUS"
+
+/* cpus of a cpu list into set; -1 if it does not parse */
+int cpulist_parse(const char *list, cpu_set_t *set);
+
+/* the n-th cpu of set, wrapping around; -1 if set is empty */
+int cpuset_nth(const cpu_set_t *set, int n);
+
+/* NUMA node of a cpu, or -1 if the kernel does not say (no NUMA) */
+int cpu_node(int cpu);
+
+/* the cpus of a node into set; -1 if it has none */
+int node_cpus(int node, cpu_set_t *set);
+
+/* NUMA node of the NIC at ibdev_path (/sys/class/infiniband/<dev>), or -1 if unknown */
+int nic_node(const char *ibdev_path);
+
+/* whether the kernel keeps cpu out of the scheduler's balancing (isolcpus) */
+int cpu_isolated(int cpu);
+
+/* binds the pages of [addr, addr + len) to node's memory, moving those already touched; 0 or -1 */
+int mem_bind_node(void *addr, size_t len, int node);
+
+/* the cpu thread tid of pid last ran on, or -1 if it is gone */
+int thread_cpu(pid_t pid, pid_t tid);
+
+/* keeps the calling thread, and the threads it starts from now on, to the cpus of node; 0 or -1 */
+int place_on_node(int node);
+
+/* Pins the n-th thread of a role (what) in attr to the n-th cpu of the list in env, if env is
+ * set, and warns of a cpu off node or not isolated; else leaves attr be. 0, or -1 if env does
+ * not parse.
+ */
+int placement_attr(pthread_attr_t *attr, const char *what, const char *env, int n, int node);
+
+/* Pins the calling thread, for a role (what) that must stay on one cpu, to the n-th cpu of the
+ * list in env if env is set, else to the first cpu of node, else to the cpu it runs on. 0, or -1.
+ */
+int placement_pin(const char *what, const char *env, int n, int node);
+
+#endif
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+/*
+ * Test for the pacer's placement helpers (placement.h, placement.c).
+ *
+ * Cpu lists parse as the kernel writes them and bad ones are refused; the n-th cpu of a set wraps
+ * around. On this host every online cpu is among the cpus of the node the kernel puts it on (or
+ * no cpu has a node, without NUMA), a thread kept to a node runs there, and thread_cpu agrees with
+ * sched_getcpu for a pinned thread. The NIC's node is read from a fake ibdev_path. Last, a shared
+ * mapping bound to the node of cpu 0 has its pages there, as move_pages tells, where the kernel
+ * has mbind. A thread placement_pin pins runs on the cpu of the list it is given, else on the
+ * first of its node's, else where it ran.
+ *
+ * usage: placement_test
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "placement.h"
+
+#define PAGES   16
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+/* list parses to exactly the cpus of want, a list of its own of single cpus ended by -1 */
+static int check_list(const char *list, const int *want)
+{
+    cpu_set_t set;
+    int n = 0;
+
+    CHECK(cpulist_parse(list, &set) == 0, "\"%s\" refused", list);
+    for (; *want >= 0; want++, n++)
+        CHECK(CPU_ISSET(*want, &set), "\"%s\" lacks cpu %d", list, *want);
+    CHECK(CPU_COUNT(&set) == n, "\"%s\" has %d cpus, not %d", list, CPU_COUNT(&set), n);
+    return 0;
+}
+
+static int check_parse(void)
+{
+    static const char *bad[] = { "a", "3-1", "1,,2", "1-", "-1", "2 3", "1;2", "99999" };
+    static const int one[] = { 0, -1 }, range[] = { 0, 1, 2, 3, -1 }, mixed[] = { 1, 3, 5, 6, -1 };
+    static const int none[] = { -1 }, spaced[] = { 2, 3, 4, -1 };
+    cpu_set_t set;
+    size_t i;
+
+    if (check_list("0", one) || check_list("0-3", range) || check_list("1,3,5-6", mixed) ||
+        check_list("", none) || check_list(" 2-4\n", spaced))
+        return -1;
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+        CHECK(cpulist_parse(bad[i], &set) < 0, "\"%s\" parsed", bad[i]);
+
+    cpulist_parse("1,3,5-6", &set);
+    CHECK(cpuset_nth(&set, 0) == 1 && cpuset_nth(&set, 2) == 5 && cpuset_nth(&set, 3) == 6, "nth");
+    CHECK(cpuset_nth(&set, 4) == 1 && cpuset_nth(&set, 5) == 3, "nth does not wrap");
+    CPU_ZERO(&set);
+    CHECK(cpuset_nth(&set, 0) == -1, "nth of an empty set");
+    return 0;
+}
+
+static int check_nodes(void)
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN), cpu, node, numa = 0, plain = 0;
+    cpu_set_t set;
+
+    for (cpu = 0; cpu < ncpu; cpu++) {
+        if ((node = cpu_node(cpu)) < 0) {
+            plain++;
+            continue;
+        }
+        numa++;
+        CHECK(node_cpus(node, &set) == 0 && CPU_ISSET(cpu, &set), "cpu %d not among those of its node %d",
+              cpu, node);
+    }
+    CHECK(!numa || !plain, "%d cpus on a node, %d on none", numa, plain);
+    CHECK(node_cpus(-1, &set) < 0 && node_cpus(1 << 20, &set) < 0, "cpus of a node that is not");
+
+    if ((node = cpu_node(0)) >= 0) {
+        CHECK(place_on_node(node) == 0, "cannot keep to node %d", node);
+        CHECK(cpu_node(sched_getcpu()) == node, "kept to node %d, runs on cpu %d", node, sched_getcpu());
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+    CHECK(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0, "cannot pin to cpu 0");
+    CHECK(thread_cpu(getpid(), syscall(SYS_gettid)) == sched_getcpu(), "thread_cpu %d, sched_getcpu %d",
+          thread_cpu(getpid(), syscall(SYS_gettid)), sched_getcpu());
+    CHECK(thread_cpu(getpid(), 0) == -1, "cpu of a thread that is not");
+    printf("placement_test: %d cpus, %s\n", ncpu, numa ? "numa" : "no numa nodes");
+    return 0;
+}
+
+static int check_nic(void)
+{
+    char dir[] = "/tmp/placement_test.XXXXXX", path[128];
+    FILE *f;
+    int node;
+
+    CHECK(mkdtemp(dir), "mkdtemp");
+    CHECK(nic_node(dir) == -1, "node of a nic without numa_node");
+    snprintf(path, sizeof(path), "%s/device", dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/device/numa_node", dir);
+    CHECK((f = fopen(path, "w")), "%s", path);
+    fputs("1\n", f);
+    fclose(f);
+    node = nic_node(dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/device", dir);
+    rmdir(path);
+    rmdir(dir);
+    CHECK(node == 1, "nic on node 1 read as %d", node);
+    return 0;
+}
+
+static int check_bind(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    int node = cpu_node(0), status[PAGES], i;
+    void *pages[PAGES];
+    char *mem;
+
+    if (node < 0) {
+        printf("placement_test: no numa, binding not checked\n");
+        return 0;
+    }
+    mem = mmap(NULL, PAGES * page, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(mem != MAP_FAILED, "mmap");
+    if (mem_bind_node(mem, PAGES * page, node)) {
+        CHECK(errno == ENOSYS || errno == EPERM, "mbind: %s", strerror(errno));
+        printf("placement_test: mbind not allowed here, binding not checked\n");
+        return 0;
+    }
+    memset(mem, 1, PAGES * page);
+    for (i = 0; i < PAGES; i++)
+        pages[i] = mem + i * page;
+    CHECK(syscall(SYS_move_pages, 0, PAGES, pages, NULL, status, 0) == 0, "move_pages: %s", strerror(errno));
+    for (i = 0; i < PAGES; i++)
+        CHECK(status[i] == node, "page %d on node %d, bound to %d", i, status[i], node);
+    munmap(mem, PAGES * page);
+    printf("placement_test: %d pages bound to node %d\n", PAGES, node);
+    return 0;
+}
+
+static void *pinned(void *arg)
+{
+    const char *env = arg;
+    int node = cpu_node(0);
+
+    if (placement_pin("placement_test", env, 1, node))
+        return (void *)-2L;
+    return (void *)(long)sched_getcpu();
+}
+
+/* the cpu a new thread pins itself to with the list in env (NULL: not set) */
+static long pin_cpu(const char *list)
+{
+    pthread_t th;
+    void *cpu;
+
+    if (list)
+        setenv("PLACEMENT_TEST_CPUS", list, 1);
+    else
+        unsetenv("PLACEMENT_TEST_CPUS");
+    if (pthread_create(&th, NULL, pinned, "PLACEMENT_TEST_CPUS"))
+        return -3;
+    pthread_join(th, &cpu);
+    return (long)cpu;
+}
+
+static int check_pin(void)
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN), node = cpu_node(0), last = ncpu - 1;
+    char list[32];
+    cpu_set_t set;
+    long cpu;
+
+    /* the second of the list, wrapping around */
+    snprintf(list, sizeof(list), "0,%d", last);
+    CHECK((cpu = pin_cpu(list)) == last, "pinned with %s to cpu %ld, not %d", list, cpu, last);
+    CHECK(pin_cpu("x") == -2, "pinned with a list that does not parse");
+    cpu = pin_cpu(NULL);
+    if (node >= 0 && node_cpus(node, &set) == 0)
+        CHECK(cpu == cpuset_nth(&set, 0), "pinned to cpu %ld, not the first of node %d", cpu, node);
+    else
+        CHECK(cpu >= 0 && cpu < ncpu, "pinned to cpu %ld", cpu);
+    return 0;
+}
+
+int main(void)
+{
+    check_parse();
+    check_nodes();
+    check_nic();
+    check_bind();
+    check_pin();
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("placement_test: ok\n");
+    return 0;
+}
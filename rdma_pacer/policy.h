@@ -0,0 +1,206 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lat_hist.h"
+#include "link_share.h"
+
+/* The pacer's policy apart from the threads that run it: what a token is worth, how often one
+ * comes, which waiting flow gets the next, and how the monitor moves the virtual link on the
+ * tails it measures. generate_fetch_tokens, generate_tokens_read and monitor_latency run it on
+ * the wall clock; pacersim runs the same code in virtual time against a modelled link.
+ * Kept free of verbs so it can be tested offline.
+ */
+
+// DEFAULT_CHUNK_SIZE is the initial chunk size when num_split_qps = 1
+// NOTE: from Crail exp: use 1048576 & 5120 since 1048576 is Crail's default slice size
+//#define DEFAULT_CHUNK_SIZE 10000000
+#define DEFAULT_CHUNK_SIZE 1000000
+//#define DEFAULT_CHUNK_SIZE 1048576
+#define SMALL_CHUNK_SIZE 5000
+//#define SMALL_CHUNK_SIZE 5120
+//#define EVEN_SMALLER_CHUNK_SIZE 1000
+//#define EVEN_SMALLER_CHUNK_SIZE 1024
+//#define EVEN_SMALLER_CHUNK_SIZE 5120
+#define EVEN_SMALLER_CHUNK_SIZE 5000
+#define BIG_CHUNK_SIZE 1000000
+//#define BIG_CHUNK_SIZE 1048576
+//#define DEFAULT_BATCH_OPS 5000    // xl170 (when using 10Gbps link)
+//#define DEFAULT_BATCH_OPS 1000     // Conflux
+//#define DEFAULT_BATCH_OPS 1500    // c6220
+//#define DEFAULT_BATCH_OPS 1667    // r320
+#define DEFAULT_BATCH_OPS 1800    // r320
+//#define DEFAULT_BATCH_OPS 2500    // Shin's RoCEv2
+//#define MAX_TOKEN 5
+#define MAX_TOKEN 5
+
+#define ELEPHANT_HAS_LOWER_BOUND 1  /* whether elephant has a minimum virtual link cap set by AIMD */
+#define TREAT_L_AS_ONE
+
+#define TAIL 2                      /* us; the reference flow's tail target */
+#define EWMA 0.5
+#define MONITOR_PERIOD_US 200       /* between two rounds of the monitor */
+
+#define APP_TAIL_PERCENTILE     0.99    // percentile of the latency apps' own completions controlled on
+#define APP_TAIL_TARGET         TAIL    // us; the apps' tail target (their messages may be bigger than the ref flow's)
+#define APP_TAIL_MIN_SAMPLES    100     // completions a window needs before its tail is trusted
+#define APP_TAIL_MAX_AGE        50      // rounds a window may collect for, and its tail stays valid
+#define APP_TAIL_WEIGHT         1.0     // share of the apps' tail in what AIMD sees; 0 controls on the ref flow alone
+
+/* bytes a token is worth on a virtual link of vcap MBps: whole chunks for elephants alone, small
+ * ones when latency flows share the receiver (lat_flows), so they do not wait behind a chunk */
+static inline uint32_t token_chunk_size(uint32_t vcap, uint32_t line_rate, int lat_flows)
+{
+    if (!lat_flows)
+        return DEFAULT_CHUNK_SIZE;
+    return vcap > (double)line_rate / 3 ? SMALL_CHUNK_SIZE : EVEN_SMALLER_CHUNK_SIZE;
+}
+
+/* the same for READs at the rate a responder granted: a responder grants less than line rate
+ * when it protects latency flows, so READs are split as finely as WRITEs are then */
+static inline uint32_t read_chunk_size(uint32_t rate, uint32_t line_rate)
+{
+    if (rate >= line_rate)
+        return DEFAULT_CHUNK_SIZE;
+    return rate > (double)line_rate / 3 ? SMALL_CHUNK_SIZE : EVEN_SMALLER_CHUNK_SIZE;
+}
+
+/* The rate (MBps) big READs are paced at when their responder granted rate. None granted (0)
+ * would leave them waiting for a read token forever: they take a small share of the line until
+ * the responder's next RATE. */
+#define READ_FALLBACK_SHARE 16
+static inline uint32_t read_rate(uint32_t rate, uint32_t line_rate)
+{
+    if (rate)
+        return rate;
+    return line_rate > READ_FALLBACK_SHARE ? line_rate / READ_FALLBACK_SHARE : 1;
+}
+
+/* tsc cycles between two tokens of chunk bytes at rate MBps, the tsc ticking tsc_khz */
+static inline uint64_t token_cycles(uint32_t tsc_khz, uint32_t chunk, uint32_t rate)
+{
+    return (uint64_t)tsc_khz * chunk / rate / 1000;
+}
+
+/* The slot to grant the next shared token to, round-robin from slot from: the first at or after
+ * it in [0, n) that waits for one and is not a READ. -1 if none is waiting. pending and read are
+ * the flags of slot 0, stride bytes apart. */
+static inline int rr_pick(const uint8_t *pending, const uint8_t *read, size_t stride, int n, int from)
+{
+    int k, i;
+
+    for (k = 0; k < n; k++) {
+        i = (from + k) % n;
+        if (!__atomic_load_n(read + i * stride, __ATOMIC_RELAXED) &&
+            __atomic_load_n(pending + i * stride, __ATOMIC_RELAXED))
+            return i;
+    }
+    return -1;
+}
+
+/* rr_pick for a read token: the first slot at or after from in [0, n) with a READ waiting */
+static inline int rr_pick_read(const uint8_t *pending, const uint8_t *read, size_t stride, int n, int from)
+{
+    int k, i;
+
+    for (k = 0; k < n; k++) {
+        i = (from + k) % n;
+        if (__atomic_load_n(read + i * stride, __ATOMIC_RELAXED) &&
+            __atomic_load_n(pending + i * stride, __ATOMIC_RELAXED))
+            return i;
+    }
+    return -1;
+}
+
+/* what the monitor knows of the flows when it moves the link */
+struct link_view {
+    uint32_t local_big;             /* this sender's elephants and tput flows */
+    uint32_t local_small;           /* its latency flows */
+    uint32_t local_bw;              /* its elephants */
+    uint32_t remote_reads;          /* big READs remote requesters pull through it */
+    uint32_t receiver_big;          /* the receiver's big and small apps, from all its senders */
+    uint32_t receiver_small;
+    uint32_t reserved;              /* MBps admitted to tput flows */
+};
+
+/* The virtual link (MBps) of this sender's elephants and the remote READs after one monitor
+ * round: line rate when no latency flow is in their way, otherwise one AIMD step on whether the
+ * tail target was missed, not below the elephants' share of the receiver and the reservations. */
+static inline uint32_t link_cap_step(uint32_t link_cap, const struct link_view *v, uint32_t line_rate,
+                                     int target_missed)
+{
+    uint32_t min_cap;
+
+    if ((v->local_small || v->receiver_small) && (v->local_bw || v->remote_reads)) {
+#ifndef TREAT_L_AS_ONE
+        min_cap = round((double)(v->local_big + v->remote_reads)
+            / (v->receiver_big + v->receiver_small + v->remote_reads) * line_rate);   // assume a single receiver
+#else
+        min_cap = round((double)(v->local_big + v->remote_reads)
+            / (v->receiver_big + 1 + v->remote_reads) * line_rate);      // assume a single receiver
+#endif
+        if (min_cap > line_rate)        // could happen if haven't received info from the receiver
+            min_cap = line_rate;
+        /* the tput flows keep what they reserved however often the target is missed */
+        return link_cap_aimd(link_cap, link_cap_floor(ELEPHANT_HAS_LOWER_BOUND ? min_cap : 0, v->reserved, line_rate),
+                             line_rate, target_missed);
+    }
+    return line_rate;
+}
+
+/* the reference flow's tail (us) after a probe of lat us */
+static inline double ref_tail_update(double tail, double lat)
+{
+    return EWMA * lat + (1 - EWMA) * tail;
+}
+
+/* whether AIMD sees the tail target missed: on the latency apps' own tail if a recent window has
+ * one (app_valid), blended with the reference flow's by APP_TAIL_WEIGHT, else on the ref flow's */
+static inline int tail_target_missed(double ref_tail, double ref_target, int app_valid, double app_tail)
+{
+    if (APP_TAIL_WEIGHT > 0 && app_valid)
+        return APP_TAIL_WEIGHT * app_tail / APP_TAIL_TARGET + (1 - APP_TAIL_WEIGHT) * ref_tail / ref_target > 1;
+    return ref_tail > ref_target;
+}
+
+/* tail latency of the latency apps' own completions, from the histograms their drivers keep (one
+ * per slot); collected over windows of at least APP_TAIL_MIN_SAMPLES completions
+ */
+struct app_tail {
+    struct lat_hist *prev;              /* per slot: counters as of the last round */
+    uint32_t win[LAT_HIST_BUCKETS];
+    uint32_t win_n;
+    int win_age;                        /* rounds the window has been collecting */
+    int tail_age;                       /* rounds since tail was taken */
+    double tail;                        /* us */
+};
+
+/* one monitor round over the n histograms of h; returns 1 with the apps' tail (us) in *tail if a
+ * recent window had one. at starts with tail_age past APP_TAIL_MAX_AGE and prev zeroed. */
+static inline int app_tail_update(struct app_tail *at, const struct lat_hist *h, int n, double *tail)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        at->win_n += lat_hist_collect(&h[i], &at->prev[i], at->win);
+
+    at->tail_age++;
+    if (at->win_n >= APP_TAIL_MIN_SAMPLES) {
+        at->tail = lat_hist_percentile(at->win, at->win_n, APP_TAIL_PERCENTILE) / 1000.0;
+        at->tail_age = 0;
+    }
+    if (at->win_n >= APP_TAIL_MIN_SAMPLES || ++at->win_age > APP_TAIL_MAX_AGE) {
+        memset(at->win, 0, sizeof(at->win));
+        at->win_n = 0;
+        at->win_age = 0;
+    }
+
+    *tail = at->tail;
+    return at->tail_age <= APP_TAIL_MAX_AGE;
+}
+
+#endif
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+
+/*
+ * Polling cost of the Justitia driver's completion path.
+ *
+ * A single RC QP is connected to itself (loopback) with separate send and
+ * receive CQs. Every iteration preposts batch RECVs, posts batch SENDs of
+ * msg_size bytes and polls both CQs until all completions are in. Only the
+ * ibv_poll_cq calls that return completions are timed and divided by the
+ * completions they return; empty polls are timed on their own.
+ *
+ * The receive CQ is the one split messages can arrive on, so with small
+ * messages its cost is that of unsplit traffic on a split-aware CQ; run the
+ * same command against the stock driver (LD_LIBRARY_PATH) to compare. With
+ * msg_size at or above the split minimum every SEND is split, and the bench
+ * checks that each still gives exactly one receive completion, in order,
+ * with the full byte_len.
+ *
+ * class is the QP's class (qp_context). A class 1 (latency-sensitive) QP holding a flow slot,
+ * i.e. with the pacer running, has every send completion counted into its latency histogram;
+ * its send cq cost against that of class 0 is what the recording adds per completion.
+ *
+ * usage: poll_cq_bench [dev] [msg_size] [batch] [iters] [gid_idx] [class]
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+
+static struct ibv_device *find_device(const char *name)
+{
+    int num = 0;
+    struct ibv_device **list = ibv_get_device_list(&num);
+    if (!list) {
+        fprintf(stderr, "ibv_get_device_list failed\n");
+        return NULL;
+    }
+
+    struct ibv_device *found = NULL;
+    for (int i = 0; i < num; i++) {
+        if (!name || strcmp(name, ibv_get_device_name(list[i])) == 0) {
+            found = list[i];
+            break;
+        }
+    }
+    if (!found)
+        fprintf(stderr, "No matching device found\n");
+
+    ibv_free_device_list(list);
+    return found;
+}
+
+static int connect_self(struct ibv_qp *qp, int gid_idx)
+{
+    struct ibv_port_attr port;
+    struct ibv_qp_attr attr;
+
+    if (ibv_query_port(qp->context, 1, &port)) {
+        fprintf(stderr, "ibv_query_port failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = 1;
+    attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                      IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+        fprintf(stderr, "modify to INIT failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = port.active_mtu;
+    attr.dest_qp_num = qp->qp_num;
+    attr.rq_psn = 0;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.dlid = port.lid;
+    attr.ah_attr.port_num = 1;
+    if (gid_idx >= 0) {
+        attr.ah_attr.is_global = 1;
+        attr.ah_attr.grh.hop_limit = 1;
+        attr.ah_attr.grh.sgid_index = gid_idx;
+        if (ibv_query_gid(qp->context, 1, gid_idx, &attr.ah_attr.grh.dgid)) {
+            fprintf(stderr, "ibv_query_gid failed\n");
+            return -1;
+        }
+    }
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                      IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                      IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER)) {
+        fprintf(stderr, "modify to RTR failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.sq_psn = 0;
+    attr.max_rd_atomic = 1;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT |
+                      IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                      IBV_QP_MAX_QP_RD_ATOMIC)) {
+        fprintf(stderr, "modify to RTS failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct poll_stat {
+    uint64_t ns;        /* spent in polls that returned completions */
+    uint64_t wcs;       /* completions they returned */
+    uint64_t calls;
+};
+
+/* one timed ibv_poll_cq; returns what it returned */
+static int timed_poll(struct ibv_cq *cq, int ne, struct ibv_wc *wc, struct poll_stat *st)
+{
+    uint64_t t0 = now_ns();
+    int n = ibv_poll_cq(cq, ne, wc);
+    uint64_t t1 = now_ns();
+
+    if (n > 0) {
+        st->ns += t1 - t0;
+        st->wcs += n;
+        st->calls++;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev_name = argc >= 2 ? argv[1] : NULL;
+    uint64_t msg_size = argc >= 3 ? strtoull(argv[2], NULL, 10) : 64;
+    int batch = argc >= 4 ? atoi(argv[3]) : 32;
+    int iters = argc >= 5 ? atoi(argv[4]) : 100000;
+    int gid_idx = argc >= 6 ? atoi(argv[5]) : -1;
+    long cls = argc >= 7 ? atol(argv[6]) : 0;
+
+    if (msg_size == 0 || msg_size > UINT32_MAX || batch <= 0 || batch > 1024 || iters <= 0 ||
+        cls < 0 || cls > 2) {
+        fprintf(stderr, "usage: %s [dev] [msg_size] [batch(1..1024)] [iters] [gid_idx] [class(0..2)]\n", argv[0]);
+        return 2;
+    }
+
+    struct ibv_device *dev = find_device(dev_name);
+    if (!dev)
+        return 2;
+    struct ibv_context *ctx = ibv_open_device(dev);
+    if (!ctx) {
+        fprintf(stderr, "ibv_open_device failed: %s\n", strerror(errno));
+        return 2;
+    }
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    struct ibv_cq *send_cq = pd ? ibv_create_cq(ctx, batch, NULL, NULL, 0) : NULL;
+    struct ibv_cq *recv_cq = pd ? ibv_create_cq(ctx, batch, NULL, NULL, 0) : NULL;
+    size_t buf_size = (size_t)msg_size * (batch + 1);
+    char *buf = malloc(buf_size);
+    struct ibv_mr *mr = (pd && buf) ? ibv_reg_mr(pd, buf, buf_size, IBV_ACCESS_LOCAL_WRITE) : NULL;
+    struct ibv_send_wr *swr = calloc(batch, sizeof(*swr));
+    struct ibv_recv_wr *rwr = calloc(batch, sizeof(*rwr));
+    struct ibv_sge *sge = calloc(batch + 1, sizeof(*sge));
+    struct ibv_wc *wc = calloc(batch, sizeof(*wc));
+    if (!send_cq || !recv_cq || !mr || !swr || !rwr || !sge || !wc) {
+        fprintf(stderr, "resource setup failed: %s\n", strerror(errno));
+        return 2;
+    }
+
+    struct ibv_qp_init_attr init;
+    memset(&init, 0, sizeof(init));
+    init.send_cq = send_cq;
+    init.recv_cq = recv_cq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = batch;
+    init.cap.max_recv_wr = batch;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    init.qp_context = (void *)(cls ? cls : 3);     /* 3 pins class 0: no online classification */
+    struct ibv_qp *qp = ibv_create_qp(pd, &init);
+    if (!qp || connect_self(qp, gid_idx))
+        return 2;
+
+    /* sge[0] is the send buffer, sge[1 + i] the buffer of RECV i */
+    for (int i = 0; i <= batch; i++) {
+        sge[i].addr = (uintptr_t)buf + (uint64_t)i * msg_size;
+        sge[i].length = (uint32_t)msg_size;
+        sge[i].lkey = mr->lkey;
+    }
+    for (int i = 0; i < batch; i++) {
+        swr[i].wr_id = i;
+        swr[i].opcode = IBV_WR_SEND;
+        swr[i].sg_list = &sge[0];
+        swr[i].num_sge = 1;
+        swr[i].send_flags = IBV_SEND_SIGNALED;
+        swr[i].next = i + 1 < batch ? &swr[i + 1] : NULL;
+        rwr[i].sg_list = &sge[1 + i];
+        rwr[i].num_sge = 1;
+        rwr[i].next = i + 1 < batch ? &rwr[i + 1] : NULL;
+    }
+
+    struct poll_stat send_st = { 0 }, recv_st = { 0 };
+    uint64_t seq = 0;
+    for (int it = 0; it < iters; it++) {
+        struct ibv_send_wr *bad_swr;
+        struct ibv_recv_wr *bad_rwr;
+        int sent = 0, recvd = 0, n;
+
+        for (int i = 0; i < batch; i++)
+            rwr[i].wr_id = seq + i;
+        if (ibv_post_recv(qp, &rwr[0], &bad_rwr) || ibv_post_send(qp, &swr[0], &bad_swr)) {
+            fprintf(stderr, "post failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        while (sent < batch || recvd < batch) {
+            if (sent < batch) {
+                n = timed_poll(send_cq, batch - sent, wc, &send_st);
+                if (n < 0) {
+                    fprintf(stderr, "send cq poll failed\n");
+                    return 1;
+                }
+                for (int i = 0; i < n; i++) {
+                    if (wc[i].status != IBV_WC_SUCCESS) {
+                        fprintf(stderr, "send completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                        return 1;
+                    }
+                }
+                sent += n;
+            }
+            if (recvd < batch) {
+                n = timed_poll(recv_cq, batch - recvd, wc, &recv_st);
+                if (n < 0) {
+                    fprintf(stderr, "recv cq poll failed\n");
+                    return 1;
+                }
+                /* one completion per SEND, in order, with all of its bytes */
+                for (int i = 0; i < n; i++, seq++) {
+                    if (wc[i].status != IBV_WC_SUCCESS || wc[i].opcode != IBV_WC_RECV ||
+                        wc[i].wr_id != seq || wc[i].byte_len != msg_size) {
+                        fprintf(stderr, "bad recv completion: %s wr_id %" PRIu64 " (expected %" PRIu64
+                                ") byte_len %u (expected %" PRIu64 ")\n",
+                                ibv_wc_status_str(wc[i].status), wc[i].wr_id, seq,
+                                wc[i].byte_len, msg_size);
+                        return 1;
+                    }
+                }
+                recvd += n;
+            }
+        }
+    }
+
+    /* both cqs are drained now; this is the path an app spins on */
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iters; i++) {
+        if (ibv_poll_cq(recv_cq, 1, wc) != 0) {
+            fprintf(stderr, "completion on a drained cq\n");
+            return 1;
+        }
+    }
+    uint64_t empty_ns = now_ns() - t0;
+
+    printf("msg_size=%" PRIu64 " batch=%d iters=%d class=%ld\n", msg_size, batch, iters, cls);
+    printf("send cq: %.1f ns/completion (%.1f per poll)\n",
+           (double)send_st.ns / send_st.wcs, (double)send_st.wcs / send_st.calls);
+    printf("recv cq: %.1f ns/completion (%.1f per poll)\n",
+           (double)recv_st.ns / recv_st.wcs, (double)recv_st.wcs / recv_st.calls);
+    printf("empty poll: %.1f ns\n", (double)empty_ns / iters);
+
+    ibv_destroy_qp(qp);
+    ibv_dereg_mr(mr);
+    ibv_destroy_cq(send_cq);
+    ibv_destroy_cq(recv_cq);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    free(buf);
+    free(swr);
+    free(rwr);
+    free(sge);
+    free(wc);
+    return 0;
+}
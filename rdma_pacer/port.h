@@ -0,0 +1,91 @@
+#ifndef PORT_H
+#define PORT_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+/* A pacer paces one device port: its shared block and control socket are named after the port,
+ * so the ports of a host each run a pacer of their own, and the drivers attach a qp to the one of
+ * the port it uses. The line rate is the port's, as ibv_query_port gives it. A pacer that cannot
+ * name its port (no device) takes the names of old and LINE_RATE_MB, and the drivers fall back to
+ * them for a port without a pacer of its own.
+ * Kept free of verbs so it can be tested offline; ports are given by their attributes.
+ */
+
+#define PORT_DEV_LEN        64          /* IBV_SYSFS_NAME_MAX */
+#define PORT_BLOCK_FMT      "%s-%s-%d"  /* SHARED_MEM_NAME-dev-port */
+#define PORT_SOCK_FMT       "%s-%s-%d"  /* the socket path of old-dev-port */
+#define LINE_RATE_PCT       90          /* of the port's data rate paced to; HDR 4x (200Gbps) gives 22500 MBps */
+
+/* the port a shared block belongs to, published by its pacer */
+struct pacer_port {
+    char dev[PORT_DEV_LEN];                 /* empty for a pacer that did not name one */
+    uint32_t num;
+    uint32_t line_rate;                     /* MBps paced to */
+};
+
+/* Mbps of data one lane carries at ibv_port_attr's active_speed, after its line coding
+ * (8b/10b to QDR, 64b/66b from FDR10); 0 for a speed not known here */
+static inline uint32_t port_lane_mbps(int active_speed)
+{
+    switch (active_speed) {
+    case 1:   return 2000;          /* SDR */
+    case 2:   return 4000;          /* DDR */
+    case 4:   return 8000;          /* QDR */
+    case 8:   return 10000;         /* FDR10 */
+    case 16:  return 13636;         /* FDR */
+    case 32:  return 25000;         /* EDR */
+    case 64:  return 50000;         /* HDR */
+    case 128: return 100000;        /* NDR */
+    default:  return 0;
+    }
+}
+
+/* lanes of ibv_port_attr's active_width; 0 for a width not known here */
+static inline int port_lanes(int active_width)
+{
+    switch (active_width) {
+    case 1:   return 1;
+    case 2:   return 4;
+    case 4:   return 8;
+    case 8:   return 12;
+    case 16:  return 2;
+    default:  return 0;
+    }
+}
+
+/* MBps a pacer paces a port of this speed and width to; 0 if either is not known */
+static inline uint32_t port_line_rate(int active_speed, int active_width)
+{
+    return (uint64_t)port_lane_mbps(active_speed) * port_lanes(active_width) / 8 * LINE_RATE_PCT / 100;
+}
+
+/* name of the shared block of port num of dev, from the name of old (base) */
+static inline int port_block_name(char *buf, size_t len, const char *base, const char *dev, int num)
+{
+    return snprintf(buf, len, PORT_BLOCK_FMT, base, dev, num);
+}
+
+/* Opens the shared block a qp on port num of dev is paced by: the port's own, else that of a
+ * pacer that named no port (base). The name opened goes in name (len); the fd, or -1 if neither
+ * is there. The drivers attach qps the same way. */
+static inline int port_block_open(const char *base, const char *dev, int num, int oflag, char *name, size_t len)
+{
+    int fd;
+
+    port_block_name(name, len, base, dev, num);
+    if ((fd = shm_open(name, oflag, 0)) >= 0)
+        return fd;
+    snprintf(name, len, "%s", base);
+    return shm_open(name, oflag, 0);
+}
+
+/* path of the control socket of port num of dev, from the path of old (base) */
+static inline int port_sock_path(char *buf, size_t len, const char *base, const char *dev, int num)
+{
+    return snprintf(buf, len, PORT_SOCK_FMT, base, dev, num);
+}
+
+#endif
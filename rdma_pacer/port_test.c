@@ -0,0 +1,180 @@
+/*
+ * Test for pacing per device port (port.h), against a mocked port table.
+ *
+ * Each port of the table reports a speed and width as ibv_query_port would; its line rate must be
+ * what the port carries (HDR 4x the 22500 MBps of LINE_RATE_MB), and 0 where either is unknown.
+ * A pacer is then started for each port the table runs one on, as the pacer does it: a shared
+ * block named after the port, publishing it. A qp on every port of the table must attach to the
+ * block of its own port, one on a port without a pacer to the block of a pacer that named no
+ * port, and to none when there is no such pacer either. The control sockets of the ports must
+ * be apart too.
+ *
+ * usage: port_test
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "port.h"
+
+#define MAX_PORTS   8
+
+struct mock_port {
+    const char *dev;
+    int num;
+    int active_speed, active_width;     /* as ibv_port_attr has them */
+    uint32_t line_rate;                 /* MBps it must be paced to */
+    int paced;                          /* a pacer runs on it */
+};
+
+static const struct mock_port ports[] = {
+    { "mlx5_0", 1, 64, 2, 22500, 1 },       /* HDR 4x, 200Gbps */
+    { "mlx5_1", 1, 32, 2, 11250, 1 },       /* EDR 4x, 100Gbps */
+    { "mlx4_0", 1, 4, 2, 3600, 1 },         /* QDR 4x, 40Gbps: two ports of a device */
+    { "mlx4_0", 2, 8, 1, 1125, 1 },         /* FDR10 1x, 10GbE */
+    { "mlx5_2", 1, 32, 1, 2812, 0 },        /* EDR 1x, 25GbE, without a pacer */
+    { "mlx5_3", 1, 128, 2, 45000, 0 },      /* NDR 4x */
+    { "mlx5_4", 1, 16, 2, 6136, 0 },        /* FDR 4x, 56Gbps */
+    { "mlx5_5", 1, 0, 2, 0, 0 },            /* speed unknown: LINE_RATE_MB then */
+};
+#define NPORTS ((int)(sizeof(ports) / sizeof(ports[0])))
+
+static int failures;
+static char base[64];                       /* SHARED_MEM_NAME of the test */
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+static int check_rates(void)
+{
+    int i;
+
+    for (i = 0; i < NPORTS; i++) {
+        const struct mock_port *p = &ports[i];
+        uint32_t rate = port_line_rate(p->active_speed, p->active_width);
+
+        CHECK(rate == p->line_rate, "%s port %d: speed %d width %d paced to %u MBps, not %u", p->dev, p->num,
+              p->active_speed, p->active_width, rate, p->line_rate);
+    }
+    CHECK(port_line_rate(64, 0) == 0 && port_line_rate(3, 2) == 0, "rate of an unknown width or speed");
+    return 0;
+}
+
+/* what the pacer does for its port: the block named after it, the port published in it */
+static int start_pacer(const char *dev, int num, uint32_t line_rate)
+{
+    struct pacer_port *pp;
+    char name[PORT_DEV_LEN + 64];
+    int fd;
+
+    if (dev)
+        port_block_name(name, sizeof(name), base, dev, num);
+    else
+        snprintf(name, sizeof(name), "%s", base);
+    CHECK((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0, "shm_open %s: %s", name, strerror(errno));
+    CHECK(ftruncate(fd, sizeof(*pp)) == 0, "ftruncate");
+    pp = mmap(NULL, sizeof(*pp), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(pp != MAP_FAILED, "mmap");
+    snprintf(pp->dev, sizeof(pp->dev), "%s", dev ? dev : "");
+    pp->num = num;
+    pp->line_rate = line_rate;
+    munmap(pp, sizeof(*pp));
+    return 0;
+}
+
+static void stop_pacers(void)
+{
+    char name[PORT_DEV_LEN + 64];
+    int i;
+
+    for (i = 0; i < NPORTS; i++) {
+        port_block_name(name, sizeof(name), base, ports[i].dev, ports[i].num);
+        shm_unlink(name);
+    }
+    shm_unlink(base);
+}
+
+/* a qp on port i attaches: to the pacer of want (dev NULL: the one that named no port), or to none */
+static int check_attach(int i, const char *want_dev, int want_num)
+{
+    const struct mock_port *p = &ports[i];
+    char name[PORT_DEV_LEN + 64];
+    struct pacer_port got;
+    int fd = port_block_open(base, p->dev, p->num, O_RDONLY, name, sizeof(name));
+
+    if (fd < 0) {
+        CHECK(!want_dev && want_num < 0, "qp on %s port %d attached to no pacer", p->dev, p->num);
+        return 0;
+    }
+    CHECK(read(fd, &got, sizeof(got)) == sizeof(got), "read %s", name);
+    close(fd);
+    CHECK(want_num >= 0, "qp on %s port %d attached to %s, with no pacer to attach to", p->dev, p->num, name);
+    CHECK(!strcmp(got.dev, want_dev ? want_dev : "") && (!want_dev || got.num == (uint32_t)want_num),
+          "qp on %s port %d attached to the pacer of %s port %u", p->dev, p->num, got.dev[0] ? got.dev : "-",
+          got.num);
+    CHECK(!want_dev || got.line_rate == p->line_rate, "%s port %d: pacer at %u MBps, not %u", p->dev, p->num,
+          got.line_rate, p->line_rate);
+    return 0;
+}
+
+static int check_blocks(void)
+{
+    int i;
+
+    for (i = 0; i < NPORTS; i++)
+        if (ports[i].paced && start_pacer(ports[i].dev, ports[i].num, ports[i].line_rate))
+            return -1;
+    for (i = 0; i < NPORTS; i++)
+        if (check_attach(i, ports[i].paced ? ports[i].dev : NULL, ports[i].paced ? ports[i].num : -1))
+            return -1;
+
+    /* a pacer that named no port takes the qps of the ports without one */
+    if (start_pacer(NULL, 1, 0))
+        return -1;
+    for (i = 0; i < NPORTS; i++)
+        if (check_attach(i, ports[i].paced ? ports[i].dev : NULL, ports[i].paced ? ports[i].num : 1))
+            return -1;
+    return 0;
+}
+
+static int check_sockets(void)
+{
+    char path[MAX_PORTS][108];
+    int i, j;
+
+    for (i = 0; i < NPORTS; i++) {
+        CHECK(port_sock_path(path[i], sizeof(path[i]), "/home/user/host_rdma_socket", ports[i].dev, ports[i].num)
+              < (int)sizeof(path[i]), "socket path of %s port %d too long", ports[i].dev, ports[i].num);
+        for (j = 0; j < i; j++)
+            CHECK(strcmp(path[i], path[j]), "%s port %d and %s port %d share %s", ports[i].dev, ports[i].num,
+                  ports[j].dev, ports[j].num, path[i]);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    snprintf(base, sizeof(base), "/port_test-%d", (int)getpid());
+
+    check_rates();
+    check_blocks();
+    stop_pacers();
+    check_sockets();
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("port_test: %d ports, line rates, shared blocks and sockets apart\n", NPORTS);
+    return 0;
+}
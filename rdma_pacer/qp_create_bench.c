@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+
+/*
+ * QP creation cost through the Justitia driver.
+ *
+ * Creates num_qps RC QPs on one PD and CQ and reports the time per
+ * ibv_create_qp/ibv_destroy_qp together with the resident and pinned memory
+ * each QP adds (VmRSS/VmPin from /proc/self/status). The split QPs of a user
+ * QP are only made when it is connected, so with connect set the QPs are also
+ * connected to each other in pairs over port 1 (loopback) and the time to RTS
+ * and the memory each QP adds by then are reported, and again once the split
+ * QP EXCHANGEs have settled: pairs on one PD share their split QPs, and those
+ * no QP splits over are let go of.
+ *
+ * usage: qp_create_bench [dev] [num_qps] [connect]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+static struct ibv_device *find_device(const char *name)
+{
+    int num = 0;
+    struct ibv_device **list = ibv_get_device_list(&num);
+    if (!list) {
+        fprintf(stderr, "ibv_get_device_list failed\n");
+        return NULL;
+    }
+
+    struct ibv_device *found = NULL;
+    for (int i = 0; i < num; i++) {
+        if (!name || strcmp(name, ibv_get_device_name(list[i])) == 0) {
+            found = list[i];
+            break;
+        }
+    }
+    if (!found)
+        fprintf(stderr, "No matching device found\n");
+
+    ibv_free_device_list(list);
+    return found;
+}
+
+/* value in kB of a "Key:   123 kB" line of /proc/self/status, 0 if missing */
+static long status_kb(const char *key)
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = 0;
+    size_t len = strlen(key);
+
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, len) == 0 && line[len] == ':') {
+            kb = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* walk qp to RTS, connected to dest_qp_num on port 1 of its own device */
+static int connect_qp(struct ibv_qp *qp, uint32_t dest_qp_num, struct ibv_port_attr *port,
+                      union ibv_gid *gid)
+{
+    struct ibv_qp_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = 1;
+    attr.qp_access_flags = IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS))
+        return -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = port->active_mtu;
+    attr.dest_qp_num = dest_qp_num;
+    attr.rq_psn = 0;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.dlid = port->lid;
+    attr.ah_attr.port_num = 1;
+    if (port->link_layer == IBV_LINK_LAYER_ETHERNET) {
+        attr.ah_attr.is_global = 1;
+        attr.ah_attr.grh.dgid = *gid;
+        attr.ah_attr.grh.hop_limit = 1;
+    }
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+                      IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER))
+        return -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    return ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                         IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev_name = argc >= 2 ? argv[1] : NULL;
+    int num_qps = argc >= 3 ? atoi(argv[2]) : 256;
+    int connect = argc >= 4 ? atoi(argv[3]) : 0;
+
+    if (num_qps <= 0 || (connect && num_qps % 2)) {
+        fprintf(stderr, "usage: %s [dev] [num_qps] [connect]; connected QPs come in pairs\n", argv[0]);
+        return 2;
+    }
+
+    struct ibv_device *dev = find_device(dev_name);
+    if (!dev)
+        return 2;
+    struct ibv_context *ctx = ibv_open_device(dev);
+    if (!ctx) {
+        fprintf(stderr, "ibv_open_device failed: %s\n", strerror(errno));
+        return 2;
+    }
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    struct ibv_cq *cq = pd ? ibv_create_cq(ctx, 64, NULL, NULL, 0) : NULL;
+    struct ibv_qp **qps = calloc(num_qps, sizeof(*qps));
+    if (!cq || !qps) {
+        fprintf(stderr, "resource setup failed: %s\n", strerror(errno));
+        return 2;
+    }
+
+    struct ibv_qp_init_attr init;
+    memset(&init, 0, sizeof(init));
+    init.send_cq = cq;
+    init.recv_cq = cq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = 64;
+    init.cap.max_recv_wr = 64;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    init.qp_context = (void *)3;     /* pinned to the bw class */
+
+    long rss0 = status_kb("VmRSS"), pin0 = status_kb("VmPin");
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < num_qps; i++) {
+        qps[i] = ibv_create_qp(pd, &init);
+        if (!qps[i]) {
+            fprintf(stderr, "ibv_create_qp #%d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+    }
+    uint64_t t1 = now_ns();
+    long rss1 = status_kb("VmRSS"), pin1 = status_kb("VmPin");
+
+    if (connect) {
+        struct ibv_port_attr port;
+        union ibv_gid gid;
+
+        memset(&gid, 0, sizeof(gid));
+        if (ibv_query_port(ctx, 1, &port) ||
+            (port.link_layer == IBV_LINK_LAYER_ETHERNET && ibv_query_gid(ctx, 1, 0, &gid))) {
+            fprintf(stderr, "ibv_query_port failed: %s\n", strerror(errno));
+            return 1;
+        }
+        uint64_t c0 = now_ns();
+        for (int i = 0; i < num_qps; i++) {
+            if (connect_qp(qps[i], qps[i ^ 1]->qp_num, &port, &gid)) {
+                fprintf(stderr, "connecting qp #%d failed: %s\n", i, strerror(errno));
+                return 1;
+            }
+        }
+        uint64_t c1 = now_ns();
+        /* the EXCHANGE goes out ahead of the first post and is answered without the application */
+        for (int i = 0; i < num_qps; i += 2) {
+            struct ibv_send_wr wr, *bad_wr;
+
+            memset(&wr, 0, sizeof(wr));
+            wr.opcode = IBV_WR_RDMA_WRITE;
+            if (ibv_post_send(qps[i], &wr, &bad_wr)) {
+                fprintf(stderr, "posting to qp #%d failed\n", i);
+                return 1;
+            }
+        }
+        long rss2 = status_kb("VmRSS"), pin2 = status_kb("VmPin");
+        sleep(1);
+        long rss3 = status_kb("VmRSS"), pin3 = status_kb("VmPin");
+
+        printf("connect: %.1f us/qp\n", (double)(c1 - c0) / num_qps / 1000);
+        printf("memory at RTS: %.1f kB/qp resident, %.1f kB/qp pinned\n",
+               (double)(rss2 - rss0) / num_qps, (double)(pin2 - pin0) / num_qps);
+        printf("memory settled: %.1f kB/qp resident, %.1f kB/qp pinned\n",
+               (double)(rss3 - rss0) / num_qps, (double)(pin3 - pin0) / num_qps);
+    }
+
+    for (int i = 0; i < num_qps; i++) {
+        if (ibv_destroy_qp(qps[i])) {
+            fprintf(stderr, "ibv_destroy_qp #%d failed\n", i);
+            return 1;
+        }
+    }
+    uint64_t t2 = now_ns();
+
+    printf("num_qps=%d\n", num_qps);
+    printf("create: %.1f us/qp; destroy: %.1f us/qp\n",
+           (double)(t1 - t0) / num_qps / 1000, (double)(t2 - t1) / num_qps / 1000);
+    printf("memory: %.1f kB/qp resident, %.1f kB/qp pinned\n",
+           (double)(rss1 - rss0) / num_qps, (double)(pin1 - pin0) / num_qps);
+
+    free(qps);
+    ibv_destroy_cq(cq);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    return 0;
+}
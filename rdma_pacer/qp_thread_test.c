@@ -13,7 +13,7 @@ struct thread_arg {
     struct ibv_pd *pd;
     struct ibv_cq *cq;
     int qp_per_thread;
-    long qp_class; /* 0=bw, 1=lat, 2=tput */
+    long qp_class; /* 0=classified online, 1=lat, 2=tput, 3=bw */
     int rc;
 };
 
@@ -0,0 +1,138 @@
+#include "replay.h"
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../justitia/capture.h"
+
+/* the WRs of one thread, in the order it posted them */
+struct run {
+    struct replay_post *post;       /* ns holds the tsc until the runs are merged */
+    size_t n, next;
+    double cpu_mhz;
+};
+
+static int load_run(struct run *run, const char *path)
+{
+    struct capture_header h;
+    struct capture_rec c;
+    struct replay_post *p;
+    uint64_t last = 0;
+    size_t cap = 0;
+    FILE *f;
+
+    memset(run, 0, sizeof(*run));
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != CAPTURE_MAGIC || h.version != CAPTURE_VERSION
+        || h.cpu_mhz <= 0) {
+        fprintf(stderr, "%s is not a capture of version %d\n", path, CAPTURE_VERSION);
+        fclose(f);
+        return -1;
+    }
+    run->cpu_mhz = h.cpu_mhz;
+    while (fread(&c, sizeof(c), 1, f) == 1) {
+        if (run->n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            if (!(p = realloc(run->post, cap * sizeof(*p)))) {
+                perror("realloc");
+                fclose(f);
+                return -1;
+            }
+            run->post = p;
+        }
+        /* a thread that moved to a core whose tsc lags must not post before its last WR */
+        if (c.tsc < last)
+            c.tsc = last;
+        last = c.tsc;
+        p = &run->post[run->n++];
+        p->ns = c.tsc;
+        p->qpn = c.qpn;
+        p->bytes = c.bytes;
+        p->send_flags = c.send_flags;
+        p->opcode = c.opcode;
+        p->cls = c.cls;
+        p->num_sge = c.num_sge;
+        p->pid = h.pid;
+        p->tid = h.tid;
+    }
+    fclose(f);
+    return 0;
+}
+
+int replay_load(struct replay *r, const char *prefix, double scale)
+{
+    char pattern[4096];
+    struct run *runs = NULL;
+    uint64_t tsc0 = UINT64_MAX;
+    glob_t g;
+    size_t i, total = 0;
+    int best, ret = -1;
+
+    memset(r, 0, sizeof(*r));
+    if (scale <= 0) {
+        fprintf(stderr, "time scale %g\n", scale);
+        return -1;
+    }
+    snprintf(pattern, sizeof(pattern), "%s.*", prefix);
+    if (glob(pattern, 0, NULL, &g) || !g.gl_pathc) {
+        fprintf(stderr, "no capture at %s\n", pattern);
+        return -1;
+    }
+    if (!(runs = calloc(g.gl_pathc, sizeof(*runs)))) {
+        perror("calloc");
+        goto out;
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        if (load_run(&runs[i], g.gl_pathv[i]))
+            goto out;
+        if (runs[i].n && runs[i].post[0].ns < tsc0)
+            tsc0 = runs[i].post[0].ns;
+        total += runs[i].n;
+    }
+    r->files = g.gl_pathc;
+    if (!total) {
+        fprintf(stderr, "nothing posted in %s\n", pattern);
+        goto out;
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        size_t j;
+
+        for (j = 0; j < runs[i].n; j++)
+            runs[i].post[j].ns = (runs[i].post[j].ns - tsc0) * 1000.0 / runs[i].cpu_mhz * scale;
+    }
+
+    /* the threads merged on time; a tie goes to the file globbed first */
+    if (!(r->post = malloc(total * sizeof(*r->post)))) {
+        perror("malloc");
+        goto out;
+    }
+    while (r->n < total) {
+        best = -1;
+        for (i = 0; i < g.gl_pathc; i++)
+            if (runs[i].next < runs[i].n
+                && (best < 0 || runs[i].post[runs[i].next].ns < runs[best].post[runs[best].next].ns))
+                best = i;
+        r->post[r->n++] = runs[best].post[runs[best].next++];
+    }
+    r->span_ns = r->post[r->n - 1].ns;
+    ret = 0;
+
+out:
+    for (i = 0; runs && i < g.gl_pathc; i++)
+        free(runs[i].post);
+    free(runs);
+    globfree(&g);
+    if (ret)
+        replay_free(r);
+    return ret;
+}
+
+void replay_free(struct replay *r)
+{
+    free(r->post);
+    memset(r, 0, sizeof(*r));
+}
@@ -0,0 +1,36 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Loader of the workloads the drivers capture (justitia/capture.h): an application started with
+ * JUSTITIA_CAPTURE set to a path prefix leaves a file <prefix>.<pid>.<tid> for every thread that
+ * posted. replay_load merges the files of a prefix, the threads of one host, into one sequence of
+ * WRs in tsc order, timed in ns since the first one and scaled for replay: a scale of 0.5 replays
+ * the workload twice as fast. Kept free of verbs: pacersim replays captures offline.
+ */
+
+struct replay_post {
+    uint64_t ns;                    /* since the first WR of the host, scaled */
+    uint32_t qpn;
+    uint32_t bytes;
+    uint32_t send_flags;
+    uint8_t opcode;                 /* enum ibv_wr_opcode */
+    int8_t cls;                     /* FLOW_CLASS_* it was paced as, -1 unpaced */
+    uint16_t num_sge;
+    int32_t pid, tid;               /* of the thread that posted it */
+};
+
+struct replay {
+    struct replay_post *post;
+    size_t n;
+    int files;
+    uint64_t span_ns;               /* from the first WR to the last, scaled */
+};
+
+/* 0, or -1 with what went wrong on stderr */
+int replay_load(struct replay *r, const char *prefix, double scale);
+void replay_free(struct replay *r);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef RESERVE_H
+#define RESERVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimum-rate reservations of throughput flows. A tput qp may ask for a rate (MBps) when it
+ * joins; the pacer admits it while all the reservations it holds add up to no more than its
+ * limit, and rejects it otherwise (the qp then runs best effort). Every reservation has a bucket
+ * filling at its rate: while its flow waits for a token and the bucket holds a chunk of bytes,
+ * the flow is granted one from there, ahead of the tokens the virtual link is shared with. Those
+ * pay the grant back, so what the reservations do not use is left to everyone. A bucket whose
+ * flow has nothing to send stops filling at RESERVE_BURST chunks.
+ * Kept free of verbs so it can be tested offline.
+ */
+
+#define RESERVE_MAX     64      /* reservations held at a time */
+#define RESERVE_BURST   4       /* chunks a bucket holds at most */
+
+/* admits a reservation of rate MBps against limit, *total being reserved already;
+ * returns the rate granted, 0 if it is rejected */
+static inline uint32_t reserve_admit(uint32_t *total, uint32_t limit, uint32_t rate)
+{
+    if (!rate || *total > limit || rate > limit - *total)
+        return 0;
+    *total += rate;
+    return rate;
+}
+
+struct reserve_bucket {
+    int slot;
+    uint32_t rate;          /* MBps, i.e. bytes per us */
+    double bytes;           /* filled and not granted yet */
+    uint64_t last;          /* cycles when it was last filled */
+};
+
+struct reserve_set {
+    uint32_t gen;           /* of the rates it was built from */
+    int n, next;            /* buckets; where the next grant looks first */
+    struct reserve_bucket b[RESERVE_MAX];
+};
+
+/* rebuilds s from the per-slot rates rate[0, n) of generation gen at cycles now. Slots keeping
+ * their rate keep their bucket. */
+static inline void reserve_sync(struct reserve_set *s, const uint32_t *rate, int n, uint32_t gen, uint64_t now)
+{
+    struct reserve_set old = *s;
+    struct reserve_bucket *b;
+    uint32_t r;
+    int i, j;
+
+    s->gen = gen;
+    s->n = 0;
+    s->next = 0;
+    for (i = 0; i < n && s->n < RESERVE_MAX; i++) {
+        if (!(r = __atomic_load_n(&rate[i], __ATOMIC_RELAXED)))
+            continue;
+        b = &s->b[s->n++];
+        b->slot = i;
+        b->rate = r;
+        b->bytes = 0;
+        b->last = now;
+        for (j = 0; j < old.n; j++) {
+            if (old.b[j].slot == i && old.b[j].rate == r) {
+                b->bytes = old.b[j].bytes;
+                b->last = old.b[j].last;
+                break;
+            }
+        }
+    }
+}
+
+/* The slot to grant a token of chunk bytes from its reservation at cycles now, or -1: the first
+ * bucket from s->next on holding a chunk whose flow waits (pending[slot * stride] set). It is
+ * charged the chunk. */
+static inline int reserve_next(struct reserve_set *s, uint64_t now, double cycles_per_us, uint32_t chunk,
+                               const uint8_t *pending, size_t stride)
+{
+    struct reserve_bucket *b;
+    double cap = (double)RESERVE_BURST * chunk;
+    int k, j;
+
+    for (k = 0; k < s->n; k++) {
+        j = s->next + k < s->n ? s->next + k : s->next + k - s->n;
+        b = &s->b[j];
+        if (now > b->last) {
+            b->bytes += (now - b->last) / cycles_per_us * b->rate;
+            if (b->bytes > cap)
+                b->bytes = cap;
+            b->last = now;
+        }
+        if (b->bytes >= chunk && __atomic_load_n(&pending[b->slot * stride], __ATOMIC_RELAXED)) {
+            b->bytes -= chunk;
+            s->next = j + 1 < s->n ? j + 1 : 0;
+            return b->slot;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+/*
+ * Test for the minimum-rate reservations of throughput flows (reserve.h), together with the
+ * floor they put under the AIMD of the virtual link (link_share.h), as the pacer uses them.
+ *
+ * Admission: reservations are admitted while they add up to no more than the limit, given back
+ * on leave, and a set rebuilt after a change keeps the buckets of the slots it did not touch.
+ *
+ * Pressure: a sender with reserved tput flows and best-effort elephants, all of them always
+ * waiting for tokens, runs the token generator of generate_fetch_tokens against a monitor whose
+ * latency flows miss their tail target whenever the link is above a room. The room is below the
+ * elephants' fair share, so the AIMD keeps halving. Over every window after warm-up each reserved
+ * flow must get at least its reservation, the flows all together no more than the link, and the
+ * best-effort ones even shares of what is left, no less than their cut of the elephants' min cap.
+ * The same mixes run without reservations to show the reserved flows would be cut below their
+ * rates then.
+ *
+ * usage: reserve_test [seconds] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "link_share.h"
+#include "reserve.h"
+
+#define LINE_RATE       22500       /* MBps, as LINE_RATE_MB */
+#define LIMIT           (LINE_RATE / 2)     /* as MAX_RESERVED_MB */
+#define CHUNK           5000        /* bytes per token with latency flows, as SMALL_CHUNK_SIZE */
+#define MAX_TOKEN       5           /* as in pacer.c */
+#define CYCLES_PER_US   1000        /* the simulated clock ticks in ns */
+#define STEP_NS         100         /* how often the generator looks at the buckets */
+#define MONITOR_NS      200000      /* monitor_latency period */
+#define WARMUP_NS       50000000
+#define WINDOW_NS       10000000
+#define MAX_SIM_FLOWS   16
+#define RECEIVER_BIG    40          /* elephants at the receiver, from all its senders */
+#define RANDOM_MIXES    6
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+struct mix {
+    const char *name;
+    int flows;                          /* slots 0..flows-1 */
+    uint32_t ask[MAX_SIM_FLOWS];        /* MBps a flow asks to reserve; 0 for best effort */
+    uint32_t room;                      /* MBps above which the latency flows miss their target */
+};
+
+struct result {
+    double worst[MAX_SIM_FLOWS];        /* lowest MBps of a flow over the windows */
+    double mean[MAX_SIM_FLOWS];
+    double link;                        /* mean MBps of the link */
+    double share;                       /* MBps of the elephants' min cap per elephant */
+};
+
+static int check_admission(void)
+{
+    struct reserve_set s = { 0 };
+    uint32_t rate[8] = { 0 }, total = 0;
+    int i;
+
+    CHECK(reserve_admit(&total, LIMIT, 0) == 0 && total == 0, "admitted a zero rate");
+    CHECK(reserve_admit(&total, LIMIT, 4000) == 4000, "rejected 4000 of an empty link");
+    CHECK(reserve_admit(&total, LIMIT, 2000) == 2000, "rejected 2000 with 4000 reserved");
+    CHECK(reserve_admit(&total, LIMIT, 6000) == 0 && total == 6000, "admitted 6000 with 6000 of %d reserved", LIMIT);
+    CHECK(reserve_admit(&total, LIMIT, LIMIT - 6000) == LIMIT - 6000 && total == LIMIT, "rejected what is left");
+    CHECK(reserve_admit(&total, LIMIT, 1) == 0, "admitted past the limit");
+    total -= 2000;      /* a reserved flow leaves */
+    CHECK(reserve_admit(&total, LIMIT, 2000) == 2000 && total == LIMIT, "rejected the rate given back");
+
+    /* a bucket keeps its credit across a rebuild for another slot, and starts empty when new */
+    rate[1] = 1000;
+    rate[5] = 3000;
+    reserve_sync(&s, rate, 8, 1, 0);
+    CHECK(s.n == 2 && s.b[0].slot == 1 && s.b[1].slot == 5, "set of %d buckets", s.n);
+    uint8_t pending[8] = { 0 };
+    CHECK(reserve_next(&s, 1000 * CYCLES_PER_US, CYCLES_PER_US, CHUNK, pending, 1) < 0, "granted to no one waiting");
+    rate[3] = 2000;
+    reserve_sync(&s, rate, 8, 2, 1000 * CYCLES_PER_US);
+    for (i = 0; i < s.n; i++) {
+        double want = s.b[i].slot == 3 ? 0 : (double)RESERVE_BURST * CHUNK;
+        CHECK(s.b[i].bytes == want, "slot %d holds %.0f bytes after the rebuild, not %.0f", s.b[i].slot,
+              s.b[i].bytes, want);
+    }
+    pending[3] = 1;
+    CHECK(reserve_next(&s, 1000 * CYCLES_PER_US, CYCLES_PER_US, CHUNK, pending, 1) < 0, "granted from an empty bucket");
+    CHECK(reserve_next(&s, 1003 * CYCLES_PER_US, CYCLES_PER_US, CHUNK, pending, 1) == 3, "no grant from a full chunk");
+    return 0;
+}
+
+/* one mix through the generator and the monitor for ns; reservations are admitted if reserve */
+static void run_mix(const struct mix *m, int reserve, uint64_t ns, struct result *res)
+{
+    static struct reserve_set rs;
+    uint32_t rate[MAX_SIM_FLOWS] = { 0 }, reserved = 0, min_cap, floor;
+    uint32_t link_cap = LINE_RATE, tokens = 1, debt = 0;
+    uint64_t bytes[MAX_SIM_FLOWS] = { 0 }, window[MAX_SIM_FLOWS] = { 0 }, start[MAX_SIM_FLOWS] = { 0 };
+    uint64_t link_sum = 0, link_n = 0;
+    uint64_t t, next_token = 0, next_monitor = MONITOR_NS, next_window = WARMUP_NS + WINDOW_NS;
+    uint8_t pending[MAX_SIM_FLOWS];
+    int i, rr = 0;
+
+    for (i = 0; i < m->flows; i++) {
+        pending[i] = 1;
+        res->worst[i] = 1e18;
+        if (reserve && m->ask[i])
+            rate[i] = reserve_admit(&reserved, LIMIT, m->ask[i]);
+    }
+    rs.gen = 0;
+    rs.n = 0;
+    reserve_sync(&rs, rate, m->flows, 1, 0);
+
+    /* as monitor_latency with TREAT_L_AS_ONE: all the sender's flows are elephants */
+    min_cap = (uint32_t)((double)m->flows / (RECEIVER_BIG + 1) * LINE_RATE + 0.5);
+    floor = link_cap_floor(min_cap, reserved, LINE_RATE);
+    res->share = (double)min_cap / m->flows;
+
+    for (t = 0; t < ns; t += STEP_NS) {
+        if (t >= next_monitor) {
+            link_cap = link_cap_aimd(link_cap, floor, LINE_RATE, link_cap > m->room);
+            next_monitor += MONITOR_NS;
+        }
+        if (t >= WARMUP_NS) {
+            link_sum += link_cap;
+            link_n++;
+        }
+
+        /* reservations first; every flow is back to waiting as soon as it is granted */
+        while ((i = reserve_next(&rs, t, CYCLES_PER_US, CHUNK, pending, 1)) >= 0) {
+            bytes[i] += CHUNK;
+            debt++;
+        }
+        /* then the shared tokens round-robin */
+        while (tokens) {
+            tokens--;
+            bytes[rr] += CHUNK;
+            rr = (rr + 1) % m->flows;
+        }
+        /* and the next shared token, unless the reservations took it */
+        while (t >= next_token) {
+            next_token += (uint64_t)CHUNK * 1000 / link_cap;
+            if (debt) {
+                if (debt > RESERVE_MAX * RESERVE_BURST)
+                    debt = RESERVE_MAX * RESERVE_BURST;
+                debt--;
+            } else if (tokens < MAX_TOKEN) {
+                tokens++;
+            }
+        }
+
+        if (t + STEP_NS >= next_window) {
+            for (i = 0; i < m->flows; i++) {
+                double mbps = (double)(bytes[i] - window[i]) * 1000 / WINDOW_NS;
+                if (mbps < res->worst[i])
+                    res->worst[i] = mbps;
+                window[i] = bytes[i];
+            }
+            next_window += WINDOW_NS;
+        }
+        if (t + STEP_NS == WARMUP_NS)
+            for (i = 0; i < m->flows; i++)
+                start[i] = window[i] = bytes[i];
+    }
+    for (i = 0; i < m->flows; i++)
+        res->mean[i] = (double)(bytes[i] - start[i]) * 1000 / (t - WARMUP_NS);
+    res->link = link_n ? (double)link_sum / link_n : 0;
+}
+
+/* checks one mix; with expect_cut some reserved flow must fall below its rate without reservations */
+static int check_mix(const struct mix *m, uint64_t ns, int expect_cut)
+{
+    struct result with, without;
+    double be_lo = 1e18, be_hi = 0, sum = 0;
+    int i, cut = 0;
+
+    run_mix(m, 1, ns, &with);
+    run_mix(m, 0, ns, &without);
+
+    printf("%s: link %.0f MBps with reservations, %.0f without\n", m->name, with.link, without.link);
+    for (i = 0; i < m->flows; i++) {
+        printf("  flow %2d: asks %5u MBps; with reservations %7.1f mean, %7.1f worst window; without %7.1f, %7.1f\n",
+               i, m->ask[i], with.mean[i], with.worst[i], without.mean[i], without.worst[i]);
+        if (m->ask[i]) {
+            CHECK(with.worst[i] >= 0.99 * m->ask[i], "%s: flow %d got %.1f of the %u MBps it reserved", m->name, i,
+                  with.worst[i], m->ask[i]);
+            cut |= without.worst[i] < 0.9 * m->ask[i];
+        } else {
+            if (with.worst[i] < be_lo)
+                be_lo = with.worst[i];
+            if (with.worst[i] > be_hi)
+                be_hi = with.worst[i];
+        }
+        sum += with.mean[i];
+    }
+    CHECK(sum <= 1.01 * with.link, "%s: flows take %.0f MBps of a %.0f MBps link", m->name, sum, with.link);
+    if (be_hi > 0) {
+        CHECK(be_lo >= 0.9 * be_hi, "%s: best-effort flows get %.1f..%.1f MBps", m->name, be_lo, be_hi);
+        CHECK(be_lo >= 0.98 * with.share, "%s: best-effort flows get %.1f MBps, below their %.1f of the min cap",
+              m->name, be_lo, with.share);
+    }
+    CHECK(cut || !expect_cut, "%s: no reserved flow is cut below its rate without reservations", m->name);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    double secs = argc > 1 ? atof(argv[1]) : 0.25;
+    unsigned seed = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+    uint64_t ns = (uint64_t)(secs * 1e9);
+    static const struct mix fixed[] = {
+        { "two reserved, four best effort", 6, { 4000, 2000 }, 2000 },
+        { "one reserved, seven best effort", 8, { 0, 0, 0, 5000 }, 6000 },
+        { "all reserved up to the limit", 3, { 5000, 3000, LIMIT - 8000 }, 1000 },
+    };
+    struct mix m;
+    int i, k, r;
+
+    if (ns < WARMUP_NS + 2 * WINDOW_NS)
+        return 2;
+    srand(seed);
+
+    check_admission();
+    for (i = 0; i < (int)(sizeof(fixed) / sizeof(fixed[0])); i++)
+        check_mix(&fixed[i], ns, 1);
+
+    /* random mixes: up to 4 reservations within the limit, under a room below them */
+    for (r = 0; r < RANDOM_MIXES; r++) {
+        m.name = "random";
+        m.flows = 4 + rand() % (MAX_SIM_FLOWS - 4);
+        for (i = 0; i < MAX_SIM_FLOWS; i++)
+            m.ask[i] = 0;
+        for (k = 0, i = 0; k < 4; k++) {
+            int slot = rand() % m.flows;
+            uint32_t ask = 500 + rand() % 4000;
+            if (!m.ask[slot] && i + ask <= LIMIT) {
+                m.ask[slot] = ask;
+                i += ask;
+            }
+        }
+        m.room = 1 + rand() % (i ? i : 1);
+        check_mix(&m, ns, 0);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("reserve_test: passed (%.2f s per mix, seed %u)\n", secs, seed);
+    return 0;
+}
@@ -0,0 +1,252 @@
+#include "runtime.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define RT_EVENTS   16
+
+int rt_init(struct runtime *rt, uint32_t tsc_khz)
+{
+    struct epoll_event ev;
+
+    memset(rt, 0, sizeof(*rt));
+    rt->tsc_khz = tsc_khz;
+    rt->tick = rt_cycles(rt, RT_TICK_NS);
+    rt->spin = rt_cycles(rt, RT_SPIN_NS);
+    rt->wake = rt_cycles(rt, RT_WAKE_NS);
+    rt->fds = rt_cycles(rt, RT_FDS_NS);
+    if (!rt->tick) {
+        errno = EINVAL;
+        return -1;
+    }
+    rt->at = get_cycles() / rt->tick;
+    rt->tfd = -1;
+    if ((rt->epfd = epoll_create1(0)) < 0)
+        return -1;
+    if ((rt->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+        goto fail;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         /* the timerfd */
+    if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, rt->tfd, &ev))
+        goto fail;
+    return 0;
+
+fail:
+    rt_close(rt);
+    return -1;
+}
+
+void rt_close(struct runtime *rt)
+{
+    if (rt->tfd >= 0)
+        close(rt->tfd);
+    if (rt->epfd >= 0)
+        close(rt->epfd);
+    rt->tfd = rt->epfd = -1;
+}
+
+static unsigned slot_of(struct runtime *rt, uint64_t due)
+{
+    uint64_t t = due / rt->tick;
+
+    /* a timer of the past goes in the slot looked at next */
+    if (t < rt->at)
+        t = rt->at;
+    return t & (RT_WHEEL_SLOTS - 1);
+}
+
+void rt_cancel(struct runtime *rt, struct rt_task *t)
+{
+    struct rt_task **p;
+
+    if (!t->armed)
+        return;
+    for (p = &rt->wheel[t->slot]; *p != t; p = &(*p)->next)
+        ;
+    *p = t->next;
+    t->armed = 0;
+    rt->armed--;
+}
+
+void rt_at(struct runtime *rt, struct rt_task *t, uint64_t due)
+{
+    struct rt_task **p;
+
+    rt_cancel(rt, t);
+    t->due = due;
+    t->slot = slot_of(rt, due);
+    p = &rt->wheel[t->slot];
+    t->next = *p;
+    *p = t;
+    t->armed = 1;
+    rt->armed++;
+}
+
+int rt_poll(struct runtime *rt, struct rt_task *t, int on)
+{
+    if (on && !t->polled) {
+        if (rt->npollers == RT_MAX_POLLERS)
+            return -1;
+        rt->pollers[rt->npollers++] = t;
+        t->polled = rt->npollers;
+    } else if (!on && t->polled) {
+        /* the last one takes its place */
+        rt->pollers[t->polled - 1] = rt->pollers[--rt->npollers];
+        rt->pollers[t->polled - 1]->polled = t->polled;
+        t->polled = 0;
+    }
+    return 0;
+}
+
+int rt_watch(struct runtime *rt, struct rt_task *t, int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = t;
+    return epoll_ctl(rt->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* runs the timers due by now: the slots from the one of at to that of now, a turn at most; a
+ * timer in them that is due a later turn stays */
+static void expire(struct runtime *rt, uint64_t now)
+{
+    uint64_t end = now / rt->tick, t;
+    struct rt_task *due = NULL, **p, *task;
+
+    if (!rt->armed) {
+        rt->at = end;
+        return;
+    }
+    t = end - rt->at >= RT_WHEEL_SLOTS ? end - RT_WHEEL_SLOTS + 1 : rt->at;
+    for (; t <= end; t++) {
+        p = &rt->wheel[t & (RT_WHEEL_SLOTS - 1)];
+        while ((task = *p)) {
+            if (task->due > now) {
+                p = &task->next;
+                continue;
+            }
+            *p = task->next;
+            task->armed = 0;
+            rt->armed--;
+            task->next = due;
+            due = task;
+        }
+    }
+    /* the slot of now may get more timers of this tick: it is looked at again */
+    rt->at = end;
+    /* run after the wheel is left alone, as they may arm timers again */
+    while ((task = due)) {
+        due = task->next;
+        task->runs++;
+        task->run(rt, task, now);
+    }
+}
+
+/* tsc of the next timer; 0 if none is armed */
+static uint64_t next_due(struct runtime *rt)
+{
+    uint64_t next = 0;
+    struct rt_task *t;
+    int i;
+
+    if (!rt->armed)
+        return 0;
+    for (i = 0; i < RT_WHEEL_SLOTS; i++)
+        for (t = rt->wheel[i]; t; t = t->next)
+            if (!next || t->due < next)
+                next = t->due;
+    return next;
+}
+
+/* waits up to timeout_ms for the fds and runs the tasks of those readable; -1 if epoll fails */
+static int events(struct runtime *rt, int timeout_ms)
+{
+    struct epoll_event ev[RT_EVENTS];
+    struct rt_task *t;
+    uint64_t exp, now;
+    int i, n;
+
+    n = epoll_wait(rt->epfd, ev, RT_EVENTS, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    now = get_cycles();
+    rt->fds_at = now;
+    for (i = 0; i < n; i++) {
+        if (!(t = ev[i].data.ptr)) {
+            if (read(rt->tfd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+                return -1;
+            continue;
+        }
+        t->runs++;
+        t->run(rt, t, now);
+    }
+    return 0;
+}
+
+/* sleeps until the timer due at next, less RT_WAKE_NS; with next 0, until an fd wakes it */
+static int sleep_until(struct runtime *rt, uint64_t next, uint64_t now)
+{
+    struct itimerspec its;
+    uint64_t ns;
+
+    rt->sleeps++;
+    if (!next)
+        return events(rt, -1);
+    memset(&its, 0, sizeof(its));
+    ns = (next - rt->wake - now) * 1000000 / rt->tsc_khz;
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    if (timerfd_settime(rt->tfd, 0, &its, NULL))
+        return -1;
+    return events(rt, -1);
+}
+
+void rt_run(struct runtime *rt)
+{
+    struct rt_task *t;
+    uint64_t now, next;
+    int i;
+
+    while (!rt->stop) {
+        now = get_cycles();
+        expire(rt, now);
+        for (i = 0; i < rt->npollers; ) {
+            t = rt->pollers[i];
+            t->runs++;
+            t->run(rt, t, now);
+            /* one that stopped polling left its place to the last */
+            if (rt->pollers[i] == t)
+                i++;
+        }
+        rt->passes++;
+        if (rt->stop)
+            break;
+
+        now = get_cycles();
+        if (rt->npollers) {
+            if (now - rt->fds_at >= rt->fds && events(rt, 0)) {
+                perror("epoll_wait");
+                return;
+            }
+            continue;
+        }
+        next = next_due(rt);
+        if (next && (next <= now || next - now < rt->spin)) {
+            if (now - rt->fds_at >= rt->fds && events(rt, 0)) {
+                perror("epoll_wait");
+                return;
+            }
+            continue;
+        }
+        if (sleep_until(rt, next, now)) {
+            perror("runtime");
+            return;
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <stdint.h>
+#include "get_clock.h"
+
+/* The pacer's single-core runtime (pacer -s): token generation, probing and control handling run
+ * as tasks on one pinned core, instead of a thread spinning on a core of its own each. A task runs
+ * when its timer fires, when an fd it watches is readable, and on every pass of the loop while it
+ * polls. Timers sit on a hashed wheel of RT_WHEEL_SLOTS slots of RT_TICK_NS each; one due more
+ * than a turn out waits in its slot for the turns to pass.
+ * While a task polls, the loop spins through the pollers and the timers due, and looks at the fds
+ * every RT_FDS_NS. Once none polls it spins only for a timer closer than RT_SPIN_NS; for a later
+ * one it sleeps in epoll_wait, until a timerfd set RT_WAKE_NS before the timer goes off or a
+ * watched fd wakes it. With no timer armed it sleeps until an fd wakes it.
+ * Kept free of verbs so it can be tested offline; times are tsc cycles (get_clock.h).
+ */
+
+#define RT_WHEEL_BITS       8
+#define RT_WHEEL_SLOTS      (1 << RT_WHEEL_BITS)
+#define RT_TICK_NS          1000        /* a slot of the wheel: a turn is 256us */
+#define RT_SPIN_NS          20000       /* a timer closer than this is spun for, not slept for */
+#define RT_WAKE_NS          10000       /* woken this much before a timer slept for, and spun the rest */
+#define RT_FDS_NS           50000       /* between two looks at the fds while a task polls */
+#define RT_MAX_POLLERS      8
+
+struct runtime;
+struct rt_task;
+
+/* now is the tsc the pass started at */
+typedef void (*rt_fn)(struct runtime *rt, struct rt_task *t, uint64_t now);
+
+struct rt_task {
+    rt_fn run;
+    const char *name;
+    uint64_t due;                   /* tsc the timer fires at, while armed */
+    int armed;
+    int polled;                     /* index in pollers + 1; 0 if not polled */
+    struct rt_task *next;           /* in its slot of the wheel */
+    unsigned slot;
+    uint64_t runs;
+};
+
+struct runtime {
+    struct rt_task *wheel[RT_WHEEL_SLOTS];
+    struct rt_task *pollers[RT_MAX_POLLERS];
+    int npollers;
+    int armed;                      /* timers on the wheel */
+    uint32_t tsc_khz;
+    uint64_t tick, spin, wake, fds; /* RT_*_NS in cycles */
+    uint64_t at;                    /* tick the wheel has run up to */
+    uint64_t fds_at;                /* tsc of the last look at the fds */
+    int epfd, tfd;
+    int stop;                       /* rt_run returns at the end of the pass that sees it */
+    uint64_t passes, sleeps;
+};
+
+static inline uint64_t rt_cycles(const struct runtime *rt, uint64_t ns)
+{
+    return ns * rt->tsc_khz / 1000000;
+}
+
+/* 0, or -1 with errno set */
+int rt_init(struct runtime *rt, uint32_t tsc_khz);
+void rt_close(struct runtime *rt);
+
+/* arms the timer of t at due, moving it if armed already; a due in the past fires on the next pass */
+void rt_at(struct runtime *rt, struct rt_task *t, uint64_t due);
+void rt_cancel(struct runtime *rt, struct rt_task *t);
+
+/* t runs on every pass while on; -1 if RT_MAX_POLLERS poll already */
+int rt_poll(struct runtime *rt, struct rt_task *t, int on);
+
+/* t runs whenever fd is readable (level-triggered); 0, or -1 with errno set */
+int rt_watch(struct runtime *rt, struct rt_task *t, int fd);
+
+/* runs the tasks until one sets stop, or epoll fails */
+void rt_run(struct runtime *rt);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Test for the single-core runtime (runtime.h, runtime.c).
+ *
+ * Timers armed out of order fire in the order they are due, none before its time, those due
+ * turns of the wheel out included; one a task moves or cancels fires at its new time or never,
+ * and one re-armed from its own run keeps its period. A poller runs on every pass until it stops
+ * polling. With nothing to poll the loop sleeps for a far timer and still fires it in time, and
+ * with no timer at all it sleeps until a watched fd is written; either way it takes little cpu.
+ *
+ * usage: runtime_test
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "runtime.h"
+
+#define TIMERS      6
+#define PERIODS     20
+
+static int failures;
+static uint32_t tsc_khz;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+struct timed {
+    struct rt_task task;
+    int order;                      /* fired as the order-th; 0 not yet */
+    uint64_t fired;                 /* now of the pass it fired in */
+};
+
+static int fired_n;
+
+static void on_timer(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    struct timed *x = (struct timed *)t;
+
+    x->order = ++fired_n;
+    x->fired = now;
+}
+
+static void on_stop(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    rt->stop = 1;
+}
+
+static double us(uint64_t cycles)
+{
+    return cycles * 1000.0 / tsc_khz;
+}
+
+static double thread_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int check_order(void)
+{
+    static const int at_us[TIMERS] = { 300, 50, 700, 100, 0, 1800 };     /* 700 and 1800: turns out */
+    static const int want[TIMERS] = { 4, 2, 5, 3, 1, 6 };
+    struct timed x[TIMERS], moved, cancelled;
+    struct rt_task stop = { .run = on_stop };
+    struct runtime rt;
+    uint64_t t0;
+    int i;
+
+    CHECK(rt_init(&rt, tsc_khz) == 0, "rt_init: %s", strerror(errno));
+    memset(x, 0, sizeof(x));
+    memset(&moved, 0, sizeof(moved));
+    memset(&cancelled, 0, sizeof(cancelled));
+    fired_n = 0;
+    t0 = get_cycles();
+    for (i = 0; i < TIMERS; i++) {
+        x[i].task.run = on_timer;
+        rt_at(&rt, &x[i].task, t0 + rt_cycles(&rt, at_us[i] * 1000));
+    }
+    moved.task.run = cancelled.task.run = on_timer;
+    rt_at(&rt, &moved.task, t0 + rt_cycles(&rt, 10000));
+    rt_at(&rt, &moved.task, t0 + rt_cycles(&rt, 2500000));
+    rt_at(&rt, &cancelled.task, t0 + rt_cycles(&rt, 200000));
+    rt_cancel(&rt, &cancelled.task);
+    rt_at(&rt, &stop, t0 + rt_cycles(&rt, 3000000));
+    rt_run(&rt);
+    rt_close(&rt);
+
+    for (i = 0; i < TIMERS; i++) {
+        CHECK(x[i].order == want[i], "timer at %dus fired %d-th, not %d-th", at_us[i], x[i].order, want[i]);
+        CHECK(x[i].fired >= x[i].task.due, "timer at %dus fired %.1fus early", at_us[i],
+              us(x[i].task.due - x[i].fired));
+    }
+    CHECK(moved.order == TIMERS + 1 && moved.fired >= moved.task.due, "moved timer fired %d-th, %.0fus after t0",
+          moved.order, us(moved.fired - t0));
+    CHECK(!cancelled.order, "cancelled timer fired");
+    CHECK(rt.armed == 0, "%d timers left armed", rt.armed);
+    return 0;
+}
+
+struct periodic {
+    struct rt_task task;
+    uint64_t period, first;
+    int n;
+};
+
+static void on_period(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    struct periodic *p = (struct periodic *)t;
+
+    if (!p->n++)
+        p->first = t->due;
+    if (p->n == PERIODS) {
+        rt->stop = 1;
+        return;
+    }
+    rt_at(rt, t, t->due + p->period);
+}
+
+struct poller {
+    struct rt_task task;
+    int passes;
+};
+
+static void on_poll(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    struct poller *p = (struct poller *)t;
+
+    if (++p->passes == 1000)
+        rt_poll(rt, t, 0);
+}
+
+static int check_periodic(void)
+{
+    struct periodic p;
+    struct poller q;
+    struct runtime rt;
+    uint64_t t0;
+
+    CHECK(rt_init(&rt, tsc_khz) == 0, "rt_init: %s", strerror(errno));
+    memset(&p, 0, sizeof(p));
+    memset(&q, 0, sizeof(q));
+    p.task.run = on_period;
+    p.period = rt_cycles(&rt, 30000);
+    q.task.run = on_poll;
+    CHECK(rt_poll(&rt, &q.task, 1) == 0, "rt_poll");
+    t0 = get_cycles();
+    rt_at(&rt, &p.task, t0);
+    rt_run(&rt);
+    rt_close(&rt);
+
+    CHECK(q.passes == 1000 && q.task.runs == 1000, "poller ran %d passes", q.passes);
+    CHECK(rt.passes >= 1000, "%lu passes", (unsigned long)rt.passes);
+    CHECK(p.n == PERIODS, "periodic timer fired %d times", p.n);
+    CHECK(p.task.due == p.first + (PERIODS - 1) * p.period, "periodic timer drifted");
+    return 0;
+}
+
+static int check_sleep(void)
+{
+    struct timed far;
+    struct rt_task stop = { .run = on_stop };
+    struct runtime rt;
+    double cpu;
+    uint64_t t0;
+
+    CHECK(rt_init(&rt, tsc_khz) == 0, "rt_init: %s", strerror(errno));
+    memset(&far, 0, sizeof(far));
+    far.task.run = on_timer;
+    fired_n = 0;
+    t0 = get_cycles();
+    rt_at(&rt, &far.task, t0 + rt_cycles(&rt, 20000000));
+    rt_at(&rt, &stop, t0 + rt_cycles(&rt, 40000000));
+    cpu = thread_ms();
+    rt_run(&rt);
+    cpu = thread_ms() - cpu;
+    rt_close(&rt);
+
+    CHECK(far.order == 1 && far.fired >= far.task.due, "timer 20ms out did not fire in time");
+    CHECK(us(far.fired - far.task.due) < 5000, "timer 20ms out fired %.0fus late", us(far.fired - far.task.due));
+    CHECK(rt.sleeps >= 2, "slept %lu times for two far timers", (unsigned long)rt.sleeps);
+    CHECK(cpu < 20, "%.1fms of cpu over 40ms of two timers", cpu);
+    printf("runtime_test: 40ms of two far timers: %lu sleeps, %lu passes, %.2fms cpu\n",
+           (unsigned long)rt.sleeps, (unsigned long)rt.passes, cpu);
+    return 0;
+}
+
+static int pipe_fd[2];
+
+static void *writer(void *arg)
+{
+    usleep(20000);
+    if (write(pipe_fd[1], "j", 1) != 1)
+        perror("write");
+    return NULL;
+}
+
+static void on_fd(struct runtime *rt, struct rt_task *t, uint64_t now)
+{
+    char c;
+
+    if (read(pipe_fd[0], &c, 1) == 1)
+        rt->stop = 1;
+}
+
+static int check_fd(void)
+{
+    struct rt_task reader = { .run = on_fd };
+    struct runtime rt;
+    pthread_t th;
+    double cpu;
+    uint64_t t0;
+
+    CHECK(rt_init(&rt, tsc_khz) == 0, "rt_init: %s", strerror(errno));
+    CHECK(pipe(pipe_fd) == 0, "pipe");
+    CHECK(rt_watch(&rt, &reader, pipe_fd[0]) == 0, "rt_watch: %s", strerror(errno));
+    pthread_create(&th, NULL, writer, NULL);
+    t0 = get_cycles();
+    cpu = thread_ms();
+    rt_run(&rt);
+    cpu = thread_ms() - cpu;
+    pthread_join(th, NULL);
+    rt_close(&rt);
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+
+    CHECK(reader.runs == 1, "reader ran %lu times", (unsigned long)reader.runs);
+    CHECK(us(get_cycles() - t0) >= 15000, "woke before the fd was written");
+    CHECK(rt.sleeps == 1 && rt.passes == 1, "%lu sleeps and %lu passes with nothing to do",
+          (unsigned long)rt.sleeps, (unsigned long)rt.passes);
+    CHECK(cpu < 5, "%.1fms of cpu waiting 20ms for an fd", cpu);
+    return 0;
+}
+
+int main(void)
+{
+    const char *source = "";
+    int invariant;
+
+    if (!(tsc_khz = get_tsc_khz(&invariant, &source))) {
+        fprintf(stderr, "no tsc rate\n");
+        return 1;
+    }
+    check_order();
+    check_periodic();
+    check_sleep();
+    check_fd();
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("runtime_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Test for the credit flow of the two-sided split chunks (justitia/split_credit.h).
+ *
+ * A sender and a receiver are stepped in random order the way the drivers run them: the sender
+ * takes what credits are free (waiting for one) for a window of at most an arena of chunks, the
+ * chunks land in the receiver's slots, the receiver consumes them one at a time, posts each slot
+ * again and hands credits back over a second channel, which the sender reaps. Messages of up to
+ * many times more chunks than there are slots must all get through, with every slot accounted
+ * for at every step: free to the sender, holding a chunk, owed by the receiver or on its way
+ * back. Returning the credits only once a message is complete must stall a message of more
+ * chunks than slots, which is how the drivers deadlocked before.
+ *
+ * usage: split_credit_test [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../justitia/split_credit.h"
+
+#define MAX_SLOTS       8
+#define MAX_CAPACITY    16
+#define MAX_CHUNKS      64      /* of a message: many times the slots */
+#define MESSAGES        8
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+struct link {
+    uint32_t slots, batch, capacity;
+    /* sender */
+    int credits;
+    uint32_t msg_chunks[MESSAGES];
+    int msg;                    /* being posted */
+    uint32_t posted;            /* chunks of it */
+    /* chunks in the receiver's slots, each the number of chunks left of its message */
+    uint32_t ring[MAX_SLOTS];
+    uint32_t head, held;
+    /* receiver */
+    uint32_t owed;
+    uint32_t consumed;          /* chunks of all messages */
+    int complete;               /* messages */
+    /* credit returns on their way to the sender */
+    uint32_t returns[MAX_SLOTS];
+    uint32_t rhead, rcount;
+};
+
+static uint32_t returned(const struct link *l)
+{
+    uint32_t n = 0, i;
+
+    for (i = 0; i < l->rcount; i++)
+        n += l->returns[(l->rhead + i) % MAX_SLOTS];
+    return n;
+}
+
+/* every slot is free to the sender, holds a chunk, is owed or is on its way back */
+static int check_slots(const struct link *l)
+{
+    CHECK(l->credits >= 0 && (uint32_t)l->credits + l->held + l->owed + returned(l) == l->slots,
+          "%u slots: %d credits, %u chunks held, %u owed, %u on their way back", l->slots, l->credits,
+          l->held, l->owed, returned(l));
+    return 0;
+}
+
+/* the sender posts a window of the message; 0 when it has no credit to post with */
+static int send_window(struct link *l)
+{
+    uint32_t left = l->msg_chunks[l->msg] - l->posted;
+    uint32_t window = left < l->capacity ? left : l->capacity;
+    uint32_t i;
+
+    window = split_credit_take(&l->credits, window);
+    for (i = 0; i < window; i++) {
+        l->ring[(l->head + l->held++) % MAX_SLOTS] = left - i;
+        l->posted++;
+    }
+    if (l->posted == l->msg_chunks[l->msg]) {
+        l->msg++;
+        l->posted = 0;
+    }
+    return window > 0;
+}
+
+/* the receiver consumes the oldest chunk; batch 0 returns credits only at the end of a message */
+static void recv_chunk(struct link *l)
+{
+    uint32_t left = l->ring[l->head];
+    uint32_t credits;
+
+    l->head = (l->head + 1) % MAX_SLOTS;
+    l->held--;
+    l->consumed++;
+    if (left == 1)
+        l->complete++;
+    credits = split_credit_reposted(&l->owed, l->batch ? l->batch : UINT32_MAX, left == 1);
+    if (credits)
+        l->returns[(l->rhead + l->rcount++) % MAX_SLOTS] = credits;
+}
+
+static void reap_return(struct link *l)
+{
+    __atomic_add_fetch(&l->credits, l->returns[l->rhead], __ATOMIC_RELAXED);
+    l->rhead = (l->rhead + 1) % MAX_SLOTS;
+    l->rcount--;
+}
+
+/* 1 when all messages got through, 0 when the link stalled, -1 on a failed check */
+static int run(struct link *l)
+{
+    uint32_t chunks = 0;
+    int m;
+
+    l->credits = l->slots;
+    for (m = 0; m < MESSAGES; m++)
+        chunks += l->msg_chunks[m];
+
+    while (l->complete < MESSAGES) {
+        int can_send = l->msg < MESSAGES && l->credits > 0;
+        int can_recv = l->held > 0;
+        int can_reap = l->rcount > 0;
+        int pick;
+
+        if (!can_send && !can_recv && !can_reap)
+            return 0;
+        pick = rand() % 3;
+        if (pick == 0 && can_send)
+            CHECK(send_window(l), "a sender with %d credits posted nothing", l->credits);
+        else if (pick == 1 && can_recv)
+            recv_chunk(l);
+        else if (pick == 2 && can_reap)
+            reap_return(l);
+        CHECK(l->held <= l->slots && l->rcount <= l->slots, "%u chunks held, %u returns in flight of %u slots",
+              l->held, l->rcount, l->slots);
+        if (check_slots(l))
+            return -1;
+    }
+    CHECK(l->consumed == chunks && l->msg == MESSAGES, "%u of %u chunks consumed", l->consumed, chunks);
+    CHECK(!l->owed && !l->held, "%u credits owed, %u chunks held after the last message", l->owed, l->held);
+    return 1;
+}
+
+static void setup(struct link *l, uint32_t batch)
+{
+    int m;
+
+    l->slots = 1 + rand() % MAX_SLOTS;
+    l->batch = batch ? 1 + rand() % l->slots : 0;
+    l->capacity = 1 + rand() % MAX_CAPACITY;
+    for (m = 0; m < MESSAGES; m++)
+        l->msg_chunks[m] = 1 + rand() % MAX_CHUNKS;
+    /* at least one message of more chunks than slots */
+    l->msg_chunks[rand() % MESSAGES] = l->slots + 1 + rand() % (MAX_CHUNKS - l->slots);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 20000;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    struct link l;
+    int i, ret, stalled = 0;
+
+    srand(seed);
+    for (i = 0; i < iters && !failures; i++) {
+        struct link fresh = { 0 };
+
+        l = fresh;
+        setup(&l, 1);
+        ret = run(&l);
+        if (!ret) {
+            fprintf(stderr, "FAIL: %u slots, batch %u, arena of %u: stalled at %u chunks consumed\n", l.slots,
+                    l.batch, l.capacity, l.consumed);
+            failures++;
+        }
+
+        /* the old rule: credits back only with the last chunk of a message */
+        l = fresh;
+        setup(&l, 0);
+        ret = run(&l);
+        if (ret == 1) {
+            fprintf(stderr, "FAIL: %u slots, arena of %u: a message of more chunks than slots got through "
+                    "without credits coming back\n", l.slots, l.capacity);
+            failures++;
+        }
+        stalled += ret == 0;
+    }
+
+    if (failures) {
+        printf("split_credit_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("split_credit_test: %d iterations OK (seed %u), %d stalls of the old rule\n", iters, seed, stalled);
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Test for the split qp EXCHANGE on the user's qp (justitia/split_exchange.h).
+ *
+ * The responder of an RC qp is modelled the way the HCA checks psns: the expected psn is taken
+ * and moves on, one behind it (in the half of the psn space before it) is a duplicate that is
+ * acknowledged and dropped, anything else is out of sequence. For random psns, wrap included,
+ * a sender that puts its EXCHANGE at sq_psn - 1 ahead of the application's messages must have
+ * the EXCHANGE land in the RR of a receiver at rq_psn - 1, the application's messages in the
+ * application's RRs, and nothing dropped or out of sequence; a receiver that takes no
+ * EXCHANGEs (rq_psn as given) must drop the EXCHANGE as a duplicate and take the rest the same
+ * way. Both ends must pick the same pair of the split qps they offer, connected to each other,
+ * or both none, from what the two EXCHANGEs say.
+ *
+ * usage: split_exchange_test [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../justitia/split_exchange.h"
+
+#define MESSAGES        16
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+enum { TAKEN, DUPLICATE, OUT_OF_SEQUENCE };
+
+struct responder {
+    uint32_t epsn;
+    int rrs;                    /* RRs consumed */
+    int duplicates;
+};
+
+static int receive(struct responder *r, uint32_t psn)
+{
+    uint32_t behind = (r->epsn - psn) & SPLIT_PSN_MASK;
+
+    if (psn == r->epsn) {
+        r->epsn = (r->epsn + 1) & SPLIT_PSN_MASK;
+        r->rrs++;
+        return TAKEN;
+    }
+    if (behind && behind <= (SPLIT_PSN_MASK + 1) / 2) {
+        r->duplicates++;
+        return DUPLICATE;
+    }
+    return OUT_OF_SEQUENCE;
+}
+
+static uint32_t random_psn(void)
+{
+    switch (rand() % 4) {
+    case 0:
+        return 0;
+    case 1:
+        return SPLIT_PSN_MASK - rand() % MESSAGES;
+    default:
+        return ((uint32_t)rand() << 8 ^ (uint32_t)rand()) & SPLIT_PSN_MASK;
+    }
+}
+
+/* the psns a user's qp given psn sends with: the EXCHANGE, then the application's messages */
+static int run_psns(uint32_t psn, int takes_exchanges)
+{
+    struct responder r = { takes_exchanges ? split_psn_prev(psn) : psn, 0, 0 };
+    uint32_t sq = split_psn_prev(psn);
+    int ret, i;
+
+    ret = receive(&r, sq);
+    if (takes_exchanges)
+        CHECK(ret == TAKEN && r.rrs == 1, "psn %06x: the EXCHANGE was not taken into its RR", psn);
+    else
+        CHECK(ret == DUPLICATE && r.rrs == 0, "psn %06x: the EXCHANGE reached a receiver taking none", psn);
+    for (i = 0; i < MESSAGES; i++) {
+        sq = (sq + 1) & SPLIT_PSN_MASK;
+        CHECK(receive(&r, sq) == TAKEN, "psn %06x: message %d at %06x not taken (expected %06x)", psn, i, sq,
+              r.epsn);
+    }
+    CHECK(r.rrs == MESSAGES + !!takes_exchanges && r.duplicates == !takes_exchanges,
+          "psn %06x: %d RRs consumed, %d duplicates", psn, r.rrs, r.duplicates);
+    /* the application's psns are where it put them */
+    CHECK(r.epsn == ((psn + MESSAGES) & SPLIT_PSN_MASK), "psn %06x: ends expecting %06x", psn, r.epsn);
+    return 0;
+}
+
+static void random_link(struct split_exchange_link *l)
+{
+    l->qp_num = 1 + rand() % 3;
+    l->qp2_num = 1 + rand() % 3;
+    l->peer_qp_num = rand() % 4;
+    l->peer_qp2_num = rand() % 4;
+}
+
+static void random_exchange(struct split_exchange *x)
+{
+    uint32_t i;
+
+    memset(x, 0, sizeof(*x));
+    x->qp_num = 1 + rand() % 3;
+    x->qp2_num = 1 + rand() % 3;
+    x->links = rand() % (SPLIT_EXCHANGE_LINKS + 1);
+    for (i = 0; i < x->links; i++)
+        random_link(&x->link[i]);
+}
+
+static int run_choose(void)
+{
+    struct split_exchange a, b;
+    int i, j, ab, ba, mutual = 0;
+
+    random_exchange(&a);
+    random_exchange(&b);
+    /* often links that were connected to each other */
+    if (a.links && b.links && rand() % 2) {
+        i = rand() % a.links;
+        j = rand() % b.links;
+        a.link[i].peer_qp_num = b.link[j].qp_num;
+        a.link[i].peer_qp2_num = b.link[j].qp2_num;
+        if (rand() % 4) {
+            b.link[j].peer_qp_num = a.link[i].qp_num;
+            b.link[j].peer_qp2_num = a.link[i].qp2_num;
+        }
+    }
+    for (i = 0; i < (int)a.links; i++)
+        for (j = 0; j < (int)b.links; j++)
+            mutual += split_exchange_mates(&a.link[i], &b.link[j]);
+
+    ab = split_exchange_choose(&a, &b);
+    ba = split_exchange_choose(&b, &a);
+    CHECK((ab < 0) == (ba < 0), "one end keeps a link (%d, %d), the other does not", ab, ba);
+    if (ab >= 0)
+        CHECK(split_exchange_mates(&a.link[ab], &b.link[ba]), "the two ends keep links not connected to each other");
+    if (mutual == 1)
+        CHECK(ab >= 0, "the only pair connected to each other is not kept");
+    if (!mutual)
+        CHECK(ab < 0, "a link is kept with no pair connected");
+    return 0;
+}
+
+/* two user's qps of one process connected to each other offer the same two links, up to each other */
+static int run_loopback(void)
+{
+    struct split_exchange a, b;
+    struct split_exchange_link l0 = { 10, 11, 20, 21 }, l1 = { 20, 21, 10, 11 };
+    int ab, ba;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.qp_num = 30;
+    b.qp_num = 40;
+    a.links = b.links = 2;
+    a.link[0] = b.link[0] = l0;
+    a.link[1] = b.link[1] = l1;
+    ab = split_exchange_choose(&a, &b);
+    ba = split_exchange_choose(&b, &a);
+    CHECK(ab >= 0 && ba >= 0, "a link up to itself is not kept (%d, %d)", ab, ba);
+    CHECK(split_exchange_mates(&a.link[ab], &b.link[ba]), "the two ends keep links not connected to each other");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    struct split_exchange x;
+    int i;
+
+    srand(seed);
+    CHECK(split_psn_prev(0) == SPLIT_PSN_MASK && split_psn_prev(1) == 0, "psn wrap");
+    memset(&x, 0, sizeof(x));
+    CHECK(!split_exchange_arrived(&x), "a zeroed RR buffer holds an EXCHANGE");
+    x.seal = SPLIT_EXCHANGE_SEAL;
+    CHECK(split_exchange_arrived(&x), "a sealed EXCHANGE is not seen");
+    CHECK(split_exchange_choose(&x, &x) < 0, "a link is kept with none offered");
+    run_loopback();
+
+    for (i = 0; i < iters && !failures; i++) {
+        uint32_t psn = random_psn();
+
+        run_psns(psn, 1);
+        run_psns(psn, 0);
+        run_choose();
+    }
+
+    if (failures) {
+        printf("split_exchange_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("split_exchange_test: %d iterations OK (seed %u)\n", iters, seed);
+    return 0;
+}
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+
+/*
+ * Head-of-line blocking of small posts behind a split WRITE on a shared QP.
+ *
+ * A single RC QP is connected to itself (loopback). One thread posts small
+ * inline WRITEs and times each ibv_post_send call and each post-to-completion;
+ * a second thread keeps posting WRITEs of big_size bytes, which the driver
+ * splits, on the same QP. A third thread reaps the shared CQ. The small
+ * latencies are reported alone first, then next to the split writer: with the
+ * SQ lock held across the split waits, a small post stalls for a whole big
+ * message; otherwise only for the WQE writes of one chunk window.
+ *
+ * usage: split_hol_bench [dev] [big_size] [small_size] [num_small] [gid_idx]
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+
+#define SMALL_WINDOW    16              /* small WRITEs in flight */
+#define BIG_WR_ID       UINT64_MAX
+
+static struct ibv_device *find_device(const char *name)
+{
+    int num = 0;
+    struct ibv_device **list = ibv_get_device_list(&num);
+    if (!list) {
+        fprintf(stderr, "ibv_get_device_list failed\n");
+        return NULL;
+    }
+
+    struct ibv_device *found = NULL;
+    for (int i = 0; i < num; i++) {
+        if (!name || strcmp(name, ibv_get_device_name(list[i])) == 0) {
+            found = list[i];
+            break;
+        }
+    }
+    if (!found)
+        fprintf(stderr, "No matching device found\n");
+
+    ibv_free_device_list(list);
+    return found;
+}
+
+static int connect_self(struct ibv_qp *qp, int gid_idx)
+{
+    struct ibv_port_attr port;
+    struct ibv_qp_attr attr;
+
+    if (ibv_query_port(qp->context, 1, &port)) {
+        fprintf(stderr, "ibv_query_port failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = 1;
+    attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                      IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+        fprintf(stderr, "modify to INIT failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = port.active_mtu;
+    attr.dest_qp_num = qp->qp_num;
+    attr.rq_psn = 0;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.dlid = port.lid;
+    attr.ah_attr.port_num = 1;
+    if (gid_idx >= 0) {
+        attr.ah_attr.is_global = 1;
+        attr.ah_attr.grh.hop_limit = 1;
+        attr.ah_attr.grh.sgid_index = gid_idx;
+        if (ibv_query_gid(qp->context, 1, gid_idx, &attr.ah_attr.grh.dgid)) {
+            fprintf(stderr, "ibv_query_gid failed\n");
+            return -1;
+        }
+    }
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                      IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                      IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER)) {
+        fprintf(stderr, "modify to RTR failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.sq_psn = 0;
+    attr.max_rd_atomic = 1;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT |
+                      IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                      IBV_QP_MAX_QP_RD_ATOMIC)) {
+        fprintf(stderr, "modify to RTS failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct bench {
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+    struct ibv_mr *mr;
+    char *buf;
+    uint64_t big_size;
+    uint32_t small_size;
+    int num_small;
+    uint64_t *post_ns;          /* time inside ibv_post_send, per small WRITE */
+    uint64_t *posted_at;
+    uint64_t *done_at;          /* set by the reaper */
+    int small_done;             /* small completions reaped */
+    int big_done;               /* big completions reaped */
+    int stop_big;               /* tells the big writer to stop */
+    int stop;                   /* tells the reaper to stop */
+    int error;
+};
+
+static void *reaper(void *arg)
+{
+    struct bench *b = arg;
+    struct ibv_wc wc[SMALL_WINDOW];
+
+    while (!__atomic_load_n(&b->stop, __ATOMIC_RELAXED)) {
+        int ne = ibv_poll_cq(b->cq, SMALL_WINDOW, wc);
+        if (ne < 0) {
+            __atomic_store_n(&b->error, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        uint64_t t = now_ns();
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                __atomic_store_n(&b->error, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (wc[i].wr_id == BIG_WR_ID) {
+                __atomic_add_fetch(&b->big_done, 1, __ATOMIC_RELEASE);
+            } else {
+                b->done_at[wc[i].wr_id] = t;
+                __atomic_add_fetch(&b->small_done, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *big_writer(void *arg)
+{
+    struct bench *b = arg;
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)b->buf,
+        .length = (uint32_t)b->big_size,
+        .lkey = b->mr->lkey,
+    };
+    struct ibv_send_wr wr, *bad_wr;
+    int posted = 0;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = BIG_WR_ID;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = (uintptr_t)b->buf + b->big_size;
+    wr.wr.rdma.rkey = b->mr->rkey;
+
+    while (!__atomic_load_n(&b->stop_big, __ATOMIC_RELAXED)) {
+        if (ibv_post_send(b->qp, &wr, &bad_wr)) {
+            fprintf(stderr, "big ibv_post_send failed: %s\n", strerror(errno));
+            __atomic_store_n(&b->error, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        posted++;
+        while (__atomic_load_n(&b->big_done, __ATOMIC_ACQUIRE) < posted &&
+               !__atomic_load_n(&b->error, __ATOMIC_RELAXED))
+            ;
+    }
+    return NULL;
+}
+
+/* post num_small small WRITEs, at most SMALL_WINDOW in flight; returns 0 or -1 */
+static int run_small(struct bench *b)
+{
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)b->buf + 2 * b->big_size,
+        .length = b->small_size,
+        .lkey = b->mr->lkey,
+    };
+    struct ibv_send_wr wr, *bad_wr;
+    int base = __atomic_load_n(&b->small_done, __ATOMIC_ACQUIRE);
+
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+    wr.wr.rdma.remote_addr = (uintptr_t)b->buf + 2 * b->big_size + b->small_size;
+    wr.wr.rdma.rkey = b->mr->rkey;
+
+    for (int i = 0; i < b->num_small; i++) {
+        while (i - (__atomic_load_n(&b->small_done, __ATOMIC_ACQUIRE) - base) >= SMALL_WINDOW)
+            if (__atomic_load_n(&b->error, __ATOMIC_RELAXED))
+                return -1;
+        wr.wr_id = i;
+        uint64_t t0 = now_ns();
+        if (ibv_post_send(b->qp, &wr, &bad_wr)) {
+            fprintf(stderr, "small ibv_post_send failed: %s\n", strerror(errno));
+            return -1;
+        }
+        b->posted_at[i] = t0;
+        b->post_ns[i] = now_ns() - t0;
+    }
+    while (__atomic_load_n(&b->small_done, __ATOMIC_ACQUIRE) - base < b->num_small)
+        if (__atomic_load_n(&b->error, __ATOMIC_RELAXED))
+            return -1;
+    for (int i = 0; i < b->num_small; i++)
+        b->done_at[i] -= b->posted_at[i];
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *what, uint64_t *ns, int n)
+{
+    qsort(ns, n, sizeof(*ns), cmp_u64);
+    printf("  %-10s p50 %8.2f us  p99 %8.2f us  max %8.2f us\n", what,
+           ns[n / 2] / 1000.0, ns[(int)(n * 0.99)] / 1000.0, ns[n - 1] / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev_name = argc >= 2 ? argv[1] : NULL;
+    uint64_t big_size = argc >= 3 ? strtoull(argv[2], NULL, 10) : 100000000ULL;
+    uint32_t small_size = argc >= 4 ? (uint32_t)strtoul(argv[3], NULL, 10) : 32;
+    int num_small = argc >= 5 ? atoi(argv[4]) : 100000;
+    int gid_idx = argc >= 6 ? atoi(argv[5]) : -1;
+
+    if (big_size == 0 || big_size > UINT32_MAX || small_size == 0 || small_size > 64 || num_small <= 0) {
+        fprintf(stderr, "usage: %s [dev] [big_size] [small_size(1..64)] [num_small] [gid_idx]\n", argv[0]);
+        return 2;
+    }
+
+    struct ibv_device *dev = find_device(dev_name);
+    if (!dev)
+        return 2;
+    struct ibv_context *ctx = ibv_open_device(dev);
+    if (!ctx) {
+        fprintf(stderr, "ibv_open_device failed: %s\n", strerror(errno));
+        return 2;
+    }
+
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.big_size = big_size;
+    b.small_size = small_size;
+    b.num_small = num_small;
+    size_t buf_size = 2 * big_size + 2 * small_size;
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    b.cq = pd ? ibv_create_cq(ctx, 4 * SMALL_WINDOW, NULL, NULL, 0) : NULL;
+    b.buf = malloc(buf_size);
+    b.mr = (pd && b.buf) ? ibv_reg_mr(pd, b.buf, buf_size,
+                                      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE) : NULL;
+    b.post_ns = calloc(num_small, sizeof(uint64_t));
+    b.posted_at = calloc(num_small, sizeof(uint64_t));
+    b.done_at = calloc(num_small, sizeof(uint64_t));
+    if (!b.cq || !b.mr || !b.post_ns || !b.posted_at || !b.done_at) {
+        fprintf(stderr, "resource setup failed: %s\n", strerror(errno));
+        return 2;
+    }
+
+    struct ibv_qp_init_attr init;
+    memset(&init, 0, sizeof(init));
+    init.send_cq = b.cq;
+    init.recv_cq = b.cq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = 2 * SMALL_WINDOW;
+    init.cap.max_recv_wr = 1;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    init.cap.max_inline_data = 64;
+    init.qp_context = (void *)3;     /* pinned to the bw class */
+    b.qp = ibv_create_qp(pd, &init);
+    if (!b.qp || connect_self(b.qp, gid_idx))
+        return 2;
+
+    pthread_t th_reaper, th_big;
+    if (pthread_create(&th_reaper, NULL, reaper, &b)) {
+        perror("pthread_create");
+        return 2;
+    }
+
+    printf("big_size=%" PRIu64 " small_size=%u num_small=%d\n", big_size, small_size, num_small);
+    int ret = run_small(&b);
+    if (!ret) {
+        printf("small WRITEs alone:\n");
+        report("post", b.post_ns, num_small);
+        report("complete", b.done_at, num_small);
+
+        if (pthread_create(&th_big, NULL, big_writer, &b)) {
+            perror("pthread_create");
+            return 2;
+        }
+        /* let the first split WRITE get going */
+        while (!__atomic_load_n(&b.big_done, __ATOMIC_ACQUIRE) && !__atomic_load_n(&b.error, __ATOMIC_RELAXED))
+            ;
+        ret = run_small(&b);
+        __atomic_store_n(&b.stop_big, 1, __ATOMIC_RELAXED);
+        pthread_join(th_big, NULL);
+        if (!ret) {
+            printf("small WRITEs next to split WRITEs (%d big done):\n", __atomic_load_n(&b.big_done, __ATOMIC_RELAXED));
+            report("post", b.post_ns, num_small);
+            report("complete", b.done_at, num_small);
+        }
+    }
+    __atomic_store_n(&b.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(th_reaper, NULL);
+
+    ibv_destroy_qp(b.qp);
+    ibv_dereg_mr(b.mr);
+    ibv_destroy_cq(b.cq);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    free(b.buf);
+    free(b.post_ns);
+    free(b.posted_at);
+    free(b.done_at);
+    return ret ? 1 : 0;
+}
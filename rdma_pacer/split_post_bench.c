@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+
+/*
+ * Posting cost of split RDMA WRITEs through the Justitia driver.
+ *
+ * A single RC QP is connected to itself (loopback) and posts WRITEs of
+ * msg_size bytes. The driver splits each message into chunk_size pieces
+ * (the pacer's active_chunk_size, or SPLIT_CHUNK_SIZE when no pacer runs),
+ * so the time spent inside ibv_post_send divided by the number of chunks
+ * is the per-chunk posting cost, including the split qp window waits.
+ *
+ * usage: split_post_bench [dev] [msg_size] [chunk_size] [iters] [gid_idx]
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+
+static struct ibv_device *find_device(const char *name)
+{
+    int num = 0;
+    struct ibv_device **list = ibv_get_device_list(&num);
+    if (!list) {
+        fprintf(stderr, "ibv_get_device_list failed\n");
+        return NULL;
+    }
+
+    struct ibv_device *found = NULL;
+    for (int i = 0; i < num; i++) {
+        if (!name || strcmp(name, ibv_get_device_name(list[i])) == 0) {
+            found = list[i];
+            break;
+        }
+    }
+    if (!found)
+        fprintf(stderr, "No matching device found\n");
+
+    ibv_free_device_list(list);
+    return found;
+}
+
+static int connect_self(struct ibv_qp *qp, int gid_idx)
+{
+    struct ibv_port_attr port;
+    struct ibv_qp_attr attr;
+
+    if (ibv_query_port(qp->context, 1, &port)) {
+        fprintf(stderr, "ibv_query_port failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = 1;
+    attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                      IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+        fprintf(stderr, "modify to INIT failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = port.active_mtu;
+    attr.dest_qp_num = qp->qp_num;
+    attr.rq_psn = 0;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.dlid = port.lid;
+    attr.ah_attr.port_num = 1;
+    if (gid_idx >= 0) {
+        attr.ah_attr.is_global = 1;
+        attr.ah_attr.grh.hop_limit = 1;
+        attr.ah_attr.grh.sgid_index = gid_idx;
+        if (ibv_query_gid(qp->context, 1, gid_idx, &attr.ah_attr.grh.dgid)) {
+            fprintf(stderr, "ibv_query_gid failed\n");
+            return -1;
+        }
+    }
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                      IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                      IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER)) {
+        fprintf(stderr, "modify to RTR failed\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.sq_psn = 0;
+    attr.max_rd_atomic = 1;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT |
+                      IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                      IBV_QP_MAX_QP_RD_ATOMIC)) {
+        fprintf(stderr, "modify to RTS failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev_name = argc >= 2 ? argv[1] : NULL;
+    uint64_t msg_size = argc >= 3 ? strtoull(argv[2], NULL, 10) : 100000000ULL;
+    uint64_t chunk_size = argc >= 4 ? strtoull(argv[3], NULL, 10) : 1000000ULL;
+    int iters = argc >= 5 ? atoi(argv[4]) : 100;
+    int gid_idx = argc >= 6 ? atoi(argv[5]) : -1;
+
+    if (msg_size == 0 || msg_size > UINT32_MAX || chunk_size == 0 || iters <= 0) {
+        fprintf(stderr, "usage: %s [dev] [msg_size] [chunk_size] [iters] [gid_idx]\n", argv[0]);
+        return 2;
+    }
+
+    struct ibv_device *dev = find_device(dev_name);
+    if (!dev)
+        return 2;
+    struct ibv_context *ctx = ibv_open_device(dev);
+    if (!ctx) {
+        fprintf(stderr, "ibv_open_device failed: %s\n", strerror(errno));
+        return 2;
+    }
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    struct ibv_cq *cq = pd ? ibv_create_cq(ctx, 64, NULL, NULL, 0) : NULL;
+    char *buf = malloc(2 * msg_size);
+    struct ibv_mr *mr = (pd && buf) ? ibv_reg_mr(pd, buf, 2 * msg_size,
+                            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE) : NULL;
+    if (!cq || !mr) {
+        fprintf(stderr, "resource setup failed: %s\n", strerror(errno));
+        return 2;
+    }
+
+    struct ibv_qp_init_attr init;
+    memset(&init, 0, sizeof(init));
+    init.send_cq = cq;
+    init.recv_cq = cq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = 16;
+    init.cap.max_recv_wr = 16;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    init.qp_context = (void *)3;     /* pinned to the bw class */
+    struct ibv_qp *qp = ibv_create_qp(pd, &init);
+    if (!qp || connect_self(qp, gid_idx))
+        return 2;
+
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)buf,
+        .length = (uint32_t)msg_size,
+        .lkey = mr->lkey,
+    };
+    struct ibv_send_wr wr, *bad_wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = (uintptr_t)buf + msg_size;
+    wr.wr.rdma.rkey = mr->rkey;
+
+    uint64_t chunks = (msg_size + chunk_size - 1) / chunk_size;
+    uint64_t post_ns = 0, total_ns = 0;
+    for (int i = 0; i < iters; i++) {
+        struct ibv_wc wc;
+        uint64_t t0 = now_ns();
+        if (ibv_post_send(qp, &wr, &bad_wr)) {
+            fprintf(stderr, "ibv_post_send failed: %s\n", strerror(errno));
+            return 1;
+        }
+        uint64_t t1 = now_ns();
+        int ne;
+        while ((ne = ibv_poll_cq(cq, 1, &wc)) == 0)
+            ;
+        if (ne < 0 || wc.status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "completion error: %s\n",
+                    ne < 0 ? "poll failed" : ibv_wc_status_str(wc.status));
+            return 1;
+        }
+        post_ns += t1 - t0;
+        total_ns += now_ns() - t0;
+        /* the driver must hand the user's wr back untouched */
+        if (sge.addr != (uintptr_t)buf || sge.length != msg_size ||
+            wr.wr.rdma.remote_addr != (uintptr_t)buf + msg_size) {
+            fprintf(stderr, "user wr was modified by the split path\n");
+            return 1;
+        }
+    }
+
+    printf("msg_size=%" PRIu64 " chunk_size=%" PRIu64 " chunks/msg=%" PRIu64 " iters=%d\n",
+           msg_size, chunk_size, chunks, iters);
+    printf("post: %.1f ns/msg %.1f ns/chunk; msg completion: %.1f us; %.2f Gbps\n",
+           (double)post_ns / iters, (double)post_ns / iters / chunks,
+           (double)total_ns / iters / 1000,
+           (double)msg_size * 8 * iters / total_ns);
+
+    ibv_destroy_qp(qp);
+    ibv_dereg_mr(mr);
+    ibv_destroy_cq(cq);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+
+/*
+ * Property test for the split chunk layouts built by the drivers.
+ *
+ * Random scatter/gather lists (including zero-length entries) are cut into
+ * chunks with split_sge.h exactly the way split_post_chunks/split_one_wr do
+ * for one-sided, two-sided and WRITE_WITH_IMM work requests. For every case
+ * each local byte and each remote offset must be covered exactly once, and
+ * every emitted SGE must point at the local byte of the message offset it
+ * claims. Two-sided pieces follow the receiver's rules: the piece on the user's
+ * qp is at least its split_min, chunks are capped at its slot size and the imm
+ * of the piece announces them. The byte-credit token rule of the bandwidth
+ * class is checked too.
+ *
+ * usage: split_sge_test [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../justitia/split_sge.h"
+
+#define MAX_SGE     8
+#define MAX_SEG     4096
+#define ARENA_CAP   16      /* small on purpose so chunks cross arena windows */
+
+struct layout {
+    struct ibv_sge sg_list[MAX_SGE];
+    int num_sge;
+    uint64_t total;
+    uint8_t *local_cov;     /* indexed by local address */
+    uint8_t *remote_cov;    /* indexed by remote offset */
+    uint64_t local_size;
+};
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+/* local address of message byte off, walking the user's sg_list */
+static uint64_t msg_addr(const struct layout *l, uint64_t off)
+{
+    for (int i = 0; i < l->num_sge; i++) {
+        if (off < l->sg_list[i].length)
+            return l->sg_list[i].addr + off;
+        off -= l->sg_list[i].length;
+    }
+    return UINT64_MAX;
+}
+
+/* account one posted piece: its SGEs against local memory, its remote range against the target */
+static int cover(struct layout *l, const struct ibv_sge *sge, int n, uint64_t msg_off)
+{
+    uint64_t remote = msg_off;
+
+    for (int i = 0; i < n; i++) {
+        CHECK(sge[i].length > 0, "zero-length SGE emitted");
+        CHECK(sge[i].lkey == (uint32_t)(sge[i].addr / MAX_SEG), "lkey does not match its segment");
+        for (uint32_t b = 0; b < sge[i].length; b++) {
+            uint64_t addr = sge[i].addr + b;
+            CHECK(addr < l->local_size, "local address out of range");
+            CHECK(addr == msg_addr(l, remote), "byte at msg offset %lu maps to wrong local address",
+                  (unsigned long)remote);
+            CHECK(remote < l->total, "remote offset past end of message");
+            l->local_cov[addr]++;
+            l->remote_cov[remote]++;
+            remote++;
+        }
+    }
+    return 0;
+}
+
+/* same windowing as split_post_chunks: chunks of chunk bytes, at most ARENA_CAP per window */
+static int post_chunks(struct layout *l, uint64_t offset, uint64_t length, uint32_t chunk,
+                       int max_sge, uint32_t *nchunks)
+{
+    struct split_sge_cursor cursor;
+    struct ibv_sge sge[ARENA_CAP][MAX_SGE];
+    uint64_t num_chunks = (length + chunk - 1) / chunk;
+
+    split_sge_seek(&cursor, l->sg_list, l->num_sge, offset);
+    while (num_chunks) {
+        uint32_t window = num_chunks < ARENA_CAP ? num_chunks : ARENA_CAP;
+        for (uint32_t i = 0; i < window; i++) {
+            uint32_t len = length < chunk ? length : chunk;
+            int n = split_sge_fill(&cursor, l->sg_list, l->num_sge, len, sge[i], max_sge);
+            CHECK(n >= 0, "split_sge_fill failed at offset %lu len %u", (unsigned long)offset, len);
+            if (cover(l, sge[i], n, offset))
+                return -1;
+            offset += len;
+            length -= len;
+            (*nchunks)++;
+        }
+        num_chunks -= window;
+    }
+    CHECK(length == 0, "%lu bytes left unposted", (unsigned long)length);
+    return 0;
+}
+
+/* a single WR piece at [offset, offset + length), as split_post_user_tail builds it */
+static int post_piece(struct layout *l, uint64_t offset, uint64_t length, int max_sge)
+{
+    struct split_sge_cursor cursor;
+    struct ibv_sge sge[MAX_SGE];
+
+    split_sge_seek(&cursor, l->sg_list, l->num_sge, offset);
+    int n = split_sge_fill(&cursor, l->sg_list, l->num_sge, length, sge, max_sge);
+    CHECK(n >= 0, "split_sge_fill failed for piece at %lu", (unsigned long)offset);
+    return cover(l, sge, n, offset);
+}
+
+enum kind { ONE_SIDED, TWO_SIDED, WIMM };
+
+static int run_layout(struct layout *l, enum kind kind, uint32_t chunk, uint32_t split_min,
+                      uint32_t slot, int max_sge)
+{
+    uint64_t total = l->total;
+    uint32_t nchunks = 0;
+
+    switch (kind) {
+    case ONE_SIDED: {
+        uint64_t n = (total + chunk - 1) / chunk;
+        uint64_t split_length = (n - 1) * chunk;
+        if (post_chunks(l, 0, split_length, chunk, max_sge, &nchunks) ||
+            post_piece(l, split_length, total - split_length, max_sge))
+            return -1;
+        CHECK(nchunks + 1 == n, "one-sided: %u chunks + tail, expected %lu", nchunks, (unsigned long)n);
+        break;
+    }
+    case TWO_SIDED: {
+        uint64_t first = split_user_piece_length(total, chunk, split_min);
+        uint32_t chunk2 = chunk < slot ? chunk : slot;
+        uint64_t n = (total - first + chunk2 - 1) / chunk2;
+        CHECK(first >= split_min || first == total, "two-sided: first piece %lu below split_min %u",
+              (unsigned long)first, split_min);
+        if (post_piece(l, 0, first, max_sge) ||
+            post_chunks(l, first, total - first, chunk2, max_sge, &nchunks))
+            return -1;
+        CHECK(nchunks == n, "two-sided: %u chunks announced %lu", nchunks, (unsigned long)n);
+        /* the piece announces the chunks, an empty one when nothing is left for the split qp */
+        uint32_t mark = split_imm_mark(n ? n : 1, rand() % 2);
+        CHECK(split_imm_chunks(mark) == (n ? n : 1), "two-sided: mark 0x%08x announces %u chunks, not %lu",
+              mark, split_imm_chunks(mark), (unsigned long)(n ? n : 1));
+        break;
+    }
+    case WIMM: {
+        uint64_t tail = split_user_piece_length(total, chunk, split_min);
+        uint64_t wimm = total - tail < chunk ? total - tail : chunk;
+        uint64_t wimm_offset = total - tail - wimm;
+        if (post_chunks(l, 0, wimm_offset, chunk, max_sge, &nchunks) ||
+            post_piece(l, wimm_offset, wimm, max_sge) ||
+            post_piece(l, total - tail, tail, max_sge))
+            return -1;
+        break;
+    }
+    }
+
+    uint64_t covered = 0;
+    for (uint64_t a = 0; a < l->local_size; a++) {
+        CHECK(l->local_cov[a] <= 1, "local byte %lu covered %u times", (unsigned long)a, l->local_cov[a]);
+        covered += l->local_cov[a];
+    }
+    CHECK(covered == total, "%lu local bytes covered for a %lu byte message",
+          (unsigned long)covered, (unsigned long)total);
+    for (uint64_t r = 0; r < total; r++)
+        CHECK(l->remote_cov[r] == 1, "remote offset %lu covered %u times", (unsigned long)r, l->remote_cov[r]);
+    for (int i = 0; i < l->num_sge; i++)
+        for (uint32_t b = 0; b < l->sg_list[i].length; b++)
+            CHECK(l->local_cov[l->sg_list[i].addr + b] == 1, "sge %d byte %u not covered once", i, b);
+    return 0;
+}
+
+/*
+ * Bandwidth-class token rule (justitia_charge_bytes): refill a token worth chunk bytes while
+ * the credit is not positive, then charge the WR's bytes. Returns the tokens taken.
+ */
+static uint64_t charge(int64_t *credit, uint32_t bytes, uint32_t chunk)
+{
+    uint64_t tokens = 0;
+
+    while (*credit <= 0) {
+        *credit += chunk;
+        tokens++;
+    }
+    *credit -= bytes;
+    return tokens;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc >= 2 ? atoi(argv[1]) : 2000;
+    unsigned seed = argc >= 3 ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+    struct layout l;
+
+    srand(seed);
+    l.local_size = (uint64_t)MAX_SGE * MAX_SEG;
+    l.local_cov = malloc(l.local_size);
+    l.remote_cov = malloc(l.local_size);
+    if (!l.local_cov || !l.remote_cov)
+        return 2;
+
+    for (int it = 0; it < iters; it++) {
+        int perm[MAX_SGE];
+
+        /* each SGE lives in its own segment, in shuffled order, at a random offset */
+        l.num_sge = 1 + rand() % MAX_SGE;
+        for (int i = 0; i < MAX_SGE; i++)
+            perm[i] = i;
+        for (int i = MAX_SGE - 1; i > 0; i--) {
+            int j = rand() % (i + 1), t = perm[i];
+            perm[i] = perm[j];
+            perm[j] = t;
+        }
+        l.total = 0;
+        for (int i = 0; i < l.num_sge; i++) {
+            uint32_t len = rand() % 4 == 0 ? 0 : 1 + rand() % (MAX_SEG / 2);
+            uint32_t start = rand() % (MAX_SEG - len + 1);
+            l.sg_list[i].addr = (uint64_t)perm[i] * MAX_SEG + start;
+            l.sg_list[i].length = len;
+            l.sg_list[i].lkey = perm[i];
+            l.total += len;
+        }
+        if (l.total == 0)
+            continue;
+
+        uint32_t chunk = 1 + rand() % (uint32_t)(l.total + 16);
+        uint32_t split_min = rand() % (uint32_t)(l.total + 16);
+        uint32_t slot = 1 + rand() % (uint32_t)(l.total + 16);
+        for (int kind = ONE_SIDED; kind <= WIMM; kind++) {
+            memset(l.local_cov, 0, l.local_size);
+            memset(l.remote_cov, 0, l.local_size);
+            if (run_layout(&l, kind, chunk, split_min, slot, l.num_sge)) {
+                fprintf(stderr, "  iteration %d seed %u kind %d num_sge %d total %lu chunk %u "
+                        "split_min %u slot %u\n", it, seed, kind, l.num_sge,
+                        (unsigned long)l.total, chunk, split_min, slot);
+                break;
+            }
+        }
+
+        /*
+         * token accounting: a split WR costs exactly one token per chunk, and a chain of
+         * unsplit WRs (each at most one chunk) never drifts more than a chunk from its bytes
+         */
+        uint64_t n = (l.total + chunk - 1) / chunk;
+        uint64_t tokens = 0, bytes = 0;
+        int64_t credit = 0;
+        for (uint64_t i = 0; i < n; i++)
+            tokens += charge(&credit, i + 1 < n ? chunk : l.total - (n - 1) * chunk, chunk);
+        if (tokens != n) {
+            fprintf(stderr, "FAIL: split WR of %lu chunks cost %lu tokens\n",
+                    (unsigned long)n, (unsigned long)tokens);
+            failures++;
+        }
+        tokens = 0;
+        credit = 0;
+        for (int i = 0; i < l.num_sge; i++) {
+            uint32_t len = l.sg_list[i].length < chunk ? l.sg_list[i].length : chunk;
+            tokens += charge(&credit, len, chunk);
+            bytes += len;
+        }
+        if (!(tokens * chunk + chunk > bytes && tokens * chunk <= bytes + chunk)) {
+            fprintf(stderr, "FAIL: %lu tokens for a %lu byte chain at chunk %u\n",
+                    (unsigned long)tokens, (unsigned long)bytes, chunk);
+            failures++;
+        }
+    }
+
+    /* an imm without the mark is never taken for a split piece */
+    for (int i = 0; i < iters; i++) {
+        uint32_t imm = (uint32_t)rand() << 16 ^ (uint32_t)rand();
+
+        if ((imm & SPLIT_IMM_MARK_MASK) != SPLIT_IMM_MARK && split_imm_chunks(imm)) {
+            fprintf(stderr, "FAIL: imm 0x%08x taken for a split piece\n", imm);
+            failures++;
+        }
+    }
+    if (split_imm_chunks(0) || split_imm_chunks(SPLIT_IMM_MARK | SPLIT_IMM_USER)) {
+        fprintf(stderr, "FAIL: a piece of no chunks\n");
+        failures++;
+    }
+
+    /* a cursor seeked past the end or asked for too many SGEs must refuse */
+    {
+        struct ibv_sge sg[2] = { { 0, 10, 0 }, { MAX_SEG, 10, 1 } };
+        struct ibv_sge out[2];
+        struct split_sge_cursor cur;
+
+        split_sge_seek(&cur, sg, 2, 5);
+        if (split_sge_fill(&cur, sg, 2, 10, out, 1) != -1) {
+            fprintf(stderr, "FAIL: fill spanning two SGEs with max_out 1 succeeded\n");
+            failures++;
+        }
+        split_sge_seek(&cur, sg, 2, 5);
+        if (split_sge_fill(&cur, sg, 2, 16, out, 2) != -1) {
+            fprintf(stderr, "FAIL: fill past the end of the list succeeded\n");
+            failures++;
+        }
+    }
+
+    free(l.local_cov);
+    free(l.remote_cov);
+    if (failures) {
+        printf("split_sge_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("split_sge_test: %d iterations OK (seed %u)\n", iters, seed);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef SRPT_H
+#define SRPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shortest-remaining-first order of the token grants among the bw flows waiting for a token
+ * (SRPT_GRANTS in pacer.h); without it they are served round-robin. Every bw flow publishes in
+ * its slot how many bytes are left of the message it is posting, and the waiting flow with the
+ * fewest gets the next token. So that an elephant is not starved, the bytes a flow is ranked by
+ * halve for every SRPT_AGE_GRANTS tokens granted since it started waiting or got its last one:
+ * a waiting flow gets a token within about SRPT_AGE_GRANTS * log2(its bytes left) grants.
+ * Flows publishing nothing rank as SRPT_UNKNOWN_BYTES. Ties go round-robin.
+ * Kept free of verbs so it can be tested offline.
+ */
+
+#define SRPT_AGE_GRANTS         8
+#define SRPT_UNKNOWN_BYTES      (1ULL << 40)
+
+/* rank of a flow with left bytes left that has waited for waited grants; lower goes first */
+static inline uint64_t srpt_rank(uint64_t left, uint64_t waited)
+{
+    uint64_t halvings = waited / SRPT_AGE_GRANTS;
+
+    if (!left)
+        left = SRPT_UNKNOWN_BYTES;
+    return halvings < 64 ? left >> halvings : 0;
+}
+
+/* The slot among [0, n) to grant the next token to, or -1 if none is waiting. Slot i waits if
+ * pending[i * stride] is set and read[i * stride] is not (READs have their own tokens); left[i]
+ * is what it published. since[i] is the grant count when slot i last got a token or was seen not
+ * waiting; it is kept up here, and set by the caller to the new grant count when it grants.
+ * Ties go to the first slot from start on.
+ */
+static inline int srpt_pick(const uint8_t *pending, const uint8_t *read, size_t stride, const uint64_t *left,
+                            uint64_t *since, uint64_t grants, int n, int start)
+{
+    uint64_t rank, best_rank = UINT64_MAX;
+    int i, k, best = -1;
+
+    if (start >= n)
+        start = 0;
+    for (k = 0, i = start; k < n; k++, i = i + 1 < n ? i + 1 : 0) {
+        if (!__atomic_load_n(&pending[i * stride], __ATOMIC_RELAXED) ||
+            __atomic_load_n(&read[i * stride], __ATOMIC_RELAXED)) {
+            since[i] = grants;
+            continue;
+        }
+        rank = srpt_rank(__atomic_load_n(&left[i], __ATOMIC_RELAXED), grants - since[i]);
+        if (rank < best_rank) {
+            best_rank = rank;
+            best = i;
+        }
+    }
+    return best;
+}
+
+#endif
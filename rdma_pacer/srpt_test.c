@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+
+/*
+ * Test and evaluation of the shortest-remaining-first token grants among bw flows (srpt.h)
+ * against the pacer's round-robin grants.
+ *
+ * First srpt_pick itself: the least left goes first, unknown sizes rank as SRPT_UNKNOWN_BYTES,
+ * READs and flows not waiting are skipped, ties go round-robin and a passed-over flow ages.
+ *
+ * Then both policies are simulated on the same heavy-tailed workload: messages with bounded
+ * Pareto sizes arrive as a Poisson process at a fraction of the link rate, each to one of the
+ * bw flows, which posts its messages in order. Like the driver, a flow asks for a token while
+ * it has a message and no byte credit, publishes the bytes left of that message, and a token
+ * is worth one chunk of credit that carries over to its next message. The link grants one
+ * token per chunk time. Reports mean and p99 message completion times (arrival to last byte
+ * granted), overall and for small and big messages. Checks that every message completes, that
+ * SRPT beats round-robin on mean completion time and that no waiting flow goes more than
+ * the aging bound without a token.
+ *
+ * usage: srpt_test [messages] [load] [flows] [seed]
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "srpt.h"
+
+#define CHUNK           5000            /* bytes per token: the pacer's chunk size next to lat flows */
+#define LINE_RATE_MB    12000           /* MBps: a token every CHUNK / LINE_RATE_MB us */
+#define MSG_SIZE_MIN    10000           /* bounded Pareto message sizes */
+#define MSG_SIZE_MAX    1000000000
+#define MSG_SIZE_ALPHA  1.1
+#define SMALL_MSG       100000          /* reported apart: at most this many bytes ... */
+#define BIG_MSG         10000000        /* ... and at least this many */
+#define MAX_FLOWS_SIM   256
+
+/* longest a waiting flow may go without a token under SRPT, in grants: it ranks 0 once its bytes
+ * left are halved away, and then waits at most for one tie per other flow
+ */
+#define WAIT_BOUND(flows)   (SRPT_AGE_GRANTS * (64 - __builtin_clzll(SRPT_UNKNOWN_BYTES)) + (flows))
+
+struct msg {
+    double arrival;                     /* us */
+    uint64_t size;
+    int flow;
+};
+
+struct sim_flow {
+    int *msgs;                          /* its messages in arrival order */
+    int num, head;                      /* how many; first one not completed */
+    uint64_t left;                      /* bytes left of the head message */
+    int64_t credit;                     /* bytes covered by the tokens granted so far */
+    uint64_t waiting_since;             /* grant count when it started waiting */
+};
+
+struct result {
+    double mean, p99, small_mean, small_p99, big_mean, big_p99;
+    uint64_t max_wait;
+};
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+static double uniform01(void)
+{
+    return ((double)rand() + 1) / ((double)RAND_MAX + 2);
+}
+
+static uint64_t pareto_size(void)
+{
+    double l = pow(MSG_SIZE_MIN, MSG_SIZE_ALPHA), h = pow(MSG_SIZE_MAX, MSG_SIZE_ALPHA);
+
+    /* inverse cdf of the bounded Pareto distribution */
+    return (uint64_t)pow((h - uniform01() * (h - l)) / (h * l), -1.0 / MSG_SIZE_ALPHA);
+}
+
+static int check_pick(void)
+{
+    uint8_t pending[4] = { 1, 1, 1, 0 }, read[4] = { 0, 0, 0, 0 };
+    uint64_t left[4] = { 5000000, 20000, 0, 10 }, since[4] = { 0 };
+    int i, got;
+
+    CHECK(srpt_pick(pending, read, 1, left, since, 0, 4, 0) == 1, "least left does not go first");
+    read[1] = 1;
+    CHECK(srpt_pick(pending, read, 1, left, since, 0, 4, 0) == 0, "a READ was picked");
+    pending[0] = 0;
+    CHECK(srpt_pick(pending, read, 1, left, since, 0, 4, 0) == 2, "unknown size not picked when alone");
+    pending[2] = 0;
+    CHECK(srpt_pick(pending, read, 1, left, since, 0, 4, 0) == -1, "picked with nobody waiting");
+
+    /* ties go round-robin from start */
+    memset(pending, 1, sizeof(pending));
+    memset(read, 0, sizeof(read));
+    for (i = 0; i < 4; i++)
+        left[i] = 1000;
+    for (i = 0; i < 4; i++)
+        CHECK((got = srpt_pick(pending, read, 1, left, since, 0, 4, i)) == i, "tie from %d went to %d", i, got);
+
+    /* a flow passed over ages: a big one eventually beats a fresh small one */
+    left[0] = 1ULL << 30;
+    left[1] = 1ULL << 10;
+    pending[2] = pending[3] = 0;
+    since[0] = since[1] = 0;
+    CHECK(srpt_pick(pending, read, 1, left, since, 0, 4, 0) == 1, "small does not go first");
+    since[1] = SRPT_AGE_GRANTS * 21;
+    CHECK(srpt_pick(pending, read, 1, left, since, SRPT_AGE_GRANTS * 21, 4, 0) == 0,
+          "big one passed over %d times still not first", SRPT_AGE_GRANTS * 21);
+    CHECK(srpt_rank(1, SRPT_AGE_GRANTS * 64) == 0 && srpt_rank(0, 0) == SRPT_UNKNOWN_BYTES, "rank edges");
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* mean and p99 of the n completion times in fct (sorted in place) */
+static void summarize(double *fct, int n, double *mean, double *p99)
+{
+    double sum = 0;
+    int i;
+
+    *mean = *p99 = 0;
+    if (!n)
+        return;
+    qsort(fct, n, sizeof(*fct), cmp_double);
+    for (i = 0; i < n; i++)
+        sum += fct[i];
+    *mean = sum / n;
+    *p99 = fct[n - 1 - n / 100];
+}
+
+/* the head message of f takes what credit f has; completed messages get their time at now */
+static void serve(struct sim_flow *f, const struct msg *msgs, double now, double *fct, int *done)
+{
+    while (f->head < f->num && msgs[f->msgs[f->head]].arrival <= now && f->credit > 0) {
+        uint64_t take = f->left < (uint64_t)f->credit ? f->left : (uint64_t)f->credit;
+
+        f->left -= take;
+        f->credit -= take;
+        if (f->left)
+            break;
+        fct[f->msgs[f->head]] = now - msgs[f->msgs[f->head]].arrival;
+        (*done)++;
+        if (++f->head < f->num)
+            f->left = msgs[f->msgs[f->head]].size;
+    }
+}
+
+static int simulate(const struct msg *msgs, int n, struct sim_flow *flows, int nflows, int srpt, struct result *r)
+{
+    double chunk_us = (double)CHUNK / LINE_RATE_MB, now = 0;
+    double *fct = malloc(n * sizeof(double)), *part = malloc(n * sizeof(double));
+    uint8_t pending[MAX_FLOWS_SIM] = { 0 }, read[MAX_FLOWS_SIM] = { 0 };
+    uint64_t left[MAX_FLOWS_SIM], since[MAX_FLOWS_SIM] = { 0 }, grants = 0;
+    int i, k, pick, next_idx = 0, done = 0, arrived = 0, np;
+
+    if (!fct || !part)
+        return -1;
+    memset(r, 0, sizeof(*r));
+    for (i = 0; i < nflows; i++) {
+        flows[i].head = 0;
+        flows[i].credit = 0;
+        flows[i].left = flows[i].num ? msgs[flows[i].msgs[0]].size : 0;
+        flows[i].waiting_since = 0;
+    }
+
+    while (done < n) {
+        while (arrived < n && msgs[arrived].arrival <= now)
+            arrived++;
+        /* who waits for a token and what it publishes */
+        for (i = 0; i < nflows; i++) {
+            struct sim_flow *f = &flows[i];
+            int was = pending[i];
+
+            serve(f, msgs, now, fct, &done);
+            pending[i] = f->head < f->num && msgs[f->msgs[f->head]].arrival <= now;
+            left[i] = pending[i] ? f->left : 0;
+            if (pending[i] && !was)
+                f->waiting_since = grants;
+        }
+
+        if (srpt) {
+            pick = srpt_pick(pending, read, 1, left, since, grants, nflows, next_idx);
+        } else {
+            for (pick = -1, k = 0, i = next_idx; k < nflows; k++, i = (i + 1) % nflows)
+                if (pending[i]) {
+                    pick = i;
+                    break;
+                }
+        }
+        if (pick < 0) {
+            /* idle until the next message arrives */
+            if (arrived < n && msgs[arrived].arrival > now)
+                now = msgs[arrived].arrival;
+            continue;
+        }
+
+        grants++;
+        since[pick] = grants;
+        if (grants - 1 - flows[pick].waiting_since > r->max_wait)
+            r->max_wait = grants - 1 - flows[pick].waiting_since;
+        flows[pick].waiting_since = grants;
+        flows[pick].credit += CHUNK;
+        next_idx = (pick + 1) % nflows;
+        now += chunk_us;
+        serve(&flows[pick], msgs, now, fct, &done);
+    }
+
+    memcpy(part, fct, n * sizeof(double));
+    summarize(part, n, &r->mean, &r->p99);
+    for (np = 0, i = 0; i < n; i++)
+        if (msgs[i].size <= SMALL_MSG)
+            part[np++] = fct[i];
+    summarize(part, np, &r->small_mean, &r->small_p99);
+    for (np = 0, i = 0; i < n; i++)
+        if (msgs[i].size >= BIG_MSG)
+            part[np++] = fct[i];
+    summarize(part, np, &r->big_mean, &r->big_p99);
+    free(fct);
+    free(part);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    double load = argc > 2 ? atof(argv[2]) : 0.8;
+    int nflows = argc > 3 ? atoi(argv[3]) : 16;
+    unsigned seed = argc > 4 ? (unsigned)strtoul(argv[4], NULL, 10) : 1;
+    struct sim_flow flows[MAX_FLOWS_SIM];
+    struct result rr, srpt;
+    struct msg *msgs;
+    uint64_t bytes = 0;
+    double t = 0, mean_size;
+    int i, small = 0, big = 0;
+
+    if (n <= 0 || load <= 0 || load >= 1 || nflows <= 0 || nflows > MAX_FLOWS_SIM) {
+        fprintf(stderr, "usage: %s [messages] [load(0..1)] [flows(1..%d)] [seed]\n", argv[0], MAX_FLOWS_SIM);
+        return 2;
+    }
+    srand(seed);
+    check_pick();
+
+    /* sizes first, then Poisson arrivals at load times the link rate */
+    if (!(msgs = malloc(n * sizeof(*msgs))))
+        return 2;
+    for (i = 0; i < n; i++) {
+        msgs[i].size = pareto_size();
+        bytes += msgs[i].size;
+        small += msgs[i].size <= SMALL_MSG;
+        big += msgs[i].size >= BIG_MSG;
+    }
+    mean_size = (double)bytes / n;
+    for (i = 0; i < n; i++) {
+        t += -log(uniform01()) * mean_size / (load * LINE_RATE_MB);
+        msgs[i].arrival = t;
+        msgs[i].flow = rand() % nflows;
+    }
+    for (i = 0; i < nflows; i++) {
+        flows[i].msgs = malloc(n * sizeof(int));
+        flows[i].num = 0;
+        if (!flows[i].msgs)
+            return 2;
+    }
+    for (i = 0; i < n; i++)
+        flows[msgs[i].flow].msgs[flows[msgs[i].flow].num++] = i;
+
+    if (simulate(msgs, n, flows, nflows, 0, &rr) || simulate(msgs, n, flows, nflows, 1, &srpt))
+        return 2;
+    if (!failures && srpt.mean >= rr.mean) {
+        fprintf(stderr, "FAIL: SRPT mean completion %.1f us not below round-robin %.1f us\n", srpt.mean, rr.mean);
+        failures++;
+    }
+    if (!failures && srpt.max_wait > (uint64_t)WAIT_BOUND(nflows)) {
+        fprintf(stderr, "FAIL: a flow waited %llu grants under SRPT, bound %d\n", (unsigned long long)srpt.max_wait,
+                WAIT_BOUND(nflows));
+        failures++;
+    }
+    for (i = 0; i < nflows; i++)
+        free(flows[i].msgs);
+    free(msgs);
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("srpt_test: %d messages (mean %.0f B, %d <= %d B, %d >= %d B), load %.2f, %d flows, seed %u\n", n,
+           mean_size, small, SMALL_MSG, big, BIG_MSG, load, nflows, seed);
+    printf("completion us   %12s %12s %12s %12s %12s %12s %10s\n", "mean", "p99", "small mean", "small p99",
+           "big mean", "big p99", "max wait");
+    printf("round-robin     %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %10llu\n", rr.mean, rr.p99, rr.small_mean,
+           rr.small_p99, rr.big_mean, rr.big_p99, (unsigned long long)rr.max_wait);
+    printf("srpt            %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %10llu\n", srpt.mean, srpt.p99,
+           srpt.small_mean, srpt.small_p99, srpt.big_mean, srpt.big_p99, (unsigned long long)srpt.max_wait);
+    return 0;
+}
@@ -13,11 +13,14 @@
 #include <unistd.h>
 
 #ifndef MSG_LEN
-#define MSG_LEN 24
+#define MSG_LEN 32
 #endif
 
 #define HOSTNAME_PATH "/proc/sys/kernel/hostname"
 
+/* qps every thread registers next to its per-thread slot, as the drivers do per qp */
+#define QPS_PER_THREAD 2
+
 static char *get_sock_path(void)
 {
     FILE *fp = fopen(HOSTNAME_PATH, "r");
@@ -73,7 +76,7 @@ static int connect_uds(const char *sock_path)
     return s;
 }
 
-static int do_join_and_get_slot(const char *sock_path, pid_t pid, pid_t tid)
+static int do_join_and_get_slot(const char *sock_path, pid_t pid, pid_t tid, uint32_t qpn)
 {
     int s = connect_uds(sock_path);
     if (s < 0)
@@ -105,9 +108,10 @@ static int do_join_and_get_slot(const char *sock_path, pid_t pid, pid_t tid)
         return -1;
     }
 
-    // send pid:tid
+    // send pid:tid, or pid:tid:qpn for a per-qp registration
     memset(buf, 0, sizeof(buf));
-    int msg_len = snprintf(buf, sizeof(buf), "%d:%d", (int)pid, (int)tid);
+    int msg_len = qpn ? snprintf(buf, sizeof(buf), "%d:%d:%x", (int)pid, (int)tid, qpn)
+                      : snprintf(buf, sizeof(buf), "%d:%d", (int)pid, (int)tid);
     if (send(s, buf, (size_t)msg_len, 0) == -1) {
         perror("send pid:tid");
         close(s);
@@ -127,14 +131,15 @@ static int do_join_and_get_slot(const char *sock_path, pid_t pid, pid_t tid)
     return (int)strtol(buf, NULL, 10);
 }
 
-static int do_leave(const char *sock_path, pid_t pid, pid_t tid)
+static int do_leave(const char *sock_path, pid_t pid, pid_t tid, uint32_t qpn)
 {
     int s = connect_uds(sock_path);
     if (s < 0)
         return -1;
 
     char buf[MSG_LEN];
-    int len = snprintf(buf, sizeof(buf), "l:%d:%d", (int)pid, (int)tid);
+    int len = qpn ? snprintf(buf, sizeof(buf), "l:%d:%d:%x", (int)pid, (int)tid, qpn)
+                  : snprintf(buf, sizeof(buf), "l:%d:%d", (int)pid, (int)tid);
     if (send(s, buf, (size_t)len, 0) == -1) {
         perror("send leave");
         close(s);
@@ -151,6 +156,7 @@ struct thread_arg {
     int do_leave;
     int slot_first;
     int slot_second;
+    int slot_qp[QPS_PER_THREAD];
     int rc;
 };
 
@@ -163,29 +169,45 @@ static void *thread_main(void *arg)
     pid_t pid = getpid();
     pid_t tid = (pid_t)syscall(SYS_gettid);
 
-    a->slot_first = do_join_and_get_slot(a->sock_path, pid, tid);
+    a->slot_first = do_join_and_get_slot(a->sock_path, pid, tid, 0);
     if (a->slot_first < 0) {
         a->rc = 1;
         return NULL;
     }
 
     // Join again; should return same slot for same (pid,tid)
-    a->slot_second = do_join_and_get_slot(a->sock_path, pid, tid);
+    a->slot_second = do_join_and_get_slot(a->sock_path, pid, tid, 0);
     if (a->slot_second < 0) {
         a->rc = 2;
         return NULL;
     }
 
+    // Every qp of the same thread gets a slot of its own; joining again keeps it
+    for (int q = 0; q < QPS_PER_THREAD; q++) {
+        uint32_t qpn = 0x40 + q;
+        a->slot_qp[q] = do_join_and_get_slot(a->sock_path, pid, tid, qpn);
+        if (a->slot_qp[q] < 0 || do_join_and_get_slot(a->sock_path, pid, tid, qpn) != a->slot_qp[q]) {
+            a->rc = 4;
+            return NULL;
+        }
+    }
+
     /* Hold the slot until all threads have joined, so we can validate uniqueness
      * under concurrent (pid,tid) registrations.
      */
     pthread_barrier_wait(&join_barrier);
 
     if (a->do_leave) {
-        if (do_leave(a->sock_path, pid, tid) != 0) {
+        if (do_leave(a->sock_path, pid, tid, 0) != 0) {
             a->rc = 3;
             return NULL;
         }
+        for (int q = 0; q < QPS_PER_THREAD; q++) {
+            if (do_leave(a->sock_path, pid, tid, 0x40 + q) != 0) {
+                a->rc = 3;
+                return NULL;
+            }
+        }
     }
 
     a->rc = 0;
@@ -204,8 +226,9 @@ int main(int argc, char **argv)
     int num_threads = 16;
     if (argc >= 2)
         num_threads = atoi(argv[1]);
-    if (num_threads <= 0 || num_threads > 256) {
-        fprintf(stderr, "num_threads must be 1..256\n");
+    /* the pacer has 512 slots for all threads and their qps */
+    if (num_threads <= 0 || num_threads > 512 / (1 + QPS_PER_THREAD)) {
+        fprintf(stderr, "num_threads must be 1..%d\n", 512 / (1 + QPS_PER_THREAD));
         return 2;
     }
 
@@ -219,7 +242,8 @@ int main(int argc, char **argv)
 
     pthread_t *ths = (pthread_t *)calloc((size_t)num_threads, sizeof(pthread_t));
     struct thread_arg *args = (struct thread_arg *)calloc((size_t)num_threads, sizeof(struct thread_arg));
-    int *slots = (int *)calloc((size_t)num_threads, sizeof(int));
+    int num_slots = num_threads * (1 + QPS_PER_THREAD);
+    int *slots = (int *)calloc((size_t)num_slots, sizeof(int));
 
     if (!ths || !args || !slots) {
         fprintf(stderr, "alloc failed\n");
@@ -257,23 +281,25 @@ int main(int argc, char **argv)
             fprintf(stderr, "thread %d slot mismatch: %d vs %d\n", i, args[i].slot_first, args[i].slot_second);
             failed = 1;
         }
-        slots[i] = args[i].slot_first;
+        slots[i * (1 + QPS_PER_THREAD)] = args[i].slot_first;
+        for (int q = 0; q < QPS_PER_THREAD; q++)
+            slots[i * (1 + QPS_PER_THREAD) + 1 + q] = args[i].slot_qp[q];
     }
 
-    qsort(slots, (size_t)num_threads, sizeof(int), cmp_int);
+    qsort(slots, (size_t)num_slots, sizeof(int), cmp_int);
     int dup = 0;
-    for (int i = 1; i < num_threads; i++) {
+    for (int i = 1; i < num_slots; i++) {
         if (slots[i] == slots[i - 1])
             dup = 1;
     }
 
     printf("round1 slots:");
-    for (int i = 0; i < num_threads; i++)
+    for (int i = 0; i < num_slots; i++)
         printf(" %d", slots[i]);
     printf("\n");
 
     if (dup) {
-        fprintf(stderr, "round1: found duplicate slots across threads (unexpected for scheme A)\n");
+        fprintf(stderr, "round1: found duplicate slots across threads/qps\n");
         failed = 1;
     }
 
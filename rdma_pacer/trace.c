@@ -0,0 +1,122 @@
+#include "trace.h"
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+__thread struct trace_ring *trace_self;
+
+static struct trace_ring *rings[TRACE_RINGS];
+static int trace_fd = -1;
+static int draining;                /* a flush is on; the signal handler does not wait for it */
+
+/* all of len bytes, or -1; async-signal-safe */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* starts the trace file at path; 0, or -1 with errno set */
+int trace_open(const char *path, double cpu_mhz)
+{
+    struct trace_header h;
+
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    h.magic = TRACE_MAGIC;
+    h.version = TRACE_VERSION;
+    h.cpu_mhz = cpu_mhz;
+    h.tsc0 = get_cycles();
+    if (write_all(trace_fd, &h, sizeof(h))) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* the calling thread traces into ring from now on; nothing if tracing is off or out of memory */
+void trace_thread(int ring)
+{
+    struct trace_ring *r;
+
+    if (trace_fd < 0 || ring < 0 || ring >= TRACE_RINGS)
+        return;
+    if (!(r = __atomic_load_n(&rings[ring], __ATOMIC_ACQUIRE))) {
+        if (posix_memalign((void **)&r, 64, sizeof(*r)))
+            return;
+        memset(r, 0, offsetof(struct trace_ring, ev));
+        r->id = ring;
+        __atomic_store_n(&rings[ring], r, __ATOMIC_RELEASE);
+    }
+    trace_self = r;
+}
+
+/* Writes out what the rings hold, and how much each dropped since the last flush. Returns 0, or
+ * -1 if another flush is on or the file fails. Async-signal-safe, so the pacer's termination
+ * handler can call it for the last events. */
+int trace_flush(void)
+{
+    struct trace_event drop;
+    struct trace_ring *r;
+    uint64_t head, tail, dropped, n;
+    int i, ret = 0;
+
+    if (trace_fd < 0 || __atomic_exchange_n(&draining, 1, __ATOMIC_ACQUIRE))
+        return -1;
+    for (i = 0; i < TRACE_RINGS; i++) {
+        if (!(r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE)))
+            continue;
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        while (tail != head) {
+            uint64_t at = tail & (TRACE_RING_EVENTS - 1);
+
+            n = head - tail;
+            if (n > TRACE_RING_EVENTS - at)
+                n = TRACE_RING_EVENTS - at;         /* up to the end of the ring, then from its start */
+            if (write_all(trace_fd, &r->ev[at], n * sizeof(struct trace_event)))
+                ret = -1;
+            tail += n;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->dropped_seen) {
+            memset(&drop, 0, sizeof(drop));
+            drop.tsc = get_cycles();
+            drop.type = TRACE_DROP;
+            drop.ring = i;
+            drop.val = dropped - r->dropped_seen;
+            if (write_all(trace_fd, &drop, sizeof(drop)))
+                ret = -1;
+            r->dropped_seen = dropped;
+        }
+    }
+    __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* the drain thread */
+void trace_drain(void)
+{
+    while (1) {
+        trace_flush();
+        usleep(TRACE_DRAIN_US);
+    }
+}
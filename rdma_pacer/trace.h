@@ -0,0 +1,109 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "get_clock.h"
+
+/* Binary event trace of the pacer's controller: token grants, AIMD steps of the virtual link,
+ * chunk size changes, joins and leaves, probe latencies. Every pacer thread that traces owns one
+ * ring (TRACE_RING_*) and is its only writer: an event is a 16-byte store and a release of the
+ * head, no lock, no syscall, no formatting. A drain thread copies what the rings hold to the file
+ * every TRACE_DRAIN_US; a ring it has not caught up with drops new events and counts them, so a
+ * slow disk never holds up a hot loop. pacertrace decodes the file into timelines.
+ * Tracing is on when the pacer is started with JUSTITIA_TRACE set to the file to write; off, an
+ * event costs the test of a thread-local pointer. Kept free of verbs so it can be tested offline.
+ */
+
+#define TRACE_ENV           "JUSTITIA_TRACE"
+#define TRACE_MAGIC         0x4352544aU         /* "JTRC" */
+#define TRACE_VERSION       1
+#define TRACE_RING_EVENTS   (1 << 18)           /* per ring, a power of two: 4MB */
+#define TRACE_DRAIN_US      10000
+
+enum {
+    TRACE_RING_TOKENS,      /* generate_fetch_tokens */
+    TRACE_RING_READ_TOKENS, /* generate_tokens_read */
+    TRACE_RING_READ,        /* rate_limit_read */
+    TRACE_RING_MONITOR,     /* monitor_latency or server_loop */
+    TRACE_RING_CTL,         /* flow_handler */
+    TRACE_RINGS,
+};
+
+enum {
+    TRACE_GRANT = 1,        /* arg slot, val TRACE_GRANT_* */
+    TRACE_AIMD,             /* arg 1 if the tail target was missed, val virtual link cap (MBps) */
+    TRACE_CHUNK,            /* arg 1 for the READ chunk, val chunk size (bytes) */
+    TRACE_JOIN,             /* arg slot, val pid */
+    TRACE_LEAVE,            /* arg slot, val pid */
+    TRACE_PROBE,            /* arg server, val probe latency (ns) */
+    TRACE_DROP,             /* written by the drain: val events the ring dropped since the last */
+    TRACE_TYPES,
+};
+
+enum {
+    TRACE_GRANT_SHARED,     /* from the virtual link */
+    TRACE_GRANT_RESERVED,   /* from a reservation's bucket */
+    TRACE_GRANT_READ,       /* from the READ bucket */
+};
+
+struct trace_event {
+    uint64_t tsc;
+    uint8_t type;
+    uint8_t ring;
+    uint16_t arg;
+    uint32_t val;
+};
+
+/* the file starts with it; events follow until the end */
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    double cpu_mhz;                 /* tsc cycles per us */
+    uint64_t tsc0;                  /* tsc at trace_open */
+};
+
+struct trace_ring {
+    uint64_t head;                  /* written by the owner only */
+    uint64_t tail_seen;             /* the owner's copy of tail, reread when the ring looks full */
+    uint64_t dropped;               /* events the owner found no room for */
+    uint64_t id;                    /* TRACE_RING_* */
+    char pad[32];
+    uint64_t tail;                  /* written by the drain only */
+    uint64_t dropped_seen;
+    char pad2[48];
+    struct trace_event ev[TRACE_RING_EVENTS];
+};
+
+extern __thread struct trace_ring *trace_self;
+
+int trace_open(const char *path, double cpu_mhz);
+void trace_thread(int ring);
+void trace_drain(void);
+int trace_flush(void);
+
+static inline void trace(uint8_t type, uint16_t arg, uint32_t val)
+{
+    struct trace_ring *r = trace_self;
+    struct trace_event *e;
+    uint64_t head;
+
+    if (!r)
+        return;
+    head = r->head;
+    if (head - r->tail_seen >= TRACE_RING_EVENTS) {
+        r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head - r->tail_seen >= TRACE_RING_EVENTS) {
+            __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    e = &r->ev[head & (TRACE_RING_EVENTS - 1)];
+    e->tsc = get_cycles();
+    e->type = type;
+    e->ring = r->id;
+    e->arg = arg;
+    e->val = val;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
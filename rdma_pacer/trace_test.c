@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+/*
+ * Test for the pacer's event trace (trace.h, trace.c).
+ *
+ * Writers, one per ring as the pacer's threads are, trace numbered events while the drain thread
+ * writes them out; read back, the file must hold every event of every ring, in order, with its
+ * ring, type, arg and val intact. A ring the drain does not empty keeps what fits, drops the rest
+ * and the next flush records exactly how many it dropped. Last, the cost of an event is measured
+ * and reported, with tracing on (while the drain runs) and off.
+ *
+ * usage: trace_test [events_per_ring]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TIMED       1000000
+#define WRITERS     3           /* rings TRACE_RING_TOKENS .. TRACE_RING_READ */
+#define FULL_RING   TRACE_RING_CTL
+
+static int failures;
+static int per_ring;
+static char path[] = "/tmp/trace_test.XXXXXX";
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+        return -1;                                              \
+    }                                                           \
+} while (0)
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* numbered events, slower than the drain empties the ring so none is dropped */
+static void *writer(void *arg)
+{
+    int ring = (int)(intptr_t)arg, i;
+
+    trace_thread(ring);
+    for (i = 0; i < per_ring; i++) {
+        trace(TRACE_GRANT + i % (TRACE_DROP - TRACE_GRANT), ring, i);
+        if (i % (TRACE_RING_EVENTS / 4) == TRACE_RING_EVENTS / 4 - 1)
+            usleep(3 * TRACE_DRAIN_US);
+    }
+    return NULL;
+}
+
+static void *drain_while(void *stop)
+{
+    while (!__atomic_load_n((int *)stop, __ATOMIC_RELAXED)) {
+        trace_flush();
+        usleep(TRACE_DRAIN_US);
+    }
+    return NULL;
+}
+
+static struct trace_event *read_back(size_t *n, struct trace_header *h)
+{
+    FILE *f = fopen(path, "r");
+    struct trace_event *ev = NULL;
+    size_t cap = 0;
+
+    *n = 0;
+    if (!f || fread(h, sizeof(*h), 1, f) != 1)
+        return NULL;
+    while (1) {
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 1 << 16;
+            ev = realloc(ev, cap * sizeof(*ev));
+        }
+        if (fread(&ev[*n], sizeof(*ev), 1, f) != 1)
+            break;
+        (*n)++;
+    }
+    fclose(f);
+    return ev;
+}
+
+static int check_all_written(void)
+{
+    pthread_t th[WRITERS], drain;
+    int stop = 0;
+    struct trace_header h;
+    struct trace_event *ev;
+    uint32_t next[TRACE_RINGS] = { 0 };
+    uint64_t last[TRACE_RINGS] = { 0 };
+    size_t n, i;
+    int r;
+
+    pthread_create(&drain, NULL, drain_while, &stop);
+    for (r = 0; r < WRITERS; r++)
+        pthread_create(&th[r], NULL, writer, (void *)(intptr_t)r);
+    for (r = 0; r < WRITERS; r++)
+        pthread_join(th[r], NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    pthread_join(drain, NULL);
+    CHECK(trace_flush() == 0, "last flush failed");
+
+    ev = read_back(&n, &h);
+    CHECK(ev || !n, "no trace at %s", path);
+    CHECK(h.magic == TRACE_MAGIC && h.version == TRACE_VERSION && h.cpu_mhz == 2500, "bad header");
+    CHECK(n == (size_t)WRITERS * per_ring, "%zu events written, %d traced", n, WRITERS * per_ring);
+    for (i = 0; i < n; i++) {
+        struct trace_event *e = &ev[i];
+
+        CHECK(e->ring < WRITERS && e->arg == e->ring, "event %zu: ring %u arg %u", i, e->ring, e->arg);
+        r = e->ring;
+        CHECK(e->val == next[r], "ring %d: event %u where %u was due", r, e->val, next[r]);
+        CHECK(e->type == TRACE_GRANT + e->val % (TRACE_DROP - TRACE_GRANT), "ring %d event %u: type %u",
+              r, e->val, e->type);
+        CHECK(e->tsc >= last[r] && e->tsc >= h.tsc0, "ring %d event %u: tsc went back", r, e->val);
+        next[r]++;
+        last[r] = e->tsc;
+    }
+    free(ev);
+    return 0;
+}
+
+/* no drain while twice the ring is traced: the first ring full is kept, the rest counted */
+static int check_drops(void)
+{
+    struct trace_header h;
+    struct trace_event *ev;
+    size_t n, i, kept = 0, dropped = 0;
+    int k;
+
+    trace_thread(FULL_RING);
+    for (k = 0; k < 2 * TRACE_RING_EVENTS; k++)
+        trace(TRACE_PROBE, 0, k);
+    CHECK(trace_flush() == 0, "flush failed");
+    trace_self = NULL;
+
+    ev = read_back(&n, &h);
+    for (i = 0; i < n; i++) {
+        if (ev[i].ring != FULL_RING)
+            continue;
+        if (ev[i].type == TRACE_DROP) {
+            dropped += ev[i].val;
+            continue;
+        }
+        CHECK(ev[i].val == kept, "kept event %zu is %u", kept, ev[i].val);
+        kept++;
+    }
+    CHECK(kept == TRACE_RING_EVENTS, "%zu kept of a ring of %d", kept, TRACE_RING_EVENTS);
+    CHECK(dropped == TRACE_RING_EVENTS, "%zu recorded as dropped, %d were", dropped, TRACE_RING_EVENTS);
+    free(ev);
+    return 0;
+}
+
+static double event_cost(int on)
+{
+    pthread_t drain;
+    int stop = 0, i;
+    uint64_t t0;
+    double ns;
+
+    trace_thread(TRACE_RING_MONITOR);
+    if (!on)
+        trace_self = NULL;
+    pthread_create(&drain, NULL, drain_while, &stop);
+    t0 = now_ns();
+    for (i = 0; i < TIMED; i++)
+        trace(TRACE_GRANT, i & 511, TRACE_GRANT_SHARED);
+    ns = (double)(now_ns() - t0) / TIMED;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    pthread_join(drain, NULL);
+    trace_self = NULL;
+    return ns;
+}
+
+int main(int argc, char **argv)
+{
+    int fd;
+
+    per_ring = argc > 1 ? atoi(argv[1]) : TRACE_RING_EVENTS * 2;
+    if (per_ring < 0 || (fd = mkstemp(path)) < 0)
+        return 2;
+    close(fd);
+    if (trace_open(path, 2500)) {
+        perror("trace_open");
+        return 2;
+    }
+
+    check_all_written();
+    check_drops();
+    if (failures) {
+        fprintf(stderr, "%d failure(s), trace left at %s\n", failures, path);
+        return 1;
+    }
+    printf("trace_test: %d rings of %d events written in order, drops counted\n", WRITERS, per_ring);
+
+    double on = event_cost(1), off = event_cost(0);
+    printf("event: %.1f ns traced, %.1f ns off\n", on, off);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+
+/*
+ * Test for the fail-open watchdog of the drivers (watchdog.h) against a pacer that dies.
+ *
+ * A forked fake pacer publishes a new epoch in a shared mapping laid out like the heartbeat and
+ * pending flags of the shared block, grants every pending token at once and beats every
+ * HEARTBEAT_US, as rdma_pacer does. Worker threads wait for a token before every send the way the
+ * drivers do without CPU_FRIENDLY: they spin on their pending flag, look at the heartbeat every
+ * WATCHDOG_SPINS spins and stop waiting once it stood still for WATCHDOG_STALE_NS, and they join
+ * again when the epoch changes.
+ *
+ * Phases: the pacer runs (every send is paced); it is killed under load (no send stalls longer
+ * than the stale period and a margin, then sends go unpaced at once); a new one starts (every
+ * worker joins it and sends are paced again); it is stopped for less than the stale period (no
+ * one gives up on it) and for longer (sends go unpaced, then paced again once it beats).
+ *
+ * usage: watchdog_test [workers]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../justitia/watchdog.h"
+
+#define HEARTBEAT_US    1000            /* as in pacer.h */
+#define MAX_WORKERS     16
+#define STRIDE          64              /* one cache line per pending flag */
+#define MARGIN_NS       40000000        /* scheduling slack of a loaded box on top of the stale period */
+#define INSTANT_NS      1000000         /* a wait for a pacer found dead returns within this */
+#define MS              1000000ULL
+
+struct shared {
+    uint64_t heartbeat;
+    uint32_t epoch;
+    uint8_t pending[MAX_WORKERS * STRIDE];
+};
+
+struct worker {
+    pthread_t th;
+    int slot;
+    uint32_t epoch;                     /* of the pacer joined last */
+    uint64_t joined_ns;                 /* when it was joined */
+    uint64_t paced;                     /* sends after a token */
+    uint64_t unpaced;                   /* sends without, the pacer found dead */
+    uint64_t max_wait_ns;               /* longest wait for a token; reset by the phases */
+    uint64_t first_unpaced_ns;          /* first unpaced send; reset by the phases */
+};
+
+static struct shared *sh;
+static struct watchdog_dead dead;       /* as justitia_dead */
+static struct worker workers[MAX_WORKERS];
+static int num_workers = 4;
+static int stop;
+static int failures;
+
+#define CHECK(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+        fprintf(stderr, __VA_ARGS__);                           \
+        fputc('\n', stderr);                                    \
+        failures++;                                             \
+    }                                                           \
+} while (0)
+
+#define LOAD(x)         __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* the fake pacer: a new epoch, then grants and beats until it is killed */
+static void fake_pacer(void)
+{
+    uint64_t next = watchdog_now_ns();
+    uint32_t epoch = LOAD(sh->epoch) + 1;
+    int i;
+
+    __atomic_fetch_add(&sh->heartbeat, 1, __ATOMIC_RELAXED);
+    STORE(sh->epoch, epoch ? epoch : 1);
+    while (1) {
+        for (i = 0; i < MAX_WORKERS; i++)
+            if (LOAD(sh->pending[i * STRIDE]))
+                STORE(sh->pending[i * STRIDE], 0);
+        if (watchdog_now_ns() >= next) {
+            __atomic_fetch_add(&sh->heartbeat, 1, __ATOMIC_RELAXED);
+            next += HEARTBEAT_US * 1000ULL;
+        }
+    }
+}
+
+static pid_t start_pacer(void)
+{
+    uint32_t epoch = LOAD(sh->epoch);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        exit(2);
+    }
+    if (!pid)
+        fake_pacer();
+    while (LOAD(sh->epoch) == epoch)
+        sched_yield();
+    return pid;
+}
+
+/* justitia_pacer_dead + justitia_pacer_bury */
+static int pacer_dead(void)
+{
+    return watchdog_dead(&dead, LOAD(sh->epoch), LOAD(sh->heartbeat));
+}
+
+static void pacer_bury(const struct watchdog *w)
+{
+    uint32_t epoch = LOAD(sh->epoch);
+
+    if (!watchdog_dead(&dead, epoch, w->beat))
+        watchdog_bury(&dead, w, epoch);
+}
+
+/* justitia_wait_token without CPU_FRIENDLY */
+static int wait_token(uint8_t *pending)
+{
+    struct watchdog w;
+
+    if (pacer_dead())
+        return -1;
+    STORE(*pending, 1);
+    watchdog_start(&w, &sh->heartbeat);
+    while (LOAD(*pending)) {
+        sched_yield();
+        if (watchdog_stale(&w, &sh->heartbeat)) {
+            pacer_bury(&w);
+            STORE(*pending, 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_loop(void *arg)
+{
+    struct worker *wk = arg;
+    uint64_t t0, t1;
+    uint32_t epoch;
+
+    while (!LOAD(stop)) {
+        epoch = LOAD(sh->epoch);
+        if (epoch != wk->epoch) {       /* justitia_flow_reattach on the next post */
+            STORE(wk->epoch, epoch);
+            STORE(wk->joined_ns, watchdog_now_ns());
+        }
+        t0 = watchdog_now_ns();
+        if (wait_token(&sh->pending[wk->slot * STRIDE])) {
+            t1 = watchdog_now_ns();
+            if (!LOAD(wk->first_unpaced_ns))
+                STORE(wk->first_unpaced_ns, t1);
+            __atomic_fetch_add(&wk->unpaced, 1, __ATOMIC_RELAXED);
+            sched_yield();
+        } else {
+            t1 = watchdog_now_ns();
+            __atomic_fetch_add(&wk->paced, 1, __ATOMIC_RELAXED);
+        }
+        if (t1 - t0 > LOAD(wk->max_wait_ns))
+            STORE(wk->max_wait_ns, t1 - t0);
+    }
+    return NULL;
+}
+
+static void reset_phase(void)
+{
+    int i;
+
+    for (i = 0; i < num_workers; i++) {
+        STORE(workers[i].max_wait_ns, 0);
+        STORE(workers[i].first_unpaced_ns, 0);
+    }
+}
+
+static uint64_t sum(int unpaced)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < num_workers; i++)
+        n += unpaced ? LOAD(workers[i].unpaced) : LOAD(workers[i].paced);
+    return n;
+}
+
+static uint64_t max_wait(void)
+{
+    uint64_t m = 0;
+    int i;
+
+    for (i = 0; i < num_workers; i++)
+        if (LOAD(workers[i].max_wait_ns) > m)
+            m = LOAD(workers[i].max_wait_ns);
+    return m;
+}
+
+static void sleep_ms(unsigned ms)
+{
+    usleep(ms * 1000);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t t, paced, unpaced, stall, join_ns;
+    uint32_t epoch;
+    pid_t pacer;
+    int i;
+
+    if (argc > 1)
+        num_workers = atoi(argv[1]);
+    if (num_workers < 1 || num_workers > MAX_WORKERS)
+        return 2;
+    sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sh == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    memset(sh, 0, sizeof(*sh));
+
+    pacer = start_pacer();
+    for (i = 0; i < num_workers; i++) {
+        workers[i].slot = i;
+        if (pthread_create(&workers[i].th, NULL, worker_loop, &workers[i])) {
+            perror("pthread_create");
+            return 2;
+        }
+    }
+
+    /* a live pacer: everything is paced */
+    sleep_ms(100);
+    CHECK(sum(1) == 0, "%llu unpaced sends with a live pacer", (unsigned long long)sum(1));
+    for (i = 0; i < num_workers; i++)
+        CHECK(LOAD(workers[i].paced) > 0, "worker %d got no token", i);
+
+    /* killed under load: no send stalls longer than the stale period, then none waits */
+    reset_phase();
+    paced = sum(0);
+    t = watchdog_now_ns();
+    kill(pacer, SIGKILL);
+    waitpid(pacer, NULL, 0);
+    sleep_ms(WATCHDOG_STALE_NS / MS + 100);
+    stall = 0;
+    for (i = 0; i < num_workers; i++) {
+        uint64_t first = LOAD(workers[i].first_unpaced_ns);
+        CHECK(first, "worker %d still waits for a dead pacer", i);
+        if (first && first - t > stall)
+            stall = first - t;
+    }
+    CHECK(stall <= WATCHDOG_STALE_NS + MARGIN_NS, "sends stalled %.1f ms after the pacer died", stall / 1e6);
+    CHECK(max_wait() <= WATCHDOG_STALE_NS + MARGIN_NS, "a wait took %.1f ms", max_wait() / 1e6);
+    CHECK(sum(0) - paced <= (uint64_t)num_workers, "%llu tokens from a dead pacer",
+          (unsigned long long)(sum(0) - paced));
+    printf("pacer killed: sends unpaced after %.1f ms at most (stale period %.0f ms)\n",
+           stall / 1e6, WATCHDOG_STALE_NS / 1e6);
+    reset_phase();
+    unpaced = sum(1);
+    sleep_ms(50);
+    CHECK(sum(1) > unpaced, "no sends while the pacer is dead");
+    CHECK(max_wait() <= INSTANT_NS, "a wait for a dead pacer took %.1f ms", max_wait() / 1e6);
+
+    /* a new pacer: every worker joins it and is paced again */
+    t = watchdog_now_ns();
+    pacer = start_pacer();
+    epoch = LOAD(sh->epoch);
+    sleep_ms(100);
+    join_ns = 0;
+    for (i = 0; i < num_workers; i++) {
+        CHECK(LOAD(workers[i].epoch) == epoch, "worker %d did not join epoch %u", i, epoch);
+        if (LOAD(workers[i].joined_ns) - t > join_ns)
+            join_ns = LOAD(workers[i].joined_ns) - t;
+    }
+    paced = sum(0);
+    unpaced = sum(1);
+    sleep_ms(50);
+    CHECK(sum(0) > paced, "no tokens from the new pacer");
+    CHECK(sum(1) == unpaced, "%llu unpaced sends with the new pacer", (unsigned long long)(sum(1) - unpaced));
+    printf("pacer restarted: epoch %u joined by all %d workers within %.2f ms\n", epoch, num_workers, join_ns / 1e6);
+
+    /* stopped for less than the stale period: no one gives up on it */
+    unpaced = sum(1);
+    kill(pacer, SIGSTOP);
+    sleep_ms(WATCHDOG_STALE_NS / MS / 5);
+    kill(pacer, SIGCONT);
+    sleep_ms(20);
+    CHECK(sum(1) == unpaced, "gave up on a pacer stopped for %llu ms", WATCHDOG_STALE_NS / MS / 5);
+
+    /* stopped for longer: unpaced until it beats again, no new epoch needed */
+    reset_phase();
+    unpaced = sum(1);
+    kill(pacer, SIGSTOP);
+    sleep_ms(WATCHDOG_STALE_NS / MS * 3);
+    CHECK(sum(1) > unpaced, "waited on a pacer stopped for %llu ms", WATCHDOG_STALE_NS / MS * 3);
+    CHECK(max_wait() <= WATCHDOG_STALE_NS + MARGIN_NS, "a wait took %.1f ms", max_wait() / 1e6);
+    kill(pacer, SIGCONT);
+    sleep_ms(20);
+    paced = sum(0);
+    unpaced = sum(1);
+    sleep_ms(50);
+    CHECK(sum(0) > paced, "no tokens once the pacer beats again");
+    CHECK(sum(1) == unpaced, "%llu unpaced sends once the pacer beats again", (unsigned long long)(sum(1) - unpaced));
+    CHECK(LOAD(sh->epoch) == epoch, "epoch changed without a new pacer");
+
+    STORE(stop, 1);
+    kill(pacer, SIGKILL);
+    waitpid(pacer, NULL, 0);
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i].th, NULL);
+
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("watchdog_test: passed (%d workers)\n", num_workers);
+    return 0;
+}